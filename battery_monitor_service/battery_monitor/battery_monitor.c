@@ -22,12 +22,24 @@
 #define CELL_DIS		2.70 // Threshold for detecting disconnected battery
 #define V_CHG_DETECT  	4.15 // above this assume finished charging
 
-// filter
-#define LOOP_SLEEP_US 		300000 	// 2hz sample
-#define FITLER_SAMPLES 		6		// average over 6 samples, 3 seconds
+// adaptive sample rate
+#define SLOW_HZ				1.0			// voltages steady
+#define LED_HZ				(1.0/0.3)	// 300ms steps for charging/low animation
+#define FAST_HZ				10.0		// following a transient
+#define TRANSIENT_V			0.15	// raw sample this far from the mean
+#define FAST_SAMPLES		20		// stay fast this many samples after one
+
+// filter, the window is sized for the steady rate. A plug or unplug is a
+// transient, and at FAST_HZ the same window spans a tenth of the time so
+// detection follows within a few hundred ms.
+#define FILTER_S			3.0		// seconds averaged while steady
+#define FILTER_MIN_SAMPLES	3		// enough for a meaningful stddev
+#define FILTER_SAMPLES		((int)(FILTER_S*SLOW_HZ)>FILTER_MIN_SAMPLES ? \
+						(int)(FILTER_S*SLOW_HZ) : FILTER_MIN_SAMPLES)
 #define STD_DEV_TOLERANCE 	0.04 	// above 0.1 definitely charging
 
 // functions
+int read_voltages(float* pack, float* jack);
 void illuminate_leds(int i);
 int kill_existing_instance();
 void shutdown_signal_handler(int signo);
@@ -43,17 +55,24 @@ int running;
 int main(int argc, char *argv[]){
 	FILE* fd;
 	float v_pack;	// 2S pack voltage on JST XH 2S balance connector
+	float raw_pack;	// unfiltered v_pack
 	float v_jack;	// could be dc power supply or another battery
 	float cell_voltage;	// cell voltage from either 2S or external pack
+	float raw_jack;	// unfiltered v_jack
+	float hz, loop_hz;
 	int toggle = 0;
 	int printing = 0;
 	int num_cells = 0;
 	int chg_leds = 0;
 	int charging = 0;
 	int pack_connected = 0;
+	int animating = 0;
+	int fast_left = 0;
 	int c, i;
-	float stddev;
-	d_filter_t filterB, filterJ; // battery and jack filters
+	float stddev = 0;
+	uint64_t now_us, last_anim_us = 0;
+	loop_timer_t timer;
+	battery_status_t status;
 
 	// parse arguments to check for kill mode
 	opterr = 0;
@@ -110,18 +129,18 @@ int main(int argc, char *argv[]){
 	initialize_mmap_adc();
 	initialize_mmap_gpio();
 
-	// start filters
-	v_pack = get_battery_voltage();
-	filterB = create_moving_average(FITLER_SAMPLES);
-	prefill_filter_outputs(&filterB, v_pack);
-	prefill_filter_inputs(&filterB, v_pack);
-	v_jack = get_dc_jack_voltage();
-	filterJ = create_moving_average(FITLER_SAMPLES);
-	prefill_filter_outputs(&filterJ, v_jack);
-	prefill_filter_inputs(&filterJ, v_jack);
-
-	// vector for standard deviation check
-	vector_t vec = create_vector(FITLER_SAMPLES);
+	// running mean and standard deviation of recent raw voltages, the mean
+	// is the same moving average the old filters computed
+	if(read_voltages(&raw_pack, &raw_jack)<0){
+		printf("can't read ADC voltages\n");
+		return -1;
+	}
+	windowed_stats_t pack_stats = create_windowed_stats(FILTER_SAMPLES);
+	windowed_stats_t jack_stats = create_windowed_stats(FILTER_SAMPLES);
+	for(i=0; i<FILTER_SAMPLES; i++){
+		update_windowed_stats(&pack_stats, raw_pack);
+		update_windowed_stats(&jack_stats, raw_jack);
+	}
 		
 	
 	// first decide if the user has called this from a terminal
@@ -133,24 +152,31 @@ int main(int argc, char *argv[]){
 	
 	// run intil running==0 which is set by signal handler
 	running = 1;
+	loop_hz = SLOW_HZ;
+	init_loop_timer(&timer, loop_hz);
 	while(running){
 		charging = 0;
-		// read in the voltage of the 2S pack and DC jack
-		v_pack = march_filter(&filterB, get_battery_voltage());
-		v_jack = march_filter(&filterJ, get_dc_jack_voltage());
-
-		if(v_pack==-1 || v_jack==-1){
+		// read in the voltage of the 2S pack and DC jack in one adc scan
+		if(read_voltages(&raw_pack, &raw_jack)<0){
 			printf("can't read ADC voltages\n");
 			return -1;
 		}
 		
+		// a jump away from the recent mean means something was plugged,
+		// unplugged or loaded, so sample fast for a while
+		if(fabs(raw_pack-windowed_stats_mean(&pack_stats))>TRANSIENT_V || \
+			fabs(raw_jack-windowed_stats_mean(&jack_stats))>TRANSIENT_V){
+			fast_left = FAST_SAMPLES;
+		}
+		update_windowed_stats(&pack_stats, raw_pack);
+		update_windowed_stats(&jack_stats, raw_jack);
+		v_pack = windowed_stats_mean(&pack_stats);
+		v_jack = windowed_stats_mean(&jack_stats);
+		
 		// find standard deviation of battery signal to determine
 		// if a 2S pack is connected or not
 		if(v_pack>(2*CELL_DIS)){
-			for(i=0; i<FITLER_SAMPLES; i++){
-				vec.data[i]=filterB.in_buf.data[i];
-			}
-			stddev=standard_deviation(vec);
+			stddev=windowed_stats_stddev(&pack_stats);
 			//printf("stddev: %f\n", stddev);
 		}
 
@@ -203,11 +229,28 @@ int main(int argc, char *argv[]){
 			fflush(stdout);
 		}
 
+		// publish for any other program that wants the battery state
+		status.v_pack = v_pack;
+		status.v_jack = v_jack;
+		status.cell_voltage = cell_voltage;
+		status.num_cells = num_cells;
+		status.pack_connected = pack_connected;
+		status.charging = charging;
+		status.sample_period = 1.0/loop_hz;
+		publish_battery_status(&status);
+
+		// animations step every 300ms whatever the sample rate is
+		now_us = micros_since_boot();
+		animating = 0;
 		// if charging, blink in a charging pattern
 		if(charging){
-			chg_leds += 1;
-			if(chg_leds>4) chg_leds=0;
-			illuminate_leds(chg_leds);
+			animating = 1;
+			if(now_us-last_anim_us >= 1000000/LED_HZ){
+				last_anim_us = now_us;
+				chg_leds += 1;
+				if(chg_leds>4) chg_leds=0;
+				illuminate_leds(chg_leds);
+			}
 		}
 		// illuminate LEDs properly if not charging
 		else if(num_cells==0) illuminate_leds(0);
@@ -223,17 +266,35 @@ int main(int argc, char *argv[]){
 		else if(cell_voltage>CELL_25) 	illuminate_leds(1);
 		// battery is extremely low, blink all 4
 		else{
-			if(toggle) toggle=0;
-			else toggle=4;
-			illuminate_leds(toggle);
+			animating = 1;
+			if(now_us-last_anim_us >= 1000000/LED_HZ){
+				last_anim_us = now_us;
+				if(toggle) toggle=0;
+				else toggle=4;
+				illuminate_leds(toggle);
+			}
 		}
 		
+		// slow down once things are steady, the LED animations need 300ms
+		if(fast_left>0){
+			fast_left--;
+			hz = FAST_HZ;
+		}
+		else if(animating) hz = LED_HZ;
+		else hz = SLOW_HZ;
+		if(hz!=loop_hz){
+			loop_hz = hz;
+			init_loop_timer(&timer, loop_hz);
+		}
 
-		// sleepy time
-		usleep(LOOP_SLEEP_US);
+		// sleepy time, until the next absolute deadline
+		loop_timer_wait(&timer);
 	}
 
 	// exit
+	close_battery_status();
+	destroy_windowed_stats(&pack_stats);
+	destroy_windowed_stats(&jack_stats);
 	illuminate_leds(0);
 	printf("battery_monitor exiting cleanly\n");
 	remove(PID_FILE);
@@ -241,6 +302,23 @@ int main(int argc, char *argv[]){
 }
 
 
+/*******************************************************************************
+* int read_voltages(float* pack, float* jack)
+*
+* Both dividers from a single scan of the adc, converted the same way as
+* get_battery_voltage and get_dc_jack_voltage which each run their own
+* conversion.
+*******************************************************************************/
+int read_voltages(float* pack, float* jack){
+	float v[8];
+	if(get_adc_volt_all(v)<0) return -1;
+	*pack = (v[LIPO_ADC_CH]*V_DIV_RATIO)+LIPO_OFFSET;
+	*jack = (v[DC_JACK_ADC_CH]*V_DIV_RATIO)+DC_JACK_OFFSET;
+	if(*pack<0.3) *pack = 0.0;
+	if(*jack<0.3) *jack = 0.0;
+	return 0;
+}
+
 /*******************************************************************************
 * shutdown_signal_handler(int signo)
 *
@@ -137,7 +137,8 @@ int main(){
 	
 	// start a thread to slowly sample battery 
 	pthread_t  battery_thread;
-	pthread_create(&battery_thread, NULL, battery_checker, (void*) NULL);
+	create_rt_thread(&battery_thread, RT_SERVICE_APP, battery_checker, \
+																(void*) NULL);
 	// wait for the battery thread to make the first read
 	while(cstate.vBatt==0 && get_state()!=EXITING) usleep(1000);
 	
@@ -145,7 +146,8 @@ int main(){
 	// if it was started as a background process then don't bother
 	if(isatty(fileno(stdout))){
 		pthread_t  printf_thread;
-		pthread_create(&printf_thread, NULL, printf_loop, (void*) NULL);
+		create_rt_thread(&printf_thread, RT_SERVICE_APP, printf_loop, \
+																(void*) NULL);
 	}
 	
 	// set up IMU configuration
@@ -162,7 +164,8 @@ int main(){
 	
 	// start balance stack to control setpoints
 	pthread_t  setpoint_thread;
-	pthread_create(&setpoint_thread, NULL, setpoint_manager, (void*) NULL);
+	create_rt_thread(&setpoint_thread, RT_SERVICE_APP, setpoint_manager, \
+																(void*) NULL);
 
 	// this should be the last step in initialization 
 	// to make sure other setup functions don't interfere
@@ -175,7 +178,7 @@ int main(){
 	
 	// chill until something exits the program
 	while(get_state()!=EXITING){
-		usleep(10000);
+		wait_for_state_change(get_state(), 0);
 	}
 	
 	// cleanup
@@ -194,6 +197,7 @@ int main(){
 *******************************************************************************/
 void* setpoint_manager(void* ptr){
 	float drive_stick, turn_stick; // dsm input sticks
+	loop_timer_t timer;
 
 	// wait for IMU to settle
 	disarm_controller();
@@ -204,9 +208,10 @@ void* setpoint_manager(void* ptr){
 	set_led(RED,0);
 	set_led(GREEN,1);
 	
+	init_loop_timer(&timer, SETPOINT_MANAGER_HZ);
 	while(get_state()!=EXITING){
 		// sleep at beginning of loop so we can use the 'continue' statement
-		usleep(1000000/SETPOINT_MANAGER_HZ); 
+		loop_timer_wait(&timer);
 		
 		// nothing to do if paused, go back to beginning of loop
 		if(get_state() != RUNNING) continue;
@@ -450,12 +455,14 @@ int wait_for_starting_condition(){
 *******************************************************************************/
 void* battery_checker(void* ptr){
 	float new_v;
+	loop_timer_t timer;
+	init_loop_timer(&timer, BATTERY_CHECK_HZ);
 	while(get_state()!=EXITING){
 		new_v = get_battery_voltage();
 		// if the value doesn't make sense, use nominal voltage
 		if (new_v>9.0 || new_v<5.0) new_v = V_NOMINAL;
 		cstate.vBatt = new_v;
-		usleep(1000000 / BATTERY_CHECK_HZ);
+		loop_timer_wait(&timer);
 	}
 	return NULL;
 }
@@ -468,6 +475,8 @@ void* battery_checker(void* ptr){
 *******************************************************************************/
 void* printf_loop(void* ptr){
 	state_t last_state, new_state; // keep track of last state 
+	loop_timer_t timer;
+	init_loop_timer(&timer, PRINTF_HZ);
 	while(get_state()!=EXITING){
 		new_state = get_state();
 		// check if this is the first time since being paused
@@ -505,7 +514,7 @@ void* printf_loop(void* ptr){
 			else printf("DISARMED |");
 			fflush(stdout);
 		}
-		usleep(1000000 / PRINTF_HZ);
+		loop_timer_wait(&timer);
 	}
 	return NULL;
 } 
@@ -570,6 +579,6 @@ int on_mode_release(){
 		printf("using drive_mode = NOVICE\n");
 	}
 	
-	blink_led(GREEN,5,1);
+	start_led_blink(GREEN,5,1);
 	return 0;
 }
@@ -0,0 +1,366 @@
+/*******************************************************************************
+* benchmark_suite.c
+*
+* Times the library's hot paths in nanoseconds per operation: filter steps by
+* order, matrix multiply/invert/solve by size, quaternion math, and with -H the
+* mmap gpio and adc accesses, IMU register reads over i2c and the full DMP
+* FIFO read done by the interrupt handler. Use -c for comma separated output
+* that can be diffed between library versions or CPU frequency settings.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+#define DEFAULT_REPS	100000
+#define BENCH_GPIO		67		// green LED, gpio2.3
+#define BENCH_ADC_CH	0
+#define BENCH_IMU_BUS	2
+#define BENCH_IMU_ADDR	0x68
+#define BENCH_IMU_WHOAMI 0x75
+#define DMP_BENCH_RATE	200
+#define DMP_BENCH_SECS	5
+
+// Global Variables
+int csv = 0;
+int reps = DEFAULT_REPS;
+volatile float sink;	// results go here so loops aren't optimized away
+
+// local functions
+void print_usage();
+void report(const char* group, const char* name, int param, int ops, \
+															uint64_t ns);
+int bench_filters();
+int bench_linear_algebra();
+int bench_quaternions();
+int bench_gpio_adc();
+int bench_i2c();
+int bench_dmp();
+
+/*******************************************************************************
+* void print_usage()
+*******************************************************************************/
+void print_usage(){
+	printf("\n Options\n");
+	printf("-r {reps}	Repetitions of each fast operation (default %d)\n", \
+															DEFAULT_REPS);
+	printf("-c		Comma separated output: group,name,param,ops,ns_per_op\n");
+	printf("-H		Also benchmark hardware, needs root and a cape\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+/*******************************************************************************
+* void report(const char* group, const char* name, int param, int ops,
+*																uint64_t ns)
+*
+* Prints one result. param is the filter order or matrix size, 0 if none.
+*******************************************************************************/
+void report(const char* group, const char* name, int param, int ops, \
+															uint64_t ns){
+	double per_op = ops>0 ? (double)ns/ops : 0.0;
+	if(csv) printf("%s,%s,%d,%d,%.1f\n", group, name, param, ops, per_op);
+	else printf("%-8s %-26s %4d %10d %12.1f\n", group, name, param, ops, per_op);
+	fflush(stdout);
+}
+
+/*******************************************************************************
+* int bench_filters()
+*
+* march_filter on butterworth lowpass filters of increasing order, and the
+* biquad cascade of the same order for comparison.
+*******************************************************************************/
+int bench_filters(){
+	d_filter_t f;
+	biquad_filter_t bq;
+	uint64_t start;
+	int order, i;
+	const float dt = 0.005;
+	const float wc = 2*PI*10;
+
+	for(order=1;order<=6;order++){
+		f = create_butterworth_lowpass(order, dt, wc);
+		start = nanos_since_boot();
+		for(i=0;i<reps;i++) sink = march_filter(&f, (float)(i&1));
+		report("filter", "march_filter", order, reps, \
+										nanos_since_boot()-start);
+		destroy_filter(&f);
+	}
+	for(order=2;order<=6;order+=2){
+		bq = create_butterworth_lowpass_biquad(order, dt, wc);
+		start = nanos_since_boot();
+		for(i=0;i<reps;i++) sink = march_biquad_filter(&bq, (float)(i&1));
+		report("filter", "march_biquad_filter", order, reps, \
+										nanos_since_boot()-start);
+		destroy_biquad_filter(&bq);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int bench_linear_algebra()
+*
+* The allocating matrix functions as a control loop would call them, so the
+* times include creating and destroying the results.
+*******************************************************************************/
+int bench_linear_algebra(){
+	const int sizes[] = {3, 4, 6, 10, 20};
+	matrix_t A, B, C;
+	vector_t b, x;
+	uint64_t start;
+	int s, n, i, ops;
+
+	for(s=0;s<(int)(sizeof(sizes)/sizeof(sizes[0]));s++){
+		n = sizes[s];
+		// keep the slow sizes from taking minutes
+		ops = reps/(n*n);
+		if(ops<10) ops = 10;
+		A = create_random_matrix(n, n);
+		B = create_random_matrix(n, n);
+		b = create_random_vector(n);
+		// diagonally dominant so invert and solve never hit a singular A
+		for(i=0;i<n;i++) A.data[i][i] += n;
+
+		start = nanos_since_boot();
+		for(i=0;i<ops;i++){
+			C = multiply_matrices(A, B);
+			sink = C.data[0][0];
+			destroy_matrix(&C);
+		}
+		report("matrix", "multiply_matrices", n, ops, nanos_since_boot()-start);
+
+		start = nanos_since_boot();
+		for(i=0;i<ops;i++){
+			C = invert_matrix(A);
+			sink = C.data[0][0];
+			destroy_matrix(&C);
+		}
+		report("matrix", "invert_matrix", n, ops, nanos_since_boot()-start);
+
+		start = nanos_since_boot();
+		for(i=0;i<ops;i++){
+			x = lin_system_solve(A, b);
+			sink = x.data[0];
+			destroy_vector(&x);
+		}
+		report("matrix", "lin_system_solve", n, ops, nanos_since_boot()-start);
+
+		destroy_matrix(&A);
+		destroy_matrix(&B);
+		destroy_vector(&b);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int bench_quaternions()
+*******************************************************************************/
+int bench_quaternions(){
+	float q[4] = {0.9f, 0.1f, 0.3f, 0.2f};
+	float r[4] = {0.7f, -0.2f, 0.1f, 0.6f};
+	float out[4], tb[3], v[3] = {1.0f, 2.0f, 3.0f};
+	uint64_t start;
+	int i;
+
+	normalizeQuaternion(q);
+	normalizeQuaternion(r);
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++){
+		quaternionMultiply(q, r, out);
+		sink = out[0];
+	}
+	report("quat", "quaternionMultiply", 0, reps, nanos_since_boot()-start);
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++){
+		quaternionRotateVector(q, v, out);
+		sink = out[0];
+	}
+	report("quat", "quaternionRotateVector", 0, reps, nanos_since_boot()-start);
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++){
+		out[0]=q[0]*1.001f; out[1]=q[1]; out[2]=q[2]; out[3]=q[3];
+		normalizeQuaternion(out);
+		sink = out[0];
+	}
+	report("quat", "normalizeQuaternion", 0, reps, nanos_since_boot()-start);
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++){
+		out[0]=q[0]*1.001f; out[1]=q[1]; out[2]=q[2]; out[3]=q[3];
+		normalizeQuaternionFast(out);
+		sink = out[0];
+	}
+	report("quat", "normalizeQuaternionFast", 0, reps, nanos_since_boot()-start);
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++){
+		quaternionToTaitBryan(q, tb);
+		sink = tb[0];
+	}
+	report("quat", "quaternionToTaitBryan", 0, reps, nanos_since_boot()-start);
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++){
+		quaternionToTaitBryanFast(q, tb);
+		sink = tb[0];
+	}
+	report("quat", "quaternionToTaitBryanFast", 0, reps, \
+												nanos_since_boot()-start);
+	return 0;
+}
+
+/*******************************************************************************
+* int bench_gpio_adc()
+*
+* Register level gpio writes and adc reads, initialize_cape has already set
+* up both memory maps.
+*******************************************************************************/
+int bench_gpio_adc(){
+	mmap_gpio_pin_t pin;
+	uint64_t start;
+	int i, adc_ops;
+
+	start = nanos_since_boot();
+	for(i=0;i<reps;i++) mmap_gpio_write(BENCH_GPIO, i&1);
+	report("io", "mmap_gpio_write", 0, reps, nanos_since_boot()-start);
+
+	if(mmap_gpio_pin_init(&pin, BENCH_GPIO)==0){
+		start = nanos_since_boot();
+		for(i=0;i<reps;i++) mmap_gpio_pin_write(&pin, i&1);
+		report("io", "mmap_gpio_pin_write", 0, reps, nanos_since_boot()-start);
+	}
+	mmap_gpio_write(BENCH_GPIO, 0);
+
+	// each adc read waits on a conversion, far slower than a gpio write
+	adc_ops = reps/100;
+	if(adc_ops<10) adc_ops = 10;
+	start = nanos_since_boot();
+	for(i=0;i<adc_ops;i++) sink = get_adc_raw(BENCH_ADC_CH);
+	report("io", "get_adc_raw", 0, adc_ops, nanos_since_boot()-start);
+	return 0;
+}
+
+/*******************************************************************************
+* int bench_i2c()
+*
+* Single and 14 byte register reads from the IMU, the size of one accel, temp
+* and gyro burst.
+*******************************************************************************/
+int bench_i2c(){
+	uint8_t buf[14];
+	uint64_t start;
+	int i, ops, fails = 0;
+
+	if(i2c_init(BENCH_IMU_BUS, BENCH_IMU_ADDR)<0){
+		printf("ERROR: failed to initialize i2c bus %d\n", BENCH_IMU_BUS);
+		return -1;
+	}
+	ops = reps/100;
+	if(ops<10) ops = 10;
+	start = nanos_since_boot();
+	for(i=0;i<ops;i++){
+		if(i2c_read_byte(BENCH_IMU_BUS, BENCH_IMU_WHOAMI, buf)<0) fails++;
+	}
+	report("i2c", "i2c_read_byte", 1, ops, nanos_since_boot()-start);
+
+	start = nanos_since_boot();
+	for(i=0;i<ops;i++){
+		if(i2c_read_bytes(BENCH_IMU_BUS, 0x3B, 14, buf)<0) fails++;
+	}
+	report("i2c", "i2c_read_bytes", 14, ops, nanos_since_boot()-start);
+	if(fails) printf("WARNING: %d i2c reads failed\n", fails);
+	return 0;
+}
+
+/*******************************************************************************
+* int bench_dmp()
+*
+* Runs the DMP for a few seconds and reports the interrupt handler's own
+* timing, so the read path is measured exactly as it runs in a robot. Rows are
+* named after the IMU_TIMING_* channels they report.
+*******************************************************************************/
+int bench_dmp(){
+	imu_data_t data;
+	imu_config_t conf = get_default_imu_config();
+	imu_timing_stats_t stats;
+	imu_timing_hist_t* h;
+	int i;
+	const char* names[IMU_TIMING_CHANNELS] = \
+			{"period", "wake", "read", "fusion", "callback", \
+			"total"};
+
+	conf.dmp_sample_rate = DMP_BENCH_RATE;
+	if(initialize_imu_dmp(&data, conf)<0){
+		printf("ERROR: failed to initialize DMP\n");
+		return -1;
+	}
+	sleep(DMP_BENCH_SECS);
+	get_imu_timing_stats(&stats);
+	power_off_imu();
+
+	for(i=0;i<IMU_TIMING_CHANNELS;i++){
+		h = &stats.channel[i];
+		if(h->count==0) continue;
+		report("dmp", names[i], DMP_BENCH_RATE, (int)h->count, h->sum_us*1000);
+	}
+	if(!csv){
+		printf("dmp      overruns %llu of %llu samples\n", \
+				(unsigned long long)stats.overruns, \
+				(unsigned long long)stats.channel[IMU_TIMING_TOTAL].count);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int main(int argc, char *argv[])
+*******************************************************************************/
+int main(int argc, char *argv[]){
+	int c;
+	int hardware = 0;
+
+	opterr = 0;
+	while ((c = getopt(argc, argv, "r:cHh")) != -1){
+		switch (c){
+		case 'r':
+			reps = atoi(optarg);
+			if(reps<1){
+				printf("reps must be at least 1\n");
+				return -1;
+			}
+			break;
+		case 'c':
+			csv = 1;
+			break;
+		case 'H':
+			hardware = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+
+	if(hardware && initialize_cape()<0){
+		printf("ERROR: failed to initialize cape\n");
+		return -1;
+	}
+
+	if(csv) printf("group,name,param,ops,ns_per_op\n");
+	else printf("group    name                      param        ops    ns/op\n");
+
+	bench_filters();
+	bench_quaternions();
+	bench_linear_algebra();
+	if(hardware){
+		bench_gpio_adc();
+		bench_i2c();
+		bench_dmp();
+		cleanup_cape();
+	}
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+* calibrate_imu_temp.c
+*
+* This program exists as an interface to calibrate_imu_temp_routine which
+* records how the gyro and accelerometer biases change as the IMU warms up.
+* Start it with the BeagleBone cold, ideally right after power on, and leave
+* it still until it finishes.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+#define MAX_MINUTES 30
+
+int main(){
+	if(initialize_cape()<0){
+		printf("Failed to initialize cape, exiting\n");
+		return -1;
+	}
+
+	printf("\nThis program will generate a new imu temperature calibration\n");
+	printf("file. Run it from cold and keep your beaglebone very still while\n");
+	printf("it warms up, this takes up to %d minutes.\n", MAX_MINUTES);
+	printf("Press ENTER to continue or anything else to quit\n");
+	if(continue_or_quit()<1){
+		cleanup_cape();
+		return -1;
+	}
+
+	printf("Starting calibration routine, ctrl-c to finish early\n");
+	if(calibrate_imu_temp_routine(MAX_MINUTES)<0){
+		printf("Failed to complete imu temperature calibration\n");
+		cleanup_cape();
+		return -1;
+	}
+
+	printf("\nimu temperature calibration file written\n");
+	printf("set temp_compensation in the imu config to use it\n");
+
+	cleanup_cape();
+	return 0;
+}
@@ -15,8 +15,8 @@ int main(){
 	float cell_voltage;	// cell voltage
 	float jack_voltage;	// could be dc power supply or another battery
 
-	if(initialize_cape()){
-		printf("ERROR: failed to initialize_cape()\n");
+	if(initialize_cape_subsystems(CAPE_ADC)){
+		printf("ERROR: failed to initialize_cape_subsystems()\n");
 		return -1;
 	}
 	
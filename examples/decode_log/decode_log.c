@@ -0,0 +1,142 @@
+/*******************************************************************************
+* decode_log.c
+*
+* Prints a binary log written by start_logger as comma separated text, one
+* line per record starting with the record type, sequence number and
+* timestamp. User record types are printed as hex bytes.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+// local functions
+void print_usage();
+void print_record(log_record_header_t* hdr, uint8_t* payload);
+
+/*******************************************************************************
+* void print_usage()
+*******************************************************************************/
+void print_usage(){
+	printf("\n Usage: decode_log [-t type] logfile\n");
+	printf("-t {type}	Only print records of this type number\n");
+	printf("		1 imu, 2 motor, 3 dsm, 4 encoder, 5 adc, 6 battery\n");
+	printf("-s		Print only a count of each record type\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+/*******************************************************************************
+* void print_record(log_record_header_t* hdr, uint8_t* payload)
+*******************************************************************************/
+void print_record(log_record_header_t* hdr, uint8_t* payload){
+	log_imu_record_t* imu;
+	log_motor_record_t* mot;
+	log_dsm_record_t* dsm;
+	log_encoder_record_t* enc;
+	log_adc_record_t* adc;
+	log_battery_record_t* bat;
+	int i;
+
+	printf("%u,%u,%llu", hdr->type, hdr->seq, \
+							(unsigned long long)hdr->timestamp_micros);
+	switch(hdr->type){
+	case LOG_RECORD_IMU:
+		imu = (log_imu_record_t*)payload;
+		for(i=0;i<3;i++) printf(",%f", imu->accel[i]);
+		for(i=0;i<3;i++) printf(",%f", imu->gyro[i]);
+		for(i=0;i<3;i++) printf(",%f", imu->mag[i]);
+		printf(",%f", imu->temp);
+		for(i=0;i<4;i++) printf(",%f", imu->dmp_quat[i]);
+		for(i=0;i<3;i++) printf(",%f", imu->dmp_TaitBryan[i]);
+		for(i=0;i<4;i++) printf(",%f", imu->fused_quat[i]);
+		for(i=0;i<3;i++) printf(",%f", imu->fused_TaitBryan[i]);
+		printf(",%f,%f", imu->compass_heading, imu->compass_heading_raw);
+		break;
+	case LOG_RECORD_MOTOR:
+		mot = (log_motor_record_t*)payload;
+		printf(",0x%x", mot->mask);
+		for(i=0;i<4;i++) printf(",%f", mot->duty[i]);
+		break;
+	case LOG_RECORD_DSM:
+		dsm = (log_dsm_record_t*)payload;
+		printf(",%u,%d,%d", dsm->frame_count, dsm->num_channels, \
+														dsm->resolution);
+		for(i=0;i<DSM_MAX_CHANNELS;i++) printf(",%d", dsm->raw[i]);
+		for(i=0;i<DSM_MAX_CHANNELS;i++) printf(",%f", dsm->normalized[i]);
+		break;
+	case LOG_RECORD_ENCODER:
+		enc = (log_encoder_record_t*)payload;
+		for(i=0;i<4;i++) printf(",%d", enc->pos[i]);
+		break;
+	case LOG_RECORD_ADC:
+		adc = (log_adc_record_t*)payload;
+		for(i=0;i<8;i++) printf(",%d", adc->raw[i]);
+		break;
+	case LOG_RECORD_BATTERY:
+		bat = (log_battery_record_t*)payload;
+		printf(",%f,%f,%f,%d,%d,%d", bat->v_pack, bat->v_jack, \
+				bat->cell_voltage, bat->num_cells, bat->pack_connected, \
+				bat->charging);
+		break;
+	default:
+		printf(",");
+		for(i=0;i<hdr->length;i++) printf("%02x", payload[i]);
+		break;
+	}
+	printf("\n");
+}
+
+/*******************************************************************************
+* int main(int argc, char *argv[])
+*******************************************************************************/
+int main(int argc, char *argv[]){
+	log_reader_t reader;
+	log_record_header_t hdr;
+	uint8_t payload[LOG_MAX_PAYLOAD];
+	uint64_t counts[256];
+	int c, ret, i;
+	int type = -1;
+	int summary = 0;
+
+	opterr = 0;
+	while ((c = getopt(argc, argv, "t:sh")) != -1){
+		switch (c){
+		case 't':
+			type = atoi(optarg);
+			break;
+		case 's':
+			summary = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+	if(optind>=argc){
+		print_usage();
+		return -1;
+	}
+	if(open_log_reader(&reader, argv[optind])<0) return -1;
+
+	memset(counts, 0, sizeof(counts));
+	while((ret=read_log_record(&reader, &hdr, payload, sizeof(payload)))>0){
+		counts[hdr.type&0xff]++;
+		if(summary) continue;
+		if(type>=0 && hdr.type!=type) continue;
+		print_record(&hdr, payload);
+	}
+	if(ret<0) printf("WARNING: log ends with a truncated record\n");
+
+	if(summary){
+		printf("%llu records\n", (unsigned long long)reader.records);
+		for(i=0;i<256;i++){
+			if(counts[i]) printf("type %3d: %llu\n", i, \
+										(unsigned long long)counts[i]);
+		}
+	}
+	close_log_reader(&reader);
+	return 0;
+}
@@ -4,6 +4,9 @@
 * James Strawson 2016
 * This sends all dsm2 data straight out the servo channels as they come in.
 * When running this program the BBB acts exactly like a normal DSM2 receiver.
+* The forwarding is done by the library's DSM thread with the passthrough
+* functions so this program only has to print. Channels stop pulsing if the
+* radio is lost for FAILSAFE_MS.
 *
 * You must specify SERVO or ESC mode with -s or -e to turn om or off the 6V
 * power rail. Sending 6V into an ESC may damage it!!!
@@ -14,6 +17,8 @@
 #include "../../libraries/roboticscape-usefulincludes.h"
 #include "../../libraries/roboticscape.h"
 
+#define FAILSAFE_MS	100
+
 typedef enum p_mode_t{
 	NONE,
 	POWERON,
@@ -21,12 +26,9 @@ typedef enum p_mode_t{
 } p_mode_t;
 
 // function to be called every time new a new DSM2 packet is received.
-int send_pulses(){
+// the servos have already been sent their pulses by then
+int print_channels(){
 	int i, ch;
-	// send single pulse to each servo
-	for(i=0; i<8; i++){
-		send_servo_pulse_us(i+1,get_dsm_ch_raw(i+1));
-	}
 
 	//print all channels
 	printf("\r");
@@ -51,7 +53,7 @@ void print_usage(){
 			
 
 int main(int argc, char *argv[]){
-	int ms,c;
+	int i,ms,c;
 	p_mode_t mode = NONE;
 	
 	// parse arguments
@@ -113,7 +115,10 @@ int main(int argc, char *argv[]){
 	printf("Waiting for DSM Connection");
 	fflush(stdout);
 	
-	set_new_dsm_data_func(&send_pulses);
+	// forward channels 1-8 unchanged, stopping them on signal loss
+	for(i=1;i<=8;i++) set_dsm_passthrough(i, i, 1.0, 0);
+	enable_dsm_passthrough(FAILSAFE_MS);
+	set_new_dsm_data_func(&print_channels);
 	while(get_state()!=EXITING){
 		ms = ms_since_last_dsm_packet();
 		if(ms>500){	
@@ -0,0 +1,72 @@
+/*******************************************************************************
+* show_metrics.c
+*
+* Prints the metrics another robotics cape program exports with
+* start_metrics_export, the way a monitoring agent would read them. The
+* program being watched is not stopped or slowed down.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+// local functions
+void print_usage();
+
+/*******************************************************************************
+* void print_usage()
+*******************************************************************************/
+void print_usage(){
+	printf("\n Usage: show_metrics [-w secs] pid\n");
+	printf("-w {secs}	Print again every secs seconds until killed\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+/*******************************************************************************
+* int main()
+*******************************************************************************/
+int main(int argc, char *argv[]){
+	metric_value_t m[METRICS_MAX];
+	int c, i, n, pid, watch = 0;
+
+	opterr = 0;
+	while((c=getopt(argc, argv, "w:h"))!=-1){
+		switch(c){
+		case 'w':
+			watch = atoi(optarg);
+			if(watch<1){
+				printf("interval must be at least 1 second\n");
+				return -1;
+			}
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+	if(optind!=argc-1){
+		print_usage();
+		return -1;
+	}
+	pid = atoi(argv[optind]);
+
+	while(1){
+		n = read_process_metrics(pid, m, METRICS_MAX);
+		if(n<0){
+			printf("process %d doesn't export metrics\n", pid);
+			return -1;
+		}
+		for(i=0;i<n;i++){
+			printf("%-*s %s %lld\n", METRIC_NAME_LEN, m[i].name, \
+					m[i].type==METRIC_GAUGE ? "gauge  " : "counter", \
+					(long long)m[i].value);
+		}
+		if(!watch) break;
+		printf("\n");
+		sleep(watch);
+	}
+	return 0;
+}
@@ -54,7 +54,7 @@ int main(){
 	
 	//toggle leds till the program state changes
 	while(get_state()!=EXITING){
-		usleep(10000);
+		wait_for_state_change(get_state(), 0);
 	}
 	
 	cleanup_cape();
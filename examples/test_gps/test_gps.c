@@ -71,7 +71,7 @@ int main(int argc, char *argv[]){
 
 	// printf print until user exists
 	while(get_state()!=EXITING){
-		usleep(500000);
+		wait_for_state_change(get_state(), 0);
 	}
 
 	stop_gps_service();
@@ -15,6 +15,8 @@
 * 0 to 1 as opposed to the bidirectional servo range. Be sure to run the
 * calibrate_esc example first to make sure the ESCs are calibrated to the right
 * pulse range. This mode uses the send_esc_pulse_normalized() function.
+* With the -d option the throttle goes out as DShot frames instead through
+* send_dshot_normalized(), which needs no calibration.
 *
 * MICROSECONDS: You can also specify your own pulse width in microseconds (us).
 * This uses the send_servo_pulse_us() function.
@@ -54,6 +56,7 @@ void print_usage(){
 	printf("                DO NOT use power option with ESCs\n");
 	printf(" -p {position}  Drive servos to a position between -1.5 & 1.5\n");
 	printf(" -e {throttle}  Drive ESCs at normalized throttle from 0-1\n");
+	printf(" -d {rate}      Send ESC throttle as DShot150, 300 or 600\n");
 	printf(" -u {width_us}  Send pulse width in microseconds (us)\n");
 	printf(" -s {limit}     Sweep servo back/forth between +- limit\n");
 	printf("                Limit can be between 0 & 1.5\n");
@@ -71,10 +74,12 @@ int main(int argc, char *argv[]){
 	int power_en = 0; // change to 1 if user wishes to enable power rail
 	int frequency_hz = 50; // default 50hz frequency to send pulses
 	int toggle = 0;
+	int dshot = 0; // DShot rate, 0 for ESC pulses
+	float dshot_throttle[8];
 
 	// parse arguments
 	opterr = 0;
-	while ((c = getopt(argc, argv, "c:f:vp:e:u:s:h")) != -1){
+	while ((c = getopt(argc, argv, "c:f:vp:e:d:u:s:h")) != -1){
 		switch (c){
 		case 'c': // servo/esc channel option
 			ch = atoi(optarg);
@@ -123,6 +128,14 @@ int main(int argc, char *argv[]){
 			}
 			break;
 			
+		case 'd': // DShot rate option
+			dshot = atoi(optarg);
+			if(dshot!=DSHOT150 && dshot!=DSHOT300 && dshot!=DSHOT600){
+				printf("DShot rate must be 150, 300 or 600\n");
+				return -1;
+			}
+			break;
+			
 		case 'u': // width in microsecons option
 			if(mode!=DISABLED) print_usage();
 			width_us = atof(optarg);
@@ -168,6 +181,11 @@ int main(int argc, char *argv[]){
 		return -1;
 	}
 	
+	if(dshot && mode!=ESC){
+		printf("DShot option only works with ESC throttle -e\n");
+		return -1;
+	}
+	
 	// check user isn't trying to use power with ESCs
 	if(mode==ESC && power_en==1){
 		printf("can't use servo power rail when connected to ESCs\n");
@@ -186,9 +204,27 @@ int main(int argc, char *argv[]){
 		enable_servo_power_rail();
 	}
 	
+	// DShot ESCs arm once they have seen motor stop frames for a while
+	if(dshot){
+		if(set_dshot_rate(dshot)){
+			printf("ERROR: failed to start DShot\n");
+			cleanup_cape();
+			return -1;
+		}
+		for(c=0;c<8;c++){
+			dshot_throttle[c] = (all || c==ch-1) ? -0.1 : NAN;
+		}
+		for(c=0;c<frequency_hz && get_state()!=EXITING;c++){
+			send_dshot_normalized(dshot_throttle);
+			usleep(1000000/frequency_hz);
+		}
+		for(c=0;c<8;c++){
+			if(all || c==ch-1) dshot_throttle[c] = esc_throttle;
+		}
+	}
 	// if driving an ESC, send throttle of 0 first
 	// otherwise it will go into calibration mode
-	if(mode==ESC){
+	else if(mode==ESC){
 		if(all) send_esc_pulse_normalized_all(0);
 		else send_esc_pulse_normalized(ch,0);
 		usleep(50/1000000);
@@ -206,7 +242,8 @@ int main(int argc, char *argv[]){
 												servo_pos, frequency_hz);
 		break;
 	case ESC:
-		printf("Using send_esc_pulse_normalized\n");
+		if(dshot) printf("Using send_dshot_normalized at DShot%d\n", dshot);
+		else printf("Using send_esc_pulse_normalized\n");
 		printf("Normalized Signal: %f  Pulse Frequency: %d\n", \
 												esc_throttle, frequency_hz);
 		break;
@@ -236,7 +273,8 @@ int main(int argc, char *argv[]){
 			break;
 			
 		case ESC:
-			if(all) send_esc_pulse_normalized_all(esc_throttle);
+			if(dshot) send_dshot_normalized(dshot_throttle);
+			else if(all) send_esc_pulse_normalized_all(esc_throttle);
 			else send_esc_pulse_normalized(ch, esc_throttle);
 			break;
 			
@@ -277,6 +315,7 @@ int main(int argc, char *argv[]){
 		usleep(1000000/frequency_hz);
 	}
 	
+	if(dshot) set_dshot_rate(0);
 	cleanup_cape();
     return 0;
 }
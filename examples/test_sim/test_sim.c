@@ -0,0 +1,192 @@
+/*******************************************************************************
+* test_sim.c
+*
+* Balances a simulated two wheeled robot with a PD controller running in the
+* IMU interrupt function, exactly as it would on the real robot, and prints
+* how well it did. By default the run goes as fast as the host allows, so
+* many gain combinations can be tried at once from a shell loop:
+*
+*	for kp in 2 3 4 5; do ./test_sim -p $kp -d 0.3 & done; wait
+*
+* Build the library with "make SIM=1" to run this on a PC.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+#define SAMPLE_RATE_HZ	200
+#define GRAVITY			9.807	// m/s^2
+#define BODY_LENGTH		0.1		// m, axle to center of mass
+#define MOTOR_ACCEL		60.0	// body angular accel per unit duty, rad/s^2
+#define WHEEL_SPEED		40.0	// wheel rad/s at full duty with no load
+#define WHEEL_TC		0.1		// s, motor speed time constant
+#define COUNTS_PER_RAD	(352.0/(2*M_PI))
+#define FALLEN_ANGLE	0.8		// rad, the run ends past this
+
+typedef struct pendulum_t{
+	float theta;		// body pitch, rad
+	float theta_dot;
+	float phi;			// wheel angle relative to the ground, rad
+	float phi_dot;
+} pendulum_t;
+
+// local functions
+int pendulum_step(void* ctx, float dt, const sim_outputs_t* out, \
+														sim_sensors_t* in);
+int controller();
+void print_usage();
+
+imu_data_t data;
+float kp = 4.0;
+float kd = 0.3;
+double sum_sq_theta = 0;
+int samples = 0;
+
+/*******************************************************************************
+* int pendulum_step(void* ctx, float dt, const sim_outputs_t* out,
+*														sim_sensors_t* in)
+*
+* Motor torque pushes the body back the way it leans, gravity pulls it over.
+* The body pitches about the IMU's x axis.
+*******************************************************************************/
+int pendulum_step(void* ctx, float dt, const sim_outputs_t* out, \
+														sim_sensors_t* in){
+	pendulum_t* p = (pendulum_t*)ctx;
+	float u = (out->duty[0]+out->duty[1])/2.0;
+	float theta_ddot;
+
+	theta_ddot = (GRAVITY/BODY_LENGTH)*sinf(p->theta) - MOTOR_ACCEL*u;
+	p->theta_dot += theta_ddot*dt;
+	p->theta += p->theta_dot*dt;
+	p->phi_dot += (WHEEL_SPEED*u - p->phi_dot)*dt/WHEEL_TC;
+	p->phi += p->phi_dot*dt;
+
+	in->quat[QUAT_W] = cosf(p->theta/2.0);
+	in->quat[QUAT_X] = sinf(p->theta/2.0);
+	in->quat[QUAT_Y] = 0.0;
+	in->quat[QUAT_Z] = 0.0;
+	in->gyro[0] = p->theta_dot*RAD_TO_DEG;
+	in->accel[1] = GRAVITY*sinf(p->theta);
+	in->accel[2] = GRAVITY*cosf(p->theta);
+	// encoders count the wheel against the body
+	in->encoder[0] = lrintf((p->phi - p->theta)*COUNTS_PER_RAD);
+	in->encoder[1] = -in->encoder[0];
+
+	if(fabsf(p->theta)>FALLEN_ANGLE) return 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int controller()
+*
+* IMU interrupt function, runs once per sample in the sim thread
+*******************************************************************************/
+int controller(){
+	float theta = data.dmp_TaitBryan[TB_PITCH_X];
+	float theta_dot = data.gyro[0]*DEG_TO_RAD;
+	float u = kp*theta + kd*theta_dot;
+	set_motor(1, u);
+	set_motor(2, u);
+	sum_sq_theta += theta*theta;
+	samples++;
+	return 0;
+}
+
+/*******************************************************************************
+* void print_usage()
+*******************************************************************************/
+void print_usage(){
+	printf("\n Usage: test_sim [options]\n");
+	printf("-p {kp}		Proportional gain, default 4.0\n");
+	printf("-d {kd}		Derivative gain, default 0.3\n");
+	printf("-a {deg}	Starting lean angle, default 5\n");
+	printf("-t {secs}	Simulated time to run for, default 10\n");
+	printf("-s {speed}	1 for real time, 0 for as fast as possible\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+/*******************************************************************************
+* int main()
+*******************************************************************************/
+int main(int argc, char *argv[]){
+	pendulum_t pendulum;
+	sim_plant_t plant;
+	imu_config_t conf;
+	uint64_t start_us, real_us;
+	float secs = 10.0, speed = 0.0, angle = 5.0;
+	int c, steps;
+
+	opterr = 0;
+	while((c=getopt(argc, argv, "p:d:a:t:s:h"))!=-1){
+		switch(c){
+		case 'p':
+			kp = atof(optarg);
+			break;
+		case 'd':
+			kd = atof(optarg);
+			break;
+		case 'a':
+			angle = atof(optarg);
+			break;
+		case 't':
+			secs = atof(optarg);
+			if(secs<=0){
+				printf("run time must be positive\n");
+				return -1;
+			}
+			break;
+		case 's':
+			speed = atof(optarg);
+			if(speed<0){
+				printf("speed can't be negative\n");
+				return -1;
+			}
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+
+	memset(&pendulum, 0, sizeof(pendulum));
+	pendulum.theta = angle*DEG_TO_RAD;
+	plant.step = &pendulum_step;
+	plant.ctx = &pendulum;
+	if(open_sim(plant)<0) return -1;
+	if(initialize_cape()<0){
+		printf("ERROR: failed to initialize cape\n");
+		return -1;
+	}
+
+	conf = get_default_imu_config();
+	conf.dmp_sample_rate = SAMPLE_RATE_HZ;
+	if(initialize_imu_dmp(&data, conf)){
+		printf("ERROR: can't talk to IMU\n");
+		return -1;
+	}
+	set_imu_interrupt_func(&controller);
+	enable_motors();
+	set_state(RUNNING);
+
+	start_us = micros_since_boot();
+	real_us = nanos_since_epoch()/1000;
+	if(start_sim(speed, secs)<0) return -1;
+	steps = wait_for_sim();
+	real_us = nanos_since_epoch()/1000 - real_us;
+
+	printf("kp %.3f kd %.3f: ", kp, kd);
+	if(fabsf(pendulum.theta)>FALLEN_ANGLE){
+		printf("fell after %.3fs", (micros_since_boot()-start_us)/1e6);
+	}
+	else printf("balanced, rms pitch %.5f rad", sqrt(sum_sq_theta/samples));
+	printf(", %d steps in %.3fs real time\n", steps, real_us/1e6);
+
+	power_off_imu();
+	cleanup_cape();
+	close_sim();
+	return 0;
+}
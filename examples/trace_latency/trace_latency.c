@@ -0,0 +1,148 @@
+/*******************************************************************************
+* trace_latency.c
+*
+* Runs the DMP with a trivial interrupt function and prints percentiles of
+* the time from the IMU interrupt edge to each point of the control path,
+* ending with the actuator write. With -m the function writes 0 duty to all
+* motors so the real PWM register write is timed, otherwise it just marks
+* where a write would be. Use -k for kernel timestamped edges, without it
+* the edge is only stamped once the handler wakes.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+#define DEFAULT_SECONDS	10
+#define DEFAULT_RATE	200
+
+// Global Variables
+int write_motors = 0;
+imu_data_t data;
+
+// local functions
+void print_usage();
+int control_loop();
+int dump_loops();
+
+/*******************************************************************************
+* void print_usage()
+*******************************************************************************/
+void print_usage(){
+	printf("\n Options\n");
+	printf("-s {rate}	DMP sample rate in HZ (default %d)\n", DEFAULT_RATE);
+	printf("-t {secs}	Seconds to trace for (default %d)\n", DEFAULT_SECONDS);
+	printf("-k		Use the gpio character device for kernel edge times\n");
+	printf("-w		Run the interrupt function in the callback worker\n");
+	printf("-m		Write 0 duty to the motors every loop\n");
+	printf("-d		Also print every loop as comma separated ns values\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+/*******************************************************************************
+* int control_loop()
+*
+* Stand in for a controller, the IMU interrupt function.
+*******************************************************************************/
+int control_loop(){
+	if(write_motors) set_motor_all(0);
+	else trace_point(TRACE_ACTUATOR);
+	return 0;
+}
+
+/*******************************************************************************
+* int dump_loops()
+*******************************************************************************/
+int dump_loops(){
+	latency_trace_loop_t loops[64];
+	uint64_t seq = 0;
+	int i, p, n;
+	printf("seq,wake,read_done,fusion_done,callback_start,callback_end,"\
+															"actuator\n");
+	while((n=get_latency_trace(seq, loops, 64))>0){
+		for(i=0;i<n;i++){
+			printf("%llu", (unsigned long long)loops[i].seq);
+			for(p=1;p<TRACE_POINTS;p++){
+				if(loops[i].ns[p]==TRACE_NOT_REACHED) printf(",");
+				else printf(",%u", loops[i].ns[p]);
+			}
+			printf("\n");
+		}
+		seq = loops[n-1].seq;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int main()
+*******************************************************************************/
+int main(int argc, char *argv[]){
+	imu_config_t conf = get_default_imu_config();
+	int c, seconds = DEFAULT_SECONDS, dump = 0;
+	uint64_t start;
+
+	conf.dmp_sample_rate = DEFAULT_RATE;
+	opterr = 0;
+	while((c=getopt(argc, argv, "s:t:kwmdh"))!=-1 && argc>1){
+		switch(c){
+		case 's':
+			conf.dmp_sample_rate = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			if(seconds<1){
+				printf("seconds must be at least 1\n");
+				return -1;
+			}
+			break;
+		case 'k':
+			conf.interrupt_backend = IMU_INTERRUPT_CHARDEV;
+			break;
+		case 'w':
+			conf.callback_worker = 1;
+			break;
+		case 'm':
+			write_motors = 1;
+			break;
+		case 'd':
+			dump = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+
+	if(initialize_cape()<0){
+		printf("ERROR: failed to initialize cape\n");
+		return -1;
+	}
+	// ring big enough for the whole run
+	if(start_latency_trace(seconds*conf.dmp_sample_rate)<0){
+		cleanup_cape();
+		return -1;
+	}
+	if(initialize_imu_dmp(&data, conf)<0){
+		printf("ERROR: failed to initialize imu\n");
+		cleanup_cape();
+		return -1;
+	}
+	set_imu_interrupt_func(&control_loop);
+
+	printf("tracing for %d seconds\n", seconds);
+	start = micros_since_boot();
+	while(get_state()!=EXITING && \
+				micros_since_boot()-start < (uint64_t)seconds*1000000){
+		usleep(100000);
+	}
+	stop_latency_trace();
+	power_off_imu();
+
+	print_latency_trace_summary();
+	if(dump) dump_loops();
+	cleanup_cape();
+	return 0;
+}
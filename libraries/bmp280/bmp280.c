@@ -10,6 +10,16 @@
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
+
+#define BARO_MAX_SERVICE_RATE	182	// fastest update with BMP_OVERSAMPLE_1
+#define BARO_IMU_WAIT_US		25000	// longest wait for an imu read to pass
+#define BARO_BUS_TRIES			10		// attempts to find the bus free
+#define BARO_RETRY_US			200
+#define BARO_SAMPLE_READ_TRIES	8
+#define ALT_EXPONENT			0.1903
+#define ALT_SCALE_M				44330.0
+#define ALT_REF_WINDOW_PA		500.0	// about 40m, keeps error within 2mm
 
 typedef struct bmp280_cal_t{
     uint16_t dig_T1;
@@ -28,6 +38,21 @@ typedef struct bmp280_cal_t{
 	
 	float sea_level_pa;
 
+	// constants derived once from the factory calibration so each sample
+	// only needs the terms that depend on the reading
+	int32_t t1x2;		// dig_T1<<1
+	int64_t p4s35;		// dig_P4<<35
+	int64_t p7s4;		// dig_P7<<4
+	int64_t p1;
+
+	// altitude is a quadratic expansion of the barometric formula about a
+	// reference pressure which is moved whenever the reading strays too far
+	int alt_ref_valid;
+	float alt_ref_pa;
+	float alt_ref_m;
+	float alt_d1;		// d(alt)/dp at the reference
+	float alt_d2;		// half of d2(alt)/dp2 at the reference
+
 }bmp280_cal_t;
 
 
@@ -42,6 +67,26 @@ typedef struct bmp280_data_t{
 bmp280_cal_t cal;
 bmp280_data_t data;
 
+// background service state, samples are published through a seqlock
+// protected pair of slots so readers never block the service thread
+typedef struct bmp_sample_slot_t{
+	volatile uint32_t lock;	// odd while the slot is being written
+	bmp_sample_t sample;
+} bmp_sample_slot_t;
+bmp_sample_slot_t bmp_sample_slots[2];
+volatile uint64_t newest_bmp_sample;
+pthread_t barometer_thread;
+volatile int barometer_service_running = 0;
+int barometer_period_us;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+int read_barometer_regs();
+float pressure_to_altitude(float pa);
+void publish_bmp_sample(uint64_t timestamp_micros);
+void* barometer_service(void* ptr);
+
 
 /*******************************************************************************
 * int initialize_barometer(bmp_oversample_t oversample, bmp_filter_t filter)
@@ -67,9 +112,8 @@ int initialize_barometer(bmp_oversample_t oversample, bmp_filter_t filter){
 		return -1;
 	}
 
-	// claiming the bus does no guarantee other code will not interfere 
-	// with this process, but best to claim it so other code can check
-	// like we did above
+	// hold the bus for the whole setup sequence so no other thread's
+	// transfers land in between
 	i2c_claim_bus(BMP_BUS);
 	
 	// reset the barometer
@@ -160,8 +204,15 @@ int initialize_barometer(bmp_oversample_t oversample, bmp_filter_t filter){
 	cal.dig_P8 = (uint16_t) ((buf[21] << 8) | buf [20]);
 	cal.dig_P9 = (uint16_t) ((buf[23] << 8) | buf [22]);
 	
+	// pre-derive the constant parts of the compensation formulas
+	cal.t1x2  = (int32_t)cal.dig_T1<<1;
+	cal.p4s35 = ((int64_t)cal.dig_P4)<<35;
+	cal.p7s4  = ((int64_t)cal.dig_P7)<<4;
+	cal.p1    = (int64_t)cal.dig_P1;
+	
 	// use default for now unless use sets it otherwise
 	cal.sea_level_pa = DEFAULT_SEA_LEVEL_PA; 
+	cal.alt_ref_valid = 0;
 	
 	// release control of the bus
 	i2c_release_bus(BMP_BUS);
@@ -220,15 +271,25 @@ int power_off_barometer(){
 * returns 0 on success, otherwise -1.
 *******************************************************************************/
 int read_barometer(){
-	int64_t var1, var2, var3, var4, t_fine, T, p;
-	uint8_t raw[6];
-	int32_t adc_P, adc_T;
-	
 	// check claim bus state to avoid stepping on IMU reads
 	if(i2c_get_in_use_state(BMP_BUS)){
 		printf("WARNING: i2c bus is claimed, aborting read_barometer\n");
 		return -1;
 	}
+	return read_barometer_regs();
+}
+
+/*******************************************************************************
+* int read_barometer_regs()
+*
+* Claims the bus, reads the data registers, and updates the compensated data.
+* Callers check the bus is free first.
+*******************************************************************************/
+int read_barometer_regs(){
+	int32_t var1, var2, t_fine, T;
+	int64_t var3, var4, p;
+	uint8_t raw[6];
+	int32_t adc_P, adc_T;
 	
 	// claim bus for ourselves and set the device address
 	i2c_claim_bus(BMP_BUS);
@@ -245,14 +306,17 @@ int read_barometer(){
 		return -1;
 	}
 	
+	// done with the bus, the rest is math
+	i2c_release_bus(BMP_BUS);
+	
 	// run the numbers, thanks to Bosch for putting this code in their datasheet
+	// the temperature half only needs 32 bits, pressure needs 64
 	adc_P = (raw[0] << 12)|
 			(raw[1] << 4)|(raw[2] >> 4);
 	adc_T = (raw[3] << 12)|
 			(raw[4] << 4)|(raw[5] >> 4);
 	
-	var1  = ((((adc_T>>3) - ((int32_t)cal.dig_T1 <<1))) *
-			((int32_t)cal.dig_T2)) >> 11;
+	var1  = (((adc_T>>3) - cal.t1x2) * ((int32_t)cal.dig_T2)) >> 11;
 	var2  = (((((adc_T>>4) - ((int32_t)cal.dig_T1)) *
 			((adc_T>>4) - ((int32_t)cal.dig_T1))) >> 12) *
 			((int32_t)cal.dig_T3)) >> 14;
@@ -265,10 +329,10 @@ int read_barometer(){
 	var3 = ((int64_t)t_fine) - 128000;
 	var4 = var3 * var3 * (int64_t)cal.dig_P6;
 	var4 = var4 + ((var3*(int64_t)cal.dig_P5)<<17);
-	var4 = var4 + (((int64_t)cal.dig_P4)<<35);
+	var4 = var4 + cal.p4s35;
 	var3 = ((var3 * var3 * (int64_t)cal.dig_P3)>>8) +
 		   ((var3 * (int64_t)cal.dig_P2)<<12);
-	var3 = (((((int64_t)1)<<47)+var3))*((int64_t)cal.dig_P1)>>33;
+	var3 = (((((int64_t)1)<<47)+var3))*cal.p1>>33;
 
 	if (var3 == 0){
 		return 0;  // avoid exception caused by division by zero
@@ -279,16 +343,37 @@ int read_barometer(){
 	var3 = (((int64_t)cal.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
 	var4 = (((int64_t)cal.dig_P8) * p) >> 19;
 
-	p = ((p + var3 + var4) >> 8) + (((int64_t)cal.dig_P7) << 4);
+	p = ((p + var3 + var4) >> 8) + cal.p7s4;
 	data.pressure = (float)p/256;
-	
-
-	data.alt = 44330.0*(1.0 - pow((data.pressure/cal.sea_level_pa), 0.1903));
-
-	i2c_release_bus(BMP_BUS);
+	data.alt = pressure_to_altitude(data.pressure);
 	return 0;
 }
 
+/*******************************************************************************
+* float pressure_to_altitude(float pa)
+*
+* Evaluates the barometric formula with a quadratic expansion about the last
+* reference pressure. Only when the pressure moves more than ALT_REF_WINDOW_PA
+* from the reference, or the sea level pressure changes, is powf called to 
+* set up a new reference.
+*******************************************************************************/
+float pressure_to_altitude(float pa){
+	float dp, r, rn;
+	
+	dp = pa - cal.alt_ref_pa;
+	if(!cal.alt_ref_valid || dp>ALT_REF_WINDOW_PA || dp<-ALT_REF_WINDOW_PA){
+		r = pa/cal.sea_level_pa;
+		rn = powf(r, ALT_EXPONENT);
+		cal.alt_ref_pa = pa;
+		cal.alt_ref_m = ALT_SCALE_M*(1.0f - rn);
+		cal.alt_d1 = -ALT_SCALE_M*ALT_EXPONENT*rn/pa;
+		cal.alt_d2 = -0.5f*ALT_SCALE_M*ALT_EXPONENT*(ALT_EXPONENT-1.0f)*rn/(pa*pa);
+		cal.alt_ref_valid = 1;
+		dp = 0.0f;
+	}
+	return cal.alt_ref_m + dp*(cal.alt_d1 + dp*cal.alt_d2);
+}
+
 /*******************************************************************************
 * float bmp_get_temperature_c()
 *
@@ -337,7 +422,146 @@ int set_sea_level_pressure_pa(float pa){
 		return -1;
 	}
 	cal.sea_level_pa = pa;
+	cal.alt_ref_valid = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int start_barometer_service(int rate_hz)
+*
+* Starts a background thread reading the barometer at rate_hz. The barometer
+* must already be initialized. Results are read with get_barometer_sample().
+*******************************************************************************/
+int start_barometer_service(int rate_hz){
+	if(barometer_service_running){
+		printf("ERROR: barometer service already running\n");
+		return -1;
+	}
+	if(rate_hz<1 || rate_hz>BARO_MAX_SERVICE_RATE){
+		printf("ERROR: barometer service rate must be between 1 & %d\n",\
+														BARO_MAX_SERVICE_RATE);
+		return -1;
+	}
+	barometer_period_us = 1000000/rate_hz;
+	newest_bmp_sample = 0;
+	barometer_service_running = 1;
+	if(create_rt_thread(&barometer_thread, RT_SERVICE_BAROMETER, \
+											barometer_service, NULL)){
+		printf("ERROR: failed to start barometer thread\n");
+		barometer_service_running = 0;
+		return -1;
+	}
 	return 0;
 }
 
+/*******************************************************************************
+* int stop_barometer_service()
+*
+* Stops the background thread and waits for it to exit.
+*******************************************************************************/
+int stop_barometer_service(){
+	if(!barometer_service_running) return 0;
+	barometer_service_running = 0;
+	pthread_join(barometer_thread, NULL);
+	return 0;
+}
+
+/*******************************************************************************
+* int get_barometer_sample(bmp_sample_t* sample)
+*
+* Copies the newest sample from the service thread. Returns 0 on success or
+* -1 if there isn't one yet.
+*******************************************************************************/
+int get_barometer_sample(bmp_sample_t* sample){
+	uint64_t n;
+	uint32_t before, after;
+	bmp_sample_slot_t* slot;
+	int i;
+	
+	for(i=0;i<BARO_SAMPLE_READ_TRIES;i++){
+		n = newest_bmp_sample;
+		if(n==0) return -1;
+		__sync_synchronize();
+		slot = &bmp_sample_slots[n&1];
+		before = slot->lock;
+		if(before&1) continue; // writer in progress
+		__sync_synchronize();
+		*sample = slot->sample;
+		__sync_synchronize();
+		after = slot->lock;
+		if(before!=after || sample->seq!=n) continue;
+		return 0;
+	}
+	return -1;
+}
 
+/*******************************************************************************
+* void publish_bmp_sample(uint64_t timestamp_micros)
+*
+* Writes the latest compensated data into the slot readers are not looking at.
+* Only called from the service thread so there is a single writer.
+*******************************************************************************/
+void publish_bmp_sample(uint64_t timestamp_micros){
+	uint64_t n = newest_bmp_sample + 1;
+	bmp_sample_slot_t* slot = &bmp_sample_slots[n&1];
+	
+	slot->lock++;
+	__sync_synchronize();
+	slot->sample.seq = n;
+	slot->sample.timestamp_micros = timestamp_micros;
+	slot->sample.temp_c = data.temp;
+	slot->sample.pressure_pa = data.pressure;
+	slot->sample.altitude_m = data.alt;
+	__sync_synchronize();
+	slot->lock++;
+	
+	// only now let readers know the sample exists
+	__sync_synchronize();
+	newest_bmp_sample = n;
+}
+
+/*******************************************************************************
+* void* barometer_service(void* ptr)
+*
+* The barometer keeps sampling on its own in normal mode so this only has to
+* fetch the data registers on schedule. When DMP samples are being published
+* each read waits until the IMU thread has finished its next read so the
+* barometer transaction lands in the gap before the following interrupt 
+* instead of contending with it. If the bus is still claimed it retries 
+* shortly after rather than printing warnings.
+*******************************************************************************/
+void* barometer_service(void* ptr){
+	imu_sample_t imu;
+	uint64_t next, now, seq, deadline;
+	int i;
+
+	next = micros_since_boot();
+	while(barometer_service_running && get_state()!=EXITING){
+		now = micros_since_boot();
+		if(now<next) usleep(next-now);
+		next += barometer_period_us;
+		// don't try to catch up after a long stall
+		if(next<now) next = now+barometer_period_us;
+
+		// wait for the next imu read to finish
+		if(get_latest_imu_sample(&imu)==0){
+			seq = imu.seq;
+			deadline = micros_since_boot()+BARO_IMU_WAIT_US;
+			while(get_latest_imu_sample(&imu)==0 && imu.seq==seq && \
+										micros_since_boot()<deadline){
+				usleep(BARO_RETRY_US);
+			}
+		}
+
+		for(i=0;i<BARO_BUS_TRIES;i++){
+			if(!i2c_get_in_use_state(BMP_BUS)){
+				if(read_barometer_regs()==0){
+					publish_bmp_sample(micros_since_boot());
+				}
+				break;
+			}
+			usleep(BARO_RETRY_US);
+		}
+	}
+	return NULL;
+}
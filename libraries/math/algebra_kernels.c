@@ -0,0 +1,94 @@
+/*******************************************************************************
+* algebra_kernels.c
+*
+* NEON and scalar versions of the inner loops used by the linear algebra and
+* quaternion functions. Which one is compiled is selected by USE_NEON in
+* libraries/Makefile.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include "algebra_kernels.h"
+
+#ifdef USE_NEON
+#include <arm_neon.h>
+
+/*******************************************************************************
+* float kernel_dot(const float* a, const float* b, int n)
+*
+* four multiply-accumulates per instruction, then a horizontal add
+*******************************************************************************/
+float kernel_dot(const float* a, const float* b, int n){
+	int i = 0;
+	float sum;
+	float32x4_t acc = vdupq_n_f32(0.0f);
+	float32x2_t pair;
+	for(; i+4<=n; i+=4){
+		acc = vmlaq_f32(acc, vld1q_f32(a+i), vld1q_f32(b+i));
+	}
+	pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+	pair = vpadd_f32(pair, pair);
+	sum = vget_lane_f32(pair, 0);
+	// leftover elements
+	for(; i<n; i++) sum += a[i]*b[i];
+	return sum;
+}
+
+/*******************************************************************************
+* void kernel_axpy(float s, const float* x, float* y, int n)
+*******************************************************************************/
+void kernel_axpy(float s, const float* x, float* y, int n){
+	int i = 0;
+	for(; i+4<=n; i+=4){
+		vst1q_f32(y+i, vmlaq_n_f32(vld1q_f32(y+i), vld1q_f32(x+i), s));
+	}
+	for(; i<n; i++) y[i] += s*x[i];
+}
+
+/*******************************************************************************
+* void kernel_quat_multiply(const float a[4], const float b[4], float out[4])
+*
+* out = aw*[bw  bx  by  bz] + ax*[-bx  bw -bz  by] 
+*     + ay*[-by bz  bw -bx] + az*[-bz -by  bx  bw]
+* The three permutations of b are built with lane reversals and swaps.
+*******************************************************************************/
+void kernel_quat_multiply(const float a[4], const float b[4], float out[4]){
+	static const float sx[4] = {-1.0f,  1.0f, -1.0f,  1.0f};
+	static const float sy[4] = {-1.0f,  1.0f,  1.0f, -1.0f};
+	static const float sz[4] = {-1.0f, -1.0f,  1.0f,  1.0f};
+	float32x4_t vb  = vld1q_f32(b);
+	float32x4_t bx  = vrev64q_f32(vb);						// x w z y
+	float32x4_t by  = vcombine_f32(vget_high_f32(vb), vget_low_f32(vb)); // y z w x
+	float32x4_t bz  = vrev64q_f32(by);						// z y x w
+	float32x4_t res = vmulq_n_f32(vb, a[QUAT_W]);
+	res = vmlaq_n_f32(res, vmulq_f32(bx, vld1q_f32(sx)), a[QUAT_X]);
+	res = vmlaq_n_f32(res, vmulq_f32(by, vld1q_f32(sy)), a[QUAT_Y]);
+	res = vmlaq_n_f32(res, vmulq_f32(bz, vld1q_f32(sz)), a[QUAT_Z]);
+	vst1q_f32(out, res);
+}
+
+#else // scalar fallback
+
+float kernel_dot(const float* a, const float* b, int n){
+	int i;
+	float sum = 0.0f;
+	for(i=0; i<n; i++) sum += a[i]*b[i];
+	return sum;
+}
+
+void kernel_axpy(float s, const float* x, float* y, int n){
+	int i;
+	for(i=0; i<n; i++) y[i] += s*x[i];
+}
+
+void kernel_quat_multiply(const float a[4], const float b[4], float out[4]){
+	out[QUAT_W] = a[QUAT_W]*b[QUAT_W] - a[QUAT_X]*b[QUAT_X] \
+				- a[QUAT_Y]*b[QUAT_Y] - a[QUAT_Z]*b[QUAT_Z];
+	out[QUAT_X] = a[QUAT_W]*b[QUAT_X] + a[QUAT_X]*b[QUAT_W] \
+				+ a[QUAT_Y]*b[QUAT_Z] - a[QUAT_Z]*b[QUAT_Y];
+	out[QUAT_Y] = a[QUAT_W]*b[QUAT_Y] - a[QUAT_X]*b[QUAT_Z] \
+				+ a[QUAT_Y]*b[QUAT_W] + a[QUAT_Z]*b[QUAT_X];
+	out[QUAT_Z] = a[QUAT_W]*b[QUAT_Z] + a[QUAT_X]*b[QUAT_Y] \
+				- a[QUAT_Y]*b[QUAT_X] + a[QUAT_Z]*b[QUAT_W];
+}
+
+#endif // USE_NEON
@@ -0,0 +1,22 @@
+/*******************************************************************************
+* algebra_kernels.h
+*
+* Inner loops shared by linear_algebra.c and quaternion.c. When the library is
+* built with USE_NEON defined (the default, see libraries/Makefile) these use
+* NEON intrinsics on the Cortex-A8, otherwise plain C. These are for internal 
+* use only and operate on raw float arrays without any checks.
+*******************************************************************************/
+
+#ifndef ALGEBRA_KERNELS_H
+#define ALGEBRA_KERNELS_H
+
+// returns sum of a[i]*b[i] for i=0 to n-1
+float kernel_dot(const float* a, const float* b, int n);
+
+// y[i] += s*x[i] for i=0 to n-1
+void kernel_axpy(float s, const float* x, float* y, int n);
+
+// Hamilton product out = a*b, out must not alias a or b
+void kernel_quat_multiply(const float a[4], const float b[4], float out[4]);
+
+#endif // ALGEBRA_KERNELS_H
@@ -0,0 +1,318 @@
+/*******************************************************************************
+* attitude_estimator.c
+*
+* Host-side attitude estimation from raw gyro, accel, and optionally mag data
+* for use when the DMP is not running or its 200hz limit is too slow. The 
+* algorithm is chosen when the estimator is created and is called through a
+* function pointer so a user may also plug in their own.
+*
+* The updates follow S. Madgwick, "An efficient orientation filter for 
+* inertial and inertial/magnetic sensor arrays" (2010) and R. Mahony et al.,
+* "Nonlinear Complementary Filters on the Special Orthogonal Group" (2008).
+* The resulting quaternion rotates body frame vectors into the world frame with
+* world Z pointing up, the same convention as quaternion_to_mat3.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include "../roboticscape-usefulincludes.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int madgwick_update(attitude_estimator_t* est, float g[3], float a[3], \
+												float m[3], float dt);
+int mahony_update(attitude_estimator_t* est, float g[3], float a[3], \
+												float m[3], float dt);
+float inv_norm3(float x, float y, float z);
+
+/*******************************************************************************
+* attitude_estimator_t create_attitude_estimator(estimator_type_t type)
+*
+* returns an estimator at the identity orientation with default gains
+*******************************************************************************/
+attitude_estimator_t create_attitude_estimator(estimator_type_t type){
+	attitude_estimator_t est;
+	memset(&est, 0, sizeof(est));
+	switch(type){
+	case ESTIMATOR_MADGWICK:
+		est.update = madgwick_update;
+		break;
+	case ESTIMATOR_MAHONY:
+		est.update = mahony_update;
+		break;
+	case ESTIMATOR_CUSTOM:
+		// user must set est.update themselves
+		break;
+	default:
+		printf("ERROR: invalid estimator type\n");
+		return est;
+	}
+	est.type = type;
+	est.beta = ESTIMATOR_DEFAULT_BETA;
+	est.kp = ESTIMATOR_DEFAULT_KP;
+	est.ki = ESTIMATOR_DEFAULT_KI;
+	est.q[QUAT_W] = 1.0f;
+	est.initialized = 1;
+	return est;
+}
+
+/*******************************************************************************
+* int reset_attitude_estimator(attitude_estimator_t* est)
+*
+* back to identity orientation, clears the Mahony integral term
+*******************************************************************************/
+int reset_attitude_estimator(attitude_estimator_t* est){
+	if(est->initialized != 1){
+		printf("ERROR: estimator not initialized yet\n");
+		return -1;
+	}
+	est->q[QUAT_W] = 1.0f;
+	est->q[QUAT_X] = 0.0f;
+	est->q[QUAT_Y] = 0.0f;
+	est->q[QUAT_Z] = 0.0f;
+	est->integral[0] = 0.0f;
+	est->integral[1] = 0.0f;
+	est->integral[2] = 0.0f;
+	est->steps = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int march_attitude_estimator(attitude_estimator_t* est, float gyro[3], 
+*							float accel[3], float mag[3], float dt)
+*
+* gyro in rad/s, accel and mag in any units as only their direction is used.
+* mag may be NULL. Returns whatever the update function returns.
+*******************************************************************************/
+int march_attitude_estimator(attitude_estimator_t* est, float gyro[3], \
+								float accel[3], float mag[3], float dt){
+	if(est->initialized != 1){
+		report_error("ERROR: estimator not initialized yet\n");
+		return -1;
+	}
+	if(est->update == NULL){
+		report_error("ERROR: estimator has no update function\n");
+		return -1;
+	}
+	est->steps++;
+	return est->update(est, gyro, accel, mag, dt);
+}
+
+/*******************************************************************************
+* int march_estimator_imu_data(attitude_estimator_t* est, imu_data_t* data, 
+*												int use_mag, float dt)
+*
+* Feeds the latest readings in an imu_data_t (gyro in degrees/s) to the 
+* estimator and writes the result to data->fused_quat and fused_TaitBryan.
+*******************************************************************************/
+int march_estimator_imu_data(attitude_estimator_t* est, imu_data_t* data, \
+												int use_mag, float dt){
+	float g[3];
+	g[0] = data->gyro[0]*DEG_TO_RAD;
+	g[1] = data->gyro[1]*DEG_TO_RAD;
+	g[2] = data->gyro[2]*DEG_TO_RAD;
+	if(march_attitude_estimator(est, g, data->accel, \
+									use_mag ? data->mag : NULL, dt)<0){
+		return -1;
+	}
+	data->fused_quat[QUAT_W] = est->q[QUAT_W];
+	data->fused_quat[QUAT_X] = est->q[QUAT_X];
+	data->fused_quat[QUAT_Y] = est->q[QUAT_Y];
+	data->fused_quat[QUAT_Z] = est->q[QUAT_Z];
+	quaternionToTaitBryanFast(est->q, data->fused_TaitBryan);
+	return 0;
+}
+
+/*******************************************************************************
+* float inv_norm3(float x, float y, float z)
+*
+* 1/|v|, or 0 for a zero vector so callers can skip the correction step
+*******************************************************************************/
+float inv_norm3(float x, float y, float z){
+	float n = x*x + y*y + z*z;
+	if(n == 0.0f) return 0.0f;
+	return 1.0f/sqrtf(n);
+}
+
+/*******************************************************************************
+* int madgwick_update(attitude_estimator_t* est, float g[3], float a[3], 
+*												float m[3], float dt)
+*
+* gradient descent step toward the orientation that best explains the gravity
+* and magnetic field directions, combined with gyro integration. beta sets
+* how fast the estimate is pulled toward the accel/mag solution.
+*******************************************************************************/
+int madgwick_update(attitude_estimator_t* est, float g[3], float a[3], \
+												float m[3], float dt){
+	float q0 = est->q[QUAT_W];
+	float q1 = est->q[QUAT_X];
+	float q2 = est->q[QUAT_Y];
+	float q3 = est->q[QUAT_Z];
+	float gx = g[0], gy = g[1], gz = g[2];
+	float ax, ay, az, mx, my, mz;
+	float s0, s1, s2, s3, r;
+	float qd0, qd1, qd2, qd3;
+
+	// rate of change of quaternion from gyroscope
+	qd0 = 0.5f * (-q1*gx - q2*gy - q3*gz);
+	qd1 = 0.5f * ( q0*gx + q2*gz - q3*gy);
+	qd2 = 0.5f * ( q0*gy - q1*gz + q3*gx);
+	qd3 = 0.5f * ( q0*gz + q1*gy - q2*gx);
+
+	r = inv_norm3(a[0], a[1], a[2]);
+	if(r != 0.0f){
+		ax = a[0]*r; ay = a[1]*r; az = a[2]*r;
+		float q0q0 = q0*q0, q1q1 = q1*q1, q2q2 = q2*q2, q3q3 = q3*q3;
+		float _2q0 = 2.0f*q0, _2q1 = 2.0f*q1, _2q2 = 2.0f*q2, _2q3 = 2.0f*q3;
+		r = (m != NULL) ? inv_norm3(m[0], m[1], m[2]) : 0.0f;
+		if(r == 0.0f){
+			// accel only
+			float _4q0 = 4.0f*q0, _4q1 = 4.0f*q1, _4q2 = 4.0f*q2;
+			float _8q1 = 8.0f*q1, _8q2 = 8.0f*q2;
+			s0 = _4q0*q2q2 + _2q2*ax + _4q0*q1q1 - _2q1*ay;
+			s1 = _4q1*q3q3 - _2q3*ax + 4.0f*q0q0*q1 - _2q0*ay - _4q1 \
+				+ _8q1*q1q1 + _8q1*q2q2 + _4q1*az;
+			s2 = 4.0f*q0q0*q2 + _2q0*ax + _4q2*q3q3 - _2q3*ay - _4q2 \
+				+ _8q2*q1q1 + _8q2*q2q2 + _4q2*az;
+			s3 = 4.0f*q1q1*q3 - _2q1*ax + 4.0f*q2q2*q3 - _2q2*ay;
+		}
+		else{
+			mx = m[0]*r; my = m[1]*r; mz = m[2]*r;
+			float q0q1 = q0*q1, q0q2 = q0*q2, q0q3 = q0*q3;
+			float q1q2 = q1*q2, q1q3 = q1*q3, q2q3 = q2*q3;
+			float _2q0mx = 2.0f*q0*mx, _2q0my = 2.0f*q0*my;
+			float _2q0mz = 2.0f*q0*mz, _2q1mx = 2.0f*q1*mx;
+			float _2q0q2 = 2.0f*q0*q2, _2q2q3 = 2.0f*q2*q3;
+			float hx, hy, _2bx, _2bz, _4bx, _4bz;
+			float ex, ey, ez; // residuals of the magnetic field model
+
+			// reference direction of earth's magnetic field
+			hx = mx*q0q0 - _2q0my*q3 + _2q0mz*q2 + mx*q1q1 + _2q1*my*q2 \
+				+ _2q1*mz*q3 - mx*q2q2 - mx*q3q3;
+			hy = _2q0mx*q3 + my*q0q0 - _2q0mz*q1 + _2q1mx*q2 - my*q1q1 \
+				+ my*q2q2 + _2q2*mz*q3 - my*q3q3;
+			_2bx = sqrtf(hx*hx + hy*hy);
+			_2bz = -_2q0mx*q2 + _2q0my*q1 + mz*q0q0 + _2q1mx*q3 - mz*q1q1 \
+				+ _2q2*my*q3 - mz*q2q2 + mz*q3q3;
+			_4bx = 2.0f*_2bx;
+			_4bz = 2.0f*_2bz;
+
+			ex = _2bx*(0.5f - q2q2 - q3q3) + _2bz*(q1q3 - q0q2) - mx;
+			ey = _2bx*(q1q2 - q0q3) + _2bz*(q0q1 + q2q3) - my;
+			ez = _2bx*(q0q2 + q1q3) + _2bz*(0.5f - q1q1 - q2q2) - mz;
+			float fx = 2.0f*q1q3 - _2q0q2 - ax;
+			float fy = 2.0f*q0q1 + _2q2q3 - ay;
+			float fz = 1.0f - 2.0f*q1q1 - 2.0f*q2q2 - az;
+
+			// gradient of the objective function
+			s0 = -_2q2*fx + _2q1*fy - _2bz*q2*ex \
+				+ (-_2bx*q3 + _2bz*q1)*ey + _2bx*q2*ez;
+			s1 = _2q3*fx + _2q0*fy - 4.0f*q1*fz + _2bz*q3*ex \
+				+ (_2bx*q2 + _2bz*q0)*ey + (_2bx*q3 - _4bz*q1)*ez;
+			s2 = -_2q0*fx + _2q3*fy - 4.0f*q2*fz + (-_4bx*q2 - _2bz*q0)*ex \
+				+ (_2bx*q1 + _2bz*q3)*ey + (_2bx*q0 - _4bz*q2)*ez;
+			s3 = _2q1*fx + _2q2*fy + (-_4bx*q3 + _2bz*q1)*ex \
+				+ (-_2bx*q0 + _2bz*q2)*ey + _2bx*q1*ez;
+		}
+		// normalize step magnitude and apply feedback
+		r = s0*s0 + s1*s1 + s2*s2 + s3*s3;
+		if(r > 0.0f){
+			r = est->beta/sqrtf(r);
+			qd0 -= r*s0;
+			qd1 -= r*s1;
+			qd2 -= r*s2;
+			qd3 -= r*s3;
+		}
+	}
+
+	// integrate and normalize
+	est->q[QUAT_W] = q0 + qd0*dt;
+	est->q[QUAT_X] = q1 + qd1*dt;
+	est->q[QUAT_Y] = q2 + qd2*dt;
+	est->q[QUAT_Z] = q3 + qd3*dt;
+	normalizeQuaternionFast(est->q);
+	return 0;
+}
+
+/*******************************************************************************
+* int mahony_update(attitude_estimator_t* est, float g[3], float a[3], 
+*												float m[3], float dt)
+*
+* nonlinear complementary filter: the cross product between measured and
+* estimated gravity (and magnetic field) directions is fed back to the gyro
+* rate through a PI controller with gains kp and ki.
+*******************************************************************************/
+int mahony_update(attitude_estimator_t* est, float g[3], float a[3], \
+												float m[3], float dt){
+	float q0 = est->q[QUAT_W];
+	float q1 = est->q[QUAT_X];
+	float q2 = est->q[QUAT_Y];
+	float q3 = est->q[QUAT_Z];
+	float gx = g[0], gy = g[1], gz = g[2];
+	float ax, ay, az, mx, my, mz, r;
+	float halfvx, halfvy, halfvz;
+	float halfex = 0.0f, halfey = 0.0f, halfez = 0.0f;
+
+	r = inv_norm3(a[0], a[1], a[2]);
+	if(r != 0.0f){
+		float q0q0 = q0*q0, q0q1 = q0*q1, q0q2 = q0*q2, q0q3 = q0*q3;
+		float q1q1 = q1*q1, q1q2 = q1*q2, q1q3 = q1*q3;
+		float q2q2 = q2*q2, q2q3 = q2*q3, q3q3 = q3*q3;
+		ax = a[0]*r; ay = a[1]*r; az = a[2]*r;
+
+		// estimated direction of gravity in the body frame
+		halfvx = q1q3 - q0q2;
+		halfvy = q0q1 + q2q3;
+		halfvz = q0q0 - 0.5f + q3q3;
+		halfex = ay*halfvz - az*halfvy;
+		halfey = az*halfvx - ax*halfvz;
+		halfez = ax*halfvy - ay*halfvx;
+
+		r = (m != NULL) ? inv_norm3(m[0], m[1], m[2]) : 0.0f;
+		if(r != 0.0f){
+			float hx, hy, bx, bz, halfwx, halfwy, halfwz;
+			mx = m[0]*r; my = m[1]*r; mz = m[2]*r;
+			// reference direction of earth's magnetic field
+			hx = 2.0f*(mx*(0.5f - q2q2 - q3q3) + my*(q1q2 - q0q3) \
+											+ mz*(q1q3 + q0q2));
+			hy = 2.0f*(mx*(q1q2 + q0q3) + my*(0.5f - q1q1 - q3q3) \
+											+ mz*(q2q3 - q0q1));
+			bx = sqrtf(hx*hx + hy*hy);
+			bz = 2.0f*(mx*(q1q3 - q0q2) + my*(q2q3 + q0q1) \
+											+ mz*(0.5f - q1q1 - q2q2));
+			// estimated direction of magnetic field in the body frame
+			halfwx = bx*(0.5f - q2q2 - q3q3) + bz*(q1q3 - q0q2);
+			halfwy = bx*(q1q2 - q0q3) + bz*(q0q1 + q2q3);
+			halfwz = bx*(q0q2 + q1q3) + bz*(0.5f - q1q1 - q2q2);
+			halfex += my*halfwz - mz*halfwy;
+			halfey += mz*halfwx - mx*halfwz;
+			halfez += mx*halfwy - my*halfwx;
+		}
+
+		if(est->ki > 0.0f){
+			est->integral[0] += 2.0f*est->ki*halfex*dt;
+			est->integral[1] += 2.0f*est->ki*halfey*dt;
+			est->integral[2] += 2.0f*est->ki*halfez*dt;
+			gx += est->integral[0];
+			gy += est->integral[1];
+			gz += est->integral[2];
+		}
+		gx += 2.0f*est->kp*halfex;
+		gy += 2.0f*est->kp*halfey;
+		gz += 2.0f*est->kp*halfez;
+	}
+
+	// integrate rate of change of quaternion
+	gx *= 0.5f*dt;
+	gy *= 0.5f*dt;
+	gz *= 0.5f*dt;
+	est->q[QUAT_W] = q0 + (-q1*gx - q2*gy - q3*gz);
+	est->q[QUAT_X] = q1 + ( q0*gx + q2*gz - q3*gy);
+	est->q[QUAT_Y] = q2 + ( q0*gy - q1*gz + q3*gx);
+	est->q[QUAT_Z] = q3 + ( q0*gz + q1*gy - q2*gx);
+	normalizeQuaternionFast(est->q);
+	return 0;
+}
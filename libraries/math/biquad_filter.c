@@ -0,0 +1,170 @@
+/*******************************************************************************
+* biquad_filter.c
+*
+* High order filters as a cascade of second order sections. Each section is
+* discretized on its own with the same prewarped Tustin transform as 
+* C2DTustin and evaluated in direct form II transposed. Unlike one big
+* transfer function this stays accurate in single precision at any order.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h> // for memset
+#include <stdlib.h>
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+biquad_filter_t create_butterworth_biquad(int order, float dt, float wc, int hp);
+
+/*******************************************************************************
+* biquad_filter_t create_butterworth_biquad(int order, float dt, float wc, 
+*																	int hp)
+*
+* Builds the sections for a lowpass (hp=0) or highpass (hp=1) Butterworth
+* filter. The analog prototype is factored into sections 
+* (s/wc)^2 + 2*zeta*(s/wc) + 1 plus (s/wc) + 1 for odd orders, matching 
+* poly_butter, and each is mapped with s = c(1-z^-1)/(1+z^-1) where 
+* c = wc/tan(wc*dt/2) prewarps at the cutoff. Math is done in double before
+* the normalized coefficients are stored as floats.
+*******************************************************************************/
+biquad_filter_t create_butterworth_biquad(int order, float dt, float wc, int hp){
+	biquad_filter_t filter;
+	int i, sec;
+	double c, k, zeta, a0;
+	filter.initialized = 0;
+	if(order<1){
+		printf("ERROR: order must be >=1\n");
+		return filter;
+	}
+	if(dt<=0 || wc<=0){
+		printf("ERROR: dt and wc must be positive\n");
+		return filter;
+	}
+	filter.sections = (order+1)/2;
+	filter.coefs = (float*)calloc(filter.sections*7, sizeof(float));
+	if(filter.coefs == NULL){
+		printf("ERROR: failed to allocate memory for filter\n");
+		return filter;
+	}
+	filter.state = filter.coefs + (filter.sections*5);
+	
+	c = wc/tan(wc*dt/2.0);
+	k = c/wc;	// s/wc after substitution is k(1-z^-1)/(1+z^-1)
+	sec = 0;
+	for(i=1; i<=order/2; i++){
+		double b[3], a[3];
+		zeta = -cos((2*i + order - 1)*M_PI/(2*order));
+		a[0] = k*k + 2.0*zeta*k + 1.0;
+		a[1] = 2.0 - 2.0*k*k;
+		a[2] = k*k - 2.0*zeta*k + 1.0;
+		if(hp){ b[0] = k*k;  b[1] = -2.0*k*k; b[2] = k*k; }
+		else{   b[0] = 1.0;  b[1] = 2.0;      b[2] = 1.0; }
+		a0 = a[0];
+		filter.coefs[sec*5+0] = b[0]/a0;
+		filter.coefs[sec*5+1] = b[1]/a0;
+		filter.coefs[sec*5+2] = b[2]/a0;
+		filter.coefs[sec*5+3] = a[1]/a0;
+		filter.coefs[sec*5+4] = a[2]/a0;
+		sec++;
+	}
+	// odd orders get a first order section with b2=a2=0
+	if(order%2){
+		a0 = k + 1.0;
+		if(hp){
+			filter.coefs[sec*5+0] =  k/a0;
+			filter.coefs[sec*5+1] = -k/a0;
+		}
+		else{
+			filter.coefs[sec*5+0] = 1.0/a0;
+			filter.coefs[sec*5+1] = 1.0/a0;
+		}
+		filter.coefs[sec*5+3] = (1.0-k)/a0;
+	}
+	filter.order = order;
+	filter.dt = dt;
+	filter.gain = 1;
+	filter.newest_input = 0;
+	filter.newest_output = 0;
+	filter.step = 0;
+	filter.initialized = 1;
+	return filter;
+}
+
+/*******************************************************************************
+* biquad_filter_t create_butterworth_lowpass_biquad(int order, float dt, 
+*																	float wc)
+*******************************************************************************/
+biquad_filter_t create_butterworth_lowpass_biquad(int order, float dt, float wc){
+	return create_butterworth_biquad(order, dt, wc, 0);
+}
+
+/*******************************************************************************
+* biquad_filter_t create_butterworth_highpass_biquad(int order, float dt, 
+*																	float wc)
+*******************************************************************************/
+biquad_filter_t create_butterworth_highpass_biquad(int order, float dt, float wc){
+	return create_butterworth_biquad(order, dt, wc, 1);
+}
+
+/*******************************************************************************
+* int destroy_biquad_filter(biquad_filter_t* filter)
+*******************************************************************************/
+int destroy_biquad_filter(biquad_filter_t* filter){
+	if(filter->initialized != 1) return -1;
+	free(filter->coefs);
+	filter->coefs = NULL;
+	filter->state = NULL;
+	filter->initialized = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_biquad_filter(biquad_filter_t* filter)
+*
+* zeros the state of every section
+*******************************************************************************/
+int reset_biquad_filter(biquad_filter_t* filter){
+	if(filter->initialized != 1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	memset(filter->state, 0, filter->sections*2*sizeof(float));
+	filter->newest_input = 0;
+	filter->newest_output = 0;
+	filter->step = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* float march_biquad_filter(biquad_filter_t* filter, float new_input)
+*
+* Runs the input through each section in turn, the output of one section is
+* the input to the next.
+*******************************************************************************/
+float march_biquad_filter(biquad_filter_t* filter, float new_input){
+	int i;
+	float x, y;
+	float* c;
+	float* s;
+	if(filter->initialized != 1){
+		report_error("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	filter->newest_input = new_input;
+	x = filter->gain * new_input;
+	c = filter->coefs;
+	s = filter->state;
+	for(i=0; i<filter->sections; i++){
+		y    = c[0]*x + s[0];
+		s[0] = c[1]*x - c[3]*y + s[1];
+		s[1] = c[2]*x - c[4]*y;
+		x = y;
+		c += 5;
+		s += 2;
+	}
+	filter->newest_output = x;
+	filter->step++;
+	return x;
+}
@@ -12,6 +12,21 @@
 #include <string.h> // for memset
 #include <stdlib.h>
 
+// largest order C2DTustin and the retune functions build on the stack,
+// C2DTustin allocates its workspace above this
+#define TUSTIN_MAX_ORDER	32
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int alloc_df2t(d_filter_t* filter);
+int rebuild_df2t_state(d_filter_t* filter);
+float apply_filter_limits(d_filter_t* filter, float val, int* flag);
+float march_order1(d_filter_t* filter, float new_input);
+float march_order2(d_filter_t* filter, float new_input);
+float march_generic(d_filter_t* filter, float new_input);
+int tustin_term(int m, int n, float* out);
+
 /*******************************************************************************
 * d_filter_t create_filter(int order, float dt, float* num, float* den)
 *
@@ -27,6 +42,7 @@ d_filter_t create_filter(int order, float dt, float* num, float* den){
 		return filter;
 	}
 	filter.order = order;
+	filter.dt = dt;
 	filter.gain = 1;
 	filter.newest_input = 0;
 	filter.newest_output = 0;
@@ -40,8 +56,10 @@ d_filter_t create_filter(int order, float dt, float* num, float* den){
 	filter.denominator = create_vector_from_array(order+1, den);
 	filter.in_buf 	   = create_ring_buf(order+1);
 	filter.out_buf     = create_ring_buf(order+1);
+	if(alloc_df2t(&filter)<0) return filter;
 	filter.initialized = 1;
 	filter.step = 0;
+	refresh_filter_coefficients(&filter);
 	return filter;
 }
 
@@ -56,6 +74,9 @@ int destroy_filter(d_filter_t* filter){
 	destroy_ring_buf(&(filter->out_buf));
 	destroy_vector(&(filter->numerator));
 	destroy_vector(&(filter->denominator));
+	free(filter->df2t_num);
+	filter->df2t_num = NULL;
+	filter->coefs_ready = 0;
 	filter->initialized = 0;
 	return 0;
 }
@@ -87,12 +108,100 @@ d_filter_t create_empty_filter(int order){
 	filter.denominator = create_vector(order+1);
 	filter.in_buf 	   = create_ring_buf(order+1);
 	filter.out_buf     = create_ring_buf(order+1);
+	if(alloc_df2t(&filter)<0) return filter;
+	// coefficients are normalized on the first march once the user fills them
 	filter.initialized = 1;
 	filter.step = 0;
 	return filter;
 	
 }
 
+/*******************************************************************************
+* int alloc_df2t(d_filter_t* filter)
+*
+* allocates one contiguous block holding the normalized numerator, normalized
+* denominator, and the DF2T state of a filter whose order is already set.
+*******************************************************************************/
+int alloc_df2t(d_filter_t* filter){
+	int n = filter->order;
+	filter->df2t_num = (float*)calloc((3*n)+2, sizeof(float));
+	if(filter->df2t_num == NULL){
+		printf("ERROR: failed to allocate memory for filter\n");
+		filter->initialized = 0;
+		return -1;
+	}
+	filter->df2t_den   = filter->df2t_num + n + 1;
+	filter->df2t_state = filter->df2t_den + n + 1;
+	filter->coefs_ready = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int refresh_filter_coefficients(d_filter_t* filter)
+*
+* Copies the numerator and denominator into the contiguous arrays used by
+* march_filter, dividing through by the leading denominator coefficient so 
+* march_filter doesn't have to every step. The DF2T state is rebuilt from the 
+* input and output history so the filter continues smoothly.
+*******************************************************************************/
+int refresh_filter_coefficients(d_filter_t* filter){
+	int i;
+	float den0;
+	if(filter->initialized != 1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	den0 = filter->denominator.data[0];
+	if(den0 == 0){
+		printf("ERROR: leading denominator coefficient can't be 0\n");
+		filter->coefs_ready = 0;
+		return -1;
+	}
+	for(i=0; i<=filter->order; i++){
+		filter->df2t_num[i] = filter->numerator.data[i]/den0;
+		filter->df2t_den[i] = filter->denominator.data[i]/den0;
+	}
+	// pick a step function specialized for the order
+	switch(filter->order){
+	case 1:
+		filter->march_fn = march_order1;
+		break;
+	case 2:
+		filter->march_fn = march_order2;
+		break;
+	default:
+		filter->march_fn = march_generic;
+		break;
+	}
+	filter->coefs_ready = 1;
+	rebuild_df2t_state(filter);
+	return 0;
+}
+
+/*******************************************************************************
+* int rebuild_df2t_state(d_filter_t* filter)
+*
+* Fills the DF2T state so the next step matches the direct form difference
+* equation applied to the contents of the input and output ring buffers.
+* state[k-1] = sum for j=k..order of gain*b[j]*u(j-k) - a[j]*y(j-k) where
+* u(0) and y(0) are the newest input and output.
+*******************************************************************************/
+int rebuild_df2t_state(d_filter_t* filter){
+	int j,k;
+	float sum;
+	for(k=1; k<=filter->order; k++){
+		sum = 0;
+		for(j=k; j<=filter->order; j++){
+			sum += filter->gain * filter->df2t_num[j] * \
+								get_ring_buf_value(&filter->in_buf, j-k);
+			sum -= filter->df2t_den[j] * \
+								get_ring_buf_value(&filter->out_buf, j-k);
+		}
+		filter->df2t_state[k-1] = sum;
+	}
+	return 0;
+}
+
 /*******************************************************************************
 * float march_filter(d_filter_t* filter, float new_input)
 *
@@ -101,62 +210,218 @@ d_filter_t create_empty_filter(int order){
 * If saturation is enabled then the output will automatically be bound by the
 * min and max values given to enable_saturation. The enable_saturation entry
 * in the filter struct will also be set to 1 if saturation occurred. 
+*
+* This is evaluated in direct form II transposed with the coefficients that
+* were normalized by refresh_filter_coefficients, using the step function it
+* selected for the filter's order. The output is saturated before the state
+* update so the state sees the same bounded output that the direct form 
+* difference equation would.
 *******************************************************************************/
 float march_filter(d_filter_t* filter, float new_input){
-	int i = 0;
-	
 	if(filter->initialized != 1){
-		printf("ERROR: filter not initialized yet\n");
+		report_error("ERROR: filter not initialized yet\n");
 		return -1;
 	}
-	
+	if(!filter->coefs_ready){
+		if(refresh_filter_coefficients(filter)<0) return -1;
+	}
+	return filter->march_fn(filter, new_input);
+}
+
+/*******************************************************************************
+* float march_order1(d_filter_t* filter, float new_input)
+* float march_order2(d_filter_t* filter, float new_input)
+* float march_generic(d_filter_t* filter, float new_input)
+*
+* Step functions picked by refresh_filter_coefficients based on the filter
+* order. These assume the filter was already checked by march_filter.
+*******************************************************************************/
+float march_order1(d_filter_t* filter, float new_input){
+	float* b = filter->df2t_num;
+	float* a = filter->df2t_den;
+	float* s = filter->df2t_state;
+	float u = filter->gain * new_input;
+	float y = b[0]*u + s[0];
+	if(filter->saturation_en){
+		y = apply_filter_limits(filter, y, &filter->saturation_flag);
+	}
+	s[0] = b[1]*u - a[1]*y;
 	insert_new_ring_buf_value(&filter->in_buf, new_input);
+	insert_new_ring_buf_value(&filter->out_buf, y);
 	filter->newest_input = new_input;
+	filter->newest_output = y;
+	filter->step++;
+	return y;
+}
 
-	// evaluate the difference equation
-	float new_output = 0;
-	float input_i, output_i;
-	for(i=0; i<=(filter->order); i++){
-		input_i = get_ring_buf_value(&filter->in_buf,i);
-		new_output += filter->gain * filter->numerator.data[i] * input_i;
+float march_order2(d_filter_t* filter, float new_input){
+	float* b = filter->df2t_num;
+	float* a = filter->df2t_den;
+	float* s = filter->df2t_state;
+	float u = filter->gain * new_input;
+	float y = b[0]*u + s[0];
+	if(filter->saturation_en){
+		y = apply_filter_limits(filter, y, &filter->saturation_flag);
 	}
-	for(i=1; i<=(filter->order); i++){
-		output_i = get_ring_buf_value(&filter->out_buf,i-1);
-		new_output -= filter->denominator.data[i] * output_i; 
+	s[0] = s[1] + b[1]*u - a[1]*y;
+	s[1] = b[2]*u - a[2]*y;
+	insert_new_ring_buf_value(&filter->in_buf, new_input);
+	insert_new_ring_buf_value(&filter->out_buf, y);
+	filter->newest_input = new_input;
+	filter->newest_output = y;
+	filter->step++;
+	return y;
+}
+
+float march_generic(d_filter_t* filter, float new_input){
+	int i;
+	int n = filter->order;
+	float* b = filter->df2t_num;
+	float* a = filter->df2t_den;
+	float* s = filter->df2t_state;
+	
+	// gain is applied to the input so it may be changed between steps
+	float u = filter->gain * new_input;
+	float y = b[0]*u + s[0];
+	if(filter->saturation_en){
+		y = apply_filter_limits(filter, y, &filter->saturation_flag);
 	}
 	
-	// scale in case denominator doesn't have a leading 1
-	new_output = new_output/filter->denominator.data[0];
+	// shift the state with the final output
+	for(i=0; i<n-1; i++){
+		s[i] = s[i+1] + b[i+1]*u - a[i+1]*y;
+	}
+	s[n-1] = b[n]*u - a[n]*y;
 	
+	// record the input and output to filter struct and ring buffers
+	insert_new_ring_buf_value(&filter->in_buf, new_input);
+	insert_new_ring_buf_value(&filter->out_buf, y);
+	filter->newest_input = new_input;
+	filter->newest_output = y;
+	filter->step++;
+	return y;
+}
+
+/*******************************************************************************
+* int march_filter_block(d_filter_t* filter, const float* in, float* out, int n)
+*
+* Marches the filter n steps, equivalent to calling march_filter on each
+* element of in. State carries over between calls so a long signal can be fed
+* in chunks. in and out may be the same array. First and second order filters
+* get loops with the state held in local variables, and only the last order+1
+* samples are written to the ring buffers. Returns 0 on success, -1 on error.
+*******************************************************************************/
+int march_filter_block(d_filter_t* filter, const float* in, float* out, int n){
+	int i, k;
+	int N = filter->order;
+	int lim = filter->saturation_en;
+	int hist_start;
+	float g, u, y, s0, s1;
+	float* b;
+	float* a;
+	float* s;
+	
+	if(filter->initialized != 1){
+		report_error("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	if(n<1) return 0;
+	if(!filter->coefs_ready){
+		if(refresh_filter_coefficients(filter)<0) return -1;
+	}
+	b = filter->df2t_num;
+	a = filter->df2t_den;
+	s = filter->df2t_state;
+	g = filter->gain;
+	// samples before this don't survive in the ring buffer so skip them
+	hist_start = n - (N+1);
+	if(hist_start<0) hist_start = 0;
+	
+	switch(N){
+	case 1:
+		s0 = s[0];
+		for(i=0; i<n; i++){
+			if(i>=hist_start) insert_new_ring_buf_value(&filter->in_buf, in[i]);
+			u = g*in[i];
+			y = b[0]*u + s0;
+			if(lim) y = apply_filter_limits(filter,y,&filter->saturation_flag);
+			s0 = b[1]*u - a[1]*y;
+			out[i] = y;
+			filter->step++;
+		}
+		s[0] = s0;
+		break;
+	case 2:
+		s0 = s[0];
+		s1 = s[1];
+		for(i=0; i<n; i++){
+			if(i>=hist_start) insert_new_ring_buf_value(&filter->in_buf, in[i]);
+			u = g*in[i];
+			y = b[0]*u + s0;
+			if(lim) y = apply_filter_limits(filter,y,&filter->saturation_flag);
+			s0 = s1 + b[1]*u - a[1]*y;
+			s1 = b[2]*u - a[2]*y;
+			out[i] = y;
+			filter->step++;
+		}
+		s[0] = s0;
+		s[1] = s1;
+		break;
+	default:
+		for(i=0; i<n; i++){
+			if(i>=hist_start) insert_new_ring_buf_value(&filter->in_buf, in[i]);
+			u = g*in[i];
+			y = b[0]*u + s[0];
+			if(lim) y = apply_filter_limits(filter,y,&filter->saturation_flag);
+			for(k=0; k<N-1; k++){
+				s[k] = s[k+1] + b[k+1]*u - a[k+1]*y;
+			}
+			s[N-1] = b[N]*u - a[N]*y;
+			out[i] = y;
+			filter->step++;
+		}
+		break;
+	}
+	
+	for(i=hist_start; i<n; i++){
+		insert_new_ring_buf_value(&filter->out_buf, out[i]);
+	}
+	filter->newest_input = filter->in_buf.data[filter->in_buf.index];
+	filter->newest_output = out[n-1];
+	return 0;
+}
+
+/*******************************************************************************
+* float apply_filter_limits(d_filter_t* filter, float val, int* flag)
+*
+* applies the soft start and saturation settings of filter to a new output
+* value based on filter->step. If saturation is enabled, flag is set to 1 when
+* val was bound and 0 otherwise.
+*******************************************************************************/
+float apply_filter_limits(d_filter_t* filter, float val, int* flag){
 	// soft start limits
 	if(filter->soft_start_en && filter->step < filter->soft_start_steps){
 		float a=filter->saturation_max*(filter->step/filter->soft_start_steps);
 		float b=filter->saturation_min*(filter->step/filter->soft_start_steps);
-		if(new_output > a) new_output = a;
-		if(new_output < b) new_output = b;
+		if(val > a) val = a;
+		if(val < b) val = b;
 	}
 
 	// saturate and set flag
 	if(filter->saturation_en){
-		if(new_output > filter->saturation_max){
-			new_output = filter->saturation_max;
-			filter->saturation_flag=1;
+		if(val > filter->saturation_max){
+			val = filter->saturation_max;
+			*flag=1;
 		}
-		else if(new_output < filter->saturation_min){
-			new_output = filter->saturation_min;
-			filter->saturation_flag=1;
+		else if(val < filter->saturation_min){
+			val = filter->saturation_min;
+			*flag=1;
 		}
 		else{
-			filter->saturation_flag=0;
+			*flag=0;
 		}
 	}
-	
-	// record the output to filter struct and ring buffer
-	filter->newest_output = new_output;
-	insert_new_ring_buf_value(&filter->out_buf, new_output);
-	// increment steps
-	filter->step++;
-	return new_output;
+	return val;
 }
 
 /*******************************************************************************
@@ -167,6 +432,7 @@ float march_filter(d_filter_t* filter, float new_input){
 int reset_filter(d_filter_t* filter){
 	reset_ring_buf(&filter->in_buf);
 	reset_ring_buf(&filter->out_buf);
+	memset(filter->df2t_state, 0, filter->order*sizeof(float));
 	filter->newest_input = 0;
 	filter->newest_output = 0;
 	filter->step = 0;
@@ -286,6 +552,7 @@ int prefill_filter_inputs(d_filter_t* filter, float in){
 		insert_new_ring_buf_value(&(filter->in_buf), in);
 	}
 	filter->newest_input = in;
+	if(filter->coefs_ready) rebuild_df2t_state(filter);
 	return 0;
 }
 
@@ -305,6 +572,7 @@ int prefill_filter_outputs(d_filter_t* filter, float out){
 		insert_new_ring_buf_value(&(filter->out_buf), out);
 	}
 	filter->newest_output = out;
+	if(filter->coefs_ready) rebuild_df2t_state(filter);
 	return 0;
 }
 
@@ -390,61 +658,207 @@ d_filter_t multiply_filters(d_filter_t f1, d_filter_t f2){
 * float w:			prewarping frequency in rad/s
 *******************************************************************************/
 d_filter_t C2DTustin(vector_t num, vector_t den, float dt, float w){
-	int i,j;
 	d_filter_t out;
 	if(!num.initialized || !den.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return out;
 	}
-	float f = 2*(1 - cos(w*dt)) / (w*dt*sin(w*dt));
-	float c = 2/(f*dt);
-	int   m = num.len - 1;			// highest order of num
-	int   n = den.len - 1;			// highest order of den
-	float A0;
-	vector_t numZ = create_vector(n+1);	// make vectors with den order +1
-	vector_t denZ = create_vector(n+1);
-	vector_t p1  = create_vector(2);	// (z - 1)
-	p1.data[0]   = 1;
-	p1.data[1]   = -1;
-	vector_t p2  = create_vector(2);	// (z + 1)
-	p2.data[0]   = 1;
-	p2.data[1]   = 1;
-	vector_t temp, v1, v2;
-	
+	out = create_empty_filter(den.len-1);
+	if(out.initialized!=1) return out;
+	if(C2DTustin_into(num, den, dt, w, &out)<0) destroy_filter(&out);
+	return out;
+}
+
+/*******************************************************************************
+* int C2DTustin_into(vector_t num, vector_t den, float dt, float w,
+*														d_filter_t* filter)
+*
+* Same as C2DTustin but writes the discrete coefficients into an existing 
+* filter whose order already matches the denominator. Intermediate 
+* polynomials live on the stack up to TUSTIN_MAX_ORDER so nothing is
+* allocated, higher orders take a heap workspace as C2DTustin always did. The
+* DF2T state is rebuilt from the filter's history so the output carries on
+* smoothly.
+*******************************************************************************/
+int C2DTustin_into(vector_t num, vector_t den, float dt, float w, \
+														d_filter_t* filter){
+	int i,j;
+	float stack_ws[3*(TUSTIN_MAX_ORDER+1)];
+	float *ws = stack_ws;
+	float *numZ, *denZ, *temp;
+	float f, c, A0;
+	int ret;
+	int m = num.len - 1;			// highest order of num
+	int n = den.len - 1;			// highest order of den
+
+	if(!num.initialized || !den.initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
+	}
+	if(filter->initialized!=1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	if(n!=filter->order || m>n){
+		printf("ERROR: C2DTustin_into needs a filter of order %d\n", n);
+		return -1;
+	}
+	if(n>TUSTIN_MAX_ORDER){
+		ws = (float*)malloc(3*(n+1)*sizeof(float));
+		if(ws==NULL){
+			printf("ERROR: failed to allocate C2DTustin workspace\n");
+			return -1;
+		}
+	}
+	numZ = ws;
+	denZ = ws + (n+1);
+	temp = ws + 2*(n+1);
+	f = 2*(1 - cos(w*dt)) / (w*dt*sin(w*dt));
+	c = 2/(f*dt);
+	memset(numZ, 0, (n+1)*sizeof(float));
+	memset(denZ, 0, (n+1)*sizeof(float));
 	// from zeroth up to and including mth
-	for(i=0;i<=m;i++){				
-		v1 = poly_power(p1,m-i);
-		v2 = poly_power(p2,n-m+i);
-		temp = poly_conv(v1,v2);
-		destroy_vector(&v1);
-		destroy_vector(&v2);
+	for(i=0;i<=m;i++){
+		tustin_term(m-i, n, temp);
 		for(j=0;j<n+1;j++){
-			numZ.data[j] += num.data[i]*pow(c,m-i)*temp.data[j];
+			numZ[j] += num.data[i]*pow(c,m-i)*temp[j];
 		}
-		destroy_vector(&temp);
 	}
 	for(i=0;i<=n;i++){
-		v1 = poly_power(p1,n-i);
-		v2 = poly_power(p2,i);
-		temp = poly_conv(v1,v2);
-		destroy_vector(&v1);
-		destroy_vector(&v2);
+		tustin_term(n-i, n, temp);
 		for(j=0;j<n+1;j++){
-			denZ.data[j] += den.data[i]*pow(c,n-i)*temp.data[j];
+			denZ[j] += den.data[i]*pow(c,n-i)*temp[j];
 		}
-		destroy_vector(&temp);
 	}
-	A0 = denZ.data[0];
+	A0 = denZ[0];
 	for(i=0;i<n+1;i++){
-		numZ.data[i] = numZ.data[i]/A0;
-		denZ.data[i] = denZ.data[i]/A0;
-	}
-	out = create_filter(n,dt,numZ.data,denZ.data);
-	destroy_vector(&numZ);
-	destroy_vector(&denZ);
-	destroy_vector(&p1);
-	destroy_vector(&p2);
-	return out;
+		filter->numerator.data[i]   = numZ[i]/A0;
+		filter->denominator.data[i] = denZ[i]/A0;
+	}
+	filter->dt = dt;
+	ret = refresh_filter_coefficients(filter);
+	if(ws!=stack_ws) free(ws);
+	return ret;
+}
+
+/*******************************************************************************
+* int tustin_term(int m, int n, float* out)
+*
+* out = (z-1)^m * (z+1)^(n-m), the polynomial each s^m becomes after the 
+* substitution s = c(z-1)/(z+1) is multiplied through by (z+1)^n. out must
+* have room for n+1 coefficients.
+*******************************************************************************/
+int tustin_term(int m, int n, float* out){
+	float p1[] = {1, -1};			// (z - 1)
+	float p2[] = {1,  1};			// (z + 1)
+	vector_t v1 = create_vector_view(p1, 2);
+	vector_t v2 = create_vector_view(p2, 2);
+	vector_t in, res;
+	int len;
+
+	res = create_vector_view(out, m+1);
+	if(poly_power_into(v1, m, &res)<0) return -1;
+	for(len=m+1;len<n+1;len++){
+		in  = create_vector_view(out, len);
+		res = create_vector_view(out, len+1);
+		if(poly_conv_into(in, v2, &res)<0) return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int retune_filter(d_filter_t* filter, const float* num, const float* den)
+*
+* Replaces the transfer function of an existing filter with order+1 new 
+* numerator and denominator coefficients. The ring buffers and saturation 
+* settings are kept and the state rebuilt from the input and output history, 
+* so this can be called between steps of a running loop.
+*******************************************************************************/
+int retune_filter(d_filter_t* filter, const float* num, const float* den){
+	if(filter->initialized!=1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	memcpy(filter->numerator.data, num, (filter->order+1)*sizeof(float));
+	memcpy(filter->denominator.data, den, (filter->order+1)*sizeof(float));
+	return refresh_filter_coefficients(filter);
+}
+
+/*******************************************************************************
+* int retune_first_order_lowpass(d_filter_t* filter, float dt, 
+*														float time_constant)
+*******************************************************************************/
+int retune_first_order_lowpass(d_filter_t* filter, float dt, \
+														float time_constant){
+	float lp_const = dt/time_constant;
+	float numerator[]   = {lp_const, 0};
+	float denominator[] = {1, lp_const-1};
+	if(filter->initialized==1 && filter->order!=1){
+		printf("ERROR: first order filter needed\n");
+		return -1;
+	}
+	filter->dt = dt;
+	return retune_filter(filter, numerator, denominator);
+}
+
+/*******************************************************************************
+* int retune_first_order_highpass(d_filter_t* filter, float dt, 
+*														float time_constant)
+*******************************************************************************/
+int retune_first_order_highpass(d_filter_t* filter, float dt, \
+														float time_constant){
+	float hp_const = dt/time_constant;
+	float numerator[] = {1-hp_const, hp_const-1};
+	float denominator[] = {1,hp_const-1};
+	if(filter->initialized==1 && filter->order!=1){
+		printf("ERROR: first order filter needed\n");
+		return -1;
+	}
+	filter->dt = dt;
+	return retune_filter(filter, numerator, denominator);
+}
+
+/*******************************************************************************
+* int retune_butterworth_lowpass(d_filter_t* filter, float dt, float wc)
+*
+* Moves the cutoff of a filter from create_butterworth_lowpass, keeping its
+* order. Nothing is allocated.
+*******************************************************************************/
+int retune_butterworth_lowpass(d_filter_t* filter, float dt, float wc){
+	float a[TUSTIN_MAX_ORDER+1];
+	float b[] = {1};
+	vector_t A, B;
+	if(filter->initialized!=1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	if(filter->order>TUSTIN_MAX_ORDER) return -1;
+	A = create_vector_view(a, filter->order+1);
+	B = create_vector_view(b, 1);
+	if(poly_butter_into(filter->order, wc, &A)<0) return -1;
+	return C2DTustin_into(B, A, dt, wc, filter);
+}
+
+/*******************************************************************************
+* int retune_butterworth_highpass(d_filter_t* filter, float dt, float wc)
+*
+* Moves the cutoff of a filter from create_butterworth_highpass, keeping its
+* order. Nothing is allocated.
+*******************************************************************************/
+int retune_butterworth_highpass(d_filter_t* filter, float dt, float wc){
+	float a[TUSTIN_MAX_ORDER+1], b[TUSTIN_MAX_ORDER+1];
+	vector_t A, B;
+	if(filter->initialized!=1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	if(filter->order>TUSTIN_MAX_ORDER) return -1;
+	memset(b, 0, sizeof(b));
+	b[0] = 1;
+	A = create_vector_view(a, filter->order+1);
+	B = create_vector_view(b, filter->order+1);
+	if(poly_butter_into(filter->order, wc, &A)<0) return -1;
+	return C2DTustin_into(B, A, dt, wc, filter);
 }
 
 /*******************************************************************************
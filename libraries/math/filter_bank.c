@@ -0,0 +1,145 @@
+/*******************************************************************************
+* filter_bank.c
+*
+* A filter bank runs one transfer function independently on several channels,
+* such as the 3 axes of a gyro or the 4 motor commands of a controller. The
+* DF2T state is stored channel-minor so each step walks contiguous arrays and
+* the per-channel work is done with the shared algebra kernels.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include "algebra_kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memset, memmove
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+float apply_filter_limits(d_filter_t* filter, float val, int* flag);
+
+/*******************************************************************************
+* filter_bank_t create_filter_bank(d_filter_t* filter, int channels)
+*
+* Makes a bank of 'channels' copies of filter. The bank makes its own copy of
+* the coefficients, gain, saturation and soft start settings so the original
+* filter may be destroyed or reused afterwards.
+*******************************************************************************/
+filter_bank_t create_filter_bank(d_filter_t* filter, int channels){
+	filter_bank_t bank;
+	bank.initialized = 0;
+	if(filter->initialized != 1){
+		printf("ERROR: filter not initialized yet\n");
+		return bank;
+	}
+	if(channels<1){
+		printf("ERROR: filter bank needs at least 1 channel\n");
+		return bank;
+	}
+	bank.filter = create_filter(filter->order, filter->dt, \
+						filter->numerator.data, filter->denominator.data);
+	if(bank.filter.initialized != 1){
+		printf("ERROR: failed to copy filter for filter bank\n");
+		return bank;
+	}
+	bank.filter.dt 				 = filter->dt;
+	bank.filter.gain 			 = filter->gain;
+	bank.filter.saturation_en 	 = filter->saturation_en;
+	bank.filter.saturation_min 	 = filter->saturation_min;
+	bank.filter.saturation_max 	 = filter->saturation_max;
+	bank.filter.soft_start_en 	 = filter->soft_start_en;
+	bank.filter.soft_start_steps = filter->soft_start_steps;
+
+	// state for all channels followed by one row of scaled inputs
+	bank.state = (float*)calloc((filter->order+1)*channels, sizeof(float));
+	if(bank.state == NULL){
+		printf("ERROR: failed to allocate memory for filter bank\n");
+		destroy_filter(&bank.filter);
+		return bank;
+	}
+	bank.scaled_in = bank.state + (filter->order*channels);
+	bank.channels = channels;
+	bank.saturation_flag = 0;
+	bank.initialized = 1;
+	return bank;
+}
+
+/*******************************************************************************
+* int destroy_filter_bank(filter_bank_t* bank)
+*******************************************************************************/
+int destroy_filter_bank(filter_bank_t* bank){
+	if(bank->initialized != 1) return -1;
+	destroy_filter(&bank->filter);
+	free(bank->state);
+	bank->state = NULL;
+	bank->scaled_in = NULL;
+	bank->initialized = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_filter_bank(filter_bank_t* bank)
+*
+* zeros the state of every channel and restarts soft start
+*******************************************************************************/
+int reset_filter_bank(filter_bank_t* bank){
+	if(bank->initialized != 1){
+		printf("ERROR: filter bank not initialized yet\n");
+		return -1;
+	}
+	memset(bank->state, 0, bank->filter.order*bank->channels*sizeof(float));
+	bank->filter.step = 0;
+	bank->saturation_flag = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int march_filter_bank(filter_bank_t* bank, float* in, float* out)
+*
+* Marches every channel forward one step. in and out must each hold
+* bank->channels values and may be the same array. Soft start and saturation
+* behave exactly as in march_filter, bank->saturation_flag is set to 1 if any
+* channel saturated.
+*******************************************************************************/
+int march_filter_bank(filter_bank_t* bank, float* in, float* out){
+	int c, k, flag;
+	int n, N;
+	float* b;
+	float* a;
+	float* s;
+	float* u;
+	if(bank->initialized != 1){
+		report_error("ERROR: filter bank not initialized yet\n");
+		return -1;
+	}
+	n = bank->filter.order;
+	N = bank->channels;
+	b = bank->filter.df2t_num;
+	a = bank->filter.df2t_den;
+	s = bank->state;
+	u = bank->scaled_in;
+
+	// outputs of every channel from the first state row
+	bank->saturation_flag = 0;
+	for(c=0; c<N; c++){
+		u[c] = bank->filter.gain * in[c];
+		out[c] = b[0]*u[c] + s[c];
+		// apply_filter_limits only writes flag when saturation is enabled
+		flag = 0;
+		out[c] = apply_filter_limits(&bank->filter, out[c], &flag);
+		bank->saturation_flag |= flag;
+	}
+
+	// shift the state rows: s[k] = s[k+1] + b[k+1]*u - a[k+1]*y
+	for(k=0; k<n-1; k++){
+		memmove(&s[k*N], &s[(k+1)*N], N*sizeof(float));
+		kernel_axpy( b[k+1], u,   &s[k*N], N);
+		kernel_axpy(-a[k+1], out, &s[k*N], N);
+	}
+	memset(&s[(n-1)*N], 0, N*sizeof(float));
+	kernel_axpy( b[n], u,   &s[(n-1)*N], N);
+	kernel_axpy(-a[n], out, &s[(n-1)*N], N);
+
+	bank->filter.step++;
+	return 0;
+}
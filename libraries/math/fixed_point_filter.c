@@ -0,0 +1,376 @@
+/*******************************************************************************
+* fixed_point_filter.c
+*
+* Integer versions of the biquad cascade for signal conditioning at rates
+* where float is too slow or not available, such as on the PRUs. Filters are
+* designed in float with the usual constructors and then quantized here.
+*
+* Each section is evaluated in direct form I, which keeps the inputs and
+* outputs rather than DF2T's internal states. Those never grow beyond the
+* range of the signal itself so a saturated sum can't leave the filter in a
+* bad state, the usual choice in fixed point. Coefficients are scaled by a
+* power of 2 per section, as large as the biggest coefficient allows. Q15
+* filters keep 16 bit coefficients and samples and accumulate in 32 bits with
+* saturating adds. Their numerator and denominator are scaled separately, a
+* low cutoff puts the poles near 1 and 2 while the numerator is orders of
+* magnitude smaller. Q31 filters keep 32 bit values and accumulate in 64
+* bits, which can't overflow for a stable section, then saturate the result.
+* march_q_filter uses nothing but integer multiply, add and shift so the
+* same code and q_biquad_t layout compile for the PRU.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h> // for memset
+#include <stdlib.h>
+
+#define Q15_MAX	32767
+#define Q15_MIN	(-32768)
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+q_filter_t alloc_q_filter(int sections, q_format_t format);
+int quantize_q_section(q_biquad_t* q, const float c[5], q_format_t format);
+int32_t q_saturate(int64_t v, q_format_t format);
+int32_t q15_add_saturate(int32_t acc, int32_t p);
+int q_frac_bits(const float* c, int n, int bits);
+int32_t march_q15_section(q_biquad_t* q, int32_t x);
+int32_t march_q31_section(q_biquad_t* q, int32_t x);
+
+/*******************************************************************************
+* q_filter_t create_q_filter_from_biquad(biquad_filter_t f, q_format_t format)
+*
+* Quantizes each section of a biquad cascade. The cascade's gain is folded
+* into the numerator of the first section.
+*******************************************************************************/
+q_filter_t create_q_filter_from_biquad(biquad_filter_t f, q_format_t format){
+	q_filter_t out;
+	float c[5];
+	int i;
+	out.initialized = 0;
+	if(f.initialized!=1){
+		printf("ERROR: filter not initialized\n");
+		return out;
+	}
+	out = alloc_q_filter(f.sections, format);
+	if(out.initialized!=1) return out;
+	for(i=0;i<f.sections;i++){
+		memcpy(c, &f.coefs[i*5], sizeof(c));
+		if(i==0){
+			c[0] *= f.gain;
+			c[1] *= f.gain;
+			c[2] *= f.gain;
+		}
+		if(quantize_q_section(&out.section[i], c, format)<0){
+			destroy_q_filter(&out);
+			return out;
+		}
+	}
+	out.order = f.order;
+	out.dt = f.dt;
+	return out;
+}
+
+/*******************************************************************************
+* q_filter_t create_q_filter(d_filter_t f, q_format_t format)
+*
+* Quantizes a first or second order d_filter_t such as the first order
+* lowpass and highpass. Higher orders lose too much accuracy as one section,
+* build those with the biquad constructors instead.
+*******************************************************************************/
+q_filter_t create_q_filter(d_filter_t f, q_format_t format){
+	q_filter_t out;
+	float c[5];
+	float den0;
+	int i;
+	out.initialized = 0;
+	if(f.initialized!=1){
+		printf("ERROR: filter not initialized\n");
+		return out;
+	}
+	if(f.order>2){
+		printf("ERROR: fixed point filters above order 2 must be biquads\n");
+		return out;
+	}
+	den0 = f.denominator.data[0];
+	if(den0==0){
+		printf("ERROR: leading denominator coefficient can't be 0\n");
+		return out;
+	}
+	memset(c, 0, sizeof(c));
+	for(i=0;i<=f.order;i++) c[i] = f.gain*f.numerator.data[i]/den0;
+	for(i=1;i<=f.order;i++) c[2+i] = f.denominator.data[i]/den0;
+	out = alloc_q_filter(1, format);
+	if(out.initialized!=1) return out;
+	if(quantize_q_section(&out.section[0], c, format)<0){
+		destroy_q_filter(&out);
+		return out;
+	}
+	out.order = f.order;
+	out.dt = f.dt;
+	return out;
+}
+
+/*******************************************************************************
+* q_filter_t create_q_butterworth_lowpass(int order, float dt, float wc,
+*														q_format_t format)
+*******************************************************************************/
+q_filter_t create_q_butterworth_lowpass(int order, float dt, float wc, \
+														q_format_t format){
+	q_filter_t out;
+	biquad_filter_t f = create_butterworth_lowpass_biquad(order, dt, wc);
+	out.initialized = 0;
+	if(f.initialized!=1) return out;
+	out = create_q_filter_from_biquad(f, format);
+	destroy_biquad_filter(&f);
+	return out;
+}
+
+/*******************************************************************************
+* q_filter_t create_q_butterworth_highpass(int order, float dt, float wc,
+*														q_format_t format)
+*******************************************************************************/
+q_filter_t create_q_butterworth_highpass(int order, float dt, float wc, \
+														q_format_t format){
+	q_filter_t out;
+	biquad_filter_t f = create_butterworth_highpass_biquad(order, dt, wc);
+	out.initialized = 0;
+	if(f.initialized!=1) return out;
+	out = create_q_filter_from_biquad(f, format);
+	destroy_biquad_filter(&f);
+	return out;
+}
+
+/*******************************************************************************
+* q_filter_t alloc_q_filter(int sections, q_format_t format)
+*******************************************************************************/
+q_filter_t alloc_q_filter(int sections, q_format_t format){
+	q_filter_t out;
+	out.initialized = 0;
+	if(format!=Q_FORMAT_Q15 && format!=Q_FORMAT_Q31){
+		printf("ERROR: format must be Q_FORMAT_Q15 or Q_FORMAT_Q31\n");
+		return out;
+	}
+	out.section = (q_biquad_t*)calloc(sections, sizeof(q_biquad_t));
+	if(out.section==NULL){
+		printf("ERROR: failed to allocate memory for filter\n");
+		return out;
+	}
+	out.format = format;
+	out.sections = sections;
+	out.newest_input = 0;
+	out.newest_output = 0;
+	out.step = 0;
+	out.initialized = 1;
+	return out;
+}
+
+/*******************************************************************************
+* int q_frac_bits(const float* c, int n, int bits)
+*
+* Largest number of fractional bits, up to 2*bits, that keeps all n
+* coefficients inside a signed word of bits+1 bits, or -1 if even 0 doesn't.
+* Coefficients well below 1 get more than bits so none of the word is wasted.
+*******************************************************************************/
+int q_frac_bits(const float* c, int n, int bits){
+	double max = 0, limit;
+	int i, frac;
+	limit = ldexp(1.0, bits) - 1.0;
+	for(i=0;i<n;i++) if(fabs(c[i])>max) max = fabs(c[i]);
+	frac = 2*bits;
+	while(frac>0 && max*ldexp(1.0, frac)>limit) frac--;
+	if(max*ldexp(1.0, frac)>limit){
+		printf("ERROR: filter coefficient %g too large for fixed point\n", max);
+		return -1;
+	}
+	return frac;
+}
+
+/*******************************************************************************
+* int quantize_q_section(q_biquad_t* q, const float c[5], q_format_t format)
+*
+* c holds b0 b1 b2 a1 a2 normalized so a0 is 1. Picks the largest scale that
+* keeps the coefficients inside the format's word and rounds them. Q31 keeps
+* one scale for both, 31 bits is plenty and its 64 bit sum then can't
+* overflow.
+*******************************************************************************/
+int quantize_q_section(q_biquad_t* q, const float c[5], q_format_t format){
+	int i, b_frac, a_frac;
+	int32_t* dst = &q->b0;
+	int bits = (format==Q_FORMAT_Q15) ? 15 : 31;
+	b_frac = q_frac_bits(c, 3, bits);
+	a_frac = q_frac_bits(c+3, 2, bits);
+	if(b_frac<0 || a_frac<0) return -1;
+	if(format==Q_FORMAT_Q31){
+		if(a_frac<b_frac) b_frac = a_frac;
+		else a_frac = b_frac;
+	}
+	for(i=0;i<3;i++) dst[i] = (int32_t)lround(c[i]*ldexp(1.0, b_frac));
+	for(i=3;i<5;i++) dst[i] = (int32_t)lround(c[i]*ldexp(1.0, a_frac));
+	q->b_frac = b_frac;
+	q->a_frac = a_frac;
+	q->x1 = q->x2 = q->y1 = q->y2 = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int destroy_q_filter(q_filter_t* filter)
+*******************************************************************************/
+int destroy_q_filter(q_filter_t* filter){
+	if(filter->initialized != 1) return -1;
+	free(filter->section);
+	filter->section = NULL;
+	filter->initialized = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_q_filter(q_filter_t* filter)
+*
+* zeros the inputs and outputs held by every section
+*******************************************************************************/
+int reset_q_filter(q_filter_t* filter){
+	int i;
+	if(filter->initialized != 1){
+		printf("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	for(i=0;i<filter->sections;i++){
+		filter->section[i].x1 = filter->section[i].x2 = 0;
+		filter->section[i].y1 = filter->section[i].y2 = 0;
+	}
+	filter->newest_input = 0;
+	filter->newest_output = 0;
+	filter->step = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int32_t march_q_filter(q_filter_t* filter, int32_t new_input)
+*
+* Runs one sample through each section in turn. Input and output are in the
+* same integer units, raw ADC counts for example, with Q15 filters limited
+* to the int16_t range.
+*******************************************************************************/
+int32_t march_q_filter(q_filter_t* filter, int32_t new_input){
+	int i;
+	int32_t x;
+	if(filter->initialized != 1){
+		report_error("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	filter->newest_input = new_input;
+	x = q_saturate(new_input, filter->format);
+	if(filter->format==Q_FORMAT_Q15){
+		for(i=0;i<filter->sections;i++){
+			x = march_q15_section(&filter->section[i], x);
+		}
+	}
+	else{
+		for(i=0;i<filter->sections;i++){
+			x = march_q31_section(&filter->section[i], x);
+		}
+	}
+	filter->newest_output = x;
+	filter->step++;
+	return x;
+}
+
+/*******************************************************************************
+* int march_q_filter_block(q_filter_t* filter, const int32_t* in, int32_t* out,
+*																		int n)
+*
+* Same as calling march_q_filter n times, in and out may be the same array.
+*******************************************************************************/
+int march_q_filter_block(q_filter_t* filter, const int32_t* in, int32_t* out,\
+																		int n){
+	int i;
+	if(filter->initialized != 1){
+		report_error("ERROR: filter not initialized yet\n");
+		return -1;
+	}
+	for(i=0;i<n;i++) out[i] = march_q_filter(filter, in[i]);
+	return 0;
+}
+
+/*******************************************************************************
+* int32_t march_q15_section(q_biquad_t* q, int32_t x)
+*
+* Each product of two 16 bit values fits in 31 bits. Products are brought
+* down to the coarser of the two scales before they are summed, and the sum
+* is saturated at every add as a DSP's accumulator would.
+*******************************************************************************/
+int32_t march_q15_section(q_biquad_t* q, int32_t x){
+	int32_t acc, y;
+	int32_t terms[5];
+	int i, frac, b_shift, a_shift;
+	frac = (q->b_frac<q->a_frac) ? q->b_frac : q->a_frac;
+	b_shift = q->b_frac - frac;
+	a_shift = q->a_frac - frac;
+	terms[0] =  (q->b0 * x) >> b_shift;
+	terms[1] =  (q->b1 * q->x1) >> b_shift;
+	terms[2] =  (q->b2 * q->x2) >> b_shift;
+	terms[3] = -((q->a1 * q->y1) >> a_shift);
+	terms[4] = -((q->a2 * q->y2) >> a_shift);
+	acc = frac ? (1<<(frac-1)) : 0;	// round to nearest
+	for(i=0;i<5;i++) acc = q15_add_saturate(acc, terms[i]);
+	y = q_saturate(acc>>frac, Q_FORMAT_Q15);
+	q->x2 = q->x1;
+	q->x1 = x;
+	q->y2 = q->y1;
+	q->y1 = y;
+	return y;
+}
+
+/*******************************************************************************
+* int32_t march_q31_section(q_biquad_t* q, int32_t x)
+*
+* Products are 62 bits at most and a stable section's coefficients sum to
+* less than 8 in magnitude, so the 64 bit sum only needs saturating once.
+* Both halves share one scale, see quantize_q_section.
+*******************************************************************************/
+int32_t march_q31_section(q_biquad_t* q, int32_t x){
+	int64_t acc;
+	int32_t y;
+	int frac = q->a_frac;
+	acc  = frac ? ((int64_t)1<<(frac-1)) : 0;	// round to nearest
+	acc += (int64_t)q->b0 * x;
+	acc += (int64_t)q->b1 * q->x1;
+	acc += (int64_t)q->b2 * q->x2;
+	acc -= (int64_t)q->a1 * q->y1;
+	acc -= (int64_t)q->a2 * q->y2;
+	y = q_saturate(acc>>frac, Q_FORMAT_Q31);
+	q->x2 = q->x1;
+	q->x1 = x;
+	q->y2 = q->y1;
+	q->y1 = y;
+	return y;
+}
+
+/*******************************************************************************
+* int32_t q15_add_saturate(int32_t acc, int32_t p)
+*
+* acc+p clamped to the int32_t range, checked before adding since signed
+* overflow is undefined
+*******************************************************************************/
+int32_t q15_add_saturate(int32_t acc, int32_t p){
+	if(p>0 && acc>INT32_MAX-p) return INT32_MAX;
+	if(p<0 && acc<INT32_MIN-p) return INT32_MIN;
+	return acc + p;
+}
+
+/*******************************************************************************
+* int32_t q_saturate(int64_t v, q_format_t format)
+*******************************************************************************/
+int32_t q_saturate(int64_t v, q_format_t format){
+	if(format==Q_FORMAT_Q15){
+		if(v>Q15_MAX) return Q15_MAX;
+		if(v<Q15_MIN) return Q15_MIN;
+		return (int32_t)v;
+	}
+	if(v>INT32_MAX) return INT32_MAX;
+	if(v<INT32_MIN) return INT32_MIN;
+	return (int32_t)v;
+}
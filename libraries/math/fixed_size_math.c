@@ -0,0 +1,365 @@
+/*******************************************************************************
+* fixed_size_math.c
+*
+* 3x3 and 4x4 matrix and 3-vector operations on stack-allocated structs. 
+* Everything is unrolled by hand, no loops and no malloc, so these are safe
+* and cheap to call from the IMU interrupt thread.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h> // for memset
+
+#define MAT_EPSILON 1e-12
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int mat3_invert_quiet(const mat3_t* A, mat3_t* out);
+int mat4_invert_quiet(const mat4_t* A, mat4_t* out);
+
+/*******************************************************************************
+* mat3_t mat3_identity()
+*******************************************************************************/
+mat3_t mat3_identity(){
+	mat3_t out = {{	{1.0f, 0.0f, 0.0f},
+					{0.0f, 1.0f, 0.0f},
+					{0.0f, 0.0f, 1.0f}}};
+	return out;
+}
+
+/*******************************************************************************
+* mat3_t mat3_multiply(mat3_t A, mat3_t B)
+*******************************************************************************/
+mat3_t mat3_multiply(mat3_t A, mat3_t B){
+	mat3_t out;
+	out.d[0][0] = A.d[0][0]*B.d[0][0] + A.d[0][1]*B.d[1][0] + A.d[0][2]*B.d[2][0];
+	out.d[0][1] = A.d[0][0]*B.d[0][1] + A.d[0][1]*B.d[1][1] + A.d[0][2]*B.d[2][1];
+	out.d[0][2] = A.d[0][0]*B.d[0][2] + A.d[0][1]*B.d[1][2] + A.d[0][2]*B.d[2][2];
+	out.d[1][0] = A.d[1][0]*B.d[0][0] + A.d[1][1]*B.d[1][0] + A.d[1][2]*B.d[2][0];
+	out.d[1][1] = A.d[1][0]*B.d[0][1] + A.d[1][1]*B.d[1][1] + A.d[1][2]*B.d[2][1];
+	out.d[1][2] = A.d[1][0]*B.d[0][2] + A.d[1][1]*B.d[1][2] + A.d[1][2]*B.d[2][2];
+	out.d[2][0] = A.d[2][0]*B.d[0][0] + A.d[2][1]*B.d[1][0] + A.d[2][2]*B.d[2][0];
+	out.d[2][1] = A.d[2][0]*B.d[0][1] + A.d[2][1]*B.d[1][1] + A.d[2][2]*B.d[2][1];
+	out.d[2][2] = A.d[2][0]*B.d[0][2] + A.d[2][1]*B.d[1][2] + A.d[2][2]*B.d[2][2];
+	return out;
+}
+
+/*******************************************************************************
+* mat3_t mat3_transpose(mat3_t A)
+*******************************************************************************/
+mat3_t mat3_transpose(mat3_t A){
+	mat3_t out;
+	out.d[0][0] = A.d[0][0];
+	out.d[0][1] = A.d[1][0];
+	out.d[0][2] = A.d[2][0];
+	out.d[1][0] = A.d[0][1];
+	out.d[1][1] = A.d[1][1];
+	out.d[1][2] = A.d[2][1];
+	out.d[2][0] = A.d[0][2];
+	out.d[2][1] = A.d[1][2];
+	out.d[2][2] = A.d[2][2];
+	return out;
+}
+
+/*******************************************************************************
+* vec3_t mat3_times_vec3(mat3_t A, vec3_t v)
+*******************************************************************************/
+vec3_t mat3_times_vec3(mat3_t A, vec3_t v){
+	vec3_t out;
+	out.d[0] = A.d[0][0]*v.d[0] + A.d[0][1]*v.d[1] + A.d[0][2]*v.d[2];
+	out.d[1] = A.d[1][0]*v.d[0] + A.d[1][1]*v.d[1] + A.d[1][2]*v.d[2];
+	out.d[2] = A.d[2][0]*v.d[0] + A.d[2][1]*v.d[1] + A.d[2][2]*v.d[2];
+	return out;
+}
+
+/*******************************************************************************
+* float mat3_determinant(mat3_t A)
+*******************************************************************************/
+float mat3_determinant(mat3_t A){
+	return	A.d[0][0]*(A.d[1][1]*A.d[2][2] - A.d[1][2]*A.d[2][1]) \
+		-	A.d[0][1]*(A.d[1][0]*A.d[2][2] - A.d[1][2]*A.d[2][0]) \
+		+	A.d[0][2]*(A.d[1][0]*A.d[2][1] - A.d[1][1]*A.d[2][0]);
+}
+
+/*******************************************************************************
+* int mat3_invert(mat3_t A, mat3_t* out)
+*
+* Inverse by the adjugate. Returns -1 if A is singular.
+*******************************************************************************/
+int mat3_invert(mat3_t A, mat3_t* out){
+	if(mat3_invert_quiet(&A, out)<0){
+		printf("ERROR: mat3_invert, matrix is singular\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int mat3_invert_batch(const mat3_t* A, mat3_t* out, int count)
+*
+* Inverts count matrices without printing on each singular one. Returns how
+* many were singular, their outputs are set to zero.
+*******************************************************************************/
+int mat3_invert_batch(const mat3_t* A, mat3_t* out, int count){
+	int i, singular = 0;
+	for(i=0;i<count;i++){
+		if(mat3_invert_quiet(&A[i], &out[i])<0){
+			memset(&out[i], 0, sizeof(mat3_t));
+			singular++;
+		}
+	}
+	return singular;
+}
+
+/*******************************************************************************
+* int mat3_invert_quiet(const mat3_t* A, mat3_t* out)
+*
+* mat3_invert without the error message. A and out may be the same.
+*******************************************************************************/
+int mat3_invert_quiet(const mat3_t* A, mat3_t* out){
+	float c00, c01, c02, det, inv;
+	mat3_t a = *A;
+	c00 = a.d[1][1]*a.d[2][2] - a.d[1][2]*a.d[2][1];
+	c01 = a.d[1][2]*a.d[2][0] - a.d[1][0]*a.d[2][2];
+	c02 = a.d[1][0]*a.d[2][1] - a.d[1][1]*a.d[2][0];
+	det = a.d[0][0]*c00 + a.d[0][1]*c01 + a.d[0][2]*c02;
+	if(fabs(det) < MAT_EPSILON) return -1;
+	inv = 1.0f/det;
+	out->d[0][0] = c00*inv;
+	out->d[1][0] = c01*inv;
+	out->d[2][0] = c02*inv;
+	out->d[0][1] = (a.d[0][2]*a.d[2][1] - a.d[0][1]*a.d[2][2])*inv;
+	out->d[1][1] = (a.d[0][0]*a.d[2][2] - a.d[0][2]*a.d[2][0])*inv;
+	out->d[2][1] = (a.d[0][1]*a.d[2][0] - a.d[0][0]*a.d[2][1])*inv;
+	out->d[0][2] = (a.d[0][1]*a.d[1][2] - a.d[0][2]*a.d[1][1])*inv;
+	out->d[1][2] = (a.d[0][2]*a.d[1][0] - a.d[0][0]*a.d[1][2])*inv;
+	out->d[2][2] = (a.d[0][0]*a.d[1][1] - a.d[0][1]*a.d[1][0])*inv;
+	return 0;
+}
+
+/*******************************************************************************
+* mat3_t quaternion_to_mat3(float q[4])
+*
+* rotation matrix of a unit quaternion, body frame to world frame
+*******************************************************************************/
+mat3_t quaternion_to_mat3(float q[4]){
+	mat3_t out;
+	float ww = q[QUAT_W]*q[QUAT_W];
+	float xx = q[QUAT_X]*q[QUAT_X];
+	float yy = q[QUAT_Y]*q[QUAT_Y];
+	float zz = q[QUAT_Z]*q[QUAT_Z];
+	float wx = q[QUAT_W]*q[QUAT_X];
+	float wy = q[QUAT_W]*q[QUAT_Y];
+	float wz = q[QUAT_W]*q[QUAT_Z];
+	float xy = q[QUAT_X]*q[QUAT_Y];
+	float xz = q[QUAT_X]*q[QUAT_Z];
+	float yz = q[QUAT_Y]*q[QUAT_Z];
+	out.d[0][0] = ww + xx - yy - zz;
+	out.d[0][1] = 2.0f*(xy - wz);
+	out.d[0][2] = 2.0f*(xz + wy);
+	out.d[1][0] = 2.0f*(xy + wz);
+	out.d[1][1] = ww - xx + yy - zz;
+	out.d[1][2] = 2.0f*(yz - wx);
+	out.d[2][0] = 2.0f*(xz - wy);
+	out.d[2][1] = 2.0f*(yz + wx);
+	out.d[2][2] = ww - xx - yy + zz;
+	return out;
+}
+
+/*******************************************************************************
+* mat4_t mat4_identity()
+*******************************************************************************/
+mat4_t mat4_identity(){
+	mat4_t out = {{	{1.0f, 0.0f, 0.0f, 0.0f},
+					{0.0f, 1.0f, 0.0f, 0.0f},
+					{0.0f, 0.0f, 1.0f, 0.0f},
+					{0.0f, 0.0f, 0.0f, 1.0f}}};
+	return out;
+}
+
+/*******************************************************************************
+* mat4_t mat4_multiply(mat4_t A, mat4_t B)
+*
+* each output row is a linear combination of the rows of B
+*******************************************************************************/
+#define MAT4_ROW(i) \
+	out.d[i][0] = A.d[i][0]*B.d[0][0] + A.d[i][1]*B.d[1][0] \
+				+ A.d[i][2]*B.d[2][0] + A.d[i][3]*B.d[3][0]; \
+	out.d[i][1] = A.d[i][0]*B.d[0][1] + A.d[i][1]*B.d[1][1] \
+				+ A.d[i][2]*B.d[2][1] + A.d[i][3]*B.d[3][1]; \
+	out.d[i][2] = A.d[i][0]*B.d[0][2] + A.d[i][1]*B.d[1][2] \
+				+ A.d[i][2]*B.d[2][2] + A.d[i][3]*B.d[3][2]; \
+	out.d[i][3] = A.d[i][0]*B.d[0][3] + A.d[i][1]*B.d[1][3] \
+				+ A.d[i][2]*B.d[2][3] + A.d[i][3]*B.d[3][3];
+
+mat4_t mat4_multiply(mat4_t A, mat4_t B){
+	mat4_t out;
+	MAT4_ROW(0)
+	MAT4_ROW(1)
+	MAT4_ROW(2)
+	MAT4_ROW(3)
+	return out;
+}
+#undef MAT4_ROW
+
+/*******************************************************************************
+* mat4_t mat4_transpose(mat4_t A)
+*******************************************************************************/
+mat4_t mat4_transpose(mat4_t A){
+	mat4_t out;
+	out.d[0][0] = A.d[0][0]; out.d[0][1] = A.d[1][0];
+	out.d[0][2] = A.d[2][0]; out.d[0][3] = A.d[3][0];
+	out.d[1][0] = A.d[0][1]; out.d[1][1] = A.d[1][1];
+	out.d[1][2] = A.d[2][1]; out.d[1][3] = A.d[3][1];
+	out.d[2][0] = A.d[0][2]; out.d[2][1] = A.d[1][2];
+	out.d[2][2] = A.d[2][2]; out.d[2][3] = A.d[3][2];
+	out.d[3][0] = A.d[0][3]; out.d[3][1] = A.d[1][3];
+	out.d[3][2] = A.d[2][3]; out.d[3][3] = A.d[3][3];
+	return out;
+}
+
+/*******************************************************************************
+* float mat4_determinant(mat4_t A)
+*
+* Expansion in the same 2x2 minors mat4_invert uses.
+*******************************************************************************/
+float mat4_determinant(mat4_t A){
+	float s0, s1, s2, s3, s4, s5;
+	float c0, c1, c2, c3, c4, c5;
+	s0 = A.d[0][0]*A.d[1][1] - A.d[1][0]*A.d[0][1];
+	s1 = A.d[0][0]*A.d[1][2] - A.d[1][0]*A.d[0][2];
+	s2 = A.d[0][0]*A.d[1][3] - A.d[1][0]*A.d[0][3];
+	s3 = A.d[0][1]*A.d[1][2] - A.d[1][1]*A.d[0][2];
+	s4 = A.d[0][1]*A.d[1][3] - A.d[1][1]*A.d[0][3];
+	s5 = A.d[0][2]*A.d[1][3] - A.d[1][2]*A.d[0][3];
+	c5 = A.d[2][2]*A.d[3][3] - A.d[3][2]*A.d[2][3];
+	c4 = A.d[2][1]*A.d[3][3] - A.d[3][1]*A.d[2][3];
+	c3 = A.d[2][1]*A.d[3][2] - A.d[3][1]*A.d[2][2];
+	c2 = A.d[2][0]*A.d[3][3] - A.d[3][0]*A.d[2][3];
+	c1 = A.d[2][0]*A.d[3][2] - A.d[3][0]*A.d[2][2];
+	c0 = A.d[2][0]*A.d[3][1] - A.d[3][0]*A.d[2][1];
+	return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+}
+
+/*******************************************************************************
+* int mat4_invert(mat4_t A, mat4_t* out)
+*
+* Inverse by cofactors, see mat4_invert_quiet. Returns -1 if A is singular.
+*******************************************************************************/
+int mat4_invert(mat4_t A, mat4_t* out){
+	if(mat4_invert_quiet(&A, out)<0){
+		printf("ERROR: mat4_invert, matrix is singular\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int mat4_invert_batch(const mat4_t* A, mat4_t* out, int count)
+*
+* Inverts count matrices without printing on each singular one. Returns how
+* many were singular, their outputs are set to zero.
+*******************************************************************************/
+int mat4_invert_batch(const mat4_t* A, mat4_t* out, int count){
+	int i, singular = 0;
+	for(i=0;i<count;i++){
+		if(mat4_invert_quiet(&A[i], &out[i])<0){
+			memset(&out[i], 0, sizeof(mat4_t));
+			singular++;
+		}
+	}
+	return singular;
+}
+
+/*******************************************************************************
+* int mat4_invert_quiet(const mat4_t* A, mat4_t* out)
+*
+* Inverse by cofactors built from the 2x2 minors of the top two rows (s) and
+* bottom two rows (c). A and out may be the same.
+*******************************************************************************/
+int mat4_invert_quiet(const mat4_t* A, mat4_t* out){
+	float s0, s1, s2, s3, s4, s5;
+	float c0, c1, c2, c3, c4, c5;
+	float det, inv;
+	mat4_t a = *A;
+
+	s0 = a.d[0][0]*a.d[1][1] - a.d[1][0]*a.d[0][1];
+	s1 = a.d[0][0]*a.d[1][2] - a.d[1][0]*a.d[0][2];
+	s2 = a.d[0][0]*a.d[1][3] - a.d[1][0]*a.d[0][3];
+	s3 = a.d[0][1]*a.d[1][2] - a.d[1][1]*a.d[0][2];
+	s4 = a.d[0][1]*a.d[1][3] - a.d[1][1]*a.d[0][3];
+	s5 = a.d[0][2]*a.d[1][3] - a.d[1][2]*a.d[0][3];
+
+	c5 = a.d[2][2]*a.d[3][3] - a.d[3][2]*a.d[2][3];
+	c4 = a.d[2][1]*a.d[3][3] - a.d[3][1]*a.d[2][3];
+	c3 = a.d[2][1]*a.d[3][2] - a.d[3][1]*a.d[2][2];
+	c2 = a.d[2][0]*a.d[3][3] - a.d[3][0]*a.d[2][3];
+	c1 = a.d[2][0]*a.d[3][2] - a.d[3][0]*a.d[2][2];
+	c0 = a.d[2][0]*a.d[3][1] - a.d[3][0]*a.d[2][1];
+
+	det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+	if(fabs(det) < MAT_EPSILON) return -1;
+	inv = 1.0f/det;
+
+	out->d[0][0] = ( a.d[1][1]*c5 - a.d[1][2]*c4 + a.d[1][3]*c3)*inv;
+	out->d[0][1] = (-a.d[0][1]*c5 + a.d[0][2]*c4 - a.d[0][3]*c3)*inv;
+	out->d[0][2] = ( a.d[3][1]*s5 - a.d[3][2]*s4 + a.d[3][3]*s3)*inv;
+	out->d[0][3] = (-a.d[2][1]*s5 + a.d[2][2]*s4 - a.d[2][3]*s3)*inv;
+
+	out->d[1][0] = (-a.d[1][0]*c5 + a.d[1][2]*c2 - a.d[1][3]*c1)*inv;
+	out->d[1][1] = ( a.d[0][0]*c5 - a.d[0][2]*c2 + a.d[0][3]*c1)*inv;
+	out->d[1][2] = (-a.d[3][0]*s5 + a.d[3][2]*s2 - a.d[3][3]*s1)*inv;
+	out->d[1][3] = ( a.d[2][0]*s5 - a.d[2][2]*s2 + a.d[2][3]*s1)*inv;
+
+	out->d[2][0] = ( a.d[1][0]*c4 - a.d[1][1]*c2 + a.d[1][3]*c0)*inv;
+	out->d[2][1] = (-a.d[0][0]*c4 + a.d[0][1]*c2 - a.d[0][3]*c0)*inv;
+	out->d[2][2] = ( a.d[3][0]*s4 - a.d[3][1]*s2 + a.d[3][3]*s0)*inv;
+	out->d[2][3] = (-a.d[2][0]*s4 + a.d[2][1]*s2 - a.d[2][3]*s0)*inv;
+
+	out->d[3][0] = (-a.d[1][0]*c3 + a.d[1][1]*c1 - a.d[1][2]*c0)*inv;
+	out->d[3][1] = ( a.d[0][0]*c3 - a.d[0][1]*c1 + a.d[0][2]*c0)*inv;
+	out->d[3][2] = (-a.d[3][0]*s3 + a.d[3][1]*s1 - a.d[3][2]*s0)*inv;
+	out->d[3][3] = ( a.d[2][0]*s3 - a.d[2][1]*s1 + a.d[2][2]*s0)*inv;
+	return 0;
+}
+
+/*******************************************************************************
+* 3-vector operations
+*******************************************************************************/
+vec3_t create_vec3(float x, float y, float z){
+	vec3_t out = {{x, y, z}};
+	return out;
+}
+
+vec3_t vec3_add(vec3_t a, vec3_t b){
+	vec3_t out = {{a.d[0]+b.d[0], a.d[1]+b.d[1], a.d[2]+b.d[2]}};
+	return out;
+}
+
+vec3_t vec3_subtract(vec3_t a, vec3_t b){
+	vec3_t out = {{a.d[0]-b.d[0], a.d[1]-b.d[1], a.d[2]-b.d[2]}};
+	return out;
+}
+
+vec3_t vec3_scale(vec3_t a, float s){
+	vec3_t out = {{a.d[0]*s, a.d[1]*s, a.d[2]*s}};
+	return out;
+}
+
+float vec3_dot(vec3_t a, vec3_t b){
+	return a.d[0]*b.d[0] + a.d[1]*b.d[1] + a.d[2]*b.d[2];
+}
+
+vec3_t vec3_cross(vec3_t a, vec3_t b){
+	vec3_t out;
+	out.d[0] = a.d[1]*b.d[2] - a.d[2]*b.d[1];
+	out.d[1] = a.d[2]*b.d[0] - a.d[0]*b.d[2];
+	out.d[2] = a.d[0]*b.d[1] - a.d[1]*b.d[0];
+	return out;
+}
+
+float vec3_norm(vec3_t a){
+	return sqrtf(a.d[0]*a.d[0] + a.d[1]*a.d[1] + a.d[2]*a.d[2]);
+}
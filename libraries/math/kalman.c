@@ -0,0 +1,278 @@
+/*******************************************************************************
+* kalman.c
+*
+* Discrete time Kalman filter with every matrix it needs allocated once when
+* it is created. The model matrices F, B, H, Q & R are public members of the
+* struct which the user fills in, and may change between steps as an EKF does
+* with its Jacobians. Predict and update then only run loops over memory that
+* already exists, the gain comes from a Cholesky solve of the innovation
+* covariance rather than an inverse.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#define KALMAN_WS_SLACK	64	// alignment padding per workspace allocation
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int kalman_ws_matrix_bytes(int rows, int cols);
+
+/*******************************************************************************
+* kalman_filter_t create_kalman_filter(int nx, int nu, int nz)
+*
+* nx states, nu inputs (0 for none) and nz measurements. x starts at zero
+* with P, F and R identity and B, H & Q zero. Everything including the
+* scratch used by predict and update is allocated here.
+*******************************************************************************/
+kalman_filter_t create_kalman_filter(int nx, int nu, int nz){
+	kalman_filter_t kf;
+	int i, bytes;
+	memset(&kf, 0, sizeof(kf));
+	if(nx<1 || nz<1 || nu<0){
+		printf("ERROR: kalman filter needs at least 1 state and measurement\n");
+		return kf;
+	}
+	kf.nx = nx;
+	kf.nu = nu;
+	kf.nz = nz;
+	kf.F = create_identity_matrix(nx);
+	kf.Q = create_square_matrix(nx);
+	kf.H = create_matrix(nz, nx);
+	kf.R = create_identity_matrix(nz);
+	kf.P = create_identity_matrix(nx);
+	kf.x = create_vector(nx);
+	if(nu>0) kf.B = create_matrix(nx, nu);
+	else kf.B = create_empty_matrix();
+
+	// temporaries and the spd_solve_matrix scratch share one workspace
+	bytes = kalman_ws_matrix_bytes(nx, nx) + 2*kalman_ws_matrix_bytes(nz, nx) \
+		+ 2*kalman_ws_matrix_bytes(nz, nz) + 3*kalman_ws_matrix_bytes(1, nx) \
+		+ 2*kalman_ws_matrix_bytes(1, nz);
+	kf.ws = create_la_workspace(bytes);
+	kf.FP = workspace_matrix(&kf.ws, nx, nx);
+	kf.HP = workspace_matrix(&kf.ws, nz, nx);
+	kf.Kt = workspace_matrix(&kf.ws, nz, nx);
+	kf.S = workspace_matrix(&kf.ws, nz, nz);
+	kf.y = workspace_vector(&kf.ws, nz);
+	kf.tmp = workspace_vector(&kf.ws, nx);
+	kf.ph = workspace_vector(&kf.ws, nx);
+	if(!kf.F.initialized || !kf.Q.initialized || !kf.H.initialized || \
+		!kf.R.initialized || !kf.P.initialized || !kf.x.initialized || \
+		(nu>0 && !kf.B.initialized) || !kf.FP.initialized || \
+		!kf.HP.initialized || !kf.Kt.initialized || !kf.S.initialized || \
+		!kf.y.initialized || !kf.tmp.initialized || !kf.ph.initialized){
+		printf("ERROR: failed to allocate kalman filter\n");
+		kf.initialized = 1;
+		destroy_kalman_filter(&kf);
+		return kf;
+	}
+	for(i=0;i<nx;i++) kf.x.data[i] = 0.0f;
+	kf.initialized = 1;
+	return kf;
+}
+
+/*******************************************************************************
+* int destroy_kalman_filter(kalman_filter_t* kf)
+*******************************************************************************/
+int destroy_kalman_filter(kalman_filter_t* kf){
+	if(kf->initialized!=1) return 0;
+	destroy_matrix(&kf->F);
+	destroy_matrix(&kf->B);
+	destroy_matrix(&kf->H);
+	destroy_matrix(&kf->Q);
+	destroy_matrix(&kf->R);
+	destroy_matrix(&kf->P);
+	destroy_vector(&kf->x);
+	destroy_la_workspace(&kf->ws);
+	memset(kf, 0, sizeof(kalman_filter_t));
+	return 0;
+}
+
+/*******************************************************************************
+* int kalman_predict(kalman_filter_t* kf, vector_t u)
+*
+* x = F*x + B*u and P = F*P*F' + Q. u is ignored when the filter has no
+* inputs and may be an empty vector.
+*******************************************************************************/
+int kalman_predict(kalman_filter_t* kf, vector_t u){
+	int i, k, nx = kf->nx;
+	float sum;
+	if(kf->initialized!=1){
+		report_error("ERROR: kalman filter not initialized yet\n");
+		return -1;
+	}
+	if(kf->nu>0 && (!u.initialized || u.len!=kf->nu)){
+		report_error("ERROR: kalman input vector must have length %d\n", \
+																kf->nu);
+		return -1;
+	}
+	for(i=0;i<nx;i++){
+		sum = 0.0f;
+		for(k=0;k<nx;k++) sum += kf->F.data[i][k]*kf->x.data[k];
+		for(k=0;k<kf->nu;k++) sum += kf->B.data[i][k]*u.data[k];
+		kf->tmp.data[i] = sum;
+	}
+	memcpy(kf->x.data, kf->tmp.data, nx*sizeof(float));
+	return kalman_predict_covariance(kf);
+}
+
+/*******************************************************************************
+* int kalman_predict_covariance(kalman_filter_t* kf)
+*
+* Only the P = F*P*F' + Q half of the prediction, for an EKF which propagates
+* x through its own nonlinear model and puts the Jacobian in F.
+*******************************************************************************/
+int kalman_predict_covariance(kalman_filter_t* kf){
+	int i, j, k, nx = kf->nx;
+	float sum;
+	if(kf->initialized!=1){
+		printf("ERROR: kalman filter not initialized yet\n");
+		return -1;
+	}
+	multiply_matrices_into(kf->F, kf->P, &kf->FP);
+	// FP*F' without forming the transpose, only the upper triangle
+	for(i=0;i<nx;i++){
+		for(j=i;j<nx;j++){
+			sum = kf->Q.data[i][j];
+			for(k=0;k<nx;k++) sum += kf->FP.data[i][k]*kf->F.data[j][k];
+			kf->P.data[i][j] = sum;
+			kf->P.data[j][i] = sum;
+		}
+	}
+	kf->steps++;
+	return 0;
+}
+
+/*******************************************************************************
+* int kalman_update(kalman_filter_t* kf, vector_t z)
+*
+* Standard measurement update with innovation z - H*x.
+*******************************************************************************/
+int kalman_update(kalman_filter_t* kf, vector_t z){
+	int i, k;
+	float sum;
+	if(kf->initialized!=1){
+		report_error("ERROR: kalman filter not initialized yet\n");
+		return -1;
+	}
+	if(!z.initialized || z.len!=kf->nz){
+		report_error("ERROR: kalman measurement must have length %d\n", kf->nz);
+		return -1;
+	}
+	for(i=0;i<kf->nz;i++){
+		sum = z.data[i];
+		for(k=0;k<kf->nx;k++) sum -= kf->H.data[i][k]*kf->x.data[k];
+		kf->y.data[i] = sum;
+	}
+	return kalman_update_innovation(kf, kf->y);
+}
+
+/*******************************************************************************
+* int kalman_update_innovation(kalman_filter_t* kf, vector_t y)
+*
+* Measurement update from an innovation the caller already computed, such as
+* z - h(x) in an EKF with the Jacobian of h in H. S = H*P*H' + R is factored
+* by Cholesky and S*K' = H*P solved for the gain K, then x += K*y and
+* P -= K*H*P. Returns -1 and leaves the state alone if S is not positive
+* definite.
+*******************************************************************************/
+int kalman_update_innovation(kalman_filter_t* kf, vector_t y){
+	int i, j, k, nx = kf->nx, nz = kf->nz;
+	float sum;
+	if(kf->initialized!=1){
+		report_error("ERROR: kalman filter not initialized yet\n");
+		return -1;
+	}
+	if(!y.initialized || y.len!=nz){
+		report_error("ERROR: kalman innovation must have length %d\n", nz);
+		return -1;
+	}
+	if(y.data!=kf->y.data) memcpy(kf->y.data, y.data, nz*sizeof(float));
+
+	multiply_matrices_into(kf->H, kf->P, &kf->HP);
+	for(i=0;i<nz;i++){
+		for(j=i;j<nz;j++){
+			sum = kf->R.data[i][j];
+			for(k=0;k<nx;k++) sum += kf->HP.data[i][k]*kf->H.data[j][k];
+			kf->S.data[i][j] = sum;
+			kf->S.data[j][i] = sum;
+		}
+	}
+	if(spd_solve_matrix(kf->S, kf->HP, &kf->Kt, &kf->ws)<0) return -1;
+
+	// x += K*y with K = Kt'
+	for(i=0;i<nx;i++){
+		for(k=0;k<nz;k++) kf->x.data[i] += kf->Kt.data[k][i]*kf->y.data[k];
+	}
+	// P -= K*HP, symmetric so compute the upper triangle and mirror it
+	for(i=0;i<nx;i++){
+		for(j=i;j<nx;j++){
+			sum = 0.0f;
+			for(k=0;k<nz;k++) sum += kf->Kt.data[k][i]*kf->HP.data[k][j];
+			kf->P.data[i][j] -= sum;
+			if(j!=i) kf->P.data[j][i] = kf->P.data[i][j];
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int kalman_update_sequential(kalman_filter_t* kf, vector_t z)
+*
+* Processes the measurements one at a time as scalar updates, which needs no
+* matrix solve at all: with h row i of H, s = h*P*h' + R[i][i] and the gain is
+* P*h'/s. This equals kalman_update only when R is diagonal, off diagonal
+* entries are ignored. Measurements whose s is not positive are skipped and
+* the count of those is returned, 0 when all were used.
+*******************************************************************************/
+int kalman_update_sequential(kalman_filter_t* kf, vector_t z){
+	int i, j, k, m, nx = kf->nx, skipped = 0;
+	float s, innov, sum;
+	float* h;
+	if(kf->initialized!=1){
+		report_error("ERROR: kalman filter not initialized yet\n");
+		return -1;
+	}
+	if(!z.initialized || z.len!=kf->nz){
+		report_error("ERROR: kalman measurement must have length %d\n", kf->nz);
+		return -1;
+	}
+	for(m=0;m<kf->nz;m++){
+		h = kf->H.data[m];
+		// ph = P*h', P is symmetric so this is also h*P
+		s = kf->R.data[m][m];
+		innov = z.data[m];
+		for(i=0;i<nx;i++){
+			sum = 0.0f;
+			for(k=0;k<nx;k++) sum += kf->P.data[i][k]*h[k];
+			kf->ph.data[i] = sum;
+			s += h[i]*sum;
+			innov -= h[i]*kf->x.data[i];
+		}
+		if(s<=0.0f){
+			skipped++;
+			continue;
+		}
+		for(i=0;i<nx;i++){
+			kf->x.data[i] += kf->ph.data[i]*innov/s;
+			for(j=i;j<nx;j++){
+				kf->P.data[i][j] -= kf->ph.data[i]*kf->ph.data[j]/s;
+				if(j!=i) kf->P.data[j][i] = kf->P.data[i][j];
+			}
+		}
+	}
+	return skipped;
+}
+
+/*******************************************************************************
+* int kalman_ws_matrix_bytes(int rows, int cols)
+*
+* workspace needed for one rows x cols matrix including its row pointers
+*******************************************************************************/
+int kalman_ws_matrix_bytes(int rows, int cols){
+	return rows*sizeof(float*) + rows*cols*sizeof(float) + 2*KALMAN_WS_SLACK;
+}
@@ -5,12 +5,25 @@
 *******************************************************************************/
 
 #include "../roboticscape.h"
+#include "algebra_kernels.h"
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h> // for memset
 
 #define PI (float)M_PI
+#define SMALL_MATRIX_EPSILON 1e-12	// same singular test as mat3_invert
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* workspace_alloc(la_workspace_t* ws, int bytes);
+int poly_conv_in_place(float* p, int np, const float* q, int nq);
+float small_matrix_determinant(matrix_t A);
+int invert_small_matrix(matrix_t A, matrix_t* out);
+int LU_invert_into(matrix_t LU, const int* perm, matrix_t* out);
+void ellipsoid_fit_terms(ellipsoid_fit_t* fit, float x, float y, float z, \
+															double* a);
 
 /*******************************************************************************
 * matrix_t create_matrix(int rows, int cols)
@@ -35,6 +48,7 @@ matrix_t create_matrix(int rows, int cols){
 		A.data[i] = (float*)(ptr + i*cols*sizeof(float));
 	}	
 	
+	A.view = NOT_A_VIEW;
 	A.initialized = 1;
 	return A;
 }
@@ -42,12 +56,16 @@ matrix_t create_matrix(int rows, int cols){
 /*******************************************************************************
 * void destroy_matrix(matrix_t* A)
 *
-* 
+* Frees whatever memory the matrix owns. Views only own their row pointers,
+* never the entries they point to.
 *******************************************************************************/
 void destroy_matrix(matrix_t* A){
 	if(A->initialized==1 && A->rows>0 && A->cols>0){
-		free(A->data[0]);
-		free(A->data);
+		if(A->view==NOT_A_VIEW){
+			free(A->data[0]);
+			free(A->data);
+		}
+		else if(A->view==VIEW_OWNS_ROW_PTRS) free(A->data);
 	}
 	A->data = 0;
 	A->rows = 0;
@@ -105,18 +123,13 @@ matrix_t create_square_matrix(int n){
 * 
 *******************************************************************************/
 matrix_t create_random_matrix(int rows, int cols){
-	int i,j;
 	matrix_t A;
 	if(rows<1 || cols<1){
 		printf("error creating matrix, row or col must be >=1");
 		return A;
 	}
 	A = create_matrix(rows, cols);
-	for(i=0;i<rows;i++){
-		for(j=0;j<cols;j++){
-			A.data[i][j]=get_random_float();
-		}
-	}
+	fill_random_floats(A.data[0], rows*cols);
 	return A;
 }
 
@@ -226,6 +239,125 @@ float get_matrix_entry(matrix_t A, int row, int col){
 	return  A.data[row][col];
 }
 
+/*******************************************************************************
+* matrix_t create_matrix_view(float* data, int rows, int cols)
+*
+* Wraps an existing contiguous row-major array of rows*cols floats as a matrix
+* without copying. Only the small array of row pointers is allocated. The 
+* caller keeps ownership of data which must outlive the view.
+*******************************************************************************/
+matrix_t create_matrix_view(float* data, int rows, int cols){
+	int i;
+	matrix_t A = create_empty_matrix();
+	if(rows<1 || cols<1){
+		printf("error creating matrix view, row or col must be >=1");
+		return A;
+	}
+	if(data==NULL){
+		printf("ERROR: can't create matrix view of NULL data\n");
+		return A;
+	}
+	A.data = (float**)malloc(rows*sizeof(float*));
+	for(i=0;i<rows;i++) A.data[i] = data + i*cols;
+	A.rows = rows;
+	A.cols = cols;
+	A.view = VIEW_OWNS_ROW_PTRS;
+	A.initialized = 1;
+	return A;
+}
+
+/*******************************************************************************
+* matrix_t create_submatrix_view(matrix_t A, int row, int col, int rows,
+*																	int cols)
+*
+* Returns a rows x cols window into A starting at (row,col). Writes through the
+* view modify A. Only the row pointers are allocated.
+*******************************************************************************/
+matrix_t create_submatrix_view(matrix_t A, int row, int col, int rows, int cols){
+	int i;
+	matrix_t out = create_empty_matrix();
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return out;
+	}
+	if(rows<1 || cols<1 || row<0 || col<0 || row+rows>A.rows || \
+													col+cols>A.cols){
+		printf("ERROR: submatrix view out of bounds\n");
+		return out;
+	}
+	out.data = (float**)malloc(rows*sizeof(float*));
+	for(i=0;i<rows;i++) out.data[i] = A.data[row+i] + col;
+	out.rows = rows;
+	out.cols = cols;
+	out.view = VIEW_OWNS_ROW_PTRS;
+	out.initialized = 1;
+	return out;
+}
+
+/*******************************************************************************
+* matrix_t matrix_row_view(matrix_t A, int row, int rows)
+*
+* Returns a view of a contiguous band of full rows of A. This reuses A's own
+* row pointers so nothing is allocated at all.
+*******************************************************************************/
+matrix_t matrix_row_view(matrix_t A, int row, int rows){
+	matrix_t out = create_empty_matrix();
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return out;
+	}
+	if(rows<1 || row<0 || row+rows>A.rows){
+		printf("ERROR: row view out of bounds\n");
+		return out;
+	}
+	out.data = &A.data[row];
+	out.rows = rows;
+	out.cols = A.cols;
+	out.view = VIEW_BORROWED;
+	out.initialized = 1;
+	return out;
+}
+
+/*******************************************************************************
+* vector_t matrix_row_as_vector(matrix_t A, int row)
+*
+* Returns a vector view of one row of A without copying or allocating.
+*******************************************************************************/
+vector_t matrix_row_as_vector(matrix_t A, int row){
+	vector_t v = create_empty_vector();
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return v;
+	}
+	if(row<0 || row>=A.rows){
+		printf("ERROR: row out of bounds\n");
+		return v;
+	}
+	v.data = A.data[row];
+	v.len = A.cols;
+	v.view = VIEW_BORROWED;
+	v.initialized = 1;
+	return v;
+}
+
+/*******************************************************************************
+* vector_t create_vector_view(float* data, int len)
+*
+* Wraps an existing array as a vector without copying or allocating.
+*******************************************************************************/
+vector_t create_vector_view(float* data, int len){
+	vector_t v = create_empty_vector();
+	if(len<1 || data==NULL){
+		printf("ERROR: invalid vector view\n");
+		return v;
+	}
+	v.data = data;
+	v.len = len;
+	v.view = VIEW_BORROWED;
+	v.initialized = 1;
+	return v;
+}
+
 /*******************************************************************************
 * void print_matrix(matrix_t A)
 *
@@ -285,6 +417,7 @@ vector_t create_vector(int n){
 	}
 	v.len = n;
 	v.data = (float*)calloc(n, sizeof(float));
+	v.view = NOT_A_VIEW;
 	v.initialized = 1;
 	return v;
 }
@@ -295,7 +428,7 @@ vector_t create_vector(int n){
 * 
 *******************************************************************************/
 void destroy_vector(vector_t* v){
-	if(v->initialized==1){
+	if(v->initialized==1 && v->view==NOT_A_VIEW){
 		free(v->data);
 	}
 	v->len = 0;
@@ -340,16 +473,13 @@ vector_t duplicate_vector(vector_t v){
 * 
 *******************************************************************************/
 vector_t create_random_vector(int len){
-	int i;
 	vector_t v = create_empty_vector();
 	if(len<1){
 		printf("error creating vector, len must be >=1");
 		return v;
 	}
 	v = create_vector(len);
-	for(i=0;i<len;i++){
-		v.data[i]=get_random_float();
-	}
+	fill_random_floats(v.data, len);
 	return v;
 }
 
@@ -472,8 +602,6 @@ void print_vector_sci_notation(vector_t v){
 * 
 *******************************************************************************/
 matrix_t multiply_matrices(matrix_t A, matrix_t B){
-	int i,j,k;
-	float sum = 0;
 	matrix_t out = create_empty_matrix();
 	if(!A.initialized||!B.initialized){
 		printf("ERROR: matrix not initialized yet\n");
@@ -484,17 +612,7 @@ matrix_t multiply_matrices(matrix_t A, matrix_t B){
 		return out;
 	}
 	out = create_matrix(A.rows, B.cols);	
-	for(i=0;i<(A.rows);i++){
-		for(j=0;j<(B.cols);j++){	
-			for(k=0;k<(A.cols);k++){
-				// do the matrix multiplication
-				sum = sum + A.data[i][k]*B.data[k][j];
-			}
-			// save mult sum to new location
-			out.data[i][j] = sum;
-			sum = 0; 	// re-initialize sum for next loop
-		}
-	}
+	multiply_matrices_into(A, B, &out);
 	return out;
 }
 
@@ -540,7 +658,6 @@ int vector_times_scalar(vector_t* v, float s){
 * 
 *******************************************************************************/
 vector_t matrix_times_col_vec(matrix_t A, vector_t v){
-	int i,j;
 	vector_t out = create_empty_vector();
 	if(!A.initialized || !v.initialized){
 		printf("ERROR: matrix or vector not initialized yet\n");
@@ -551,12 +668,7 @@ vector_t matrix_times_col_vec(matrix_t A, vector_t v){
 		return out;
 	}
 	out = create_vector(A.rows);
-	
-	for(i=0;i<A.rows;i++){
-		for(j=0;j<A.cols;j++){	
-			out.data[i] += v.data[j]*A.data[i][j];
-		}
-	}
+	matrix_times_col_vec_into(A, v, &out);
 	return out;
 }
 
@@ -646,16 +758,11 @@ int transpose_matrix(matrix_t* A){
 * magnitude or length.
 *******************************************************************************/
 float vector_norm(vector_t v){
-	float out = 0;
-	int i;
 	if(!v.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return -1;
 	}
-	for(i=0;i<v.len;i++){
-		out = out + v.data[i]*v.data[i];
-	}
-	return sqrt(out);
+	return sqrt(kernel_dot(v.data, v.data, v.len));
 }
 
 /*******************************************************************************
@@ -715,8 +822,6 @@ matrix_t vector_outer_product(vector_t v1, vector_t v2){
 * 
 *******************************************************************************/
 float vector_dot_product(vector_t v1, vector_t v2){
-	float out;
-	int i;
 	if(!v1.initialized || !v2.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return -1;
@@ -725,10 +830,7 @@ float vector_dot_product(vector_t v1, vector_t v2){
 		printf("ERROR: vector dimensions do not match\n");
 		return -1;
 	}
-	for(i=0; i<v1.len; i++){
-		out = out + (v1.data[i] * v2.data[i]);
-	}
-	return out;
+	return kernel_dot(v1.data, v2.data, v1.len);
 }
 
 /*******************************************************************************
@@ -761,21 +863,12 @@ vector_t cross_product_3d(vector_t v1, vector_t v2){
 *******************************************************************************/
 vector_t poly_conv(vector_t v1, vector_t v2){
 	vector_t out = create_empty_vector();
-	int m,n,i,j,k;
 	if(!v1.initialized || !v2.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return out;
 	}
-	m = v1.len;
-	n = v2.len;
-	k = m+n-1;
-	out = create_vector(k);
-	
-	for(i=0;i<m;i++){
-		for(j=0;j<n;j++){
-			out.data[i+j] += v1.data[i] * v2.data[j];
-		}
-	}
+	out = create_vector(v1.len+v2.len-1);
+	if(poly_conv_into(v1, v2, &out)<0) destroy_vector(&out);
 	return out;	
 }
 
@@ -786,7 +879,6 @@ vector_t poly_conv(vector_t v1, vector_t v2){
 *******************************************************************************/
 vector_t poly_power(vector_t v, int N){
 	vector_t out = create_empty_vector();
-	int i;
 	if(!v.initialized){
 		printf("ERROR: vector not initialized yet\n");
 		return out;
@@ -795,21 +887,8 @@ vector_t poly_power(vector_t v, int N){
 		printf("ERROR: no negative exponents\n");
 		return out;
 	}
-	if(N == 0){
-		out = create_vector(1);
-		out.data[0] = 1;
-		return out;
-	}	
-	out = duplicate_vector(v);
-	if(N == 1){
-		return out;
-	}
-	vector_t temp;
-	for(i=2;i<=N;i++){
-		temp = poly_conv(out, v);
-		out  = duplicate_vector(temp);
-		destroy_vector(&temp);
-	}
+	out = create_vector(((v.len-1)*N)+1);
+	if(poly_power_into(v, N, &out)<0) destroy_vector(&out);
 	return out;
 }
 
@@ -820,9 +899,7 @@ vector_t poly_power(vector_t v, int N){
 *  or order N and cutoff wc (rad/s)
 *******************************************************************************/
 vector_t poly_butter(int N, float wc){
-	int i;
 	vector_t filter = create_empty_vector();
-	vector_t P2, P3, temp;
 	if(N < 1){
 		printf("ERROR: order must be > 1\n");
 		return filter;
@@ -831,38 +908,114 @@ vector_t poly_butter(int N, float wc){
 		printf("ERROR: order must be <= 10 to prevent overflow\n");
 		return filter;
 	}
-	filter = create_vector(1);
-	filter.data[0] = 1;
-	P2 = create_vector(2);
-	P3 = create_vector(3);
-	if(N%2 == 0){
-		for(i=1;i<=N/2;i++){
-			P3.data[0] = 1/(wc*wc);
-			P3.data[1] = -2*cos((2*i + N - 1)*PI/(2*N))/wc;
-			P3.data[2] = 1;
-			temp = duplicate_vector(filter);
-			filter = poly_conv(temp,P3);
-			destroy_vector(&temp);
+	filter = create_vector(N+1);
+	if(poly_butter_into(N, wc, &filter)<0) destroy_vector(&filter);
+	return filter;
+}
+
+/*******************************************************************************
+* int poly_conv_in_place(float* p, int np, const float* q, int nq)
+*
+* p = p*q for coefficients highest power first. p must have room for
+* np+nq-1 entries. Output entry k only depends on p[k-nq+1..k], so working 
+* down from the top overwrites each entry after its last use. Returns the new
+* length.
+*******************************************************************************/
+int poly_conv_in_place(float* p, int np, const float* q, int nq){
+	int j, k, n = np+nq-1;
+	float sum;
+	for(k=n-1;k>=0;k--){
+		sum = 0;
+		for(j=0;j<nq;j++){
+			if(k-j<0) break;
+			if(k-j<np) sum += q[j]*p[k-j];
 		}
+		p[k] = sum;
 	}
-	if(N%2 == 1){	
-		P2.data[0] = 1/wc;
-		P2.data[1] = 1;
-		temp = duplicate_vector(filter);
-		filter = poly_conv(temp,P2);
-		destroy_vector(&temp);
-		for(i=1;i<=(N-1)/2;i++){
-			P3.data[0] = 1/(wc*wc);
-			P3.data[1] = -2*cos((2*i + N - 1)*PI/(2*N))/wc;
-			P3.data[2] = 1;
-			temp = duplicate_vector(filter);
-			filter = poly_conv(temp,P3);
-			destroy_vector(&temp);
-		}
+	return n;
+}
+
+/*******************************************************************************
+* int poly_conv_into(vector_t v1, vector_t v2, vector_t* out)
+*
+* out must have length v1.len+v2.len-1 and may be the same memory as v1.
+*******************************************************************************/
+int poly_conv_into(vector_t v1, vector_t v2, vector_t* out){
+	if(!v1.initialized || !v2.initialized || !out->initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
 	}
-	destroy_vector(&P2);
-	destroy_vector(&P3);
-	return filter;
+	if(out->len != v1.len+v2.len-1){
+		printf("ERROR: poly_conv output must have length %d\n", \
+													v1.len+v2.len-1);
+		return -1;
+	}
+	if(out->data!=v1.data) memmove(out->data, v1.data, v1.len*sizeof(float));
+	poly_conv_in_place(out->data, v1.len, v2.data, v2.len);
+	return 0;
+}
+
+/*******************************************************************************
+* int poly_power_into(vector_t v, int N, vector_t* out)
+*
+* out must have length (v.len-1)*N+1 and not share memory with v.
+*******************************************************************************/
+int poly_power_into(vector_t v, int N, vector_t* out){
+	int i, len;
+	if(!v.initialized || !out->initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
+	}
+	if(N < 0){
+		printf("ERROR: no negative exponents\n");
+		return -1;
+	}
+	if(out->len != ((v.len-1)*N)+1){
+		printf("ERROR: poly_power output must have length %d\n", \
+													((v.len-1)*N)+1);
+		return -1;
+	}
+	out->data[0] = 1;
+	len = 1;
+	for(i=0;i<N;i++) len = poly_conv_in_place(out->data, len, v.data, v.len);
+	return 0;
+}
+
+/*******************************************************************************
+* int poly_butter_into(int N, float wc, vector_t* out)
+*
+* out must have length N+1. Built one first or second order factor at a time
+* in out itself.
+*******************************************************************************/
+int poly_butter_into(int N, float wc, vector_t* out){
+	float P2[2], P3[3];
+	int i, len;
+	if(N < 1){
+		printf("ERROR: order must be > 1\n");
+		return -1;
+	}
+	if(N > 10){
+		printf("ERROR: order must be <= 10 to prevent overflow\n");
+		return -1;
+	}
+	if(!out->initialized || out->len != N+1){
+		printf("ERROR: poly_butter output must have length %d\n", N+1);
+		return -1;
+	}
+	out->data[0] = 1;
+	len = 1;
+	if(N%2 == 1){
+		P2[0] = 1/wc;
+		P2[1] = 1;
+		len = poly_conv_in_place(out->data, len, P2, 2);
+	}
+	for(i=1;i<=N/2;i++){
+		P3[0] = 1/(wc*wc);
+		P3[1] = -2*cos((2*i + N - 1)*PI/(2*N))/wc;
+		P3[2] = 1;
+		len = poly_conv_in_place(out->data, len, P3, 3);
+	}
+	return 0;
 }
 
 /*******************************************************************************
@@ -916,11 +1069,14 @@ float vector_mean(vector_t v){
 /*******************************************************************************
 * float matrix_determinant(matrix_t A)
 *
-* 
+* Written out for sizes up to 4x4, otherwise the product of the pivots of a
+* partial pivoting LU factorization of a copy of A.
 *******************************************************************************/
 float matrix_determinant(matrix_t A){
-	int i,j,k;
-	float ratio, det;
+	int i, sign;
+	float det;
+	int* perm;
+	matrix_t temp;
 	if(!A.initialized){
 		printf("ERROR: matrix not initialized yet\n");
 		return -1;
@@ -929,22 +1085,140 @@ float matrix_determinant(matrix_t A){
 		printf("Error: Matrix is not square\n");
 		return -1;
 	}
-	matrix_t temp = duplicate_matrix(A);
-	for(i=0;i<A.rows;i++){
-        for(j=0;j<A.rows;j++){
-            if(j>i){
-				ratio = temp.data[j][i]/temp.data[i][i];
-                for(k=0;k<A.rows;k++){
-                    temp.data[j][k] = temp.data[j][k] - ratio * temp.data[i][k];
-                }
-            }
-        }
-    }
-	det = 1; //storage for determinant
-    for(i=0;i<A.rows;i++) det = det*temp.data[i][i];
-
+	if(A.rows<=4) return small_matrix_determinant(A);
+	temp = duplicate_matrix(A);
+	perm = (int*)malloc(A.rows*sizeof(int));
+	if(LU_decomposition_inplace(&temp, perm, &sign)<0) det = 0;
+	else{
+		det = sign;
+		for(i=0;i<A.rows;i++) det = det*temp.data[i][i];
+	}
+	free(perm);
 	destroy_matrix(&temp);
-    return det;  
+	return det;  
+}
+
+/*******************************************************************************
+* float small_matrix_determinant(matrix_t A)
+*
+* 1x1 to 4x4 only, read through the row pointers so views work.
+*******************************************************************************/
+float small_matrix_determinant(matrix_t A){
+	mat3_t a3;
+	mat4_t a4;
+	int i;
+	switch(A.rows){
+	case 1:
+		return A.data[0][0];
+	case 2:
+		return A.data[0][0]*A.data[1][1] - A.data[0][1]*A.data[1][0];
+	case 3:
+		for(i=0;i<3;i++) memcpy(a3.d[i], A.data[i], 3*sizeof(float));
+		return mat3_determinant(a3);
+	case 4:
+		for(i=0;i<4;i++) memcpy(a4.d[i], A.data[i], 4*sizeof(float));
+		return mat4_determinant(a4);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int invert_small_matrix(matrix_t A, matrix_t* out)
+*
+* Closed form inverse of a 1x1 to 4x4 matrix into out, which may be A. 
+* Returns -1 if the determinant is below SMALL_MATRIX_EPSILON and leaves out
+* alone, callers fall back to LU so that only rejects truly singular input.
+*******************************************************************************/
+int invert_small_matrix(matrix_t A, matrix_t* out){
+	mat3_t a3;
+	mat4_t a4;
+	float a, b, c, d, det;
+	int i;
+	switch(A.rows){
+	case 1:
+		if(fabs(A.data[0][0]) < SMALL_MATRIX_EPSILON) return -1;
+		out->data[0][0] = 1.0f/A.data[0][0];
+		return 0;
+	case 2:
+		a = A.data[0][0];
+		b = A.data[0][1];
+		c = A.data[1][0];
+		d = A.data[1][1];
+		det = a*d - b*c;
+		if(fabs(det) < SMALL_MATRIX_EPSILON) return -1;
+		det = 1.0f/det;
+		out->data[0][0] =  d*det;
+		out->data[0][1] = -b*det;
+		out->data[1][0] = -c*det;
+		out->data[1][1] =  a*det;
+		return 0;
+	case 3:
+		for(i=0;i<3;i++) memcpy(a3.d[i], A.data[i], 3*sizeof(float));
+		if(mat3_invert_batch(&a3, &a3, 1)) return -1;
+		for(i=0;i<3;i++) memcpy(out->data[i], a3.d[i], 3*sizeof(float));
+		return 0;
+	case 4:
+		for(i=0;i<4;i++) memcpy(a4.d[i], A.data[i], 4*sizeof(float));
+		if(mat4_invert_batch(&a4, &a4, 1)) return -1;
+		for(i=0;i<4;i++) memcpy(out->data[i], a4.d[i], 4*sizeof(float));
+		return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int LU_decomposition_inplace(matrix_t* A, int* perm, int* sign)
+*
+* Doolittle LU with partial pivoting, overwriting square A with U on and 
+* above the diagonal and the multipliers of unit lower triangular L below it
+* so that PA = LU. perm[i] is the row of the original A now in row i and 
+* sign is the determinant of P. Returns -1 if a pivot is zero.
+*******************************************************************************/
+int LU_decomposition_inplace(matrix_t* A, int* perm, int* sign){
+	int i, j, k, p, n;
+	float max, ratio;
+	float* row;
+	if(!A->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A->rows != A->cols){
+		printf("ERROR: matrix is not square\n");
+		return -1;
+	}
+	n = A->rows;
+	*sign = 1;
+	for(i=0;i<n;i++) perm[i] = i;
+	for(k=0;k<n;k++){
+		p = k;
+		max = fabs(A->data[k][k]);
+		for(i=k+1;i<n;i++){
+			if(fabs(A->data[i][k]) > max){
+				max = fabs(A->data[i][k]);
+				p = i;
+			}
+		}
+		if(max==0) return -1;
+		// swap entries rather than row pointers so views keep their layout
+		if(p != k){
+			for(j=0;j<n;j++){
+				ratio = A->data[p][j];
+				A->data[p][j] = A->data[k][j];
+				A->data[k][j] = ratio;
+			}
+			i = perm[p];
+			perm[p] = perm[k];
+			perm[k] = i;
+			*sign = -*sign;
+		}
+		row = A->data[k];
+		for(i=k+1;i<n;i++){
+			ratio = A->data[i][k]/row[k];
+			A->data[i][k] = ratio;
+			for(j=k+1;j<n;j++) A->data[i][j] -= ratio*row[j];
+		}
+	}
+	return 0;
 }
 
 /*******************************************************************************
@@ -1087,12 +1361,13 @@ int QR_decomposition(matrix_t A, matrix_t* Q, matrix_t* R){
 /*******************************************************************************
 * matrix_t invert_matrix(matrix_t A)
 *
-* Invert Matrix function based on LUP decomposition and then forward and
-* backward substitution.
+* Closed form up to 4x4, otherwise LU decomposition with partial pivoting
+* and then forward and backward substitution.
 *******************************************************************************/
 matrix_t invert_matrix(matrix_t A){
-	int i,j,k,m;
-	matrix_t L,U,P,D,temp;
+	int sign;
+	int* perm;
+	matrix_t LU;
 	matrix_t out = create_empty_matrix();
 	if(!A.initialized){
 		printf("ERROR: matrix not initialized yet\n");
@@ -1102,38 +1377,112 @@ matrix_t invert_matrix(matrix_t A){
 		printf("ERROR: matrix is not square\n");
 		return out;
 	}
-	if(matrix_determinant(A) == 0){
+	out = create_square_matrix(A.rows);
+	// the closed forms use an absolute determinant threshold, a matrix that
+	// is merely small-scaled falls through to the pivoted LU instead
+	if(A.rows<=4 && invert_small_matrix(A, &out)==0) return out;
+	LU = duplicate_matrix(A);
+	perm = (int*)malloc(A.rows*sizeof(int));
+	if(LU_decomposition_inplace(&LU, perm, &sign)<0){
 		printf("ERROR: matrix is singular, not invertible\n");
-		return out;
+		destroy_matrix(&out);
 	}
-	m = A.cols;
-	LUP_decomposition(A,&L,&U,&P);
-	D    = create_identity_matrix(m);
-	temp = create_square_matrix(m);
+	else LU_invert_into(LU, perm, &out);
+	free(perm);
+	destroy_matrix(&LU);
+	return out;
+}
 
+/*******************************************************************************
+* int LU_invert_into(matrix_t LU, const int* perm, matrix_t* out)
+*
+* Inverse from the factors left by LU_decomposition_inplace, each column by
+* forward and back substitution straight into out.
+*******************************************************************************/
+int LU_invert_into(matrix_t LU, const int* perm, matrix_t* out){
+	int i,j,k,m;
+	float sum;
+	m = LU.rows;
 	for(j=0;j<m;j++){
+		// L y = P e_j
 		for(i=0;i<m;i++){
-			for(k=0;k<i;k++){
-				D.data[i][j] -= L.data[i][k] * D.data[k][j];
-			}
+			sum = (perm[i]==j) ? 1 : 0;
+			for(k=0;k<i;k++) sum -= LU.data[i][k] * out->data[k][j];
+			out->data[i][j] = sum;
 		}
-		for(i=m-1;i>=0;i--){				// backwards.. last to first
-			temp.data[i][j] = D.data[i][j];
-			for(k=i+1;k<m;k++){	
-				temp.data[i][j] -= U.data[i][k] * temp.data[k][j];
-			}
-			temp.data[i][j] = temp.data[i][j] / U.data[i][i];
+		// U x = y, backwards.. last to first
+		for(i=m-1;i>=0;i--){
+			sum = out->data[i][j];
+			for(k=i+1;k<m;k++) sum -= LU.data[i][k] * out->data[k][j];
+			out->data[i][j] = sum / LU.data[i][i];
 		}
 	}
-	// multiply by permutation matrix
-	out = multiply_matrices(temp, P);		
-	// free allocation	
-	destroy_matrix(&temp);	
-	destroy_matrix(&L);		
-	destroy_matrix(&U);
-	destroy_matrix(&P);
-	destroy_matrix(&D);
-	return out;
+	return 0;
+}
+
+/*******************************************************************************
+* matrix_t matrix_exponential(matrix_t A)
+*
+* e^A by scaling and squaring: A is halved until its norm is below 0.5, the
+* Taylor series is summed to 12 terms which is beyond float precision there,
+* and the result squared back up. Used to discretize continuous time systems.
+*******************************************************************************/
+matrix_t matrix_exponential(matrix_t A){
+	int i, j, k, m, n, s;
+	float norm, row, scale;
+	matrix_t term, next, sum, tmp;
+	matrix_t out = create_empty_matrix();
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return out;
+	}
+	if(A.cols != A.rows){
+		printf("ERROR: matrix is not square\n");
+		return out;
+	}
+	n = A.rows;
+	// infinity norm picks how many times to halve
+	norm = 0.0f;
+	for(i=0;i<n;i++){
+		row = 0.0f;
+		for(j=0;j<n;j++) row += fabs(A.data[i][j]);
+		if(row>norm) norm = row;
+	}
+	s = 0;
+	while(norm>0.5f && s<64){
+		norm *= 0.5f;
+		s++;
+	}
+	scale = ldexpf(1.0f, -s);
+	
+	sum = create_identity_matrix(n);
+	term = create_identity_matrix(n);
+	next = create_square_matrix(n);
+	for(k=1;k<=12;k++){
+		// term = term*A*scale/k
+		for(i=0;i<n;i++){
+			for(j=0;j<n;j++){
+				next.data[i][j] = 0.0f;
+				for(m=0;m<n;m++){
+					next.data[i][j] += term.data[i][m]*A.data[m][j];
+				}
+				next.data[i][j] *= scale/k;
+			}
+		}
+		tmp = term;
+		term = next;
+		next = tmp;
+		for(i=0;i<n;i++) for(j=0;j<n;j++) sum.data[i][j] += term.data[i][j];
+	}
+	for(k=0;k<s;k++){
+		multiply_matrices_into(sum, sum, &next);
+		tmp = sum;
+		sum = next;
+		next = tmp;
+	}
+	destroy_matrix(&term);
+	destroy_matrix(&next);
+	return sum;
 }
 
 /*******************************************************************************
@@ -1301,11 +1650,14 @@ vector_t lin_system_solve_qr(matrix_t A, vector_t b){
 * vector_t* lengths is a pointer to a user-created vector which will be 
 * populated with the 3 distances from the surface to the centroid in each of the 
 * 3 directions.
+*
+* This runs the rows through the streaming fitter below, use that directly to
+* avoid collecting the points at all.
 *******************************************************************************/
 int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths){
+	ellipsoid_fit_t fit;
+	float c[3], l[3];
 	int i,p;
-	matrix_t A;
-	vector_t b;
 	if(!points.initialized){
 		printf("ERROR: matrix_t points not initialized\n");
 		return -1;
@@ -1320,59 +1672,1041 @@ int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths){
 		return -1;
 	}
 	
-	b = create_vector_of_ones(p);
-	A = create_matrix(p,6);
+	init_ellipsoid_fit(&fit, 0, 1.0f);
 	for(i=0;i<p;i++){
-		A.data[i][0] = points.data[i][0] * points.data[i][0];
-		A.data[i][1] = points.data[i][0];
-		A.data[i][2] = points.data[i][1] * points.data[i][1];
-		A.data[i][3] = points.data[i][1];
-		A.data[i][4] = points.data[i][2] * points.data[i][2];
-		A.data[i][5] = points.data[i][2];
+		ellipsoid_fit_add_point(&fit, points.data[i][0], points.data[i][1], \
+														points.data[i][2]);
 	}
+	if(solve_ellipsoid_fit(&fit, c, l, NULL)<0) return -1;
 	
-	vector_t f = lin_system_solve_qr(A,b);
-	destroy_matrix(&A);
-	destroy_vector(&b);
-	
-	// compute center 
-	*center = create_vector(3);
-	center->data[0] = -f.data[1]/(2*f.data[0]);
-	center->data[1] = -f.data[3]/(2*f.data[2]);
-	center->data[2] = -f.data[5]/(2*f.data[4]);
-	
-	// Solve for lengths
-	A = create_square_matrix(3);
-	b = create_vector(3);
-	
-	// fill in A
-	A.data[0][0] = (f.data[0] * center->data[0] * center->data[0]) + 1.0;
-	A.data[0][1] = (f.data[0] * center->data[1] * center->data[1]);
-	A.data[0][2] = (f.data[0] * center->data[2] * center->data[2]);
-	
-	A.data[1][0] = (f.data[2] * center->data[0] * center->data[0]);
-	A.data[1][1] = (f.data[2] * center->data[1] * center->data[1]) + 1.0;
-	A.data[1][2] = (f.data[2] * center->data[2] * center->data[2]);
-	
-	A.data[2][0] = (f.data[4] * center->data[0] * center->data[0]);
-	A.data[2][1] = (f.data[4] * center->data[1] * center->data[1]);
-	A.data[2][2] = (f.data[4] * center->data[2] * center->data[2]) + 1.0;
-	
-	// fill in b
-	b.data[0] = f.data[0];
-	b.data[1] = f.data[2];
-	b.data[2] = f.data[4];
-
-	// solve for lengths
-	vector_t scales = lin_system_solve(A, b);
-	
-	*lengths = create_vector(3);
-	lengths->data[0] = 1.0/sqrt(scales.data[0]);
-	lengths->data[1] = 1.0/sqrt(scales.data[1]);
-	lengths->data[2] = 1.0/sqrt(scales.data[2]);
-	// cleanup
-	destroy_vector(&scales);
-	destroy_matrix(&A);
-	destroy_vector(&b);
+	*center = create_vector_from_array(3, c);
+	*lengths = create_vector_from_array(3, l);
 	return 0;
 }
+
+/*******************************************************************************
+* Streaming ellipsoid fit
+*
+* Each point contributes one row a of the least squares problem a*v = 1, with
+* a = [x^2 y^2 z^2 2xy 2xz 2yz 2x 2y 2z] for the full quadric or just the
+* squares and linear terms for the axis aligned fit. Rather than keeping the
+* rows we add a'a and a' into the normal equations as points arrive and solve
+* the small symmetric system when asked. Accumulation is done in doubles since
+* forming a'a squares the condition number.
+*******************************************************************************/
+
+/*******************************************************************************
+* void ellipsoid_fit_terms(ellipsoid_fit_t* fit, float x, float y, float z,
+*															double* a)
+*
+* Fills a with the row of quadric terms for one point, in the order the
+* solution vector uses.
+*******************************************************************************/
+void ellipsoid_fit_terms(ellipsoid_fit_t* fit, float x, float y, float z, \
+															double* a){
+	if(fit->full){
+		a[0] = (double)x*x;
+		a[1] = (double)y*y;
+		a[2] = (double)z*z;
+		a[3] = 2.0*x*y;
+		a[4] = 2.0*x*z;
+		a[5] = 2.0*y*z;
+		a[6] = 2.0*x;
+		a[7] = 2.0*y;
+		a[8] = 2.0*z;
+	}
+	else{
+		a[0] = (double)x*x;
+		a[1] = (double)y*y;
+		a[2] = (double)z*z;
+		a[3] = 2.0*x;
+		a[4] = 2.0*y;
+		a[5] = 2.0*z;
+	}
+	return;
+}
+
+/*******************************************************************************
+* int init_ellipsoid_fit(ellipsoid_fit_t* fit, int full, float forget)
+*
+* Zeroes the accumulators. full=1 fits rotated ellipsoids with cross terms,
+* 0 keeps the axes aligned with the coordinate system like fit_ellipsoid.
+* forget between 0 and 1 scales down everything accumulated before each new
+* point so old data fades out, 1 weighs all points equally.
+*******************************************************************************/
+int init_ellipsoid_fit(ellipsoid_fit_t* fit, int full, float forget){
+	if(forget<=0.0f || forget>1.0f){
+		printf("ERROR: ellipsoid fit forget factor must be in (0,1]\n");
+		return -1;
+	}
+	memset(fit, 0, sizeof(ellipsoid_fit_t));
+	fit->full = full ? 1 : 0;
+	fit->terms = full ? ELLIPSOID_FULL_TERMS : ELLIPSOID_ALIGNED_TERMS;
+	fit->forget = forget;
+	fit->initialized = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int ellipsoid_fit_add_point(ellipsoid_fit_t* fit, float x, float y, float z)
+*
+* Adds one point to the normal equations, only the upper triangle is kept.
+*******************************************************************************/
+int ellipsoid_fit_add_point(ellipsoid_fit_t* fit, float x, float y, float z){
+	double a[ELLIPSOID_FULL_TERMS];
+	int i, j, n;
+	
+	if(!fit->initialized){
+		printf("ERROR: ellipsoid fit not initialized\n");
+		return -1;
+	}
+	n = fit->terms;
+	ellipsoid_fit_terms(fit, x, y, z, a);
+	if(fit->forget<1.0f){
+		for(i=0;i<n;i++){
+			for(j=i;j<n;j++) fit->ata[i][j] *= fit->forget;
+			fit->atb[i] *= fit->forget;
+		}
+	}
+	for(i=0;i<n;i++){
+		for(j=i;j<n;j++) fit->ata[i][j] += a[i]*a[j];
+		fit->atb[i] += a[i];
+	}
+	fit->points++;
+	return 0;
+}
+
+/*******************************************************************************
+* int solve_ellipsoid_fit(ellipsoid_fit_t* fit, float center[3],
+*											float lengths[3], mat3_t* shape)
+*
+* Solves the normal equations accumulated so far by Gaussian elimination with
+* partial pivoting, leaving the accumulators untouched so more points can be
+* added and this called again. center is the fitted centroid and shape the
+* matrix M with (p-c)'M(p-c) = 1 on the surface, which may be NULL. lengths
+* are the distances from the centroid to the surface along each axis, the
+* semi-axis lengths in the aligned case. Returns -1 with too few points or if
+* the points don't describe an ellipsoid.
+*******************************************************************************/
+int solve_ellipsoid_fit(ellipsoid_fit_t* fit, float center[3], \
+											float lengths[3], mat3_t* shape){
+	double N[ELLIPSOID_FULL_TERMS][ELLIPSOID_FULL_TERMS+1];
+	double v[ELLIPSOID_FULL_TERMS];
+	double Q[3][3], g[3], c[3], det, inv[3][3], k, max, tmp;
+	int i, j, r, n, piv;
+	
+	if(!fit->initialized){
+		printf("ERROR: ellipsoid fit not initialized\n");
+		return -1;
+	}
+	n = fit->terms;
+	if(fit->points<(uint64_t)n){
+		printf("ERROR: ellipsoid fit needs at least %d points\n", n);
+		return -1;
+	}
+	
+	// fill in the lower triangle and the right hand side column
+	for(i=0;i<n;i++){
+		for(j=0;j<n;j++) N[i][j] = (j>=i) ? fit->ata[i][j] : fit->ata[j][i];
+		N[i][n] = fit->atb[i];
+	}
+	
+	// forward elimination
+	for(i=0;i<n;i++){
+		piv = i;
+		max = fabs(N[i][i]);
+		for(r=i+1;r<n;r++){
+			if(fabs(N[r][i])>max){
+				max = fabs(N[r][i]);
+				piv = r;
+			}
+		}
+		if(max<1e-30){
+			printf("ERROR: ellipsoid fit normal equations are singular\n");
+			return -1;
+		}
+		if(piv!=i){
+			for(j=i;j<=n;j++){
+				tmp = N[i][j];
+				N[i][j] = N[piv][j];
+				N[piv][j] = tmp;
+			}
+		}
+		for(r=i+1;r<n;r++){
+			k = N[r][i]/N[i][i];
+			for(j=i;j<=n;j++) N[r][j] -= k*N[i][j];
+		}
+	}
+	// back substitution
+	for(i=n-1;i>=0;i--){
+		v[i] = N[i][n];
+		for(j=i+1;j<n;j++) v[i] -= N[i][j]*v[j];
+		v[i] /= N[i][i];
+	}
+	
+	// quadric x'Qx + 2g'x = 1
+	memset(Q, 0, sizeof(Q));
+	Q[0][0] = v[0];
+	Q[1][1] = v[1];
+	Q[2][2] = v[2];
+	if(fit->full){
+		Q[0][1] = Q[1][0] = v[3];
+		Q[0][2] = Q[2][0] = v[4];
+		Q[1][2] = Q[2][1] = v[5];
+		g[0] = v[6];
+		g[1] = v[7];
+		g[2] = v[8];
+	}
+	else{
+		g[0] = v[3];
+		g[1] = v[4];
+		g[2] = v[5];
+	}
+	
+	// center is -inv(Q)*g
+	inv[0][0] = Q[1][1]*Q[2][2] - Q[1][2]*Q[2][1];
+	inv[0][1] = Q[0][2]*Q[2][1] - Q[0][1]*Q[2][2];
+	inv[0][2] = Q[0][1]*Q[1][2] - Q[0][2]*Q[1][1];
+	inv[1][0] = Q[1][2]*Q[2][0] - Q[1][0]*Q[2][2];
+	inv[1][1] = Q[0][0]*Q[2][2] - Q[0][2]*Q[2][0];
+	inv[1][2] = Q[0][2]*Q[1][0] - Q[0][0]*Q[1][2];
+	inv[2][0] = Q[1][0]*Q[2][1] - Q[1][1]*Q[2][0];
+	inv[2][1] = Q[0][1]*Q[2][0] - Q[0][0]*Q[2][1];
+	inv[2][2] = Q[0][0]*Q[1][1] - Q[0][1]*Q[1][0];
+	det = Q[0][0]*inv[0][0] + Q[0][1]*inv[1][0] + Q[0][2]*inv[2][0];
+	if(fabs(det)<1e-30){
+		printf("ERROR: fitted quadric has no center\n");
+		return -1;
+	}
+	for(i=0;i<3;i++){
+		c[i] = 0.0;
+		for(j=0;j<3;j++) c[i] -= inv[i][j]*g[j]/det;
+	}
+	
+	// moving to the center gives (p-c)'Q(p-c) = 1 + c'Qc
+	k = 1.0;
+	for(i=0;i<3;i++) for(j=0;j<3;j++) k += c[i]*Q[i][j]*c[j];
+	if(k<=0.0 || Q[0][0]<=0.0 || Q[1][1]<=0.0 || Q[2][2]<=0.0){
+		printf("ERROR: fitted quadric is not an ellipsoid\n");
+		return -1;
+	}
+	for(i=0;i<3;i++){
+		center[i] = c[i];
+		lengths[i] = sqrt(k/Q[i][i]);
+		if(shape!=NULL) for(j=0;j<3;j++) shape->d[i][j] = Q[i][j]/k;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* Workspaces and zero-allocation variants
+*
+* Everything above returns freshly allocated matrices and vectors which is 
+* convenient but means heap traffic every call. The functions below write into
+* storage the caller has already allocated, and the decompositions take their
+* scratch space from a la_workspace_t so nothing is malloc'd once running.
+*******************************************************************************/
+
+// keep workspace allocations aligned for float and pointer access and NEON
+#define WORKSPACE_ALIGN 16
+
+/*******************************************************************************
+* la_workspace_t create_la_workspace(int bytes)
+*
+* Allocates a block of scratch memory that matrices and vectors can be carved
+* out of with workspace_matrix and workspace_vector. Allocate once at startup.
+*******************************************************************************/
+la_workspace_t create_la_workspace(int bytes){
+	la_workspace_t ws;
+	memset(&ws,0,sizeof(la_workspace_t));
+	if(bytes<1){
+		printf("ERROR: workspace size must be >=1\n");
+		return ws;
+	}
+	ws.mem = (char*)calloc(bytes, 1);
+	if(ws.mem==NULL){
+		printf("ERROR: failed to allocate workspace\n");
+		return ws;
+	}
+	ws.size = bytes;
+	ws.used = 0;
+	ws.initialized = 1;
+	return ws;
+}
+
+/*******************************************************************************
+* int destroy_la_workspace(la_workspace_t* ws)
+*
+* Frees the workspace memory. Any matrices or vectors taken from it become
+* invalid.
+*******************************************************************************/
+int destroy_la_workspace(la_workspace_t* ws){
+	if(ws->initialized!=1) return -1;
+	free(ws->mem);
+	memset(ws,0,sizeof(la_workspace_t));
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_la_workspace(la_workspace_t* ws)
+*
+* Releases everything taken from the workspace at once so it can be reused.
+*******************************************************************************/
+int reset_la_workspace(la_workspace_t* ws){
+	if(ws->initialized!=1){
+		printf("ERROR: workspace not initialized yet\n");
+		return -1;
+	}
+	ws->used = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* void* workspace_alloc(la_workspace_t* ws, int bytes)
+*
+* local function to take an aligned chunk out of the workspace. Returns NULL
+* if there isn't enough room left.
+*******************************************************************************/
+void* workspace_alloc(la_workspace_t* ws, int bytes){
+	void* ptr;
+	int start = (ws->used + WORKSPACE_ALIGN-1) & ~(WORKSPACE_ALIGN-1);
+	if(ws->initialized!=1){
+		printf("ERROR: workspace not initialized yet\n");
+		return NULL;
+	}
+	if(start+bytes > ws->size){
+		printf("ERROR: workspace too small, need %d more bytes\n",\
+												start+bytes-ws->size);
+		return NULL;
+	}
+	ptr = ws->mem + start;
+	ws->used = start + bytes;
+	memset(ptr, 0, bytes);
+	return ptr;
+}
+
+/*******************************************************************************
+* matrix_t workspace_matrix(la_workspace_t* ws, int rows, int cols)
+*
+* Returns a zero-filled matrix whose memory lives in the workspace. 
+* destroy_matrix does nothing to it, reset or destroy the workspace instead.
+*******************************************************************************/
+matrix_t workspace_matrix(la_workspace_t* ws, int rows, int cols){
+	int i;
+	matrix_t A = create_empty_matrix();
+	if(rows<1 || cols<1){
+		printf("error creating matrix, row or col must be >=1");
+		return A;
+	}
+	float** rowptr = (float**)workspace_alloc(ws, rows*sizeof(float*));
+	if(rowptr==NULL) return A;
+	float* ptr = (float*)workspace_alloc(ws, rows*cols*sizeof(float));
+	if(ptr==NULL) return A;
+	for(i=0;i<rows;i++) rowptr[i] = ptr + i*cols;
+	A.rows = rows;
+	A.cols = cols;
+	A.data = rowptr;
+	A.view = VIEW_BORROWED;
+	A.initialized = 1;
+	return A;
+}
+
+/*******************************************************************************
+* vector_t workspace_vector(la_workspace_t* ws, int len)
+*
+* Returns a zero-filled vector whose memory lives in the workspace. 
+* destroy_vector does nothing to it, reset or destroy the workspace instead.
+*******************************************************************************/
+vector_t workspace_vector(la_workspace_t* ws, int len){
+	vector_t v = create_empty_vector();
+	if(len<1){
+		printf("error creating vector, n must be >=1");
+		return v;
+	}
+	v.data = (float*)workspace_alloc(ws, len*sizeof(float));
+	if(v.data==NULL) return v;
+	v.len = len;
+	v.view = VIEW_BORROWED;
+	v.initialized = 1;
+	return v;
+}
+
+/*******************************************************************************
+* int copy_matrix_into(matrix_t A, matrix_t* out)
+*
+* Copies the contents of A into an existing matrix of the same size.
+*******************************************************************************/
+int copy_matrix_into(matrix_t A, matrix_t* out){
+	int i;
+	if(!A.initialized || !out->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.rows!=out->rows || A.cols!=out->cols){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	for(i=0;i<A.rows;i++){
+		memcpy(out->data[i], A.data[i], A.cols*sizeof(float));
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int copy_vector_into(vector_t v, vector_t* out)
+*
+* Copies the contents of v into an existing vector of the same length.
+*******************************************************************************/
+int copy_vector_into(vector_t v, vector_t* out){
+	if(!v.initialized || !out->initialized){
+		printf("ERROR: vector not initialized yet\n");
+		return -1;
+	}
+	if(v.len!=out->len){
+		printf("ERROR: vector dimensions do not match\n");
+		return -1;
+	}
+	memcpy(out->data, v.data, v.len*sizeof(float));
+	return 0;
+}
+
+/*******************************************************************************
+* int multiply_matrices_into(matrix_t A, matrix_t B, matrix_t* out)
+*
+* out = A*B where out is already allocated with A.rows rows and B.cols columns.
+* out must not share memory with A or B.
+*******************************************************************************/
+int multiply_matrices_into(matrix_t A, matrix_t B, matrix_t* out){
+	int i,k;
+	if(!A.initialized || !B.initialized || !out->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.cols!=B.rows || out->rows!=A.rows || out->cols!=B.cols){
+		printf("ERROR: Invalid matrix sizes\n");
+		return -1;
+	}
+	if(out->data==A.data || out->data==B.data){
+		printf("ERROR: output of multiply_matrices_into can't be an input\n");
+		return -1;
+	}
+	// i-k-j order so the inner loop walks rows of B and out contiguously
+	for(i=0;i<A.rows;i++){
+		float* outrow = out->data[i];
+		memset(outrow, 0, B.cols*sizeof(float));
+		for(k=0;k<A.cols;k++){
+			kernel_axpy(A.data[i][k], B.data[k], outrow, B.cols);
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int add_matrices_into(matrix_t A, matrix_t B, matrix_t* out)
+*
+* out = A+B where out is already allocated. out may be the same as A or B.
+*******************************************************************************/
+int add_matrices_into(matrix_t A, matrix_t B, matrix_t* out){
+	int i,j;
+	if(!A.initialized || !B.initialized || !out->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.rows!=B.rows || A.cols!=B.cols || \
+				out->rows!=A.rows || out->cols!=A.cols){
+		printf("Invalid matrix sizes\n");
+		return -1;
+	}
+	for(i=0;i<A.rows;i++){
+		for(j=0;j<A.cols;j++){
+			out->data[i][j] = A.data[i][j] + B.data[i][j];
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int add_matrices_inplace(matrix_t* A, matrix_t B)
+*
+* A = A+B
+*******************************************************************************/
+int add_matrices_inplace(matrix_t* A, matrix_t B){
+	return add_matrices_into(*A, B, A);
+}
+
+/*******************************************************************************
+* int matrix_times_col_vec_into(matrix_t A, vector_t v, vector_t* out)
+*
+* out = A*v where out is already allocated with length A.rows. out must not be
+* the same vector as v.
+*******************************************************************************/
+int matrix_times_col_vec_into(matrix_t A, vector_t v, vector_t* out){
+	int i;
+	if(!A.initialized || !v.initialized || !out->initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	if(A.cols!=v.len || out->len!=A.rows){
+		printf("ERROR: dimensions do not match\n");
+		return -1;
+	}
+	if(out->data==v.data){
+		printf("ERROR: output of matrix_times_col_vec_into can't be input\n");
+		return -1;
+	}
+	for(i=0;i<A.rows;i++){
+		out->data[i] = kernel_dot(A.data[i], v.data, A.cols);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int transpose_matrix_into(matrix_t A, matrix_t* out)
+*
+* out = A' where out is already allocated with A.cols rows and A.rows columns.
+*******************************************************************************/
+int transpose_matrix_into(matrix_t A, matrix_t* out){
+	int i,j;
+	if(!A.initialized || !out->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(out->rows!=A.cols || out->cols!=A.rows){
+		printf("ERROR: Invalid matrix sizes\n");
+		return -1;
+	}
+	if(out->data==A.data){
+		printf("ERROR: output of transpose_matrix_into can't be input\n");
+		return -1;
+	}
+	for(i=0;i<A.rows;i++){
+		for(j=0;j<A.cols;j++){
+			out->data[j][i] = A.data[i][j];
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int LUP_decomposition_into(matrix_t A, matrix_t* L, matrix_t* U, 
+*										matrix_t* P, la_workspace_t* ws)
+*
+* Same algorithm as LUP_decomposition but L, U, and P must already be allocated
+* as square matrices the size of A. Unlike LUP_decomposition, A is left alone.
+* The pivoted copy of A is taken from ws and released again before returning.
+*******************************************************************************/
+int LUP_decomposition_into(matrix_t A, matrix_t* L, matrix_t* U, matrix_t* P,\
+														la_workspace_t* ws){
+	int i, j, k, m, index, mark;
+	float s1, s2, temp;
+	matrix_t At;
+	if(!A.initialized || !L->initialized || !U->initialized || \
+														!P->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.cols != A.rows){
+		printf("ERROR: matrix is not square\n");
+		return -1;
+	}
+	m = A.cols;
+	if(L->rows!=m || L->cols!=m || U->rows!=m || U->cols!=m || \
+											P->rows!=m || P->cols!=m){
+		printf("ERROR: L, U, and P must be the same size as A\n");
+		return -1;
+	}
+	mark = ws->used;
+	At = workspace_matrix(ws, m, m);
+	if(!At.initialized) return -1;
+	copy_matrix_into(A, &At);
+	
+	// start with L & P as identity and U as zero
+	for(i=0;i<m;i++){
+		memset(L->data[i], 0, m*sizeof(float));
+		memset(U->data[i], 0, m*sizeof(float));
+		memset(P->data[i], 0, m*sizeof(float));
+		L->data[i][i] = 1;
+		P->data[i][i] = 1;
+	}
+	for(i=0;i<m-1;i++){
+		index = i;
+		for(j=i;j<m;j++){
+			if(fabs(At.data[j][i]) >= fabs(At.data[index][i])){
+				index = j;
+			}
+		}
+		if(index != i){
+			for(j=0;j<m;j++){
+				temp 				= At.data[index][j];
+				At.data[index][j] 	= At.data[i][j];
+				At.data[i][j]		= temp;
+				temp				= P->data[index][j];
+				P->data[index][j]	= P->data[i][j];
+				P->data[i][j]		= temp;	
+			}
+		}	
+	}
+	for(i=0;i<m;i++){
+		for(j=0;j<m;j++){
+			s1 = 0;
+			s2 = 0;
+			for(k=0;k<i;k++){
+				s1 += U->data[k][j] * L->data[i][k];
+			}
+			for(k=0;k<j;k++){
+				s2 += U->data[k][j] * L->data[i][k];
+			}
+			if(j>=i)	U->data[i][j] = At.data[i][j] - s1;
+			if(i>=j)	L->data[i][j] = (At.data[i][j] - s2)/U->data[j][j];	
+		}
+	}
+	ws->used = mark;
+	return 0;
+}
+
+/*******************************************************************************
+* int QR_decomposition_into(matrix_t A, matrix_t* Q, matrix_t* R, 
+*														la_workspace_t* ws)
+*
+* QR decomposition by Householder reflections applied directly to R and Q
+* rather than forming and multiplying full reflection matrices. Q must be 
+* allocated as A.rows x A.rows and R the same size as A.
+*******************************************************************************/
+int QR_decomposition_into(matrix_t A, matrix_t* Q, matrix_t* R, \
+														la_workspace_t* ws){
+	int i, j, k, mark;
+	int m = A.rows;
+	int n = A.cols;
+	float norm, tau, dot;
+	vector_t v;
+	if(!A.initialized || !Q->initialized || !R->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(Q->rows!=m || Q->cols!=m || R->rows!=m || R->cols!=n){
+		printf("ERROR: Q must be %dx%d and R must be %dx%d\n", m, m, m, n);
+		return -1;
+	}
+	mark = ws->used;
+	v = workspace_vector(ws, m);
+	if(!v.initialized) return -1;
+	
+	copy_matrix_into(A, R);
+	for(i=0;i<m;i++){
+		memset(Q->data[i], 0, m*sizeof(float));
+		Q->data[i][i] = 1;
+	}
+	
+	for(i=0;i<n && i<m;i++){
+		// reflector for column i from the diagonal down
+		norm = 0;
+		for(j=i;j<m;j++){
+			v.data[j] = R->data[j][i];
+			norm += v.data[j]*v.data[j];
+		}
+		norm = sqrt(norm);
+		if(R->data[i][i] > 0)	v.data[i] += norm;
+		else					v.data[i] -= norm;
+		dot = 0;
+		for(j=i;j<m;j++) dot += v.data[j]*v.data[j];
+		if(dot==0) continue; // column already zero
+		tau = 2.0/dot;
+		
+		// R = H*R, only rows i and below change
+		for(k=0;k<n;k++){
+			dot = 0;
+			for(j=i;j<m;j++) dot += v.data[j]*R->data[j][k];
+			dot *= tau;
+			for(j=i;j<m;j++) R->data[j][k] -= dot*v.data[j];
+		}
+		// Q = Q*H, only columns i and right change
+		for(k=0;k<m;k++){
+			dot = 0;
+			for(j=i;j<m;j++) dot += Q->data[k][j]*v.data[j];
+			dot *= tau;
+			for(j=i;j<m;j++) Q->data[k][j] -= dot*v.data[j];
+		}
+	}
+	ws->used = mark;
+	return 0;
+}
+
+/*******************************************************************************
+* int invert_matrix_into(matrix_t A, matrix_t* out, la_workspace_t* ws)
+*
+* Same as invert_matrix but writes into existing square matrix out. Up to 
+* 4x4 this is the closed form and ws is not touched unless the determinant
+* is too small for it, below 1e-12 in magnitude, in which case it falls
+* through to LU like larger matrices. Those are factored in place in a copy
+* taken from ws with LU_decomposition_inplace and the scratch is released
+* before returning, so ws needs room for the LU copy at any size.
+*******************************************************************************/
+int invert_matrix_into(matrix_t A, matrix_t* out, la_workspace_t* ws){
+	int m,mark,sign;
+	int* perm;
+	matrix_t LU;
+	if(!A.initialized || !out->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.cols != A.rows){
+		printf("ERROR: matrix is not square\n");
+		return -1;
+	}
+	m = A.cols;
+	if(out->rows!=m || out->cols!=m){
+		printf("ERROR: output matrix must be the same size as A\n");
+		return -1;
+	}
+	// small-scaled matrices the closed forms refuse go through LU instead
+	if(m<=4 && invert_small_matrix(A, out)==0) return 0;
+	mark = ws->used;
+	LU = workspace_matrix(ws, m, m);
+	perm = (int*)workspace_alloc(ws, m*sizeof(int));
+	if(!LU.initialized || perm==NULL){
+		ws->used = mark;
+		return -1;
+	}
+	copy_matrix_into(A, &LU);
+	if(LU_decomposition_inplace(&LU, perm, &sign)<0){
+		printf("ERROR: matrix is singular, not invertible\n");
+		ws->used = mark;
+		return -1;
+	}
+	LU_invert_into(LU, perm, out);
+	ws->used = mark;
+	return 0;
+}
+
+/*******************************************************************************
+* int invert_matrices_batch(const float* A, float* out, int n, int count)
+*
+* Inverts count n by n matrices stored one after another row-major in A into
+* the same layout in out, which may be A. n can be 1 to 4. Returns how many 
+* were singular, whose outputs are zeroed, or -1 for a bad size.
+*******************************************************************************/
+int invert_matrices_batch(const float* A, float* out, int n, int count){
+	int i, singular = 0;
+	float a, b, c, d, det;
+	switch(n){
+	case 1:
+	case 2:
+		for(i=0;i<count;i++){
+			if(n==1){
+				det = A[i];
+				if(fabs(det) < SMALL_MATRIX_EPSILON){
+					out[i] = 0;
+					singular++;
+				}
+				else out[i] = 1.0f/det;
+				continue;
+			}
+			a = A[4*i];
+			b = A[4*i+1];
+			c = A[4*i+2];
+			d = A[4*i+3];
+			det = a*d - b*c;
+			if(fabs(det) < SMALL_MATRIX_EPSILON){
+				memset(&out[4*i], 0, 4*sizeof(float));
+				singular++;
+				continue;
+			}
+			det = 1.0f/det;
+			out[4*i]   =  d*det;
+			out[4*i+1] = -b*det;
+			out[4*i+2] = -c*det;
+			out[4*i+3] =  a*det;
+		}
+		return singular;
+	// the fixed size structs are plain row-major float arrays
+	case 3:
+		return mat3_invert_batch((const mat3_t*)A, (mat3_t*)out, count);
+	case 4:
+		return mat4_invert_batch((const mat4_t*)A, (mat4_t*)out, count);
+	}
+	printf("ERROR: invert_matrices_batch only handles 1x1 to 4x4\n");
+	return -1;
+}
+
+/*******************************************************************************
+* int matrix_determinants_batch(const float* A, float* det, int n, int count)
+*
+* Determinants of count n by n matrices packed as for invert_matrices_batch.
+*******************************************************************************/
+int matrix_determinants_batch(const float* A, float* det, int n, int count){
+	int i;
+	const mat3_t* a3 = (const mat3_t*)A;
+	const mat4_t* a4 = (const mat4_t*)A;
+	switch(n){
+	case 1:
+		for(i=0;i<count;i++) det[i] = A[i];
+		return 0;
+	case 2:
+		for(i=0;i<count;i++) det[i] = A[4*i]*A[4*i+3] - A[4*i+1]*A[4*i+2];
+		return 0;
+	case 3:
+		for(i=0;i<count;i++) det[i] = mat3_determinant(a3[i]);
+		return 0;
+	case 4:
+		for(i=0;i<count;i++) det[i] = mat4_determinant(a4[i]);
+		return 0;
+	}
+	printf("ERROR: matrix_determinants_batch only handles 1x1 to 4x4\n");
+	return -1;
+}
+
+/*******************************************************************************
+* int lin_system_solve_into(matrix_t A, vector_t b, vector_t* x, 
+*														la_workspace_t* ws)
+*
+* Same as lin_system_solve but writes the solution into existing vector x and
+* takes the working copies of A and b from ws.
+*******************************************************************************/
+int lin_system_solve_into(matrix_t A, vector_t b, vector_t* x, \
+														la_workspace_t* ws){
+	float fMaxElem, fAcc;
+	int nDim,i,j,k,m,mark;
+	matrix_t Atemp;
+	vector_t btemp;
+	if(!A.initialized || !b.initialized || !x->initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	if(A.cols != b.len || A.rows != A.cols || x->len != A.cols){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	nDim = A.cols;
+	mark = ws->used;
+	Atemp = workspace_matrix(ws, nDim, nDim);
+	btemp = workspace_vector(ws, nDim);
+	if(!Atemp.initialized || !btemp.initialized){
+		ws->used = mark;
+		return -1;
+	}
+	copy_matrix_into(A, &Atemp);
+	copy_vector_into(b, &btemp);
+	
+	for(k=0; k<(nDim-1); k++){ // base row of matrix
+		// search of line with max element
+		fMaxElem = fabs( Atemp.data[k][k]);
+		m = k;
+		for(i=k+1; i<nDim; i++){
+			if(fMaxElem < fabs(Atemp.data[i][k])){
+				fMaxElem = Atemp.data[i][k];
+				m = i;
+			}
+		}
+		// permutation of base line (index k) and max element line(index m)
+		if(m != k){
+			for(i=k; i<nDim; i++){
+				fAcc = Atemp.data[k][i];
+				Atemp.data[k][i] = Atemp.data[m][i];
+				Atemp.data[m][i]  = fAcc;
+			}
+			fAcc = btemp.data[k];
+			btemp.data[k] = btemp.data[m];
+			btemp.data[m] = fAcc;
+		}
+		if(Atemp.data[k][k] == 0.0){
+			printf("ERROR: matrix is singular\n");
+			ws->used = mark;
+			return -1;
+		}
+		// triangulation of matrix with coefficients
+		for(j=(k+1); j<nDim; j++){ // current row of matrix
+			fAcc = - Atemp.data[j][k]  / Atemp.data[k][k];
+			for(i=k; i<nDim; i++){
+				Atemp.data[j][i] = Atemp.data[j][i] + fAcc*Atemp.data[k][i] ;
+			}
+			// free member recalculation
+			btemp.data[j] = btemp.data[j] + fAcc*btemp.data[k]; 
+		}
+	}
+
+	for(k=(nDim-1); k>=0; k--){
+		x->data[k] = btemp.data[k];
+		for(i=(k+1); i<nDim; i++){
+			x->data[k] -= (Atemp.data[k][i]*x->data[i]);
+		}
+		x->data[k] = x->data[k] / Atemp.data[k][k];
+	}
+	ws->used = mark;
+	return 0;
+}
+
+/*******************************************************************************
+* int cholesky_decomposition(matrix_t* A)
+*
+* Factors a symmetric positive definite matrix into L*L' in place. Only the
+* lower triangle of A is read, on return it holds L and the upper triangle is
+* zeroed. Half the work of LUP and no pivoting is needed. Returns -1 if A is
+* not positive definite, A is left partly overwritten in that case.
+*******************************************************************************/
+int cholesky_decomposition(matrix_t* A){
+	int i,j,k,n;
+	float sum;
+	if(!A->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A->rows != A->cols){
+		printf("ERROR: matrix is not square\n");
+		return -1;
+	}
+	n = A->rows;
+	for(j=0;j<n;j++){
+		sum = A->data[j][j];
+		for(k=0;k<j;k++) sum -= A->data[j][k]*A->data[j][k];
+		if(sum<=0.0f){
+			printf("ERROR: matrix is not positive definite\n");
+			return -1;
+		}
+		A->data[j][j] = sqrtf(sum);
+		for(i=j+1;i<n;i++){
+			sum = A->data[i][j];
+			for(k=0;k<j;k++) sum -= A->data[i][k]*A->data[j][k];
+			A->data[i][j] = sum/A->data[j][j];
+		}
+		for(i=0;i<j;i++) A->data[i][j] = 0.0f;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int lower_triangular_solve(matrix_t L, vector_t b, vector_t* x)
+*
+* Forward substitution for L*x = b with L lower triangular. x may be b.
+*******************************************************************************/
+int lower_triangular_solve(matrix_t L, vector_t b, vector_t* x){
+	int i,k,n;
+	float sum;
+	if(!L.initialized || !b.initialized || !x->initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	n = L.rows;
+	if(L.cols!=n || b.len!=n || x->len!=n){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		sum = b.data[i];
+		for(k=0;k<i;k++) sum -= L.data[i][k]*x->data[k];
+		if(L.data[i][i]==0.0f){
+			printf("ERROR: matrix is singular\n");
+			return -1;
+		}
+		x->data[i] = sum/L.data[i][i];
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int lower_transpose_solve(matrix_t L, vector_t b, vector_t* x)
+*
+* Back substitution for L'*x = b with L lower triangular, so the upper
+* triangular system Cholesky needs without forming the transpose. x may be b.
+*******************************************************************************/
+int lower_transpose_solve(matrix_t L, vector_t b, vector_t* x){
+	int i,k,n;
+	float sum;
+	if(!L.initialized || !b.initialized || !x->initialized){
+		printf("ERROR: matrix or vector not initialized yet\n");
+		return -1;
+	}
+	n = L.rows;
+	if(L.cols!=n || b.len!=n || x->len!=n){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	for(i=n-1;i>=0;i--){
+		sum = b.data[i];
+		for(k=i+1;k<n;k++) sum -= L.data[k][i]*x->data[k];
+		if(L.data[i][i]==0.0f){
+			printf("ERROR: matrix is singular\n");
+			return -1;
+		}
+		x->data[i] = sum/L.data[i][i];
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int cholesky_solve(matrix_t L, vector_t b, vector_t* x)
+*
+* Solves A*x = b given the factor L from cholesky_decomposition, so a matrix
+* factored once can be reused for many right hand sides. x may be b.
+*******************************************************************************/
+int cholesky_solve(matrix_t L, vector_t b, vector_t* x){
+	if(lower_triangular_solve(L, b, x)<0) return -1;
+	return lower_transpose_solve(L, *x, x);
+}
+
+/*******************************************************************************
+* int spd_solve(matrix_t A, vector_t b, vector_t* x, la_workspace_t* ws)
+*
+* Solves A*x = b for symmetric positive definite A with a Cholesky factor
+* taken from ws, A itself is not modified. Use instead of invert_matrix for
+* covariance matrices.
+*******************************************************************************/
+int spd_solve(matrix_t A, vector_t b, vector_t* x, la_workspace_t* ws){
+	int mark, ret;
+	matrix_t L;
+	if(!A.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	mark = ws->used;
+	L = workspace_matrix(ws, A.rows, A.cols);
+	if(!L.initialized){
+		ws->used = mark;
+		return -1;
+	}
+	copy_matrix_into(A, &L);
+	ret = cholesky_decomposition(&L);
+	if(ret==0) ret = cholesky_solve(L, b, x);
+	ws->used = mark;
+	return ret;
+}
+
+/*******************************************************************************
+* int spd_solve_matrix(matrix_t A, matrix_t B, matrix_t* X, la_workspace_t* ws)
+*
+* Solves A*X = B column by column for symmetric positive definite A, factoring
+* A only once. This is the Kalman gain computation: with S the innovation 
+* covariance, S*K' = H*P gives K' without ever inverting S. X may be B.
+*******************************************************************************/
+int spd_solve_matrix(matrix_t A, matrix_t B, matrix_t* X, la_workspace_t* ws){
+	int i, j, n, mark, ret = 0;
+	matrix_t L;
+	vector_t col;
+	if(!A.initialized || !B.initialized || !X->initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	n = A.rows;
+	if(A.cols!=n || B.rows!=n || X->rows!=n || X->cols!=B.cols){
+		printf("ERROR: matrix dimensions do not match\n");
+		return -1;
+	}
+	mark = ws->used;
+	L = workspace_matrix(ws, n, n);
+	col = workspace_vector(ws, n);
+	if(!L.initialized || !col.initialized){
+		ws->used = mark;
+		return -1;
+	}
+	copy_matrix_into(A, &L);
+	if(cholesky_decomposition(&L)<0){
+		ws->used = mark;
+		return -1;
+	}
+	for(j=0;j<B.cols && ret==0;j++){
+		for(i=0;i<n;i++) col.data[i] = B.data[i][j];
+		ret = cholesky_solve(L, col, &col);
+		for(i=0;i<n;i++) X->data[i][j] = col.data[i];
+	}
+	ws->used = mark;
+	return ret;
+}
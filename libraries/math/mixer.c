@@ -0,0 +1,305 @@
+/*******************************************************************************
+* mixer.c
+*
+* Maps thrust, roll, pitch and yaw commands onto rotors or wheels through a
+* fixed table of coefficients per layout, so a control loop makes one call
+* per tick with nothing allocated. When the commands can't all be met inside
+* the output range the mixer gives up authority in order of importance
+* instead of clipping each output on its own, which would change the torque
+* actually produced: attitude (roll & pitch) first, then thrust, then yaw.
+* Ground vehicles have no roll or pitch and keep steering over throttle.
+*
+* Rotors are numbered clockwise from above starting at the front right rotor
+* of X layouts or the front rotor of + layouts. Rotor 1 spins anticlockwise
+* and directions alternate from there. Body axes are x forward, y right and
+* z down so positive roll drops the right side, positive pitch raises the
+* nose and positive yaw turns clockwise seen from above.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "../roboticscape-defs.h"
+
+#define MIXER_ESC_MIN_US	1000
+#define MIXER_ESC_RANGE_US	1000
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void mixer_fill_rotors(mixer_t* m, int n, float first_angle_deg);
+void mixer_normalize_column(mixer_t* m, int col);
+
+/*******************************************************************************
+* mixer_t create_mixer(mixer_layout_t layout)
+*
+* Fills the coefficient table for layout. Rotor outputs default to the range
+* 0 to 1 for send_mixer_esc_pulses and wheel outputs to -1 to 1 for
+* set_mixer_motors.
+*******************************************************************************/
+mixer_t create_mixer(mixer_layout_t layout){
+	mixer_t m;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	m.layout = layout;
+	m.min = 0.0f;
+	m.max = 1.0f;
+	switch(layout){
+	case MIXER_QUAD_X:
+		mixer_fill_rotors(&m, 4, 45.0f);
+		break;
+	case MIXER_QUAD_PLUS:
+		mixer_fill_rotors(&m, 4, 0.0f);
+		break;
+	case MIXER_HEX_X:
+		mixer_fill_rotors(&m, 6, 30.0f);
+		break;
+	case MIXER_HEX_PLUS:
+		mixer_fill_rotors(&m, 6, 0.0f);
+		break;
+	case MIXER_OCTO_X:
+		mixer_fill_rotors(&m, 8, 22.5f);
+		break;
+	case MIXER_OCTO_PLUS:
+		mixer_fill_rotors(&m, 8, 0.0f);
+		break;
+	case MIXER_DIFF_DRIVE:
+		// left, right
+		m.outputs = 2;
+		m.mix[0][0] = 1.0f;	m.mix[0][3] = 1.0f;
+		m.mix[1][0] = 1.0f;	m.mix[1][3] = -1.0f;
+		m.min = -1.0f;
+		break;
+	case MIXER_SKID_STEER:
+		// left front, left rear, right front, right rear
+		m.outputs = 4;
+		for(i=0;i<4;i++){
+			m.mix[i][0] = 1.0f;
+			m.mix[i][3] = (i<2) ? 1.0f : -1.0f;
+		}
+		m.min = -1.0f;
+		break;
+	default:
+		printf("ERROR: invalid mixer layout\n");
+		return m;
+	}
+	m.initialized = 1;
+	return m;
+}
+
+/*******************************************************************************
+* int set_mixer_output_limits(mixer_t* m, float min, float max)
+*******************************************************************************/
+int set_mixer_output_limits(mixer_t* m, float min, float max){
+	if(m->initialized!=1){
+		printf("ERROR: mixer not initialized yet\n");
+		return -1;
+	}
+	if(max<=min){
+		printf("ERROR: mixer output max must be greater than min\n");
+		return -1;
+	}
+	m->min = min;
+	m->max = max;
+	return 0;
+}
+
+/*******************************************************************************
+* int mix_controls(mixer_t* m, float thrust, float roll, float pitch, float yaw)
+*
+* Computes m->out[0..outputs-1]. m->saturated is set if any command had to be
+* reduced to stay within the output limits.
+*******************************************************************************/
+int mix_controls(mixer_t* m, float thrust, float roll, float pitch, float yaw){
+	float a[MIXER_MAX_OUTPUTS];	// high priority part of each output
+	float s[MIXER_MAX_OUTPUTS];	// low priority part
+	float amin, amax, lo, hi, t, k, room;
+	int i, ground, n;
+
+	if(m->initialized!=1){
+		report_error("ERROR: mixer not initialized yet\n");
+		return -1;
+	}
+	n = m->outputs;
+	ground = (m->layout==MIXER_DIFF_DRIVE || m->layout==MIXER_SKID_STEER);
+	m->saturated = 0;
+
+	amin = INFINITY;
+	amax = -INFINITY;
+	for(i=0;i<n;i++){
+		if(ground){
+			a[i] = m->mix[i][3]*yaw;
+			s[i] = 0.0f;
+		}
+		else{
+			a[i] = m->mix[i][1]*roll + m->mix[i][2]*pitch;
+			s[i] = m->mix[i][3]*yaw;
+		}
+		amin = fminf(amin, a[i]);
+		amax = fmaxf(amax, a[i]);
+	}
+
+	// scale attitude down if its span alone doesn't fit in the range
+	if(amax-amin > m->max-m->min){
+		k = (m->max-m->min)/(amax-amin);
+		for(i=0;i<n;i++) a[i] *= k;
+		amin *= k;
+		amax *= k;
+		m->saturated = 1;
+	}
+
+	// then move thrust so every output fits, thrust coefficients are 1
+	lo = m->min - amin;
+	hi = m->max - amax;
+	t = thrust;
+	if(t<lo){
+		t = lo;
+		m->saturated = 1;
+	}
+	else if(t>hi){
+		t = hi;
+		m->saturated = 1;
+	}
+
+	// yaw takes whatever headroom is left
+	k = 1.0f;
+	for(i=0;i<n;i++){
+		if(s[i]>0.0f) room = m->max - (t*m->mix[i][0] + a[i]);
+		else if(s[i]<0.0f) room = (t*m->mix[i][0] + a[i]) - m->min;
+		else continue;
+		if(room<0.0f) room = 0.0f;
+		if(room<fabsf(s[i])) k = fminf(k, room/fabsf(s[i]));
+	}
+	if(k<1.0f) m->saturated = 1;
+
+	for(i=0;i<n;i++){
+		m->out[i] = t*m->mix[i][0] + a[i] + k*s[i];
+		m->out[i] = fminf(fmaxf(m->out[i], m->min), m->max);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int send_mixer_esc_pulses(mixer_t* m, int first_ch)
+*
+* Sends the last mixed outputs as ESC pulses on servo channels first_ch
+* onwards in one batch. Other channels are left idle.
+*******************************************************************************/
+int send_mixer_esc_pulses(mixer_t* m, int first_ch){
+	int us[SERVO_CHANNELS];
+	int i;
+
+	if(m->initialized!=1){
+		report_error("ERROR: mixer not initialized yet\n");
+		return -1;
+	}
+	if(first_ch<1 || first_ch+m->outputs-1>SERVO_CHANNELS){
+		report_error("ERROR: mixer outputs don't fit on servo channels " \
+					"%d-%d\n", first_ch, first_ch+m->outputs-1);
+		return -1;
+	}
+	if(m->min<0.0f){
+		report_error("ERROR: mixer output range must be positive for ESCs\n");
+		return -1;
+	}
+	memset(us, 0, sizeof(us));
+	for(i=0;i<m->outputs;i++){
+		us[first_ch-1+i] = MIXER_ESC_MIN_US + \
+						lrintf(fminf(m->out[i], 1.0f)*MIXER_ESC_RANGE_US);
+	}
+	return send_servo_pulses_us(us);
+}
+
+/*******************************************************************************
+* int send_mixer_dshot(mixer_t* m, int first_ch)
+*
+* Same as send_mixer_esc_pulses for ESCs running DShot, see set_dshot_rate.
+*******************************************************************************/
+int send_mixer_dshot(mixer_t* m, int first_ch){
+	float throttle[SERVO_CHANNELS];
+	int i;
+
+	if(m->initialized!=1){
+		report_error("ERROR: mixer not initialized yet\n");
+		return -1;
+	}
+	if(first_ch<1 || first_ch+m->outputs-1>SERVO_CHANNELS){
+		report_error("ERROR: mixer outputs don't fit on servo channels " \
+					"%d-%d\n", first_ch, first_ch+m->outputs-1);
+		return -1;
+	}
+	if(m->min<0.0f){
+		report_error("ERROR: mixer output range must be positive for ESCs\n");
+		return -1;
+	}
+	for(i=0;i<SERVO_CHANNELS;i++) throttle[i] = NAN;
+	for(i=0;i<m->outputs;i++){
+		throttle[first_ch-1+i] = fminf(m->out[i], 1.0f);
+	}
+	return send_dshot_normalized(throttle);
+}
+
+/*******************************************************************************
+* int set_mixer_motors(mixer_t* m, int first_motor)
+*
+* Sets the last mixed outputs as duty cycles on motors first_motor onwards.
+* All four go out in one set_motors call when the mixer covers them all.
+*******************************************************************************/
+int set_mixer_motors(mixer_t* m, int first_motor){
+	int i;
+
+	if(m->initialized!=1){
+		report_error("ERROR: mixer not initialized yet\n");
+		return -1;
+	}
+	if(first_motor<1 || first_motor+m->outputs-1>MOTOR_CHANNELS){
+		report_error("ERROR: mixer outputs don't fit on motors %d-%d\n", \
+								first_motor, first_motor+m->outputs-1);
+		return -1;
+	}
+	if(m->outputs==MOTOR_CHANNELS) return set_motors(m->out);
+	for(i=0;i<m->outputs;i++){
+		if(set_motor(first_motor+i, m->out[i])<0) return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* void mixer_fill_rotors(mixer_t* m, int n, float first_angle_deg)
+*
+* n rotors evenly spaced clockwise from first_angle_deg off the nose
+*******************************************************************************/
+void mixer_fill_rotors(mixer_t* m, int n, float first_angle_deg){
+	float angle;
+	int i;
+
+	m->outputs = n;
+	for(i=0;i<n;i++){
+		angle = (first_angle_deg + i*360.0f/n)*DEG_TO_RAD;
+		m->mix[i][0] = 1.0f;
+		// more thrust on the left rolls right, more at the front pitches up
+		m->mix[i][1] = -sinf(angle);
+		m->mix[i][2] = cosf(angle);
+		// anticlockwise rotors push the body clockwise
+		m->mix[i][3] = (i%2==0) ? 1.0f : -1.0f;
+	}
+	mixer_normalize_column(m, 1);
+	mixer_normalize_column(m, 2);
+}
+
+/*******************************************************************************
+* void mixer_normalize_column(mixer_t* m, int col)
+*
+* scales a column so the most affected output moves by the full command, and
+* flushes the rounding left on rotors sitting on an axis to exactly 0
+*******************************************************************************/
+void mixer_normalize_column(mixer_t* m, int col){
+	float big = 0.0f;
+	int i;
+	for(i=0;i<m->outputs;i++) big = fmaxf(big, fabsf(m->mix[i][col]));
+	if(big==0.0f) return;
+	for(i=0;i<m->outputs;i++){
+		m->mix[i][col] /= big;
+		if(fabsf(m->mix[i][col])<1e-6f) m->mix[i][col] = 0.0f;
+	}
+}
@@ -0,0 +1,178 @@
+/*******************************************************************************
+* pid_controller.c
+*
+* PID controller with its proportional, integral and derivative terms kept as
+* explicit state rather than folded into one transfer function as create_pid
+* does. That makes anti-windup possible: the integrator can be frozen or bled
+* off while the output is saturated instead of winding up behind the clamp.
+* The derivative is of the measurement (or weighted setpoint) through a first
+* order rolloff, discretized with backward Euler so it is stable for any Tf.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+/*******************************************************************************
+* pid_controller_t create_pid_controller(float kp, float ki, float kd,
+*														float Tf, float dt)
+*
+* Parallel form gains with derivative rolloff time constant Tf, same meaning as
+* create_pid. Starts with no output limits, anti-windup off and setpoint
+* weights of 1 so it behaves like the transfer function version until
+* configured.
+*******************************************************************************/
+pid_controller_t create_pid_controller(float kp, float ki, float kd, \
+														float Tf, float dt){
+	pid_controller_t pid;
+	memset(&pid, 0, sizeof(pid));
+	if(dt<=0.0f){
+		printf("ERROR: pid timestep must be positive\n");
+		return pid;
+	}
+	if(Tf<0.0f){
+		printf("ERROR: pid derivative time constant can't be negative\n");
+		return pid;
+	}
+	pid.kp = kp;
+	pid.ki = ki;
+	pid.kd = kd;
+	pid.Tf = Tf;
+	pid.dt = dt;
+	pid.b = 1.0f;
+	pid.c = 1.0f;
+	pid.out_min = -INFINITY;
+	pid.out_max = INFINITY;
+	pid.antiwindup = PID_ANTIWINDUP_NONE;
+	// back-calculation tracking time sqrt(Ti*Td) as in Astrom & Hagglund,
+	// or Ti alone for a PI controller
+	if(ki!=0.0f && kd!=0.0f && kp!=0.0f) pid.kt = 1.0f/sqrtf(fabsf(kd/ki));
+	else if(ki!=0.0f && kp!=0.0f) pid.kt = fabsf(ki/kp);
+	else pid.kt = 1.0f/dt;
+	// D[k] = ad*D[k-1] + bd*(e_d[k]-e_d[k-1])
+	pid.ad = Tf/(Tf+dt);
+	pid.bd = kd/(Tf+dt);
+	pid.initialized = 1;
+	return pid;
+}
+
+/*******************************************************************************
+* int set_pid_output_limits(pid_controller_t* pid, float min, float max)
+*******************************************************************************/
+int set_pid_output_limits(pid_controller_t* pid, float min, float max){
+	if(pid->initialized!=1){
+		printf("ERROR: pid controller not initialized yet\n");
+		return -1;
+	}
+	if(max<=min){
+		printf("ERROR: pid output max must be greater than min\n");
+		return -1;
+	}
+	pid->out_min = min;
+	pid->out_max = max;
+	return 0;
+}
+
+/*******************************************************************************
+* int set_pid_antiwindup(pid_controller_t* pid, pid_antiwindup_t mode, float kt)
+*
+* kt is the back-calculation gain in 1/s, pass 0 to keep the default.
+*******************************************************************************/
+int set_pid_antiwindup(pid_controller_t* pid, pid_antiwindup_t mode, float kt){
+	if(pid->initialized!=1){
+		printf("ERROR: pid controller not initialized yet\n");
+		return -1;
+	}
+	if(mode!=PID_ANTIWINDUP_NONE && mode!=PID_ANTIWINDUP_CLAMP && \
+										mode!=PID_ANTIWINDUP_BACK_CALC){
+		printf("ERROR: invalid pid anti-windup mode\n");
+		return -1;
+	}
+	if(kt<0.0f){
+		printf("ERROR: pid back-calculation gain can't be negative\n");
+		return -1;
+	}
+	pid->antiwindup = mode;
+	if(kt>0.0f) pid->kt = kt;
+	return 0;
+}
+
+/*******************************************************************************
+* int set_pid_setpoint_weights(pid_controller_t* pid, float b, float c)
+*
+* b weighs the setpoint in the proportional term and c in the derivative
+* term. c=0 differentiates only the measurement so steps in setpoint don't
+* kick the output, b<1 softens the proportional response to steps.
+*******************************************************************************/
+int set_pid_setpoint_weights(pid_controller_t* pid, float b, float c){
+	if(pid->initialized!=1){
+		printf("ERROR: pid controller not initialized yet\n");
+		return -1;
+	}
+	pid->b = b;
+	pid->c = c;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_pid_controller(pid_controller_t* pid)
+*
+* clears the integrator and derivative state
+*******************************************************************************/
+int reset_pid_controller(pid_controller_t* pid){
+	if(pid->initialized!=1){
+		printf("ERROR: pid controller not initialized yet\n");
+		return -1;
+	}
+	pid->integrator = 0.0f;
+	pid->derivative = 0.0f;
+	pid->last_ed = 0.0f;
+	pid->output = 0.0f;
+	pid->saturation_flag = 0;
+	pid->steps = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* float march_pid_controller(pid_controller_t* pid, float setpoint,
+*														float measurement)
+*
+* One control step, returns the saturated output. The integrator is advanced
+* after the output is computed so an integral gain change applies gradually.
+*******************************************************************************/
+float march_pid_controller(pid_controller_t* pid, float setpoint, \
+														float measurement){
+	float e, ed, v, u, integrate;
+
+	e = setpoint - measurement;
+	ed = pid->c*setpoint - measurement;
+	// no derivative kick from whatever the state held before the first step
+	if(pid->steps==0) pid->last_ed = ed;
+	pid->derivative = pid->ad*pid->derivative + pid->bd*(ed - pid->last_ed);
+	pid->last_ed = ed;
+
+	v = pid->kp*(pid->b*setpoint - measurement) + pid->integrator + \
+															pid->derivative;
+	u = fminf(fmaxf(v, pid->out_min), pid->out_max);
+	pid->saturation_flag = (u!=v);
+
+	switch(pid->antiwindup){
+	case PID_ANTIWINDUP_CLAMP:
+		// stop integrating only while saturated and the error pushes further
+		// into the limit it hit, v-u points the way it's saturated
+		integrate = (pid->saturation_flag && e*(v-u)>0.0f) ? 0.0f : 1.0f;
+		pid->integrator += integrate*pid->ki*pid->dt*e;
+		break;
+	case PID_ANTIWINDUP_BACK_CALC:
+		// bleed the integrator toward what the actuator actually delivers
+		pid->integrator += pid->dt*(pid->ki*e + pid->kt*(u - v));
+		break;
+	default:
+		pid->integrator += pid->ki*pid->dt*e;
+		break;
+	}
+	pid->output = u;
+	pid->steps++;
+	return u;
+}
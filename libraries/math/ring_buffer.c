@@ -74,7 +74,7 @@ int reset_ring_buf(ring_buf_t* buf){
 *******************************************************************************/
 int insert_new_ring_buf_value(ring_buf_t* buf, float val){
 	if(buf->initialized !=1){
-		printf("ERROR: trying add value to uninitialized ring buffer\n");
+		report_error("ERROR: trying add value to uninitialized ring buffer\n");
 		return -1;
 	}
 	int new_index = buf->index + 1;
@@ -96,11 +96,11 @@ int insert_new_ring_buf_value(ring_buf_t* buf, float val){
 float get_ring_buf_value(ring_buf_t* buf, int position){
 	// sanity range check
 	if((position<0) || (position>buf->size-1)){
-		printf("ERROR: pos must be between 0 & %d\n", buf->size-1);
+		report_error("ERROR: pos must be between 0 & %d\n", buf->size-1);
 		return -1;
 	}
 	if(buf->initialized !=1){
-		printf("ERROR: trying to read value from uninitialized ring buffer\n");
+		report_error("ERROR: trying to read from uninitialized ring buffer\n");
 		return -1;
 	}
 	int return_index = buf->index - position;
@@ -109,3 +109,146 @@ float get_ring_buf_value(ring_buf_t* buf, int position){
 	}
 	return buf->data[return_index];
 }
+
+/*******************************************************************************
+* int insert_ring_buf_values(ring_buf_t* buf, const float* vals, int n)
+*
+* Inserts n values in order, the same as calling insert_new_ring_buf_value on
+* each but with one check for the whole batch.
+*******************************************************************************/
+int insert_ring_buf_values(ring_buf_t* buf, const float* vals, int n){
+	int i, idx;
+	if(buf->initialized !=1){
+		report_error("ERROR: trying add values to uninitialized ring buffer\n");
+		return -1;
+	}
+	// values older than the last 'size' would just be overwritten
+	if(n > buf->size){
+		vals += n - buf->size;
+		n = buf->size;
+	}
+	idx = buf->index;
+	for(i=0; i<n; i++){
+		idx++;
+		if(idx >= buf->size) idx = 0;
+		buf->data[idx] = vals[i];
+	}
+	buf->index = idx;
+	return 0;
+}
+
+/*******************************************************************************
+* pow2_ring_buf_t create_pow2_ring_buf(int min_size)
+*
+* Allocates a ring buffer whose size is min_size rounded up to a power of two
+* so positions wrap with a mask. Twice the memory is allocated so every value
+* is stored twice, once at index and once at index+size. That way the newest
+* n values are always contiguous somewhere in memory.
+*******************************************************************************/
+pow2_ring_buf_t create_pow2_ring_buf(int min_size){
+	pow2_ring_buf_t buf;
+	int size = 2;
+	buf.initialized = 0;
+	if(min_size<2){
+		printf("ERROR: ring_buf_size must be greater than or equal to 2\n");
+		return buf;
+	}
+	if(min_size > (1<<24)){
+		printf("ERROR: ring_buf_size too large\n");
+		return buf;
+	}
+	while(size < min_size) size <<= 1;
+	buf.data = (float*)calloc(2*size, sizeof(float));
+	if(buf.data == NULL){
+		printf("ERROR: failed to allocate memory for ring buffer\n");
+		return buf;
+	}
+	buf.size = size;
+	buf.mask = size-1;
+	buf.index = 0;
+	buf.initialized = 1;
+	return buf;
+}
+
+/*******************************************************************************
+* int destroy_pow2_ring_buf(pow2_ring_buf_t* buf)
+*******************************************************************************/
+int destroy_pow2_ring_buf(pow2_ring_buf_t* buf){
+	free(buf->data);
+	buf->data = NULL;
+	buf->initialized = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_pow2_ring_buf(pow2_ring_buf_t* buf)
+*******************************************************************************/
+int reset_pow2_ring_buf(pow2_ring_buf_t* buf){
+	if(buf->initialized !=1){
+		printf("ERROR: trying to reset an uninitialized ring buffer\n");
+		return -1;
+	}
+	memset(buf->data, 0, 2*buf->size*sizeof(float));
+	buf->index = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* void insert_pow2_ring_buf_value(pow2_ring_buf_t* buf, float val)
+*
+* no initialized check so this can be used in tight loops, the buffer must
+* have been created successfully.
+*******************************************************************************/
+void insert_pow2_ring_buf_value(pow2_ring_buf_t* buf, float val){
+	unsigned int idx = (buf->index + 1) & buf->mask;
+	buf->data[idx] = val;
+	buf->data[idx + buf->size] = val;
+	buf->index = idx;
+}
+
+/*******************************************************************************
+* void insert_pow2_ring_buf_values(pow2_ring_buf_t* buf, const float* vals, 
+*																		int n)
+*******************************************************************************/
+void insert_pow2_ring_buf_values(pow2_ring_buf_t* buf, const float* vals, int n){
+	int i;
+	unsigned int idx = buf->index;
+	float* lo = buf->data;
+	float* hi = buf->data + buf->size;
+	if(n > buf->size){
+		vals += n - buf->size;
+		n = buf->size;
+	}
+	for(i=0; i<n; i++){
+		idx = (idx + 1) & buf->mask;
+		lo[idx] = vals[i];
+		hi[idx] = vals[i];
+	}
+	buf->index = idx;
+}
+
+/*******************************************************************************
+* float get_pow2_ring_buf_value(pow2_ring_buf_t* buf, int position)
+*
+* returns the value 'position' steps behind the newest, position must be
+* between 0 and size-1.
+*******************************************************************************/
+float get_pow2_ring_buf_value(pow2_ring_buf_t* buf, int position){
+	return buf->data[(buf->index - position) & buf->mask];
+}
+
+/*******************************************************************************
+* const float* pow2_ring_buf_window(pow2_ring_buf_t* buf, int n)
+*
+* Returns a pointer to the newest n values in chronological order, oldest
+* first, so ptr[n-1] is the newest value. The pointer stays valid until the
+* next insert. Returns NULL if n is out of range.
+*******************************************************************************/
+const float* pow2_ring_buf_window(pow2_ring_buf_t* buf, int n){
+	if(n<1 || n>buf->size){
+		printf("ERROR: window must be between 1 & %d\n", buf->size);
+		return NULL;
+	}
+	// the newest value's mirror at index+size always has n-1 values before it
+	return &buf->data[buf->index + buf->size - n + 1];
+}
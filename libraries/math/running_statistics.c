@@ -0,0 +1,192 @@
+/*******************************************************************************
+* running_statistics.c
+*
+* Mean, variance, and standard deviation of a stream of samples updated in 
+* constant time per sample with Welford's method, so nothing needs to be stored
+* and re-summed as with standard_deviation and vector_mean. Sums are kept in
+* double to avoid the cancellation the naive sum of squares suffers in float.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+
+/*******************************************************************************
+* running_stats_t create_running_stats()
+*******************************************************************************/
+running_stats_t create_running_stats(){
+	running_stats_t stats;
+	stats.initialized = 1;
+	reset_running_stats(&stats);
+	return stats;
+}
+
+/*******************************************************************************
+* int reset_running_stats(running_stats_t* stats)
+*******************************************************************************/
+int reset_running_stats(running_stats_t* stats){
+	if(stats->initialized != 1){
+		printf("ERROR: running_stats not initialized yet\n");
+		return -1;
+	}
+	stats->n = 0;
+	stats->mean = 0;
+	stats->m2 = 0;
+	stats->min = 0;
+	stats->max = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int update_running_stats(running_stats_t* stats, float x)
+*******************************************************************************/
+int update_running_stats(running_stats_t* stats, float x){
+	double delta;
+	if(stats->initialized != 1){
+		printf("ERROR: running_stats not initialized yet\n");
+		return -1;
+	}
+	if(stats->n == 0){
+		stats->min = x;
+		stats->max = x;
+	}
+	else{
+		if(x < stats->min) stats->min = x;
+		if(x > stats->max) stats->max = x;
+	}
+	stats->n++;
+	delta = x - stats->mean;
+	stats->mean += delta/stats->n;
+	stats->m2 += delta*(x - stats->mean);
+	return 0;
+}
+
+/*******************************************************************************
+* float running_stats_mean(running_stats_t* stats)
+*******************************************************************************/
+float running_stats_mean(running_stats_t* stats){
+	return stats->mean;
+}
+
+/*******************************************************************************
+* float running_stats_variance(running_stats_t* stats)
+*
+* population variance, consistent with standard_deviation()
+*******************************************************************************/
+float running_stats_variance(running_stats_t* stats){
+	if(stats->n < 2) return 0;
+	return stats->m2/stats->n;
+}
+
+/*******************************************************************************
+* float running_stats_stddev(running_stats_t* stats)
+*******************************************************************************/
+float running_stats_stddev(running_stats_t* stats){
+	return sqrt(running_stats_variance(stats));
+}
+
+/*******************************************************************************
+* windowed_stats_t create_windowed_stats(int window)
+*
+* Statistics over only the most recent 'window' samples. A ring buffer holds
+* the samples so the oldest can be removed from the sums as each new one
+* arrives.
+*******************************************************************************/
+windowed_stats_t create_windowed_stats(int window){
+	windowed_stats_t stats;
+	stats.initialized = 0;
+	if(window<2){
+		printf("ERROR: window must be >= 2\n");
+		return stats;
+	}
+	stats.buf = create_ring_buf(window);
+	if(stats.buf.initialized != 1){
+		printf("ERROR: failed to allocate windowed_stats\n");
+		return stats;
+	}
+	stats.window = window;
+	stats.count = 0;
+	stats.mean = 0;
+	stats.m2 = 0;
+	stats.initialized = 1;
+	return stats;
+}
+
+/*******************************************************************************
+* int destroy_windowed_stats(windowed_stats_t* stats)
+*******************************************************************************/
+int destroy_windowed_stats(windowed_stats_t* stats){
+	if(stats->initialized != 1) return -1;
+	destroy_ring_buf(&stats->buf);
+	stats->initialized = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_windowed_stats(windowed_stats_t* stats)
+*******************************************************************************/
+int reset_windowed_stats(windowed_stats_t* stats){
+	if(stats->initialized != 1){
+		printf("ERROR: windowed_stats not initialized yet\n");
+		return -1;
+	}
+	reset_ring_buf(&stats->buf);
+	stats->count = 0;
+	stats->mean = 0;
+	stats->m2 = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int update_windowed_stats(windowed_stats_t* stats, float x)
+*
+* Until the window fills this is the normal Welford update. After that the 
+* oldest sample is swapped for the new one:
+* mean' = mean + (x-old)/N
+* m2'   = m2 + (x-old)*(x-mean'+old-mean)
+*******************************************************************************/
+int update_windowed_stats(windowed_stats_t* stats, float x){
+	double delta, old, old_mean;
+	if(stats->initialized != 1){
+		printf("ERROR: windowed_stats not initialized yet\n");
+		return -1;
+	}
+	if(stats->count < stats->window){
+		stats->count++;
+		delta = x - stats->mean;
+		stats->mean += delta/stats->count;
+		stats->m2 += delta*(x - stats->mean);
+	}
+	else{
+		// before inserting, the oldest sample is window-1 steps back
+		old = stats->buf.data[(stats->buf.index+1) % stats->window];
+		old_mean = stats->mean;
+		stats->mean += (x - old)/stats->window;
+		stats->m2 += (x - old)*(x - stats->mean + old - old_mean);
+		if(stats->m2 < 0) stats->m2 = 0;
+	}
+	insert_new_ring_buf_value(&stats->buf, x);
+	return 0;
+}
+
+/*******************************************************************************
+* float windowed_stats_mean(windowed_stats_t* stats)
+*******************************************************************************/
+float windowed_stats_mean(windowed_stats_t* stats){
+	return stats->mean;
+}
+
+/*******************************************************************************
+* float windowed_stats_variance(windowed_stats_t* stats)
+*******************************************************************************/
+float windowed_stats_variance(windowed_stats_t* stats){
+	if(stats->count < 2) return 0;
+	return stats->m2/stats->count;
+}
+
+/*******************************************************************************
+* float windowed_stats_stddev(windowed_stats_t* stats)
+*******************************************************************************/
+float windowed_stats_stddev(windowed_stats_t* stats){
+	return sqrt(windowed_stats_variance(stats));
+}
@@ -0,0 +1,237 @@
+/*******************************************************************************
+* state_space.c
+*
+* Discrete time multi-input multi-output state space systems
+*
+*	x[k+1] = A*x[k] + B*u[k]
+*	y[k]   = C*x[k] + D*u[k]
+*
+* A, B, C & D live in one (nx+ny) x (nx+nu) matrix [A B; C D] and the state
+* and input share one vector [x; u], so a whole step is a single matrix times
+* vector product into preallocated memory. Controllers with observers, such as
+* LQR with an estimator, can be written as one such system taking the
+* measurements and references as inputs and producing the commands as outputs.
+*******************************************************************************/
+
+#include "../roboticscape.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int ss_check_continuous(matrix_t A, matrix_t B, matrix_t C, matrix_t D);
+
+/*******************************************************************************
+* ss_system_t create_ss_system(int nx, int nu, int ny, float dt)
+*
+* Allocates a discrete system with all matrices and the state zeroed, fill in
+* A, B, C and D afterwards. They are views into the combined matrix so writing
+* sys.A.data[i][j] is all that is needed.
+*******************************************************************************/
+ss_system_t create_ss_system(int nx, int nu, int ny, float dt){
+	ss_system_t sys;
+	memset(&sys, 0, sizeof(sys));
+	if(nx<1 || nu<1 || ny<1){
+		printf("ERROR: state space system needs at least 1 state, input, ");
+		printf("and output\n");
+		return sys;
+	}
+	if(dt<=0.0f){
+		printf("ERROR: state space timestep must be positive\n");
+		return sys;
+	}
+	sys.nx = nx;
+	sys.nu = nu;
+	sys.ny = ny;
+	sys.dt = dt;
+	sys.M = create_matrix(nx+ny, nx+nu);
+	sys.A = create_submatrix_view(sys.M, 0, 0, nx, nx);
+	sys.B = create_submatrix_view(sys.M, 0, nx, nx, nu);
+	sys.C = create_submatrix_view(sys.M, nx, 0, ny, nx);
+	sys.D = create_submatrix_view(sys.M, nx, nx, ny, nu);
+	sys.xu = create_vector(nx+nu);
+	sys.out = create_vector(nx+ny);
+	sys.x = sys.xu.data;
+	sys.initialized = 1;
+	return sys;
+}
+
+/*******************************************************************************
+* ss_system_t create_ss_from_continuous(matrix_t A, matrix_t B, matrix_t C,
+*						matrix_t D, float dt, ss_discretization_t method)
+*
+* Discretizes a continuous time system at creation. SS_ZOH takes the matrix
+* exponential of [A B; 0 0]*dt which is exact for inputs held between steps.
+* SS_TUSTIN is the bilinear transform matching C2DTustin for SISO systems.
+*******************************************************************************/
+ss_system_t create_ss_from_continuous(matrix_t A, matrix_t B, matrix_t C, \
+						matrix_t D, float dt, ss_discretization_t method){
+	ss_system_t sys;
+	matrix_t Mc, E, Wi, W, N, WB, CW;
+	int i, j, k, nx, nu, ny;
+	float rt;
+
+	memset(&sys, 0, sizeof(sys));
+	if(ss_check_continuous(A, B, C, D)<0) return sys;
+	nx = A.rows;
+	nu = B.cols;
+	ny = C.rows;
+	sys = create_ss_system(nx, nu, ny, dt);
+	if(!sys.initialized) return sys;
+
+	switch(method){
+	case SS_ZOH:
+		Mc = create_square_matrix(nx+nu);
+		for(i=0;i<nx;i++){
+			for(j=0;j<nx;j++) Mc.data[i][j] = A.data[i][j]*dt;
+			for(j=0;j<nu;j++) Mc.data[i][nx+j] = B.data[i][j]*dt;
+		}
+		E = matrix_exponential(Mc);
+		destroy_matrix(&Mc);
+		if(!E.initialized) break;
+		for(i=0;i<nx;i++){
+			for(j=0;j<nx;j++) sys.A.data[i][j] = E.data[i][j];
+			for(j=0;j<nu;j++) sys.B.data[i][j] = E.data[i][nx+j];
+		}
+		destroy_matrix(&E);
+		for(i=0;i<ny;i++){
+			for(j=0;j<nx;j++) sys.C.data[i][j] = C.data[i][j];
+			for(j=0;j<nu;j++) sys.D.data[i][j] = D.data[i][j];
+		}
+		return sys;
+
+	case SS_TUSTIN:
+		// W = inv(I - A*dt/2), N = I + A*dt/2
+		Wi = create_identity_matrix(nx);
+		N = create_identity_matrix(nx);
+		for(i=0;i<nx;i++){
+			for(j=0;j<nx;j++){
+				Wi.data[i][j] -= A.data[i][j]*dt/2;
+				N.data[i][j] += A.data[i][j]*dt/2;
+			}
+		}
+		W = invert_matrix(Wi);
+		destroy_matrix(&Wi);
+		if(!W.initialized){
+			destroy_matrix(&N);
+			break;
+		}
+		WB = multiply_matrices(W, B);
+		CW = multiply_matrices(C, W);
+		rt = sqrtf(dt);
+		// Ad = N*W, Bd = W*B*sqrt(dt), Cd = sqrt(dt)*C*W, Dd = D + C*W*B*dt/2
+		for(i=0;i<nx;i++){
+			for(j=0;j<nx;j++){
+				sys.A.data[i][j] = 0.0f;
+				for(k=0;k<nx;k++) sys.A.data[i][j] += N.data[i][k]*W.data[k][j];
+			}
+			for(j=0;j<nu;j++) sys.B.data[i][j] = WB.data[i][j]*rt;
+		}
+		for(i=0;i<ny;i++){
+			for(j=0;j<nx;j++) sys.C.data[i][j] = CW.data[i][j]*rt;
+			for(j=0;j<nu;j++){
+				sys.D.data[i][j] = D.data[i][j];
+				for(k=0;k<nx;k++){
+					sys.D.data[i][j] += C.data[i][k]*WB.data[k][j]*dt/2;
+				}
+			}
+		}
+		destroy_matrix(&W);
+		destroy_matrix(&N);
+		destroy_matrix(&WB);
+		destroy_matrix(&CW);
+		return sys;
+
+	default:
+		printf("ERROR: invalid state space discretization method\n");
+		break;
+	}
+	printf("ERROR: failed to discretize state space system\n");
+	destroy_ss_system(&sys);
+	return sys;
+}
+
+/*******************************************************************************
+* int destroy_ss_system(ss_system_t* sys)
+*******************************************************************************/
+int destroy_ss_system(ss_system_t* sys){
+	if(sys->initialized!=1) return 0;
+	destroy_matrix(&sys->A);
+	destroy_matrix(&sys->B);
+	destroy_matrix(&sys->C);
+	destroy_matrix(&sys->D);
+	destroy_matrix(&sys->M);
+	destroy_vector(&sys->xu);
+	destroy_vector(&sys->out);
+	memset(sys, 0, sizeof(ss_system_t));
+	return 0;
+}
+
+/*******************************************************************************
+* int march_ss_system(ss_system_t* sys, float* u, float* y)
+*
+* Computes y from the current state and input then advances the state. u has
+* nu entries and y room for ny, either may be NULL for a system with no use
+* for it. Nothing is allocated.
+*******************************************************************************/
+int march_ss_system(ss_system_t* sys, float* u, float* y){
+	if(sys->initialized!=1){
+		report_error("ERROR: state space system not initialized yet\n");
+		return -1;
+	}
+	if(u!=NULL) memcpy(&sys->xu.data[sys->nx], u, sys->nu*sizeof(float));
+	else memset(&sys->xu.data[sys->nx], 0, sys->nu*sizeof(float));
+	// [x+; y] = [A B; C D]*[x; u]
+	if(matrix_times_col_vec_into(sys->M, sys->xu, &sys->out)<0) return -1;
+	memcpy(sys->x, sys->out.data, sys->nx*sizeof(float));
+	if(y!=NULL) memcpy(y, &sys->out.data[sys->nx], sys->ny*sizeof(float));
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_ss_system(ss_system_t* sys)
+*
+* zeroes the state
+*******************************************************************************/
+int reset_ss_system(ss_system_t* sys){
+	if(sys->initialized!=1){
+		printf("ERROR: state space system not initialized yet\n");
+		return -1;
+	}
+	memset(sys->xu.data, 0, (sys->nx+sys->nu)*sizeof(float));
+	return 0;
+}
+
+/*******************************************************************************
+* int set_ss_state(ss_system_t* sys, float* x)
+*
+* copies nx entries of x into the state, for example an initial estimate
+*******************************************************************************/
+int set_ss_state(ss_system_t* sys, float* x){
+	if(sys->initialized!=1){
+		printf("ERROR: state space system not initialized yet\n");
+		return -1;
+	}
+	memcpy(sys->x, x, sys->nx*sizeof(float));
+	return 0;
+}
+
+/*******************************************************************************
+* int ss_check_continuous(matrix_t A, matrix_t B, matrix_t C, matrix_t D)
+*
+* makes sure the four matrices describe one system
+*******************************************************************************/
+int ss_check_continuous(matrix_t A, matrix_t B, matrix_t C, matrix_t D){
+	if(!A.initialized || !B.initialized || !C.initialized || !D.initialized){
+		printf("ERROR: matrix not initialized yet\n");
+		return -1;
+	}
+	if(A.rows!=A.cols || B.rows!=A.rows || C.cols!=A.cols || \
+		D.rows!=C.rows || D.cols!=B.cols){
+		printf("ERROR: state space matrix dimensions do not match\n");
+		return -1;
+	}
+	return 0;
+}
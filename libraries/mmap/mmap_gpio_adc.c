@@ -29,6 +29,7 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the FreeBSD Project.
 */
 
+#include "../roboticscape.h"
 #include "mmap_gpio_adc.h"
 #include "mmap_gpio_adc_defs.h"
 
@@ -46,6 +47,20 @@ volatile uint32_t *map; // pointer to /dev/mem
 int mapped = 0; // boolean to check if mem mapped
 int gpio_initialized = 0;
 int adc_initialized = 0;
+int adc_continuous = 0;
+
+// samples drained from the FIFO in continuous mode are kept per channel
+#define ADC_RING_LEN 256	// must be a power of 2
+typedef struct adc_ring_t{
+	uint16_t data[ADC_RING_LEN];
+	unsigned int head;	// total samples written
+	unsigned int tail;	// total samples popped
+} adc_ring_t;
+adc_ring_t adc_ring[ADC_STEPS];
+
+// local function declarations
+void flush_adc_fifo();
+volatile uint32_t* gpio_bank_reg(int bank, int reg);
 
 /*******************************************************************************
 *   Shared Map Function
@@ -134,6 +149,11 @@ int initialize_mmap_gpio(){
 	return 0;
 }
 
+// lets cleanup skip gpio outputs a program never touched
+int mmap_gpio_is_initialized(){
+	return gpio_initialized;
+}
+
 // write HIGH or LOW to a pin
 // pinMUX must already be configured for output
 int mmap_gpio_write(int pin, int state) {
@@ -169,6 +189,73 @@ int mmap_gpio_write(int pin, int state) {
 	return 0;
 }
 
+// pointer to a register in one of the 4 gpio banks
+volatile uint32_t* gpio_bank_reg(int bank, int reg){
+	const int bank_offset[4] = {GPIO0, GPIO1, GPIO2, GPIO3};
+	return &map[(bank_offset[bank]-MMAP_OFFSET+reg)/4];
+}
+
+// set and clear any pins in one bank with a single write each, pins in
+// clear_mask are cleared before those in set_mask are set
+int mmap_gpio_write_mask(int bank, uint32_t set_mask, uint32_t clear_mask){
+	if(initialize_mmap_gpio()){
+		return -1;
+	}
+	if(bank<0 || bank>3){
+		printf("invalid gpio bank\n");
+		return -1;
+	}
+	if(clear_mask) *gpio_bank_reg(bank, GPIO_CLEARDATAOUT) = clear_mask;
+	if(set_mask) *gpio_bank_reg(bank, GPIO_SETDATAOUT) = set_mask;
+	return 0;
+}
+
+// read all 32 input levels of one bank at once, 0 on error
+uint32_t mmap_gpio_read_bank(int bank){
+	if(initialize_mmap_gpio()){
+		return 0;
+	}
+	if(bank<0 || bank>3){
+		printf("invalid gpio bank\n");
+		return 0;
+	}
+	return *gpio_bank_reg(bank, GPIO_DATAIN);
+}
+
+// resolve a pin number once into register pointers and a bit mask so the
+// inline mmap_gpio_pin_* functions can toggle it with a single store
+int mmap_gpio_pin_init(mmap_gpio_pin_t* pin, int gpio){
+	if(initialize_mmap_gpio()){
+		return -1;
+	}
+	if(gpio<0 || gpio>=128){
+		printf("invalid gpio pin\n");
+		return -1;
+	}
+	pin->set = gpio_bank_reg(gpio/32, GPIO_SETDATAOUT);
+	pin->clear = gpio_bank_reg(gpio/32, GPIO_CLEARDATAOUT);
+	pin->datain = gpio_bank_reg(gpio/32, GPIO_DATAIN);
+	pin->bit = 1u<<(gpio%32);
+	return 0;
+}
+
+// write many pins at once, one CLEARDATAOUT and one SETDATAOUT write per bank
+// with a nonzero mask. set and clear hold one 32-bit pin mask per gpio bank.
+// Pins are cleared before others are set.
+int mmap_gpio_write_banks(const uint32_t set[4], const uint32_t clear[4]){
+	int i;
+	if(initialize_mmap_gpio()){
+		return -1;
+	}
+	for(i=0;i<4;i++){
+		if(clear[i]) *gpio_bank_reg(i, GPIO_CLEARDATAOUT) = clear[i];
+	}
+	for(i=0;i<4;i++){
+		if(set[i]) *gpio_bank_reg(i, GPIO_SETDATAOUT) = set[i];
+	}
+	return 0;
+}
+
 // returns 1 or 0 for HIGH or LOW
 // pinMUX must already be configured for input
 int mmap_gpio_read(int pin) {
@@ -242,8 +329,10 @@ int initialize_mmap_adc() {
 	#endif
 	map[(ADC_CTRL-MMAP_OFFSET)/4] &= !0x01;
 	
-	// make sure STEPCONFIG write protect is off
-	map[(ADC_CTRL-MMAP_OFFSET)/4] |= ADC_STEPCONFIG_WRITE_PROTECT_OFF;
+	// make sure STEPCONFIG write protect is off and tag FIFO entries with
+	// their step ID so multi-channel scans can sort them
+	map[(ADC_CTRL-MMAP_OFFSET)/4] |= ADC_STEPCONFIG_WRITE_PROTECT_OFF | \
+															ADC_STEP_ID_TAG;
 
 	// set up each ADCSTEPCONFIG for each ain pin
 	map[(ADCSTEPCONFIG1-MMAP_OFFSET)/4] = 0x00<<19 | ADC_AVG8 | ADC_SW_ONESHOT;
@@ -279,8 +368,14 @@ int initialize_mmap_adc() {
 }
 
 
-// Read in from an analog pin with oneshot mode
+// Read in from an analog pin with oneshot mode. In continuous mode return
+// the newest sample drained from the FIFO instead, waiting only if the 
+// channel has never been sampled.
 int mmap_adc_read_raw(int ch) {
+	if(adc_continuous){
+		while(mmap_adc_drain()>=0 && adc_ring[ch].head==0){}
+		return adc_ring[ch].data[(adc_ring[ch].head-1)&(ADC_RING_LEN-1)];
+	}
 		  
 	// clear the FIFO buffer just in case it's not empty
 	int output;
@@ -300,3 +395,142 @@ int mmap_adc_read_raw(int ch) {
 	return output;
 }
 
+
+// Read all 8 channels in one pass. In one-shot mode every step is enabled at
+// once and the tagged FIFO entries are sorted by step ID as they arrive.
+// In continuous mode the newest drained sample for each channel is returned.
+int mmap_adc_read_raw_all(int raw[ADC_STEPS]){
+	int i, n, id, got;
+	uint32_t entry;
+	if(initialize_mmap_adc()){
+		return -1;
+	}
+	if(adc_continuous){
+		mmap_adc_drain();
+		for(i=0;i<ADC_STEPS;i++){
+			while(adc_ring[i].head==0) mmap_adc_drain();
+			raw[i] = adc_ring[i].data[(adc_ring[i].head-1)&(ADC_RING_LEN-1)];
+		}
+		return 0;
+	}
+	flush_adc_fifo();
+	map[(ADC_STEPENABLE-MMAP_OFFSET)/4] |= ADC_STEP_MASK;
+	got = 0;
+	while(got<ADC_STEPS){
+		n = map[(FIFO0COUNT-MMAP_OFFSET)/4] & FIFO_COUNT_MASK;
+		for(i=0;i<n;i++){
+			entry = map[(ADC_FIFO0DATA-MMAP_OFFSET)/4];
+			id = (entry>>ADC_FIFO_STEPID_SHIFT) & ADC_FIFO_STEPID_MASK;
+			if(id>=ADC_STEPS) continue;
+			raw[id] = entry & ADC_FIFO_MASK;
+			got++;
+		}
+	}
+	return 0;
+}
+
+// throw away everything in FIFO0
+void flush_adc_fifo(){
+	volatile uint32_t entry = 0;
+	while(map[(FIFO0COUNT-MMAP_OFFSET)/4] & FIFO_COUNT_MASK){
+		entry = map[(ADC_FIFO0DATA-MMAP_OFFSET)/4];
+	}
+	(void)entry;
+}
+
+// Put all 8 steps in software continuous mode so the ADC keeps sampling
+// every channel into FIFO0 on its own. averaging is the number of hardware
+// samples averaged per entry, open_delay is in ADC clocks before each step and
+// sample_delay is the sampling time in ADC clocks. Each FIFO entry is tagged
+// with its step ID so mmap_adc_drain can sort them into the right channel.
+int mmap_adc_start_continuous(int averaging, int open_delay, int sample_delay){
+	int i, avg;
+	if(initialize_mmap_adc()){
+		return -1;
+	}
+	switch(averaging){
+		case 1:  avg = ADC_AVG1;  break;
+		case 2:  avg = ADC_AVG2;  break;
+		case 4:  avg = ADC_AVG4;  break;
+		case 8:  avg = ADC_AVG8;  break;
+		case 16: avg = ADC_AVG16; break;
+		default:
+			printf("adc averaging must be 1,2,4,8, or 16\n");
+			return -1;
+	}
+	if(open_delay<0 || open_delay>ADC_MAX_OPEN_DELAY || \
+					sample_delay<0 || sample_delay>ADC_MAX_SAMPLE_DELAY){
+		printf("invalid adc step delay\n");
+		return -1;
+	}
+	// disable adc and open up the step config
+	map[(ADC_CTRL-MMAP_OFFSET)/4] &= ~0x01;
+	map[(ADC_CTRL-MMAP_OFFSET)/4] |= ADC_STEPCONFIG_WRITE_PROTECT_OFF | \
+															ADC_STEP_ID_TAG;
+	// step configs and delays are interleaved 8 bytes apart
+	for(i=0;i<ADC_STEPS;i++){
+		map[(ADCSTEPCONFIG1+8*i-MMAP_OFFSET)/4] = i<<19 | avg | ADC_SW_CONTINUOUS;
+		map[(ADCSTEPDELAY1+8*i-MMAP_OFFSET)/4] = sample_delay<<24 | open_delay;
+		adc_ring[i].head = 0;
+		adc_ring[i].tail = 0;
+	}
+	// empty the FIFO of any old one-shot samples
+	flush_adc_fifo();
+	adc_continuous = 1;
+	// continuous steps stay enabled and loop through the sequence forever
+	map[(ADC_STEPENABLE-MMAP_OFFSET)/4] |= ADC_STEP_MASK;
+	map[(ADC_CTRL-MMAP_OFFSET)/4] |= 0x01;
+	return 0;
+}
+
+// go back to the one-shot configuration from initialize_mmap_adc
+int mmap_adc_stop_continuous(){
+	int i;
+	if(!adc_continuous) return 0;
+	map[(ADC_CTRL-MMAP_OFFSET)/4] &= ~0x01;
+	map[(ADC_STEPENABLE-MMAP_OFFSET)/4] &= ~ADC_STEP_MASK;
+	for(i=0;i<ADC_STEPS;i++){
+		map[(ADCSTEPCONFIG1+8*i-MMAP_OFFSET)/4] = i<<19 | ADC_AVG8 | ADC_SW_ONESHOT;
+		map[(ADCSTEPDELAY1+8*i-MMAP_OFFSET)/4] = 0<<24;
+	}
+	flush_adc_fifo();
+	adc_continuous = 0;
+	map[(ADC_CTRL-MMAP_OFFSET)/4] |= 0x01;
+	return 0;
+}
+
+// Move everything currently in FIFO0 into the per-channel rings without
+// waiting. The count is read once so this never chases a filling FIFO. When
+// a ring is full the oldest sample is dropped. Returns the number of samples
+// moved or -1 if not in continuous mode.
+int mmap_adc_drain(){
+	int i, n, id;
+	uint32_t entry;
+	adc_ring_t* ring;
+	
+	if(!adc_continuous) return -1;
+	n = map[(FIFO0COUNT-MMAP_OFFSET)/4] & FIFO_COUNT_MASK;
+	for(i=0;i<n;i++){
+		entry = map[(ADC_FIFO0DATA-MMAP_OFFSET)/4];
+		id = (entry>>ADC_FIFO_STEPID_SHIFT) & ADC_FIFO_STEPID_MASK;
+		if(id>=ADC_STEPS) continue;
+		ring = &adc_ring[id];
+		ring->data[ring->head&(ADC_RING_LEN-1)] = entry & ADC_FIFO_MASK;
+		ring->head++;
+		if(ring->head-ring->tail > ADC_RING_LEN) ring->tail = ring->head-ADC_RING_LEN;
+	}
+	return n;
+}
+
+// pop up to max of the oldest unread samples for one channel, returns the
+// number of samples copied into raw
+int mmap_adc_pop(int ch, uint16_t* raw, int max){
+	int n = 0;
+	adc_ring_t* ring = &adc_ring[ch];
+	while(n<max && ring->tail!=ring->head){
+		raw[n] = ring->data[ring->tail&(ADC_RING_LEN-1)];
+		ring->tail++;
+		n++;
+	}
+	return n;
+}
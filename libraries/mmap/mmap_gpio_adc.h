@@ -14,17 +14,25 @@ Big thanks to Ethan Hayon for the GPIO code
 #ifndef MMAP_GPIO_ADC
 #define MMAP_GPIO_ADC
 
+#include <stdint.h>
+
 #define HIGH 1
 #define LOW  0 
 
 
 // GPIO
 int initialize_mmap_gpio();
+int mmap_gpio_is_initialized();
 
 
 // ADC
 int initialize_mmap_adc();
 int mmap_adc_read_raw(int ch);
+int mmap_adc_read_raw_all(int raw[8]);
+int mmap_adc_start_continuous(int averaging, int open_delay, int sample_delay);
+int mmap_adc_stop_continuous();
+int mmap_adc_drain();
+int mmap_adc_pop(int ch, uint16_t* raw, int max);
 
 
 #endif
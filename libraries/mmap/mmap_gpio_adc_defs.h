@@ -58,11 +58,19 @@
 #define ADC_AVG16 (0b100 << 2)
 
 #define ADC_SW_ONESHOT 0b00
+#define ADC_SW_CONTINUOUS 0b01
+#define ADC_STEP_ID_TAG (0x01<<1)
+#define ADC_MAX_OPEN_DELAY 0x3FFFF
+#define ADC_MAX_SAMPLE_DELAY 0xFF
 #define FIFO0COUNT (ADC_TSC+0xE4)
 #define FIFO_COUNT_MASK 0b01111111
 
 #define ADC_FIFO0DATA (ADC_TSC+0x100)
 #define ADC_FIFO_MASK (0xFFF)
+#define ADC_FIFO_STEPID_SHIFT 16
+#define ADC_FIFO_STEPID_MASK (0xF)
+#define ADC_STEPS 8
+#define ADC_STEP_MASK (0xFF<<1)	// STEPENABLE bits for steps 1-8
 
 #define TRUE 1
 #define FALSE 0
@@ -46,7 +46,15 @@ int cm_per_mapped=0;
 volatile char *pwm_base[3]; // pwm subsystem pointers for eQEP
 int pwmss_mapped[3] = {0,0,0}; // to record which subsystems have been mapped
 int eqep_initialized[3] = {0,0,0};
-int pwm_initialized[3] = {0,0,0};
+int pwm_initialized[3] = {0,0,0}; // set once CMPA/CMPB shadow load is on
+
+// eQEP capture unit timing, SYSCLKOUT is 100mhz and the capture timer
+// is prescaled by 128 giving 1.28us ticks and 84ms until it overflows
+#define EQEP_CAP_TICK_NS	1280
+#define EQEP_CAP_EDGES		4	// edges per unit position event, see UPPS_4
+
+// local function declarations
+int init_pwm_shadow(int ss);
 
 /********************************************
 *  PWMSS Mapping
@@ -140,6 +148,8 @@ int map_pwmss(int ss){
 	
 	// enable clock from PWMSS
 	*(uint32_t*)(pwm_base[ss]+PWMSS_CLKCONFIG) |= 0x010;
+	// latch compare updates at period boundaries if the ePWM is running
+	init_pwm_shadow(ss);
 	
 	close(dev_mem);
 	#ifdef DEBUG
@@ -208,8 +218,14 @@ int init_eqep(int ss){
 	*(uint16_t*)(pwm_base[ss]+EQEP_OFFSET+QEINT) = UTOF;
 	// set unit period register
 	*(uint32_t*)(pwm_base[ss]+EQEP_OFFSET+QUPRD)=0x5F5E100;
-	// enable counter in control register
-	*(uint16_t*)(pwm_base[ss]+EQEP_OFFSET+QEPCTL) = PHEN|IEL0|SWI|UTE|QCLM;
+	// enable counter in control register, capture timer and period are 
+	// latched whenever QPOSCNT is read so they match the position
+	*(uint16_t*)(pwm_base[ss]+EQEP_OFFSET+QEPCTL) = PHEN|IEL0|SWI|UTE;
+	// capture unit measures time between every 4 edges for velocity
+	// prescalers may only be changed while it's disabled
+	*(uint16_t*)(pwm_base[ss]+EQEP_OFFSET+QCAPCTL) = 0;
+	*(uint16_t*)(pwm_base[ss]+EQEP_OFFSET+QCAPCTL) = CCPS_128|UPPS_4;
+	*(uint16_t*)(pwm_base[ss]+EQEP_OFFSET+QCAPCTL) |= CEN;
 	//enable clock from PWMSS
 	*(uint32_t*)(pwm_base[ss]+PWMSS_CLKCONFIG) |= PWMSS_EQEPCLK_EN;
 	
@@ -231,6 +247,46 @@ int read_eqep(int ch){
 	return  *(int*)(pwm_base[ch] + EQEP_OFFSET +QPOSCNT);
 }
 
+// read all 3 eQEP counters back to back
+int read_eqep_all(int pos[3]){
+	int i;
+	for(i=0;i<3;i++) if(init_eqep(i)) return -1;
+	pos[0] = *(int*)(pwm_base[0] + EQEP_OFFSET +QPOSCNT);
+	pos[1] = *(int*)(pwm_base[1] + EQEP_OFFSET +QPOSCNT);
+	pos[2] = *(int*)(pwm_base[2] + EQEP_OFFSET +QPOSCNT);
+	return 0;
+}
+
+// read position along with velocity in counts/s from the capture unit
+// and the time since the last unit position event. Velocity decays toward 0
+// as the time since the last event grows past the last period and is 0 if 
+// the capture timer overflowed or direction changed since the last read.
+int read_eqep_state(int ch, int* pos, float* velocity, uint64_t* age_ns){
+	uint16_t sts, period, timer;
+	if(init_eqep(ch)) return -1;
+	// reading QPOSCNT latches QCTMRLAT and QCPRDLAT
+	*pos = *(int*)(pwm_base[ch] + EQEP_OFFSET +QPOSCNT);
+	sts = *(uint16_t*)(pwm_base[ch] + EQEP_OFFSET +QEPSTS);
+	period = *(uint16_t*)(pwm_base[ch] + EQEP_OFFSET +QCPRDLAT);
+	timer = *(uint16_t*)(pwm_base[ch] + EQEP_OFFSET +QCTMRLAT);
+	*age_ns = (uint64_t)timer*EQEP_CAP_TICK_NS;
+
+	if(sts & (COEF|CDEF)){
+		// write 1 to clear sticky error flags
+		*(uint16_t*)(pwm_base[ch] + EQEP_OFFSET +QEPSTS) = sts & (COEF|CDEF);
+		*velocity = 0.0;
+		return 0;
+	}
+	if(timer > period) period = timer;
+	if(period==0){
+		*velocity = 0.0;	// no event yet since init
+		return 0;
+	}
+	*velocity = (EQEP_CAP_EDGES*1000000000.0/EQEP_CAP_TICK_NS)/period;
+	if(!(sts & QDF)) *velocity = -*velocity;
+	return 0;
+}
+
 // write a value to the eQEP counter
 int write_eqep(int ch, int val){
 	if(init_eqep(ch)) return -1;
@@ -245,6 +301,25 @@ int write_eqep(int ch, int val){
 * must be done through /sys/class/pwm or with simple_pwm.c
 *****************************************************************/
 
+// put CMPA and CMPB in shadow mode loading at counter zero so a new duty 
+// cycle only takes effect at the start of a period, which avoids runt pulses
+// when the duty changes mid-period. The ePWM registers can only be touched 
+// once the driver has clocked the module, so until then this returns -1 and
+// is tried again on the next duty cycle write.
+int init_pwm_shadow(int ss){
+	uint16_t cmpctl;
+	if(pwm_initialized[ss]) return 0;
+	if(!(*(uint32_t*)(pwm_base[ss]+PWMSS_CLKSTATUS) & PWMSS_EPWMCLK_EN_ACK)){
+		return -1;
+	}
+	cmpctl = *(uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPCTL);
+	cmpctl &= ~(CC_IMMEDIATE_B|CC_IMMEDIATE_A|CC_LOAD_FREEZE_B|CC_LOAD_FREEZE_A);
+	cmpctl |= CC_SHADOW_B|CC_SHADOW_A|CC_CTR_ZERO_B|CC_CTR_ZERO_A;
+	*(uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPCTL) = cmpctl;
+	pwm_initialized[ss] = 1;
+	return 0;
+}
+
 // set duty cycle for either channel A or B in a given subsystem
 // input channel is a character 'A' or 'B'
 int mmap_set_pwm_duty(int ss, char ch, float duty){
@@ -253,6 +328,7 @@ int mmap_set_pwm_duty(int ss, char ch, float duty){
 		printf("failed to map PWMSS %d\n", ss);
 		return -1;
 	}
+	init_pwm_shadow(ss);
 	//sanity check duty
 	if(duty>1.0 || duty<0.0){
 		printf("duty must be between 0.0 & 1.0\n");
@@ -283,3 +359,25 @@ int mmap_set_pwm_duty(int ss, char ch, float duty){
 	
 	return 0;
 }
+
+// set duty cycle for both channels of a subsystem with one check and one
+// write to each compare register. With shadow loading both take effect at the
+// start of the same period.
+int mmap_set_pwm_duty_ab(int ss, float duty_a, float duty_b){
+	// make sure the subsystem is mapped
+	if(map_pwmss(ss)){
+		printf("failed to map PWMSS %d\n", ss);
+		return -1;
+	}
+	init_pwm_shadow(ss);
+	//sanity check duty
+	if(duty_a>1.0 || duty_a<0.0 || duty_b>1.0 || duty_b<0.0){
+		printf("duty must be between 0.0 & 1.0\n");
+		return -1;
+	}
+	// duty ranges from 0 to TBPRD+1 for 0-100% PWM duty
+	uint16_t period = *(uint16_t*)(pwm_base[ss]+PWM_OFFSET+TBPRD);
+	*(uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPA) = lroundf(duty_a*(period+1));
+	*(uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPB) = lroundf(duty_b*(period+1));
+	return 0;
+}
@@ -15,9 +15,16 @@ be done through /sys/class/pwm or with simple_pwm.c
 #ifndef MMAP_PWMSS
 #define MMAP_PWMSS
 
+#include <stdint.h>
+
+// maps a subsystem's registers, done on first use by everything else
+int map_pwmss(int ss);
+
 // eQEP
 int init_eqep(int ss);
 int read_eqep(int ch);
+int read_eqep_all(int pos[3]);
+int read_eqep_state(int ch, int* pos, float* velocity, uint64_t* age_ns);
 int write_eqep(int ch, int val);
 
 
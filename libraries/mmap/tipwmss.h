@@ -101,6 +101,20 @@
 #define PCSPW1    (0x0001 << 1)
 #define PCSPW0    (0x0001 << 0)
 
+// Capture prescalers for QCAPCTL
+#define CCPS_128   (0x0007 << 4)	// capture timer clock SYSCLKOUT/128
+#define UPPS_4     (0x0002 << 0)	// unit position event every 4 edges
+
+// Bits for the QEPSTS register
+#define UPEVNT     (0x0001 << 7)
+#define FDF        (0x0001 << 6)
+#define QDF        (0x0001 << 5)
+#define QDLF       (0x0001 << 4)
+#define COEF       (0x0001 << 3)
+#define CDEF       (0x0001 << 2)
+#define FIMF       (0x0001 << 1)
+#define PCEF       (0x0001 << 0)
+
 // Bits for the interrupt registers
 #define EQEP_INTERRUPT_MASK (0x0FFF)
 #define UTOF                (0x0001 << 11)
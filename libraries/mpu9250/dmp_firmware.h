@@ -7,7 +7,7 @@
 #define MPU6500_BANK_SIZE		256
 #define MPU6500_BANK_SEL		0x6D
 #define MPU6500_MEM_R_W			0x6F
-#define DMP_LOAD_CHUNK			(16)
+#define DMP_LOAD_CHUNK			(128) // must divide MPU6500_BANK_SIZE
 #define DMP_CODE_SIZE           (3062)
 #define DMP_SAMPLE_RATE     	(200)
 
@@ -9,6 +9,11 @@
 #include "../roboticscape-defs.h"
 #include "../roboticscape-usefulincludes.h"
 #include "../roboticscape.h"
+#include "../other/replay.h"
+#include "../other/sim.h"
+#include "../other/cal_store.h"
+#include "../other/latency_trace.h"
+#include "../other/vertical_estimator.h"
 #include "mpu9250_defs.h"
 #include "dmp_firmware.h"
 #include "dmpKey.h"
@@ -17,6 +22,19 @@
 // or enabled.
 #define FIFO_LEN_NO_MAG 28
 #define FIFO_LEN_MAG	35
+#define DMP_QUAT_LEN	16	// 6 axis quaternion, always in the DMP packet
+#define DMP_MAG_LEN		7	// mag bytes the i2c master adds to the FIFO
+#define AK8963_RATE		100	// hz in continuous measurement mode 2
+
+// SPI transport. The datasheet allows 1MHz for every register and 20MHz for
+// reading the sensor, interrupt status and FIFO registers. The register
+// address byte carries the read flag in its top bit.
+#define IMU_SPI_MODE			SPI_MODE_CPOL1_CPHA1
+#define IMU_SPI_CONFIG_HZ		1000000
+#define IMU_SPI_FAST_HZ			20000000
+#define MPU_SPI_READ			0x80
+#define MAG_SLV4_TRIES			50	// 100us polls of I2C_MST_STATUS
+#define MPU_SPI_REG_WRITES		32	// registers in one mpu_write_regs call
 
 // error threshold checks
 #define QUAT_ERROR_THRESH       (1L<<16) // very precise threshold
@@ -26,33 +44,225 @@
 #define GYRO_CAL_THRESH			50
 #define GYRO_OFFSET_THRESH		500
 
+// online gyro bias tracking. Offset register LSBs are 1/32.8 deg/s whatever
+// the FSR. A window counts as still when every gyro axis and the accel norm
+// vary less than these, and a mean rate beyond the step limit is taken to be
+// a slow turn rather than bias.
+#define GYRO_OFFSET_LSB_PER_DEGS	32.8f
+#define GYRO_BIAS_WINDOW_MS		500
+#define GYRO_BIAS_STILL_DEGS	0.3f	// max gyro std dev, deg/s
+#define ACCEL_BIAS_STILL_MS2	0.1f	// max accel norm std dev, m/s^2
+#define GYRO_BIAS_MAX_STEP_DEGS	2.0f
+#define GYRO_BIAS_GAIN			0.25f	// fraction of measured bias removed
+#define GYRO_BIAS_MAX_REG		250		// about 7.6 deg/s
+#define GYRO_BIAS_SAVE_US		600000000	// 10 minutes
+
+// temperature compensation table, 1C bins. Corrections are relative to 
+// their value at IMU_TEMP_REF_C so the gyro calibration file keeps holding 
+// the absolute offsets. The DMP FIFO carries no temperature so it is read 
+// separately once a second in DMP mode.
+#define IMU_TEMP_MIN_C			-20
+#define IMU_TEMP_BINS			96
+#define IMU_TEMP_REF_C			25.0f
+#define IMU_TEMP_MIN_SAMPLES	50		// per bin to keep it
+#define IMU_TEMP_CAL_RATE		100		// hz
+#define IMU_TEMP_CAL_STABLE_S	180		// no warming this long ends it
+#define IMU_TEMP_CAL_STILL_DEGS	2.0f
+
+// number of past DMP samples kept for get_imu_samples_since, power of 2
+#define IMU_SAMPLE_RING_LEN		32
+#define IMU_SAMPLE_READ_TRIES	8
+#define IMU_TIMING_READ_TRIES	8
+
+// raw fifo streaming mode, 6 accel + 2 temp + 6 gyro bytes per packet and
+// 8 more for the magnetometer ST1 through ST2 when it is enabled
+#define STREAM_PACKET_LEN		14
+#define STREAM_PACKET_LEN_MAG	22
+#define MPU_HW_FIFO_SIZE		512
+#define STREAM_MAX_BATCH		(MPU_HW_FIFO_SIZE/STREAM_PACKET_LEN)
+#define I2C_MAX_READ_LEN		128 // MAX_I2C_LENGTH in simple_i2c.c
+#define SPI_MAX_READ_LEN		MPU_HW_FIFO_SIZE
+// a read can stop short of up to 3 mag blocks and a packet too short to
+// check, that much is carried into the next read ahead of a full FIFO
+#define DMP_CARRY_MAX			(3*DMP_MAG_LEN + FIFO_LEN_NO_MAG)
+#define DMP_MAX_BATCH			((DMP_CARRY_MAX+MPU_HW_FIFO_SIZE)/DMP_QUAT_LEN)
+
+// sample clock tracking. The MPU's oscillator is only good to a few percent
+// so its true sample period is estimated from batch arrival times. Gains of
+// an alpha-beta filter on the time of the newest sample, a jump of more than
+// CLOCK_RESYNC_PERIODS means samples were lost and the model starts over.
+#define CLOCK_PHASE_GAIN		0.05
+#define CLOCK_PERIOD_GAIN		0.002
+#define CLOCK_MAX_ERROR			0.10	// fraction of nominal period
+#define CLOCK_RESYNC_PERIODS	3.0
+
+// seqlock protected ring of samples written only by imu_interrupt_handler
+typedef struct imu_sample_slot_t{
+	volatile uint32_t lock;	// odd while the slot is being written
+	imu_sample_t sample;
+} imu_sample_slot_t;
+
+/*******************************************************************************
+*	Per IMU state
+*
+* Everything the driver knows about one MPU9250. The functions below work on
+* whichever instance the calling thread has selected through the thread
+* local mpu pointer, the on-board IMU unless select_imu said otherwise. The
+* threads started for an IMU select it themselves so its interrupt function
+* and everything called from there refer to the IMU that fired.
+*******************************************************************************/
+struct imu_handle_t{
+	// where the chip is, spi_slave is 0 for i2c or SPI1 slave 1 or 2
+	int bus;
+	uint8_t addr;
+	int spi_slave;
+	int spi_ready;	// initialize_spi done for spi_slave
+	int interrupt_pin;
+
+	imu_config_t config;
+	int bypass_en;  
+	int dmp_en;
+	int packet_len;	// bytes per DMP packet, not counting mag blocks
+	pthread_t imu_interrupt_thread;
+	int (*imu_interrupt_func)();
+	int interrupt_func_set;
+	float mag_factory_adjust[3];
+	float mag_offsets[3];
+	float mag_scales[3];
+	float mag_gain[3];	// factory adjust, uT conversion and scale in one
+	float mag_bias[3];	// offsets times scale, applied after mag_gain
+	uint8_t last_mag_raw[6];	// last mag block seen in the DMP FIFO
+	int mag_updated;	// new mag data since data_fusion last ran the filters
+	int last_read_successful;
+	int mag_master_en; // 1 when the AK8963 is slaved to the MPU i2c master
+	uint64_t last_interrupt_timestamp_micros;
+	imu_data_t* data_ptr;
+	int shutdown_interrupt_thread;
+	int imu_replay_en; // fed by a replay log or simulation, not the chip
+	int fifo_stream_en;
+	int stream_packet_len;
+	uint64_t stream_period_micros;
+	uint64_t stream_overflows;
+	int (*imu_fifo_batch_func)(imu_sample_t* samples, int n);
+	imu_sample_t stream_batch[STREAM_MAX_BATCH];
+
+	// every DMP packet parsed by the last read_dmp_fifo, oldest first
+	imu_data_t dmp_batch[DMP_MAX_BATCH];
+	unsigned char dmp_carry[DMP_CARRY_MAX];	// partial packet between reads
+	int dmp_carry_len;
+	int dmp_first_read;	// no misalignment warnings until a good read
+	uint64_t dmp_dropped_packets;
+	uint64_t dmp_fifo_resets;
+
+	// magnetometer yaw fusion, kept between calls to data_fusion. The fused
+	// quaternion is the DMP quaternion turned about the vertical by yaw_corr
+	float yaw_corr[4];		// correction quaternion, only W and Z are used
+	float yaw_corr_angle;	// the same rotation in radians, kept for Euler yaw
+	float yaw_corr_gain;	// share of the heading error taken per mag sample
+	int fusion_first_run;
+
+	// model of the MPU sample clock in micros_since_boot() time
+	double imu_clock_newest;	// estimated acquisition time of newest sample
+	double imu_clock_period;	// estimated sample period, us
+	double imu_clock_nominal;
+	int imu_clock_synced;
+	uint64_t imu_clock_resyncs;
+
+	imu_sample_slot_t imu_sample_ring[IMU_SAMPLE_RING_LEN];
+	volatile uint64_t newest_imu_sample_seq;
+
+	// handler timing histograms, same single writer seqlock as the ring
+	volatile uint32_t imu_timing_lock;
+	imu_timing_stats_t imu_timing;
+	volatile int imu_timing_reset_requested;
+	uint64_t imu_timing_prev_timestamp;
+	uint32_t last_fusion_micros;	// data_fusion time in last read_dmp_fifo
+
+	// optional worker that runs the user function off the interrupt thread
+	pthread_t imu_worker_thread;
+	pthread_mutex_t imu_worker_mutex;
+	pthread_cond_t imu_worker_cond;
+	int imu_worker_en;
+	int imu_worker_shutdown;
+	int imu_worker_pending;	// a sample is waiting for the worker
+	int imu_worker_busy;	// the worker is inside the user function
+	imu_data_t imu_acq_data;	// what the handler parses into, worker on
+	imu_data_t* imu_user_data_ptr;
+	imu_data_t imu_worker_sample;
+	uint64_t imu_worker_timestamp;
+	uint64_t imu_worker_period_micros;
+	uint64_t imu_callback_overruns;
+	uint64_t imu_callback_missed_deadlines;
+
+	// online gyro bias tracking, only run from the interrupt or stream thread
+	int16_t gyro_offset_reg[3];	// what is in the XG_OFFSET_H registers now
+	int gyro_bias_window;		// samples per stillness test
+	int gyro_bias_n;
+	float gyro_bias_sum[3], gyro_bias_sumsq[3];
+	float accel_norm_sum, accel_norm_sumsq;
+	uint64_t gyro_bias_updates;
+	uint64_t gyro_bias_saved_micros;
+	int gyro_bias_dirty;		// registers changed since the file was written
+	int16_t gyro_bias_save_offsets[3];
+	pthread_mutex_t gyro_bias_save_mutex;
+	int16_t gyro_offset_base[3];	// from the file and tracking, at ref temp
+
+	// temperature compensation, dense after loading so lookup is one lerp
+	int temp_comp_en;
+	float temp_comp_gyro[IMU_TEMP_BINS][3];		// deg/s
+	float temp_comp_accel[IMU_TEMP_BINS][3];	// m/s^2
+	float temp_accel_corr[3];	// interpolated for the last temperature
+	int16_t gyro_temp_corr[3];	// offset register LSBs added to the base
+	int temp_comp_period;		// DMP packets between temperature reads
+	int temp_comp_count;
+};
+
 /*******************************************************************************
 *	Local variables
 *******************************************************************************/
-imu_config_t config;
-int bypass_en;  
-int dmp_en;
-int packet_len;
-pthread_t imu_interrupt_thread;
-int (*imu_interrupt_func)();
-int interrupt_func_set;
-float mag_factory_adjust[3];
-float mag_offsets[3];
-float mag_scales[3];
-int last_read_successful;
-uint64_t last_interrupt_timestamp_micros;
-imu_data_t* data_ptr;
-int shutdown_interrupt_thread = 0;
+// the MPU9250 on the cape, the only one with calibration files
+imu_handle_t onboard_imu = {
+	.bus = IMU_BUS,
+	.addr = IMU_ADDR,
+	.interrupt_pin = IMU_INTERRUPT_PIN,
+	.dmp_first_read = 1,
+	.fusion_first_run = 1,
+	.imu_worker_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.imu_worker_cond = PTHREAD_COND_INITIALIZER,
+	.gyro_bias_save_mutex = PTHREAD_MUTEX_INITIALIZER
+};
+__thread imu_handle_t* mpu = &onboard_imu;
+
 
 /*******************************************************************************
 *	config functions for internal use only
 *******************************************************************************/
+int mpu_init_bus();
+int mpu_bus_in_use();
+int mpu_claim_bus();
+int mpu_claim_bus_priority(int priority);
+int mpu_release_bus();
+int mpu_read_bytes(uint8_t reg, int length, uint8_t* data);
+int mpu_read_byte(uint8_t reg, uint8_t* data);
+int mpu_read_word(uint8_t reg, uint16_t* data);
+int mpu_write_bytes(uint8_t reg, int length, uint8_t* data);
+int mpu_write_byte(uint8_t reg, uint8_t data);
+int mpu_write_regs(const i2c_reg_write_t* regs, int n);
+int mpu_max_read_len();
+int mag_read_bytes(uint8_t reg, int length, uint8_t* data);
+int mag_write_byte(uint8_t reg, uint8_t data);
+int mag_slv4_transfer(uint8_t addr, uint8_t reg, uint8_t out, uint8_t* in);
 int reset_mpu9250();
+int warm_reset_mpu9250();
+int dmp_firmware_resident();
 int set_gyro_fsr(gyro_fsr_t fsr, imu_data_t* data);
 int set_accel_fsr(accel_fsr_t, imu_data_t* data);
 int set_gyro_dlpf(gyro_dlpf_t);
 int set_accel_dlpf(accel_dlpf_t);
 int initialize_magnetometer();
+int configure_mag_slave_read();
+int process_raw_mag_data(uint8_t* raw, imu_data_t* data);
+void update_mag_correction();
 int power_down_magnetometer();
 int mpu_set_bypass(unsigned char bypass_on);
 int mpu_write_mem(unsigned short mem_addr, unsigned short length,\
@@ -72,13 +282,42 @@ int mpu_set_dmp_state(unsigned char enable);
 int set_int_enable(unsigned char enable);
 int dmp_set_interrupt_mode(unsigned char mode);
 int read_dmp_fifo();
+void parse_dmp_packet(unsigned char* raw);
+void parse_dmp_mag(unsigned char* raw);
+void deliver_dmp_batch(int n, int first_run);
+void reset_imu_clock(double nominal_us);
+void update_imu_clock(uint64_t t_obs, int n);
+uint64_t imu_sample_time(int k, int n);
 int data_fusion();
+void fuse_yaw_corr(float c[4], float q[4], float out[4]);
+float wrap_yaw(float yaw);
 int load_gyro_offets();
+void start_gyro_bias_tracking(int sample_rate);
+void track_gyro_bias(imu_data_t* data);
+int write_gyro_offset_regs(int16_t reg[3]);
+void* gyro_bias_save_thread(void* ptr);
+int update_gyro_offset_regs();
+int load_imu_temp_calibration();
+void start_temp_compensation(int sample_rate);
+void apply_temp_compensation(imu_data_t* data, int have_temp);
 int load_mag_calibration();
 int write_mag_cal_to_disk(float offsets[3], float scale[3]);
 void* imu_interrupt_handler(void* ptr);
-int (*imu_interrupt_func)(); // pointer to user-defined function
+void* imu_fifo_stream_handler(void* ptr);
+int start_imu_thread(void* (*func)(void*));
+int reset_stream_fifo();
+int read_raw_fifo();
+uint64_t kernel_event_ns_to_micros(uint64_t ns);
 int check_quaternion_validity(unsigned char* raw, int i);
+void publish_imu_sample(imu_data_t* data, uint64_t timestamp_micros);
+int read_imu_sample_slot(uint64_t seq, imu_sample_t* sample);
+void clear_imu_timing(uint32_t budget_us);
+void record_imu_timing(uint32_t* us, int mask);
+int start_imu_callback_worker(imu_data_t* data);
+void stop_imu_callback_worker();
+void run_imu_callback(uint64_t timestamp_micros);
+void* imu_callback_worker(void* ptr);
+void trace_imu_point(trace_point_t p);
 
 
 /*******************************************************************************
@@ -101,7 +340,21 @@ imu_config_t get_default_imu_config(){
 	conf.orientation = ORIENTATION_Z_UP;
 	conf.compass_time_constant = 5.0;
 	conf.dmp_interrupt_priority = sched_get_priority_max(SCHED_FIFO)-1;
+	conf.interrupt_backend = IMU_INTERRUPT_SYSFS;
 	conf.show_warnings = 0;
+	conf.fast_math = 0;
+	conf.dmp_verify_firmware = 1;
+	conf.dmp_warm_start = 0;
+	conf.dmp_deliver_backlog = 0;
+	conf.dmp_send_accel = 1;
+	conf.dmp_send_gyro = 1;
+	conf.callback_worker = 0;
+	conf.track_gyro_bias = 0;
+	conf.temp_compensation = 0;
+	
+	// raw fifo streaming stuff
+	conf.fifo_sample_rate = 1000;
+	conf.fifo_drain_rate = 100;
 	return conf;
 }
 
@@ -115,6 +368,386 @@ int set_imu_config_to_defaults(imu_config_t *conf){
 	return 0;
 }
 
+/*******************************************************************************
+* imu_handle_t* create_imu_handle(int bus, int address, int interrupt_pin)
+*
+* Describes an MPU9250 other than the one on the cape. Nothing is sent to the
+* chip until it is selected and initialized. interrupt_pin may be -1 for an
+* IMU only used in one-shot or FIFO stream mode.
+*******************************************************************************/
+imu_handle_t* create_imu_handle(int bus, int address, int interrupt_pin){
+	imu_handle_t* imu;
+	if(bus!=1 && bus!=2){
+		printf("ERROR: i2c bus must be 1 or 2\n");
+		return NULL;
+	}
+	if(address!=0x68 && address!=0x69){
+		printf("ERROR: MPU9250 address must be 0x68 or 0x69\n");
+		return NULL;
+	}
+	if(bus==IMU_BUS && address==IMU_ADDR){
+		printf("ERROR: that is the on-board IMU, use select_imu(NULL)\n");
+		return NULL;
+	}
+	imu = (imu_handle_t*)calloc(1, sizeof(imu_handle_t));
+	if(imu==NULL){
+		printf("ERROR: failed to allocate imu handle\n");
+		return NULL;
+	}
+	imu->bus = bus;
+	imu->addr = address;
+	imu->interrupt_pin = interrupt_pin;
+	imu->dmp_first_read = 1;
+	imu->fusion_first_run = 1;
+	pthread_mutex_init(&imu->imu_worker_mutex, NULL);
+	pthread_cond_init(&imu->imu_worker_cond, NULL);
+	pthread_mutex_init(&imu->gyro_bias_save_mutex, NULL);
+	return imu;
+}
+
+/*******************************************************************************
+* imu_handle_t* create_imu_handle_spi(int slave, int interrupt_pin)
+*
+* Describes an MPU9250 wired to SPI1 slave select 1 or 2 instead of i2c. The
+* SPI port is set up when the IMU is first initialized.
+*******************************************************************************/
+imu_handle_t* create_imu_handle_spi(int slave, int interrupt_pin){
+	imu_handle_t* imu;
+	if(slave!=1 && slave!=2){
+		printf("ERROR: spi slave must be 1 or 2\n");
+		return NULL;
+	}
+	imu = (imu_handle_t*)calloc(1, sizeof(imu_handle_t));
+	if(imu==NULL){
+		printf("ERROR: failed to allocate imu handle\n");
+		return NULL;
+	}
+	imu->addr = IMU_ADDR;
+	imu->spi_slave = slave;
+	imu->interrupt_pin = interrupt_pin;
+	imu->dmp_first_read = 1;
+	imu->fusion_first_run = 1;
+	pthread_mutex_init(&imu->imu_worker_mutex, NULL);
+	pthread_cond_init(&imu->imu_worker_cond, NULL);
+	pthread_mutex_init(&imu->gyro_bias_save_mutex, NULL);
+	return imu;
+}
+
+/*******************************************************************************
+* int destroy_imu_handle(imu_handle_t* imu)
+*
+* Frees a handle from create_imu_handle. Call power_off_imu with it selected
+* first if it was initialized. The calling thread goes back to the on-board
+* IMU if it had this one selected.
+*******************************************************************************/
+int destroy_imu_handle(imu_handle_t* imu){
+	if(imu==NULL || imu==&onboard_imu){
+		printf("ERROR: can only destroy handles from create_imu_handle\n");
+		return -1;
+	}
+	if((imu->dmp_en || imu->fifo_stream_en) && !imu->shutdown_interrupt_thread){
+		printf("ERROR: call power_off_imu before destroy_imu_handle\n");
+		return -1;
+	}
+	pthread_mutex_destroy(&imu->imu_worker_mutex);
+	pthread_cond_destroy(&imu->imu_worker_cond);
+	pthread_mutex_destroy(&imu->gyro_bias_save_mutex);
+	if(imu->spi_ready) close_spi(imu->spi_slave);
+	if(mpu==imu) mpu = &onboard_imu;
+	free(imu);
+	return 0;
+}
+
+/*******************************************************************************
+* int select_imu(imu_handle_t* imu)
+*
+* Points the IMU functions called from this thread at imu, or at the
+* on-board IMU when imu is NULL. Other threads keep their own selection.
+*******************************************************************************/
+int select_imu(imu_handle_t* imu){
+	if(imu==NULL) mpu = &onboard_imu;
+	else mpu = imu;
+	return 0;
+}
+
+/*******************************************************************************
+* imu_handle_t* get_selected_imu()
+*
+* Handle of the IMU the calling thread is using, the on-board one by default.
+*******************************************************************************/
+imu_handle_t* get_selected_imu(){
+	return mpu;
+}
+
+/*******************************************************************************
+*	register access
+*
+* Every register access below goes through these so the driver runs the same
+* over i2c or SPI. simple_spi's register functions put the write flag in the
+* top address bit, the MPU9250 wants the read flag there, so SPI transfers
+* are built here. Register writes always run at IMU_SPI_CONFIG_HZ.
+*******************************************************************************/
+
+/*******************************************************************************
+* int mpu_init_bus()
+*
+* Opens the i2c bus or SPI port the selected IMU is on.
+*******************************************************************************/
+int mpu_init_bus(){
+	if(!mpu->spi_slave) return i2c_init(mpu->bus, mpu->addr);
+	if(mpu->spi_ready) return 0;
+	if(initialize_spi(SS_MODE_AUTO, IMU_SPI_MODE, IMU_SPI_CONFIG_HZ, \
+													mpu->spi_slave)<0){
+		return -1;
+	}
+	mpu->spi_ready = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int mpu_bus_in_use()
+*
+* i2c claims are only advisory between processes, SPI slaves aren't shared.
+*******************************************************************************/
+int mpu_bus_in_use(){
+	if(mpu->spi_slave) return 0;
+	return i2c_get_in_use_state(mpu->bus);
+}
+
+/*******************************************************************************
+* int mpu_claim_bus()
+*******************************************************************************/
+int mpu_claim_bus(){
+	if(mpu->spi_slave) return 0;
+	return i2c_claim_bus(mpu->bus);
+}
+
+/*******************************************************************************
+* int mpu_claim_bus_priority(int priority)
+*******************************************************************************/
+int mpu_claim_bus_priority(int priority){
+	if(mpu->spi_slave) return 0;
+	return i2c_claim_bus_priority(mpu->bus, priority);
+}
+
+/*******************************************************************************
+* int mpu_release_bus()
+*******************************************************************************/
+int mpu_release_bus(){
+	if(mpu->spi_slave) return 0;
+	return i2c_release_bus(mpu->bus);
+}
+
+/*******************************************************************************
+* int mpu_read_bytes(uint8_t reg, int length, uint8_t* data)
+*
+* Returns the number of bytes read like i2c_read_bytes, -1 on error. Sensor,
+* interrupt status and FIFO reads go at IMU_SPI_FAST_HZ over SPI.
+*******************************************************************************/
+int mpu_read_bytes(uint8_t reg, int length, uint8_t* data){
+	spi_xfer_t xfer[2];
+	char addr = reg | MPU_SPI_READ;
+	int speed = IMU_SPI_CONFIG_HZ;
+	
+	if(!mpu->spi_slave){
+		i2c_set_device_address(mpu->bus, mpu->addr);
+		return i2c_read_bytes(mpu->bus, reg, length, data);
+	}
+	if((reg>=INT_STATUS && reg<=EXT_SENS_DATA_23) || reg==FIFO_COUNTH || \
+													reg==FIFO_R_W){
+		speed = IMU_SPI_FAST_HZ;
+	}
+	// address then response in one select
+	xfer[0].tx_data = &addr;
+	xfer[0].rx_data = NULL;
+	xfer[0].bytes = 1;
+	xfer[0].cs_change = 0;
+	xfer[0].speed_hz = speed;
+	xfer[1].tx_data = NULL;
+	xfer[1].rx_data = (char*)data;
+	xfer[1].bytes = length;
+	xfer[1].cs_change = 0;
+	xfer[1].speed_hz = speed;
+	if(spi_transfer_list(xfer, 2, mpu->spi_slave)<0) return -1;
+	return length;
+}
+
+/*******************************************************************************
+* int mpu_read_byte(uint8_t reg, uint8_t* data)
+*******************************************************************************/
+int mpu_read_byte(uint8_t reg, uint8_t* data){
+	return mpu_read_bytes(reg, 1, data);
+}
+
+/*******************************************************************************
+* int mpu_read_word(uint8_t reg, uint16_t* data)
+*
+* big endian register pair, returns 0 on success like i2c_read_word
+*******************************************************************************/
+int mpu_read_word(uint8_t reg, uint16_t* data){
+	uint8_t raw[2];
+	if(!mpu->spi_slave){
+		i2c_set_device_address(mpu->bus, mpu->addr);
+		return i2c_read_word(mpu->bus, reg, data);
+	}
+	if(mpu_read_bytes(reg, 2, raw)<0) return -1;
+	*data = ((uint16_t)raw[0]<<8)|raw[1];
+	return 0;
+}
+
+/*******************************************************************************
+* int mpu_write_bytes(uint8_t reg, int length, uint8_t* data)
+*
+* Auto-incremented write starting at reg, returns 0 on success. Over SPI the
+* i2c slave interface is kept disabled whenever USER_CTRL is written.
+*******************************************************************************/
+int mpu_write_bytes(uint8_t reg, int length, uint8_t* data){
+	char buf[MPU6500_BANK_SIZE+1];
+	spi_xfer_t xfer;
+	
+	if(!mpu->spi_slave){
+		i2c_set_device_address(mpu->bus, mpu->addr);
+		return i2c_write_bytes(mpu->bus, reg, length, data);
+	}
+	if(length<1 || length>MPU6500_BANK_SIZE){
+		printf("ERROR: mpu_write_bytes length must be 1 to %d\n", \
+														MPU6500_BANK_SIZE);
+		return -1;
+	}
+	buf[0] = reg & ~MPU_SPI_READ;
+	memcpy(&buf[1], data, length);
+	if(reg==USER_CTRL) buf[1] |= I2C_IF_DIS;
+	xfer.tx_data = buf;
+	xfer.rx_data = NULL;
+	xfer.bytes = length+1;
+	xfer.cs_change = 0;
+	xfer.speed_hz = IMU_SPI_CONFIG_HZ;
+	if(spi_transfer_list(&xfer, 1, mpu->spi_slave)<0) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* int mpu_write_byte(uint8_t reg, uint8_t data)
+*******************************************************************************/
+int mpu_write_byte(uint8_t reg, uint8_t data){
+	return mpu_write_bytes(reg, 1, &data);
+}
+
+/*******************************************************************************
+* int mpu_write_regs(const i2c_reg_write_t* regs, int n)
+*
+* Writes a list of single registers in order, all in one ioctl either way.
+* Over SPI each register is its own select.
+*******************************************************************************/
+int mpu_write_regs(const i2c_reg_write_t* regs, int n){
+	char buf[MPU_SPI_REG_WRITES][2];
+	spi_xfer_t xfer[MPU_SPI_REG_WRITES];
+	int i;
+	
+	if(!mpu->spi_slave){
+		i2c_set_device_address(mpu->bus, mpu->addr);
+		return i2c_write_regs(mpu->bus, regs, n);
+	}
+	if(n<1 || n>MPU_SPI_REG_WRITES){
+		printf("ERROR: mpu_write_regs n must be between 1 and %d\n",\
+													MPU_SPI_REG_WRITES);
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		buf[i][0] = regs[i].regAddr & ~MPU_SPI_READ;
+		buf[i][1] = regs[i].data;
+		if(regs[i].regAddr==USER_CTRL) buf[i][1] |= I2C_IF_DIS;
+		xfer[i].tx_data = buf[i];
+		xfer[i].rx_data = NULL;
+		xfer[i].bytes = 2;
+		xfer[i].cs_change = (i<n-1);
+		xfer[i].speed_hz = IMU_SPI_CONFIG_HZ;
+	}
+	if(spi_transfer_list(xfer, n, mpu->spi_slave)<0) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* int mpu_max_read_len()
+*
+* Longest single read the transport allows, a whole FIFO over SPI.
+*******************************************************************************/
+int mpu_max_read_len(){
+	if(mpu->spi_slave) return SPI_MAX_READ_LEN;
+	return I2C_MAX_READ_LEN;
+}
+
+/*******************************************************************************
+* int mag_read_bytes(uint8_t reg, int length, uint8_t* data)
+*
+* Direct access to the AK8963 while setting it up. On i2c the MPU9250 must
+* be in bypass mode and the AK8963 is addressed on the same bus. Over SPI
+* there is no bypass so each byte goes through the MPU's i2c master slave 4.
+* Returns the number of bytes read or -1.
+*******************************************************************************/
+int mag_read_bytes(uint8_t reg, int length, uint8_t* data){
+	int i, ret;
+	if(!mpu->spi_slave){
+		i2c_set_device_address(mpu->bus, AK8963_ADDR);
+		ret = i2c_read_bytes(mpu->bus, reg, length, data);
+		i2c_set_device_address(mpu->bus, mpu->addr);
+		return ret;
+	}
+	for(i=0;i<length;i++){
+		if(mag_slv4_transfer(BIT_I2C_READ|AK8963_ADDR, reg+i, 0, &data[i])){
+			return -1;
+		}
+	}
+	return length;
+}
+
+/*******************************************************************************
+* int mag_write_byte(uint8_t reg, uint8_t data)
+*
+* returns 0 on success, see mag_read_bytes
+*******************************************************************************/
+int mag_write_byte(uint8_t reg, uint8_t data){
+	int ret;
+	if(!mpu->spi_slave){
+		i2c_set_device_address(mpu->bus, AK8963_ADDR);
+		ret = i2c_write_byte(mpu->bus, reg, data);
+		i2c_set_device_address(mpu->bus, mpu->addr);
+		return ret;
+	}
+	return mag_slv4_transfer(AK8963_ADDR, reg, data, NULL);
+}
+
+/*******************************************************************************
+* int mag_slv4_transfer(uint8_t addr, uint8_t reg, uint8_t out, uint8_t* in)
+*
+* One byte transaction on the MPU's auxiliary i2c bus through slave 4. addr
+* has BIT_I2C_READ set for reads, which leave the byte in *in. Needs the i2c
+* master enabled, see mpu_set_bypass. Returns 0 on success.
+*******************************************************************************/
+int mag_slv4_transfer(uint8_t addr, uint8_t reg, uint8_t out, uint8_t* in){
+	uint8_t st = 0;
+	int i;
+	const i2c_reg_write_t regs[] = {
+		{I2C_SLV4_ADDR,	addr},
+		{I2C_SLV4_REG,	reg},
+		{I2C_SLV4_DO,	out},
+		{I2C_SLV4_CTRL,	BIT_SLAVE_EN}
+	};
+	
+	if(mpu_write_regs(regs, sizeof(regs)/sizeof(regs[0]))) return -1;
+	for(i=0;i<MAG_SLV4_TRIES;i++){
+		usleep(100);
+		if(mpu_read_byte(I2C_MST_STATUS, &st)<0) return -1;
+		if(st&I2C_SLV4_DONE) break;
+	}
+	if(i==MAG_SLV4_TRIES || (st&I2C_SLV4_NACK)){
+		printf("ERROR: no answer from magnetometer on mpu9250 i2c master\n");
+		return -1;
+	}
+	if(in!=NULL && mpu_read_byte(I2C_SLV4_DI, in)<0) return -1;
+	return 0;
+}
+
 /*******************************************************************************
 * int initialize_imu(imu_config_t conf)
 *
@@ -125,93 +758,101 @@ int initialize_imu(imu_data_t *data, imu_config_t conf){
 	
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(i2c_get_in_use_state(IMU_BUS)){
+	if(mpu_bus_in_use()){
 		printf("i2c bus claimed by another process\n");
 		printf("Continuing with initialize_imu() anyway.\n");
 	}
 	
 	// if it is not claimed, start the i2c bus
-	if(i2c_init(IMU_BUS, IMU_ADDR)<0){
+	if(mpu_init_bus()<0){
 		printf("failed to initialize i2c bus\n");
 		return -1;
 	}
 	// claiming the bus does no guarantee other code will not interfere 
 	// with this process, but best to claim it so other code can check
 	// like we did above
-	i2c_claim_bus(IMU_BUS);
+	mpu_claim_bus();
 	
 	// update local copy of config struct with new values
-	config=conf;
+	mpu->config=conf;
 	
 	// restart the device so we start with clean registers
 	if(reset_mpu9250()<0){
 		printf("ERROR: failed to reset_mpu9250\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	//check the who am i register to make sure the chip is alive
-	if(i2c_read_byte(IMU_BUS, WHO_AM_I_MPU9250, &c)<0){
+	if(mpu_read_byte(WHO_AM_I_MPU9250, &c)<0){
 		printf("Reading WHO_AM_I_MPU9250 register failed\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(c!=0x71){
 		printf("mpu9250 WHO AM I register should return 0x71\n");
 		printf("WHO AM I returned: 0x%x\n", c);
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
  
 	// load in gyro calibration offsets from disk
 	if(load_gyro_offets()<0){
 		printf("ERROR: failed to load gyro calibration offsets\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	// Set sample rate = 1000/(1 + SMPLRT_DIV)
 	// here we use a divider of 0 for 1khz sample
-	if(i2c_write_byte(IMU_BUS, SMPLRT_DIV, 0x00)){
+	if(mpu_write_byte(SMPLRT_DIV, 0x00)){
 		printf("I2C bus write error\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	// set full scale ranges and filter constants
 	if(set_gyro_fsr(conf.gyro_fsr, data)){
 		printf("failed to set gyro fsr\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(set_accel_fsr(conf.accel_fsr, data)){
 		printf("failed to set accel fsr\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(set_gyro_dlpf(conf.gyro_dlpf)){
 		printf("failed to set gyro dlpf\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(set_accel_dlpf(conf.accel_dlpf)){
 		printf("failed to set accel_dlpf\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	// initialize the magnetometer too if requested in config
+	mpu->mag_master_en = 0;
 	if(conf.enable_magnetometer){
 		if(initialize_magnetometer()){
 			printf("failed to initialize magnetometer\n");
-			i2c_release_bus(IMU_BUS);
+			mpu_release_bus();
+			return -1;
+		}
+		// hand the magnetometer over to the MPU's internal i2c master so its
+		// data lands in EXT_SENS_DATA right after the gyro registers
+		if(configure_mag_slave_read()){
+			printf("failed to slave magnetometer to mpu9250 i2c master\n");
+			mpu_release_bus();
 			return -1;
 		}
 	}
 	else power_down_magnetometer();
 	
 	// all done!!
-	i2c_release_bus(IMU_BUS);
+	mpu_release_bus();
 	return 0;
 }
 
@@ -225,11 +866,8 @@ int read_accel_data(imu_data_t *data){
 	// new register data stored here
 	uint8_t raw[6];  
 	
-	// set the device address
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
-	
 	 // Read the six raw data registers into data array
-	if(i2c_read_bytes(IMU_BUS, ACCEL_XOUT_H, 6, &raw[0])<0){
+	if(mpu_read_bytes(ACCEL_XOUT_H, 6, &raw[0])<0){
 		return -1;
 	}
 	
@@ -256,11 +894,8 @@ int read_gyro_data(imu_data_t *data){
 	// new register data stored here
 	uint8_t raw[6];
 	
-	// set the device address
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
-	
 	 // Read the six raw data registers into data array
-	if(i2c_read_bytes(IMU_BUS, GYRO_XOUT_H, 6, &raw[0])<0){
+	if(mpu_read_bytes(GYRO_XOUT_H, 6, &raw[0])<0){
 		return -1;
 	}
 	 
@@ -286,23 +921,31 @@ int read_gyro_data(imu_data_t *data){
 *******************************************************************************/
 int read_mag_data(imu_data_t* data){
 	uint8_t st1;
-	uint8_t raw[7];
-	int16_t adc[3];
-	float factory_cal_data[3];
+	uint8_t raw[8];
 	
-	if(config.enable_magnetometer==0){
+	if(mpu->config.enable_magnetometer==0){
 		printf("ERROR: can't read magnetometer unless it is enabled in \n");
 		printf("imu_config_t struct before calling initialize_imu\n");
 		return -1;
 	}
 	
+	// when the magnetometer is slaved to the MPU's i2c master the latest
+	// ST1, data, and ST2 registers are mirrored in EXT_SENS_DATA so one
+	// read from the MPU9250 itself is all that is needed
+	if(mpu->mag_master_en){
+		if(mpu_read_bytes(EXT_SENS_DATA_00, 8, &raw[0])<0){
+			printf("read_mag_data failed\n");
+			return -1;
+		}
+		if(!(raw[0]&MAG_DATA_READY)) return 0;
+		return process_raw_mag_data(&raw[1], data);
+	}
+	
 	// magnetometer is actually a separate device with its
 	// own address inside the mpu9250
 	// MPU9250 was put into passthrough mode 
-	i2c_set_device_address(IMU_BUS, AK8963_ADDR);
-	
 	// read the data ready bit to see if there is new data
-	if(i2c_read_byte(IMU_BUS, AK8963_ST1, &st1)<0){
+	if(mag_read_bytes(AK8963_ST1, 1, &st1)<0){
 		printf("Error reading Magnetometer, i2c_bypass is probably not set\n");
 		return -1;
 	}
@@ -317,10 +960,22 @@ int read_mag_data(imu_data_t* data){
 	}
 	
 	// Read the six raw data regs into data array	
-	if(i2c_read_bytes(IMU_BUS,AK8963_XOUT_L,7,&raw[0])<0){
+	if(mag_read_bytes(AK8963_XOUT_L,7,&raw[0])<0){
 		printf("read_mag_data failed\n");
 		return -1;
 	}
+	return process_raw_mag_data(&raw[0], data);
+}
+
+/*******************************************************************************
+* int process_raw_mag_data(uint8_t* raw, imu_data_t* data)
+*
+* Converts the 7 bytes read from AK8963_XOUT_L through AK8963_ST2 into 
+* calibrated values in units of uT and places them in the data struct. Used by
+* both read_mag_data and read_imu_all.
+*******************************************************************************/
+int process_raw_mag_data(uint8_t* raw, imu_data_t* data){
+	int16_t adc[3];
 	
 	// check if the readings saturated such as because
 	// of a local field source, discard data if so
@@ -339,26 +994,43 @@ int read_mag_data(imu_data_t* data){
 	printf("raw mag:%d %d %d\n", adc[0], adc[1], adc[2]);
 	#endif
 
-	// multiply by the sensitivity adjustment and convert to units of uT micro
-	// Teslas. Also correct the coordinate system as someone in invensense 
-	// thought it would be bright idea to have the magnetometer coordiate
-	// system aligned differently than the accelerometer and gyro.... -__-
-	factory_cal_data[0] = adc[1] * mag_factory_adjust[1] * MAG_RAW_TO_uT;
-	factory_cal_data[1] = adc[0] * mag_factory_adjust[0] * MAG_RAW_TO_uT;
-	factory_cal_data[2] = -adc[2] * mag_factory_adjust[2] * MAG_RAW_TO_uT;
-	
-	// now apply out own calibration, but first make sure we don't accidentally
-	// multiply by zero in case of uninitialized scale factors
-	if(mag_scales[0]==0.0) mag_scales[0]=1.0;
-	if(mag_scales[1]==0.0) mag_scales[1]=1.0;
-	if(mag_scales[2]==0.0) mag_scales[2]=1.0;
-	data->mag[0] = (factory_cal_data[0]-mag_offsets[0])*mag_scales[0];
-	data->mag[1] = (factory_cal_data[1]-mag_offsets[1])*mag_scales[1];
-	data->mag[2] = (factory_cal_data[2]-mag_offsets[2])*mag_scales[2];
+	// the axes are swapped to match the accel and gyro, see
+	// update_mag_correction for the rest
+	data->mag[0] = adc[1]*mpu->mag_gain[0] + mpu->mag_bias[0];
+	data->mag[1] = adc[0]*mpu->mag_gain[1] + mpu->mag_bias[1];
+	data->mag[2] = adc[2]*mpu->mag_gain[2] + mpu->mag_bias[2];
 	
 	return 0;
 }
 
+/*******************************************************************************
+* void update_mag_correction()
+*
+* Folds the factory sensitivity adjustment, the conversion to uT and the
+* calibration offsets and scales into one gain and bias per axis so that
+* process_raw_mag_data is a single multiply-add. Call whenever any of them
+* change.
+*******************************************************************************/
+void update_mag_correction(){
+	int i;
+	
+	// make sure we don't accidentally multiply by zero in case of 
+	// uninitialized scale factors
+	for(i=0;i<3;i++) if(mpu->mag_scales[i]==0.0) mpu->mag_scales[i]=1.0;
+	
+	// someone in invensense thought it would be bright idea to have the
+	// magnetometer coordiate system aligned differently than the
+	// accelerometer and gyro.... -__- so x and y swap and z flips
+	mpu->mag_gain[0] = mpu->mag_factory_adjust[1] * MAG_RAW_TO_uT * \
+														mpu->mag_scales[0];
+	mpu->mag_gain[1] = mpu->mag_factory_adjust[0] * MAG_RAW_TO_uT * \
+														mpu->mag_scales[1];
+	mpu->mag_gain[2] = -mpu->mag_factory_adjust[2] * MAG_RAW_TO_uT * \
+														mpu->mag_scales[2];
+	for(i=0;i<3;i++) mpu->mag_bias[i] = -mpu->mag_offsets[i]*mpu->mag_scales[i];
+	return;
+}
+
 /*******************************************************************************
 * int read_imu_temp(imu_data_t* data)
 *
@@ -367,17 +1039,60 @@ int read_mag_data(imu_data_t* data){
 int read_imu_temp(imu_data_t* data){
 	uint16_t adc;
 	
-	// set device address
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
-	
 	// Read the two raw data registers
-	if(i2c_read_word(IMU_BUS, TEMP_OUT_H, &adc)<0){
+	if(mpu_read_word(TEMP_OUT_H, &adc)<0){
 		printf("failed to read IMU temperature registers\n");
 		return -1;
 	} 
 	
-	// convert to real units
-	data->temp = ((float)(adc)/TEMP_SENSITIVITY) + 21.0;
+	// convert to real units, the register is signed about 21C
+	data->temp = ((float)(int16_t)adc/TEMP_SENSITIVITY) + 21.0;
+	return 0;
+}
+
+/*******************************************************************************
+* int read_imu_all(imu_data_t* data)
+*
+* Reads accelerometer, thermometer, gyroscope, and magnetometer (if enabled) in
+* one burst. These registers are contiguous from ACCEL_XOUT_H through the
+* EXT_SENS_DATA registers where the MPU's i2c master places the magnetometer
+* data, so everything is fetched with a single i2c transaction instead of
+* four or more.
+*******************************************************************************/
+int read_imu_all(imu_data_t* data){
+	// 6 accel, 2 temp, 6 gyro, then 8 mag bytes ST1 through ST2
+	uint8_t raw[22];
+	int len = 14;
+	
+	if(mpu->mag_master_en) len += 8;
+	
+	if(mpu_read_bytes(ACCEL_XOUT_H, len, &raw[0])<0){
+		printf("read_imu_all failed\n");
+		return -1;
+	}
+	
+	// Turn the MSB and LSB into a signed 16-bit value
+	data->raw_accel[0] = (int16_t)(((uint16_t)raw[0]<<8)|raw[1]);
+	data->raw_accel[1] = (int16_t)(((uint16_t)raw[2]<<8)|raw[3]);
+	data->raw_accel[2] = (int16_t)(((uint16_t)raw[4]<<8)|raw[5]);
+	data->raw_gyro[0]  = (int16_t)(((uint16_t)raw[8]<<8)|raw[9]);
+	data->raw_gyro[1]  = (int16_t)(((uint16_t)raw[10]<<8)|raw[11]);
+	data->raw_gyro[2]  = (int16_t)(((uint16_t)raw[12]<<8)|raw[13]);
+	
+	// Fill in real unit values
+	data->accel[0] = data->raw_accel[0] * data->accel_to_ms2;
+	data->accel[1] = data->raw_accel[1] * data->accel_to_ms2;
+	data->accel[2] = data->raw_accel[2] * data->accel_to_ms2;
+	data->temp = ((float)(int16_t)(((uint16_t)raw[6]<<8)|raw[7]) \
+												/TEMP_SENSITIVITY) + 21.0;
+	data->gyro[0] = data->raw_gyro[0] * data->gyro_to_degs;
+	data->gyro[1] = data->raw_gyro[1] * data->gyro_to_degs;
+	data->gyro[2] = data->raw_gyro[2] * data->gyro_to_degs;
+	
+	// only update magnetometer values if ST1 says there is new data
+	if(mpu->mag_master_en && (raw[14]&MAG_DATA_READY)){
+		if(process_raw_mag_data(&raw[15], data)<0) return -1;
+	}
 	return 0;
 }
  
@@ -390,25 +1105,22 @@ int read_imu_temp(imu_data_t* data){
 *******************************************************************************/
 int reset_mpu9250(){
 	// disable the interrupt to prevent it from doing things while we reset
-	shutdown_interrupt_thread = 1;
-
-	// set the device address
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
+	mpu->shutdown_interrupt_thread = 1;
 	
 	// write the reset bit
-	if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+	if(mpu_write_byte(PWR_MGMT_1, H_RESET)){
 		// wait and try again
 		usleep(10000);
-			if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+			if(mpu_write_byte(PWR_MGMT_1, H_RESET)){
 				printf("I2C write to MPU9250 Failed\n");
 			return -1;
 		}
 	}
 	// make sure all other power management features are off
-	if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0)){
+	if(mpu_write_byte(PWR_MGMT_1, 0)){
 		// wait and try again
 		usleep(10000);
-		if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0)){
+		if(mpu_write_byte(PWR_MGMT_1, 0)){
 			printf("I2C write to MPU9250 Failed\n");
 		return -1;
 		}
@@ -418,6 +1130,31 @@ int reset_mpu9250(){
 	return 0;
 }
 
+/*******************************************************************************
+* int warm_reset_mpu9250()
+*
+* Lighter alternative to reset_mpu9250 that leaves DMP memory intact. Resets
+* the FIFO, DMP, i2c master, and signal paths and turns off anything a previous
+* process may have left feeding the FIFO or interrupt. Everything else is
+* rewritten by initialize_imu_dmp anyway.
+*******************************************************************************/
+int warm_reset_mpu9250(){
+	// disable the interrupt to prevent it from doing things while we reset
+	mpu->shutdown_interrupt_thread = 1;
+	
+	const i2c_reg_write_t regs[] = {
+		{PWR_MGMT_1,	0},
+		{INT_ENABLE,	0},
+		{FIFO_EN,		0},
+		{I2C_SLV0_CTRL,	0},
+		{USER_CTRL,		BIT_FIFO_RST|BIT_DMP_RST|I2C_MST_RST|SIG_COND_RST}
+	};
+	
+	if(mpu_write_regs(regs, sizeof(regs)/sizeof(regs[0]))) return -1;
+	usleep(1000);
+	return 0;
+}
+
 /*******************************************************************************
 * int set_gyro_fsr(gyro_fsr_t fsr, imu_data_t* data)
 * 
@@ -446,7 +1183,7 @@ int set_gyro_fsr(gyro_fsr_t fsr, imu_data_t* data){
 		printf("invalid gyro fsr\n");
 		return -1;
 	}
-	return i2c_write_byte(IMU_BUS, GYRO_CONFIG, c);
+	return mpu_write_byte(GYRO_CONFIG, c);
 }
 
 /*******************************************************************************
@@ -478,7 +1215,7 @@ int set_accel_fsr(accel_fsr_t fsr, imu_data_t* data){
 		return -1;
 		
 	}
-	return i2c_write_byte(IMU_BUS, ACCEL_CONFIG, c);
+	return mpu_write_byte(ACCEL_CONFIG, c);
 }
 
 /*******************************************************************************
@@ -518,7 +1255,7 @@ int set_gyro_dlpf(gyro_dlpf_t dlpf){
 		return -1;
 		
 	}
-	return i2c_write_byte(IMU_BUS, CONFIG, c); 
+	return mpu_write_byte(CONFIG, c); 
 }
 
 /*******************************************************************************
@@ -557,7 +1294,7 @@ int set_accel_dlpf(accel_dlpf_t dlpf){
 		return -1;
 		
 	}
-	return i2c_write_byte(IMU_BUS, ACCEL_CONFIG_2, c);
+	return mpu_write_byte(ACCEL_CONFIG_2, c);
 }
 
 /*******************************************************************************
@@ -569,7 +1306,6 @@ int set_accel_dlpf(accel_dlpf_t dlpf){
 int initialize_magnetometer(){
 	uint8_t raw[3];  // calibration data stored here
 	
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Enable i2c bypass to allow talking to magnetometer
 	if(mpu_set_bypass(1)){
 		printf("failed to set mpu9250 into bypass i2c mode\n");
@@ -578,47 +1314,71 @@ int initialize_magnetometer(){
 		
 	// magnetometer is actually a separate device with its
 	// own address inside the mpu9250
-	i2c_set_device_address(IMU_BUS, AK8963_ADDR);
-	
 	// Power down magnetometer  
-	i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_POWER_DN); 
+	mag_write_byte(AK8963_CNTL, MAG_POWER_DN); 
 	usleep(1000);
 	
 	// Enter Fuse ROM access mode
-	i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_FUSE_ROM); 
+	mag_write_byte(AK8963_CNTL, MAG_FUSE_ROM); 
 	usleep(1000);
 	
 	// Read the xyz sensitivity adjustment values
-	if(i2c_read_bytes(IMU_BUS, AK8963_ASAX, 3, &raw[0])<0){
+	if(mag_read_bytes(AK8963_ASAX, 3, &raw[0])<0){
 		printf("failed to read magnetometer adjustment regs\n");
-		i2c_set_device_address(IMU_BUS, IMU_ADDR);
 		mpu_set_bypass(0);
 		return -1;
 	}
 
 	// Return sensitivity adjustment values
-	mag_factory_adjust[0]=(float)(raw[0]-128)/256.0f + 1.0f;   
-	mag_factory_adjust[1]=(float)(raw[1]-128)/256.0f + 1.0f;  
-	mag_factory_adjust[2]=(float)(raw[2]-128)/256.0f + 1.0f; 
+	mpu->mag_factory_adjust[0]=(float)(raw[0]-128)/256.0f + 1.0f;   
+	mpu->mag_factory_adjust[1]=(float)(raw[1]-128)/256.0f + 1.0f;  
+	mpu->mag_factory_adjust[2]=(float)(raw[2]-128)/256.0f + 1.0f; 
 	
 	// Power down magnetometer again
-	i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_POWER_DN); 
+	mag_write_byte(AK8963_CNTL, MAG_POWER_DN); 
 	usleep(100);
 	
 	// Configure the magnetometer for 16 bit resolution 
 	// and continuous sampling mode 2 (100hz)
 	uint8_t c = MSCALE_16|MAG_CONT_MES_2;
-	i2c_write_byte(IMU_BUS, AK8963_CNTL, c);
+	mag_write_byte(AK8963_CNTL, c);
 	usleep(100);
 	
-	// go back to configuring the IMU, leave bypass on
-	i2c_set_device_address(IMU_BUS,IMU_ADDR);
-	
 	// load in magnetometer calibration
 	load_mag_calibration();
 	return 0;
 }
 
+/*******************************************************************************
+* int configure_mag_slave_read()
+*
+* Takes the mpu9250 out of bypass mode and sets up the internal i2c master to
+* continuously read AK8963_ST1 through AK8963_ST2 (8 bytes) into the 
+* EXT_SENS_DATA registers at the sample rate. Used in random-read mode so 
+* read_imu_all can get all 9 axes in one burst.
+*******************************************************************************/
+int configure_mag_slave_read(){
+	// turn off bypass, this also enables the i2c master
+	if(mpu_set_bypass(0)){
+		printf("failed to take mpu9250 out of bypass mode\n");
+		return -1;
+	}
+	// 400khz master clock, slave 0 reads 8 bytes from the magnetometer
+	// starting at the status register. These are consecutive registers
+	// so this is a single write.
+	const i2c_reg_write_t regs[] = {
+		{I2C_MST_CTRL,	0x0D},
+		{I2C_SLV0_ADDR,	BIT_I2C_READ|AK8963_ADDR},
+		{I2C_SLV0_REG,	AK8963_ST1},
+		{I2C_SLV0_CTRL,	BIT_SLAVE_EN|8}
+	};
+	if(mpu_write_regs(regs, sizeof(regs)/sizeof(regs[0]))) return -1;
+	// give the master one cycle to populate EXT_SENS_DATA
+	usleep(1000);
+	mpu->mag_master_en = 1;
+	return 0;
+}
+
 /*******************************************************************************
 * int power_down_magnetometer()
 *
@@ -626,7 +1386,6 @@ int initialize_magnetometer(){
 *******************************************************************************/
 int power_down_magnetometer(){
 	
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Enable i2c bypass to allow talking to magnetometer
 	if(mpu_set_bypass(1)){
 		printf("failed to set mpu9250 into bypass i2c mode\n");
@@ -635,15 +1394,12 @@ int power_down_magnetometer(){
 	
 	// magnetometer is actually a separate device with its
 	// own address inside the mpu9250
-	i2c_set_device_address(IMU_BUS, AK8963_ADDR);
-	
 	// Power down magnetometer  
-	if(i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_POWER_DN)<0){
+	if(mag_write_byte(AK8963_CNTL, MAG_POWER_DN)<0){
 		printf("failed to write to magnetometer\n");
 		return -1;
 	}
 	
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Enable i2c bypass to allow talking to magnetometer
 	if(mpu_set_bypass(0)){
 		printf("failed to set mpu9250 into bypass i2c mode\n");
@@ -657,25 +1413,34 @@ int power_down_magnetometer(){
 *******************************************************************************/
 int power_off_imu(){
 	
-	shutdown_interrupt_thread = 1;
-	// set the device address
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
+	// nothing to power down when samples came from a replay log or sim
+	if(mpu->imu_replay_en){
+		mpu->imu_replay_en = 0;
+		mpu->dmp_en = 0;
+		stop_imu_callback_worker();
+		return 0;
+	}
+	mpu->shutdown_interrupt_thread = 1;
 	
-	// write the reset bit
-	if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+	// write the reset bit, unless the DMP firmware should survive for the
+	// next process to warm start from
+	if(mpu->dmp_en && mpu->config.dmp_warm_start){
+		mpu_write_byte(INT_ENABLE, 0);
+	}
+	else if(mpu_write_byte(PWR_MGMT_1, H_RESET)){
 		//wait and try again
 		usleep(1000);
-		if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+		if(mpu_write_byte(PWR_MGMT_1, H_RESET)){
 			printf("I2C write to MPU9250 Failed\n");
 			return -1;
 		}
 	}
 	
 	// write the sleep bit
-	if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, MPU_SLEEP)){
+	if(mpu_write_byte(PWR_MGMT_1, MPU_SLEEP)){
 		//wait and try again
 		usleep(1000);
-		if(i2c_write_byte(IMU_BUS, PWR_MGMT_1, MPU_SLEEP)){
+		if(mpu_write_byte(PWR_MGMT_1, MPU_SLEEP)){
 			printf("I2C write to MPU9250 Failed\n");
 			return -1;
 		}	
@@ -687,11 +1452,13 @@ int power_off_imu(){
 	clock_gettime(CLOCK_REALTIME, &thread_timeout);
 	thread_timeout.tv_sec += 1;
 	int thread_err = 0;
-	thread_err = pthread_timedjoin_np(imu_interrupt_thread, NULL, \
+	thread_err = pthread_timedjoin_np(mpu->imu_interrupt_thread, NULL, \
 															&thread_timeout);
 	if(thread_err == ETIMEDOUT){
 		printf("WARNING: imu_interrupt_thread exit timeout\n");
 	}
+	stop_imu_callback_worker();
+	if(mpu->gyro_bias_dirty && mpu==&onboard_imu) save_gyro_bias();
 	return 0;
 }
 
@@ -700,6 +1467,8 @@ int power_off_imu(){
 *******************************************************************************/
 int initialize_imu_dmp(imu_data_t *data, imu_config_t conf){
 	uint8_t c;
+	int warm;
+	unsigned short features;
 	
 	// range check
 	if(conf.dmp_sample_rate>DMP_MAX_RATE || conf.dmp_sample_rate<DMP_MIN_RATE){
@@ -721,75 +1490,134 @@ int initialize_imu_dmp(imu_data_t *data, imu_config_t conf){
 		return -1;
 	}
 	
+	// bias tracking judges stillness from both
+	if(conf.track_gyro_bias && (!conf.dmp_send_accel || !conf.dmp_send_gyro)){
+		printf("ERROR: track_gyro_bias needs dmp_send_accel & dmp_send_gyro\n");
+		return -1;
+	}
+	
+	// samples come from the replay or sim thread instead of the chip
+	if(is_replay_mode() || is_sim_mode()){
+		if(mpu!=&onboard_imu){
+			printf("ERROR: only the on-board IMU can be replayed\n");
+			return -1;
+		}
+		mpu->config = conf;
+		mpu->data_ptr = data;
+		mpu->dmp_en = 1;
+		mpu->fifo_stream_en = 0;
+		mpu->newest_imu_sample_seq = 0;
+		clear_imu_timing(1000000/conf.dmp_sample_rate);
+		mpu->interrupt_func_set = 1;
+		set_imu_interrupt_func(&null_func);
+		// a simulation stays deterministic by running callbacks in its thread
+		if(conf.callback_worker && !is_sim_mode() && \
+					start_imu_callback_worker(data)<0) return -1;
+		mpu->imu_replay_en = 1;
+		return 0;
+	}
+	
+	if(mpu->interrupt_pin<0){
+		printf("ERROR: DMP mode needs an imu with an interrupt pin\n");
+		return -1;
+	}
+
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(i2c_get_in_use_state(IMU_BUS)){
+	if(mpu_bus_in_use()){
 		printf("WARNING: i2c bus claimed by another process\n");
 		printf("Continuing with initialize_imu_dmp() anyway\n");
 	}
 	
 	// start the i2c bus
-	if(i2c_init(IMU_BUS, IMU_ADDR)){
+	if(mpu_init_bus()){
 		printf("initialize_imu_dmp failed at i2c_init\n");
 		return -1;
 	}
 
-	// configure the gpio interrupt pin
-	if(gpio_export(IMU_INTERRUPT_PIN)<0){
-		printf("ERROR: failed to export GPIO %d", IMU_INTERRUPT_PIN);
-		return -1;
+	// configure the gpio interrupt pin. The character device backend
+	// requests the line itself and can't share it with sysfs
+	if(conf.interrupt_backend==IMU_INTERRUPT_CHARDEV){
+		gpio_unexport(mpu->interrupt_pin);
 	}
-	if(gpio_set_dir(IMU_INTERRUPT_PIN, INPUT_PIN)<0){
-		printf("ERROR: failed to configure GPIO %d", IMU_INTERRUPT_PIN);
+	else if(gpio_export(mpu->interrupt_pin)<0){
+		printf("ERROR: failed to export GPIO %d", mpu->interrupt_pin);
 		return -1;
 	}
-	if(gpio_set_edge(IMU_INTERRUPT_PIN, EDGE_FALLING)<0){
-		printf("ERROR: failed to configure GPIO %d", IMU_INTERRUPT_PIN);
-		return -1;
+	if(conf.interrupt_backend!=IMU_INTERRUPT_CHARDEV){
+		if(gpio_set_dir(mpu->interrupt_pin, INPUT_PIN)<0){
+			printf("ERROR: failed to configure GPIO %d", mpu->interrupt_pin);
+			return -1;
+		}
+		if(gpio_set_edge(mpu->interrupt_pin, EDGE_FALLING)<0){
+			printf("ERROR: failed to configure GPIO %d", mpu->interrupt_pin);
+			return -1;
+		}
 	}
 	
 	// claiming the bus does no guarantee other code will not interfere 
 	// with this process, but best to claim it so other code can check
 	// like we did above
-	i2c_claim_bus(IMU_BUS);
+	mpu_claim_bus();
+	
+	// a process restarting on a powered IMU may find the DMP still loaded,
+	// in which case the full reset and firmware load can be skipped
+	warm = 0;
+	if(conf.dmp_warm_start && dmp_firmware_resident()==1) warm = 1;
 	
 	// restart the device so we start with clean registers
-	if(reset_mpu9250()<0){
+	if(warm){
+		if(warm_reset_mpu9250()<0){
+			printf("failed to warm_reset_mpu9250()\n");
+			mpu_release_bus();
+			return -1;
+		}
+	}
+	else if(reset_mpu9250()<0){
 		printf("failed to reset_mpu9250()\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	//check the who am i register to make sure the chip is alive
-	if(i2c_read_byte(IMU_BUS, WHO_AM_I_MPU9250, &c)<0){
+	if(mpu_read_byte(WHO_AM_I_MPU9250, &c)<0){
 		printf("i2c_read_byte failed\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	} if(c!=0x71){
 		printf("mpu9250 WHO AM I register should return 0x71\n");
 		printf("WHO AM I returned: 0x%x\n", c);
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	// load in gyro calibration offsets from disk
 	if(load_gyro_offets()<0){
 		printf("ERROR: failed to load gyro calibration offsets\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	// log locally that the dmp will be running
-	dmp_en = 1;
-	// update local copy of config and data struct with new values
-	config = conf;
-	data_ptr = data;
+	mpu->dmp_en = 1;
+	mpu->fifo_stream_en = 0;
+	mpu->mag_master_en = 0;
+	mpu->newest_imu_sample_seq = 0;
+	clear_imu_timing(1000000/conf.dmp_sample_rate);
+	start_gyro_bias_tracking(conf.dmp_sample_rate);
+	reset_imu_clock(1000000.0/conf.dmp_sample_rate);
+	// update local copy of config and data struct with new values before
+	// temperature compensation reads into the data struct
+	mpu->config = conf;
+	mpu->data_ptr = data;
+	if(conf.temp_compensation) start_temp_compensation(conf.dmp_sample_rate);
+	else mpu->temp_comp_en = 0;
 	
 	// Set sensor sample rate to 200hz which is max the dmp can do.
 	// DMP will divide this frequency down further itself
 	if(mpu_set_sample_rate(200)<0){
 		printf("ERROR: setting IMU sample rate\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
@@ -797,7 +1625,7 @@ int initialize_imu_dmp(imu_data_t *data, imu_config_t conf){
 	if(conf.enable_magnetometer){
 		if(initialize_magnetometer()){
 			printf("ERROR: failed to initialize_magnetometer\n");
-			i2c_release_bus(IMU_BUS);
+			mpu_release_bus();
 			return -1;
 		}
 	}
@@ -806,83 +1634,208 @@ int initialize_imu_dmp(imu_data_t *data, imu_config_t conf){
 	// set full scale ranges. It seems the DMP only scales the gyro properly
 	// at 2000DPS. I'll assume the same is true for accel and use 2G like their
 	// example
-	set_gyro_fsr(G_FSR_2000DPS, data_ptr);
-	set_accel_fsr(A_FSR_2G, data_ptr);
+	set_gyro_fsr(G_FSR_2000DPS, mpu->data_ptr);
+	set_accel_fsr(A_FSR_2G, mpu->data_ptr);
 
 	// set the user-configurable DLPF
-	set_gyro_dlpf(config.gyro_dlpf);
-	set_accel_dlpf(config.accel_dlpf);
+	set_gyro_dlpf(mpu->config.gyro_dlpf);
+	set_accel_dlpf(mpu->config.accel_dlpf);
 	
 
 	// set up the DMP
-	if(dmp_load_motion_driver_firmware()<0){
+	if(warm){
+		#ifdef DEBUG
+		printf("DMP firmware already resident, skipping load\n");
+		#endif
+	}
+	else if(dmp_load_motion_driver_firmware()<0){
 		printf("failed to load DMP motion driver\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
-	if(dmp_set_fifo_rate(config.dmp_sample_rate)<0){
+	if(dmp_set_fifo_rate(mpu->config.dmp_sample_rate)<0){
 		printf("ERROR: failed to set DMP fifo rate\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	// Set fifo/sensor sample rate. Will have to set the DMP sample
 	// rate to match this shortly.
 	if(dmp_set_orientation((unsigned short)conf.orientation)<0){
 		printf("ERROR: failed to set dmp orientation\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
-	if(dmp_enable_feature(DMP_FEATURE_6X_LP_QUAT|DMP_FEATURE_SEND_RAW_ACCEL| \
-												DMP_FEATURE_SEND_RAW_GYRO)<0){
+	features = DMP_FEATURE_6X_LP_QUAT;
+	if(conf.dmp_send_accel) features |= DMP_FEATURE_SEND_RAW_ACCEL;
+	if(conf.dmp_send_gyro) features |= DMP_FEATURE_SEND_RAW_GYRO;
+	if(dmp_enable_feature(features)<0){
 		printf("ERROR: failed to enable DMP features\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(dmp_set_interrupt_mode(DMP_INT_CONTINUOUS)<0){
 		printf("ERROR: failed to set DMP interrupt mode to continuous\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if (mpu_set_dmp_state(1)<0) {
 		printf("ERROR: mpu_set_dmp_state(1) failed\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
-	// set up the IMU to put magnetometer data in the fifo too if enabled
+	// set up the IMU to put magnetometer data in the fifo too if enabled.
+	// The I2C master runs at the DMP_MAX_RATE sensor rate but the AK8963
+	// only has new data at AK8963_RATE, and there is no point reading it
+	// faster than the DMP emits packets either. Slave 0 is delayed to read
+	// at the slower of the two, the same rate the compass filter dt uses,
+	// and the FIFO repeats the old bytes between reads.
 	if(conf.enable_magnetometer){
-		// enable slave 0 (mag) in fifo
-		i2c_write_byte(IMU_BUS,FIFO_EN, FIFO_SLV0_EN);	
-		// enable master, and clock speed
-		i2c_write_byte(IMU_BUS,I2C_MST_CTRL,	0x8D);
-		// set slave 0 address to magnetometer address
-		i2c_write_byte(IMU_BUS,I2C_SLV0_ADDR,	0X8C);
-		// set mag data register to read from
-		i2c_write_byte(IMU_BUS,I2C_SLV0_REG,	AK8963_XOUT_L);
-		// set slave 0 to read 7 bytes
-		i2c_write_byte(IMU_BUS,I2C_SLV0_CTRL,	0x87);
-		packet_len += 7; // add 7 more bytes to the fifo reads
+		int mag_rate = conf.dmp_sample_rate;
+		if(mag_rate>AK8963_RATE) mag_rate = AK8963_RATE;
+		int mag_dly = DMP_MAX_RATE/mag_rate - 1;
+		if(mag_dly>0x1F) mag_dly = 0x1F; // I2C_MST_DLY is 5 bits
+		const i2c_reg_write_t regs[] = {
+			{FIFO_EN,		FIFO_SLV0_EN},	// enable slave 0 (mag) in fifo
+			{I2C_MST_CTRL,	0x8D},			// enable master, and clock speed
+			{I2C_SLV0_ADDR,	0X8C},			// slave 0 reads magnetometer
+			{I2C_SLV0_REG,	AK8963_XOUT_L},	// mag data register to read from
+			{I2C_SLV0_CTRL,	0x87},			// slave 0 reads 7 bytes
+			{I2C_SLV4_CTRL,	mag_dly},		// I2C_MST_DLY
+			{I2C_MST_DELAY_CTRL, 0x01}		// slave 0 uses the delay
+		};
+		memset(mpu->last_mag_raw, 0, sizeof(mpu->last_mag_raw));
+		mpu->mag_updated = 0;
+		mpu_write_regs(regs, sizeof(regs)/sizeof(regs[0]));
 	}
 	
 	// done with I2C for now
-	i2c_release_bus(IMU_BUS);
+	mpu_release_bus();
 	
 	#ifdef DEBUG
-	printf("packet_len: %d\n", packet_len);
+	printf("packet_len: %d\n", mpu->packet_len);
 	#endif
 	
 	// start the interrupt handler thread
-	interrupt_func_set = 1;
-	shutdown_interrupt_thread = 0;
+	mpu->interrupt_func_set = 1;
+	mpu->shutdown_interrupt_thread = 0;
 	set_imu_interrupt_func(&null_func);
-	struct sched_param params;
-	params.sched_priority = config.dmp_interrupt_priority;
-	pthread_setschedparam(imu_interrupt_thread, SCHED_FIFO, &params);
-	pthread_create(&imu_interrupt_thread, NULL, \
-					imu_interrupt_handler, (void*) NULL);
-					
+	if(mpu->config.callback_worker && start_imu_callback_worker(data)<0){
+		return -1;
+	}
+	if(start_imu_thread(imu_interrupt_handler)<0){
+		stop_imu_callback_worker();
+		return -1;
+	}
+					
+	
+	
+	return 0;
+}
+
+/*******************************************************************************
+* int initialize_imu_fifo_stream(imu_data_t *data, imu_config_t conf)
+*
+* Sets up the IMU in random-read mode with the hardware FIFO collecting every 
+* accel, temp, gyro (and magnetometer if enabled) sample at fifo_sample_rate.
+* A background thread wakes at fifo_drain_rate and empties the FIFO with one 
+* count read and as few FIFO_R_W burst reads as the i2c driver allows, then
+* hands the whole timestamped batch to the function set with 
+* set_imu_fifo_batch_func. Samples also go to the history ring read by
+* get_imu_samples_since and the newest one is copied into data.
+*******************************************************************************/
+int initialize_imu_fifo_stream(imu_data_t *data, imu_config_t conf){
+	uint8_t c;
+	int div, len, per_drain;
+	
+	// range check
+	if(conf.fifo_sample_rate>1000 || conf.fifo_sample_rate<4){
+		printf("ERROR: fifo_sample_rate must be between 4 & 1000\n");
+		return -1;
+	}
+	if(conf.fifo_drain_rate<1 || conf.fifo_drain_rate>conf.fifo_sample_rate){
+		printf("ERROR: fifo_drain_rate must be between 1 & fifo_sample_rate\n");
+		return -1;
+	}
+	// the sample rate divider only acts with the DLPF on
+	if(conf.gyro_dlpf==GYRO_DLPF_OFF){
+		printf("ERROR: fifo streaming requires the gyro DLPF to be enabled\n");
+		return -1;
+	}
+	
+	// make sure each drain leaves the FIFO at most half full so a late 
+	// wakeup doesn't overflow it
+	if(conf.enable_magnetometer) len = STREAM_PACKET_LEN_MAG;
+	else len = STREAM_PACKET_LEN;
+	per_drain = (conf.fifo_sample_rate+conf.fifo_drain_rate-1)\
+														/conf.fifo_drain_rate;
+	if(per_drain*len > MPU_HW_FIFO_SIZE/2){
+		printf("ERROR: fifo_drain_rate must be at least %d for a %dhz stream\n",\
+				(2*conf.fifo_sample_rate*len)/MPU_HW_FIFO_SIZE+1, \
+				conf.fifo_sample_rate);
+		return -1;
+	}
+	
+	// random-read setup does the reset, scaling, DLPF, and magnetometer slave
+	if(initialize_imu(data, conf)<0){
+		printf("initialize_imu_fifo_stream failed at initialize_imu\n");
+		return -1;
+	}
+	
+	mpu_claim_bus();
+	
+	// Set sample rate = 1000/(1 + SMPLRT_DIV), this is also the FIFO rate
+	if(mpu_set_sample_rate(conf.fifo_sample_rate)<0){
+		printf("ERROR: setting IMU sample rate\n");
+		mpu_release_bus();
+		return -1;
+	}
+	div = 1000/conf.fifo_sample_rate;
+	mpu->stream_period_micros = 1000*div;
+	
+	// stop writing into a full FIFO instead of overwriting old bytes so 
+	// an overflow never leaves us misaligned within a packet
+	if(mpu_read_byte(CONFIG, &c)<0){
+		printf("ERROR: failed to read CONFIG register\n");
+		mpu_release_bus();
+		return -1;
+	}
+	if(mpu_write_byte(CONFIG, c|FIFO_MODE_KEEP_OLD)){
+		printf("ERROR: failed to write CONFIG register\n");
+		mpu_release_bus();
+		return -1;
+	}
+	
+	// log locally that the fifo stream will be running
+	mpu->dmp_en = 0;
+	mpu->fifo_stream_en = 1;
+	mpu->stream_packet_len = len;
+	mpu->stream_overflows = 0;
+	mpu->newest_imu_sample_seq = 0;
+	clear_imu_timing(1000000/conf.fifo_drain_rate);
+	start_gyro_bias_tracking(1000/div);
+	reset_imu_clock(mpu->stream_period_micros);
+	// temperature compensation reads into the data struct straight away
+	mpu->data_ptr = data;
+	if(conf.temp_compensation) start_temp_compensation(1000/div);
+	else mpu->temp_comp_en = 0;
+	
+	if(reset_stream_fifo()<0){
+		printf("ERROR: failed to start IMU FIFO\n");
+		mpu_release_bus();
+		return -1;
+	}
+	mpu_release_bus();
 	
+	#ifdef DEBUG
+	printf("stream packet_len: %d period: %lluus\n", mpu->stream_packet_len, \
+								(unsigned long long)mpu->stream_period_micros);
+	#endif
 	
+	// start the drain thread in place of the DMP interrupt handler, 
+	// power_off_imu joins it the same way
+	mpu->shutdown_interrupt_thread = 0;
+	if(start_imu_thread(imu_fifo_stream_handler)<0) return -1;
 	return 0;
 }
 
@@ -910,9 +1863,9 @@ int mpu_write_mem(unsigned short mem_addr, unsigned short length,\
 		printf("mpu_write_mem exceeds bank size\n");
         return -1;
 	}
-    if (i2c_write_bytes(IMU_BUS,MPU6500_BANK_SEL, 2, tmp))
+    if (mpu_write_bytes(MPU6500_BANK_SEL, 2, tmp))
         return -1;
-    if (i2c_write_bytes(IMU_BUS,MPU6500_MEM_R_W, length, data))
+    if (mpu_write_bytes(MPU6500_MEM_R_W, length, data))
         return -1;
     return 0;
 }
@@ -941,9 +1894,9 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,\
 		printf("mpu_read_mem exceeds bank size\n");
         return -1;
 	}
-    if (i2c_write_bytes(IMU_BUS,MPU6500_BANK_SEL, 2, tmp))
+    if (mpu_write_bytes(MPU6500_BANK_SEL, 2, tmp))
         return -1;
-    if (i2c_read_bytes(IMU_BUS,MPU6500_MEM_R_W, length, data)!=length)
+    if (mpu_read_bytes(MPU6500_MEM_R_W, length, data)!=length)
         return -1;
     return 0;
 }
@@ -951,7 +1904,10 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,\
 /*******************************************************************************
 * int dmp_load_motion_driver_firmware()
 *
-* loads pre-compiled firmware binary from invensense onto dmp
+* loads pre-compiled firmware binary from invensense onto dmp. Chunks are as
+* large as the i2c driver allows without crossing a memory bank. Each one is
+* read back and checked for corruption unless dmp_verify_firmware is off in
+* the config struct.
 *******************************************************************************/
 int dmp_load_motion_driver_firmware(){
 	
@@ -960,18 +1916,15 @@ int dmp_load_motion_driver_firmware(){
     /* Must divide evenly into st.hw->bank_size to avoid bank crossings. */
 
     unsigned char cur[DMP_LOAD_CHUNK], tmp[2];
-
-	// make sure the address is set correctly
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	
-	// loop through 16 bytes at a time and check each write
-	// for corruption
+	// loop through DMP_LOAD_CHUNK bytes at a time
     for (ii=0; ii<DMP_CODE_SIZE; ii+=this_write) {
         this_write = min(DMP_LOAD_CHUNK, DMP_CODE_SIZE - ii);
         if (mpu_write_mem(ii, this_write, (uint8_t*)&dmp_firmware[ii])){
 			printf("dmp firmware write failed\n");
             return -1;
 		}
+		if(!mpu->config.dmp_verify_firmware) continue;
         if (mpu_read_mem(ii, this_write, cur)){
 			printf("dmp firmware read failed\n");
             return -1;
@@ -985,13 +1938,37 @@ int dmp_load_motion_driver_firmware(){
     /* Set program start address. */
     tmp[0] = dmp_start_addr >> 8;
     tmp[1] = dmp_start_addr & 0xFF;
-    if (i2c_write_bytes(IMU_BUS, MPU6500_PRGM_START_H, 2, tmp)){
+    if (mpu_write_bytes(MPU6500_PRGM_START_H, 2, tmp)){
         return -1;
 	}
 	
     return 0;
 }
 
+/*******************************************************************************
+* int dmp_firmware_resident()
+*
+* Wakes the IMU and compares a few windows of DMP program memory against the
+* firmware image. The windows sit in code banks away from every address the
+* dmp_* configuration functions patch, so a configured DMP still matches.
+* Returns 1 if the firmware appears to be loaded, 0 if not, -1 on bus error.
+*******************************************************************************/
+int dmp_firmware_resident(){
+	// bank-aligned offsets clear of the CFG_ and FCFG_ keys
+	const unsigned short windows[3] = {1536, 2048, 2816};
+	unsigned char cur[16];
+	int i;
+	
+	// DMP memory is only accessible while the chip is awake
+	if(mpu_write_byte(PWR_MGMT_1, 0)) return -1;
+	usleep(1000);
+	for(i=0;i<3;i++){
+		if(mpu_read_mem(windows[i], 16, cur)) return -1;
+		if(memcmp(dmp_firmware+windows[i], cur, 16)) return 0;
+	}
+	return 1;
+}
+
 /*******************************************************************************
  *  @brief      Push gyro and accel orientation to the DMP.
  *  The orientation is represented here as the output of
@@ -1078,21 +2055,28 @@ int dmp_set_fifo_rate(unsigned short rate){
 * int mpu_set_bypass(unsigned char bypass_on)
 * 
 * configures the USER_CTRL and INT_PIN_CFG registers to turn on and off the
-* i2c bypass mode for talking to the magnetometer. In random read mode this
-* is used to turn on the bypass and left as is. In DMP mode bypass is turned
-* off after configuration and the MPU fetches magnetometer data automatically.
+* i2c bypass mode for talking to the magnetometer. Bypass is only used while
+* configuring the magnetometer. In both random read and DMP mode bypass is then
+* turned off and the MPU fetches magnetometer data automatically.
 * USER_CTRL - based on global variable dsp_en
 * INT_PIN_CFG based on requested bypass state
 *******************************************************************************/
 int mpu_set_bypass(uint8_t bypass_on){
     uint8_t tmp = 0;
 
+	// over SPI the magnetometer is only reachable through the i2c master,
+	// SLV4 needs the master clock set up before it can be used
+	if(mpu->spi_slave){
+		bypass_on = 0;
+		if(mpu_write_byte(I2C_MST_CTRL, 0x0D)) return -1;
+	}
+	
     // set up USER_CTRL first
-	if(dmp_en)
+	if(mpu->dmp_en)
 		tmp |= FIFO_EN_BIT; // enable fifo for dsp mode
 	if(!bypass_on)
 		tmp |= I2C_MST_EN; // i2c master mode when not in bypass
-	if (i2c_write_byte(IMU_BUS, USER_CTRL, tmp))
+	if (mpu_write_byte(USER_CTRL, tmp))
             return -1;
     usleep(3000);
 	
@@ -1102,13 +2086,13 @@ int mpu_set_bypass(uint8_t bypass_on){
 	
 	if(bypass_on)
 		tmp |= BYPASS_EN;
-	if (i2c_write_byte(IMU_BUS, INT_PIN_CFG, tmp))
+	if (mpu_write_byte(INT_PIN_CFG, tmp))
             return -1;
 		
 	if(bypass_on)
-		bypass_en = 1;
+		mpu->bypass_en = 1;
 	else
-		bypass_en = 0;
+		mpu->bypass_en = 0;
 	
 	return 0;
 }
@@ -1206,13 +2190,13 @@ int dmp_enable_feature(unsigned short mask){
     // dmp.feature_mask = mask | DMP_FEATURE_PEDOMETER;
     mpu_reset_fifo();
 
-    packet_len = 0;
+    mpu->packet_len = 0;
     if (mask & DMP_FEATURE_SEND_RAW_ACCEL)
-        packet_len += 6;
+        mpu->packet_len += 6;
     if (mask & DMP_FEATURE_SEND_ANY_GYRO)
-        packet_len += 6;
+        mpu->packet_len += 6;
     if (mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT))
-        packet_len += 16;
+        mpu->packet_len += 16;
     // if (mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
         // dmp.packet_length += 4;
 
@@ -1293,32 +2277,31 @@ int dmp_enable_lp_quat(unsigned char enable){
 int mpu_reset_fifo(void){
     uint8_t data;
 
-    // make sure the i2c address is set correctly. 
-	// this shouldn't take any time at all if already set
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
+    // whatever was held back belonged to the old FIFO contents
+    mpu->dmp_carry_len = 0;
 
     data = 0;
-    if (i2c_write_byte(IMU_BUS, INT_ENABLE, data)) return -1;
-    if (i2c_write_byte(IMU_BUS, FIFO_EN, data)) return -1;
+    if (mpu_write_byte(INT_ENABLE, data)) return -1;
+    if (mpu_write_byte(FIFO_EN, data)) return -1;
     //if (i2c_write_byte(IMU_BUS, USER_CTRL, data)) return -1;
 
 	data = BIT_FIFO_RST | BIT_DMP_RST;
-	if (i2c_write_byte(IMU_BUS, USER_CTRL, data)) return -1;
+	if (mpu_write_byte(USER_CTRL, data)) return -1;
 	usleep(1000);
 
 	data = BIT_DMP_EN | BIT_FIFO_EN;
-	if (config.enable_magnetometer)
+	if (mpu->config.enable_magnetometer)
 		data |= I2C_MST_EN;
-	if (i2c_write_byte(IMU_BUS, USER_CTRL, data))
+	if (mpu_write_byte(USER_CTRL, data))
 		return -1;
 	
-	if(config.enable_magnetometer){
-		i2c_write_byte(IMU_BUS, FIFO_EN, FIFO_SLV0_EN);
+	if(mpu->config.enable_magnetometer){
+		mpu_write_byte(FIFO_EN, FIFO_SLV0_EN);
 	}
-	else i2c_write_byte(IMU_BUS, FIFO_EN, 0);
+	else mpu_write_byte(FIFO_EN, 0);
 
-	if(dmp_en) i2c_write_byte(IMU_BUS, INT_ENABLE, BIT_DMP_INT_EN);
-	else i2c_write_byte(IMU_BUS, INT_ENABLE, 0);
+	if(mpu->dmp_en) mpu_write_byte(INT_ENABLE, BIT_DMP_INT_EN);
+	else mpu_write_byte(INT_ENABLE, 0);
 
     return 0;
 }
@@ -1360,9 +2343,9 @@ int set_int_enable(unsigned char enable){
     if (enable) tmp = BIT_DMP_INT_EN;
     else tmp = 0x00;
 	
-    if (i2c_write_byte(IMU_BUS, INT_ENABLE, tmp)) return -1;
+    if (mpu_write_byte(INT_ENABLE, tmp)) return -1;
 	// disable all other FIFO features leaving just DMP
-	if (i2c_write_byte(IMU_BUS, FIFO_EN, 0)) return -1;
+	if (mpu_write_byte(FIFO_EN, 0)) return -1;
 
     return 0;
 }
@@ -1382,7 +2365,7 @@ int mpu_set_sample_rate(int rate){
 	#ifdef DEBUG
 	printf("setting divider to %d\n", div);
 	#endif
-	if(i2c_write_byte(IMU_BUS, SMPLRT_DIV, div)){
+	if(mpu_write_byte(SMPLRT_DIV, div)){
 		printf("I2C bus write error\n");
 		return -1;
 	}  
@@ -1408,7 +2391,7 @@ int mpu_set_dmp_state(unsigned char enable){
 		// 	return -1;
 		// }
         /* Remove FIFO elements. */
-        i2c_write_byte(IMU_BUS, FIFO_EN , 0);
+        mpu_write_byte(FIFO_EN , 0);
         /* Enable DMP interrupt. */
         set_int_enable(1);
         mpu_reset_fifo();
@@ -1416,12 +2399,45 @@ int mpu_set_dmp_state(unsigned char enable){
         /* Disable DMP interrupt. */
         set_int_enable(0);
         /* Restore FIFO settings. */
-        i2c_write_byte(IMU_BUS, FIFO_EN , 0);
+        mpu_write_byte(FIFO_EN , 0);
         mpu_reset_fifo();
     }
     return 0;
 }
 
+/*******************************************************************************
+* uint64_t kernel_event_ns_to_micros(uint64_t ns)
+*
+* gpio character device events are stamped with CLOCK_REALTIME on older 
+* kernels and CLOCK_MONOTONIC on newer ones. Convert either to microseconds
+* on the monotonic clock so it lines up with micros_since_boot(). 
+*******************************************************************************/
+uint64_t kernel_event_ns_to_micros(uint64_t ns){
+	// anything before the year 2000 can't be wall-clock time
+	if(ns < 946684800ULL*1000000000ULL) return ns/1000;
+	return (ns - nanos_since_epoch() + nanos_since_boot())/1000;
+}
+
+/*******************************************************************************
+* int start_imu_thread(void* (*func)(void*))
+*
+* Starts the interrupt or stream handler with the IMU real-time thread config.
+* dmp_interrupt_priority predates that config so it still sets the priority
+* when the IMU thread is under a real-time policy.
+*******************************************************************************/
+int start_imu_thread(void* (*func)(void*)){
+	rt_config_t rt = get_rt_config();
+	if(rt.service[RT_SERVICE_IMU].policy!=SCHED_OTHER && \
+		rt.service[RT_SERVICE_IMU].priority != \
+										mpu->config.dmp_interrupt_priority){
+		rt.service[RT_SERVICE_IMU].priority = \
+										mpu->config.dmp_interrupt_priority;
+		if(set_rt_config(rt)<0) return -1;
+	}
+	return create_rt_thread(&mpu->imu_interrupt_thread, RT_SERVICE_IMU, \
+																func, mpu);
+}
+
 /*******************************************************************************
 * void* imu_interrupt_handler(void* ptr)
 *
@@ -1431,68 +2447,400 @@ int mpu_set_dmp_state(unsigned char enable){
 * read in the IMU data, and call the user-defined interrupt function if set.
 *******************************************************************************/
 void* imu_interrupt_handler(void* ptr){ 
-	struct pollfd fdset[1];
+	struct pollfd fdset[2];
 	int ret;
 	char buf[64];
 	int first_run = 1;
-	int imu_gpio_fd = gpio_fd_open(IMU_INTERRUPT_PIN);
+	int use_chardev = 0;
+	uint64_t event_ns;
+	int imu_gpio_fd = -1;
+	uint64_t t_wake, t_read, t_done;
+	uint32_t times[IMU_TIMING_CHANNELS];
+	int mask;
+	
+	mpu = (imu_handle_t*)ptr;
+	// try the character device first if requested
+	if(mpu->config.interrupt_backend==IMU_INTERRUPT_CHARDEV){
+		imu_gpio_fd = gpio_line_event_open(mpu->interrupt_pin, EDGE_FALLING);
+		if(imu_gpio_fd == -1){
+			printf("WARNING: gpio character device unavailable\n");
+			printf("falling back to sysfs for IMU interrupt\n");
+			gpio_export(mpu->interrupt_pin);
+			gpio_set_dir(mpu->interrupt_pin, INPUT_PIN);
+			gpio_set_edge(mpu->interrupt_pin, EDGE_FALLING);
+		}
+		else use_chardev = 1;
+	}
+	if(!use_chardev) imu_gpio_fd = gpio_fd_open(mpu->interrupt_pin);
 	if(imu_gpio_fd == -1){
 		printf("ERROR: can't open IMU_INTERRUPT_PIN gpio fd\n");
 		printf("aborting imu_interrupt_handler\n");
 		return NULL;
 	}
 	fdset[0].fd = imu_gpio_fd;
-	fdset[0].events = POLLPRI;
+	fdset[0].events = use_chardev ? POLLIN : POLLPRI;
+	// wakes the poll as soon as the program starts exiting
+	fdset[1].fd = get_exit_fd();
+	fdset[1].events = POLLIN;
 	// keep running until the program closes
 	mpu_reset_fifo();
-	while(get_state()!=EXITING && shutdown_interrupt_thread!=1) {
+	while(get_state()!=EXITING && mpu->shutdown_interrupt_thread!=1) {
 		// system hangs here until IMU FIFO interrupt
-		poll(fdset, 1, IMU_POLL_TIMEOUT); 
+		poll(fdset, 2, IMU_POLL_TIMEOUT); 
 
-		if(get_state()==EXITING || shutdown_interrupt_thread==1){
+		if(get_state()==EXITING || mpu->shutdown_interrupt_thread==1){
 			break;
 		}
-		else if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, 64);
-			
-			// interrupt received, mark the timestamp
-			last_interrupt_timestamp_micros = micros_since_epoch();
-			
-			// try to load fifo no matter the claim bus state
-			if(i2c_get_in_use_state(IMU_BUS)){
-				printf("WARNING: Something has claimed the I2C bus when an\n");
-				printf("IMU interrupt was received. Reading IMU anyway.\n");
+		else if (fdset[0].revents & fdset[0].events) {
+			// interrupt received, mark the timestamp. The character device
+			// gives us the time the kernel saw the edge
+			if(use_chardev){
+				if(gpio_line_event_read(imu_gpio_fd, &event_ns)<0) continue;
+				mpu->last_interrupt_timestamp_micros = \
+										kernel_event_ns_to_micros(event_ns);
+			}
+			else{
+				lseek(fdset[0].fd, 0, SEEK_SET);  
+				read(fdset[0].fd, buf, 64);
+				mpu->last_interrupt_timestamp_micros = micros_since_boot();
+			}
+			t_wake = micros_since_boot();
+			if(mpu==&onboard_imu){
+				trace_loop_begin(mpu->last_interrupt_timestamp_micros*1000);
 			}
-			i2c_claim_bus(IMU_BUS);
+			trace_imu_point(TRACE_WAKE);
+			
+			// take the bus ahead of every other waiter, this only has to
+			// wait for a transaction already in flight
+			mpu_claim_bus_priority(I2C_PRIORITY_IMU);
+			mpu->last_fusion_micros = 0;
 			ret = read_dmp_fifo();
-			i2c_release_bus(IMU_BUS);
+			mpu_release_bus();
+			t_read = micros_since_boot();
+			trace_imu_point(TRACE_FUSION_DONE);
 			
 			// record if it was successful or not
-			if (ret==0) last_read_successful=1;
-			else last_read_successful=0;
+			if (ret>0) mpu->last_read_successful=1;
+			else{
+				mpu->last_read_successful=0;
+				metric_add(METRIC_IMU_READ_FAILURES, 1);
+			}
 			
-			// call the user function if not the first run
-			if(first_run == 1){
+			if(mpu->last_read_successful){
+				deliver_dmp_batch(ret, first_run);
 				first_run = 0;
 			}
-			else if(interrupt_func_set && last_read_successful){
-				 imu_interrupt_func(); 
-			}
+			t_done = micros_since_boot();
+			
+			// wake is only meaningful with kernel timestamps, with sysfs
+			// the edge is stamped after waking so it reads as ~0
+			mask = (1<<IMU_TIMING_WAKE)|(1<<IMU_TIMING_READ)| \
+					(1<<IMU_TIMING_CALLBACK)|(1<<IMU_TIMING_TOTAL);
+			times[IMU_TIMING_PERIOD] = mpu->last_interrupt_timestamp_micros - \
+												mpu->imu_timing_prev_timestamp;
+			times[IMU_TIMING_WAKE] = t_wake - \
+										mpu->last_interrupt_timestamp_micros;
+			times[IMU_TIMING_READ] = t_read - t_wake - mpu->last_fusion_micros;
+			times[IMU_TIMING_FUSION] = mpu->last_fusion_micros;
+			times[IMU_TIMING_CALLBACK] = t_done - t_read;
+			times[IMU_TIMING_TOTAL] = t_done - \
+										mpu->last_interrupt_timestamp_micros;
+			if(mpu->imu_timing_prev_timestamp!=0) mask |= 1<<IMU_TIMING_PERIOD;
+			if(mpu->last_fusion_micros!=0) mask |= 1<<IMU_TIMING_FUSION;
+			record_imu_timing(times, mask);
+			mpu->imu_timing_prev_timestamp = \
+										mpu->last_interrupt_timestamp_micros;
 		}
 	}
-	gpio_fd_close(imu_gpio_fd);
+	if(use_chardev) close(imu_gpio_fd);
+	else gpio_fd_close(imu_gpio_fd);
+	return 0;
+}
+
+/*******************************************************************************
+* void reset_imu_clock(double nominal_us)
+*
+* Forgets the clock model, the next batch is taken at face value.
+*******************************************************************************/
+void reset_imu_clock(double nominal_us){
+	mpu->imu_clock_nominal = nominal_us;
+	mpu->imu_clock_period = nominal_us;
+	mpu->imu_clock_synced = 0;
+	mpu->imu_clock_resyncs = 0;
+}
+
+/*******************************************************************************
+* void update_imu_clock(uint64_t t_obs, int n)
+*
+* n new samples arrived and the newest was observed to be taken at t_obs:
+* the interrupt edge in DMP mode, the middle of the last sample period
+* before the FIFO count was read in stream mode. Counting samples forward 
+* from the previous estimate predicts when it really was, and a small part
+* of the difference corrects the time while a smaller part trims the period
+* toward the IMU's true rate. Jitter in t_obs is averaged out that way, and
+* samples in a backlog get times that follow the IMU's clock.
+*******************************************************************************/
+void update_imu_clock(uint64_t t_obs, int n){
+	double predicted, err;
+
+	if(n<=0) return;
+	if(!mpu->imu_clock_synced){
+		mpu->imu_clock_newest = t_obs;
+		mpu->imu_clock_synced = 1;
+		return;
+	}
+	predicted = mpu->imu_clock_newest + n*mpu->imu_clock_period;
+	err = (double)t_obs - predicted;
+	if(fabs(err) > CLOCK_RESYNC_PERIODS*mpu->imu_clock_nominal){
+		mpu->imu_clock_newest = t_obs;
+		mpu->imu_clock_resyncs++;
+		return;
+	}
+	mpu->imu_clock_newest = predicted + CLOCK_PHASE_GAIN*err;
+	mpu->imu_clock_period += CLOCK_PERIOD_GAIN*err/n;
+	if(mpu->imu_clock_period > mpu->imu_clock_nominal*(1.0+CLOCK_MAX_ERROR)){
+		mpu->imu_clock_period = mpu->imu_clock_nominal*(1.0+CLOCK_MAX_ERROR);
+	}
+	else if(mpu->imu_clock_period < \
+							mpu->imu_clock_nominal*(1.0-CLOCK_MAX_ERROR)){
+		mpu->imu_clock_period = mpu->imu_clock_nominal*(1.0-CLOCK_MAX_ERROR);
+	}
+}
+
+/*******************************************************************************
+* uint64_t imu_sample_time(int k, int n)
+*
+* time of sample k of the n in the batch just given to update_imu_clock
+*******************************************************************************/
+uint64_t imu_sample_time(int k, int n){
+	return (uint64_t)llround(mpu->imu_clock_newest - \
+										(n-1-k)*mpu->imu_clock_period);
+}
+
+/*******************************************************************************
+* float get_imu_sample_period_us()
+*
+* The sample period measured against the BeagleBone's clock, or 0 before
+* samples have arrived.
+*******************************************************************************/
+float get_imu_sample_period_us(){
+	if(!mpu->imu_clock_synced) return 0.0f;
+	return mpu->imu_clock_period;
+}
+
+/*******************************************************************************
+* uint64_t get_imu_clock_resyncs()
+*******************************************************************************/
+uint64_t get_imu_clock_resyncs(){
+	return mpu->imu_clock_resyncs;
+}
+
+/*******************************************************************************
+* void deliver_dmp_batch(int n, int first_run)
+*
+* Publishes the n packets read_dmp_fifo caught up on, oldest first, stamped
+* by the sample clock model. By default the user function runs once for the
+* newest packet and the older ones count as dropped, dmp_deliver_backlog in
+* the config runs it for every packet instead. Nothing is called on the first
+* read after starting as the FIFO may hold stale data from before.
+*******************************************************************************/
+void deliver_dmp_batch(int n, int first_run){
+	uint64_t ts;
+	int k;
+	
+	update_imu_clock(mpu->last_interrupt_timestamp_micros, n);
+	if(n==1){
+		ts = imu_sample_time(0, 1);
+		publish_imu_sample(mpu->data_ptr, ts);
+		if(mpu->interrupt_func_set && !first_run) run_imu_callback(ts);
+		return;
+	}
+	for(k=0;k<n;k++){
+		ts = imu_sample_time(k, n);
+		*mpu->data_ptr = mpu->dmp_batch[k];
+		publish_imu_sample(mpu->data_ptr, ts);
+		if(!mpu->interrupt_func_set || first_run) continue;
+		if(mpu->config.dmp_deliver_backlog || k==n-1) run_imu_callback(ts);
+	}
+	if(mpu->interrupt_func_set && !first_run && \
+										!mpu->config.dmp_deliver_backlog){
+		mpu->dmp_dropped_packets += n-1;
+		metric_add(METRIC_DMP_DROPPED_PACKETS, n-1);
+	}
+	return;
+}
+
+/*******************************************************************************
+* uint64_t get_dmp_dropped_packets()
+*
+* returns how many DMP packets were published without the user function being
+* called for them because the handler fell behind.
+*******************************************************************************/
+uint64_t get_dmp_dropped_packets(){
+	return mpu->dmp_dropped_packets;
+}
+
+/*******************************************************************************
+* uint64_t get_dmp_fifo_resets()
+*
+* returns how many times the FIFO was reset to recover from an overflow,
+* a failed read or bytes that didn't parse as DMP or magnetometer data.
+*******************************************************************************/
+uint64_t get_dmp_fifo_resets(){
+	return mpu->dmp_fifo_resets;
+}
+
+/*******************************************************************************
+* int start_imu_callback_worker(imu_data_t* data)
+*
+* With callback_worker set in the config the handler parses into a private
+* copy of the data struct and the user's struct is only written by the worker
+* just before it runs the user function, so a callback never sees a half
+* written sample and can take as long as it likes without delaying the next
+* FIFO read.
+*******************************************************************************/
+int start_imu_callback_worker(imu_data_t* data){
+	mpu->imu_user_data_ptr = data;
+	mpu->imu_acq_data = *data;
+	mpu->data_ptr = &mpu->imu_acq_data;
+	mpu->imu_worker_pending = 0;
+	mpu->imu_worker_busy = 0;
+	mpu->imu_callback_overruns = 0;
+	mpu->imu_callback_missed_deadlines = 0;
+	mpu->imu_worker_period_micros = 1000000/mpu->config.dmp_sample_rate;
+	mpu->imu_worker_shutdown = 0;
+	if(create_rt_thread(&mpu->imu_worker_thread, RT_SERVICE_IMU_CALLBACK, \
+									imu_callback_worker, mpu)<0){
+		mpu->data_ptr = data;
+		return -1;
+	}
+	mpu->imu_worker_en = 1;
 	return 0;
 }
 
+/*******************************************************************************
+* void stop_imu_callback_worker()
+*
+* Wakes the worker up to exit, waits for it, and points the handler back at
+* the user's data struct.
+*******************************************************************************/
+void stop_imu_callback_worker(){
+	if(!mpu->imu_worker_en) return;
+	pthread_mutex_lock(&mpu->imu_worker_mutex);
+	mpu->imu_worker_shutdown = 1;
+	pthread_cond_broadcast(&mpu->imu_worker_cond);
+	pthread_mutex_unlock(&mpu->imu_worker_mutex);
+	pthread_join(mpu->imu_worker_thread, NULL);
+	mpu->imu_worker_en = 0;
+	mpu->data_ptr = mpu->imu_user_data_ptr;
+	return;
+}
+
+/*******************************************************************************
+* void run_imu_callback(uint64_t timestamp_micros)
+*
+* Called by the handler wherever the user function is due. Inline by default,
+* otherwise the current sample is handed to the worker. If the worker hasn't
+* picked up the last one yet it is replaced and counts as an overrun.
+*******************************************************************************/
+void run_imu_callback(uint64_t timestamp_micros){
+	if(!mpu->imu_worker_en){
+		trace_imu_point(TRACE_CALLBACK_START);
+		mpu->imu_interrupt_func();
+		trace_imu_point(TRACE_CALLBACK_END);
+		return;
+	}
+	pthread_mutex_lock(&mpu->imu_worker_mutex);
+	if(mpu->imu_worker_pending){
+		mpu->imu_callback_overruns++;
+		metric_add(METRIC_IMU_CALLBACK_OVERRUNS, 1);
+	}
+	mpu->imu_worker_sample = *mpu->data_ptr;
+	mpu->imu_worker_timestamp = timestamp_micros;
+	mpu->imu_worker_pending = 1;
+	pthread_cond_signal(&mpu->imu_worker_cond);
+	pthread_mutex_unlock(&mpu->imu_worker_mutex);
+	return;
+}
+
+/*******************************************************************************
+* void* imu_callback_worker(void* ptr)
+*
+* Runs the user function for each sample handed over by run_imu_callback. A
+* callback that returns later than one sample period after its sample's
+* timestamp counts as a missed deadline.
+*******************************************************************************/
+void* imu_callback_worker(void* ptr){
+	uint64_t timestamp;
+	
+	mpu = (imu_handle_t*)ptr;
+	while(1){
+		pthread_mutex_lock(&mpu->imu_worker_mutex);
+		while(!mpu->imu_worker_pending && !mpu->imu_worker_shutdown){
+			pthread_cond_wait(&mpu->imu_worker_cond, &mpu->imu_worker_mutex);
+		}
+		if(mpu->imu_worker_shutdown){
+			pthread_mutex_unlock(&mpu->imu_worker_mutex);
+			break;
+		}
+		*mpu->imu_user_data_ptr = mpu->imu_worker_sample;
+		timestamp = mpu->imu_worker_timestamp;
+		mpu->imu_worker_pending = 0;
+		mpu->imu_worker_busy = 1;
+		pthread_mutex_unlock(&mpu->imu_worker_mutex);
+		
+		if(get_state()==EXITING) break;
+		trace_imu_point(TRACE_CALLBACK_START);
+		mpu->imu_interrupt_func();
+		trace_imu_point(TRACE_CALLBACK_END);
+		
+		pthread_mutex_lock(&mpu->imu_worker_mutex);
+		mpu->imu_worker_busy = 0;
+		if(micros_since_boot() > timestamp+mpu->imu_worker_period_micros){
+			mpu->imu_callback_missed_deadlines++;
+			metric_add(METRIC_IMU_DEADLINE_MISSES, 1);
+		}
+		pthread_mutex_unlock(&mpu->imu_worker_mutex);
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* uint64_t get_imu_callback_overruns()
+*
+* returns how many samples the callback worker skipped because the previous
+* callback had not returned yet.
+*******************************************************************************/
+uint64_t get_imu_callback_overruns(){
+	uint64_t ret;
+	pthread_mutex_lock(&mpu->imu_worker_mutex);
+	ret = mpu->imu_callback_overruns;
+	pthread_mutex_unlock(&mpu->imu_worker_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* uint64_t get_imu_callback_missed_deadlines()
+*
+* returns how many callbacks run by the worker returned more than one sample
+* period after the interrupt that produced their sample.
+*******************************************************************************/
+uint64_t get_imu_callback_missed_deadlines(){
+	uint64_t ret;
+	pthread_mutex_lock(&mpu->imu_worker_mutex);
+	ret = mpu->imu_callback_missed_deadlines;
+	pthread_mutex_unlock(&mpu->imu_worker_mutex);
+	return ret;
+}
+
 /*******************************************************************************
 * int set_imu_interrupt_func(int (*func)(void))
 *
 * sets a user function to be called when new data is read
 *******************************************************************************/
 int set_imu_interrupt_func(int (*func)(void)){
-	imu_interrupt_func = func;
-	interrupt_func_set = 1;
+	mpu->imu_interrupt_func = func;
+	mpu->interrupt_func_set = 1;
 	return 0;
 }
 
@@ -1502,298 +2850,433 @@ int set_imu_interrupt_func(int (*func)(void)){
 * stops the user function from being called when new data is available
 *******************************************************************************/
 int stop_imu_interrupt_func(){
-	interrupt_func_set = 0;
+	mpu->interrupt_func_set = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int set_imu_fifo_batch_func(int (*func)(imu_sample_t* samples, int n))
+*
+* sets a user function to be called with each batch drained from the FIFO in
+* streaming mode. samples is only valid until the function returns.
+*******************************************************************************/
+int set_imu_fifo_batch_func(int (*func)(imu_sample_t* samples, int n)){
+	mpu->imu_fifo_batch_func = func;
+	return 0;
+}
+
+/*******************************************************************************
+* uint64_t get_imu_fifo_overflows()
+*
+* returns how many times the FIFO filled up in streaming mode. Samples taken
+* while it was full are lost.
+*******************************************************************************/
+uint64_t get_imu_fifo_overflows(){
+	return mpu->stream_overflows;
+}
+
+/*******************************************************************************
+* int reset_stream_fifo()
+*
+* Empties the FIFO and turns raw sensor writes into it back on. USER_CTRL is 
+* read first so the i2c master bit feeding the magnetometer stays as it was.
+*******************************************************************************/
+int reset_stream_fifo(){
+	uint8_t c, fifo;
+	
+	if(mpu_write_byte(FIFO_EN, 0)) return -1;
+	if(mpu_read_byte(USER_CTRL, &c)<0) return -1;
+	c &= ~(BIT_FIFO_EN|BIT_DMP_EN);
+	if(mpu_write_byte(USER_CTRL, c|BIT_FIFO_RST)) return -1;
+	usleep(1000);
+	if(mpu_write_byte(USER_CTRL, c|BIT_FIFO_EN)) return -1;
+	
+	fifo = FIFO_TEMP_EN|FIFO_GYRO_X_EN|FIFO_GYRO_Y_EN|FIFO_GYRO_Z_EN|\
+															FIFO_ACCEL_EN;
+	if(mpu->stream_packet_len==STREAM_PACKET_LEN_MAG) fifo |= FIFO_SLV0_EN;
+	if(mpu_write_byte(FIFO_EN, fifo)) return -1;
+	// the drain thread is timer driven, no interrupts needed
+	if(mpu_write_byte(INT_ENABLE, 0)) return -1;
 	return 0;
 }
 
+/*******************************************************************************
+* int read_raw_fifo()
+*
+* Drains every complete packet from the FIFO into stream_batch. Packets are
+* oldest first and the newest is assumed to have been sampled just before 
+* the count was read, earlier ones one sample period apart before that.
+* Returns the number of samples read or -1 on error.
+*******************************************************************************/
+int read_raw_fifo(){
+	uint8_t raw[MPU_HW_FIFO_SIZE];
+	uint8_t* p;
+	uint8_t count_raw[2];
+	int count, n, i, bytes, chunk, max_chunk, overflow;
+	uint64_t now;
+	imu_data_t* d;
+	
+	if(mpu_read_bytes(FIFO_COUNTH, 2, count_raw)<0){
+		if(mpu->config.show_warnings){
+			report_error("failed to read fifo count\n");
+		}
+		return -1;
+	}
+	now = micros_since_boot();
+	count = (((uint16_t)count_raw[0]<<8)|count_raw[1]) & 0x1FFF;
+	
+	// a FIFO with no room for another packet stopped taking samples
+	overflow = (count+mpu->stream_packet_len > MPU_HW_FIFO_SIZE);
+	n = count/mpu->stream_packet_len;
+	// a garbage count mustn't read past raw, packets with the mag are longer
+	if(n>MPU_HW_FIFO_SIZE/mpu->stream_packet_len){
+		n = MPU_HW_FIFO_SIZE/mpu->stream_packet_len;
+	}
+	
+	// read whole packets in as few transfers as the i2c driver allows
+	bytes = n*mpu->stream_packet_len;
+	max_chunk = (mpu_max_read_len()/mpu->stream_packet_len) * \
+													mpu->stream_packet_len;
+	for(i=0; i<bytes; i+=chunk){
+		chunk = bytes-i;
+		if(chunk>max_chunk) chunk = max_chunk;
+		if(mpu_read_bytes(FIFO_R_W, chunk, &raw[i])<0){
+			if(mpu->config.show_warnings){
+				report_error("failed to read fifo data\n");
+			}
+			reset_stream_fifo();
+			return -1;
+		}
+	}
+	
+	if(overflow){
+		mpu->stream_overflows++;
+		if(mpu->config.show_warnings){
+			report_error("WARNING: IMU FIFO overflow\n");
+		}
+		reset_stream_fifo();
+	}
+	
+	for(i=0;i<n;i++){
+		p = &raw[i*mpu->stream_packet_len];
+		// start from the last sample to carry scaling and magnetometer over
+		if(i==0) mpu->stream_batch[i].data = *mpu->data_ptr;
+		else mpu->stream_batch[i].data = mpu->stream_batch[i-1].data;
+		d = &mpu->stream_batch[i].data;
+		d->raw_accel[0] = (int16_t)(((uint16_t)p[0]<<8)|p[1]);
+		d->raw_accel[1] = (int16_t)(((uint16_t)p[2]<<8)|p[3]);
+		d->raw_accel[2] = (int16_t)(((uint16_t)p[4]<<8)|p[5]);
+		d->raw_gyro[0]  = (int16_t)(((uint16_t)p[8]<<8)|p[9]);
+		d->raw_gyro[1]  = (int16_t)(((uint16_t)p[10]<<8)|p[11]);
+		d->raw_gyro[2]  = (int16_t)(((uint16_t)p[12]<<8)|p[13]);
+		d->accel[0] = d->raw_accel[0] * d->accel_to_ms2;
+		d->accel[1] = d->raw_accel[1] * d->accel_to_ms2;
+		d->accel[2] = d->raw_accel[2] * d->accel_to_ms2;
+		d->temp = ((float)(int16_t)(((uint16_t)p[6]<<8)|p[7]) \
+												/TEMP_SENSITIVITY) + 21.0;
+		d->gyro[0] = d->raw_gyro[0] * d->gyro_to_degs;
+		d->gyro[1] = d->raw_gyro[1] * d->gyro_to_degs;
+		d->gyro[2] = d->raw_gyro[2] * d->gyro_to_degs;
+		if(mpu->temp_comp_en) apply_temp_compensation(d, 1);
+		if(mpu->config.track_gyro_bias) track_gyro_bias(d);
+		// the mag slave repeats old data between its own 100hz samples
+		if(mpu->stream_packet_len==STREAM_PACKET_LEN_MAG && \
+											(p[14]&MAG_DATA_READY)){
+			process_raw_mag_data(&p[15], d);
+		}
+	}
+	// the newest whole packet was taken some time in the last period
+	update_imu_clock(now - mpu->stream_period_micros/2, n);
+	for(i=0;i<n;i++){
+		mpu->stream_batch[i].timestamp_micros = imu_sample_time(i, n);
+	}
+	return n;
+}
+
+/*******************************************************************************
+* void* imu_fifo_stream_handler(void* ptr)
+*
+* Thread started by initialize_imu_fifo_stream. Drains the FIFO at 
+* fifo_drain_rate, publishes each sample to the history ring, copies the 
+* newest into the user's imu_data_t, and calls the user's batch function.
+*******************************************************************************/
+void* imu_fifo_stream_handler(void* ptr){
+	loop_timer_t timer;
+	int i, n;
+	uint64_t t_wake, t_read, t_done;
+	uint32_t times[IMU_TIMING_CHANNELS];
+	
+	mpu = (imu_handle_t*)ptr;
+	if(init_loop_timer(&timer, mpu->config.fifo_drain_rate)<0) return NULL;
+	while(get_state()!=EXITING && mpu->shutdown_interrupt_thread!=1){
+		loop_timer_wait(&timer);
+		if(get_state()==EXITING || mpu->shutdown_interrupt_thread==1) break;
+		t_wake = micros_since_boot();
+		if(mpu==&onboard_imu) trace_loop_begin(t_wake*1000);
+		
+		mpu_claim_bus_priority(I2C_PRIORITY_IMU);
+		n = read_raw_fifo();
+		mpu_release_bus();
+		t_read = micros_since_boot();
+		trace_imu_point(TRACE_READ_DONE);
+		
+		mpu->last_read_successful = (n>=0);
+		if(n<0) metric_add(METRIC_IMU_READ_FAILURES, 1);
+		if(n<=0) continue;
+		
+		for(i=0;i<n;i++){
+			publish_imu_sample(&mpu->stream_batch[i].data, \
+										mpu->stream_batch[i].timestamp_micros);
+			mpu->stream_batch[i].seq = mpu->newest_imu_sample_seq;
+		}
+		*mpu->data_ptr = mpu->stream_batch[n-1].data;
+		mpu->last_interrupt_timestamp_micros = \
+								mpu->stream_batch[n-1].timestamp_micros;
+		trace_imu_point(TRACE_FUSION_DONE);
+		if(mpu->imu_fifo_batch_func!=NULL){
+			trace_imu_point(TRACE_CALLBACK_START);
+			mpu->imu_fifo_batch_func(mpu->stream_batch, n);
+			trace_imu_point(TRACE_CALLBACK_END);
+		}
+		t_done = micros_since_boot();
+		
+		// there is no interrupt edge, the period is between drains
+		times[IMU_TIMING_PERIOD] = t_wake - mpu->imu_timing_prev_timestamp;
+		times[IMU_TIMING_READ] = t_read - t_wake;
+		times[IMU_TIMING_CALLBACK] = t_done - t_read;
+		times[IMU_TIMING_TOTAL] = t_done - t_wake;
+		record_imu_timing(times, (1<<IMU_TIMING_READ)| \
+				(1<<IMU_TIMING_CALLBACK)|(1<<IMU_TIMING_TOTAL)| \
+				(mpu->imu_timing_prev_timestamp ? (1<<IMU_TIMING_PERIOD) : 0));
+		mpu->imu_timing_prev_timestamp = t_wake;
+	}
+	return NULL;
+}
+
 /*******************************************************************************
 * int read_dmp_fifo()
 *
-* Reads the FIFO buffer and populates the data struct. Here is where we see 
-* bad/empty/double packets due to i2c bus errors and the IMU failing to have
-* data ready in time. enabling warnings in the config struct will let this
-* function print out warnings when these conditions are detected. If write
-* errors are detected then this function tries some i2c transfers a second time.
+* Reads everything in the FIFO and parses every DMP packet in it into
+* dmp_batch, leaving the newest in the data struct. A partial packet at the
+* end is kept and completed on the next call rather than forcing a reset.
+* Returns the number of packets parsed or -1 if there were none. Enabling
+* warnings in the config struct will let this function print out warnings
+* when the FIFO overflows or falls out of alignment.
 *******************************************************************************/
 int read_dmp_fifo(){
-    unsigned char raw[MAX_FIFO_BUFFER];
-	long quat[4];
-	int16_t mag_adc[3];
-    uint16_t fifo_count;
-	int ret, mag_data_available, dmp_data_available;
-	int i = 0; // position of beginning of mag data
-	int j = 0; // position of beginning of dmp data
-	static int first_run = 1; // set to 0 after first call
-	float factory_cal_data[3]; // just temp holder for mag data
-    if (!dmp_en){
-		printf("only use mpu_read_fifo in dmp mode\n");
-        return -1;
+	unsigned char raw[DMP_CARRY_MAX+MPU_HW_FIFO_SIZE];
+	uint16_t fifo_count;
+	int i, k, p, n, left, bytes, chunk;
+	uint64_t t_fusion;
+	
+	if (!mpu->dmp_en){
+		report_error("only use mpu_read_fifo in dmp mode\n");
+		return -1;
 	}
 	
 	// if the fifo packet_len variable not set up yet, this function must
 	// have been called prematurely
-	if(packet_len!=FIFO_LEN_NO_MAG && packet_len!=FIFO_LEN_MAG){
-		printf("ERROR: packet_len is set incorrectly for read_dmp_fifo\n");
+	if(mpu->packet_len<DMP_QUAT_LEN || mpu->packet_len>FIFO_LEN_NO_MAG){
+		report_error("ERROR: packet_len is set incorrectly for "\
+											"read_dmp_fifo\n");
 		return -1;
 	}
-	
-	// make sure the i2c address is set correctly. 
-	// this shouldn't take any time at all if already set
-	i2c_set_device_address(IMU_BUS, IMU_ADDR);
-	int is_new_dmp_data = 0;
 
 	// check fifo count register to make sure new data is there
-    if (i2c_read_word(IMU_BUS, FIFO_COUNTH, &fifo_count)<0){
-		if(config.show_warnings){
-			printf("fifo_count i2c error: %s\n",strerror(errno));
+	if (mpu_read_word(FIFO_COUNTH, &fifo_count)<0){
+		if(mpu->config.show_warnings){
+			report_error("fifo_count i2c error: %s\n",strerror(errno));
 		}
 		return -1;
-	}	
+	}
+	fifo_count &= 0x1FFF;
 	#ifdef DEBUG
 	printf("fifo_count: %d\n", fifo_count);
 	#endif
+	if(fifo_count==0) return -1;
 	
-	/***************************************************************************
-	* now that we see how many values are in the buffer, we have a long list of
-	* checks to determine what should be done
-	***************************************************************************/
-	mag_data_available=0;
-	dmp_data_available=0;
-
-	// empty FIFO, just return, nothing else to do
-	if(fifo_count==0){
-		// if(config.show_warnings&& first_run!=1){
-		// 	printf("WARNING: empty fifo\n");
-		// }
+	// a full FIFO has been dropping bytes and can't be realigned
+	if(fifo_count>=MPU_HW_FIFO_SIZE){
+		if(mpu->config.show_warnings){
+			report_error("warning: imu fifo overflow\n");
+		}
+		mpu->dmp_fifo_resets++;
+		metric_add(METRIC_DMP_FIFO_RESETS, 1);
+		mpu_reset_fifo();
 		return -1;
 	}
-
-
-	// one packet, perfect!
-	if(fifo_count==FIFO_LEN_NO_MAG){
-		i = 0; // set offset to 0
-		mag_data_available=0;
-		dmp_data_available=1;
-		goto READ_FIFO;
-	}
-	if(fifo_count==FIFO_LEN_MAG){
-		i = 0; // set offset to 0
-		mag_data_available=1;
-		dmp_data_available=1;
-		goto READ_FIFO;
-	}
-
-	// these numbers pop up under high stress and represent uneven 
-	// combinations of magnetometer and DMP data
-	if(fifo_count==42){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: packet count 42\n");
-		}
-		i = 7; // set offset to 7
-		mag_data_available=0;
-		dmp_data_available=1;
-		goto READ_FIFO;
-	}
-	if(fifo_count==63){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: packet count 63\n");
-		}
-		i = 28; // set offset to 7
-		mag_data_available=0;
-		dmp_data_available=1;
-		goto READ_FIFO;
-	}
-	if(fifo_count==77){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: packet count 77\n");
-		}
-		i = 42; // set offset to 7
-		mag_data_available=0;
-		dmp_data_available=1;
-		goto READ_FIFO;
-	}
-
-	// if exactly 2 packets are there we just missed one (whoops)
-	// read both in and set the offset i to one packet length
-	// the last packet data will be read normally
-	if(fifo_count==2*FIFO_LEN_NO_MAG){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: imu fifo contains two packets\n");
-		}
-		i = FIFO_LEN_NO_MAG; // set offset to beginning of second packet
-		mag_data_available=0;
-		dmp_data_available=1;
-		goto READ_FIFO;
-	}
-	if(fifo_count==2*FIFO_LEN_MAG){
-		if(config.show_warnings&& first_run!=1){
-			printf("warning: imu fifo contains two packets\n");
+	
+	// read the whole backlog in behind any partial packet left last time
+	memcpy(raw, mpu->dmp_carry, mpu->dmp_carry_len);
+	bytes = mpu->dmp_carry_len + fifo_count;
+	for(i=mpu->dmp_carry_len; i<bytes; i+=chunk){
+		chunk = bytes-i;
+		if(chunk>mpu_max_read_len()) chunk = mpu_max_read_len();
+		if(mpu_read_bytes(FIFO_R_W, chunk, &raw[i])!=chunk){
+			if(mpu->config.show_warnings){
+				report_error("ERROR: failed to read fifo buffer register\n");
+			}
+			// bytes already popped from the FIFO are lost, realign
+			mpu->dmp_fifo_resets++;
+			metric_add(METRIC_DMP_FIFO_RESETS, 1);
+			mpu_reset_fifo();
+			return -1;
 		}
-		i = FIFO_LEN_MAG; // set offset to beginning of second packet
-		mag_data_available=1;
-		dmp_data_available=1;
-		goto READ_FIFO;
 	}
-
-	// if there are exactly 7 14, or 21 bytes available, there must be magnetometer
-	// data but nothing else. read it in anyway
-	if(fifo_count==7 || fifo_count==14 || fifo_count==21){
-		i = fifo_count - 7;
-		mag_data_available = 1;
-		dmp_data_available = 0;
-		goto READ_FIFO;
-	}
-
-	// finally, if we got a weird packet length, reset the fifo
-	if(config.show_warnings&& first_run!=1){
-		printf("warning: %d bytes in FIFO, expected %d\n", fifo_count,packet_len);
-	}
-	mpu_reset_fifo();
-	return -1;
+	trace_imu_point(TRACE_READ_DONE);
+	mpu->dmp_carry_len = 0;
 	
-	
-
 	/***************************************************************************
-	* now we get to the reading section. Here we also have logic to determine
-	* the order of the data in the packet as magnetometer data may come before
-	* or after the DMP data
+	* Walk the buffer packet by packet. DMP packets are recognized by their
+	* unit quaternion, with the magnetometer enabled up to 3 blocks of 7 mag
+	* bytes may sit between them. Anything too short to tell is kept for the
+	* next read, only bytes that fit neither are treated as corruption.
 	***************************************************************************/
-READ_FIFO:
-	memset(raw,0,MAX_FIFO_BUFFER);
-	// read it in!
-    ret = i2c_read_bytes(IMU_BUS, FIFO_R_W, fifo_count, &raw[0]);
-	if(ret<0){
-		// if i2c_read returned -1 there was an error, try again
-		ret = i2c_read_bytes(IMU_BUS, FIFO_R_W, fifo_count, &raw[0]);
-	}
-	if(ret!=fifo_count){
-		if(config.show_warnings){
-			printf("ERROR: failed to read fifo buffer register\n");
-			printf("read %d bytes, expected %d\n", ret, packet_len);
+	p = 0;
+	n = 0;
+	while(p<bytes){
+		left = bytes-p;
+		if(left<mpu->packet_len) break;
+		if(check_quaternion_validity(raw, p)){
+			parse_dmp_packet(&raw[p]);
+			p += mpu->packet_len;
+			if(mpu->temp_comp_en) apply_temp_compensation(mpu->data_ptr, 0);
+			if(mpu->config.track_gyro_bias) track_gyro_bias(mpu->data_ptr);
+			// fuse every packet in order so the yaw filter sees each step
+			if(mpu->config.enable_magnetometer){
+				t_fusion = micros_since_boot();
+				data_fusion();
+				mpu->last_fusion_micros += micros_since_boot() - t_fusion;
+				if(mpu->last_fusion_micros==0) mpu->last_fusion_micros = 1;
+			}
+			if(n<DMP_MAX_BATCH) mpu->dmp_batch[n++] = *mpu->data_ptr;
+			continue;
 		}
-        return -1;
+		if(!mpu->config.enable_magnetometer) goto CORRUPT;
+		// find how many mag blocks come before the next DMP packet
+		for(k=DMP_MAG_LEN; k<=3*DMP_MAG_LEN; k+=DMP_MAG_LEN){
+			if(k+mpu->packet_len>left) break;
+			if(check_quaternion_validity(raw, p+k)) break;
+		}
+		if(k+mpu->packet_len>left) break; // wait for the rest
+		if(k>3*DMP_MAG_LEN) goto CORRUPT;
+		for(i=0;i<k;i+=DMP_MAG_LEN) parse_dmp_mag(&raw[p+i]);
+		p += k;
 	}
+	
+	// keep a trailing partial packet for next time
+	mpu->dmp_carry_len = bytes-p;
+	if(mpu->dmp_carry_len>(int)sizeof(mpu->dmp_carry)) goto CORRUPT;
+	memcpy(mpu->dmp_carry, &raw[p], mpu->dmp_carry_len);
+	
+	if(n==0) return -1;
+	mpu->dmp_first_read = 0;
+	return n;
 
+CORRUPT:
+	if(mpu->config.show_warnings && !mpu->dmp_first_read){
+		report_error("warning: imu fifo misaligned at byte %d of %d\n", \
+																p, bytes);
+	}
+	mpu->dmp_carry_len = 0;
+	mpu->dmp_fifo_resets++;
+	metric_add(METRIC_DMP_FIFO_RESETS, 1);
+	mpu_reset_fifo();
+	// packets before the bad bytes were fine, deliver them
+	if(n==0) return -1;
+	return n;
+}
 
-	// if dmp data is available we must figure out if it's before or 
-	// after the magnetometer data. Usually before.
-	if(dmp_data_available){
-		if(config.enable_magnetometer && check_quaternion_validity(raw,i+7)){
-			j=i+7; // 7 mag bytes before dmp data
-		}
-		else if(check_quaternion_validity(raw,i)){
-			// printf("after\n");
-			j=i; // 7 mag bytes after dmp data
-			i=i+FIFO_LEN_NO_MAG; // update mag data offset
-		}
-		else{
-			if(config.show_warnings){
-				printf("warning: Quaternion out of bounds\n");
-				printf("fifo_count: %d\n", fifo_count);
-			}
-			mpu_reset_fifo();
-		    return -1;
-		}
-		// now we can read the quaternion
-		// parse the quaternion data from the buffer
-		quat[0] = ((long)raw[j+0] << 24) | ((long)raw[j+1] << 16) |
-			((long)raw[j+2] << 8) | raw[j+3];
-		quat[1] = ((long)raw[j+4] << 24) | ((long)raw[j+5] << 16) |
-			((long)raw[j+6] << 8) | raw[j+7];
-		quat[2] = ((long)raw[j+8] << 24) | ((long)raw[j+9] << 16) |
-			((long)raw[j+10] << 8) | raw[j+11];
-		quat[3] = ((long)raw[j+12] << 24) | ((long)raw[j+13] << 16) |
-			((long)raw[j+14] << 8) | raw[j+15];
-
-		// load in the quaternion to the data struct if it was good
-		data_ptr->dmp_quat[QUAT_W] = (float)quat[QUAT_W];
-		data_ptr->dmp_quat[QUAT_X] = (float)quat[QUAT_X];
-		data_ptr->dmp_quat[QUAT_Y] = (float)quat[QUAT_Y];
-		data_ptr->dmp_quat[QUAT_Z] = (float)quat[QUAT_Z];
-		// fill in euler angles to the data struct
-		normalizeQuaternion(data_ptr->dmp_quat);
-		quaternionToTaitBryan(data_ptr->dmp_quat, data_ptr->dmp_TaitBryan);
-		
-		j+=16; // increase offset by 16 which was the quaternion size
-		
-		
-		// Read Accel values and load into imu_data struct
-		// Turn the MSB and LSB into a signed 16-bit value
-		data_ptr->raw_accel[0] = (int16_t)(((uint16_t)raw[j+0]<<8)|raw[j+1]);
-		data_ptr->raw_accel[1] = (int16_t)(((uint16_t)raw[j+2]<<8)|raw[j+3]);
-		data_ptr->raw_accel[2] = (int16_t)(((uint16_t)raw[j+4]<<8)|raw[j+5]);
-		
-		// Fill in real unit values
-		data_ptr->accel[0] = data_ptr->raw_accel[0] * data_ptr->accel_to_ms2;
-		data_ptr->accel[1] = data_ptr->raw_accel[1] * data_ptr->accel_to_ms2;
-		data_ptr->accel[2] = data_ptr->raw_accel[2] * data_ptr->accel_to_ms2;
-		j+=6;
-		
-		// Read gyro values and load into imu_data struct
-		// Turn the MSB and LSB into a signed 16-bit value
-		data_ptr->raw_gyro[0] = (int16_t)(((int16_t)raw[0+j]<<8)|raw[1+j]);
-		data_ptr->raw_gyro[1] = (int16_t)(((int16_t)raw[2+j]<<8)|raw[3+j]);
-		data_ptr->raw_gyro[2] = (int16_t)(((int16_t)raw[4+j]<<8)|raw[5+j]);
-		// Fill in real unit values
-		data_ptr->gyro[0] = data_ptr->raw_gyro[0] * data_ptr->gyro_to_degs;
-		data_ptr->gyro[1] = data_ptr->raw_gyro[1] * data_ptr->gyro_to_degs;
-		data_ptr->gyro[2] = data_ptr->raw_gyro[2] * data_ptr->gyro_to_degs;
-
-		is_new_dmp_data = 1;
-	}
-
-	// if there was magnetometer data try to read it
-	if(mag_data_available){
-		// Turn the MSB and LSB into a signed 16-bit value
-		// Data stored as little Endian
-		mag_adc[0] = (int16_t)(((int16_t)raw[i+1]<<8) | raw[i+0]);  
-		mag_adc[1] = (int16_t)(((int16_t)raw[i+3]<<8) | raw[i+2]);  
-		mag_adc[2] = (int16_t)(((int16_t)raw[i+5]<<8) | raw[i+4]); 
-		
-		// if the data is non-zero, save it
-		// multiply by the sensitivity adjustment and convert to units of 
-		// uT micro Teslas. Also correct the coordinate system as someone 
-		// in invensense thought it would be bright idea to have the 
-		// magnetometer coordiate system aligned differently than the 
-		// accelerometer and gyro.... -__-
-		if(mag_adc[0]!=0 || mag_adc[1]!=0 || mag_adc[2]!=0){
-			// multiply by the sensitivity adjustment and convert to units of uT
-			// Also correct the coordinate system as someone in invensense 
-			// thought it would be a bright idea to have the magnetometer coordiate
-			// system aligned differently than the accelerometer and gyro.... -__-
-			factory_cal_data[0] = mag_adc[1]*mag_factory_adjust[1] * MAG_RAW_TO_uT;
-			factory_cal_data[1] = mag_adc[0]*mag_factory_adjust[0] * MAG_RAW_TO_uT;
-			factory_cal_data[2] = -mag_adc[2]*mag_factory_adjust[2] * MAG_RAW_TO_uT;
-		
-			// now apply out own calibration, but first make sure we don't 
-			// accidentally multiply by zero in case of uninitialized scale factors
-			if(mag_scales[0]==0.0) mag_scales[0]=1.0;
-			if(mag_scales[1]==0.0) mag_scales[1]=1.0;
-			if(mag_scales[2]==0.0) mag_scales[2]=1.0;
-			data_ptr->mag[0] = (factory_cal_data[0]-mag_offsets[0])*mag_scales[0];
-			data_ptr->mag[1] = (factory_cal_data[1]-mag_offsets[1])*mag_scales[1];
-			data_ptr->mag[2] = (factory_cal_data[2]-mag_offsets[2])*mag_scales[2];
-		}
+/*******************************************************************************
+* void parse_dmp_packet(unsigned char* raw)
+*
+* Loads one DMP packet, quaternion then accel then gyro, into the user's data
+* struct. Accel and gyro are only there if enabled in the config, otherwise
+* their fields are left alone.
+*******************************************************************************/
+void parse_dmp_packet(unsigned char* raw){
+	long quat[4];
+	int j = 0;
+	
+	// parse the quaternion data from the buffer
+	quat[0] = ((long)raw[j+0] << 24) | ((long)raw[j+1] << 16) |
+		((long)raw[j+2] << 8) | raw[j+3];
+	quat[1] = ((long)raw[j+4] << 24) | ((long)raw[j+5] << 16) |
+		((long)raw[j+6] << 8) | raw[j+7];
+	quat[2] = ((long)raw[j+8] << 24) | ((long)raw[j+9] << 16) |
+		((long)raw[j+10] << 8) | raw[j+11];
+	quat[3] = ((long)raw[j+12] << 24) | ((long)raw[j+13] << 16) |
+		((long)raw[j+14] << 8) | raw[j+15];
+
+	// load in the quaternion to the data struct
+	mpu->data_ptr->dmp_quat[QUAT_W] = (float)quat[QUAT_W];
+	mpu->data_ptr->dmp_quat[QUAT_X] = (float)quat[QUAT_X];
+	mpu->data_ptr->dmp_quat[QUAT_Y] = (float)quat[QUAT_Y];
+	mpu->data_ptr->dmp_quat[QUAT_Z] = (float)quat[QUAT_Z];
+	// fill in euler angles to the data struct
+	if(mpu->config.fast_math){
+		normalizeQuaternionFast(mpu->data_ptr->dmp_quat);
+		quaternionToTaitBryanFast(mpu->data_ptr->dmp_quat, \
+											mpu->data_ptr->dmp_TaitBryan);
 	}
-
+	else{
+		normalizeQuaternion(mpu->data_ptr->dmp_quat);
+		quaternionToTaitBryan(mpu->data_ptr->dmp_quat, \
+											mpu->data_ptr->dmp_TaitBryan);
+	}
+	j+=16; // increase offset by 16 which was the quaternion size
+	if(!mpu->config.dmp_send_accel) goto GYRO;
 	
+	// Read Accel values and load into imu_data struct
+	// Turn the MSB and LSB into a signed 16-bit value
+	mpu->data_ptr->raw_accel[0] = (int16_t)(((uint16_t)raw[j+0]<<8)|raw[j+1]);
+	mpu->data_ptr->raw_accel[1] = (int16_t)(((uint16_t)raw[j+2]<<8)|raw[j+3]);
+	mpu->data_ptr->raw_accel[2] = (int16_t)(((uint16_t)raw[j+4]<<8)|raw[j+5]);
 	
-	// run data_fusion to filter yaw with compass if new mag data came in
-	if(is_new_dmp_data && config.enable_magnetometer){
-		#ifdef DEBUG
-		printf("running data_fusion\n");
-		#endif
-		data_fusion();
-	}
-
-	// if we finally got dmp data, turn off the first run flag
-	if(is_new_dmp_data) first_run=0;
+	// Fill in real unit values
+	mpu->data_ptr->accel[0] = mpu->data_ptr->raw_accel[0] * \
+												mpu->data_ptr->accel_to_ms2;
+	mpu->data_ptr->accel[1] = mpu->data_ptr->raw_accel[1] * \
+												mpu->data_ptr->accel_to_ms2;
+	mpu->data_ptr->accel[2] = mpu->data_ptr->raw_accel[2] * \
+												mpu->data_ptr->accel_to_ms2;
+	j+=6;
+
+GYRO:
+	if(!mpu->config.dmp_send_gyro) return;
+	
+	// Read gyro values and load into imu_data struct
+	// Turn the MSB and LSB into a signed 16-bit value
+	mpu->data_ptr->raw_gyro[0] = (int16_t)(((int16_t)raw[0+j]<<8)|raw[1+j]);
+	mpu->data_ptr->raw_gyro[1] = (int16_t)(((int16_t)raw[2+j]<<8)|raw[3+j]);
+	mpu->data_ptr->raw_gyro[2] = (int16_t)(((int16_t)raw[4+j]<<8)|raw[5+j]);
+	// Fill in real unit values
+	mpu->data_ptr->gyro[0] = mpu->data_ptr->raw_gyro[0] * \
+												mpu->data_ptr->gyro_to_degs;
+	mpu->data_ptr->gyro[1] = mpu->data_ptr->raw_gyro[1] * \
+												mpu->data_ptr->gyro_to_degs;
+	mpu->data_ptr->gyro[2] = mpu->data_ptr->raw_gyro[2] * \
+												mpu->data_ptr->gyro_to_degs;
+	return;
+}
 
-	// finally, our return value is based on the presence of DMP data only
-	// even if new magnetometer data was read, the expected timing must come
-	// from the DMP samples only
-	if(is_new_dmp_data) return 0;
-	else return -1;
+/*******************************************************************************
+* void parse_dmp_mag(unsigned char* raw)
+*
+* Loads one 7 byte block of magnetometer data put in the FIFO by the MPU's
+* i2c master. The slave writes zeros before its first read and repeats the
+* last bytes between reads, only changed data counts as a new sample and
+* marks the yaw fusion for an update.
+*******************************************************************************/
+void parse_dmp_mag(unsigned char* raw){
+	if(raw[0]==0 && raw[1]==0 && raw[2]==0 && raw[3]==0 && \
+											raw[4]==0 && raw[5]==0){
+		return;
+	}
+	if(memcmp(raw, mpu->last_mag_raw, sizeof(mpu->last_mag_raw))==0) return;
+	memcpy(mpu->last_mag_raw, raw, sizeof(mpu->last_mag_raw));
+	if(process_raw_mag_data(raw, mpu->data_ptr)==0) mpu->mag_updated = 1;
+	return;
 }
 
 /*******************************************************************************
@@ -1838,201 +3321,206 @@ int check_quaternion_validity(unsigned char* raw, int i){
 *
 * This fuses the magnetometer data with the quaternion straight from the DMP
 * to correct the yaw heading to a compass heading. Much thanks to Pansenti for
-* open sourcing this routine. In addition to the Pansenti implementation I also
-* correct the magnetometer data for DMP orientation, initialize yaw with the
-* magnetometer to prevent initial rise time, and correct the yaw_mixing_factor
-* with the sample rate so the filter rise time remains constant with different
-* sample rates.
+* the original routine. The complementary filter runs on a rotation about the
+* vertical that takes the DMP quaternion onto the fused one, so the DMP's
+* short term yaw passes straight through and only the correction is low
+* passed toward the compass heading. Each magnetometer sample rotates the 
+* body field by the fused quaternion, reads the heading error from it and
+* turns the correction by a small part of that, with yaw_corr_gain scaled by
+* the sample rate so the filter rise time stays the same. This is the same
+* first order filter as the old low and high pass pair, but headings never
+* need unwrapping and no Euler angles are turned back into quaternions. The
+* correction starts at the full compass heading to avoid an initial rise
+* time. DMP samples in between magnetometer samples reuse the correction,
+* costing a quaternion product and an add.
 *******************************************************************************/
-d_filter_t low_pass, high_pass; // for magnetometer Yaw filtering
-
 int data_fusion(){
-	float fusedEuler[3], magQuat[4], unfusedQuat[4];
-	static float newMagYaw = 0;
-	static float newDMPYaw = 0;
-	float lastDMPYaw, lastMagYaw, newYaw; 
-	static float dmp_spin_counter = 0;
-	static float mag_spin_counter = 0;
-	static int first_run = 1; // set to 0 after first call to this function
-	
-	
-	// start by filling in the roll/pitch components of the fused euler
-	// angles from the DMP generated angles. Ignore yaw for now, we have to
-	// filter that later. 
-	fusedEuler[TB_PITCH_X] = data_ptr->dmp_TaitBryan[TB_PITCH_X];
-	//fusedEuler[TB_ROLL_Y] = -(data_ptr->dmp_TaitBryan[TB_ROLL_Y]);
-	fusedEuler[TB_ROLL_Y] = (data_ptr->dmp_TaitBryan[TB_ROLL_Y]);
-	fusedEuler[TB_YAW_Z] = 0;
-
-	// generate a quaternion rotation of just roll/pitch
-	TaitBryanToQuaternion(fusedEuler, unfusedQuat);
-
-	// create a quaternion vector from the current magnetic field vector
-	// in IMU body coordinate frame. Since the DMP quaternion is aligned with
-	// a particular orientation, we must be careful to orient the magnetometer
-	// data to match.
-	magQuat[QUAT_W] = 0;
-	switch(config.orientation){
+	float mag[3], q[4], err, h, hw, hz, w, z, dt, yaw;
+	float* c = mpu->yaw_corr;
+	
+	if(!mpu->mag_updated && !mpu->fusion_first_run) goto OUTPUT;
+	mpu->mag_updated = 0;
+
+	// the magnetic field vector in IMU body coordinates. Since the DMP 
+	// quaternion is aligned with a particular orientation, we must be careful
+	// to orient the magnetometer data to match.
+	switch(mpu->config.orientation){
 	case ORIENTATION_Z_UP:
-		magQuat[QUAT_X] = data_ptr->mag[TB_PITCH_X];
-		magQuat[QUAT_Y] = data_ptr->mag[TB_ROLL_Y];
-		magQuat[QUAT_Z] = data_ptr->mag[TB_YAW_Z];
+		mag[0] = mpu->data_ptr->mag[TB_PITCH_X];
+		mag[1] = mpu->data_ptr->mag[TB_ROLL_Y];
+		mag[2] = mpu->data_ptr->mag[TB_YAW_Z];
 		break;
 	case ORIENTATION_Z_DOWN:
-		magQuat[QUAT_X] = -data_ptr->mag[TB_PITCH_X];
-		magQuat[QUAT_Y] = data_ptr->mag[TB_ROLL_Y];
-		magQuat[QUAT_Z] = -data_ptr->mag[TB_YAW_Z];
+		mag[0] = -mpu->data_ptr->mag[TB_PITCH_X];
+		mag[1] = mpu->data_ptr->mag[TB_ROLL_Y];
+		mag[2] = -mpu->data_ptr->mag[TB_YAW_Z];
 		break;
 	case ORIENTATION_X_UP:
-		magQuat[QUAT_X] = data_ptr->mag[TB_YAW_Z];
-		magQuat[QUAT_Y] = data_ptr->mag[TB_ROLL_Y];
-		magQuat[QUAT_Z] = data_ptr->mag[TB_PITCH_X];
+		mag[0] = mpu->data_ptr->mag[TB_YAW_Z];
+		mag[1] = mpu->data_ptr->mag[TB_ROLL_Y];
+		mag[2] = mpu->data_ptr->mag[TB_PITCH_X];
 		break;
 	case ORIENTATION_X_DOWN:
-		magQuat[QUAT_X] = -data_ptr->mag[TB_YAW_Z];
-		magQuat[QUAT_Y] = data_ptr->mag[TB_ROLL_Y];
-		magQuat[QUAT_Z] = -data_ptr->mag[TB_PITCH_X];
+		mag[0] = -mpu->data_ptr->mag[TB_YAW_Z];
+		mag[1] = mpu->data_ptr->mag[TB_ROLL_Y];
+		mag[2] = -mpu->data_ptr->mag[TB_PITCH_X];
 		break;
 	case ORIENTATION_Y_UP:
-		magQuat[QUAT_X] = data_ptr->mag[TB_PITCH_X];
-		magQuat[QUAT_Y] = -data_ptr->mag[TB_YAW_Z];
-		magQuat[QUAT_Z] = data_ptr->mag[TB_ROLL_Y];
+		mag[0] = mpu->data_ptr->mag[TB_PITCH_X];
+		mag[1] = -mpu->data_ptr->mag[TB_YAW_Z];
+		mag[2] = mpu->data_ptr->mag[TB_ROLL_Y];
 		break;
 	case ORIENTATION_Y_DOWN:
-		magQuat[QUAT_X] = data_ptr->mag[TB_PITCH_X];
-		magQuat[QUAT_Y] = data_ptr->mag[TB_YAW_Z];
-		magQuat[QUAT_Z] = -data_ptr->mag[TB_ROLL_Y];
+		mag[0] = mpu->data_ptr->mag[TB_PITCH_X];
+		mag[1] = mpu->data_ptr->mag[TB_YAW_Z];
+		mag[2] = -mpu->data_ptr->mag[TB_ROLL_Y];
 		break;
 	case ORIENTATION_X_FORWARD:
-		magQuat[QUAT_X] = data_ptr->mag[TB_ROLL_Y];
-		magQuat[QUAT_Y] = -data_ptr->mag[TB_PITCH_X];
-		magQuat[QUAT_Z] = data_ptr->mag[TB_YAW_Z];
+		mag[0] = mpu->data_ptr->mag[TB_ROLL_Y];
+		mag[1] = -mpu->data_ptr->mag[TB_PITCH_X];
+		mag[2] = mpu->data_ptr->mag[TB_YAW_Z];
 		break;
 	case ORIENTATION_X_BACK:
-		magQuat[QUAT_X] = -data_ptr->mag[TB_ROLL_Y];
-		magQuat[QUAT_Y] = data_ptr->mag[TB_PITCH_X];
-		magQuat[QUAT_Z] = data_ptr->mag[TB_YAW_Z];
+		mag[0] = -mpu->data_ptr->mag[TB_ROLL_Y];
+		mag[1] = mpu->data_ptr->mag[TB_PITCH_X];
+		mag[2] = mpu->data_ptr->mag[TB_YAW_Z];
 		break;
 	default:
 		printf("ERROR: invalid orientation\n");
 		return -1;
 	}
 
-	// tilt that vector by the roll/pitch of the IMU to align magnetic field
-	// vector such that Z points vertically
-	tilt_compensate(magQuat, unfusedQuat, magQuat);
-
-	// from the aligned magnetic field vector, find a yaw heading
-	// check for validity and make sure the heading is positive
-	lastMagYaw = newMagYaw; // save from last loop
-	newMagYaw = -atan2f(magQuat[QUAT_Y], magQuat[QUAT_X]);
-	if (newMagYaw != newMagYaw) {
+	// the first error is measured against the DMP alone
+	if(mpu->fusion_first_run){
+		c[QUAT_W] = 1.0f;
+		c[QUAT_X] = c[QUAT_Y] = c[QUAT_Z] = 0.0f;
+		mpu->yaw_corr_angle = 0.0f;
+	}
+	// rotate the field into the fused world frame. With the fused heading
+	// right it points north, any angle left over is the heading error.
+	fuse_yaw_corr(c, mpu->data_ptr->dmp_quat, q);
+	quaternionRotateVector(q, mag, mag);
+	if(mpu->config.fast_math) err = -fastAtan2f(mag[1], mag[0]);
+	else err = -atan2f(mag[1], mag[0]);
+	if (err != err) {
 		#ifdef WARNINGS
-		printf("newMagYaw NAN\n");
+		printf("heading error NAN\n");
 		#endif
 		return -1;
 	}
-	data_ptr->compass_heading_raw = newMagYaw;
-	// save DMP last from time and record newDMPYaw for this time
-	lastDMPYaw = newDMPYaw;
-	newDMPYaw = data_ptr->dmp_TaitBryan[TB_YAW_Z];
-	
-	// the outputs from atan2 and dmp are between -PI and PI.
-	// for our filters to run smoothly, we can't have them jump between -PI
-	// to PI when doing a complete spin. Therefore we check for a skip and 
-	// increment or decrement the spin counter
-	if(newMagYaw-lastMagYaw < -PI) mag_spin_counter++;
-	else if (newMagYaw-lastMagYaw > PI) mag_spin_counter--;
-	if(newDMPYaw-lastDMPYaw < -PI) dmp_spin_counter++;
-	else if (newDMPYaw-lastDMPYaw > PI) dmp_spin_counter--;
-	
-	// if this is the first run, set up filters
-	if(first_run){
-		lastMagYaw = newMagYaw;
-		lastDMPYaw = newDMPYaw;
-		mag_spin_counter = 0;
-		dmp_spin_counter = 0;
-		
-		// generate complementary filters
-		float dt = 1.0/config.dmp_sample_rate;
-		low_pass =create_first_order_lowpass(dt,config.compass_time_constant);
-		high_pass=create_first_order_highpass(dt,config.compass_time_constant);
-		prefill_filter_inputs(&low_pass,newMagYaw);
-		prefill_filter_outputs(&low_pass,newMagYaw);
-		prefill_filter_inputs(&high_pass,newDMPYaw);
-		prefill_filter_outputs(&high_pass,0);
-		first_run = 0;
-	}
-	
-	// new Yaw is the sum of low and high pass complementary filters.
-	newYaw = march_filter(&low_pass,newMagYaw+(TWO_PI*mag_spin_counter)) \
-			+ march_filter(&high_pass,newDMPYaw+(TWO_PI*dmp_spin_counter));
-			
-	newYaw = fmodf(newYaw,TWO_PI); // remove the effect of the spins
-	if (newYaw > PI) newYaw -= TWO_PI; // bound between +- PI
-	else if (newYaw < -PI) newYaw += TWO_PI; // bound between +- PI
-
-	// Euler angles expect a yaw between -pi to pi so slide it again and
-	// store in the user-accessible fused euler angle
-	data_ptr->compass_heading = newYaw;
-	data_ptr->fused_TaitBryan[TB_YAW_Z] = newYaw;
-	data_ptr->fused_TaitBryan[TB_PITCH_X] = data_ptr->dmp_TaitBryan[TB_PITCH_X];
-	data_ptr->fused_TaitBryan[TB_ROLL_Y] = data_ptr->dmp_TaitBryan[TB_ROLL_Y];
-
-	// Also generate a new quaternion from the filtered euler angles
-	TaitBryanToQuaternion(data_ptr->fused_TaitBryan, data_ptr->fused_quat);
+	yaw = wrap_yaw(mpu->data_ptr->dmp_TaitBryan[TB_YAW_Z]+mpu->yaw_corr_angle);
+	mpu->data_ptr->compass_heading_raw = wrap_yaw(yaw + err);
+	
+	// on the first run take the whole error so the heading starts right, the
+	// filter steps at the magnetometer rate when the DMP runs faster
+	if(mpu->fusion_first_run){
+		dt = 1.0f/mpu->config.dmp_sample_rate;
+		if(mpu->config.dmp_sample_rate>AK8963_RATE) dt = 1.0f/AK8963_RATE;
+		mpu->yaw_corr_gain = dt/mpu->config.compass_time_constant;
+		h = 0.5f*err;
+		hw = cosf(h);
+		hz = sinf(h);
+		mpu->fusion_first_run = 0;
+	}
+	// otherwise a small turn, the half angle's sin and cos by Taylor series
+	else{
+		err *= mpu->yaw_corr_gain;
+		h = 0.5f*err;
+		hw = 1.0f - 0.5f*h*h;
+		hz = h*(1.0f - h*h/6.0f);
+	}
+	w = hw*c[QUAT_W] - hz*c[QUAT_Z];
+	z = hw*c[QUAT_Z] + hz*c[QUAT_W];
+	c[QUAT_W] = w;
+	c[QUAT_Z] = z;
+	normalizeQuaternionFast(c);
+	// the angle comes from c itself so the two can't drift apart
+	if(mpu->config.fast_math){
+		mpu->yaw_corr_angle = 2.0f*fastAtan2f(c[QUAT_Z], c[QUAT_W]);
+	}
+	else mpu->yaw_corr_angle = 2.0f*atan2f(c[QUAT_Z], c[QUAT_W]);
+	mpu->yaw_corr_angle = wrap_yaw(mpu->yaw_corr_angle);
+
+OUTPUT:
+	// roll and pitch are the DMP's, yaw is the DMP's turned by the correction
+	fuse_yaw_corr(c, mpu->data_ptr->dmp_quat, mpu->data_ptr->fused_quat);
+	yaw = wrap_yaw(mpu->data_ptr->dmp_TaitBryan[TB_YAW_Z]+mpu->yaw_corr_angle);
+	mpu->data_ptr->compass_heading = yaw;
+	mpu->data_ptr->fused_TaitBryan[TB_YAW_Z] = yaw;
+	mpu->data_ptr->fused_TaitBryan[TB_PITCH_X] = \
+									mpu->data_ptr->dmp_TaitBryan[TB_PITCH_X];
+	mpu->data_ptr->fused_TaitBryan[TB_ROLL_Y] = \
+									mpu->data_ptr->dmp_TaitBryan[TB_ROLL_Y];
 	return 0;
 }
 
+/*******************************************************************************
+* void fuse_yaw_corr(float c[4], float q[4], float out[4])
+*
+* c*q for a correction c turning only about Z, 8 multiplies
+*******************************************************************************/
+void fuse_yaw_corr(float c[4], float q[4], float out[4]){
+	float w = c[QUAT_W]*q[QUAT_W] - c[QUAT_Z]*q[QUAT_Z];
+	float x = c[QUAT_W]*q[QUAT_X] - c[QUAT_Z]*q[QUAT_Y];
+	float y = c[QUAT_W]*q[QUAT_Y] + c[QUAT_Z]*q[QUAT_X];
+	out[QUAT_Z] = c[QUAT_W]*q[QUAT_Z] + c[QUAT_Z]*q[QUAT_W];
+	out[QUAT_W] = w;
+	out[QUAT_X] = x;
+	out[QUAT_Y] = y;
+}
+
+/*******************************************************************************
+* float wrap_yaw(float yaw)
+*
+* bounds an angle within a turn of +- PI to +- PI
+*******************************************************************************/
+float wrap_yaw(float yaw){
+	if(yaw > PI) return yaw - TWO_PI;
+	if(yaw < -PI) return yaw + TWO_PI;
+	return yaw;
+}
+
 /*******************************************************************************
 * int write_gyro_offsets_to_disk(int16_t offsets[3])
 *
-* Reads steady state gyro offsets from the disk and puts them in the IMU's 
-* gyro offset register. If no calibration file exists then make a new one.
+* Saves steady state gyro offsets in the calibration store, replacing the
+* old ones in a single rename.
 *******************************************************************************/
 int write_gyro_offets_to_disk(int16_t offsets[3]){
-	FILE *cal;
-	char file_path[100];
-
-	// construct a new file path string and open for writing
-	strcpy(file_path, CONFIG_DIRECTORY);
-	strcat(file_path, GYRO_CAL_FILE);
-	cal = fopen(file_path, "w+");
-	// if opening for writing failed, the directory may not exist yet
-	if (cal == 0) {
-		mkdir(CONFIG_DIRECTORY, 0777);
-		cal = fopen(file_path, "w+");
-		if (cal == 0){
-			printf("could not open config directory\n");
-			printf(CONFIG_DIRECTORY);
-			printf("\n");
-			return -1;
-		}
-	}
-	
-	// write to the file, close, and exit
-	if(fprintf(cal,"%d\n%d\n%d\n", offsets[0],offsets[1],offsets[2])<0){
-		printf("Failed to write gyro offsets to file\n");
-		fclose(cal);
+	if(cal_store_set_gyro(offsets)<0){
+		printf("Failed to write gyro offsets to disk\n");
 		return -1;
 	}
-	fclose(cal);
-	return 0;	
-	
+	return 0;
 }
 
 /*******************************************************************************
 * int load_gyro_offsets()
 *
-* Loads steady state gyro offsets from the disk and puts them in the IMU's 
-* gyro offset register. If no calibration file exists then make a new one.
+* Loads steady state gyro offsets from the calibration store and puts them in
+* the IMU's gyro offset register. Offsets only found in the old text file are
+* copied into the store.
 *******************************************************************************/
 int load_gyro_offets(){
 	FILE *cal;
 	char file_path[100];
 	uint8_t data[6];
+	int16_t migrate[3];
+	int off[3];
 	int x,y,z;
 	
+	// only the on-board IMU has a calibration, others start from zero
+	if(mpu!=&onboard_imu){
+		x = y = z = 0;
+		goto LOADED;
+	}
+	if(cal_store_get_gyro(off)==0){
+		x = off[0];
+		y = off[1];
+		z = off[2];
+		goto LOADED;
+	}
+
 	// construct a new file path string and open for reading
 	strcpy (file_path, CONFIG_DIRECTORY);
 	strcat (file_path, GYRO_CAL_FILE);
@@ -2048,11 +3536,16 @@ int load_gyro_offets(){
 		z = 0;
 	}
 	else {
-		// read in data
+		// read in data and carry it over to the calibration store
 		fscanf(cal,"%d\n%d\n%d\n", &x,&y,&z);
 		fclose(cal);
+		migrate[0] = x;
+		migrate[1] = y;
+		migrate[2] = z;
+		cal_store_set_gyro(migrate);
 	}
 
+LOADED:
 	#ifdef DEBUG
 	printf("offsets: %d %d %d\n", x, y, z);
 	#endif
@@ -2066,9 +3559,13 @@ int load_gyro_offets(){
 	data[3] = (-y/4)       & 0xFF;
 	data[4] = (-z/4  >> 8) & 0xFF;
 	data[5] = (-z/4)       & 0xFF;
+	mpu->gyro_offset_reg[0] = mpu->gyro_offset_base[0] = -x/4;
+	mpu->gyro_offset_reg[1] = mpu->gyro_offset_base[1] = -y/4;
+	mpu->gyro_offset_reg[2] = mpu->gyro_offset_base[2] = -z/4;
+	memset(mpu->gyro_temp_corr, 0, sizeof(mpu->gyro_temp_corr));
 
 	// Push gyro biases to hardware registers
-	if(i2c_write_bytes(IMU_BUS, XG_OFFSET_H, 6, &data[0])){
+	if(mpu_write_bytes(XG_OFFSET_H, 6, &data[0])){
 		printf("ERROR: failed to load gyro offsets into IMU register\n");
 		return -1;
 	}
@@ -2086,16 +3583,20 @@ int calibrate_gyro_routine(){
 	int32_t gyro_sum[3] = {0, 0, 0};
 	int16_t offsets[3];
 	
+	if(mpu!=&onboard_imu){
+		printf("ERROR: only the on-board IMU can be calibrated\n");
+		return -1;
+	}
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(i2c_get_in_use_state(IMU_BUS)){
+	if(mpu_bus_in_use()){
 		printf("i2c bus claimed by another process\n");
 		printf("aborting gyro calibration()\n");
 		return -1;
 	}
 	
 	// if it is not claimed, start the i2c bus
-	if(i2c_init(IMU_BUS, IMU_ADDR)){
+	if(mpu_init_bus()){
 		printf("initialize_imu_dmp failed at i2c_init\n");
 		return -1;
 	}
@@ -2103,7 +3604,7 @@ int calibrate_gyro_routine(){
 	// claiming the bus does no guarantee other code will not interfere 
 	// with this process, but best to claim it so other code can check
 	// like we did above
-	i2c_claim_bus(IMU_BUS);
+	mpu_claim_bus();
 	
 	// reset device, reset all registers
 	if(reset_mpu9250()<0){
@@ -2112,8 +3613,8 @@ int calibrate_gyro_routine(){
 	}
 
 	// set up the IMU specifically for calibration. 
-	i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0x01);  
-	i2c_write_byte(IMU_BUS, PWR_MGMT_2, 0x00); 
+	mpu_write_byte(PWR_MGMT_1, 0x01);  
+	mpu_write_byte(PWR_MGMT_2, 0x00); 
 	usleep(200000);
 	
 	// // set bias registers to 0
@@ -2124,36 +3625,43 @@ int calibrate_gyro_routine(){
 		// return -1;
 	// }
 
-	i2c_write_byte(IMU_BUS, INT_ENABLE, 0x00);  // Disable all interrupts
-	i2c_write_byte(IMU_BUS, FIFO_EN, 0x00);     // Disable FIFO
-	i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0x00);  // Turn on internal clock source
-	i2c_write_byte(IMU_BUS, I2C_MST_CTRL, 0x00);// Disable I2C master
-	i2c_write_byte(IMU_BUS, USER_CTRL, 0x00);   // Disable FIFO and I2C master
-	i2c_write_byte(IMU_BUS, USER_CTRL, 0x0C);   // Reset FIFO and DMP
+	const i2c_reg_write_t reset_regs[] = {
+		{INT_ENABLE,	0x00},	// Disable all interrupts
+		{FIFO_EN,		0x00},	// Disable FIFO
+		{PWR_MGMT_1,	0x00},	// Turn on internal clock source
+		{I2C_MST_CTRL,	0x00},	// Disable I2C master
+		{USER_CTRL,		0x00},	// Disable FIFO and I2C master
+		{USER_CTRL,		0x0C}	// Reset FIFO and DMP
+	};
+	mpu_write_regs(reset_regs, \
+							sizeof(reset_regs)/sizeof(reset_regs[0]));
 	usleep(15000);
 
 	// Configure MPU9250 gyro and accelerometer for bias calculation
-	i2c_write_byte(IMU_BUS, CONFIG, 0x01);      // Set low-pass filter to 188 Hz
-	i2c_write_byte(IMU_BUS, SMPLRT_DIV, 0x04);  // Set sample rate to 200hz
-	// Set gyro full-scale to 250 degrees per second, maximum sensitivity
-	i2c_write_byte(IMU_BUS, GYRO_CONFIG, 0x00); 
-	// Set accelerometer full-scale to 2 g, maximum sensitivity	
-	i2c_write_byte(IMU_BUS, ACCEL_CONFIG, 0x00); 
+	// SMPLRT_DIV through ACCEL_CONFIG are consecutive, one write does all
+	const i2c_reg_write_t config_regs[] = {
+		{SMPLRT_DIV,	0x04},	// Set sample rate to 200hz
+		{CONFIG,		0x01},	// Set low-pass filter to 188 Hz
+		{GYRO_CONFIG,	0x00},	// 250 degrees per second, max sensitivity
+		{ACCEL_CONFIG,	0x00}	// 2 g, maximum sensitivity
+	};
+	mpu_write_regs(config_regs, \
+							sizeof(config_regs)/sizeof(config_regs[0]));
 
 COLLECT_DATA:
 
 	// Configure FIFO to capture gyro data for bias calculation
-	i2c_write_byte(IMU_BUS, USER_CTRL, 0x40);   // Enable FIFO  
+	mpu_write_byte(USER_CTRL, 0x40);   // Enable FIFO  
 	// Enable gyro sensors for FIFO (max size 512 bytes in MPU-9250)
 	c = FIFO_GYRO_X_EN|FIFO_GYRO_Y_EN|FIFO_GYRO_Z_EN;
-	i2c_write_byte(IMU_BUS, FIFO_EN, c); 
+	mpu_write_byte(FIFO_EN, c); 
 	// 6 bytes per sample. 200hz. wait 0.4 seconds
 	usleep(400000);
 
 	// At end of sample accumulation, turn off FIFO sensor read
-	i2c_write_byte(IMU_BUS, FIFO_EN, 0x00);   
+	mpu_write_byte(FIFO_EN, 0x00);   
 	// read FIFO sample count and log number of samples
-	i2c_read_bytes(IMU_BUS, FIFO_COUNTH, 2, &data[0]); 
+	mpu_read_bytes(FIFO_COUNTH, 2, &data[0]); 
 	int16_t fifo_count = ((uint16_t)data[0] << 8) | data[1];
 	int samples = fifo_count/6;
 
@@ -2163,17 +3671,17 @@ COLLECT_DATA:
 	
 	int i;
 	int16_t x,y,z;
-	vector_t vx,vy,vz;
-	vx = create_vector(samples);
-	vy = create_vector(samples);
-	vz = create_vector(samples);
+	running_stats_t sx, sy, sz;
+	sx = create_running_stats();
+	sy = create_running_stats();
+	sz = create_running_stats();
 	float dev_x, dev_y, dev_z;
 	gyro_sum[0] = 0;
 	gyro_sum[1] = 0;
 	gyro_sum[2] = 0;
 	for (i=0; i<samples; i++) {
 		// read data for averaging
-		if(i2c_read_bytes(IMU_BUS, FIFO_R_W, 6, data)<0){
+		if(mpu_read_bytes(FIFO_R_W, 6, data)<0){
 			printf("ERROR: failed to read FIFO\n");
 			return -1;
 		}
@@ -2183,16 +3691,13 @@ COLLECT_DATA:
 		gyro_sum[0]  += (int32_t) x;
 		gyro_sum[1]  += (int32_t) y;
 		gyro_sum[2]  += (int32_t) z;
-		vx.data[i] = (float)x;
-		vy.data[i] = (float)y;
-		vz.data[i] = (float)z;
+		update_running_stats(&sx, x);
+		update_running_stats(&sy, y);
+		update_running_stats(&sz, z);
 	}
-  	dev_x = standard_deviation(vx);
-  	dev_y = standard_deviation(vy);
-  	dev_z = standard_deviation(vz);
-  	destroy_vector(&vx);
-  	destroy_vector(&vy);
-  	destroy_vector(&vz);
+	dev_x = running_stats_stddev(&sx);
+	dev_y = running_stats_stddev(&sy);
+	dev_z = running_stats_stddev(&sz);
 
 	#ifdef DEBUG
 	printf("gyro sums: %d %d %d\n", gyro_sum[0], gyro_sum[1], gyro_sum[2]);
@@ -2220,7 +3725,7 @@ COLLECT_DATA:
 	}
 
 	// done with I2C for now
-	i2c_release_bus(IMU_BUS);
+	mpu_release_bus();
 	
 	
  
@@ -2233,6 +3738,429 @@ COLLECT_DATA:
 	return 0;
 }
 
+/*******************************************************************************
+* void start_gyro_bias_tracking(int sample_rate)
+*
+* Sizes the stillness window for the rate samples will arrive at and clears
+* the counters. Called by the DMP and FIFO stream initializers after the
+* offsets were loaded from disk.
+*******************************************************************************/
+void start_gyro_bias_tracking(int sample_rate){
+	mpu->gyro_bias_window = sample_rate*GYRO_BIAS_WINDOW_MS/1000;
+	if(mpu->gyro_bias_window<2) mpu->gyro_bias_window = 2;
+	mpu->gyro_bias_n = 0;
+	mpu->gyro_bias_updates = 0;
+	mpu->gyro_bias_dirty = 0;
+	mpu->gyro_bias_saved_micros = micros_since_boot();
+}
+
+/*******************************************************************************
+* void track_gyro_bias(imu_data_t* data)
+*
+* Runs on every sample when track_gyro_bias is set in the config. Gyro and 
+* accel norm statistics are gathered over a window, and if the board sat 
+* still through all of it the mean rate is what is left of the gyro bias. A
+* fraction of that is folded into the MPU's gyro offset registers, so the DMP
+* quaternion is corrected along with the raw rates and thermal drift is 
+* followed whenever the robot stops. A write to disk is started now and then
+* so the next power up begins close.
+*******************************************************************************/
+void track_gyro_bias(imu_data_t* data){
+	float mean, var, norm, step;
+	int16_t base[3];
+	int i, changed = 0;
+	pthread_t thread;
+
+	norm = sqrtf(data->accel[0]*data->accel[0] + \
+			data->accel[1]*data->accel[1] + data->accel[2]*data->accel[2]);
+	if(mpu->gyro_bias_n==0){
+		for(i=0;i<3;i++){
+			mpu->gyro_bias_sum[i] = 0.0f;
+			mpu->gyro_bias_sumsq[i] = 0.0f;
+		}
+		mpu->accel_norm_sum = 0.0f;
+		mpu->accel_norm_sumsq = 0.0f;
+	}
+	for(i=0;i<3;i++){
+		mpu->gyro_bias_sum[i] += data->gyro[i];
+		mpu->gyro_bias_sumsq[i] += data->gyro[i]*data->gyro[i];
+	}
+	mpu->accel_norm_sum += norm;
+	mpu->accel_norm_sumsq += norm*norm;
+	if(++mpu->gyro_bias_n < mpu->gyro_bias_window) return;
+	mpu->gyro_bias_n = 0;
+
+	mean = mpu->accel_norm_sum/mpu->gyro_bias_window;
+	var = mpu->accel_norm_sumsq/mpu->gyro_bias_window - mean*mean;
+	if(var > ACCEL_BIAS_STILL_MS2*ACCEL_BIAS_STILL_MS2) return;
+	for(i=0;i<3;i++){
+		mean = mpu->gyro_bias_sum[i]/mpu->gyro_bias_window;
+		var = mpu->gyro_bias_sumsq[i]/mpu->gyro_bias_window - mean*mean;
+		if(var > GYRO_BIAS_STILL_DEGS*GYRO_BIAS_STILL_DEGS) return;
+		if(fabsf(mean) > GYRO_BIAS_MAX_STEP_DEGS) return;
+		step = GYRO_BIAS_GAIN*mean*GYRO_OFFSET_LSB_PER_DEGS;
+		base[i] = mpu->gyro_offset_base[i] - (int16_t)lrintf(step);
+		if(base[i]>GYRO_BIAS_MAX_REG) base[i] = GYRO_BIAS_MAX_REG;
+		if(base[i]<-GYRO_BIAS_MAX_REG) base[i] = -GYRO_BIAS_MAX_REG;
+		if(base[i]!=mpu->gyro_offset_base[i]) changed = 1;
+	}
+	if(!changed) return;
+	for(i=0;i<3;i++) mpu->gyro_offset_base[i] = base[i];
+	if(update_gyro_offset_regs()<0) return;
+	mpu->gyro_bias_updates++;
+	mpu->gyro_bias_dirty = 1;
+
+	// file i/o doesn't belong in this thread, hand it to a normal one
+	if(mpu!=&onboard_imu) return;
+	if(micros_since_boot()-mpu->gyro_bias_saved_micros < GYRO_BIAS_SAVE_US){
+		return;
+	}
+	if(pthread_mutex_trylock(&mpu->gyro_bias_save_mutex)) return;
+	for(i=0;i<3;i++){
+		mpu->gyro_bias_save_offsets[i] = -mpu->gyro_offset_base[i]*4;
+	}
+	pthread_mutex_unlock(&mpu->gyro_bias_save_mutex);
+	if(create_rt_thread(&thread, RT_SERVICE_LOGGER, gyro_bias_save_thread, \
+															mpu)==0){
+		pthread_detach(thread);
+		mpu->gyro_bias_saved_micros = micros_since_boot();
+		mpu->gyro_bias_dirty = 0;
+	}
+}
+
+/*******************************************************************************
+* int write_gyro_offset_regs(int16_t reg[3])
+*******************************************************************************/
+int write_gyro_offset_regs(int16_t reg[3]){
+	uint8_t data[6];
+	int i;
+	for(i=0;i<3;i++){
+		data[2*i]   = (reg[i] >> 8) & 0xFF;
+		data[2*i+1] = reg[i] & 0xFF;
+	}
+	if(mpu_write_bytes(XG_OFFSET_H, 6, data)){
+		if(mpu->config.show_warnings) printf("failed to write gyro offsets\n");
+		return -1;
+	}
+	for(i=0;i<3;i++) mpu->gyro_offset_reg[i] = reg[i];
+	return 0;
+}
+
+/*******************************************************************************
+* int update_gyro_offset_regs()
+*
+* writes the base offsets plus the temperature correction if that changed
+*******************************************************************************/
+int update_gyro_offset_regs(){
+	int16_t reg[3];
+	int i, changed = 0;
+	for(i=0;i<3;i++){
+		reg[i] = mpu->gyro_offset_base[i] + mpu->gyro_temp_corr[i];
+		if(reg[i]!=mpu->gyro_offset_reg[i]) changed = 1;
+	}
+	if(!changed) return 0;
+	return write_gyro_offset_regs(reg);
+}
+
+/*******************************************************************************
+* void* gyro_bias_save_thread(void* ptr)
+*
+* writes the offsets track_gyro_bias left in gyro_bias_save_offsets
+*******************************************************************************/
+void* gyro_bias_save_thread(void* ptr){
+	mpu = (imu_handle_t*)ptr;
+	pthread_mutex_lock(&mpu->gyro_bias_save_mutex);
+	write_gyro_offets_to_disk(mpu->gyro_bias_save_offsets);
+	pthread_mutex_unlock(&mpu->gyro_bias_save_mutex);
+	return NULL;
+}
+
+/*******************************************************************************
+* int get_gyro_bias(float bias[3])
+*
+* The bias in deg/s currently removed by the gyro offset registers, from the
+* calibration file plus whatever tracking has added since.
+*******************************************************************************/
+int get_gyro_bias(float bias[3]){
+	int i;
+	for(i=0;i<3;i++){
+		bias[i] = -mpu->gyro_offset_reg[i]/GYRO_OFFSET_LSB_PER_DEGS;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* uint64_t get_gyro_bias_updates()
+*******************************************************************************/
+uint64_t get_gyro_bias_updates(){
+	return mpu->gyro_bias_updates;
+}
+
+/*******************************************************************************
+* int save_gyro_bias()
+*
+* Writes the tracked offsets to the gyro calibration file now. power_off_imu
+* does this too if they changed since the last write.
+*******************************************************************************/
+int save_gyro_bias(){
+	int16_t offsets[3];
+	int i, ret;
+	if(mpu!=&onboard_imu){
+		printf("ERROR: only the on-board IMU has a gyro calibration file\n");
+		return -1;
+	}
+	for(i=0;i<3;i++) offsets[i] = -mpu->gyro_offset_base[i]*4;
+	pthread_mutex_lock(&mpu->gyro_bias_save_mutex);
+	ret = write_gyro_offets_to_disk(offsets);
+	pthread_mutex_unlock(&mpu->gyro_bias_save_mutex);
+	if(ret<0) return -1;
+	mpu->gyro_bias_dirty = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* void start_temp_compensation(int sample_rate)
+*
+* Loads the table and reads the temperature once so the first samples are
+* already corrected. Compensation stays off if there is no table.
+*******************************************************************************/
+void start_temp_compensation(int sample_rate){
+	mpu->temp_comp_en = 0;
+	if(load_imu_temp_calibration()<0) return;
+	mpu->temp_comp_period = sample_rate;
+	mpu->temp_comp_count = 0;
+	mpu->temp_comp_en = 1;
+	if(read_imu_temp(mpu->data_ptr)==0){
+		apply_temp_compensation(mpu->data_ptr, 1);
+	}
+}
+
+/*******************************************************************************
+* void apply_temp_compensation(imu_data_t* data, int have_temp)
+*
+* Per sample correction. When data->temp is fresh, or in DMP mode once a 
+* second after reading it, the correction for that temperature is 
+* interpolated between two bins. The gyro part goes into the offset
+* registers so DMP angles benefit and the accel part is subtracted here.
+*******************************************************************************/
+void apply_temp_compensation(imu_data_t* data, int have_temp){
+	float x, f;
+	int i, k;
+
+	if(!have_temp && ++mpu->temp_comp_count>=mpu->temp_comp_period){
+		mpu->temp_comp_count = 0;
+		if(read_imu_temp(data)==0) have_temp = 1;
+	}
+	if(have_temp){
+		x = data->temp - IMU_TEMP_MIN_C;
+		if(x<0.0f) x = 0.0f;
+		if(x>IMU_TEMP_BINS-1) x = IMU_TEMP_BINS-1;
+		k = (int)x;
+		if(k>IMU_TEMP_BINS-2) k = IMU_TEMP_BINS-2;
+		f = x-k;
+		for(i=0;i<3;i++){
+			mpu->temp_accel_corr[i] = mpu->temp_comp_accel[k][i] + f * \
+				(mpu->temp_comp_accel[k+1][i]-mpu->temp_comp_accel[k][i]);
+			mpu->gyro_temp_corr[i] = -(int16_t)lrintf( \
+				GYRO_OFFSET_LSB_PER_DEGS * (mpu->temp_comp_gyro[k][i] + f * \
+				(mpu->temp_comp_gyro[k+1][i]-mpu->temp_comp_gyro[k][i])));
+		}
+		update_gyro_offset_regs();
+	}
+	if(mpu->dmp_en && !mpu->config.dmp_send_accel) return;
+	for(i=0;i<3;i++) data->accel[i] -= mpu->temp_accel_corr[i];
+}
+
+/*******************************************************************************
+* int load_imu_temp_calibration()
+*
+* Reads the bins calibrate_imu_temp_routine kept and fills the ones between
+* and beyond them by interpolating and holding the end values, so every bin
+* is usable at run time.
+*******************************************************************************/
+int load_imu_temp_calibration(){
+	FILE *cal;
+	char file_path[100];
+	float t, g[3], a[3];
+	int have[IMU_TEMP_BINS];
+	int i, j, k, last, n = 0;
+
+	if(mpu!=&onboard_imu) return -1;
+	strcpy(file_path, CONFIG_DIRECTORY);
+	strcat(file_path, IMU_TEMP_CAL_FILE);
+	cal = fopen(file_path, "r");
+	if(cal==0){
+		printf("WARNING: no imu temperature calibration data found\n");
+		printf("Please run calibrate_imu_temp\n\n");
+		return -1;
+	}
+	memset(have, 0, sizeof(have));
+	while(fscanf(cal, "%f %f %f %f %f %f %f\n", &t, &g[0], &g[1], &g[2], \
+										&a[0], &a[1], &a[2])==7){
+		k = lrintf(t) - IMU_TEMP_MIN_C;
+		if(k<0 || k>=IMU_TEMP_BINS) continue;
+		for(i=0;i<3;i++){
+			mpu->temp_comp_gyro[k][i] = g[i];
+			mpu->temp_comp_accel[k][i] = a[i];
+		}
+		have[k] = 1;
+		n++;
+	}
+	fclose(cal);
+	if(n==0){
+		printf("ERROR: imu temperature calibration file is empty\n");
+		return -1;
+	}
+
+	last = -1;
+	for(k=0;k<IMU_TEMP_BINS;k++){
+		if(!have[k]) continue;
+		// hold the first value below it, interpolate back to the last one
+		for(j=last+1;j<k;j++){
+			for(i=0;i<3;i++){
+				if(last<0){
+					mpu->temp_comp_gyro[j][i] = mpu->temp_comp_gyro[k][i];
+					mpu->temp_comp_accel[j][i] = mpu->temp_comp_accel[k][i];
+					continue;
+				}
+				t = (float)(j-last)/(k-last);
+				mpu->temp_comp_gyro[j][i] = mpu->temp_comp_gyro[last][i] + \
+					t*(mpu->temp_comp_gyro[k][i]-mpu->temp_comp_gyro[last][i]);
+				mpu->temp_comp_accel[j][i] = mpu->temp_comp_accel[last][i] + \
+				t*(mpu->temp_comp_accel[k][i]-mpu->temp_comp_accel[last][i]);
+			}
+		}
+		last = k;
+	}
+	for(j=last+1;j<IMU_TEMP_BINS;j++){
+		for(i=0;i<3;i++){
+			mpu->temp_comp_gyro[j][i] = mpu->temp_comp_gyro[last][i];
+			mpu->temp_comp_accel[j][i] = mpu->temp_comp_accel[last][i];
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int calibrate_imu_temp_routine(int max_minutes)
+*
+* Run from cold with the board sitting still. Samples accel, gyro and 
+* temperature at 100hz while the board warms up and averages them into 1C 
+* bins. Ends when the temperature hasn't risen for 3 minutes, after 
+* max_minutes, or when the program is told to exit. Samples with the board 
+* turning are skipped. Bins are written relative to their interpolated value
+* at 25C, or the nearest end of the range covered if that is outside, with
+* gyro rates relative to the offsets in the gyro calibration file.
+*******************************************************************************/
+int calibrate_imu_temp_routine(int max_minutes){
+	imu_data_t data;
+	static double gsum[IMU_TEMP_BINS][3], asum[IMU_TEMP_BINS][3];
+	static int count[IMU_TEMP_BINS];
+	float g[IMU_TEMP_BINS][3], a[IMU_TEMP_BINS][3];
+	float gref[3], aref[3], hottest, f;
+	uint64_t start, last_rise, now;
+	FILE *cal;
+	char file_path[100];
+	int i, k, lo, hi, kref;
+
+	if(mpu!=&onboard_imu){
+		printf("ERROR: only the on-board IMU can be calibrated\n");
+		return -1;
+	}
+	memset(gsum, 0, sizeof(gsum));
+	memset(asum, 0, sizeof(asum));
+	memset(count, 0, sizeof(count));
+	if(initialize_imu(&data, get_default_imu_config())<0){
+		printf("ERROR: failed to initialize imu for temperature calibration\n");
+		return -1;
+	}
+	start = last_rise = micros_since_boot();
+	hottest = -INFINITY;
+	while(get_state()!=EXITING){
+		now = micros_since_boot();
+		if(max_minutes>0 && now-start > (uint64_t)max_minutes*60000000) break;
+		if(now-last_rise > (uint64_t)IMU_TEMP_CAL_STABLE_S*1000000) break;
+		usleep(1000000/IMU_TEMP_CAL_RATE);
+		if(read_imu_all(&data)<0) continue;
+		if(fabsf(data.gyro[0])>IMU_TEMP_CAL_STILL_DEGS || \
+			fabsf(data.gyro[1])>IMU_TEMP_CAL_STILL_DEGS || \
+			fabsf(data.gyro[2])>IMU_TEMP_CAL_STILL_DEGS) continue;
+		k = lrintf(data.temp) - IMU_TEMP_MIN_C;
+		if(k<0 || k>=IMU_TEMP_BINS) continue;
+		for(i=0;i<3;i++){
+			gsum[k][i] += data.gyro[i];
+			asum[k][i] += data.accel[i];
+		}
+		count[k]++;
+		if(data.temp > hottest+0.2f){
+			hottest = data.temp;
+			last_rise = now;
+			printf("\rtemperature: %5.1fC", data.temp);
+			fflush(stdout);
+		}
+	}
+	printf("\n");
+
+	// average the bins worth keeping
+	lo = -1;
+	hi = -1;
+	for(k=0;k<IMU_TEMP_BINS;k++){
+		if(count[k]<IMU_TEMP_MIN_SAMPLES){
+			count[k] = 0;
+			continue;
+		}
+		for(i=0;i<3;i++){
+			g[k][i] = gsum[k][i]/count[k];
+			a[k][i] = asum[k][i]/count[k];
+		}
+		if(lo<0) lo = k;
+		hi = k;
+	}
+	if(lo<0 || lo==hi){
+		printf("ERROR: temperature didn't change enough to calibrate\n");
+		return -1;
+	}
+
+	// reference values at 25C, held at the ends of the range covered
+	f = IMU_TEMP_REF_C - IMU_TEMP_MIN_C;
+	if(f<lo) f = lo;
+	if(f>hi) f = hi;
+	kref = (int)f;
+	while(count[kref]==0) kref--;
+	for(k=kref+1; k<=hi && count[k]==0; k++);
+	if(k>hi) k = kref;
+	f = (k==kref) ? 0.0f : (f-kref)/(k-kref);
+	for(i=0;i<3;i++){
+		gref[i] = g[kref][i] + f*(g[k][i]-g[kref][i]);
+		aref[i] = a[kref][i] + f*(a[k][i]-a[kref][i]);
+	}
+
+	strcpy(file_path, CONFIG_DIRECTORY);
+	strcat(file_path, IMU_TEMP_CAL_FILE);
+	cal = fopen(file_path, "w+");
+	if(cal==0){
+		mkdir(CONFIG_DIRECTORY, 0777);
+		cal = fopen(file_path, "w+");
+		if(cal==0){
+			printf("could not open config directory\n");
+			return -1;
+		}
+	}
+	for(k=lo;k<=hi;k++){
+		if(count[k]==0) continue;
+		if(fprintf(cal, "%d %f %f %f %f %f %f\n", k+IMU_TEMP_MIN_C, \
+					g[k][0]-gref[0], g[k][1]-gref[1], g[k][2]-gref[2], \
+					a[k][0]-aref[0], a[k][1]-aref[1], a[k][2]-aref[2])<0){
+			printf("Failed to write imu temperature calibration\n");
+			fclose(cal);
+			return -1;
+		}
+	}
+	fclose(cal);
+	printf("calibrated %dC to %dC\n", lo+IMU_TEMP_MIN_C, hi+IMU_TEMP_MIN_C);
+	return 0;
+}
+
 /*******************************************************************************
 * unsigned short inv_row_2_scale(signed char row[])
 *
@@ -2339,7 +4267,7 @@ void print_orientation_info(){
 * was_last_read_successful() to see if the data was updated or not.
 *******************************************************************************/
 int was_last_read_successful(){
-	return last_read_successful;
+	return mpu->last_read_successful;
 }
 
 /*******************************************************************************
@@ -2353,64 +4281,340 @@ int was_last_read_successful(){
 * function.
 *******************************************************************************/
 uint64_t micros_since_last_interrupt(){
-	return micros_since_epoch() - last_interrupt_timestamp_micros;
+	return micros_since_boot() - mpu->last_interrupt_timestamp_micros;
 }
 
 /*******************************************************************************
-* int write_mag_cal_to_disk(float offsets[3], float scale[3])
+* int replay_imu_record(const log_imu_record_t* r, uint64_t timestamp_micros)
 *
-* Reads steady state gyro offsets from the disk and puts them in the IMU's 
-* gyro offset register. If no calibration file exists then make a new one.
+* Called from the replay thread in place of imu_interrupt_handler reading the
+* FIFO. Fills in the user's data struct, publishes the sample and runs the
+* user's interrupt function just as a real interrupt would.
 *******************************************************************************/
-int write_mag_cal_to_disk(float offsets[3], float scale[3]){
-	FILE *cal;
-	char file_path[100];
-	int ret;
+int replay_imu_record(const log_imu_record_t* r, uint64_t timestamp_micros){
+	mpu = &onboard_imu; // logs only ever hold the on-board IMU
+	if(!mpu->imu_replay_en) return -1;
+	memcpy(mpu->data_ptr->accel, r->accel, sizeof(r->accel));
+	memcpy(mpu->data_ptr->gyro, r->gyro, sizeof(r->gyro));
+	memcpy(mpu->data_ptr->mag, r->mag, sizeof(r->mag));
+	mpu->data_ptr->temp = r->temp;
+	memcpy(mpu->data_ptr->dmp_quat, r->dmp_quat, sizeof(r->dmp_quat));
+	memcpy(mpu->data_ptr->dmp_TaitBryan, r->dmp_TaitBryan, \
+											sizeof(r->dmp_TaitBryan));
+	memcpy(mpu->data_ptr->fused_quat, r->fused_quat, sizeof(r->fused_quat));
+	memcpy(mpu->data_ptr->fused_TaitBryan, r->fused_TaitBryan, \
+												sizeof(r->fused_TaitBryan));
+	mpu->data_ptr->compass_heading = r->compass_heading;
+	mpu->data_ptr->compass_heading_raw = r->compass_heading_raw;
+	mpu->last_interrupt_timestamp_micros = timestamp_micros;
+	mpu->last_read_successful = 1;
+	publish_imu_sample(mpu->data_ptr, timestamp_micros);
+	if(mpu->interrupt_func_set) run_imu_callback(timestamp_micros);
+	return 0;
+}
+
+/*******************************************************************************
+* int get_replayed_imu_rate()
+*
+* DMP sample rate the on-board IMU was initialized with for replay or
+* simulation, -1 if it's reading the chip or not initialized.
+*******************************************************************************/
+int get_replayed_imu_rate(){
+	if(!onboard_imu.imu_replay_en) return -1;
+	return onboard_imu.config.dmp_sample_rate;
+}
+
+/*******************************************************************************
+* void publish_imu_sample(imu_data_t* data, uint64_t timestamp_micros)
+*
+* Copies a freshly read sample into the next slot of the sample ring. Only 
+* ever called from the imu interrupt or fifo stream thread so there is a single
+* writer. The slot's lock counter is odd while the copy is in progress so 
+* readers can detect and retry torn reads without ever blocking this thread.
+*******************************************************************************/
+void publish_imu_sample(imu_data_t* data, uint64_t timestamp_micros){
+	uint64_t seq = mpu->newest_imu_sample_seq + 1;
+	imu_sample_slot_t* slot = \
+				&mpu->imu_sample_ring[seq&(IMU_SAMPLE_RING_LEN-1)];
+	
+	slot->lock++;
+	__sync_synchronize();
+	slot->sample.seq = seq;
+	slot->sample.timestamp_micros = timestamp_micros;
+	slot->sample.data = *data;
+	__sync_synchronize();
+	slot->lock++;
+	
+	// only now let readers know the sample exists
+	__sync_synchronize();
+	mpu->newest_imu_sample_seq = seq;
+	
+	// the sensor hub, logger, telemetry and vertical estimator use one IMU,
+	// the on-board one
+	if(mpu!=&onboard_imu) return;
+	if(get_sensor_hub_sources()) hub_publish_imu_sample(&slot->sample);
+	if(get_logger_sources()&LOG_SOURCE_IMU){
+		log_imu_data(data, timestamp_micros);
+	}
+	if(get_telemetry_sources()&LOG_SOURCE_IMU){
+		telemetry_imu_data(data, timestamp_micros);
+	}
+	vertical_estimator_imu_sample(data, timestamp_micros);
+}
+
+/*******************************************************************************
+* int read_imu_sample_slot(uint64_t seq, imu_sample_t* sample)
+*
+* Copies sample number seq out of the ring. Returns 0 on success, 1 if that
+* sample has already been overwritten, and -1 if a consistent copy could not
+* be made in IMU_SAMPLE_READ_TRIES attempts.
+*******************************************************************************/
+int read_imu_sample_slot(uint64_t seq, imu_sample_t* sample){
+	int i;
+	uint32_t before, after;
+	imu_sample_slot_t* slot = \
+				&mpu->imu_sample_ring[seq&(IMU_SAMPLE_RING_LEN-1)];
+	
+	for(i=0;i<IMU_SAMPLE_READ_TRIES;i++){
+		before = slot->lock;
+		if(before&1) continue; // writer in progress
+		__sync_synchronize();
+		*sample = slot->sample;
+		__sync_synchronize();
+		after = slot->lock;
+		if(before!=after) continue;
+		if(sample->seq!=seq) return 1;
+		return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int get_latest_imu_sample(imu_sample_t* sample)
+*
+* Fills in the most recent DMP sample with its sequence number and interrupt
+* timestamp. Safe to call from any thread at any time. Returns 0 on success or
+* -1 if no samples have been read yet.
+*******************************************************************************/
+int get_latest_imu_sample(imu_sample_t* sample){
+	uint64_t seq;
+	int i;
 	
-	// construct a new file path string and open for writing
-	strcpy(file_path, CONFIG_DIRECTORY);
-	strcat(file_path, MAG_CAL_FILE);
-	cal = fopen(file_path, "w+");
-	// if opening for writing failed, the directory may not exist yet
-	if (cal == 0) {
-		mkdir(CONFIG_DIRECTORY, 0777);
-		cal = fopen(file_path, "w+");
-		if (cal == 0){
-			printf("could not open config directory\n");
-			printf(CONFIG_DIRECTORY);
-			printf("\n");
-			return -1;
-		}
+	for(i=0;i<IMU_SAMPLE_READ_TRIES;i++){
+		seq = mpu->newest_imu_sample_seq;
+		if(seq==0) return -1;
+		__sync_synchronize();
+		if(read_imu_sample_slot(seq, sample)==0) return 0;
 	}
+	return -1;
+}
+
+/*******************************************************************************
+* int get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max)
+*
+* Copies up to max samples newer than sequence number seq into buf, oldest 
+* first. Pass 0 to get everything still held in the ring, then pass the seq of
+* the last sample received on subsequent calls. If the caller fell more than
+* IMU_SAMPLE_RING_LEN samples behind, the oldest ones are lost and the gap
+* shows up in the returned sequence numbers. Returns number of samples copied.
+*******************************************************************************/
+int get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max){
+	uint64_t newest, next;
+	int n = 0;
 	
-	// write to the file, close, and exit
-	ret = fprintf(cal,"%f\n%f\n%f\n%f\n%f\n%f\n", 	offsets[0],\
-													offsets[1],\
-													offsets[2],\
-													scale[0],\
-													scale[1],\
-													scale[2]);
-	if(ret<0){
-		printf("Failed to write mag calibration to file\n");
-		fclose(cal);
+	if(max<1){
+		printf("ERROR: in get_imu_samples_since, max must be >=1\n");
 		return -1;
 	}
-	fclose(cal);
-	return 0;	
+	newest = mpu->newest_imu_sample_seq;
+	__sync_synchronize();
+	
+	// skip ahead past samples that have already been overwritten
+	next = seq+1;
+	if(newest>=IMU_SAMPLE_RING_LEN && next<=newest-IMU_SAMPLE_RING_LEN){
+		next = newest-IMU_SAMPLE_RING_LEN+1;
+	}
+	while(next<=newest && n<max){
+		// a return of 1 means the writer lapped us, just move on
+		if(read_imu_sample_slot(next, &buf[n])==0) n++;
+		next++;
+	}
+	return n;
+}
+
+/*******************************************************************************
+* void clear_imu_timing(uint32_t budget_us)
+*
+* Zeroes the histograms. Only called while no handler thread is running or
+* from the handler itself so it doesn't need the lock.
+*******************************************************************************/
+void clear_imu_timing(uint32_t budget_us){
+	int i;
+	mpu->imu_timing_lock++;
+	__sync_synchronize();
+	memset(&mpu->imu_timing, 0, sizeof(mpu->imu_timing));
+	for(i=0;i<IMU_TIMING_CHANNELS;i++){
+		mpu->imu_timing.channel[i].min_us = UINT32_MAX;
+	}
+	mpu->imu_timing.budget_us = budget_us;
+	__sync_synchronize();
+	mpu->imu_timing_lock++;
+	mpu->imu_timing_prev_timestamp = 0;
+	mpu->imu_timing_reset_requested = 0;
+}
+
+/*******************************************************************************
+* void record_imu_timing(uint32_t* us, int mask)
+*
+* Adds one handler pass to the histograms. us holds a time for every channel
+* and mask says which of them were measured this pass. Bin k counts times from
+* 2^k to 2^(k+1) microseconds with bin 0 also taking 0 and the last bin taking
+* everything above. Called only by the handler thread.
+*******************************************************************************/
+void record_imu_timing(uint32_t* us, int mask){
+	imu_timing_hist_t* h;
+	int i, bin;
 	
+	if(mpu->imu_timing_reset_requested){
+		clear_imu_timing(mpu->imu_timing.budget_us);
+	}
+	mpu->imu_timing_lock++;
+	__sync_synchronize();
+	for(i=0;i<IMU_TIMING_CHANNELS;i++){
+		if(!(mask&(1<<i))) continue;
+		h = &mpu->imu_timing.channel[i];
+		bin = (us[i]<2) ? 0 : 31-__builtin_clz(us[i]);
+		if(bin>=IMU_TIMING_BINS) bin = IMU_TIMING_BINS-1;
+		h->bins[bin]++;
+		h->count++;
+		h->sum_us += us[i];
+		if(us[i]<h->min_us) h->min_us = us[i];
+		if(us[i]>h->max_us) h->max_us = us[i];
+	}
+	if((mask&(1<<IMU_TIMING_TOTAL)) && \
+					us[IMU_TIMING_TOTAL]>mpu->imu_timing.budget_us){
+		mpu->imu_timing.overruns++;
+		metric_add(METRIC_IMU_BUDGET_OVERRUNS, 1);
+	}
+	__sync_synchronize();
+	mpu->imu_timing_lock++;
+}
+
+/*******************************************************************************
+* int get_imu_timing_stats(imu_timing_stats_t* stats)
+*
+* Copies the histograms without blocking the handler, retrying if it caught
+* the handler mid-update. Returns 0 on success, -1 if no consistent copy 
+* could be made.
+*******************************************************************************/
+int get_imu_timing_stats(imu_timing_stats_t* stats){
+	uint32_t lock;
+	int i;
+	
+	if(stats==NULL) return -1;
+	for(i=0;i<IMU_TIMING_READ_TRIES;i++){
+		lock = mpu->imu_timing_lock;
+		if(lock&1) continue;
+		__sync_synchronize();
+		*stats = mpu->imu_timing;
+		__sync_synchronize();
+		if(mpu->imu_timing_lock==lock) return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int reset_imu_timing_stats()
+*
+* Asks the handler to zero the histograms before its next pass so it stays
+* the only writer.
+*******************************************************************************/
+int reset_imu_timing_stats(){
+	mpu->imu_timing_reset_requested = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int print_imu_timing_stats()
+*
+* One line per channel with count, min, mean and max in microseconds followed
+* by the non-empty histogram bins.
+*******************************************************************************/
+int print_imu_timing_stats(){
+	const char* names[IMU_TIMING_CHANNELS] = \
+			{"period", "wake", "i2c read", "fusion", "callback", "total"};
+	imu_timing_stats_t stats;
+	imu_timing_hist_t* h;
+	int i, j;
+	
+	if(get_imu_timing_stats(&stats)<0){
+		printf("ERROR: couldn't copy imu timing stats\n");
+		return -1;
+	}
+	printf("imu timing, budget %uus, %llu overruns\n", stats.budget_us, \
+									(unsigned long long)stats.overruns);
+	printf("channel     count      min     mean      max (us)\n");
+	for(i=0;i<IMU_TIMING_CHANNELS;i++){
+		h = &stats.channel[i];
+		if(h->count==0){
+			printf("%-9s %7d\n", names[i], 0);
+			continue;
+		}
+		printf("%-9s %7llu %8u %8llu %8u   ", names[i], \
+				(unsigned long long)h->count, h->min_us, \
+				(unsigned long long)(h->sum_us/h->count), h->max_us);
+		for(j=0;j<IMU_TIMING_BINS;j++){
+			if(h->bins[j]==0) continue;
+			if(j==IMU_TIMING_BINS-1) printf(" >=%u:%u", 1u<<j, h->bins[j]);
+			else printf(" <%u:%u", 2u<<j, h->bins[j]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int write_mag_cal_to_disk(float offsets[3], float scale[3])
+*
+* Saves the magnetometer offsets and scales in the calibration store.
+*******************************************************************************/
+int write_mag_cal_to_disk(float offsets[3], float scale[3]){
+	if(cal_store_set_mag(offsets, scale)<0){
+		printf("Failed to write mag calibration to disk\n");
+		return -1;
+	}
+	return 0;
 }
 
 /*******************************************************************************
 * int load_mag_calibration()
 *
-* Loads steady state magnetometer offsets and scale from the disk into global
-* variables for correction later by read_magnetometer and FIFO read functions
+* Loads steady state magnetometer offsets and scale from the calibration store
+* into global variables for correction later by read_magnetometer and FIFO 
+* read functions. A calibration only found in the old text file is copied
+* into the store.
 *******************************************************************************/
 int load_mag_calibration(){
 	FILE *cal;
 	char file_path[100];
 	float x,y,z,sx,sy,sz;
 	
+	// only the on-board IMU has a calibration, others go uncorrected
+	if(mpu!=&onboard_imu){
+		mpu->mag_offsets[0]=0.0;
+		mpu->mag_offsets[1]=0.0;
+		mpu->mag_offsets[2]=0.0;
+		mpu->mag_scales[0]=1.0;
+		mpu->mag_scales[1]=1.0;
+		mpu->mag_scales[2]=1.0;
+		update_mag_correction();
+		return 0;
+	}
+	if(cal_store_get_mag(mpu->mag_offsets, mpu->mag_scales)==0){
+		update_mag_correction();
+		return 0;
+	}
+
 	// construct a new file path string and open for reading
 	strcpy (file_path, CONFIG_DIRECTORY);
 	strcat (file_path, MAG_CAL_FILE);
@@ -2420,30 +4624,32 @@ int load_mag_calibration(){
 		// calibration file doesn't exist yet
 		printf("WARNING: no magnetometer calibration data found\n");
 		printf("Please run calibrate_mag\n\n");
-		mag_offsets[0]=0.0;
-		mag_offsets[1]=0.0;
-		mag_offsets[2]=0.0;
-		mag_scales[0]=1.0;
-		mag_scales[1]=1.0;
-		mag_scales[2]=1.0;
+		mpu->mag_offsets[0]=0.0;
+		mpu->mag_offsets[1]=0.0;
+		mpu->mag_offsets[2]=0.0;
+		mpu->mag_scales[0]=1.0;
+		mpu->mag_scales[1]=1.0;
+		mpu->mag_scales[2]=1.0;
+		update_mag_correction();
 		return -1;
 	}
 	// read in data
 	fscanf(cal,"%f\n%f\n%f\n%f\n%f\n%f\n", &x,&y,&z,&sx,&sy,&sz);
+	fclose(cal);
 		
 	#ifdef DEBUG
 	printf("magcal: %f %f %f %f %f %f\n", x,y,z,sx,sy,sz);
 	#endif
 	
 	// write to global variables fo use by read_mag_data
-	mag_offsets[0]=x;
-	mag_offsets[1]=y;
-	mag_offsets[2]=z;
-	mag_scales[0]=sx;
-	mag_scales[1]=sy;
-	mag_scales[2]=sz;
-
-	fclose(cal);
+	mpu->mag_offsets[0]=x;
+	mpu->mag_offsets[1]=y;
+	mpu->mag_offsets[2]=z;
+	mpu->mag_scales[0]=sx;
+	mpu->mag_scales[1]=sy;
+	mpu->mag_scales[2]=sz;
+	update_mag_correction();
+	cal_store_set_mag(mpu->mag_offsets, mpu->mag_scales);
 	return 0;	
 }
 
@@ -2463,19 +4669,23 @@ int calibrate_mag_routine(){
 	uint8_t c;
 	float new_scale[3];
 	imu_data_t imu_data; // to collect magnetometer data
-	config = get_default_imu_config();
-	config.enable_magnetometer = 1;
+	if(mpu!=&onboard_imu){
+		printf("ERROR: only the on-board IMU can be calibrated\n");
+		return -1;
+	}
+	mpu->config = get_default_imu_config();
+	mpu->config.enable_magnetometer = 1;
 	
 	// make sure the bus is not currently in use by another thread
 	// do not proceed to prevent interfering with that process
-	if(i2c_get_in_use_state(IMU_BUS)){
+	if(mpu_bus_in_use()){
 		printf("i2c bus claimed by another process\n");
 		printf("aborting gyro calibration()\n");
 		return -1;
 	}
 	
 	// if it is not claimed, start the i2c bus
-	if(i2c_init(IMU_BUS, IMU_ADDR)){
+	if(mpu_init_bus()){
 		printf("initialize_imu_dmp failed at i2c_init\n");
 		return -1;
 	}
@@ -2483,7 +4693,7 @@ int calibrate_mag_routine(){
 	// claiming the bus does no guarantee other code will not interfere 
 	// with this process, but best to claim it so other code can check
 	// like we did above
-	i2c_claim_bus(IMU_BUS);
+	mpu_claim_bus();
 	
 	// reset device, reset all registers
 	if(reset_mpu9250()<0){
@@ -2491,31 +4701,33 @@ int calibrate_mag_routine(){
 		return -1;
 	}
 	//check the who am i register to make sure the chip is alive
-	if(i2c_read_byte(IMU_BUS, WHO_AM_I_MPU9250, &c)<0){
+	if(mpu_read_byte(WHO_AM_I_MPU9250, &c)<0){
 		printf("Reading WHO_AM_I_MPU9250 register failed\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(c!=0x71){
 		printf("mpu9250 WHO AM I register should return 0x71\n");
 		printf("WHO AM I returned: 0x%x\n", c);
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	if(initialize_magnetometer()){
 		printf("ERROR: failed to initialize_magnetometer\n");
-		i2c_release_bus(IMU_BUS);
+		mpu_release_bus();
 		return -1;
 	}
 	
 	// set local calibration to initial values and prepare variables
-	mag_offsets[0] = 0.0;
-	mag_offsets[1] = 0.0;
-	mag_offsets[2] = 0.0;
-	mag_scales[0]  = 1.0;
-	mag_scales[1]  = 1.0;
-	mag_scales[2]  = 1.0;
-	matrix_t A = create_matrix(samples,3);
+	mpu->mag_offsets[0] = 0.0;
+	mpu->mag_offsets[1] = 0.0;
+	mpu->mag_offsets[2] = 0.0;
+	mpu->mag_scales[0]  = 1.0;
+	mpu->mag_scales[1]  = 1.0;
+	mpu->mag_scales[2]  = 1.0;
+	update_mag_correction();
+	ellipsoid_fit_t fit;
+	init_ellipsoid_fit(&fit, 0, 1.0f);
 	i = 0;
 		
 	// sample data
@@ -2529,10 +4741,9 @@ int calibrate_mag_routine(){
 			printf("ERROR: retreived all zeros from magnetometer\n");
 			break;	
 		}
-		// save data to matrix for ellipse fitting
-		A.data[i][0] = imu_data.mag[0];
-		A.data[i][1] = imu_data.mag[1];
-		A.data[i][2] = imu_data.mag[2];
+		// add to the fit as we go, nothing is kept
+		ellipsoid_fit_add_point(&fit, imu_data.mag[0], imu_data.mag[1], \
+														imu_data.mag[2]);
 		i++;
 		
 		// print "keep going" every 4 seconds
@@ -2549,7 +4760,7 @@ int calibrate_mag_routine(){
 	
 	// done with I2C for now
 	power_off_imu();
-	i2c_release_bus(IMU_BUS);
+	mpu_release_bus();
 	
 	printf("\n\nOkay Stop!\n");
 	printf("Calculating calibration constants.....\n");
@@ -2562,49 +4773,42 @@ int calibrate_mag_routine(){
 		return -1;
 	}
 	
-	// make empty vectors for ellipsoid fitting to populate
-	vector_t center,lengths;
- 	if(fit_ellipsoid(A,&center,&lengths)<0){
+	// arrays for the ellipsoid fit to populate
+	float center[3], lengths[3];
+ 	if(solve_ellipsoid_fit(&fit, center, lengths, NULL)<0){
  		printf("failed to fit ellipsoid to magnetometer data\n");
- 		destroy_matrix(&A);
  		return -1;
  	}
- 	destroy_matrix(&A); // empty memory, we are done with A
  	
  	// do some sanity checks to make sure data is reasonable
- 	if(fabs(center.data[0])>200 || fabs(center.data[1])>200 || \
- 											fabs(center.data[2])>200){
+ 	if(fabs(center[0])>200 || fabs(center[1])>200 || fabs(center[2])>200){
  		printf("ERROR: center of fitted ellipsoid out of bounds\n");
- 		destroy_vector(&center);
- 		destroy_vector(&lengths);
  		return -1;
  	}
- 	if(lengths.data[0]>200 || lengths.data[0]<5 || \
- 	   lengths.data[1]>200 || lengths.data[1]<5 || \
- 	   lengths.data[2]>200 || lengths.data[2]<5){
+ 	if(lengths[0]>200 || lengths[0]<5 || \
+ 	   lengths[1]>200 || lengths[1]<5 || \
+ 	   lengths[2]>200 || lengths[2]<5){
  		printf("ERROR: length of fitted ellipsoid out of bounds\n");
- 		destroy_vector(&center);
- 		destroy_vector(&lengths);
  		return -1;
  	}
  	
 	// all seems well, calculate scaling factors to map ellipse lengths to
 	// a sphere of radius 70uT, this scale will later be multiplied by the
 	// factory corrected data
-	new_scale[0] = 70.0/lengths.data[0];
-	new_scale[1] = 70.0/lengths.data[1];
-	new_scale[2] = 70.0/lengths.data[2];
+	new_scale[0] = 70.0/lengths[0];
+	new_scale[1] = 70.0/lengths[1];
+	new_scale[2] = 70.0/lengths[2];
 	
 	printf("\n");
-	printf("Offsets X: %7.3f Y: %7.3f Z: %7.3f\n", 	center.data[0],\
-													center.data[1],\
-													center.data[2]);
+	printf("Offsets X: %7.3f Y: %7.3f Z: %7.3f\n", 	center[0],\
+													center[1],\
+													center[2]);
 	printf("Scales  X: %7.3f Y: %7.3f Z: %7.3f\n", 	new_scale[0],\
 													new_scale[1],\
 													new_scale[2]);
 	
 	// write to disk
-	if(write_mag_cal_to_disk(center.data,new_scale)<0){
+	if(write_mag_cal_to_disk(center,new_scale)<0){
 		return -1;
 	}
 	return 0;
@@ -2612,3 +4816,12 @@ int calibrate_mag_routine(){
 
 
 // Phew, that was a lot of code....
+
+/*******************************************************************************
+* void trace_imu_point(trace_point_t p)
+*
+* The latency trace follows the on-board IMU only.
+*******************************************************************************/
+void trace_imu_point(trace_point_t p){
+	if(mpu==&onboard_imu) trace_point(p);
+}
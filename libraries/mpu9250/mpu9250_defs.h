@@ -245,6 +245,12 @@ identical but the latter has a different register map
 #define I2C_MST_RST			0x01<<1
 #define SIG_COND_RST			0x01
 
+/*******************************************************************
+* I2C_MST_STATUS bits
+*******************************************************************/
+#define I2C_SLV4_DONE		0x01<<6
+#define I2C_SLV4_NACK		0x01<<4
+
 
 
 
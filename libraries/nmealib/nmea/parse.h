@@ -20,6 +20,9 @@ extern "C" {
 int nmea_pack_type(const char *buff, int buff_sz);
 int nmea_find_tail(const char *buff, int buff_sz, int *res_crc);
 
+int nmea_parse_pack(int type, const char *buff, int buff_sz, void *pack);
+void nmea_pack2info(int type, void *pack, nmeaINFO *info);
+
 int nmea_parse_GPGGA(const char *buff, int buff_sz, nmeaGPGGA *pack);
 int nmea_parse_GPGSA(const char *buff, int buff_sz, nmeaGPGSA *pack);
 int nmea_parse_GPGSV(const char *buff, int buff_sz, nmeaGPGSV *pack);
@@ -21,10 +21,21 @@ extern "C" {
  * high level
  */
 
+/**
+ * Packets parsed but not yet popped, the oldest is dropped beyond this
+ */
+#ifdef RC_SMALL_MEMORY
+#   define NMEA_PARSER_SLOTS    (8)
+#else
+#   define NMEA_PARSER_SLOTS    (32)
+#endif
+
 typedef struct _nmeaPARSER
 {
     void *top_node;
     void *end_node;
+    void *slots;        /**< NMEA_PARSER_SLOTS nodes allocated at init */
+    void *free_node;    /**< unused slots, linked through next_node */
     unsigned char *buffer;
     int buff_size;
     int buff_use;
@@ -44,6 +55,12 @@ int     nmea_parse(
  * low level
  */
 
+/**
+ * nmea_parser_pop and nmea_parser_peek hand out the parser's own slot, which
+ * is reused by a later push and must not be freed. Code written for the
+ * earlier malloc'd packets can build with NMEA_PARSER_POP_ALLOC defined to
+ * get a copy from nmea_parser_pop that it frees as before.
+ */
 int     nmea_parser_push(nmeaPARSER *parser, const char *buff, int buff_sz);
 int     nmea_parser_top(nmeaPARSER *parser);
 int     nmea_parser_pop(nmeaPARSER *parser, void **pack_ptr);
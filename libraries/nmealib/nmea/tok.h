@@ -17,11 +17,22 @@
 extern "C" {
 #endif
 
+/**
+ * One field of a sentence as split by nmea_split_fields, not terminated
+ */
+typedef struct _nmeaFIELD
+{
+    const char *str;
+    int sz;
+
+} nmeaFIELD;
+
 int     nmea_calc_crc(const char *buff, int buff_sz);
 int     nmea_atoi(const char *str, int str_sz, int radix);
 double  nmea_atof(const char *str, int str_sz);
 int     nmea_printf(char *buff, int buff_sz, const char *format, ...);
 int     nmea_scanf(const char *buff, int buff_sz, const char *format, ...);
+int     nmea_split_fields(const char *buff, int buff_sz, nmeaFIELD *fields, int max_fields);
 
 #ifdef  __cplusplus
 }
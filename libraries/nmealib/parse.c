@@ -13,43 +13,22 @@
  * \brief Functions of a low level for analysis of
  * packages of NMEA stream.
  *
+ * Sentences are split into fields once with nmea_split_fields and each
+ * field is converted straight from the receive buffer. nmea_scanf is left
+ * for other users but the parsers here don't go through its format strings.
+ *
  * \code
  * ...
  * ptype = nmea_pack_type(
  *     (const char *)parser->buffer + nparsed + 1,
  *     parser->buff_use - nparsed - 1);
  * 
- * if(0 == (node = malloc(sizeof(nmeaParserNODE))))
- *     goto mem_fail;
- * 
- * node->pack = 0;
- * 
- * switch(ptype)
+ * if(GPNON != ptype && !nmea_parse_pack(ptype,
+ *     (const char *)parser->buffer + nparsed,
+ *     sen_sz, &node->pack))
  * {
- * case GPGGA:
- *     if(0 == (node->pack = malloc(sizeof(nmeaGPGGA))))
- *         goto mem_fail;
- *     node->packType = GPGGA;
- *     if(!nmea_parse_GPGGA(
- *         (const char *)parser->buffer + nparsed,
- *         sen_sz, (nmeaGPGGA *)node->pack))
- *     {
- *         free(node);
- *         node = 0;
- *     }
- *     break;
- * case GPGSA:
- *     if(0 == (node->pack = malloc(sizeof(nmeaGPGSA))))
- *         goto mem_fail;
- *     node->packType = GPGSA;
- *     if(!nmea_parse_GPGSA(
- *         (const char *)parser->buffer + nparsed,
- *         sen_sz, (nmeaGPGSA *)node->pack))
- *     {
- *         free(node);
- *         node = 0;
- *     }
- *     break;
+ *     ...
+ * }
  * ...
  * \endcode
  */
@@ -63,30 +42,125 @@
 #include <string.h>
 #include <stdio.h>
 
+#define NMEA_MAXFIELDS      (24)
+
+typedef int (*nmeaPARSEFUNC)(const char *buff, int buff_sz, void *pack);
+typedef void (*nmeaINFOFUNC)(void *pack, nmeaINFO *info);
+
+/**
+ * Entry of the sentence dispatch table
+ */
+typedef struct _nmeaSENTENCE
+{
+    const char *head;   /**< Sentence type after the "GP" talker id */
+    int type;           /**< nmeaPACKTYPE */
+    nmeaPARSEFUNC parse;
+    nmeaINFOFUNC info;
+
+} nmeaSENTENCE;
+
+static const nmeaSENTENCE nmea_sentences[] = {
+    { "GGA", GPGGA, (nmeaPARSEFUNC)nmea_parse_GPGGA, (nmeaINFOFUNC)nmea_GPGGA2info },
+    { "RMC", GPRMC, (nmeaPARSEFUNC)nmea_parse_GPRMC, (nmeaINFOFUNC)nmea_GPRMC2info },
+    { "GSA", GPGSA, (nmeaPARSEFUNC)nmea_parse_GPGSA, (nmeaINFOFUNC)nmea_GPGSA2info },
+    { "GSV", GPGSV, (nmeaPARSEFUNC)nmea_parse_GPGSV, (nmeaINFOFUNC)nmea_GPGSV2info },
+    { "VTG", GPVTG, (nmeaPARSEFUNC)nmea_parse_GPVTG, (nmeaINFOFUNC)nmea_GPVTG2info },
+};
+
+#define NMEA_NSENTENCES     ((int)(sizeof(nmea_sentences) / sizeof(nmea_sentences[0])))
+
+/**
+ * \brief Dispatch table entry of a packet type, 0 if there is none
+ */
+static const nmeaSENTENCE *nmea_sentence_of(int type)
+{
+    int it;
+
+    for(it = 0; it < NMEA_NSENTENCES; ++it)
+    {
+        if(nmea_sentences[it].type == type)
+            return &nmea_sentences[it];
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Check the header field of a split sentence
+ */
+static int nmea_check_head(const nmeaFIELD *field, const char *head)
+{
+    return (5 == field->sz && 0 == memcmp(field->str, head, 5));
+}
+
+static void nmea_field_int(const nmeaFIELD *field, int *res)
+{
+    if(field->sz)
+        *res = nmea_atoi(field->str, field->sz, 10);
+}
+
+static void nmea_field_double(const nmeaFIELD *field, double *res)
+{
+    if(field->sz)
+        *res = nmea_atof(field->str, field->sz);
+}
+
+static void nmea_field_char(const nmeaFIELD *field, char *res)
+{
+    if(field->sz)
+        *res = *field->str;
+}
+
+/**
+ * \brief Read a pair of decimal digits
+ * @return 0 to 99 or -1 if either isn't a digit
+ */
+static int nmea_two_digits(const char *str)
+{
+    if(str[0] < '0' || str[0] > '9' || str[1] < '0' || str[1] > '9')
+        return -1;
+    return (str[0] - '0') * 10 + (str[1] - '0');
+}
+
+/**
+ * \brief Parse hhmmss[.s[s[s]]] into res, fractions are kept to hundredths
+ */
 int _nmea_parse_time(const char *buff, int buff_sz, nmeaTIME *res)
 {
-    int success = 0;
+    int success = 0, it, hsec = 0;
 
     switch(buff_sz)
     {
     case sizeof("hhmmss") - 1:
-        success = (3 == nmea_scanf(buff, buff_sz,
-            "%2d%2d%2d", &(res->hour), &(res->min), &(res->sec)
-            ));
-        break;
     case sizeof("hhmmss.s") - 1:
     case sizeof("hhmmss.ss") - 1:
     case sizeof("hhmmss.sss") - 1:
-        success = (4 == nmea_scanf(buff, buff_sz,
-            "%2d%2d%2d.%d", &(res->hour), &(res->min), &(res->sec), &(res->hsec)
-            ));
+        res->hour = nmea_two_digits(buff);
+        res->min = nmea_two_digits(buff + 2);
+        res->sec = nmea_two_digits(buff + 4);
+        success = (res->hour >= 0 && res->min >= 0 && res->sec >= 0);
+        if(buff_sz > 6)
+        {
+            success = success && ('.' == buff[6]);
+            for(it = 7; it < buff_sz; ++it)
+                success = success && (buff[it] >= '0' && buff[it] <= '9');
+            for(it = 7; it < 9; ++it)
+            {
+                hsec *= 10;
+                if(it < buff_sz)
+                    hsec += buff[it] - '0';
+            }
+            if(success)
+                res->hsec = hsec;
+        }
         break;
     default:
-        nmea_error("Parse of time error (format error)!");
-        success = 0;
         break;
     }
 
+    if(!success)
+        nmea_error("Parse of time error (format error)!");
+
     return (success?0:-1);        
 }
 
@@ -99,32 +173,54 @@ int _nmea_parse_time(const char *buff, int buff_sz, nmeaTIME *res)
  */
 int nmea_pack_type(const char *buff, int buff_sz)
 {
-    static const char *pheads[] = {
-        "GPGGA",
-        "GPGSA",
-        "GPGSV",
-        "GPRMC",
-        "GPVTG",
-    };
+    int it;
 
     NMEA_ASSERT(buff);
 
-    if(buff_sz < 5)
+    if(buff_sz < 5 || 'G' != buff[0] || 'P' != buff[1])
         return GPNON;
-    else if(0 == memcmp(buff, pheads[0], 5))
-        return GPGGA;
-    else if(0 == memcmp(buff, pheads[1], 5))
-        return GPGSA;
-    else if(0 == memcmp(buff, pheads[2], 5))
-        return GPGSV;
-    else if(0 == memcmp(buff, pheads[3], 5))
-        return GPRMC;
-    else if(0 == memcmp(buff, pheads[4], 5))
-        return GPVTG;
+
+    for(it = 0; it < NMEA_NSENTENCES; ++it)
+    {
+        if(0 == memcmp(buff + 2, nmea_sentences[it].head, 3))
+            return nmea_sentences[it].type;
+    }
 
     return GPNON;
 }
 
+/**
+ * \brief Parse a packet of any known type from buffer.
+ * @param type packet type from nmea_pack_type.
+ * @param buff a constant character pointer of packet buffer.
+ * @param buff_sz buffer size.
+ * @param pack a pointer of packet structure of that type.
+ * @return 1 (true) - if parsed successfully or 0 (false) - if fail.
+ */
+int nmea_parse_pack(int type, const char *buff, int buff_sz, void *pack)
+{
+    const nmeaSENTENCE *sentence = nmea_sentence_of(type);
+
+    if(!sentence)
+        return 0;
+
+    return sentence->parse(buff, buff_sz, pack);
+}
+
+/**
+ * \brief Fill nmeaINFO structure by packet data of any known type.
+ * @param type packet type.
+ * @param pack a pointer of packet structure.
+ * @param info a pointer of summary information structure.
+ */
+void nmea_pack2info(int type, void *pack, nmeaINFO *info)
+{
+    const nmeaSENTENCE *sentence = nmea_sentence_of(type);
+
+    if(sentence)
+        sentence->info(pack, info);
+}
+
 /**
  * \brief Find tail of packet ("\r\n") in buffer and check control sum (CRC).
  * @param buff a constant character pointer of packets buffer.
@@ -185,7 +281,7 @@ int nmea_find_tail(const char *buff, int buff_sz, int *res_crc)
  */
 int nmea_parse_GPGGA(const char *buff, int buff_sz, nmeaGPGGA *pack)
 {
-    char time_buff[NMEA_TIMEPARSE_BUF];
+    nmeaFIELD f[NMEA_MAXFIELDS];
 
     NMEA_ASSERT(buff && pack);
 
@@ -193,18 +289,28 @@ int nmea_parse_GPGGA(const char *buff, int buff_sz, nmeaGPGGA *pack)
 
     nmea_trace_buff(buff, buff_sz);
 
-    if(14 != nmea_scanf(buff, buff_sz,
-        "$GPGGA,%s,%f,%C,%f,%C,%d,%d,%f,%f,%C,%f,%C,%f,%d*",
-        &(time_buff[0]),
-        &(pack->lat), &(pack->ns), &(pack->lon), &(pack->ew),
-        &(pack->sig), &(pack->satinuse), &(pack->HDOP), &(pack->elv), &(pack->elv_units),
-        &(pack->diff), &(pack->diff_units), &(pack->dgps_age), &(pack->dgps_sid)))
+    if(nmea_split_fields(buff, buff_sz, f, NMEA_MAXFIELDS) < 15 ||
+        !nmea_check_head(&f[0], "GPGGA"))
     {
         nmea_error("GPGGA parse error!");
         return 0;
     }
 
-    if(0 != _nmea_parse_time(&time_buff[0], (int)strlen(&time_buff[0]), &(pack->utc)))
+    nmea_field_double(&f[2], &(pack->lat));
+    nmea_field_char(&f[3], &(pack->ns));
+    nmea_field_double(&f[4], &(pack->lon));
+    nmea_field_char(&f[5], &(pack->ew));
+    nmea_field_int(&f[6], &(pack->sig));
+    nmea_field_int(&f[7], &(pack->satinuse));
+    nmea_field_double(&f[8], &(pack->HDOP));
+    nmea_field_double(&f[9], &(pack->elv));
+    nmea_field_char(&f[10], &(pack->elv_units));
+    nmea_field_double(&f[11], &(pack->diff));
+    nmea_field_char(&f[12], &(pack->diff_units));
+    nmea_field_double(&f[13], &(pack->dgps_age));
+    nmea_field_int(&f[14], &(pack->dgps_sid));
+
+    if(0 != _nmea_parse_time(f[1].str, f[1].sz, &(pack->utc)))
     {
         nmea_error("GPGGA time parse error!");
         return 0;
@@ -222,23 +328,30 @@ int nmea_parse_GPGGA(const char *buff, int buff_sz, nmeaGPGGA *pack)
  */
 int nmea_parse_GPGSA(const char *buff, int buff_sz, nmeaGPGSA *pack)
 {
+    nmeaFIELD f[NMEA_MAXFIELDS];
+    int it;
+
     NMEA_ASSERT(buff && pack);
 
     memset(pack, 0, sizeof(nmeaGPGSA));
 
     nmea_trace_buff(buff, buff_sz);
 
-    if(17 != nmea_scanf(buff, buff_sz,
-        "$GPGSA,%C,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%f,%f,%f*",
-        &(pack->fix_mode), &(pack->fix_type),
-        &(pack->sat_prn[0]), &(pack->sat_prn[1]), &(pack->sat_prn[2]), &(pack->sat_prn[3]), &(pack->sat_prn[4]), &(pack->sat_prn[5]),
-        &(pack->sat_prn[6]), &(pack->sat_prn[7]), &(pack->sat_prn[8]), &(pack->sat_prn[9]), &(pack->sat_prn[10]), &(pack->sat_prn[11]),
-        &(pack->PDOP), &(pack->HDOP), &(pack->VDOP)))
+    if(nmea_split_fields(buff, buff_sz, f, NMEA_MAXFIELDS) < 18 ||
+        !nmea_check_head(&f[0], "GPGSA"))
     {
         nmea_error("GPGSA parse error!");
         return 0;
     }
 
+    nmea_field_char(&f[1], &(pack->fix_mode));
+    nmea_field_int(&f[2], &(pack->fix_type));
+    for(it = 0; it < NMEA_MAXSAT; ++it)
+        nmea_field_int(&f[3 + it], &(pack->sat_prn[it]));
+    nmea_field_double(&f[15], &(pack->PDOP));
+    nmea_field_double(&f[16], &(pack->HDOP));
+    nmea_field_double(&f[17], &(pack->VDOP));
+
     return 1;
 }
 
@@ -251,7 +364,8 @@ int nmea_parse_GPGSA(const char *buff, int buff_sz, nmeaGPGSA *pack)
  */
 int nmea_parse_GPGSV(const char *buff, int buff_sz, nmeaGPGSV *pack)
 {
-    int nsen, nsat;
+    nmeaFIELD f[NMEA_MAXFIELDS];
+    int nsen, nsat, it;
 
     NMEA_ASSERT(buff && pack);
 
@@ -259,17 +373,23 @@ int nmea_parse_GPGSV(const char *buff, int buff_sz, nmeaGPGSV *pack)
 
     nmea_trace_buff(buff, buff_sz);
 
-    nsen = nmea_scanf(buff, buff_sz,
-        "$GPGSV,%d,%d,%d,"
-        "%d,%d,%d,%d,"
-        "%d,%d,%d,%d,"
-        "%d,%d,%d,%d,"
-        "%d,%d,%d,%d*",
-        &(pack->pack_count), &(pack->pack_index), &(pack->sat_count),
-        &(pack->sat_data[0].id), &(pack->sat_data[0].elv), &(pack->sat_data[0].azimuth), &(pack->sat_data[0].sig),
-        &(pack->sat_data[1].id), &(pack->sat_data[1].elv), &(pack->sat_data[1].azimuth), &(pack->sat_data[1].sig),
-        &(pack->sat_data[2].id), &(pack->sat_data[2].elv), &(pack->sat_data[2].azimuth), &(pack->sat_data[2].sig),
-        &(pack->sat_data[3].id), &(pack->sat_data[3].elv), &(pack->sat_data[3].azimuth), &(pack->sat_data[3].sig));
+    nsen = nmea_split_fields(buff, buff_sz, f, NMEA_SATINPACK * 4 + 4) - 1;
+    if(nsen < 3 || !nmea_check_head(&f[0], "GPGSV"))
+    {
+        nmea_error("GPGSV parse error!");
+        return 0;
+    }
+
+    nmea_field_int(&f[1], &(pack->pack_count));
+    nmea_field_int(&f[2], &(pack->pack_index));
+    nmea_field_int(&f[3], &(pack->sat_count));
+    for(it = 0; it < NMEA_SATINPACK && 4 * it + 7 <= nsen; ++it)
+    {
+        nmea_field_int(&f[4 * it + 4], &(pack->sat_data[it].id));
+        nmea_field_int(&f[4 * it + 5], &(pack->sat_data[it].elv));
+        nmea_field_int(&f[4 * it + 6], &(pack->sat_data[it].azimuth));
+        nmea_field_int(&f[4 * it + 7], &(pack->sat_data[it].sig));
+    }
 
     nsat = (pack->pack_index - 1) * NMEA_SATINPACK;
     nsat = (nsat + NMEA_SATINPACK > pack->sat_count)?pack->sat_count - nsat:NMEA_SATINPACK;
@@ -293,8 +413,8 @@ int nmea_parse_GPGSV(const char *buff, int buff_sz, nmeaGPGSV *pack)
  */
 int nmea_parse_GPRMC(const char *buff, int buff_sz, nmeaGPRMC *pack)
 {
-    int nsen;
-    char time_buff[NMEA_TIMEPARSE_BUF];
+    nmeaFIELD f[NMEA_MAXFIELDS];
+    int nfields;
 
     NMEA_ASSERT(buff && pack);
 
@@ -302,21 +422,30 @@ int nmea_parse_GPRMC(const char *buff, int buff_sz, nmeaGPRMC *pack)
 
     nmea_trace_buff(buff, buff_sz);
 
-    nsen = nmea_scanf(buff, buff_sz,
-        "$GPRMC,%s,%C,%f,%C,%f,%C,%f,%f,%2d%2d%2d,%f,%C,%C*",
-        &(time_buff[0]),
-        &(pack->status), &(pack->lat), &(pack->ns), &(pack->lon), &(pack->ew),
-        &(pack->speed), &(pack->direction),
-        &(pack->utc.day), &(pack->utc.mon), &(pack->utc.year),
-        &(pack->declination), &(pack->declin_ew), &(pack->mode));
-
-    if(nsen != 13 && nsen != 14)
+    nfields = nmea_split_fields(buff, buff_sz, f, NMEA_MAXFIELDS);
+    if(nfields < 12 ||
+        !nmea_check_head(&f[0], "GPRMC") || 6 != f[9].sz ||
+        (pack->utc.day = nmea_two_digits(f[9].str)) < 0 ||
+        (pack->utc.mon = nmea_two_digits(f[9].str + 2)) < 0 ||
+        (pack->utc.year = nmea_two_digits(f[9].str + 4)) < 0)
     {
         nmea_error("GPRMC parse error!");
         return 0;
     }
 
-    if(0 != _nmea_parse_time(&time_buff[0], (int)strlen(&time_buff[0]), &(pack->utc)))
+    nmea_field_char(&f[2], &(pack->status));
+    nmea_field_double(&f[3], &(pack->lat));
+    nmea_field_char(&f[4], &(pack->ns));
+    nmea_field_double(&f[5], &(pack->lon));
+    nmea_field_char(&f[6], &(pack->ew));
+    nmea_field_double(&f[7], &(pack->speed));
+    nmea_field_double(&f[8], &(pack->direction));
+    nmea_field_double(&f[10], &(pack->declination));
+    nmea_field_char(&f[11], &(pack->declin_ew));
+    if(nfields > 12)
+        nmea_field_char(&f[12], &(pack->mode));
+
+    if(0 != _nmea_parse_time(f[1].str, f[1].sz, &(pack->utc)))
     {
         nmea_error("GPRMC time parse error!");
         return 0;
@@ -338,23 +467,30 @@ int nmea_parse_GPRMC(const char *buff, int buff_sz, nmeaGPRMC *pack)
  */
 int nmea_parse_GPVTG(const char *buff, int buff_sz, nmeaGPVTG *pack)
 {
+    nmeaFIELD f[NMEA_MAXFIELDS];
+
     NMEA_ASSERT(buff && pack);
 
     memset(pack, 0, sizeof(nmeaGPVTG));
 
     nmea_trace_buff(buff, buff_sz);
 
-    if(8 != nmea_scanf(buff, buff_sz,
-        "$GPVTG,%f,%C,%f,%C,%f,%C,%f,%C*",
-        &(pack->dir), &(pack->dir_t),
-        &(pack->dec), &(pack->dec_m),
-        &(pack->spn), &(pack->spn_n),
-        &(pack->spk), &(pack->spk_k)))
+    if(nmea_split_fields(buff, buff_sz, f, NMEA_MAXFIELDS) < 9 ||
+        !nmea_check_head(&f[0], "GPVTG"))
     {
         nmea_error("GPVTG parse error!");
         return 0;
     }
 
+    nmea_field_double(&f[1], &(pack->dir));
+    nmea_field_char(&f[2], &(pack->dir_t));
+    nmea_field_double(&f[3], &(pack->dec));
+    nmea_field_char(&f[4], &(pack->dec_m));
+    nmea_field_double(&f[5], &(pack->spn));
+    nmea_field_char(&f[6], &(pack->spn_n));
+    nmea_field_double(&f[7], &(pack->spk));
+    nmea_field_char(&f[8], &(pack->spk_k));
+
     if( pack->dir_t != 'T' ||
         pack->dec_m != 'M' ||
         pack->spn_n != 'N' ||
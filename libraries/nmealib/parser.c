@@ -10,6 +10,8 @@
 
 /**
  * \file parser.h
+ * Parsed packets are kept in a fixed number of slots allocated along with
+ * the buffer in nmea_parser_init, nothing is allocated per sentence.
  */
 
 #include "nmea/tok.h"
@@ -20,14 +22,81 @@
 #include <string.h>
 #include <stdlib.h>
 
+typedef union _nmeaParserPACK
+{
+    nmeaGPGGA gpgga;
+    nmeaGPGSA gpgsa;
+    nmeaGPGSV gpgsv;
+    nmeaGPRMC gprmc;
+    nmeaGPVTG gpvtg;
+
+} nmeaParserPACK;
+
 typedef struct _nmeaParserNODE
 {
     int packType;
     void *pack;
     struct _nmeaParserNODE *next_node;
+    nmeaParserPACK slot;
 
 } nmeaParserNODE;
 
+/**
+ * \brief Take a free slot, or the oldest queued packet's if none is left
+ */
+static nmeaParserNODE *nmea_parser_take_node(nmeaPARSER *parser)
+{
+    nmeaParserNODE *node = (nmeaParserNODE *)parser->free_node;
+
+    if(node)
+        parser->free_node = node->next_node;
+    else
+    {
+        nmea_error("Parser queue full, oldest packet dropped!");
+        node = (nmeaParserNODE *)parser->top_node;
+        parser->top_node = node->next_node;
+        if(!parser->top_node)
+            parser->end_node = 0;
+    }
+
+    node->pack = &node->slot;
+    node->next_node = 0;
+
+    return node;
+}
+
+/**
+ * \brief Return a slot to the free list
+ */
+static void nmea_parser_give_node(nmeaPARSER *parser, nmeaParserNODE *node)
+{
+    node->next_node = (nmeaParserNODE *)parser->free_node;
+    parser->free_node = node;
+}
+
+/**
+ * \brief Withdraw top packet, leaving it in its slot
+ */
+static int nmea_parser_pop_slot(nmeaPARSER *parser, void **pack_ptr)
+{
+    int retval = GPNON;
+    nmeaParserNODE *node = (nmeaParserNODE *)parser->top_node;
+
+    NMEA_ASSERT(parser && parser->buffer);
+
+    if(node)
+    {
+        *pack_ptr = node->pack;
+        retval = node->packType;
+        parser->top_node = node->next_node;
+        if(!parser->top_node)
+            parser->end_node = 0;
+        nmea_parser_give_node(parser, node);
+    }
+
+    return retval;
+}
+
 /*
  * high level
  */
@@ -38,8 +107,9 @@ typedef struct _nmeaParserNODE
  */
 int nmea_parser_init(nmeaPARSER *parser)
 {
-    int resv = 0;
+    int resv = 0, it;
     int buff_size = nmea_property()->parse_buff_size;
+    nmeaParserNODE *slots;
 
     NMEA_ASSERT(parser);
 
@@ -50,8 +120,17 @@ int nmea_parser_init(nmeaPARSER *parser)
 
     if(0 == (parser->buffer = malloc(buff_size)))
         nmea_error("Insufficient memory!");
+    else if(0 == (slots = malloc(NMEA_PARSER_SLOTS * sizeof(nmeaParserNODE))))
+    {
+        free(parser->buffer);
+        parser->buffer = 0;
+        nmea_error("Insufficient memory!");
+    }
     else
     {
+        parser->slots = slots;
+        for(it = 0; it < NMEA_PARSER_SLOTS; ++it)
+            nmea_parser_give_node(parser, &slots[it]);
         parser->buff_size = buff_size;
         resv = 1;
     }    
@@ -66,7 +145,7 @@ void nmea_parser_destroy(nmeaPARSER *parser)
 {
     NMEA_ASSERT(parser && parser->buffer);
     free(parser->buffer);
-    nmea_parser_queue_clear(parser);
+    free(parser->slots);
     memset(parser, 0, sizeof(nmeaPARSER));
 }
 
@@ -87,30 +166,10 @@ int nmea_parse(
 
     nmea_parser_push(parser, buff, buff_sz);
 
-    while(GPNON != (ptype = nmea_parser_pop(parser, &pack)))
+    while(GPNON != (ptype = nmea_parser_pop_slot(parser, &pack)))
     {
         nread++;
-
-        switch(ptype)
-        {
-        case GPGGA:
-            nmea_GPGGA2info((nmeaGPGGA *)pack, info);
-            break;
-        case GPGSA:
-            nmea_GPGSA2info((nmeaGPGSA *)pack, info);
-            break;
-        case GPGSV:
-            nmea_GPGSV2info((nmeaGPGSV *)pack, info);
-            break;
-        case GPRMC:
-            nmea_GPRMC2info((nmeaGPRMC *)pack, info);
-            break;
-        case GPVTG:
-            nmea_GPVTG2info((nmeaGPVTG *)pack, info);
-            break;
-        };
-
-        free(pack);
+        nmea_pack2info(ptype, pack, info);
     }
 
     return nread;
@@ -164,78 +223,18 @@ int nmea_parser_real_push(nmeaPARSER *parser, const char *buff, int buff_sz)
                 (const char *)parser->buffer + nparsed + 1,
                 parser->buff_use - nparsed - 1);
 
-            if(0 == (node = malloc(sizeof(nmeaParserNODE))))
-                goto mem_fail;
-
-            node->pack = 0;
-
-            switch(ptype)
+            if(GPNON != ptype)
             {
-            case GPGGA:
-                if(0 == (node->pack = malloc(sizeof(nmeaGPGGA))))
-                    goto mem_fail;
-                node->packType = GPGGA;
-                if(!nmea_parse_GPGGA(
-                    (const char *)parser->buffer + nparsed,
-                    sen_sz, (nmeaGPGGA *)node->pack))
-                {
-                    free(node);
-                    node = 0;
-                }
-                break;
-            case GPGSA:
-                if(0 == (node->pack = malloc(sizeof(nmeaGPGSA))))
-                    goto mem_fail;
-                node->packType = GPGSA;
-                if(!nmea_parse_GPGSA(
-                    (const char *)parser->buffer + nparsed,
-                    sen_sz, (nmeaGPGSA *)node->pack))
-                {
-                    free(node);
-                    node = 0;
-                }
-                break;
-            case GPGSV:
-                if(0 == (node->pack = malloc(sizeof(nmeaGPGSV))))
-                    goto mem_fail;
-                node->packType = GPGSV;
-                if(!nmea_parse_GPGSV(
-                    (const char *)parser->buffer + nparsed,
-                    sen_sz, (nmeaGPGSV *)node->pack))
-                {
-                    free(node);
-                    node = 0;
-                }
-                break;
-            case GPRMC:
-                if(0 == (node->pack = malloc(sizeof(nmeaGPRMC))))
-                    goto mem_fail;
-                node->packType = GPRMC;
-                if(!nmea_parse_GPRMC(
+                node = nmea_parser_take_node(parser);
+                node->packType = ptype;
+                if(!nmea_parse_pack(ptype,
                     (const char *)parser->buffer + nparsed,
-                    sen_sz, (nmeaGPRMC *)node->pack))
+                    sen_sz, node->pack))
                 {
-                    free(node);
+                    nmea_parser_give_node(parser, node);
                     node = 0;
                 }
-                break;
-            case GPVTG:
-                if(0 == (node->pack = malloc(sizeof(nmeaGPVTG))))
-                    goto mem_fail;
-                node->packType = GPVTG;
-                if(!nmea_parse_GPVTG(
-                    (const char *)parser->buffer + nparsed,
-                    sen_sz, (nmeaGPVTG *)node->pack))
-                {
-                    free(node);
-                    node = 0;
-                }
-                break;
-            default:
-                free(node);
-                node = 0;
-                break;
-            };
+            }
 
             if(node)
             {
@@ -244,7 +243,6 @@ int nmea_parser_real_push(nmeaPARSER *parser, const char *buff, int buff_sz)
                 parser->end_node = node;
                 if(!parser->top_node)
                     parser->top_node = node;
-                node->next_node = 0;
             }
         }
 
@@ -252,14 +250,6 @@ int nmea_parser_real_push(nmeaPARSER *parser, const char *buff, int buff_sz)
     }
 
     return nparsed;
-
-mem_fail:
-    if(node)
-        free(node);
-
-    nmea_error("Insufficient memory!");
-
-    return -1;
 }
 
 /**
@@ -307,27 +297,32 @@ int nmea_parser_top(nmeaPARSER *parser)
 
 /**
  * \brief Withdraw top packet from parser
+ * The packet stays in the parser's slot, it must not be freed and is only
+ * valid until the next push. With NMEA_PARSER_POP_ALLOC it is a malloc'd
+ * copy the caller frees, as in earlier nmealib releases.
  * @return Received packet type
  * @see nmeaPACKTYPE
  */
 int nmea_parser_pop(nmeaPARSER *parser, void **pack_ptr)
 {
-    int retval = GPNON;
-    nmeaParserNODE *node = (nmeaParserNODE *)parser->top_node;
-
-    NMEA_ASSERT(parser && parser->buffer);
+#ifdef NMEA_PARSER_POP_ALLOC
+    void *pack = 0;
+    int retval = nmea_parser_pop_slot(parser, &pack);
 
-    if(node)
+    if(GPNON != retval)
     {
-        *pack_ptr = node->pack;
-        retval = node->packType;
-        parser->top_node = node->next_node;
-        if(!parser->top_node)
-            parser->end_node = 0;
-        free(node);
+        if(0 == (*pack_ptr = malloc(sizeof(nmeaParserPACK))))
+        {
+            nmea_error("Insufficient memory!");
+            return GPNON;
+        }
+        memcpy(*pack_ptr, pack, sizeof(nmeaParserPACK));
     }
 
     return retval;
+#else
+    return nmea_parser_pop_slot(parser, pack_ptr);
+#endif
 }
 
 /**
@@ -365,13 +360,11 @@ int nmea_parser_drop(nmeaPARSER *parser)
 
     if(node)
     {
-        if(node->pack)
-            free(node->pack);
         retval = node->packType;
         parser->top_node = node->next_node;
         if(!parser->top_node)
             parser->end_node = 0;
-        free(node);
+        nmea_parser_give_node(parser, node);
     }
 
     return retval;
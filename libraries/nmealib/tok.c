@@ -38,29 +38,56 @@ int nmea_calc_crc(const char *buff, int buff_sz)
     return chsum;
 }
 
+/**
+ * \brief Value of a digit or letter digit, -1 for anything else
+ */
+static int nmea_digit_value(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'z')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'Z')
+        return c - 'A' + 10;
+    return -1;
+}
+
 /**
  * \brief Convert string to number
+ * Digits are read straight from the field, no copy is made. Stops at the
+ * first character that isn't a digit of radix like strtol does.
  */
 int nmea_atoi(const char *str, int str_sz, int radix)
 {
-    char *tmp_ptr;
-    char buff[NMEA_CONVSTR_BUF];
-    int res = 0;
+    const char *end_str = str + str_sz;
+    int res = 0, neg = 0, digit;
 
-    if(str_sz < NMEA_CONVSTR_BUF)
+    if(radix < 2 || radix > 36)
+        return 0;
+
+    while(str < end_str && isspace((unsigned char)*str))
+        ++str;
+    if(str < end_str && ('-' == *str || '+' == *str))
+        neg = ('-' == *str++);
+    if(16 == radix && end_str - str > 2 && '0' == str[0] &&
+        ('x' == str[1] || 'X' == str[1]))
+        str += 2;
+
+    for(; str < end_str; ++str)
     {
-        memcpy(&buff[0], str, str_sz);
-        buff[str_sz] = '\0';
-        res = strtol(&buff[0], &tmp_ptr, radix);
+        digit = nmea_digit_value(*str);
+        if(digit < 0 || digit >= radix)
+            break;
+        res = res * radix + digit;
     }
 
-    return res;
+    return (neg?-res:res);
 }
 
 /**
- * \brief Convert string to fraction number
+ * \brief Convert string to fraction number with strtod
  */
-double nmea_atof(const char *str, int str_sz)
+static double nmea_atof_strtod(const char *str, int str_sz)
 {
     char *tmp_ptr;
     char buff[NMEA_CONVSTR_BUF];
@@ -76,6 +103,97 @@ double nmea_atof(const char *str, int str_sz)
     return res;
 }
 
+/**
+ * \brief Convert string to fraction number
+ * NMEA fields are plain [-]digits[.digits], these are collected into an
+ * integer and divided once by a power of ten. Both are exact doubles for up
+ * to 15 significant digits and 18 decimals so the result is correctly
+ * rounded, the same as strtod gives. Longer numbers and exponents still go
+ * through strtod. The powers are written as integers since the library is
+ * built with -fsingle-precision-constant, which would round 1e11 and up.
+ */
+double nmea_atof(const char *str, int str_sz)
+{
+    static const double pow10[] = {
+        1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL,
+        10000000LL, 100000000LL, 1000000000LL, 10000000000LL,
+        100000000000LL, 1000000000000LL, 10000000000000LL,
+        100000000000000LL, 1000000000000000LL, 10000000000000000LL,
+        100000000000000000LL, 1000000000000000000LL
+    };
+
+    const char *beg_str = str;
+    const char *end_str = str + str_sz;
+    long long mant = 0;
+    int ndigits = 0, nfrac = -1, neg = 0;
+    double res;
+
+    while(str < end_str && isspace((unsigned char)*str))
+        ++str;
+    if(str < end_str && ('-' == *str || '+' == *str))
+        neg = ('-' == *str++);
+
+    for(; str < end_str; ++str)
+    {
+        if(*str >= '0' && *str <= '9')
+        {
+            if(mant || '0' != *str)
+                ndigits++;
+            mant = mant * 10 + (*str - '0');
+            if(nfrac >= 0)
+                nfrac++;
+            if(ndigits > 15 || nfrac > 18)
+                return nmea_atof_strtod(beg_str, str_sz);
+        }
+        else if('.' == *str && nfrac < 0)
+            nfrac = 0;
+        else
+            break;
+    }
+
+    if(str < end_str && ('e' == *str || 'E' == *str))
+        return nmea_atof_strtod(beg_str, str_sz);
+
+    res = (double)mant;
+    if(nfrac > 0)
+        res /= pow10[nfrac];
+
+    return (neg?-res:res);
+}
+
+/**
+ * \brief Split a sentence into its comma separated fields in place
+ * The leading '$' and the "*CRC" tail are left out, the first field is the
+ * header. Pointers are into buff, the fields are not terminated.
+ * @return Number of fields, at most max_fields
+ */
+int nmea_split_fields(const char *buff, int buff_sz, nmeaFIELD *fields, int max_fields)
+{
+    const char *end_buf = buff + buff_sz;
+    int nfields = 0;
+
+    if(buff < end_buf && '$' == *buff)
+        ++buff;
+
+    if(max_fields < 1)
+        return 0;
+
+    fields[0].str = buff;
+    for(; buff < end_buf && '*' != *buff && '\r' != *buff; ++buff)
+    {
+        if(',' == *buff)
+        {
+            fields[nfields].sz = (int)(buff - fields[nfields].str);
+            if(++nfields == max_fields)
+                return nfields;
+            fields[nfields].str = buff + 1;
+        }
+    }
+    fields[nfields].sz = (int)(buff - fields[nfields].str);
+
+    return nfields + 1;
+}
+
 /**
  * \brief Formating string (like standart printf) with CRC tail (*CRC)
  */
@@ -0,0 +1,150 @@
+/*******************************************************************************
+* battery_status.c
+*
+* Small POSIX shared memory segment through which the battery_monitor service
+* publishes what it measures. Any program can then read the pack voltage, cell
+* count and charging state with a memcpy instead of running its own ADC
+* conversions. There is a single writer, the seq counter is odd while it is
+* updating and readers retry if it changed under them.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include <sys/mman.h>
+
+#define BATTERY_SHM_NAME		"/roboticscape_battery"
+#define BATTERY_SHM_VERSION		1
+#define BATTERY_SHM_READ_TRIES	8
+
+typedef struct battery_shm_t{
+	uint32_t version;
+	volatile uint32_t seq;
+	battery_status_t status;
+} battery_shm_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+battery_shm_t* battery_shm = NULL;
+int battery_shm_writer = 0;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int map_battery_shm(int writer);
+
+/*******************************************************************************
+* int publish_battery_status(battery_status_t* status)
+*
+* Used by the battery_monitor service. Creates the segment on first use and
+* copies status into it with a fresh timestamp.
+*******************************************************************************/
+int publish_battery_status(battery_status_t* status){
+	if(battery_shm==NULL || !battery_shm_writer){
+		if(map_battery_shm(1)<0) return -1;
+	}
+	battery_shm->seq++;
+	__sync_synchronize();
+	battery_shm->status = *status;
+	battery_shm->status.timestamp_micros = micros_since_boot();
+	__sync_synchronize();
+	battery_shm->seq++;
+	return 0;
+}
+
+/*******************************************************************************
+* int read_battery_status(battery_status_t* status)
+*
+* Copies the newest published status. Returns 0 on success or -1 if no monitor
+* has published since boot. Check status->timestamp_micros against
+* micros_since_boot() to tell if the monitor has since stopped.
+*******************************************************************************/
+int read_battery_status(battery_status_t* status){
+	uint32_t before, after;
+	int i;
+
+	if(battery_shm==NULL){
+		if(map_battery_shm(0)<0) return -1;
+	}
+	for(i=0;i<BATTERY_SHM_READ_TRIES;i++){
+		before = battery_shm->seq;
+		if(before==0) return -1; // nothing written yet
+		if(before&1) continue; // writer in progress
+		__sync_synchronize();
+		*status = battery_shm->status;
+		__sync_synchronize();
+		after = battery_shm->seq;
+		if(before==after) return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int close_battery_status()
+*
+* Unmaps the segment. It is left in place so readers keep their mapping when
+* the monitor restarts, and simply see the timestamp stop advancing meanwhile.
+*******************************************************************************/
+int close_battery_status(){
+	if(battery_shm==NULL) return 0;
+	munmap(battery_shm, sizeof(battery_shm_t));
+	battery_shm = NULL;
+	battery_shm_writer = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int map_battery_shm(int writer)
+*
+* The writer creates and sizes the segment, readers map it read-only and fail
+* quietly if the monitor isn't running.
+*******************************************************************************/
+int map_battery_shm(int writer){
+	struct stat st;
+	int fd;
+	void* ptr;
+
+	if(battery_shm!=NULL) close_battery_status();
+	if(writer) fd = shm_open(BATTERY_SHM_NAME, O_RDWR|O_CREAT, 0644);
+	else fd = shm_open(BATTERY_SHM_NAME, O_RDONLY, 0);
+	if(fd<0){
+		if(writer) printf("ERROR: can't create battery status shared memory\n");
+		return -1;
+	}
+	if(writer && ftruncate(fd, sizeof(battery_shm_t))<0){
+		printf("ERROR: can't size battery status shared memory\n");
+		close(fd);
+		return -1;
+	}
+	// the monitor may have created it but not sized it yet, reading past
+	// the end of the segment would fault
+	if(!writer && (fstat(fd, &st)<0 || \
+						st.st_size<(off_t)sizeof(battery_shm_t))){
+		close(fd);
+		return -1;
+	}
+	ptr = mmap(NULL, sizeof(battery_shm_t), \
+				writer ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ptr==MAP_FAILED){
+		printf("ERROR: can't map battery status shared memory\n");
+		return -1;
+	}
+	battery_shm = (battery_shm_t*)ptr;
+	if(writer){
+		battery_shm->version = BATTERY_SHM_VERSION;
+		// a previous monitor may have died mid-update
+		if(battery_shm->seq&1) battery_shm->seq++;
+		battery_shm_writer = 1;
+	}
+	else if(battery_shm->version!=BATTERY_SHM_VERSION){
+		// 0 means the monitor created it but hasn't finished setting it up
+		if(battery_shm->version!=0){
+			printf("ERROR: battery status shared memory version mismatch\n");
+		}
+		munmap(ptr, sizeof(battery_shm_t));
+		battery_shm = NULL;
+		return -1;
+	}
+	return 0;
+}
@@ -15,26 +15,27 @@
 #define BUF_SIZE 128
 
 // current model stored in memory as enum for fast access
-bb_model_t model;
+bb_model_t model = UNKNOWN_MODEL;
 
-// global variable always initialized at 0
-// set to 1 once the model id has been pulled from /proc/
-int has_checked; 
+// run once per process, pthread_once makes concurrent first calls wait for
+// the one doing the read instead of each parsing the device tree
+pthread_once_t bb_model_once = PTHREAD_ONCE_INIT;
 
 
 /*******************************************************************************
-* return global variable 'model' from device tree
-* then store it for later use
+* void get_bb_model_from_device_tree()
+*
+* reads the model string and stores the matching enum in global 'model'
 *******************************************************************************/
-bb_model_t get_bb_model_from_device_tree(){
+void get_bb_model_from_device_tree(){
 	char c[BUF_SIZE];
     FILE *fd;
 
     if ((fd = fopen(MODEL_DIR, "r")) == NULL)
     {
         printf("ERROR: can't open %s \n", MODEL_DIR);
-        has_checked = 1;
-		return UNKNOWN_MODEL;     
+		model = UNKNOWN_MODEL;
+		return;
     }
 
     // read model
@@ -49,20 +50,17 @@ bb_model_t get_bb_model_from_device_tree(){
     else if(strcmp(c, "TI AM335x BeagleBone Green"		   )==0) model=BB_GREEN;
     else if(strcmp(c, "TI AM335x BeagleBone Green Wireless")==0) model=BB_GREEN_W;
     else model = UNKNOWN_MODEL;
-
-    // mark has-checked as 1 to prevent future slow checks
-    has_checked = 1;
-    return model;
+    return;
 }
 
 
 /*******************************************************************************
-* return global variable 'model' if already read from device tree
-* otherwise get from device tree which stores it for later use
+* return global variable 'model', reading it from the device tree on the first
+* call from any thread
 *******************************************************************************/
 bb_model_t get_bb_model(){
-	if(has_checked) return model;
-	else return get_bb_model_from_device_tree();
+	pthread_once(&bb_model_once, get_bb_model_from_device_tree);
+	return model;
 }
 
 
@@ -71,9 +69,7 @@ bb_model_t get_bb_model(){
 * if it hasn't been checked yet, do so first.
 *******************************************************************************/
 void print_bb_model(){
-	if(has_checked==0) get_bb_model_from_device_tree();
-
-	switch(model){
+	switch(get_bb_model()){
 	case(UNKNOWN_MODEL):
 		printf("UNKNOWN_MODEL");
 		break;
@@ -0,0 +1,265 @@
+/*******************************************************************************
+* cal_store.c
+*
+* One binary file holding the gyro offsets, magnetometer calibration and DSM
+* channel ranges. It is mapped and checked once the first time any driver
+* asks for a value, after which every lookup is a copy out of memory instead
+* of an fopen and fscanf per driver per start up.
+*
+* The file is a small header with the layout version, payload size and a
+* CRC32 of the payload, followed by cal_store_data_t. Updates write the whole
+* store to a temporary file, fsync it and rename it over the old one, so a
+* power cut in the middle of a calibration leaves either the old or the new
+* values on disk and never a mix of the two.
+*
+* Sections that have never been stored in the binary file are read from the
+* old text files by the drivers and copied in, so existing calibrations
+* carry over without running the routines again.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "../roboticscape-defs.h"
+#include "cal_store.h"
+
+typedef struct cal_store_header_t{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		// of the payload that follows
+	uint32_t crc;		// CRC32 of the payload
+} cal_store_header_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+cal_store_data_t cal_store;
+int cal_store_loaded = 0;
+pthread_mutex_t cal_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+uint32_t cal_store_crc(const void* buf, size_t len);
+void load_cal_store();
+int write_cal_store();
+
+/*******************************************************************************
+* int cal_store_get_gyro(int offsets[3])
+*******************************************************************************/
+int cal_store_get_gyro(int offsets[3]){
+	int i, ret = -1;
+	pthread_mutex_lock(&cal_store_mutex);
+	load_cal_store();
+	if(cal_store.valid & CAL_STORE_GYRO){
+		for(i=0;i<3;i++) offsets[i] = cal_store.gyro_offsets[i];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&cal_store_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int cal_store_get_mag(float offsets[3], float scales[3])
+*******************************************************************************/
+int cal_store_get_mag(float offsets[3], float scales[3]){
+	int i, ret = -1;
+	pthread_mutex_lock(&cal_store_mutex);
+	load_cal_store();
+	if(cal_store.valid & CAL_STORE_MAG){
+		for(i=0;i<3;i++){
+			offsets[i] = cal_store.mag_offsets[i];
+			scales[i] = cal_store.mag_scales[i];
+		}
+		ret = 0;
+	}
+	pthread_mutex_unlock(&cal_store_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int cal_store_get_dsm(int min[DSM_MAX_CHANNELS], int max[DSM_MAX_CHANNELS])
+*******************************************************************************/
+int cal_store_get_dsm(int min[DSM_MAX_CHANNELS], int max[DSM_MAX_CHANNELS]){
+	int i, ret = -1;
+	pthread_mutex_lock(&cal_store_mutex);
+	load_cal_store();
+	if(cal_store.valid & CAL_STORE_DSM){
+		for(i=0;i<DSM_MAX_CHANNELS;i++){
+			min[i] = cal_store.dsm_min[i];
+			max[i] = cal_store.dsm_max[i];
+		}
+		ret = 0;
+	}
+	pthread_mutex_unlock(&cal_store_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int cal_store_set_gyro(const int16_t offsets[3])
+*******************************************************************************/
+int cal_store_set_gyro(const int16_t offsets[3]){
+	int i, ret;
+	pthread_mutex_lock(&cal_store_mutex);
+	load_cal_store();
+	for(i=0;i<3;i++) cal_store.gyro_offsets[i] = offsets[i];
+	cal_store.valid |= CAL_STORE_GYRO;
+	ret = write_cal_store();
+	pthread_mutex_unlock(&cal_store_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int cal_store_set_mag(const float offsets[3], const float scales[3])
+*******************************************************************************/
+int cal_store_set_mag(const float offsets[3], const float scales[3]){
+	int i, ret;
+	pthread_mutex_lock(&cal_store_mutex);
+	load_cal_store();
+	for(i=0;i<3;i++){
+		cal_store.mag_offsets[i] = offsets[i];
+		cal_store.mag_scales[i] = scales[i];
+	}
+	cal_store.valid |= CAL_STORE_MAG;
+	ret = write_cal_store();
+	pthread_mutex_unlock(&cal_store_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int cal_store_set_dsm(const int min[DSM_MAX_CHANNELS],
+*										const int max[DSM_MAX_CHANNELS])
+*******************************************************************************/
+int cal_store_set_dsm(const int min[DSM_MAX_CHANNELS], \
+										const int max[DSM_MAX_CHANNELS]){
+	int i, ret;
+	pthread_mutex_lock(&cal_store_mutex);
+	load_cal_store();
+	for(i=0;i<DSM_MAX_CHANNELS;i++){
+		cal_store.dsm_min[i] = min[i];
+		cal_store.dsm_max[i] = max[i];
+	}
+	cal_store.valid |= CAL_STORE_DSM;
+	ret = write_cal_store();
+	pthread_mutex_unlock(&cal_store_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* void load_cal_store()
+*
+* Maps the file and copies the payload out if the header checks out. Only
+* the first call does anything. A missing file just leaves every section
+* invalid, a damaged one or a different layout version is reported and
+* ignored so the drivers fall back to their text files or defaults. Call
+* with cal_store_mutex held.
+*******************************************************************************/
+void load_cal_store(){
+	char file_path[100];
+	struct stat st;
+	const cal_store_header_t* h;
+	void* map;
+	int fd;
+
+	if(cal_store_loaded) return;
+	cal_store_loaded = 1;
+	memset(&cal_store, 0, sizeof(cal_store));
+
+	strcpy(file_path, CONFIG_DIRECTORY);
+	strcat(file_path, CAL_STORE_FILE);
+	fd = open(file_path, O_RDONLY|O_CLOEXEC);
+	if(fd<0) return;
+	if(fstat(fd, &st)<0 || st.st_size<(off_t)sizeof(cal_store_header_t)){
+		printf("WARNING: calibration store is truncated, ignoring it\n");
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map==MAP_FAILED){
+		printf("WARNING: failed to map calibration store\n");
+		return;
+	}
+	h = (const cal_store_header_t*)map;
+	if(h->magic!=CAL_STORE_MAGIC){
+		printf("WARNING: %s is not a calibration store\n", file_path);
+	}
+	else if(h->version!=CAL_STORE_VERSION || h->size!=sizeof(cal_store_data_t)\
+		|| st.st_size<(off_t)(sizeof(cal_store_header_t)+h->size)){
+		printf("WARNING: calibration store version %d not supported\n", \
+																h->version);
+	}
+	else if(cal_store_crc(h+1, h->size)!=h->crc){
+		printf("WARNING: calibration store checksum failed, ignoring it\n");
+	}
+	else memcpy(&cal_store, h+1, sizeof(cal_store_data_t));
+	munmap(map, st.st_size);
+	return;
+}
+
+/*******************************************************************************
+* int write_cal_store()
+*
+* Writes header and payload to a temporary file and renames it into place.
+* Call with cal_store_mutex held.
+*******************************************************************************/
+int write_cal_store(){
+	char file_path[100], tmp_path[104];
+	cal_store_header_t h;
+	int fd;
+
+	strcpy(file_path, CONFIG_DIRECTORY);
+	strcat(file_path, CAL_STORE_FILE);
+	strcpy(tmp_path, file_path);
+	strcat(tmp_path, ".tmp");
+
+	h.magic = CAL_STORE_MAGIC;
+	h.version = CAL_STORE_VERSION;
+	h.size = sizeof(cal_store_data_t);
+	h.crc = cal_store_crc(&cal_store, sizeof(cal_store_data_t));
+
+	fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	// if opening for writing failed, the directory may not exist yet
+	if(fd<0){
+		mkdir(CONFIG_DIRECTORY, 0777);
+		fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if(fd<0){
+			printf("could not open config directory\n");
+			printf(CONFIG_DIRECTORY);
+			printf("\n");
+			return -1;
+		}
+	}
+	if(write(fd, &h, sizeof(h))!=sizeof(h) || \
+		write(fd, &cal_store, sizeof(cal_store))!=sizeof(cal_store) || \
+		fsync(fd)<0){
+		printf("Failed to write calibration store\n");
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	close(fd);
+	if(rename(tmp_path, file_path)<0){
+		printf("Failed to replace calibration store\n");
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* uint32_t cal_store_crc(const void* buf, size_t len)
+*
+* Standard reflected CRC32, bit at a time since the payload is tiny and only
+* checked once.
+*******************************************************************************/
+uint32_t cal_store_crc(const void* buf, size_t len){
+	const uint8_t* p = buf;
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+	int j;
+	for(i=0;i<len;i++){
+		crc ^= p[i];
+		for(j=0;j<8;j++) crc = (crc>>1) ^ (0xEDB88320 & -(crc&1));
+	}
+	return ~crc;
+}
@@ -0,0 +1,34 @@
+/*******************************************************************************
+* cal_store.h
+*
+* Shared binary calibration store used by the IMU and DSM drivers. Not part
+* of the public API, the calibrate_* routines are the way to change it.
+*******************************************************************************/
+
+#define CAL_STORE_MAGIC		0x4c414352	// "RCAL" little endian
+#define CAL_STORE_VERSION	1
+
+// bits of cal_store_data_t.valid
+#define CAL_STORE_GYRO		(1<<0)
+#define CAL_STORE_MAG		(1<<1)
+#define CAL_STORE_DSM		(1<<2)
+
+typedef struct cal_store_data_t{
+	uint32_t valid;
+	int32_t gyro_offsets[3];
+	float mag_offsets[3];
+	float mag_scales[3];
+	int32_t dsm_min[DSM_MAX_CHANNELS];
+	int32_t dsm_max[DSM_MAX_CHANNELS];
+} cal_store_data_t;
+
+// each returns -1 if that section has never been stored
+int cal_store_get_gyro(int offsets[3]);
+int cal_store_get_mag(float offsets[3], float scales[3]);
+int cal_store_get_dsm(int min[DSM_MAX_CHANNELS], int max[DSM_MAX_CHANNELS]);
+
+// replace one section and rewrite the whole file atomically
+int cal_store_set_gyro(const int16_t offsets[3]);
+int cal_store_set_mag(const float offsets[3], const float scales[3]);
+int cal_store_set_dsm(const int min[DSM_MAX_CHANNELS], \
+											const int max[DSM_MAX_CHANNELS]);
@@ -8,12 +8,35 @@
 
 #include "../roboticscape.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define GOVERNOR_PATH  "/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor"
 #define SETSPEED_PATH  "/sys/devices/system/cpu/cpu0/cpufreq/scaling_setspeed"
 #define CURFREQ_PATH   "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
+#define DMA_LATENCY_PATH "/dev/cpu_dma_latency"
+#define GOVERNOR_LEN	32
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+// the PM QoS request on /dev/cpu_dma_latency lasts as long as the fd is open
+int cpu_dma_latency_fd = -1;
+int cpu_performance_on = 0;
+int cpu_performance_follows_state = 0;
+char cpu_saved_governor[GOVERNOR_LEN];
+int cpu_saved_setspeed = 0;
+pthread_mutex_t cpu_performance_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int write_cpu_sysfs(const char* path, const char* str);
+int read_cpu_sysfs(const char* path, char* buf, int len);
 
 
 /*******************************************************************************
@@ -128,5 +151,150 @@ int print_cpu_frequency(){
 	return 0;
 }
 
+/*******************************************************************************
+* int enable_cpu_performance_mode(int max_latency_us)
+*
+* Holds the cpu at full speed and keeps it out of idle states that take longer
+* than max_latency_us to wake from, 0 leaving only the fast WFI idle. The
+* governor in use is saved and put back by disable_cpu_performance_mode().
+* Returns 0 on success or -1 if neither could be applied.
+*******************************************************************************/
+int enable_cpu_performance_mode(int max_latency_us){
+	char buf[GOVERNOR_LEN];
+	int32_t latency;
+	int ret = 0;
 
+	if(max_latency_us<0){
+		printf("ERROR: cpu wakeup latency can't be negative\n");
+		return -1;
+	}
+	pthread_mutex_lock(&cpu_performance_mutex);
+	if(!cpu_performance_on){
+		if(read_cpu_sysfs(GOVERNOR_PATH, cpu_saved_governor, GOVERNOR_LEN)<0){
+			cpu_saved_governor[0] = 0;
+		}
+		if(strcmp(cpu_saved_governor, "userspace")==0 && \
+				read_cpu_sysfs(CURFREQ_PATH, buf, GOVERNOR_LEN)==0){
+			cpu_saved_setspeed = atoi(buf);
+		}
+		else cpu_saved_setspeed = 0;
+		// performance skips the ondemand sampling entirely, fall back to the
+		// userspace governor on kernels built without it
+		if(write_cpu_sysfs(GOVERNOR_PATH, "performance")<0 && \
+								set_cpu_frequency(FREQ_1000MHZ)<0){
+			ret = -1;
+		}
+	}
+	// a new value replaces the old request on the same fd
+	if(cpu_dma_latency_fd<0){
+		cpu_dma_latency_fd = open(DMA_LATENCY_PATH, O_WRONLY);
+	}
+	latency = max_latency_us;
+	if(cpu_dma_latency_fd<0 || \
+		write(cpu_dma_latency_fd, &latency, sizeof(latency))!=sizeof(latency)){
+		printf("WARNING: can't limit cpu idle latency\n");
+		if(ret<0){
+			pthread_mutex_unlock(&cpu_performance_mutex);
+			return -1;
+		}
+	}
+	cpu_performance_on = 1;
+	pthread_mutex_unlock(&cpu_performance_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int disable_cpu_performance_mode()
+*
+* Drops the idle latency request and restores the governor (and frequency for
+* the userspace governor) found when performance mode was enabled.
+*******************************************************************************/
+int disable_cpu_performance_mode(){
+	char buf[GOVERNOR_LEN];
+	int ret = 0;
 
+	pthread_mutex_lock(&cpu_performance_mutex);
+	if(!cpu_performance_on){
+		pthread_mutex_unlock(&cpu_performance_mutex);
+		return 0;
+	}
+	if(cpu_dma_latency_fd>=0){
+		close(cpu_dma_latency_fd);
+		cpu_dma_latency_fd = -1;
+	}
+	if(cpu_saved_governor[0]==0) ret = set_cpu_frequency(FREQ_ONDEMAND);
+	else{
+		ret = write_cpu_sysfs(GOVERNOR_PATH, cpu_saved_governor);
+		if(ret==0 && cpu_saved_setspeed>0){
+			snprintf(buf, sizeof(buf), "%d", cpu_saved_setspeed);
+			ret = write_cpu_sysfs(SETSPEED_PATH, buf);
+		}
+	}
+	cpu_performance_on = 0;
+	pthread_mutex_unlock(&cpu_performance_mutex);
+	if(ret<0) printf("ERROR: failed to restore cpu governor\n");
+	return ret;
+}
+
+/*******************************************************************************
+* int is_cpu_performance_mode()
+*******************************************************************************/
+int is_cpu_performance_mode(){
+	return cpu_performance_on;
+}
+
+/*******************************************************************************
+* int set_cpu_performance_follows_state(int enable)
+*
+* When enabled, set_state(RUNNING) turns performance mode on with the lowest
+* idle latency and every other state turns it off again.
+*******************************************************************************/
+int set_cpu_performance_follows_state(int enable){
+	cpu_performance_follows_state = (enable!=0);
+	if(!enable) return 0;
+	if(get_state()==RUNNING) return enable_cpu_performance_mode(0);
+	return disable_cpu_performance_mode();
+}
+
+/*******************************************************************************
+* int cpu_performance_state_changed(state_t new_state)
+*
+* called by set_state whenever the state actually changes. EXITING is left to
+* cleanup_cape, which restores the governor anyway, so a Ctrl-C landing while
+* another thread is inside enable_cpu_performance_mode can't wait on it.
+*******************************************************************************/
+int cpu_performance_state_changed(state_t new_state){
+	if(!cpu_performance_follows_state) return 0;
+	if(new_state==EXITING) return 0;
+	if(new_state==RUNNING) return enable_cpu_performance_mode(0);
+	return disable_cpu_performance_mode();
+}
+
+/*******************************************************************************
+* int write_cpu_sysfs(const char* path, const char* str)
+*******************************************************************************/
+int write_cpu_sysfs(const char* path, const char* str){
+	int fd, ret;
+	fd = open(path, O_WRONLY);
+	if(fd<0) return -1;
+	ret = write(fd, str, strlen(str));
+	close(fd);
+	return ret<0 ? -1 : 0;
+}
+
+/*******************************************************************************
+* int read_cpu_sysfs(const char* path, char* buf, int len)
+*
+* reads one line without its newline
+*******************************************************************************/
+int read_cpu_sysfs(const char* path, char* buf, int len){
+	int fd, n;
+	fd = open(path, O_RDONLY);
+	if(fd<0) return -1;
+	n = read(fd, buf, len-1);
+	close(fd);
+	if(n<=0) return -1;
+	buf[n] = 0;
+	if(buf[n-1]=='\n') buf[n-1] = 0;
+	return 0;
+}
@@ -10,8 +10,11 @@
 #include "../roboticscape.h"
 #include "../roboticscape-defs.h"
 #include "../mmap/mmap_gpio_adc.h"
+#include "replay.h"
+#include "cal_store.h"
 
-#define MAX_DSM_CHANNELS 9
+#define MAX_DSM_CHANNELS DSM_MAX_CHANNELS
+#define DSM_FRAME_READ_TRIES 8
 #define PAUSE 115	//microseconds
 #define DEFAULT_MIN 1142
 #define DEFAULT_MAX 1858
@@ -19,6 +22,14 @@
 #define DSM_UART_BUS 		4
 #define DSM_BAUD_RATE 		115200
 #define DSM_PACKET_SIZE 	16
+#define DSM_POLL_TIMEOUT_MS	100	// upper bound on stop_dsm_service latency
+#define DSM_GAP_US			2000 // longer than one 16-byte frame at 115200
+#define DSM_MID_US			1500 // raw width of a centered stick
+#define DSM_PASSTHROUGH_MIN_TIMEOUT_MS	20
+#define DSM_SYSTEM_11MS_2048_DSM2	0x12	// system byte values with 11ms
+#define DSM_SYSTEM_11MS_2048_DSMX	0xB2	// between packets, others are 22ms
+#define DSM_PACKET_PERIOD_11MS		11000
+#define DSM_PACKET_PERIOD_22MS		22000
 
 /*******************************************************************************
 * Local Global Variables
@@ -36,13 +47,51 @@ pthread_t serial_parser_thread;
 int listening; // for calibration routine only
 int (*dsm_ready_func)();
 int is_dsm_active_flag; 
+int dsm_replay_en; // frames come from a replay log or sim, no uart or thread
+
+// seqlock double buffer of whole frames written only by serial_parser
+typedef struct dsm_frame_slot_t{
+	volatile uint32_t lock;	// odd while the slot is being written
+	dsm_frame_t frame;
+} dsm_frame_slot_t;
+dsm_frame_slot_t dsm_frame_slots[2];
+volatile uint64_t newest_dsm_frame;
+
+// servo outputs driven straight from serial_parser, see set_dsm_passthrough
+typedef struct dsm_passthrough_ch_t{
+	int dsm_ch;			// 1-9, 0 if the servo channel isn't forwarded
+	float gain;			// applied to the raw width's offset from 1500us
+	int min_us;
+	int max_us;
+	int failsafe_us;	// sent when frames stop, 0 stops the channel
+} dsm_passthrough_ch_t;
+dsm_passthrough_ch_t dsm_passthrough[SERVO_CHANNELS];
+pthread_mutex_t dsm_passthrough_mutex = PTHREAD_MUTEX_INITIALIZER;
+int dsm_passthrough_en;
+int dsm_passthrough_failsafe_flag;
+uint64_t dsm_passthrough_timeout_us;
+uint64_t dsm_passthrough_start_us;
+int dsm_poll_timeout_ms = DSM_POLL_TIMEOUT_MS;
+
+// link quality counters, only written by serial_parser. Resetting takes a
+// baseline rather than clearing them so it never races the parser.
+dsm_link_stats_t dsm_stats;
+dsm_link_stats_t dsm_stats_base;
+uint64_t dsm_last_packet_us;
+int dsm_last_fades = -1;
 
 /*******************************************************************************
 * Local Function Declarations
 *******************************************************************************/
 int load_default_calibration();
 void* serial_parser(void *ptr); //background thread
+int read_dsm_packet(char* buf);
+int resync_dsm();
+void publish_dsm_frame();
 void* calibration_listen_func(void *params);
+void send_dsm_passthrough();
+void check_dsm_passthrough_failsafe();
+void count_dsm_packet(unsigned char fades, unsigned char system, uint64_t now);
 
 /*******************************************************************************
 * int initialize_dsm()
@@ -52,49 +101,74 @@ void* calibration_listen_func(void *params);
 * for serials packets on that interface.
 *******************************************************************************/ 
 int initialize_dsm(){
+	uart_config_t uart_conf;
 	int i;
 	//if calibration file exists, load it and start spektrum thread
 	FILE *cal;
 	char file_path[100];
 
-	// construct a new file path string
-	strcpy(file_path, CONFIG_DIRECTORY);
-	strcat(file_path, DSM_CAL_FILE);
-	
-	// open for reading
-	cal = fopen(file_path, "r");
+	// the calibration store first, then carry over an old text file
+	if(cal_store_get_dsm(rc_mins, rc_maxes)<0){
+		// construct a new file path string
+		strcpy(file_path, CONFIG_DIRECTORY);
+		strcat(file_path, DSM_CAL_FILE);
+		
+		// open for reading
+		cal = fopen(file_path, "r");
 
-	if (cal == NULL) {
-		printf("\ndsm Calibration File Doesn't Exist Yet\n");
-		printf("Run calibrate_dsm example to create one\n");
-		printf("Using default values for now\n");
-		load_default_calibration();
-	}
-	else{
-		for(i=0;i<MAX_DSM_CHANNELS;i++){
-			fscanf(cal,"%d %d", &rc_mins[i],&rc_maxes[i]);
+		if (cal == NULL) {
+			printf("\ndsm Calibration File Doesn't Exist Yet\n");
+			printf("Run calibrate_dsm example to create one\n");
+			printf("Using default values for now\n");
+			load_default_calibration();
+		}
+		else{
+			for(i=0;i<MAX_DSM_CHANNELS;i++){
+				fscanf(cal,"%d %d", &rc_mins[i],&rc_maxes[i]);
+			}
+			fclose(cal);
+			cal_store_set_dsm(rc_mins, rc_maxes);
 		}
-		#ifdef DEBUG
-		printf("DSM Calibration Loaded\n");
-		#endif
-		fclose(cal);
 	}
+	#ifdef DEBUG
+	printf("DSM Calibration Loaded\n");
+	#endif
 
-	set_pinmux_mode(DSM_PIN, PINMUX_UART);
-	
-	
 	dsm_frame_rate = 0; // zero until mode is detected on first packet
-	running = 1; // lets uarts 4 thread know it can run
 	num_channels = 0;
 	last_time = 0;
 	is_dsm_active_flag = 0;
+	newest_dsm_frame = 0;
+	dsm_last_packet_us = 0;
+	dsm_last_fades = -1;
+	memset(&dsm_stats, 0, sizeof(dsm_stats));
+	memset(&dsm_stats_base, 0, sizeof(dsm_stats_base));
 	set_new_dsm_data_func(&null_func);
 	
-	if(initialize_uart(DSM_UART_BUS, DSM_BAUD_RATE, 0.1)){
+	// the replay or sim thread delivers frames with replay_dsm_record
+	if(is_replay_mode() || is_sim_mode()){
+		dsm_replay_en = 1;
+		return 0;
+	}
+	
+	set_pinmux_mode(DSM_PIN, PINMUX_UART);
+	running = 1; // lets uarts 4 thread know it can run
+	
+	// interrupt on the first byte and push it straight up so the packet is
+	// in userspace within a byte time of its last byte arriving
+	uart_conf = get_default_uart_config();
+	uart_conf.baudrate = DSM_BAUD_RATE;
+	uart_conf.timeout_s = 0.1;
+	uart_conf.low_latency = 1;
+	uart_conf.rx_trigger = 1;
+	if(initialize_uart_config(DSM_UART_BUS, uart_conf)){
 		printf("Error, failed to initialize UART%d for dsm\n", DSM_UART_BUS);
 	}
+	// wake the parser once per packet instead of polling for bytes
+	set_uart_read_min(DSM_UART_BUS, DSM_PACKET_SIZE);
 	
-	pthread_create(&serial_parser_thread, NULL, serial_parser, (void*) NULL);
+	create_rt_thread(&serial_parser_thread, RT_SERVICE_DSM, serial_parser, \
+																(void*) NULL);
 	#ifdef DEBUG
 	printf("dsm Thread Started\n");
 	#endif
@@ -148,6 +222,99 @@ float get_dsm_ch_normalized(int ch){
 	}
 }
 
+/*******************************************************************************
+* @ int get_dsm_frame(dsm_frame_t* frame)
+* 
+* Copies the most recent complete frame with all channels, their normalized
+* values, frame count, and receive timestamp. Every field comes from the same
+* frame even while serial_parser is writing the next one. Returns 0 on success
+* or -1 if no frame has been received yet.
+*******************************************************************************/
+int get_dsm_frame(dsm_frame_t* frame){
+	uint64_t n;
+	uint32_t before, after;
+	dsm_frame_slot_t* slot;
+	int i;
+	
+	for(i=0;i<DSM_FRAME_READ_TRIES;i++){
+		n = newest_dsm_frame;
+		if(n==0) return -1;
+		__sync_synchronize();
+		slot = &dsm_frame_slots[n&1];
+		before = slot->lock;
+		if(before&1) continue; // writer in progress
+		__sync_synchronize();
+		*frame = slot->frame;
+		__sync_synchronize();
+		after = slot->lock;
+		if(before!=after || frame->frame_count!=n) continue;
+		new_dsm_flag = 0;
+		return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* void publish_dsm_frame()
+* 
+* Normalizes the freshly committed rc_channels and writes them with the frame
+* count and last_time into the slot readers are not looking at. Only called
+* from serial_parser so there is a single writer.
+*******************************************************************************/
+void publish_dsm_frame(){
+	uint64_t n = newest_dsm_frame + 1;
+	dsm_frame_slot_t* slot = &dsm_frame_slots[n&1];
+	dsm_frame_t* f = &slot->frame;
+	float range, center;
+	int i;
+	
+	slot->lock++;
+	__sync_synchronize();
+	f->frame_count = n;
+	f->timestamp_micros = last_time;
+	f->num_channels = num_channels;
+	f->resolution = resolution;
+	for(i=0;i<MAX_DSM_CHANNELS;i++){
+		f->raw[i] = rc_channels[i];
+		range = rc_maxes[i]-rc_mins[i];
+		if(range!=0 && rc_channels[i]!=0){
+			center = (rc_maxes[i]+rc_mins[i])/2;
+			f->normalized[i] = 2*(rc_channels[i]-center)/range;
+		}
+		else f->normalized[i] = 0;
+	}
+	__sync_synchronize();
+	slot->lock++;
+	
+	// only now let readers know the frame exists
+	__sync_synchronize();
+	newest_dsm_frame = n;
+	
+	if(get_logger_sources()&LOG_SOURCE_DSM) log_dsm_frame(f);
+	if(get_telemetry_sources()&LOG_SOURCE_DSM) telemetry_dsm_frame(f);
+	if(get_sensor_hub_sources()&HUB_SOURCE_DSM) hub_publish_dsm_frame(f);
+}
+
+/*******************************************************************************
+* int replay_dsm_record(const log_dsm_record_t* r, uint64_t timestamp_micros)
+*
+* Called from the replay thread in place of serial_parser completing a frame.
+* The raw widths are renormalized with this robot's calibration.
+*******************************************************************************/
+int replay_dsm_record(const log_dsm_record_t* r, uint64_t timestamp_micros){
+	int i;
+	if(!dsm_replay_en) return -1;
+	num_channels = r->num_channels;
+	resolution = r->resolution;
+	for(i=0;i<MAX_DSM_CHANNELS;i++) rc_channels[i] = r->raw[i];
+	last_time = timestamp_micros;
+	new_dsm_flag = 1;
+	is_dsm_active_flag = 1;
+	publish_dsm_frame();
+	dsm_ready_func();
+	return 0;
+}
+
 /*******************************************************************************
 * @ int is_new_dsm_data()
 * 
@@ -210,7 +377,7 @@ int ms_since_last_dsm_packet(){
 		return -1;
 	}
 	// otherwise in normal operation just subtract last time from new time
-	uint64_t current_time = micros_since_epoch();
+	uint64_t current_time = micros_since_boot();
 	
 	return (int)((current_time-last_time)/1000);
 }
@@ -226,8 +393,11 @@ int ms_since_last_dsm_packet(){
 *******************************************************************************/
 void* serial_parser(void *ptr){
 	char buf[DSM_PACKET_SIZE];
-	int i, ret, available;
+	int i, ret;
 	int new_values[MAX_DSM_CHANNELS]; // hold new values before committing
+	uint64_t new_packet[MAX_DSM_CHANNELS]; // packet each value came from
+	uint64_t now, gap;
+	int j, dropped;
 	int detection_packets_left; // use first 4 packets just for detection
 	unsigned char ch_id;
 	int16_t value;
@@ -248,35 +418,12 @@ void* serial_parser(void *ptr){
 	* to break 1024 mode then swap to 2048
 	***************************************************************************/
 DETECTION_START:
-	flush_uart(DSM_UART_BUS); // flush first
+	resync_dsm(); // start at a frame boundary
 	detection_packets_left = 4;
 	while(detection_packets_left>0 && running && get_state()!=EXITING){
-		usleep(5000);
-		available = uart_bytes_available(DSM_UART_BUS);
-
-		// nothing yet, go back to sleep
-		if(available == 0) continue;
-		// halfway through packet, sleep for 1ms
-		if(available <  DSM_PACKET_SIZE){
-			usleep(1000);
-			available = uart_bytes_available(DSM_UART_BUS);
-		}
-		// read or flush depending on bytes available		
-		if(available == DSM_PACKET_SIZE){
-			ret = uart_read_bytes(DSM_UART_BUS, DSM_PACKET_SIZE, buf);
-			if(ret!=DSM_PACKET_SIZE){
-				#ifdef DEBUG
-					printf("WARNING: read the wrong number of bytes: %d\n", ret);
-				#endif
-				flush_uart(DSM_UART_BUS); // flush
-				continue;
-			}
-		}
-		else{
-			// got out of sync or read nonsense, flush and try again
-			flush_uart(DSM_UART_BUS); // flush
-			continue;
-		}
+		// sleeps until a whole packet arrives
+		ret = read_dsm_packet(buf);
+		if(ret!=1) continue;
 
 		// first check each channel id assuming 1024/22ms mode
 		// where the channel id lives in 0b01111000 mask
@@ -384,39 +531,33 @@ DETECTION_START:
 	/***************************************************************************
 	* normal operation loop
 	***************************************************************************/
+	memset(new_values, 0, sizeof(new_values));
+	memset(new_packet, 0, sizeof(new_packet));
 START_NORMAL_LOOP:
 	while(running && get_state()!=EXITING){
-		usleep(5000);
-		available = uart_bytes_available(DSM_UART_BUS);
-
-		// nothing yet, go back to sleep
-		if(available == 0) continue;
-		// halfway through packet, sleep for 1ms
-		if(available <  DSM_PACKET_SIZE){
-			usleep(1000);
-			available = uart_bytes_available(DSM_UART_BUS);
+		// sleeps until a whole packet arrives
+		ret = read_dsm_packet(buf);
+		if(ret==0) continue;
+		if(ret<0){
+			is_dsm_active_flag=0;
+			dsm_stats.resyncs++;
+			memset(new_values, 0, sizeof(new_values));
+			continue;
 		}
+		now = micros_since_boot();
+		gap = now - dsm_last_packet_us;
+		count_dsm_packet(buf[0], buf[1], now);
 
-		#ifdef DEBUG
-			printf("bytes available: %d\n", available);
-		#endif
-
-		// read or flush depending on bytes available		
-		if(available == DSM_PACKET_SIZE){
-			ret = uart_read_bytes(DSM_UART_BUS, DSM_PACKET_SIZE, buf);
-			if(ret!=DSM_PACKET_SIZE){
-				#ifdef DEBUG
-					printf("WARNING: read the wrong number of bytes: %d\n", ret);
-				#endif
-				is_dsm_active_flag=0;
-				flush_uart(DSM_UART_BUS); // flush
-				continue;
+		// if the packet before this one went missing, any half frame we
+		// hold is from an earlier frame and would mix stale channels in
+		if(dsm_stats.packet_period_us && \
+							gap > dsm_stats.packet_period_us*3/2){
+			dropped = 0;
+			for(i=0;i<MAX_DSM_CHANNELS;i++){
+				if(new_values[i]!=0) dropped = 1;
+				new_values[i] = 0;
 			}
-		}
-		else{
-			// got out of sync, flush and try again
-			flush_uart(DSM_UART_BUS); // flush
-			continue;
+			dsm_stats.dropped_partial_frames += dropped;
 		}
 
 		// raw debug mode spits out all ones and zeros
@@ -470,8 +611,19 @@ START_NORMAL_LOOP:
 					#endif
 					goto START_NORMAL_LOOP;
 				}
+				// a channel repeating before the set completed means the
+				// rest of the last frame never came, start over with the
+				// values from this packet
+				if(new_values[ch_id]!=0 && \
+					new_packet[ch_id]!=dsm_stats.packets){
+					for(j=0;j<MAX_DSM_CHANNELS;j++){
+						if(new_packet[j]!=dsm_stats.packets) new_values[j] = 0;
+					}
+					dsm_stats.dropped_partial_frames++;
+				}
 				// record new value
 				new_values[ch_id] = value;
+				new_packet[ch_id] = dsm_stats.packets;
 			}
 		}
 
@@ -493,11 +645,15 @@ START_NORMAL_LOOP:
 			#endif
 			new_dsm_flag=1;
 			is_dsm_active_flag=1;
-			last_time = micros_since_epoch();
+			last_time = now;
 			for(i=0;i<num_channels;i++){
 				rc_channels[i]=new_values[i];
 				new_values[i]=0;// put local values array back to 0
 			}
+			dsm_stats.frames++;
+			// servos first, nothing below should delay them
+			if(dsm_passthrough_en) send_dsm_passthrough();
+			publish_dsm_frame();
 			// run the dsm ready function.
 			// this is null unless user changed it
 			dsm_ready_func();
@@ -510,6 +666,118 @@ START_NORMAL_LOOP:
 	return NULL;
 }
 
+/*******************************************************************************
+* void count_dsm_packet(unsigned char fades, unsigned char system, uint64_t now)
+*
+* Updates the link counters from the two header bytes of a good packet and its
+* arrival time. Packets come at a fixed period, 11ms or 22ms as given by the
+* system byte, so a longer gap means some were lost.
+*******************************************************************************/
+void count_dsm_packet(unsigned char fades, unsigned char system, uint64_t now){
+	uint64_t gap, period;
+
+	if(system==DSM_SYSTEM_11MS_2048_DSM2 || system==DSM_SYSTEM_11MS_2048_DSMX){
+		period = DSM_PACKET_PERIOD_11MS;
+	}
+	else period = DSM_PACKET_PERIOD_22MS;
+	dsm_stats.packet_period_us = period;
+	dsm_stats.system = system;
+
+	if(dsm_stats.packets>0){
+		gap = now - dsm_last_packet_us;
+		if(gap > period*3/2){
+			dsm_stats.lost_packets += (gap + period/2)/period - 1;
+			metric_add(METRIC_DSM_LOST_PACKETS, (gap + period/2)/period - 1);
+		}
+	}
+	// the receiver's own one byte count of frames it missed, wraps at 256
+	if(dsm_last_fades>=0){
+		dsm_stats.fades += (unsigned char)(fades - dsm_last_fades);
+	}
+	dsm_last_fades = fades;
+	dsm_last_packet_us = now;
+	dsm_stats.packets++;
+}
+
+/*******************************************************************************
+* int get_dsm_link_stats(dsm_link_stats_t* stats)
+*
+* copies the link counters, each is exact but they may be one packet apart
+*******************************************************************************/
+int get_dsm_link_stats(dsm_link_stats_t* stats){
+	*stats = dsm_stats;
+	stats->packets -= dsm_stats_base.packets;
+	stats->frames -= dsm_stats_base.frames;
+	stats->lost_packets -= dsm_stats_base.lost_packets;
+	stats->dropped_partial_frames -= dsm_stats_base.dropped_partial_frames;
+	stats->resyncs -= dsm_stats_base.resyncs;
+	stats->fades -= dsm_stats_base.fades;
+	return 0;
+}
+
+/*******************************************************************************
+* int reset_dsm_link_stats()
+*
+* serial_parser leans on its own running counts to pair frame halves and
+* spot gaps, so they are left alone and only a baseline is taken here
+*******************************************************************************/
+int reset_dsm_link_stats(){
+	dsm_stats_base = dsm_stats;
+	return 0;
+}
+
+/*******************************************************************************
+* int read_dsm_packet(char* buf)
+*
+* Blocks in poll() until a full packet is buffered, VMIN having been set to
+* DSM_PACKET_SIZE, so the parser wakes once per packet within a byte time of
+* the last byte landing. Frames are separated by several milliseconds of idle
+* line so any bytes already waiting after the read mean we are out of step 
+* with the frames and must resync. Returns 1 with a packet in buf, 0 on 
+* timeout, or -1 if a resync was needed.
+*******************************************************************************/
+int read_dsm_packet(char* buf){
+	struct pollfd fdset[2];
+	int ret;
+	
+	fdset[0].fd = get_uart_fd(DSM_UART_BUS);
+	fdset[0].events = POLLIN;
+	fdset[1].fd = get_exit_fd();
+	fdset[1].events = POLLIN;
+	ret = poll(fdset, 2, dsm_poll_timeout_ms);
+	if(ret<=0 || !(fdset[0].revents&POLLIN)){
+		if(dsm_passthrough_en) check_dsm_passthrough_failsafe();
+		return 0;
+	}
+	
+	ret = read(fdset[0].fd, buf, DSM_PACKET_SIZE);
+	if(ret!=DSM_PACKET_SIZE || uart_bytes_available(DSM_UART_BUS)!=0){
+		#ifdef DEBUG
+		printf("WARNING: dsm packet misaligned, read %d bytes\n", ret);
+		#endif
+		if(dsm_passthrough_en) check_dsm_passthrough_failsafe();
+		resync_dsm();
+		return -1;
+	}
+	return 1;
+}
+
+/*******************************************************************************
+* int resync_dsm()
+*
+* Discards buffered bytes until the line has been quiet for DSM_GAP_US. A 
+* frame takes about 1.4ms to arrive so that window can only be empty between
+* frames, leaving the next byte received as the start of a frame.
+*******************************************************************************/
+int resync_dsm(){
+	do{
+		flush_uart(DSM_UART_BUS);
+		usleep(DSM_GAP_US);
+	}while(uart_bytes_available(DSM_UART_BUS)>0 && running && \
+													get_state()!=EXITING);
+	return 0;
+}
+
 /*******************************************************************************
 * @ int stop_dsm_service()
 * 
@@ -519,6 +787,8 @@ START_NORMAL_LOOP:
 int stop_dsm_service(){
 	int ret = 0;
 
+	dsm_replay_en = 0;
+	disable_dsm_passthrough();
 	if(running){
 		running = 0; // this tells serial_parser_thread loop to stop
 		// allow up to 0.3 seconds for thread cleanup
@@ -541,6 +811,171 @@ int stop_dsm_service(){
 	return ret;
 }
 
+/*******************************************************************************
+* int set_dsm_passthrough(int servo_ch, int dsm_ch, float gain, int failsafe_us)
+*
+* Forwards dsm_ch to servo_ch once passthrough is enabled. The output width is
+* 1500us plus gain times the raw width's offset from 1500us, so a gain of 1
+* reproduces the receiver and -1 reverses it. failsafe_us is sent when frames
+* stop, or the channel is stopped if 0. Pass dsm_ch 0 to stop forwarding.
+*******************************************************************************/
+int set_dsm_passthrough(int servo_ch, int dsm_ch, float gain, int failsafe_us){
+	dsm_passthrough_ch_t* p;
+
+	if(servo_ch<1 || servo_ch>SERVO_CHANNELS){
+		printf("ERROR: Servo Channel must be between 1&%d\n", SERVO_CHANNELS);
+		return -1;
+	}
+	if(dsm_ch<0 || dsm_ch>MAX_DSM_CHANNELS){
+		printf("ERROR: DSM channel must be between 0&%d\n", MAX_DSM_CHANNELS);
+		return -1;
+	}
+	if(failsafe_us<0){
+		printf("ERROR: failsafe pulse width can't be negative\n");
+		return -1;
+	}
+	pthread_mutex_lock(&dsm_passthrough_mutex);
+	p = &dsm_passthrough[servo_ch-1];
+	// first mapping of a channel starts with the widest safe range
+	if(p->max_us==0){
+		p->min_us = SERVO_MID_US - SERVO_EXTENDED_RANGE/2;
+		p->max_us = SERVO_MID_US + SERVO_EXTENDED_RANGE/2;
+	}
+	p->dsm_ch = dsm_ch;
+	p->gain = gain;
+	p->failsafe_us = failsafe_us;
+	pthread_mutex_unlock(&dsm_passthrough_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int set_dsm_passthrough_limits(int servo_ch, int min_us, int max_us)
+*
+* Clamps the forwarded width, for example to keep a servo off its end stops.
+*******************************************************************************/
+int set_dsm_passthrough_limits(int servo_ch, int min_us, int max_us){
+	if(servo_ch<1 || servo_ch>SERVO_CHANNELS){
+		printf("ERROR: Servo Channel must be between 1&%d\n", SERVO_CHANNELS);
+		return -1;
+	}
+	if(min_us<0 || max_us<=min_us){
+		printf("ERROR: passthrough max width must be greater than min\n");
+		return -1;
+	}
+	pthread_mutex_lock(&dsm_passthrough_mutex);
+	dsm_passthrough[servo_ch-1].min_us = min_us;
+	dsm_passthrough[servo_ch-1].max_us = max_us;
+	pthread_mutex_unlock(&dsm_passthrough_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int enable_dsm_passthrough(int timeout_ms)
+*
+* Starts forwarding from within serial_parser as each frame completes. Goes to
+* failsafe if no frame arrives for timeout_ms, which is also counted from now
+* in case the radio never connects.
+*******************************************************************************/
+int enable_dsm_passthrough(int timeout_ms){
+	if(timeout_ms<DSM_PASSTHROUGH_MIN_TIMEOUT_MS){
+		printf("ERROR: dsm passthrough timeout must be at least %dms\n", \
+											DSM_PASSTHROUGH_MIN_TIMEOUT_MS);
+		return -1;
+	}
+	pthread_mutex_lock(&dsm_passthrough_mutex);
+	dsm_passthrough_timeout_us = timeout_ms*1000ULL;
+	dsm_passthrough_start_us = micros_since_boot();
+	dsm_passthrough_failsafe_flag = 0;
+	// wake often enough to notice lost frames within a fraction of timeout
+	dsm_poll_timeout_ms = timeout_ms/2;
+	if(dsm_poll_timeout_ms>DSM_POLL_TIMEOUT_MS){
+		dsm_poll_timeout_ms = DSM_POLL_TIMEOUT_MS;
+	}
+	dsm_passthrough_en = 1;
+	pthread_mutex_unlock(&dsm_passthrough_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int disable_dsm_passthrough()
+*
+* Stops forwarding. Servo widths are left as they were.
+*******************************************************************************/
+int disable_dsm_passthrough(){
+	pthread_mutex_lock(&dsm_passthrough_mutex);
+	dsm_passthrough_en = 0;
+	dsm_passthrough_failsafe_flag = 0;
+	dsm_poll_timeout_ms = DSM_POLL_TIMEOUT_MS;
+	pthread_mutex_unlock(&dsm_passthrough_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int is_dsm_passthrough_failsafe()
+*
+* returns 1 while passthrough is sending failsafe widths, otherwise 0
+*******************************************************************************/
+int is_dsm_passthrough_failsafe(){
+	return dsm_passthrough_failsafe_flag;
+}
+
+/*******************************************************************************
+* void send_dsm_passthrough()
+*
+* Called by serial_parser as soon as a frame's rc_channels are committed.
+* One width write per forwarded channel, straight into PRU memory.
+*******************************************************************************/
+void send_dsm_passthrough(){
+	dsm_passthrough_ch_t* p;
+	int i, us;
+
+	pthread_mutex_lock(&dsm_passthrough_mutex);
+	if(dsm_passthrough_en){
+		dsm_passthrough_failsafe_flag = 0;
+		for(i=0;i<SERVO_CHANNELS;i++){
+			p = &dsm_passthrough[i];
+			if(p->dsm_ch==0 || rc_channels[p->dsm_ch-1]==0) continue;
+			us = DSM_MID_US + p->gain*(rc_channels[p->dsm_ch-1]-DSM_MID_US);
+			if(us<p->min_us) us = p->min_us;
+			else if(us>p->max_us) us = p->max_us;
+			send_servo_pulse_us(i+1, us);
+		}
+	}
+	pthread_mutex_unlock(&dsm_passthrough_mutex);
+}
+
+/*******************************************************************************
+* void check_dsm_passthrough_failsafe()
+*
+* Called by serial_parser whenever it wakes without a good packet. Once
+* timeout has passed since the last frame, or since enabling if there was
+* none, the failsafe widths are sent. They are repeated on each later wakeup
+* so they hold in single pulse mode too.
+*******************************************************************************/
+void check_dsm_passthrough_failsafe(){
+	dsm_passthrough_ch_t* p;
+	uint64_t since;
+	int i;
+
+	pthread_mutex_lock(&dsm_passthrough_mutex);
+	since = last_time>dsm_passthrough_start_us ? last_time : \
+												dsm_passthrough_start_us;
+	if(dsm_passthrough_en && \
+					micros_since_boot()-since>=dsm_passthrough_timeout_us){
+		if(!dsm_passthrough_failsafe_flag){
+			printf("WARNING: dsm passthrough lost radio, sending failsafe\n");
+		}
+		dsm_passthrough_failsafe_flag = 1;
+		for(i=0;i<SERVO_CHANNELS;i++){
+			p = &dsm_passthrough[i];
+			if(p->dsm_ch==0) continue;
+			if(p->failsafe_us>0) send_servo_pulse_us(i+1, p->failsafe_us);
+			else stop_servo_repeat(i+1);
+		}
+	}
+	pthread_mutex_unlock(&dsm_passthrough_mutex);
+}
+
 /*******************************************************************************
 * int bind_dsm()
 *
@@ -777,7 +1212,8 @@ int calibrate_dsm_routine(){
 		printf("Error, failed to initialize UART%d for dsm\n", DSM_UART_BUS);
 	}
 	
-	pthread_create(&serial_parser_thread, NULL, serial_parser, (void*) NULL);
+	create_rt_thread(&serial_parser_thread, RT_SERVICE_DSM, serial_parser, \
+																(void*) NULL);
 		
 	// display instructions
 	printf("\nRaw dsm data should display below if the transmitter and\n");
@@ -789,7 +1225,8 @@ int calibrate_dsm_routine(){
 	// start listening
 	listening = 1;
 	pthread_t  listening_thread;
-	pthread_create(&listening_thread, NULL, calibration_listen_func, (void*) NULL);
+	create_rt_thread(&listening_thread, RT_SERVICE_DSM, \
+								calibration_listen_func, (void*) NULL);
 	
 	// wait for user to hit enter
 	ret = continue_or_quit();
@@ -812,37 +1249,19 @@ int calibrate_dsm_routine(){
 		return -1;
 	}
 	
-	// construct a new file path string
-	char file_path[100];
-	strcpy (file_path, CONFIG_DIRECTORY);
-	strcat (file_path, DSM_CAL_FILE);
-	
-	// open for writing
-	FILE* cal;
-	cal = fopen(file_path, "w");
-	if (cal == NULL) {
-		mkdir(CONFIG_DIRECTORY, 0777);
-		cal = fopen(file_path, "w");
-		if (cal == 0){
-			printf("could not open config directory\n");
-			printf(CONFIG_DIRECTORY);
-			printf("\n");
-			return -1;
-		}
-	}
-
-	// if new data was captures for a channel, write data to cal file
-	// otherwise fill in defaults for unused channels in case
-	// a higher channel radio is used in the future with this cal file
+	// if new data was captured for a channel, store it, otherwise fill in
+	// defaults for unused channels in case a higher channel radio is used 
+	// in the future with this calibration
 	for(i=0;i<MAX_DSM_CHANNELS;i++){
 		if((rc_mins[i]==0) || (rc_mins[i]==rc_maxes[i])){
-			fprintf(cal, "%d %d\n",DEFAULT_MIN, DEFAULT_MAX);
-		}
-		else{
-			fprintf(cal, "%d %d\n", rc_mins[i], rc_maxes[i]);
+			rc_mins[i] = DEFAULT_MIN;
+			rc_maxes[i] = DEFAULT_MAX;
 		}
 	}
-	fclose(cal);
+	if(cal_store_set_dsm(rc_mins, rc_maxes)<0){
+		printf("Failed to write dsm calibration to disk\n");
+		return -1;
+	}
 	printf("New calibration file written\n");
 	printf("use test_dsm to confirm\n");
 	return 0;
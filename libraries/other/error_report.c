@@ -0,0 +1,234 @@
+/*******************************************************************************
+* error_report.c
+*
+* Error channel for code that runs in real-time threads. report_error formats
+* the message straight into a slot of a fixed ring, claimed without locking
+* in the same way as log_reserve, and returns without touching stdout. A low
+* priority thread prints or hands on the queued messages, so a slow serial
+* console or ssh session only ever stalls that thread.
+*
+* Repeats of the same message are rate limited at the call site, keyed by the
+* format string's address: one report per call site per interval gets
+* through and the rest are only counted, the count is attached to the next
+* report from that site. Without the reporter thread running, before
+* initialize_cape for instance, messages are still rate limited but printed
+* right away as before.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include <stdarg.h>
+
+#ifdef RC_SMALL_MEMORY
+#define ERROR_RING_LEN		16		// power of two
+#else
+#define ERROR_RING_LEN		64
+#endif
+#define ERROR_SITES			64		// power of two
+#define ERROR_INTERVAL_US	1000000	// one report per call site this often
+#define ERROR_DRAIN_US		20000	// reporter thread wakes this often
+
+typedef struct error_slot_t{
+	volatile uint64_t committed;	// claim index+1 once the text is whole
+	error_report_t report;
+} error_slot_t;
+
+typedef struct error_site_t{
+	volatile uintptr_t key;			// format string address, 0 if unused
+	volatile uint64_t last_micros;	// when it last got through
+	volatile uint32_t suppressed;	// repeats since then
+} error_site_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+error_slot_t error_ring[ERROR_RING_LEN];
+volatile uint64_t error_head = 0;	// next slot a reporter will claim
+volatile uint64_t error_tail = 0;	// next slot the thread will print
+volatile uint64_t error_drops = 0;
+error_site_t error_sites[ERROR_SITES];
+int (*error_report_func)(const error_report_t* r) = NULL;
+volatile int error_reporter_running = 0;
+pthread_t error_thread;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int error_rate_limit(const char* fmt, uint32_t* suppressed);
+void* error_reporter(void* ptr);
+int drain_error_ring();
+void print_error_report(const error_report_t* r);
+
+/*******************************************************************************
+* int start_error_reporter()
+*
+* Starts the thread printing queued reports. Called by initialize_cape.
+*******************************************************************************/
+int start_error_reporter(){
+	if(error_reporter_running) return 0;
+	error_reporter_running = 1;
+	if(create_rt_thread(&error_thread, RT_SERVICE_ERRORS, error_reporter, \
+																	NULL)){
+		error_reporter_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_error_reporter()
+*
+* Prints whatever is still queued and stops the thread, reports are printed
+* directly again afterwards.
+*******************************************************************************/
+int stop_error_reporter(){
+	if(!error_reporter_running) return 0;
+	error_reporter_running = 0;
+	pthread_join(error_thread, NULL);
+	drain_error_ring();
+	return 0;
+}
+
+/*******************************************************************************
+* int set_error_report_func(int (*func)(const error_report_t* r))
+*
+* Replaces printing, NULL to print again. func runs in the reporter thread.
+*******************************************************************************/
+int set_error_report_func(int (*func)(const error_report_t* r)){
+	error_report_func = func;
+	return 0;
+}
+
+/*******************************************************************************
+* uint64_t get_error_report_drops()
+*
+* Reports lost because the ring was full. Rate limited repeats aren't drops.
+*******************************************************************************/
+uint64_t get_error_report_drops(){
+	return error_drops;
+}
+
+/*******************************************************************************
+* void report_error(const char* fmt, ...)
+*
+* printf style. Never blocks while the reporter thread runs.
+*******************************************************************************/
+void report_error(const char* fmt, ...){
+	error_report_t direct;
+	error_report_t* r;
+	error_slot_t* slot = NULL;
+	uint32_t suppressed;
+	uint64_t h;
+	va_list args;
+
+	if(error_rate_limit(fmt, &suppressed)) return;
+	if(error_reporter_running){
+		do{
+			h = error_head;
+			if(h-error_tail >= ERROR_RING_LEN){
+				__sync_fetch_and_add(&error_drops, 1);
+				return;
+			}
+		}while(!__sync_bool_compare_and_swap(&error_head, h, h+1));
+		slot = &error_ring[h&(ERROR_RING_LEN-1)];
+		r = &slot->report;
+	}
+	else r = &direct;
+
+	r->timestamp_micros = micros_since_boot();
+	r->suppressed = suppressed;
+	va_start(args, fmt);
+	vsnprintf(r->text, ERROR_REPORT_LEN, fmt, args);
+	va_end(args);
+
+	if(slot==NULL){
+		print_error_report(r);
+		return;
+	}
+	__sync_synchronize();
+	slot->committed = h+1;
+}
+
+/*******************************************************************************
+* int error_rate_limit(const char* fmt, uint32_t* suppressed)
+*
+* Returns 1 if this call site already reported within the interval, counting
+* the repeat. Otherwise claims the interval and returns 0 with the number of
+* repeats held back since the last report. With every site slot taken new
+* call sites aren't limited.
+*******************************************************************************/
+int error_rate_limit(const char* fmt, uint32_t* suppressed){
+	error_site_t* s = NULL;
+	uintptr_t key = (uintptr_t)fmt;
+	uint64_t now, last;
+	int i, start;
+
+	*suppressed = 0;
+	start = (key>>2)&(ERROR_SITES-1);
+	for(i=0;i<ERROR_SITES;i++){
+		s = &error_sites[(start+i)&(ERROR_SITES-1)];
+		if(s->key==key) break;
+		if(s->key==0 && __sync_bool_compare_and_swap(&s->key, 0, key)) break;
+		if(s->key==key) break; // another thread took it for the same site
+	}
+	if(i==ERROR_SITES) return 0;
+
+	now = micros_since_boot();
+	last = s->last_micros;
+	if((last!=0 && now-last<ERROR_INTERVAL_US) || \
+			!__sync_bool_compare_and_swap(&s->last_micros, last, now)){
+		__sync_fetch_and_add(&s->suppressed, 1);
+		return 1;
+	}
+	*suppressed = __sync_lock_test_and_set(&s->suppressed, 0);
+	return 0;
+}
+
+/*******************************************************************************
+* void* error_reporter(void* ptr)
+*******************************************************************************/
+void* error_reporter(void* ptr){
+	while(error_reporter_running){
+		drain_error_ring();
+		usleep(ERROR_DRAIN_US);
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* int drain_error_ring()
+*
+* Prints committed reports in order, stopping at one still being written.
+*******************************************************************************/
+int drain_error_ring(){
+	error_slot_t* slot;
+	error_report_t r;
+	uint64_t t;
+	int n = 0;
+	for(t=error_tail; t!=error_head; t++){
+		slot = &error_ring[t&(ERROR_RING_LEN-1)];
+		if(slot->committed!=t+1) break;
+		__sync_synchronize();
+		r = slot->report;
+		__sync_synchronize();
+		error_tail = t+1;
+		if(error_report_func!=NULL) error_report_func(&r);
+		else print_error_report(&r);
+		n++;
+	}
+	if(n && error_report_func==NULL) fflush(stdout);
+	return n;
+}
+
+/*******************************************************************************
+* void print_error_report(const error_report_t* r)
+*******************************************************************************/
+void print_error_report(const error_report_t* r){
+	int len = strlen(r->text);
+	// messages are usually written with their own newline
+	if(len && r->text[len-1]=='\n') len--;
+	if(r->suppressed){
+		printf("%.*s (%u repeats suppressed)\n", len, r->text, r->suppressed);
+	}
+	else printf("%.*s\n", len, r->text);
+}
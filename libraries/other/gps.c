@@ -2,20 +2,41 @@
 * gps.c
 *
 * This file contains all gps related functions and is compiled into 
-* robotics_cape.so but kept here separately for tidyness. This references 
-* the nmealib.
+* robotics_cape.so but kept here separately for tidyness. NMEA is decoded
+* by a small incremental parser here rather than nmealib so the listener 
+* thread never allocates.
 *
 *******************************************************************************/
 
 #include "../roboticscape-usefulincludes.h"
 #include "../roboticscape.h"
 #include "../roboticscape-defs.h"
-#include "../nmealib/nmea/nmea.h"
-
-
+#include "../nmealib/nmea/tok.h"
 #define GPS_UART_BUS 		2
 #define GPS_UART_TIMEOUT	1.0
 #define GPS_BUFFER_SIZE		128
+#define NMEA_MAX_SENTENCE	82	// longest legal sentence excluding $ and *hh
+#define NMEA_MAX_FIELDS		24
+#define GPS_FIX_READ_TRIES	8
+#define KNOTS_TO_MS			0.514444
+
+// u-blox UBX binary protocol
+#define UBX_SYNC1			0xB5
+#define UBX_SYNC2			0x62
+#define UBX_MAX_PAYLOAD		100	// NAV-PVT is 92, longer messages are skipped
+#define UBX_CLASS_NAV		0x01
+#define UBX_CLASS_ACK		0x05
+#define UBX_CLASS_CFG		0x06
+#define UBX_NAV_DOP			0x04
+#define UBX_NAV_DOP_LEN		18
+#define UBX_NAV_PVT			0x07
+#define UBX_NAV_PVT_LEN		92
+#define UBX_ACK_NAK			0x00
+#define UBX_ACK_ACK			0x01
+#define UBX_CFG_PRT			0x00
+#define UBX_CFG_MSG			0x01
+#define UBX_CFG_RATE		0x08
+#define UBX_ACK_TIMEOUT_US	500000
 
 /*******************************************************************************
 * Local Global Variables
@@ -23,17 +44,72 @@
 int running;
 int is_new_gps_data;
 int is_gps_active_flag;
-pthread_t gps_listener_thread;
+int gps_fd = -1;		// uart fd registered with the reactor
+int gps_timer = -1;		// reactor timer marking the gps inactive on silence
+int gps_sentence_mask = GPS_SENTENCE_GGA|GPS_SENTENCE_RMC|GPS_SENTENCE_VTG;
+
+// incremental NMEA parser state, fed one byte at a time by gps_read_func
+typedef enum nmea_state_t{
+	NMEA_WAIT_START,
+	NMEA_BODY,
+	NMEA_CHECKSUM_HI,
+	NMEA_CHECKSUM_LO
+} nmea_state_t;
+
+nmea_state_t nmea_state;
+char nmea_buf[NMEA_MAX_SENTENCE+1];
+int nmea_len;
+uint8_t nmea_sum, nmea_expected;
+uint64_t nmea_start_micros;
 
-//NMEA Structs
-nmeaINFO info;
-nmeaPARSER parser;
-nmeaPOS dpos;
+// fix being assembled from sentences, published whole to the slots below
+gps_fix_t working_fix;
+int gps_baud;
+
+// incremental UBX parser state, fed alongside the NMEA parser
+typedef enum ubx_state_t{
+	UBX_WAIT_SYNC1,
+	UBX_WAIT_SYNC2,
+	UBX_HEADER,
+	UBX_PAYLOAD,
+	UBX_CK_A,
+	UBX_CK_B
+} ubx_state_t;
+
+ubx_state_t ubx_state;
+uint8_t ubx_header[4];	// class, id, length low, length high
+uint8_t ubx_payload[UBX_MAX_PAYLOAD];
+int ubx_len, ubx_pos;
+uint8_t ubx_ck_a, ubx_ck_b;
+uint64_t ubx_start_micros;
+
+// last ACK or NAK seen by the listener, class<<8|id of the acked message
+volatile int ubx_last_ack;
+volatile int ubx_last_nak;
+
+// seqlock double buffer of fixes written only by gps_read_func
+typedef struct gps_fix_slot_t{
+	volatile uint32_t lock;	// odd while the slot is being written
+	gps_fix_t fix;
+} gps_fix_slot_t;
+gps_fix_slot_t gps_fix_slots[2];
+volatile uint64_t newest_gps_fix;
 
 /*******************************************************************************
 * Local Function Declarations
 *******************************************************************************/
-void* gps_listener(void *ptr); //background thread
+void gps_read_func(int fd, uint32_t events, void* arg); // reactor callbacks
+void gps_timeout_func(int fd, uint32_t events, void* arg);
+int nmea_stream_byte(char c, uint64_t now);
+int nmea_process_sentence();
+int hex_digit(char c);
+double gps_atof(char* field);
+double nmea_to_degrees(char* field, char* hemisphere);
+void publish_gps_fix();
+int ubx_stream_byte(uint8_t c, uint64_t now);
+int ubx_process_message();
+int ubx_send(uint8_t class, uint8_t id, int len, uint8_t* payload);
+int ubx_send_and_wait_ack(uint8_t class, uint8_t id, int len, uint8_t* payload);
 
 /*******************************************************************************
 * int initialize_gps(int baud)
@@ -48,112 +124,586 @@ int initialize_gps(int baud){
 		printf("Error, failed to initialize UART%d for GPS\n", GPS_UART_BUS);
 		return -1;
 	}
+	// wake on any bytes so sentences are parsed as they stream in
+	set_uart_read_min(GPS_UART_BUS, 1);
 	
-	pthread_create(&gps_listener_thread, NULL, gps_listener, (void*) NULL);
+	gps_baud = baud;
+	ubx_state = UBX_WAIT_SYNC1;
 	is_new_gps_data = 0;
+	newest_gps_fix = 0;
+	memset(&working_fix, 0, sizeof(working_fix));
+	nmea_state = NMEA_WAIT_START;
+	is_gps_active_flag = 0;
+	
+	// flush the hardware buffer then let the reactor thread feed the parser
+	flush_uart(GPS_UART_BUS);
+	gps_fd = get_uart_fd(GPS_UART_BUS);
+	gps_timer = reactor_add_timer(0, REACTOR_PRIORITY_LOW, gps_timeout_func,\
+																	NULL);
+	if(gps_timer<0 || reactor_add_fd(gps_fd, POLLIN, REACTOR_PRIORITY_NORMAL,\
+											gps_read_func, NULL)<0){
+		printf("ERROR: failed to register GPS with the reactor\n");
+		if(gps_timer>=0) reactor_remove_fd(gps_timer);
+		gps_timer = -1;
+		gps_fd = -1;
+		return -1;
+	}
+	running = 1;
 
 	#ifdef DEBUG
-	printf("GPS Thread Started\n");
+	printf("GPS listener registered\n");
 	#endif
 	
 	return 0;
 }
 
+/*******************************************************************************
+* int set_gps_sentence_mask(int mask)
+* 
+* selects which of GPS_SENTENCE_GGA, GPS_SENTENCE_RMC, and GPS_SENTENCE_VTG 
+* are decoded. All other sentences are checksummed and dropped.
+*******************************************************************************/
+int set_gps_sentence_mask(int mask){
+	if(mask & ~(GPS_SENTENCE_GGA|GPS_SENTENCE_RMC|GPS_SENTENCE_VTG)){
+		printf("ERROR: invalid gps sentence mask\n");
+		return -1;
+	}
+	gps_sentence_mask = mask;
+	return 0;
+}
 
+/*******************************************************************************
+* int get_gps_fix(gps_fix_t* fix)
+* 
+* Copies the most recently published fix. Safe to call from any thread at any
+* time. Returns 0 on success or -1 if no subscribed sentence has arrived yet.
+*******************************************************************************/
+int get_gps_fix(gps_fix_t* fix){
+	uint64_t n;
+	uint32_t before, after;
+	gps_fix_slot_t* slot;
+	int i;
+	
+	for(i=0;i<GPS_FIX_READ_TRIES;i++){
+		n = newest_gps_fix;
+		if(n==0) return -1;
+		__sync_synchronize();
+		slot = &gps_fix_slots[n&1];
+		before = slot->lock;
+		if(before&1) continue; // writer in progress
+		__sync_synchronize();
+		*fix = slot->fix;
+		__sync_synchronize();
+		after = slot->lock;
+		if(before!=after || fix->seq!=n) continue;
+		is_new_gps_data = 0;
+		return 0;
+	}
+	return -1;
+}
 
+/*******************************************************************************
+* int is_gps_active()
+* 
+* returns 1 if bytes have arrived from the GPS within GPS_UART_TIMEOUT,
+* otherwise 0.
+*******************************************************************************/
+int is_gps_active(){
+	return is_gps_active_flag;
+}
 
 /*******************************************************************************
-* @ void* gps_listener(void *ptr)
+* @ void gps_read_func(int fd, uint32_t events, void* arg)
 * 
-* This is a local function that is started as a background thread by 
-* initialize_gps(). This monitors the serial port and interprets data
-* for each packet.
+* Reactor callback registered by initialize_gps(). Reads whatever is buffered
+* and feeds it through the incremental NMEA and UBX parsers so nothing is 
+* allocated or copied beyond the one sentence being assembled. Each read also
+* pushes back the inactivity timer.
 *******************************************************************************/
-void* gps_listener(void *ptr){
-	char buf[GPS_BUFFER_SIZE]; // large serial buffer to catch doubled up packets
-	int ret;
+void gps_read_func(int fd, uint32_t events, void* arg){
+	char buf[GPS_BUFFER_SIZE];
+	int i, ret;
+	uint64_t now;
 	
+	ret = read(fd, buf, GPS_BUFFER_SIZE);
+	if(ret<0){ //error
+		if(errno==EINTR || errno==EAGAIN) return;
+		printf("ERROR reading uart %d\n", GPS_UART_BUS);
+		printf("stopping gps listener\n");
+		stop_gps_service();
+		return;
+	}
+	if(ret==0) return;
+	now = micros_since_boot();
+	is_gps_active_flag = 1;
+	reactor_set_timer(gps_timer, GPS_UART_TIMEOUT, 0);
+	
+	#ifdef DEBUG
+		printf("GPS read %d bytes\n", ret);
+	#endif
+	
+	// NMEA and UBX can be interleaved on the same port. Both carry
+	// checksums so neither parser is fooled by the other's bytes
+	for(i=0;i<ret;i++){
+		if(nmea_stream_byte(buf[i], now)==1 && nmea_process_sentence()==1){
+			publish_gps_fix();
+		}
+		if(ubx_stream_byte((uint8_t)buf[i], now)==1 && \
+										ubx_process_message()==1){
+			publish_gps_fix();
+		}
+	}
+	return;
+}
 
-	//Zero out NMEA settings
-    nmea_zero_INFO(&info);
-    nmea_parser_init(&parser);
+/*******************************************************************************
+* @ void gps_timeout_func(int fd, uint32_t events, void* arg)
+* 
+* Reactor timer callback, fires when nothing has arrived for GPS_UART_TIMEOUT.
+*******************************************************************************/
+void gps_timeout_func(int fd, uint32_t events, void* arg){
+	#ifdef DEBUG
+		printf("GPS Timeout\n");
+	#endif
+	is_gps_active_flag=0; // indicate connection is no longer active
+	return;
+}
 
-    // flush the hardware buffer
-	flush_uart(GPS_UART_BUS);
+/*******************************************************************************
+* int nmea_stream_byte(char c, uint64_t now)
+* 
+* Advances the parser state machine by one byte. The sentence body between $
+* and * is kept in nmea_buf while its checksum is accumulated. Returns 1 when
+* a complete sentence with a valid checksum is ready in nmea_buf, otherwise 0.
+* Any $ restarts the parser so a corrupted sentence costs at most itself.
+*******************************************************************************/
+int nmea_stream_byte(char c, uint64_t now){
+	int d;
 	
-	// running will become 0 when stop_gps_service() is called
-	// or cleanup_cape() will set state to exiting
-	running = 1;
-	while(running && get_state()!=EXITING){
-		memset(&buf, 0, sizeof(buf)); // clear buffer
-		// read the buffer and decide what to do
-		//ret = uart_read_line(GPS_UART_BUS, GPS_BUFFER_SIZE, buf);
-		ret = uart_read_bytes(GPS_UART_BUS, GPS_BUFFER_SIZE, buf);
-		if(ret<0){ //error
-			printf("ERROR reading uart %d\n", GPS_UART_BUS);
-			printf("stopping gps listener\n");
-			running=0;
-			goto END;
+	if(c=='$'){
+		nmea_state = NMEA_BODY;
+		nmea_len = 0;
+		nmea_sum = 0;
+		nmea_start_micros = now;
+		return 0;
+	}
+	switch(nmea_state){
+	case NMEA_BODY:
+		if(c=='*'){
+			nmea_buf[nmea_len] = 0;
+			nmea_state = NMEA_CHECKSUM_HI;
+		}
+		else if(nmea_len>=NMEA_MAX_SENTENCE || c=='\r' || c=='\n'){
+			nmea_state = NMEA_WAIT_START;
 		}
-		else if(ret==0){ //timeout
+		else{
+			nmea_buf[nmea_len++] = c;
+			nmea_sum ^= (uint8_t)c;
+		}
+		return 0;
+	case NMEA_CHECKSUM_HI:
+		d = hex_digit(c);
+		if(d<0) nmea_state = NMEA_WAIT_START;
+		else{
+			nmea_expected = d<<4;
+			nmea_state = NMEA_CHECKSUM_LO;
+		}
+		return 0;
+	case NMEA_CHECKSUM_LO:
+		nmea_state = NMEA_WAIT_START;
+		d = hex_digit(c);
+		if(d<0) return 0;
+		nmea_expected |= d;
+		if(nmea_expected!=nmea_sum){
 			#ifdef DEBUG
-				printf("GPS Timeout\n");
+			printf("NMEA checksum mismatch\n");
 			#endif
-			is_gps_active_flag=0; // indicate connection is no longer active
-			continue;
+			return 0;
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*******************************************************************************
+* int nmea_process_sentence()
+* 
+* Splits the sentence in nmea_buf into fields in place and copies any non-empty
+* fields of a subscribed GGA, RMC, or VTG sentence into working_fix. The talker
+* id (GP, GN, GL...) is ignored. Returns 1 if working_fix changed, 0 otherwise.
+*******************************************************************************/
+int nmea_process_sentence(){
+	char* f[NMEA_MAX_FIELDS];
+	char* p;
+	int n = 0;
+	char* type;
+	
+	// point at each field and terminate it in place
+	f[n++] = nmea_buf;
+	for(p=nmea_buf; *p && n<NMEA_MAX_FIELDS; p++){
+		if(*p==','){
+			*p = 0;
+			f[n++] = p+1;
 		}
-		
-		#ifdef DEBUG
-			printf("GPS read %d bytes, ", ret);
-		#endif
-		
-		//Parse raw NMEA Data
-        nmea_parse(&parser, buf, ret, &info);
+	}
+	if(strlen(f[0])!=5) return 0;
+	type = &f[0][2];
+	
+	if((gps_sentence_mask&GPS_SENTENCE_GGA) && strcmp(type,"GGA")==0){
+		if(n<10) return 0;
+		if(*f[1]) working_fix.utc_time = gps_atof(f[1]);
+		if(*f[2] && *f[4]){
+			working_fix.lat = nmea_to_degrees(f[2], f[3]);
+			working_fix.lon = nmea_to_degrees(f[4], f[5]);
+		}
+		if(*f[6]) working_fix.fix_quality = atoi(f[6]);
+		if(*f[7]) working_fix.satellites = atoi(f[7]);
+		if(*f[8]) working_fix.hdop = gps_atof(f[8]);
+		if(*f[9]) working_fix.altitude_m = gps_atof(f[9]);
+	}
+	else if((gps_sentence_mask&GPS_SENTENCE_RMC) && strcmp(type,"RMC")==0){
+		if(n<10) return 0;
+		if(*f[1]) working_fix.utc_time = gps_atof(f[1]);
+		working_fix.valid = (*f[2]=='A');
+		if(*f[3] && *f[5]){
+			working_fix.lat = nmea_to_degrees(f[3], f[4]);
+			working_fix.lon = nmea_to_degrees(f[5], f[6]);
+		}
+		if(*f[7]) working_fix.speed_ms = gps_atof(f[7])*KNOTS_TO_MS;
+		if(*f[8]) working_fix.course_deg = gps_atof(f[8]);
+		if(*f[9]) working_fix.utc_date = atoi(f[9]);
+	}
+	else if((gps_sentence_mask&GPS_SENTENCE_VTG) && strcmp(type,"VTG")==0){
+		if(n<8) return 0;
+		if(*f[1]) working_fix.course_deg = gps_atof(f[1]);
+		if(*f[7]) working_fix.speed_ms = gps_atof(f[7])/3.6;
+		else if(*f[5]) working_fix.speed_ms = gps_atof(f[5])*KNOTS_TO_MS;
+	}
+	else return 0;
+	
+	working_fix.timestamp_micros = nmea_start_micros;
+	return 1;
+}
+
+/*******************************************************************************
+* int hex_digit(char c)
+* 
+* returns the value of an uppercase or lowercase hex digit, -1 if not one.
+*******************************************************************************/
+int hex_digit(char c){
+	if(c>='0' && c<='9') return c-'0';
+	if(c>='A' && c<='F') return c-'A'+10;
+	if(c>='a' && c<='f') return c-'a'+10;
+	return -1;
+}
 
-        //Converts lat and long data in .info struct to radians 
-        nmea_info2pos(&info, &dpos);
+/*******************************************************************************
+* double gps_atof(char* field)
+* 
+* nmealib's conversion, digits are accumulated as an integer and scaled once
+* which gives the same result as atof for NMEA fields without going through
+* strtod's locale and exponent handling.
+*******************************************************************************/
+double gps_atof(char* field){
+	return nmea_atof(field, strlen(field));
+}
 
-        printf("Lat: %f, Lon: %f, Sig: %d, Fix: %d\n", info.lat, info.lon, info.sig, info.fix);
+/*******************************************************************************
+* double nmea_to_degrees(char* field, char* hemisphere)
+* 
+* converts NMEA ddmm.mmmm or dddmm.mmmm to signed decimal degrees, negative
+* for the S and W hemispheres. Degrees and minutes are split on the digits
+* rather than by dividing the whole field by 100, so no rounding from the
+* division ends up in the minutes.
+*******************************************************************************/
+double nmea_to_degrees(char* field, char* hemisphere){
+	char* dot = strchr(field, '.');
+	int len = (dot==NULL) ? (int)strlen(field) : (int)(dot-field);
+	double out;
+	if(len<2) return 0.0;
+	out = nmea_atoi(field, len-2, 10) + gps_atof(field+len-2)/60.0;
+	if(*hemisphere=='S' || *hemisphere=='W') out = -out;
+	return out;
+}
 
-        is_new_gps_data = 1;
-        is_gps_active_flag = 1;
+/*******************************************************************************
+* void publish_gps_fix()
+* 
+* Copies working_fix into the slot readers are not looking at. Only called
+* from gps_read_func so there is a single writer.
+*******************************************************************************/
+void publish_gps_fix(){
+	uint64_t n = newest_gps_fix + 1;
+	gps_fix_slot_t* slot = &gps_fix_slots[n&1];
+	
+	slot->lock++;
+	__sync_synchronize();
+	working_fix.seq = n;
+	slot->fix = working_fix;
+	__sync_synchronize();
+	slot->lock++;
+	
+	// only now let readers know the fix exists
+	__sync_synchronize();
+	newest_gps_fix = n;
+	is_new_gps_data = 1;
+}
 
-END: ;
+/*******************************************************************************
+* int configure_gps_ubx(int rate_hz)
+* 
+* Switches a u-blox receiver on the GPS port to UBX-only output at the current
+* baud rate, enables NAV-PVT once per navigation solution, and sets the 
+* navigation rate. NAV-PVT is 100 bytes on the wire against roughly 150 for
+* the GGA, RMC, and VTG sentences it replaces. Must be called after 
+* initialize_gps since the listener thread collects the acknowledgements.
+* Returns 0 once all three settings are acknowledged, -1 otherwise.
+*******************************************************************************/
+int configure_gps_ubx(int rate_hz){
+	uint8_t prt[20], msg[3], rate[6];
+	uint16_t meas_ms;
+	
+	if(!running){
+		printf("ERROR: call initialize_gps before configure_gps_ubx\n");
+		return -1;
+	}
+	if(rate_hz<1 || rate_hz>25){
+		printf("ERROR: gps nav rate must be between 1 & 25 hz\n");
+		return -1;
+	}
+	
+	// UART1: 8N1 at the current baud, accept UBX+NMEA, output UBX only
+	memset(prt, 0, sizeof(prt));
+	prt[0] = 1;
+	prt[4] = 0xD0;
+	prt[5] = 0x08;
+	prt[8]  = gps_baud & 0xFF;
+	prt[9]  = (gps_baud>>8) & 0xFF;
+	prt[10] = (gps_baud>>16) & 0xFF;
+	prt[11] = (gps_baud>>24) & 0xFF;
+	prt[12] = 0x03;
+	prt[14] = 0x01;
+	if(ubx_send_and_wait_ack(UBX_CLASS_CFG, UBX_CFG_PRT, 20, prt)<0){
+		printf("ERROR: gps did not acknowledge UBX port config\n");
+		return -1;
 	}
+	
+	// NAV-PVT every navigation solution on the current port
+	msg[0] = UBX_CLASS_NAV;
+	msg[1] = UBX_NAV_PVT;
+	msg[2] = 1;
+	if(ubx_send_and_wait_ack(UBX_CLASS_CFG, UBX_CFG_MSG, 3, msg)<0){
+		printf("ERROR: gps did not acknowledge NAV-PVT enable\n");
+		return -1;
+	}
+	
+	// NAV-DOP for hDOP, which NAV-PVT doesn't carry
+	msg[1] = UBX_NAV_DOP;
+	if(ubx_send_and_wait_ack(UBX_CLASS_CFG, UBX_CFG_MSG, 3, msg)<0){
+		printf("ERROR: gps did not acknowledge NAV-DOP enable\n");
+		return -1;
+	}
+	
+	// measurement period in ms, one nav solution per measurement, GPS time
+	meas_ms = 1000/rate_hz;
+	rate[0] = meas_ms & 0xFF;
+	rate[1] = meas_ms >> 8;
+	rate[2] = 1;
+	rate[3] = 0;
+	rate[4] = 1;
+	rate[5] = 0;
+	if(ubx_send_and_wait_ack(UBX_CLASS_CFG, UBX_CFG_RATE, 6, rate)<0){
+		printf("ERROR: gps did not acknowledge nav rate\n");
+		return -1;
+	}
+	return 0;
+}
 
-	#ifdef DEBUG
-		printf("exiting gps_listener_thread\n");
-	#endif
+/*******************************************************************************
+* int ubx_send(uint8_t class, uint8_t id, int len, uint8_t* payload)
+* 
+* frames a UBX message with sync bytes, length, and Fletcher checksum and 
+* writes it to the GPS port.
+*******************************************************************************/
+int ubx_send(uint8_t class, uint8_t id, int len, uint8_t* payload){
+	char frame[UBX_MAX_PAYLOAD+8];
+	uint8_t a = 0, b = 0;
+	int i;
+	
+	if(len>UBX_MAX_PAYLOAD) return -1;
+	frame[0] = UBX_SYNC1;
+	frame[1] = UBX_SYNC2;
+	frame[2] = class;
+	frame[3] = id;
+	frame[4] = len & 0xFF;
+	frame[5] = len >> 8;
+	memcpy(&frame[6], payload, len);
+	for(i=2;i<len+6;i++){
+		a += (uint8_t)frame[i];
+		b += a;
+	}
+	frame[len+6] = a;
+	frame[len+7] = b;
+	if(uart_send_bytes(GPS_UART_BUS, len+8, frame)!=len+8) return -1;
+	return 0;
+}
 
-	return NULL;
+/*******************************************************************************
+* int ubx_send_and_wait_ack(uint8_t class, uint8_t id, int len, uint8_t* payload)
+* 
+* sends a UBX message and waits up to UBX_ACK_TIMEOUT_US for the listener to 
+* see the matching ACK-ACK. Returns 0 on ACK, -1 on NAK or timeout.
+*******************************************************************************/
+int ubx_send_and_wait_ack(uint8_t class, uint8_t id, int len, uint8_t* payload){
+	int key = (class<<8)|id;
+	uint64_t start;
+	
+	ubx_last_ack = -1;
+	ubx_last_nak = -1;
+	if(ubx_send(class, id, len, payload)<0) return -1;
+	start = micros_since_boot();
+	while(micros_since_boot()-start < UBX_ACK_TIMEOUT_US){
+		if(ubx_last_ack==key) return 0;
+		if(ubx_last_nak==key) return -1;
+		usleep(1000);
+	}
+	return -1;
 }
 
 /*******************************************************************************
-* @ int stop_gps_service()
+* int ubx_stream_byte(uint8_t c, uint64_t now)
 * 
-* signals the serial_parser_thread to stop and allows up to 1 second for the 
-* thread to  shut down before returning.
+* Advances the UBX parser state machine by one byte, accumulating the 
+* checksum over class, id, length, and payload. Returns 1 when a complete
+* message with a valid checksum is in ubx_header and ubx_payload, otherwise 0.
+* Messages longer than UBX_MAX_PAYLOAD are checksummed but not stored.
 *******************************************************************************/
-int stop_gps_service(){
-	int ret = 0;
-	
-	if (running){
-		running = 0; // this tells serial_parser_thread loop to stop
-		// allow up to 1.5 seconds for thread cleanup
-		timespec thread_timeout;
-		clock_gettime(CLOCK_REALTIME, &thread_timeout);
-		timespec_add(&thread_timeout, 1.5);
-		int thread_err = 0;
-		thread_err = pthread_timedjoin_np(gps_listener_thread, NULL, 
-															   &thread_timeout);
-		if(thread_err == ETIMEDOUT){
-			printf("WARNING: gps_listener_thread exit timeout\n");
-			ret = -1;
+int ubx_stream_byte(uint8_t c, uint64_t now){
+	switch(ubx_state){
+	case UBX_WAIT_SYNC1:
+		if(c==UBX_SYNC1) ubx_state = UBX_WAIT_SYNC2;
+		return 0;
+	case UBX_WAIT_SYNC2:
+		if(c==UBX_SYNC2){
+			ubx_state = UBX_HEADER;
+			ubx_pos = 0;
+			ubx_ck_a = 0;
+			ubx_ck_b = 0;
+			ubx_start_micros = now;
+		}
+		else if(c!=UBX_SYNC1) ubx_state = UBX_WAIT_SYNC1;
+		return 0;
+	case UBX_HEADER:
+		ubx_header[ubx_pos++] = c;
+		ubx_ck_a += c;
+		ubx_ck_b += ubx_ck_a;
+		if(ubx_pos==4){
+			ubx_len = ubx_header[2] | (ubx_header[3]<<8);
+			ubx_pos = 0;
+			if(ubx_len==0) ubx_state = UBX_CK_A;
+			else ubx_state = UBX_PAYLOAD;
 		}
+		return 0;
+	case UBX_PAYLOAD:
+		if(ubx_pos<UBX_MAX_PAYLOAD) ubx_payload[ubx_pos] = c;
+		ubx_pos++;
+		ubx_ck_a += c;
+		ubx_ck_b += ubx_ck_a;
+		if(ubx_pos==ubx_len) ubx_state = UBX_CK_A;
+		return 0;
+	case UBX_CK_A:
+		if(c==ubx_ck_a) ubx_state = UBX_CK_B;
+		else ubx_state = UBX_WAIT_SYNC1;
+		return 0;
+	case UBX_CK_B:
+		ubx_state = UBX_WAIT_SYNC1;
+		if(c!=ubx_ck_b){
+			#ifdef DEBUG
+			printf("UBX checksum mismatch\n");
+			#endif
+			return 0;
+		}
+		return (ubx_len<=UBX_MAX_PAYLOAD);
+	default:
+		ubx_state = UBX_WAIT_SYNC1;
+		return 0;
+	}
+}
+
+/*******************************************************************************
+* int ubx_process_message()
+* 
+* Handles a complete UBX message. ACK and NAK are recorded for 
+* ubx_send_and_wait_ack and NAV-PVT is decoded into working_fix. Returns 1 if
+* working_fix changed, 0 otherwise. The receiver sends an epoch's messages in
+* id order so NAV-DOP only stores hDOP, the NAV-PVT after it publishes it.
+*******************************************************************************/
+int ubx_process_message(){
+	uint8_t* p = ubx_payload;
+	uint8_t class = ubx_header[0];
+	uint8_t id = ubx_header[1];
+	int32_t nano;
+	
+	if(class==UBX_CLASS_ACK && ubx_len==2){
+		if(id==UBX_ACK_ACK) ubx_last_ack = (p[0]<<8)|p[1];
+		else if(id==UBX_ACK_NAK) ubx_last_nak = (p[0]<<8)|p[1];
+		return 0;
+	}
+	
+	#define U16(o) ((uint16_t)(p[o]|(p[o+1]<<8)))
+	if(class==UBX_CLASS_NAV && id==UBX_NAV_DOP && ubx_len==UBX_NAV_DOP_LEN){
+		working_fix.hdop = U16(12)*0.01;
+		return 0;
 	}
+	if(class!=UBX_CLASS_NAV || id!=UBX_NAV_PVT || ubx_len!=UBX_NAV_PVT_LEN){
+		return 0;
+	}
+	
+	#define I32(o) ((int32_t)((uint32_t)p[o]|((uint32_t)p[o+1]<<8)|\
+							((uint32_t)p[o+2]<<16)|((uint32_t)p[o+3]<<24)))
+	nano = I32(16);
+	working_fix.utc_date = p[7]*10000 + p[6]*100 + (U16(4)%100);
+	working_fix.utc_time = p[8]*10000 + p[9]*100 + p[10] + nano*1e-9;
+	working_fix.fix_type = p[20];
+	working_fix.valid = p[21]&0x01;			// gnssFixOK
+	if(!working_fix.valid) working_fix.fix_quality = 0;
+	else if(p[21]&0x02) working_fix.fix_quality = 2;	// diffSoln
+	else working_fix.fix_quality = 1;
+	working_fix.satellites = p[23];
+	// divide rather than scale since 1e7 is exact as a float constant
+	working_fix.lon = (double)I32(24)/10000000.0;
+	working_fix.lat = (double)I32(28)/10000000.0;
+	working_fix.altitude_m = I32(36)*1e-3;
+	working_fix.h_acc_m = (uint32_t)I32(40)*1e-3;
+	working_fix.v_acc_m = (uint32_t)I32(44)*1e-3;
+	working_fix.vel_ned[0] = I32(48)*1e-3;
+	working_fix.vel_ned[1] = I32(52)*1e-3;
+	working_fix.vel_ned[2] = I32(56)*1e-3;
+	working_fix.speed_ms = I32(60)*1e-3;
+	working_fix.course_deg = I32(64)*1e-5;
+	#undef U16
+	#undef I32
 	
-	running = 0;
-	return ret;
+	working_fix.timestamp_micros = ubx_start_micros;
+	return 1;
+}
+
+/*******************************************************************************
+* @ int stop_gps_service()
+* 
+* unregisters the GPS callbacks from the reactor. The uart stays open.
+*******************************************************************************/
+int stop_gps_service(){
+	if(running){
+		running = 0;
+		reactor_remove_fd(gps_fd);
+		reactor_remove_fd(gps_timer);
+		gps_fd = -1;
+		gps_timer = -1;
+		is_gps_active_flag = 0;
+	}
+	return 0;
 }
 
 
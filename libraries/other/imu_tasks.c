@@ -0,0 +1,203 @@
+/*******************************************************************************
+* imu_tasks.c
+*
+* Cyclic executive driven by the IMU. Tasks are registered with a divisor of
+* the IMU rate and run_imu_tasks, set as the IMU interrupt function, calls
+* each one on its ticks in registration order. Everything then runs in one
+* thread with a fixed phase relative to the IMU sample, so loops at
+* different rates share state without locks. Tasks of the same divisor are
+* put on different ticks where possible so slow work is spread out rather
+* than landing on the same sample.
+*
+* Timing is kept per task in the same single writer seqlock style as the IMU
+* sample ring so any thread can read it without blocking the executive.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+
+#define IMU_TASK_READ_TRIES	8
+
+typedef struct imu_task_t{
+	char name[IMU_TASK_NAME_LEN];
+	int divisor;
+	int phase;
+	uint32_t budget_us;
+	int (*func)(void);
+	volatile uint32_t lock;	// odd while stats are being written
+	imu_task_stats_t stats;
+} imu_task_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+imu_task_t imu_tasks[IMU_MAX_TASKS];
+int imu_task_count = 0;
+uint64_t imu_task_tick = 0;
+uint64_t imu_task_last_seq = 0;
+volatile int imu_task_reset_requested = 0;
+
+/*******************************************************************************
+* int add_imu_task(const char* name, int divisor, int (*func)(void),
+*														uint32_t budget_us)
+*
+* Registers func to run every divisor IMU samples. Returns the task's id for
+* get_imu_task_stats or -1 on error. Register everything before the IMU
+* starts calling run_imu_tasks, the table is not locked.
+*******************************************************************************/
+int add_imu_task(const char* name, int divisor, int (*func)(void), \
+														uint32_t budget_us){
+	imu_task_t* t;
+	int i, same = 0;
+
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to imu task\n");
+		return -1;
+	}
+	if(divisor<1){
+		printf("ERROR: imu task divisor must be at least 1\n");
+		return -1;
+	}
+	if(imu_task_count>=IMU_MAX_TASKS){
+		printf("ERROR: at most %d imu tasks\n", IMU_MAX_TASKS);
+		return -1;
+	}
+	// spread tasks sharing a divisor over its ticks
+	for(i=0;i<imu_task_count;i++){
+		if(imu_tasks[i].divisor==divisor) same++;
+	}
+	t = &imu_tasks[imu_task_count];
+	memset(t, 0, sizeof(imu_task_t));
+	strncpy(t->name, name ? name : "", IMU_TASK_NAME_LEN-1);
+	t->divisor = divisor;
+	t->phase = same%divisor;
+	t->budget_us = budget_us;
+	t->func = func;
+	t->stats.min_us = UINT32_MAX;
+	return imu_task_count++;
+}
+
+/*******************************************************************************
+* int run_imu_tasks()
+*
+* Pass to set_imu_interrupt_func. Runs the tasks due on this sample and
+* times each of them. A task whose run takes longer than its budget counts as
+* an overrun, a negative return counts as an error. Both are only recorded,
+* the schedule never skips a task. The tick moves on by however many samples
+* were published since the last call, the IMU only calls this for the newest
+* of a late batch, and a task whose tick fell inside the batch runs once now.
+*******************************************************************************/
+int run_imu_tasks(){
+	imu_task_t* t;
+	imu_sample_t sample;
+	uint64_t start, n = 1;
+	uint32_t us;
+	int i, ret;
+
+	if(get_latest_imu_sample(&sample)==0){
+		// a restarted IMU counts from the start again
+		if(imu_task_last_seq && sample.seq>imu_task_last_seq){
+			n = sample.seq - imu_task_last_seq;
+		}
+		imu_task_last_seq = sample.seq;
+	}
+
+	if(imu_task_reset_requested){
+		for(i=0;i<imu_task_count;i++){
+			t = &imu_tasks[i];
+			t->lock++;
+			__sync_synchronize();
+			memset(&t->stats, 0, sizeof(imu_task_stats_t));
+			t->stats.min_us = UINT32_MAX;
+			__sync_synchronize();
+			t->lock++;
+		}
+		imu_task_reset_requested = 0;
+	}
+	for(i=0;i<imu_task_count;i++){
+		t = &imu_tasks[i];
+		// due if one of the ticks tick..tick+n-1 lands on its phase
+		if((t->phase + t->divisor - imu_task_tick%t->divisor)%t->divisor \
+															>= n) continue;
+		start = micros_since_boot();
+		ret = t->func();
+		us = micros_since_boot() - start;
+
+		t->lock++;
+		__sync_synchronize();
+		t->stats.runs++;
+		t->stats.sum_us += us;
+		t->stats.last_us = us;
+		if(us < t->stats.min_us) t->stats.min_us = us;
+		if(us > t->stats.max_us) t->stats.max_us = us;
+		if(t->budget_us && us > t->budget_us){
+			t->stats.overruns++;
+			metric_add(METRIC_IMU_TASK_OVERRUNS, 1);
+		}
+		if(ret<0){
+			t->stats.errors++;
+			metric_add(METRIC_IMU_TASK_ERRORS, 1);
+		}
+		__sync_synchronize();
+		t->lock++;
+	}
+	imu_task_tick += n;
+	return 0;
+}
+
+/*******************************************************************************
+* int get_imu_task_stats(int id, imu_task_stats_t* stats)
+*
+* Consistent copy of one task's timing. Returns -1 for a bad id or if the
+* executive kept writing through IMU_TASK_READ_TRIES attempts.
+*******************************************************************************/
+int get_imu_task_stats(int id, imu_task_stats_t* stats){
+	uint32_t before, after;
+	int i;
+
+	if(id<0 || id>=imu_task_count){
+		printf("ERROR: invalid imu task id\n");
+		return -1;
+	}
+	for(i=0;i<IMU_TASK_READ_TRIES;i++){
+		before = imu_tasks[id].lock;
+		if(before&1) continue;
+		__sync_synchronize();
+		*stats = imu_tasks[id].stats;
+		__sync_synchronize();
+		after = imu_tasks[id].lock;
+		if(before==after) return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int reset_imu_task_stats()
+*
+* zeroes the stats of every task at the start of the next tick
+*******************************************************************************/
+int reset_imu_task_stats(){
+	imu_task_reset_requested = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int print_imu_task_stats()
+*******************************************************************************/
+int print_imu_task_stats(){
+	imu_task_stats_t s;
+	int i;
+
+	printf("%-16s %4s %10s %8s %8s %8s %8s %8s\n", "task", "div", "runs", \
+					"avg_us", "min_us", "max_us", "overrun", "errors");
+	for(i=0;i<imu_task_count;i++){
+		if(get_imu_task_stats(i, &s)<0) continue;
+		printf("%-16s %4d %10llu %8llu %8u %8u %8llu %8llu\n", \
+			imu_tasks[i].name, imu_tasks[i].divisor, \
+			(unsigned long long)s.runs, \
+			(unsigned long long)(s.runs ? s.sum_us/s.runs : 0), \
+			s.runs ? s.min_us : 0, s.max_us, \
+			(unsigned long long)s.overruns, (unsigned long long)s.errors);
+	}
+	return 0;
+}
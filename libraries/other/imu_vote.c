@@ -0,0 +1,461 @@
+/*******************************************************************************
+* imu_vote.c
+*
+* Redundancy layer over two or three MPU9250s running in DMP mode. Each IMU's
+* interrupt function parks its newest sample here and once every healthy IMU
+* has delivered one they are aligned to a common time and voted into a
+* single imu_data_t for the user's function.
+*
+* Samples are aligned to the oldest of the set by interpolating the later
+* ones between their previous and newest sample, so the vote compares the
+* same instant rather than whatever each IMU last read. The accel, gyro and
+* magnetometer vectors are then voted per axis: the median of three, the mean
+* of two. A sensor further than the tolerance from the vote for fault_samples
+* samples in a row, or missing from that many votes, is excluded until it
+* agrees again for recover_samples. Two IMUs can only detect a disagreement,
+* not tell which one is wrong, so while they disagree the first one listed
+* is passed on alone and the vote counts as degraded.
+*
+* DMP attitude and the raw readings come from whichever healthy IMU was
+* closest to the vote so quaternions are never averaged. IMU interrupt
+* threads run concurrently, the vote is done under one mutex by whichever
+* thread completes the set and the user function runs there too.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+
+typedef struct imu_vote_input_t{
+	imu_handle_t* imu;
+	imu_sample_t prev, newest;
+	int have_prev;
+	int pending;	// newest hasn't been voted on yet
+	int bad_run;	// consecutive votes it disagreed with or missed
+	int good_run;	// consecutive votes it agreed with
+} imu_vote_input_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+imu_vote_input_t imu_vote_in[IMU_VOTE_MAX];
+imu_vote_config_t imu_vote_conf;
+imu_vote_status_t imu_vote_stat;
+imu_sample_t imu_vote_newest;
+imu_data_t* imu_vote_data_ptr = NULL;
+int (*imu_vote_func)(void) = NULL;
+int imu_vote_running = 0;
+pthread_mutex_t imu_vote_mutex = PTHREAD_MUTEX_INITIALIZER;
+// orders the user function's calls, never held together with imu_vote_mutex
+// so the function can read the vote back
+pthread_mutex_t imu_vote_func_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t imu_vote_delivered;	// seq of the last vote handed to the user
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int imu_vote_handler();
+int run_imu_vote(imu_sample_t* voted);
+void deliver_imu_votes(imu_sample_t* voted, int n, int (*func)(void));
+void align_imu_vote_sample(imu_vote_input_t* in, uint64_t t, imu_data_t* out);
+float imu_vote_axis(float* v, int n);
+
+/*******************************************************************************
+* imu_vote_config_t get_default_imu_vote_config()
+*******************************************************************************/
+imu_vote_config_t get_default_imu_vote_config(){
+	imu_vote_config_t conf;
+	conf.gyro_tolerance = 10.0;
+	conf.accel_tolerance = 1.5;
+	conf.fault_samples = 20;
+	conf.recover_samples = 200;
+	conf.max_skew_us = 2500;
+	return conf;
+}
+
+/*******************************************************************************
+* int start_imu_vote(imu_handle_t** imus, int n, imu_vote_config_t conf,
+*															imu_data_t* data)
+*
+* Every IMU must already be running in DMP mode at the same sample rate.
+* Takes over each one's interrupt function, a NULL entry is the on-board
+* IMU. The calling thread's IMU selection is left as it was.
+*******************************************************************************/
+int start_imu_vote(imu_handle_t** imus, int n, imu_vote_config_t conf, \
+															imu_data_t* data){
+	imu_handle_t* caller;
+	int i, j;
+
+	if(imu_vote_running){
+		printf("ERROR: imu vote already running\n");
+		return -1;
+	}
+	if(n<2 || n>IMU_VOTE_MAX){
+		printf("ERROR: imu vote needs between 2 and %d IMUs\n", IMU_VOTE_MAX);
+		return -1;
+	}
+	if(data==NULL){
+		printf("ERROR: imu vote needs a data struct to write into\n");
+		return -1;
+	}
+	if(conf.gyro_tolerance<=0 || conf.accel_tolerance<=0 || \
+				conf.fault_samples<1 || conf.recover_samples<1){
+		printf("ERROR: imu vote tolerances and sample counts must be >0\n");
+		return -1;
+	}
+	caller = get_selected_imu();
+	select_imu(NULL);
+	for(i=0;i<n;i++){
+		if(imus[i]==NULL) imus[i] = get_selected_imu();
+	}
+	select_imu(caller);
+	for(i=0;i<n;i++){
+		for(j=0;j<i;j++){
+			if(imus[i]==imus[j]){
+				printf("ERROR: imu vote was given the same IMU twice\n");
+				return -1;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&imu_vote_mutex);
+	memset(imu_vote_in, 0, sizeof(imu_vote_in));
+	memset(&imu_vote_stat, 0, sizeof(imu_vote_stat));
+	memset(&imu_vote_newest, 0, sizeof(imu_vote_newest));
+	imu_vote_delivered = 0;
+	for(i=0;i<n;i++){
+		imu_vote_in[i].imu = imus[i];
+		imu_vote_stat.healthy[i] = 1;
+	}
+	imu_vote_stat.n = n;
+	imu_vote_conf = conf;
+	imu_vote_data_ptr = data;
+	imu_vote_running = 1;
+	pthread_mutex_unlock(&imu_vote_mutex);
+
+	for(i=0;i<n;i++){
+		select_imu(imus[i]);
+		set_imu_interrupt_func(&imu_vote_handler);
+	}
+	select_imu(caller);
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_imu_vote()
+*
+* Gives the IMUs back with no interrupt function set.
+*******************************************************************************/
+int stop_imu_vote(){
+	imu_handle_t* caller;
+	int i;
+	if(!imu_vote_running) return 0;
+	caller = get_selected_imu();
+	for(i=0;i<imu_vote_stat.n;i++){
+		select_imu(imu_vote_in[i].imu);
+		stop_imu_interrupt_func();
+	}
+	select_imu(caller);
+	pthread_mutex_lock(&imu_vote_mutex);
+	imu_vote_running = 0;
+	pthread_mutex_unlock(&imu_vote_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int set_imu_vote_func(int (*func)(void))
+*
+* Called after every vote with the result in the data struct given to
+* start_imu_vote. NULL removes it.
+*******************************************************************************/
+int set_imu_vote_func(int (*func)(void)){
+	pthread_mutex_lock(&imu_vote_mutex);
+	imu_vote_func = func;
+	pthread_mutex_unlock(&imu_vote_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int get_latest_imu_vote_sample(imu_sample_t* sample)
+*
+* Copy of the newest vote with its aligned timestamp and a sequence number
+* counting votes. Returns -1 if there hasn't been one yet.
+*******************************************************************************/
+int get_latest_imu_vote_sample(imu_sample_t* sample){
+	int ret = -1;
+	pthread_mutex_lock(&imu_vote_mutex);
+	if(imu_vote_newest.seq){
+		*sample = imu_vote_newest;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&imu_vote_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int get_imu_vote_status(imu_vote_status_t* status)
+*******************************************************************************/
+int get_imu_vote_status(imu_vote_status_t* status){
+	pthread_mutex_lock(&imu_vote_mutex);
+	*status = imu_vote_stat;
+	pthread_mutex_unlock(&imu_vote_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int print_imu_vote_status()
+*******************************************************************************/
+int print_imu_vote_status(){
+	imu_vote_status_t s;
+	int i;
+	get_imu_vote_status(&s);
+	printf("imu vote: %llu votes, %llu degraded\n", \
+			(unsigned long long)s.votes, (unsigned long long)s.degraded);
+	printf("imu healthy  faults  missed  gyro err  accel err\n");
+	for(i=0;i<s.n;i++){
+		printf("%3d %7s %7llu %7llu %9.3f %10.3f\n", i, \
+				s.healthy[i] ? "yes" : "NO", \
+				(unsigned long long)s.faults[i], \
+				(unsigned long long)s.missed[i], \
+				s.gyro_error[i], s.accel_error[i]);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int imu_vote_handler()
+*
+* Interrupt function of every voted IMU. Works out which IMU fired from the
+* thread's selection. A second sample from an IMU before the rest caught up
+* means one of them is late or dead, so the vote goes ahead without it.
+*******************************************************************************/
+int imu_vote_handler(){
+	imu_handle_t* imu = get_selected_imu();
+	imu_vote_input_t* in = NULL;
+	imu_sample_t s;
+	imu_sample_t voted[2];	// a handler runs at most two votes
+	int (*func)(void);
+	int i, ready, nv = 0;
+
+	if(get_latest_imu_sample(&s)<0) return -1;
+	pthread_mutex_lock(&imu_vote_mutex);
+	if(!imu_vote_running){
+		pthread_mutex_unlock(&imu_vote_mutex);
+		return 0;
+	}
+	for(i=0;i<imu_vote_stat.n;i++){
+		if(imu_vote_in[i].imu==imu) in = &imu_vote_in[i];
+	}
+	if(in==NULL || s.seq==in->newest.seq){
+		pthread_mutex_unlock(&imu_vote_mutex);
+		return 0;
+	}
+	if(in->pending) nv += run_imu_vote(&voted[nv]);
+	if(in->newest.seq){
+		in->prev = in->newest;
+		in->have_prev = 1;
+	}
+	in->newest = s;
+	in->pending = 1;
+
+	ready = 1;
+	for(i=0;i<imu_vote_stat.n;i++){
+		if(imu_vote_stat.healthy[i] && !imu_vote_in[i].pending) ready = 0;
+	}
+	if(ready) nv += run_imu_vote(&voted[nv]);
+	func = imu_vote_func;
+	pthread_mutex_unlock(&imu_vote_mutex);
+	if(nv) deliver_imu_votes(voted, nv, func);
+	return 0;
+}
+
+/*******************************************************************************
+* int run_imu_vote(imu_sample_t* voted)
+*
+* Votes the pending samples and updates each IMU's health. Call with
+* imu_vote_mutex held. Returns 1 with the result copied to voted, 0 if there
+* was nothing to vote on.
+*******************************************************************************/
+int run_imu_vote(imu_sample_t* voted){
+	imu_data_t aligned[IMU_VOTE_MAX];
+	int used[IMU_VOTE_MAX], voter[IMU_VOTE_MAX];
+	float v[IMU_VOTE_MAX], ref_a[3], ref_g[3], ref_m[3];
+	float gerr, aerr, best = INFINITY, temp = 0;
+	uint64_t t = UINT64_MAX;
+	imu_vote_input_t* in;
+	imu_data_t out;
+	int i, j, n = imu_vote_stat.n, h = 0, ref = -1, split, bad;
+
+	for(i=0;i<n;i++){
+		if(imu_vote_in[i].pending && imu_vote_in[i].newest.timestamp_micros<t){
+			t = imu_vote_in[i].newest.timestamp_micros;
+		}
+	}
+	if(t==UINT64_MAX) return 0;
+
+	// align everything to the oldest sample, later ones stay pending if
+	// they can't be brought back that far
+	for(i=0;i<n;i++){
+		in = &imu_vote_in[i];
+		used[i] = 0;
+		if(!in->pending) continue;
+		if(in->newest.timestamp_micros-t > imu_vote_conf.max_skew_us && \
+			!(in->have_prev && in->prev.timestamp_micros<=t)) continue;
+		align_imu_vote_sample(in, t, &aligned[i]);
+		used[i] = 1;
+		in->pending = 0;
+		if(imu_vote_stat.healthy[i]) voter[h++] = i;
+	}
+	if(h==0) return 0;
+
+	for(j=0;j<3;j++){
+		for(i=0;i<h;i++) v[i] = aligned[voter[i]].accel[j];
+		ref_a[j] = imu_vote_axis(v, h);
+		for(i=0;i<h;i++) v[i] = aligned[voter[i]].gyro[j];
+		ref_g[j] = imu_vote_axis(v, h);
+		for(i=0;i<h;i++) v[i] = aligned[voter[i]].mag[j];
+		ref_m[j] = imu_vote_axis(v, h);
+	}
+
+	// two voters far apart can't be told apart, pass the first one on
+	split = 0;
+	if(h==2){
+		for(j=0;j<3;j++){
+			if(fabsf(aligned[voter[0]].gyro[j]-aligned[voter[1]].gyro[j]) > \
+								2.0f*imu_vote_conf.gyro_tolerance) split = 1;
+			if(fabsf(aligned[voter[0]].accel[j]-aligned[voter[1]].accel[j]) > \
+								2.0f*imu_vote_conf.accel_tolerance) split = 1;
+		}
+	}
+	if(split){
+		imu_vote_stat.degraded++;
+		for(j=0;j<3;j++){
+			ref_a[j] = aligned[voter[0]].accel[j];
+			ref_g[j] = aligned[voter[0]].gyro[j];
+			ref_m[j] = aligned[voter[0]].mag[j];
+		}
+	}
+
+	// judge every IMU against the vote, excluded ones included so they can
+	// earn their way back
+	for(i=0;i<n;i++){
+		in = &imu_vote_in[i];
+		if(!used[i]){
+			if(imu_vote_stat.healthy[i]) imu_vote_stat.missed[i]++;
+			bad = 1;
+		}
+		else{
+			gerr = aerr = 0;
+			for(j=0;j<3;j++){
+				gerr = fmaxf(gerr, fabsf(aligned[i].gyro[j]-ref_g[j]));
+				aerr = fmaxf(aerr, fabsf(aligned[i].accel[j]-ref_a[j]));
+			}
+			imu_vote_stat.gyro_error[i] = gerr;
+			imu_vote_stat.accel_error[i] = aerr;
+			bad = gerr>imu_vote_conf.gyro_tolerance || \
+									aerr>imu_vote_conf.accel_tolerance;
+			if(imu_vote_stat.healthy[i] && (!split || i==voter[0])){
+				gerr = gerr/imu_vote_conf.gyro_tolerance + \
+									aerr/imu_vote_conf.accel_tolerance;
+				if(gerr<best){
+					best = gerr;
+					ref = i;
+				}
+			}
+			// a split says nothing about either voter, an excluded IMU
+			// agreeing with the first one is still evidence
+			if(split && imu_vote_stat.healthy[i]) continue;
+		}
+		if(bad){
+			in->good_run = 0;
+			in->bad_run++;
+			if(imu_vote_stat.healthy[i] && \
+					in->bad_run>=imu_vote_conf.fault_samples){
+				imu_vote_stat.healthy[i] = 0;
+				imu_vote_stat.faults[i]++;
+			}
+		}
+		else{
+			in->bad_run = 0;
+			in->good_run++;
+			if(!imu_vote_stat.healthy[i] && \
+					in->good_run>=imu_vote_conf.recover_samples){
+				imu_vote_stat.healthy[i] = 1;
+			}
+		}
+	}
+	if(ref<0) ref = voter[0];
+
+	out = aligned[ref];
+	for(j=0;j<3;j++){
+		out.accel[j] = ref_a[j];
+		out.gyro[j] = ref_g[j];
+		out.mag[j] = ref_m[j];
+	}
+	for(i=0;i<h;i++) temp += aligned[voter[i]].temp;
+	out.temp = temp/h;
+
+	imu_vote_stat.reference = ref;
+	imu_vote_stat.votes++;
+	imu_vote_newest.seq = imu_vote_stat.votes;
+	imu_vote_newest.timestamp_micros = t;
+	imu_vote_newest.data = out;
+	*voted = imu_vote_newest;
+	return 1;
+}
+
+/*******************************************************************************
+* void deliver_imu_votes(imu_sample_t* voted, int n, int (*func)(void))
+*
+* Writes each vote to the user's data struct and runs their function, without
+* imu_vote_mutex held. Votes from several IMU threads go out one at a time
+* and in order, one that lost the race to a newer vote is skipped.
+*******************************************************************************/
+void deliver_imu_votes(imu_sample_t* voted, int n, int (*func)(void)){
+	int i;
+	pthread_mutex_lock(&imu_vote_func_mutex);
+	for(i=0;i<n;i++){
+		if(voted[i].seq<=imu_vote_delivered) continue;
+		imu_vote_delivered = voted[i].seq;
+		*imu_vote_data_ptr = voted[i].data;
+		if(func!=NULL) func();
+	}
+	pthread_mutex_unlock(&imu_vote_func_mutex);
+}
+
+/*******************************************************************************
+* void align_imu_vote_sample(imu_vote_input_t* in, uint64_t t, imu_data_t* out)
+*
+* The newest sample with its vectors interpolated back to time t when the
+* previous sample comes before t.
+*******************************************************************************/
+void align_imu_vote_sample(imu_vote_input_t* in, uint64_t t, imu_data_t* out){
+	const imu_data_t* a = &in->prev.data;
+	const imu_data_t* b = &in->newest.data;
+	uint64_t t0 = in->prev.timestamp_micros;
+	uint64_t t1 = in->newest.timestamp_micros;
+	float f;
+	int j;
+
+	*out = *b;
+	if(!in->have_prev || t1<=t || t0>t || t1<=t0) return;
+	f = (float)(t1-t)/(float)(t1-t0);
+	for(j=0;j<3;j++){
+		out->accel[j] = b->accel[j] + f*(a->accel[j]-b->accel[j]);
+		out->gyro[j] = b->gyro[j] + f*(a->gyro[j]-b->gyro[j]);
+		out->mag[j] = b->mag[j] + f*(a->mag[j]-b->mag[j]);
+	}
+}
+
+/*******************************************************************************
+* float imu_vote_axis(float* v, int n)
+*
+* Median of three, mean of two.
+*******************************************************************************/
+float imu_vote_axis(float* v, int n){
+	float lo, hi;
+	if(n==1) return v[0];
+	if(n==2) return 0.5f*(v[0]+v[1]);
+	lo = fminf(v[0], v[1]);
+	hi = fmaxf(v[0], v[1]);
+	return fmaxf(lo, fminf(hi, v[2]));
+}
@@ -0,0 +1,255 @@
+/*******************************************************************************
+* latency_trace.c
+*
+* Per loop trace of the control path from the IMU interrupt edge to the
+* motor or servo write it leads to. The IMU handler opens a loop in a ring
+* at every edge and each trace point after that records how long after the
+* edge it was first reached. Points can be hit from the interrupt thread,
+* the callback worker or any thread writing actuators, so each is claimed
+* with a compare and swap and never written twice.
+*
+* Times come from CLOCK_MONOTONIC through nanos_since_boot, the ARM cycle
+* counter isn't readable from user space without a kernel module. Opening a
+* loop follows the single writer seqlock pattern of the IMU sample ring so
+* readers copy whole loops without blocking the handler.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "latency_trace.h"
+
+#define TRACE_DEFAULT_LOOPS	4096
+#define TRACE_READ_TRIES	8
+
+typedef struct trace_slot_t{
+	volatile uint32_t lock;	// odd while the loop is being opened
+	latency_trace_loop_t loop;
+} trace_slot_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+trace_slot_t* trace_ring = NULL;
+uint64_t trace_mask;
+volatile uint64_t trace_newest = 0;
+volatile int trace_en = 0;
+const char* trace_point_names[TRACE_POINTS] = {
+	"edge", "wake", "read done", "fusion done", "callback start", \
+	"callback end", "actuator"
+};
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int read_trace_slot(uint64_t seq, latency_trace_loop_t* loop);
+int compare_trace_ns(const void* a, const void* b);
+
+/*******************************************************************************
+* int start_latency_trace(int loops)
+*
+* Allocates a ring for the last loops loops, rounded up to a power of two,
+* 0 for the default, and starts tracing. The ring is kept after
+* stop_latency_trace so it can still be read and is reused by the next start
+* unless the size changes.
+*******************************************************************************/
+int start_latency_trace(int loops){
+	uint64_t n = 1;
+	if(trace_en){
+		printf("ERROR: latency trace already running\n");
+		return -1;
+	}
+	if(loops<0){
+		printf("ERROR: latency trace length must be positive\n");
+		return -1;
+	}
+	if(loops==0) loops = TRACE_DEFAULT_LOOPS;
+	while(n<(uint64_t)loops) n <<= 1;
+	if(trace_ring==NULL || n!=trace_mask+1){
+		free(trace_ring);
+		trace_ring = (trace_slot_t*)calloc(n, sizeof(trace_slot_t));
+		if(trace_ring==NULL){
+			printf("ERROR: failed to allocate latency trace\n");
+			return -1;
+		}
+		trace_mask = n-1;
+	}
+	else memset(trace_ring, 0, n*sizeof(trace_slot_t));
+	trace_newest = 0;
+	__sync_synchronize();
+	trace_en = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_latency_trace()
+*******************************************************************************/
+int stop_latency_trace(){
+	trace_en = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* void trace_loop_begin(uint64_t edge_ns)
+*
+* Called by the IMU handler once per interrupt with the edge time, which is
+* time zero for every point of the loop.
+*******************************************************************************/
+void trace_loop_begin(uint64_t edge_ns){
+	trace_slot_t* s;
+	uint64_t seq;
+	int i;
+	if(!trace_en) return;
+	seq = trace_newest+1;
+	s = &trace_ring[seq&trace_mask];
+	s->lock++;
+	__sync_synchronize();
+	s->loop.seq = seq;
+	s->loop.edge_ns = edge_ns;
+	s->loop.ns[TRACE_EDGE] = 0;
+	for(i=1;i<TRACE_POINTS;i++) s->loop.ns[i] = TRACE_NOT_REACHED;
+	__sync_synchronize();
+	s->lock++;
+	__sync_synchronize();
+	trace_newest = seq;
+}
+
+/*******************************************************************************
+* int trace_point(trace_point_t p)
+*
+* Marks p as reached in the newest loop if it wasn't already. Costs one load
+* while tracing is off. The library marks everything but a user can mark
+* TRACE_ACTUATOR for actuators it drives itself.
+*******************************************************************************/
+int trace_point(trace_point_t p){
+	trace_slot_t* s;
+	uint64_t seq, d;
+	if(!trace_en) return 0;
+	if(p<=TRACE_EDGE || p>=TRACE_POINTS) return -1;
+	seq = trace_newest;
+	if(seq==0) return 0;
+	s = &trace_ring[seq&trace_mask];
+	d = nanos_since_boot() - s->loop.edge_ns;
+	if(d>=TRACE_NOT_REACHED) d = TRACE_NOT_REACHED-1;
+	__sync_bool_compare_and_swap(&s->loop.ns[p], TRACE_NOT_REACHED, \
+																(uint32_t)d);
+	return 0;
+}
+
+/*******************************************************************************
+* int get_latency_trace(uint64_t seq, latency_trace_loop_t* buf, int max)
+*
+* Copies up to max finished loops after loop number seq into buf, oldest
+* first, and returns how many. Pass 0 for everything still in the ring and
+* the seq of the last loop returned to continue from there. The newest loop
+* may still be collecting points so it is left for the next call.
+*******************************************************************************/
+int get_latency_trace(uint64_t seq, latency_trace_loop_t* buf, int max){
+	uint64_t last, first;
+	int n = 0;
+	if(trace_ring==NULL || max<=0) return 0;
+	last = trace_newest;
+	if(last<2) return 0;
+	last--;
+	first = seq+1;
+	// the newest loop has taken the slot of the one trace_mask before it
+	if(last+1>trace_mask && first<last+1-trace_mask){
+		first = last+1-trace_mask;
+	}
+	for(; first<=last && n<max; first++){
+		if(read_trace_slot(first, &buf[n])==0) n++;
+	}
+	return n;
+}
+
+/*******************************************************************************
+* int get_latency_trace_summary(latency_trace_summary_t* sum)
+*
+* Percentiles of each point's time after the edge over every finished loop
+* in the ring, counting only loops that reached that point.
+*******************************************************************************/
+int get_latency_trace_summary(latency_trace_summary_t* sum){
+	latency_trace_loop_t* loops;
+	uint32_t* v;
+	int i, p, n, m;
+
+	memset(sum, 0, sizeof(latency_trace_summary_t));
+	if(trace_ring==NULL) return 0;
+	loops = (latency_trace_loop_t*)malloc((trace_mask+1)*sizeof(*loops));
+	v = (uint32_t*)malloc((trace_mask+1)*sizeof(uint32_t));
+	if(loops==NULL || v==NULL){
+		printf("ERROR: failed to allocate memory for trace summary\n");
+		free(loops);
+		free(v);
+		return -1;
+	}
+	n = get_latency_trace(0, loops, trace_mask+1);
+	sum->loops = n;
+	for(p=0;p<TRACE_POINTS;p++){
+		m = 0;
+		for(i=0;i<n;i++){
+			if(loops[i].ns[p]!=TRACE_NOT_REACHED) v[m++] = loops[i].ns[p];
+		}
+		sum->count[p] = m;
+		if(m==0) continue;
+		qsort(v, m, sizeof(uint32_t), compare_trace_ns);
+		sum->p50_ns[p] = v[(m-1)*50/100];
+		sum->p90_ns[p] = v[(m-1)*90/100];
+		sum->p99_ns[p] = v[(int)((m-1)*0.99)];
+		sum->p999_ns[p] = v[(int)((m-1)*0.999)];
+		sum->max_ns[p] = v[m-1];
+	}
+	free(loops);
+	free(v);
+	return 0;
+}
+
+/*******************************************************************************
+* int print_latency_trace_summary()
+*******************************************************************************/
+int print_latency_trace_summary(){
+	latency_trace_summary_t s;
+	int p;
+	if(get_latency_trace_summary(&s)<0) return -1;
+	printf("latency from IMU edge over %llu loops, us\n", \
+										(unsigned long long)s.loops);
+	printf("point            loops      p50      p90      p99    p99.9"\
+															"      max\n");
+	for(p=1;p<TRACE_POINTS;p++){
+		printf("%-14s %7llu %8.1f %8.1f %8.1f %8.1f %8.1f\n", \
+				trace_point_names[p], (unsigned long long)s.count[p], \
+				s.p50_ns[p]/1000.0, s.p90_ns[p]/1000.0, s.p99_ns[p]/1000.0, \
+				s.p999_ns[p]/1000.0, s.max_ns[p]/1000.0);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int read_trace_slot(uint64_t seq, latency_trace_loop_t* loop)
+*
+* Consistent copy of loop seq, -1 if it was overwritten or kept changing.
+*******************************************************************************/
+int read_trace_slot(uint64_t seq, latency_trace_loop_t* loop){
+	trace_slot_t* s = &trace_ring[seq&trace_mask];
+	uint32_t before, after;
+	int i;
+	for(i=0;i<TRACE_READ_TRIES;i++){
+		before = s->lock;
+		if(before&1) continue;
+		__sync_synchronize();
+		*loop = s->loop;
+		__sync_synchronize();
+		after = s->lock;
+		if(before!=after) continue;
+		return (loop->seq==seq) ? 0 : -1;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int compare_trace_ns(const void* a, const void* b)
+*******************************************************************************/
+int compare_trace_ns(const void* a, const void* b){
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x>y) - (x<y);
+}
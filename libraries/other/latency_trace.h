@@ -0,0 +1,9 @@
+/*******************************************************************************
+* latency_trace.h
+*
+* Hook between latency_trace.c and the IMU driver. Not part of the public
+* API, see the LATENCY TRACE section of roboticscape.h instead.
+*******************************************************************************/
+
+// opens a new loop in the trace ring with its interrupt edge time
+void trace_loop_begin(uint64_t edge_ns);
@@ -0,0 +1,515 @@
+/*******************************************************************************
+* logger.c
+*
+* Binary telemetry logger. Real-time threads reserve a fixed size slot in a
+* preallocated ring, fill the record in place and commit it, never blocking
+* and never copying through an intermediate buffer. A low priority writer
+* thread drains committed records in order to a file and syncs it
+* periodically. Records are stored back to back as a log_record_header_t
+* followed by its payload after a small file header, see open_log_reader.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include <stddef.h>
+
+#define LOG_MAGIC			"RCLOG\0\0\1"
+#define LOG_VERSION			1
+#ifdef RC_SMALL_MEMORY
+#define LOG_DEFAULT_RING_KB	64
+#define LOG_STAGING_BYTES	16384
+#else
+#define LOG_DEFAULT_RING_KB	256
+#define LOG_STAGING_BYTES	65536
+#endif
+#define LOG_DRAIN_US		10000	// writer wakes this often
+#define LOG_SYNC_US			1000000	// and syncs the file this often
+
+// one ring entry, 128 bytes so slots never straddle cache lines
+typedef struct log_slot_t{
+	volatile uint64_t committed;	// claim index+1 once the record is whole
+	log_record_header_t hdr;
+	uint8_t payload[LOG_MAX_PAYLOAD];
+} log_slot_t;
+
+// written once at the start of every log file
+typedef struct log_file_header_t{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;		// bytes of log_record_header_t
+	uint64_t start_micros;		// micros_since_boot() when logging started
+} log_file_header_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+log_slot_t* log_ring = NULL;
+uint64_t log_ring_mask;
+volatile uint64_t log_head;		// next slot a producer will claim
+volatile uint64_t log_tail;		// next slot the writer will drain
+volatile uint64_t log_drops;
+volatile uint64_t log_written;
+volatile int log_sources;
+volatile int logger_running = 0;
+int log_fd = -1;
+uint8_t* log_staging = NULL;
+pthread_t log_thread;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* log_writer(void* ptr);
+int drain_log_ring();
+int release_log_staging(int used, int staged);
+int write_all(int fd, const uint8_t* buf, int bytes);
+
+/*******************************************************************************
+* int start_logger(const char* path, int ring_kb)
+*
+* Creates or truncates the log file, allocates the ring and starts the writer
+* thread. ring_kb of 0 uses the default.
+*******************************************************************************/
+int start_logger(const char* path, int ring_kb){
+	log_file_header_t fh;
+	uint64_t slots;
+
+	pthread_mutex_lock(&log_mutex);
+	if(logger_running){
+		pthread_mutex_unlock(&log_mutex);
+		printf("ERROR: logger already running\n");
+		return -1;
+	}
+	if(ring_kb<=0) ring_kb = LOG_DEFAULT_RING_KB;
+	// round down to a power of 2 number of slots
+	slots = 1;
+	while(slots*2*sizeof(log_slot_t) <= (uint64_t)ring_kb*1024) slots *= 2;
+
+	log_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(log_fd<0){
+		pthread_mutex_unlock(&log_mutex);
+		printf("ERROR: can't open log file %s\n", path);
+		return -1;
+	}
+	// the last run's ring is only freed here, a producer that raced
+	// stop_logger may still have been writing into it
+	free(log_ring);
+	free(log_staging);
+	log_ring = calloc(slots, sizeof(log_slot_t));
+	log_staging = malloc(LOG_STAGING_BYTES);
+	if(log_ring==NULL || log_staging==NULL){
+		printf("ERROR: failed to allocate log ring\n");
+		goto fail;
+	}
+	log_ring_mask = slots-1;
+	log_head = 0;
+	log_tail = 0;
+	log_drops = 0;
+	log_written = 0;
+
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, LOG_MAGIC, sizeof(fh.magic));
+	fh.version = LOG_VERSION;
+	fh.header_size = sizeof(log_record_header_t);
+	fh.start_micros = micros_since_boot();
+	if(write_all(log_fd, (uint8_t*)&fh, sizeof(fh))<0){
+		printf("ERROR: failed to write log header\n");
+		goto fail;
+	}
+
+	logger_running = 1;
+	if(create_rt_thread(&log_thread, RT_SERVICE_LOGGER, log_writer, NULL)){
+		logger_running = 0;
+		goto fail;
+	}
+	pthread_mutex_unlock(&log_mutex);
+	return 0;
+
+fail:
+	close(log_fd);
+	log_fd = -1;
+	free(log_ring);
+	free(log_staging);
+	log_ring = NULL;
+	log_staging = NULL;
+	pthread_mutex_unlock(&log_mutex);
+	return -1;
+}
+
+/*******************************************************************************
+* int stop_logger()
+*
+* Stops new records, lets the writer drain everything committed, syncs and
+* closes the file. The ring stays allocated until the next start_logger.
+*******************************************************************************/
+int stop_logger(){
+	pthread_mutex_lock(&log_mutex);
+	if(!logger_running){
+		pthread_mutex_unlock(&log_mutex);
+		return 0;
+	}
+	log_sources = 0;
+	logger_running = 0;
+	pthread_join(log_thread, NULL);
+	fsync(log_fd);
+	close(log_fd);
+	log_fd = -1;
+	pthread_mutex_unlock(&log_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int set_logger_sources(int sources) / int get_logger_sources()
+*
+* Which library data streams log themselves automatically, a mask of
+* LOG_SOURCE_* values.
+*******************************************************************************/
+int set_logger_sources(int sources){
+	log_sources = sources;
+	return 0;
+}
+
+int get_logger_sources(){
+	if(!logger_running) return 0;
+	return log_sources;
+}
+
+/*******************************************************************************
+* uint64_t get_logger_drops() / uint64_t get_logger_records()
+*******************************************************************************/
+uint64_t get_logger_drops(){
+	return log_drops;
+}
+
+uint64_t get_logger_records(){
+	return log_written;
+}
+
+/*******************************************************************************
+* void* log_reserve(uint16_t type, uint16_t length, uint64_t timestamp_micros)
+*
+* Claims the next slot without locking. Returns a pointer to length bytes of
+* payload to fill in place, or NULL if the logger isn't running, the record is
+* too long, or the ring is full in which case the drop is counted. A
+* timestamp of 0 stamps the record now.
+*******************************************************************************/
+void* log_reserve(uint16_t type, uint16_t length, uint64_t timestamp_micros){
+	log_slot_t* slot;
+	uint64_t h;
+
+	if(!logger_running || length>LOG_MAX_PAYLOAD) return NULL;
+	do{
+		h = log_head;
+		if(h-log_tail > log_ring_mask){
+			__sync_fetch_and_add(&log_drops, 1);
+			metric_add(METRIC_LOGGER_DROPS, 1);
+			return NULL;
+		}
+	}while(!__sync_bool_compare_and_swap(&log_head, h, h+1));
+
+	slot = &log_ring[h&log_ring_mask];
+	slot->hdr.type = type;
+	slot->hdr.length = length;
+	slot->hdr.seq = (uint32_t)h;
+	if(timestamp_micros==0) timestamp_micros = micros_since_boot();
+	slot->hdr.timestamp_micros = timestamp_micros;
+	return slot->payload;
+}
+
+/*******************************************************************************
+* int log_commit(void* payload)
+*
+* Hands a reserved record to the writer. payload must be the pointer returned
+* by log_reserve.
+*******************************************************************************/
+int log_commit(void* payload){
+	log_slot_t* slot;
+	if(payload==NULL) return -1;
+	slot = (log_slot_t*)((uint8_t*)payload - offsetof(log_slot_t, payload));
+	__sync_synchronize();
+	slot->committed = (uint64_t)slot->hdr.seq + 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int log_write(uint16_t type, const void* data, uint16_t length,
+*												uint64_t timestamp_micros)
+*
+* reserve, copy and commit in one call for records already built elsewhere.
+*******************************************************************************/
+int log_write(uint16_t type, const void* data, uint16_t length, \
+												uint64_t timestamp_micros){
+	void* p = log_reserve(type, length, timestamp_micros);
+	if(p==NULL) return -1;
+	memcpy(p, data, length);
+	return log_commit(p);
+}
+
+/*******************************************************************************
+* record packers shared with the telemetry publisher
+*******************************************************************************/
+int pack_log_imu_record(log_imu_record_t* r, const imu_data_t* data){
+	memcpy(r->accel, data->accel, sizeof(r->accel));
+	memcpy(r->gyro, data->gyro, sizeof(r->gyro));
+	memcpy(r->mag, data->mag, sizeof(r->mag));
+	r->temp = data->temp;
+	memcpy(r->dmp_quat, data->dmp_quat, sizeof(r->dmp_quat));
+	memcpy(r->dmp_TaitBryan, data->dmp_TaitBryan, sizeof(r->dmp_TaitBryan));
+	memcpy(r->fused_quat, data->fused_quat, sizeof(r->fused_quat));
+	memcpy(r->fused_TaitBryan, data->fused_TaitBryan, \
+											sizeof(r->fused_TaitBryan));
+	r->compass_heading = data->compass_heading;
+	r->compass_heading_raw = data->compass_heading_raw;
+	return 0;
+}
+
+int pack_log_motor_record(log_motor_record_t* r, const float duty[4], \
+																	int mask){
+	int i;
+	for(i=0;i<4;i++) r->duty[i] = (mask&(1<<i)) ? duty[i] : 0;
+	r->mask = mask;
+	return 0;
+}
+
+int pack_log_dsm_record(log_dsm_record_t* r, const dsm_frame_t* frame){
+	int i;
+	r->frame_count = (uint32_t)frame->frame_count;
+	r->num_channels = frame->num_channels;
+	r->resolution = frame->resolution;
+	r->reserved = 0;
+	for(i=0;i<DSM_MAX_CHANNELS;i++){
+		r->raw[i] = frame->raw[i];
+		r->normalized[i] = frame->normalized[i];
+	}
+	return 0;
+}
+
+int pack_log_battery_record(log_battery_record_t* r, \
+											const battery_status_t* status){
+	r->v_pack = status->v_pack;
+	r->v_jack = status->v_jack;
+	r->cell_voltage = status->cell_voltage;
+	r->num_cells = status->num_cells;
+	r->pack_connected = status->pack_connected;
+	r->charging = status->charging;
+	return 0;
+}
+
+/*******************************************************************************
+* typed records for the library's own data
+*******************************************************************************/
+int log_imu_data(const imu_data_t* data, uint64_t timestamp_micros){
+	log_imu_record_t* r;
+	r = log_reserve(LOG_RECORD_IMU, sizeof(log_imu_record_t), timestamp_micros);
+	if(r==NULL) return -1;
+	pack_log_imu_record(r, data);
+	return log_commit(r);
+}
+
+int log_motor_duties(const float duty[4], int mask){
+	log_motor_record_t* r;
+	r = log_reserve(LOG_RECORD_MOTOR, sizeof(log_motor_record_t), 0);
+	if(r==NULL) return -1;
+	pack_log_motor_record(r, duty, mask);
+	return log_commit(r);
+}
+
+int log_dsm_frame(const dsm_frame_t* frame){
+	log_dsm_record_t* r;
+	r = log_reserve(LOG_RECORD_DSM, sizeof(log_dsm_record_t), \
+												frame->timestamp_micros);
+	if(r==NULL) return -1;
+	pack_log_dsm_record(r, frame);
+	return log_commit(r);
+}
+
+int log_encoders(const int pos[4], uint64_t timestamp_micros){
+	log_encoder_record_t* r;
+	int i;
+	r = log_reserve(LOG_RECORD_ENCODER, sizeof(log_encoder_record_t), \
+														timestamp_micros);
+	if(r==NULL) return -1;
+	for(i=0;i<4;i++) r->pos[i] = pos[i];
+	return log_commit(r);
+}
+
+int log_adc_raw(const int raw[8], uint64_t timestamp_micros){
+	log_adc_record_t* r;
+	int i;
+	r = log_reserve(LOG_RECORD_ADC, sizeof(log_adc_record_t), timestamp_micros);
+	if(r==NULL) return -1;
+	for(i=0;i<8;i++) r->raw[i] = raw[i];
+	return log_commit(r);
+}
+
+int log_battery_status(const battery_status_t* status){
+	log_battery_record_t* r;
+	r = log_reserve(LOG_RECORD_BATTERY, sizeof(log_battery_record_t), \
+												status->timestamp_micros);
+	if(r==NULL) return -1;
+	pack_log_battery_record(r, status);
+	return log_commit(r);
+}
+
+/*******************************************************************************
+* int open_log_reader(log_reader_t* reader, const char* path)
+*
+* Opens a log written by the logger and checks its header.
+*******************************************************************************/
+int open_log_reader(log_reader_t* reader, const char* path){
+	log_file_header_t fh;
+
+	reader->fp = fopen(path, "rb");
+	if(reader->fp==NULL){
+		printf("ERROR: can't open log %s\n", path);
+		return -1;
+	}
+	if(fread(&fh, sizeof(fh), 1, reader->fp)!=1 || \
+				memcmp(fh.magic, LOG_MAGIC, sizeof(fh.magic)) || \
+				fh.header_size!=sizeof(log_record_header_t)){
+		printf("ERROR: %s is not a robotics cape log\n", path);
+		fclose(reader->fp);
+		reader->fp = NULL;
+		return -1;
+	}
+	reader->version = fh.version;
+	reader->start_micros = fh.start_micros;
+	reader->records = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int read_log_record(log_reader_t* reader, log_record_header_t* hdr,
+*												void* payload, int max_bytes)
+*
+* Reads the next record into hdr and payload. Returns 1 if a record was read,
+* 0 at the end of the log, or -1 if the record is truncated or longer than
+* max_bytes.
+*******************************************************************************/
+int read_log_record(log_reader_t* reader, log_record_header_t* hdr, \
+												void* payload, int max_bytes){
+	if(reader->fp==NULL) return -1;
+	if(fread(hdr, sizeof(*hdr), 1, reader->fp)!=1) return 0;
+	if(hdr->length>max_bytes || hdr->length>LOG_MAX_PAYLOAD){
+		printf("ERROR: log record %u too long\n", hdr->seq);
+		return -1;
+	}
+	if(hdr->length && fread(payload, hdr->length, 1, reader->fp)!=1){
+		return -1;
+	}
+	reader->records++;
+	return 1;
+}
+
+/*******************************************************************************
+* int close_log_reader(log_reader_t* reader)
+*******************************************************************************/
+int close_log_reader(log_reader_t* reader){
+	if(reader->fp!=NULL) fclose(reader->fp);
+	reader->fp = NULL;
+	return 0;
+}
+
+/*******************************************************************************
+* void* log_writer(void* ptr)
+*
+* Background thread draining the ring every LOG_DRAIN_US and syncing the file
+* every LOG_SYNC_US so a crash or power loss costs at most about a second.
+* Also logs the battery status for LOG_SOURCE_BATTERY since nothing in the
+* program itself produces it.
+*******************************************************************************/
+void* log_writer(void* ptr){
+	battery_status_t bat;
+	uint64_t last_sync = micros_since_boot();
+	uint64_t last_bat = 0;
+	uint64_t now;
+
+	while(logger_running){
+		usleep(LOG_DRAIN_US);
+		drain_log_ring();
+		now = micros_since_boot();
+		if(now-last_sync >= LOG_SYNC_US){
+			fdatasync(log_fd);
+			last_sync = now;
+		}
+		// battery_monitor publishes new readings about once a second, log
+		// each one as it appears
+		if((log_sources&LOG_SOURCE_BATTERY) && read_battery_status(&bat)==0 \
+									&& bat.timestamp_micros!=last_bat){
+			log_battery_status(&bat);
+			last_bat = bat.timestamp_micros;
+		}
+	}
+	// stop_logger cleared logger_running so no new slots get claimed,
+	// wait briefly for any producer still filling one
+	usleep(LOG_DRAIN_US);
+	drain_log_ring();
+	return NULL;
+}
+
+/*******************************************************************************
+* int drain_log_ring()
+*
+* Copies committed records in claim order into the staging buffer and writes
+* it out when full. Stops at the first slot still being filled so the file
+* is always in order. Slots are only released and counted as written once
+* the write has succeeded, after a failed one they are tried again next time
+* and producers see a full ring meanwhile.
+*******************************************************************************/
+int drain_log_ring(){
+	log_slot_t* slot;
+	uint64_t t = log_tail;
+	int used = 0, staged = 0;
+	int bytes;
+
+	while(t!=log_head){
+		slot = &log_ring[t&log_ring_mask];
+		// seq and so committed only hold the low 32 bits of the index
+		if(slot->committed!=(uint64_t)(uint32_t)t+1) break;
+		__sync_synchronize();
+		bytes = sizeof(log_record_header_t) + slot->hdr.length;
+		if(used+bytes > LOG_STAGING_BYTES){
+			if(release_log_staging(used, staged)<0) return -1;
+			used = 0;
+			staged = 0;
+		}
+		memcpy(&log_staging[used], &slot->hdr, bytes);
+		used += bytes;
+		staged++;
+		t++;
+	}
+	if(used && release_log_staging(used, staged)<0) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* int release_log_staging(int used, int staged)
+*
+* Writes the staging buffer and hands the staged slots back to producers.
+*******************************************************************************/
+int release_log_staging(int used, int staged){
+	if(write_all(log_fd, log_staging, used)<0) return -1;
+	log_written += staged;
+	// release the slots to producers only after they are in the file
+	__sync_synchronize();
+	log_tail += staged;
+	return 0;
+}
+
+/*******************************************************************************
+* int write_all(int fd, const uint8_t* buf, int bytes)
+*******************************************************************************/
+int write_all(int fd, const uint8_t* buf, int bytes){
+	int ret;
+	while(bytes>0){
+		ret = write(fd, buf, bytes);
+		if(ret<0){
+			if(errno==EINTR) continue;
+			printf("ERROR: log write failed: %s\n", strerror(errno));
+			return -1;
+		}
+		buf += ret;
+		bytes -= ret;
+	}
+	return 0;
+}
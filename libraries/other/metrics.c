@@ -0,0 +1,317 @@
+/*******************************************************************************
+* metrics.c
+*
+* Registry of named 64 bit counters and gauges that the drivers and user code
+* bump as things happen, readable from outside the process while it runs.
+* The library's own metrics occupy fixed ids so the drivers never look
+* anything up, user metrics are registered after them.
+*
+* Updates are single atomic read-modify-write operations on the value, no
+* locks, so any thread including the IMU interrupt thread can update at any
+* time. Until start_metrics_export is called the table lives in process
+* memory, after that in a POSIX shared memory segment named after the pid
+* which an external agent maps read only and polls. Readers can't use
+* atomics on a read only mapping and a 64 bit load may tear on the Cortex-A8,
+* so a value is read until two loads agree.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include <sys/mman.h>
+
+#define METRICS_SHM_PREFIX	"/roboticscape_metrics."
+#define METRICS_SHM_VERSION	1
+#define METRICS_READ_TRIES	8
+
+typedef struct metric_slot_t{
+	char name[METRIC_NAME_LEN];
+	int32_t type;
+	uint32_t reserved;
+	volatile int64_t value;
+} metric_slot_t;
+
+typedef struct metrics_table_t{
+	uint32_t version;
+	int32_t pid;
+	volatile uint32_t count;	// slots with a name, only ever grows
+	uint32_t reserved;
+	metric_slot_t slots[METRICS_MAX];
+} metrics_table_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+metrics_table_t metrics_local = {
+	.version = METRICS_SHM_VERSION,
+	.count = METRIC_BUILTIN_COUNT,
+	.slots = {
+		[METRIC_I2C_ERRORS]				= {"i2c_errors", METRIC_COUNTER},
+		[METRIC_IMU_READ_FAILURES]		= {"imu_read_failures", METRIC_COUNTER},
+		[METRIC_DMP_FIFO_RESETS]		= {"dmp_fifo_resets", METRIC_COUNTER},
+		[METRIC_DMP_DROPPED_PACKETS]	= {"dmp_dropped_packets",METRIC_COUNTER},
+		[METRIC_IMU_CALLBACK_OVERRUNS]	= {"imu_callback_overruns", \
+															METRIC_COUNTER},
+		[METRIC_IMU_DEADLINE_MISSES]	= {"imu_deadline_misses", \
+															METRIC_COUNTER},
+		[METRIC_IMU_BUDGET_OVERRUNS]	= {"imu_budget_overruns", \
+															METRIC_COUNTER},
+		[METRIC_IMU_TASK_OVERRUNS]		= {"imu_task_overruns", METRIC_COUNTER},
+		[METRIC_IMU_TASK_ERRORS]		= {"imu_task_errors", METRIC_COUNTER},
+		[METRIC_DSM_LOST_PACKETS]		= {"dsm_lost_packets", METRIC_COUNTER},
+		[METRIC_LOGGER_DROPS]			= {"logger_drops", METRIC_COUNTER}
+	}
+};
+metrics_table_t* volatile metrics = &metrics_local;
+pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+char metrics_shm_name[64];
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int64_t read_metric_value(const volatile int64_t* v);
+
+/*******************************************************************************
+* int register_metric(const char* name, metric_type_t type)
+*
+* Adds a metric starting at 0 and returns its id. Registering a name that
+* already exists returns the existing id if the type matches.
+*******************************************************************************/
+int register_metric(const char* name, metric_type_t type){
+	metrics_table_t* t;
+	int i, id;
+	if(name==NULL || name[0]==0 || strlen(name)>=METRIC_NAME_LEN){
+		printf("ERROR: metric name must be 1 to %d characters\n", \
+														METRIC_NAME_LEN-1);
+		return -1;
+	}
+	if(type!=METRIC_COUNTER && type!=METRIC_GAUGE){
+		printf("ERROR: metric type must be METRIC_COUNTER or METRIC_GAUGE\n");
+		return -1;
+	}
+	pthread_mutex_lock(&metrics_mutex);
+	t = metrics;
+	for(i=0;i<(int)t->count;i++){
+		if(strcmp(t->slots[i].name, name)) continue;
+		pthread_mutex_unlock(&metrics_mutex);
+		if(t->slots[i].type!=type){
+			printf("ERROR: metric %s already registered as another type\n", \
+																		name);
+			return -1;
+		}
+		return i;
+	}
+	if(t->count>=METRICS_MAX){
+		pthread_mutex_unlock(&metrics_mutex);
+		printf("ERROR: at most %d metrics\n", METRICS_MAX);
+		return -1;
+	}
+	id = t->count;
+	strcpy(t->slots[id].name, name);
+	t->slots[id].type = type;
+	t->slots[id].value = 0;
+	// readers only look at slots below count
+	__sync_synchronize();
+	t->count = id+1;
+	pthread_mutex_unlock(&metrics_mutex);
+	return id;
+}
+
+/*******************************************************************************
+* void metric_add(int id, int64_t n)
+*******************************************************************************/
+void metric_add(int id, int64_t n){
+	metrics_table_t* t = metrics;
+	if(id<0 || id>=(int)t->count) return;
+	__sync_fetch_and_add(&t->slots[id].value, n);
+}
+
+/*******************************************************************************
+* void metric_set(int id, int64_t value)
+*******************************************************************************/
+void metric_set(int id, int64_t value){
+	metrics_table_t* t = metrics;
+	if(id<0 || id>=(int)t->count) return;
+	__sync_lock_test_and_set(&t->slots[id].value, value);
+}
+
+/*******************************************************************************
+* int64_t get_metric(int id)
+*******************************************************************************/
+int64_t get_metric(int id){
+	metrics_table_t* t = metrics;
+	if(id<0 || id>=(int)t->count) return 0;
+	return __sync_fetch_and_add(&t->slots[id].value, 0);
+}
+
+/*******************************************************************************
+* int start_metrics_export()
+*
+* Moves the table into /dev/shm/roboticscape_metrics.<pid>, readable by
+* everyone and writable only by this process. Updates made while the table
+* moves are carried over to the new copy.
+*******************************************************************************/
+int start_metrics_export(){
+	metrics_table_t* shm;
+	int64_t copied[METRICS_MAX];
+	int fd, i;
+
+	pthread_mutex_lock(&metrics_mutex);
+	if(metrics!=&metrics_local){
+		pthread_mutex_unlock(&metrics_mutex);
+		return 0;
+	}
+	snprintf(metrics_shm_name, sizeof(metrics_shm_name), "%s%d", \
+											METRICS_SHM_PREFIX, (int)getpid());
+	// a segment left by a dead process with our pid may still be mapped by
+	// a reader, truncating it under them would fault them, so start fresh
+	shm_unlink(metrics_shm_name);
+	fd = shm_open(metrics_shm_name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if(fd<0){
+		pthread_mutex_unlock(&metrics_mutex);
+		printf("ERROR: can't create metrics shared memory\n");
+		return -1;
+	}
+	fchmod(fd, 0644); // past the umask
+	if(ftruncate(fd, sizeof(metrics_table_t))<0){
+		close(fd);
+		shm_unlink(metrics_shm_name);
+		pthread_mutex_unlock(&metrics_mutex);
+		printf("ERROR: can't size metrics shared memory\n");
+		return -1;
+	}
+	shm = (metrics_table_t*)mmap(NULL, sizeof(metrics_table_t), \
+							PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm==MAP_FAILED){
+		shm_unlink(metrics_shm_name);
+		pthread_mutex_unlock(&metrics_mutex);
+		printf("ERROR: can't map metrics shared memory\n");
+		return -1;
+	}
+	for(i=0;i<(int)metrics_local.count;i++){
+		copied[i] = get_metric(i);
+		memcpy(shm->slots[i].name, metrics_local.slots[i].name, \
+														METRIC_NAME_LEN);
+		shm->slots[i].type = metrics_local.slots[i].type;
+		shm->slots[i].value = copied[i];
+	}
+	shm->pid = getpid();
+	shm->count = metrics_local.count;
+	__sync_synchronize();
+	shm->version = METRICS_SHM_VERSION;
+	metrics = shm;
+	__sync_synchronize();
+	// counts that landed in the old table after it was copied
+	for(i=0;i<(int)metrics_local.count;i++){
+		if(metrics_local.slots[i].type!=METRIC_COUNTER) continue;
+		__sync_fetch_and_add(&shm->slots[i].value, \
+			__sync_fetch_and_add(&metrics_local.slots[i].value, 0)-copied[i]);
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_metrics_export()
+*
+* Brings the table back into process memory and removes the segment.
+*******************************************************************************/
+int stop_metrics_export(){
+	metrics_table_t* shm;
+	int i;
+	pthread_mutex_lock(&metrics_mutex);
+	shm = metrics;
+	if(shm==&metrics_local){
+		pthread_mutex_unlock(&metrics_mutex);
+		return 0;
+	}
+	for(i=0;i<(int)shm->count;i++){
+		metrics_local.slots[i] = shm->slots[i];
+	}
+	metrics_local.count = shm->count;
+	__sync_synchronize();
+	metrics = &metrics_local;
+	__sync_synchronize();
+	// a thread that loaded the old pointer may be mid update, leave the
+	// mapping in place and only remove the name
+	shm_unlink(metrics_shm_name);
+	pthread_mutex_unlock(&metrics_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int read_process_metrics(int pid, metric_value_t* buf, int max)
+*
+* For monitoring agents. Maps the metrics another process exports, read
+* only, and copies up to max of them into buf. Returns how many or -1 if
+* that process doesn't export metrics.
+*******************************************************************************/
+int read_process_metrics(int pid, metric_value_t* buf, int max){
+	const metrics_table_t* t;
+	struct stat st;
+	char name[64];
+	int fd, i, n;
+
+	snprintf(name, sizeof(name), "%s%d", METRICS_SHM_PREFIX, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd<0) return -1;
+	// the exporter may not have sized it yet, touching past the end faults
+	if(fstat(fd, &st)<0 || st.st_size<(off_t)sizeof(metrics_table_t)){
+		close(fd);
+		return -1;
+	}
+	t = (const metrics_table_t*)mmap(NULL, sizeof(metrics_table_t), \
+										PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(t==MAP_FAILED) return -1;
+	if(t->version!=METRICS_SHM_VERSION){
+		munmap((void*)t, sizeof(metrics_table_t));
+		return -1;
+	}
+	n = t->count;
+	if(n>METRICS_MAX) n = METRICS_MAX;
+	if(n>max) n = max;
+	__sync_synchronize();
+	for(i=0;i<n;i++){
+		memcpy(buf[i].name, t->slots[i].name, METRIC_NAME_LEN);
+		buf[i].name[METRIC_NAME_LEN-1] = 0;
+		buf[i].type = (metric_type_t)t->slots[i].type;
+		buf[i].value = read_metric_value(&t->slots[i].value);
+	}
+	munmap((void*)t, sizeof(metrics_table_t));
+	return n;
+}
+
+/*******************************************************************************
+* int print_metrics()
+*
+* Every metric of this process.
+*******************************************************************************/
+int print_metrics(){
+	metrics_table_t* t = metrics;
+	int i;
+	for(i=0;i<(int)t->count;i++){
+		printf("%-*s %s %lld\n", METRIC_NAME_LEN, t->slots[i].name, \
+				t->slots[i].type==METRIC_GAUGE ? "gauge  " : "counter", \
+				(long long)get_metric(i));
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int64_t read_metric_value(const volatile int64_t* v)
+*
+* Plain loads for a read only mapping, repeated until two agree so a value
+* changing between the two halves isn't returned torn.
+*******************************************************************************/
+int64_t read_metric_value(const volatile int64_t* v){
+	int64_t a, b;
+	int i;
+	a = *v;
+	for(i=0;i<METRICS_READ_TRIES;i++){
+		b = *v;
+		if(a==b) break;
+		a = b;
+	}
+	return a;
+}
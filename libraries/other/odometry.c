@@ -0,0 +1,306 @@
+/*******************************************************************************
+* odometry.c
+*
+* Differential drive dead reckoning from two encoder channels and optionally
+* the IMU's yaw rate. Each update takes one snapshot of all encoder counters
+* from get_encoder_pos_all so both wheels are sampled at the same instant,
+* differences the counts as 32 bit integers so counter wraparound is
+* harmless, and integrates the arc between snapshots at its mid heading.
+* With use_imu_yaw the heading change comes from the gyro instead of the
+* wheel difference, which slips on turns, using the mean of the yaw rate at
+* this and the previous snapshot over the time between them. The yaw rate is
+* interpolated between the IMU samples either side of the encoder snapshot.
+*
+* One thread updates, any thread reads the pose through the same single
+* writer seqlock pattern as the IMU sample ring. Nothing is allocated.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+
+#define ODOMETRY_READ_TRIES	8
+#define ODOMETRY_MAX_DT		1.0	// s, longer gaps only restart integration
+#define ODOMETRY_IMU_SAMPLES	4	// recent IMU samples searched for the time
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+odometry_config_t odo_conf;
+int odo_running = 0;
+int odo_have_prev = 0;
+int odo_prev_left, odo_prev_right;
+uint64_t odo_prev_micros;
+float odo_prev_yaw_rate;
+volatile uint32_t odo_lock = 0;	// odd while the pose is being written
+odometry_pose_t odo_pose;
+volatile int odo_set_requested = 0;
+float odo_set_x, odo_set_y, odo_set_heading;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+float wrap_odometry_heading(float h);
+int imu_yaw_rate_at(uint64_t t, float* yaw_rate);
+
+/*******************************************************************************
+* odometry_config_t get_default_odometry_config()
+*
+* Channels 1 and 2 with 48 count per rev encoders on a 35:1 gearbox driving
+* 80mm wheels 200mm apart, wheels only.
+*******************************************************************************/
+odometry_config_t get_default_odometry_config(){
+	odometry_config_t conf;
+	conf.left_ch = 1;
+	conf.right_ch = 2;
+	conf.left_polarity = 1;
+	conf.right_polarity = 1;
+	conf.counts_per_rev = 48*35;
+	conf.wheel_diameter = 0.08;
+	conf.track_width = 0.2;
+	conf.use_imu_yaw = 0;
+	conf.gyro_polarity = 1;
+	return conf;
+}
+
+/*******************************************************************************
+* int start_odometry(odometry_config_t conf)
+*
+* Checks the configuration and zeros the pose. The first update after this
+* only records where the encoders are.
+*******************************************************************************/
+int start_odometry(odometry_config_t conf){
+	if(conf.left_ch<1 || conf.left_ch>4 || conf.right_ch<1 || \
+												conf.right_ch>4){
+		printf("ERROR: odometry encoder channels must be from 1 to 4\n");
+		return -1;
+	}
+	if(conf.left_ch==conf.right_ch){
+		printf("ERROR: odometry needs two different encoder channels\n");
+		return -1;
+	}
+	if((conf.left_polarity!=1 && conf.left_polarity!=-1) || \
+		(conf.right_polarity!=1 && conf.right_polarity!=-1) || \
+		(conf.gyro_polarity!=1 && conf.gyro_polarity!=-1)){
+		printf("ERROR: odometry polarities must be 1 or -1\n");
+		return -1;
+	}
+	if(conf.counts_per_rev<=0 || conf.wheel_diameter<=0 || \
+												conf.track_width<=0){
+		printf("ERROR: odometry geometry must be positive\n");
+		return -1;
+	}
+	odo_conf = conf;
+	odo_have_prev = 0;
+	odo_set_requested = 0;
+	odo_lock++;
+	__sync_synchronize();
+	memset(&odo_pose, 0, sizeof(odometry_pose_t));
+	__sync_synchronize();
+	odo_lock++;
+	odo_running = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_odometry()
+*
+* The last pose stays readable.
+*******************************************************************************/
+int stop_odometry(){
+	odo_running = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int update_odometry()
+*
+* Samples the encoders and, with use_imu_yaw, the gyro at the time of the
+* encoder snapshot, then integrates. Meant to be called at a steady rate from
+* one thread, for instance as an IMU task.
+*******************************************************************************/
+int update_odometry(){
+	uint64_t t;
+	int pos[4];
+	float yaw_rate = 0;
+	if(!odo_running){
+		report_error("ERROR: odometry not started\n");
+		return -1;
+	}
+	if(get_encoder_pos_all(pos, &t)<0) return -1;
+	if(odo_conf.use_imu_yaw && imu_yaw_rate_at(t, &yaw_rate)<0){
+		report_error("ERROR: odometry has no IMU sample for yaw rate\n");
+		return -1;
+	}
+	return feed_odometry(pos, t, yaw_rate);
+}
+
+/*******************************************************************************
+* int imu_yaw_rate_at(uint64_t t, float* yaw_rate)
+*
+* Gyro z in rad/s at time t, interpolated between the two recent IMU samples
+* either side of it. A t past the newest sample takes the newest, as the
+* encoder snapshot usually lands between IMU samples. Returns -1 if there are
+* no IMU samples.
+*******************************************************************************/
+int imu_yaw_rate_at(uint64_t t, float* yaw_rate){
+	imu_sample_t buf[ODOMETRY_IMU_SAMPLES];
+	imu_sample_t* a;
+	imu_sample_t* b;
+	uint64_t newest;
+	float f;
+	int i, n;
+
+	if(get_latest_imu_sample(&buf[0])<0) return -1;
+	newest = buf[0].seq;
+	if(buf[0].timestamp_micros<=t || newest<=1){
+		*yaw_rate = buf[0].data.gyro[2]*DEG_TO_RAD;
+		return 0;
+	}
+	if(newest>ODOMETRY_IMU_SAMPLES) newest -= ODOMETRY_IMU_SAMPLES;
+	else newest = 0;
+	n = get_imu_samples_since(newest, buf, ODOMETRY_IMU_SAMPLES);
+	if(n<1) return -1;
+	// oldest first, find the first sample at or after t
+	for(i=0;i<n-1 && buf[i].timestamp_micros<t;i++);
+	b = &buf[i];
+	if(i==0 || b->timestamp_micros<t){
+		*yaw_rate = b->data.gyro[2]*DEG_TO_RAD;
+		return 0;
+	}
+	a = &buf[i-1];
+	f = (float)(t-a->timestamp_micros) / \
+					(float)(b->timestamp_micros-a->timestamp_micros);
+	*yaw_rate = (a->data.gyro[2] + f*(b->data.gyro[2]-a->data.gyro[2])) * \
+																DEG_TO_RAD;
+	return 0;
+}
+
+/*******************************************************************************
+* int feed_odometry(const int pos[4], uint64_t timestamp_micros,
+*															float yaw_rate)
+*
+* Integrates one snapshot of all 4 encoder channels taken at
+* timestamp_micros with the yaw rate in rad/s at that time, which is only
+* used with use_imu_yaw. For logged or replayed data and for snapshots taken
+* elsewhere. Snapshots older than the last one are refused.
+*******************************************************************************/
+int feed_odometry(const int pos[4], uint64_t timestamp_micros, \
+															float yaw_rate){
+	int32_t dl, dr;
+	float m_per_count, sl, sr, ds, dth, h, dt;
+	int l, r;
+
+	if(!odo_running){
+		report_error("ERROR: odometry not started\n");
+		return -1;
+	}
+	l = pos[odo_conf.left_ch-1]*odo_conf.left_polarity;
+	r = pos[odo_conf.right_ch-1]*odo_conf.right_polarity;
+	yaw_rate *= odo_conf.gyro_polarity;
+	if(odo_have_prev && timestamp_micros<odo_prev_micros){
+		report_error("ERROR: odometry snapshot older than the last one\n");
+		return -1;
+	}
+
+	odo_lock++;
+	__sync_synchronize();
+	if(odo_set_requested){
+		odo_pose.x = odo_set_x;
+		odo_pose.y = odo_set_y;
+		odo_pose.heading = wrap_odometry_heading(odo_set_heading);
+		odo_set_requested = 0;
+	}
+	dt = odo_have_prev ? (timestamp_micros-odo_prev_micros)/1000000.0 : 0;
+	if(odo_have_prev && dt<=ODOMETRY_MAX_DT){
+		// unsigned subtraction so a counter wrapping past INT_MAX is fine
+		dl = (int32_t)((uint32_t)l-(uint32_t)odo_prev_left);
+		dr = (int32_t)((uint32_t)r-(uint32_t)odo_prev_right);
+		m_per_count = PI*odo_conf.wheel_diameter/odo_conf.counts_per_rev;
+		sl = dl*m_per_count;
+		sr = dr*m_per_count;
+		ds = (sl+sr)/2.0;
+		if(odo_conf.use_imu_yaw) dth = (odo_prev_yaw_rate+yaw_rate)/2.0*dt;
+		else dth = (sr-sl)/odo_conf.track_width;
+		h = odo_pose.heading + dth/2.0;
+		odo_pose.x += ds*cos(h);
+		odo_pose.y += ds*sin(h);
+		odo_pose.heading = wrap_odometry_heading(odo_pose.heading+dth);
+		odo_pose.distance += fabs(ds);
+		if(dt>0){
+			odo_pose.velocity = ds/dt;
+			odo_pose.yaw_rate = dth/dt;
+		}
+		odo_pose.updates++;
+	}
+	else if(odo_have_prev) odo_pose.gaps++;
+	odo_pose.timestamp_micros = timestamp_micros;
+	__sync_synchronize();
+	odo_lock++;
+
+	odo_prev_left = l;
+	odo_prev_right = r;
+	odo_prev_micros = timestamp_micros;
+	odo_prev_yaw_rate = yaw_rate;
+	odo_have_prev = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int get_odometry_pose(odometry_pose_t* pose)
+*
+* Consistent copy of the pose from any thread without blocking the updates.
+*******************************************************************************/
+int get_odometry_pose(odometry_pose_t* pose){
+	uint32_t before, after;
+	int i;
+	for(i=0;i<ODOMETRY_READ_TRIES;i++){
+		before = odo_lock;
+		if(before&1) continue;
+		__sync_synchronize();
+		*pose = odo_pose;
+		__sync_synchronize();
+		after = odo_lock;
+		if(before==after) return 0;
+	}
+	printf("ERROR: odometry pose kept changing while being read\n");
+	return -1;
+}
+
+/*******************************************************************************
+* int set_odometry_pose(float x, float y, float heading)
+*
+* Moves the pose, to a known starting point or a fix from another sensor.
+* Applied by the next update so it is safe from any thread.
+*******************************************************************************/
+int set_odometry_pose(float x, float y, float heading){
+	odo_set_x = x;
+	odo_set_y = y;
+	odo_set_heading = heading;
+	__sync_synchronize();
+	odo_set_requested = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int print_odometry_pose()
+*******************************************************************************/
+int print_odometry_pose(){
+	odometry_pose_t p;
+	if(get_odometry_pose(&p)<0) return -1;
+	printf("x:%7.3fm y:%7.3fm heading:%6.1fdeg v:%6.3fm/s " \
+			"yaw rate:%6.1fdeg/s distance:%7.2fm\n", p.x, p.y, \
+			p.heading/DEG_TO_RAD, p.velocity, p.yaw_rate/DEG_TO_RAD, \
+			p.distance);
+	return 0;
+}
+
+/*******************************************************************************
+* float wrap_odometry_heading(float h)
+*
+* into -PI to PI
+*******************************************************************************/
+float wrap_odometry_heading(float h){
+	while(h>PI) h -= TWO_PI;
+	while(h<-PI) h += TWO_PI;
+	return h;
+}
@@ -41,17 +41,161 @@
 #define J15_PATH "/sys/devices/platform/ocp/ocp:J15_pinmux/state"
 #define H17_PATH "/sys/devices/platform/ocp/ocp:H17_pinmux/state"
 
+#define PINMUX_MAX_PINS		16	// more than the 15 state files above
+#define PINMUX_MAX_STATE_LEN	16
+
+// one pin state file, held open while a batch runs
+typedef struct pinmux_file_t{
+	const char* path;
+	int fd;
+	int mode;	// last mode read back or written, -1 if unknown
+} pinmux_file_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+pinmux_file_t pinmux_files[PINMUX_MAX_PINS];
+int pinmux_num_files = 0;
+int pinmux_batch_running = 0;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+const char* pinmux_path(int pin, pinmux_mode_t mode);
+const char* pinmux_mode_string(pinmux_mode_t mode);
+pinmux_file_t* open_pinmux_file(const char* path);
+int read_pinmux_file(pinmux_file_t* f);
+int write_pinmux_file(pinmux_file_t* f, pinmux_mode_t mode);
+void close_pinmux_files();
+int add_pinmux_entry(int* pins, pinmux_mode_t* modes, int* n, int pin, \
+														pinmux_mode_t mode);
+
 
 
 /*******************************************************************************
 * int set_pinmux_mode(int pin, pinmux_mode_t mode)
 *
 * checks the desired pin and mode for validity depending on if you are running
-* a blue or cape. Returns -1 on failure, 0 on success.
+* a blue or cape. The current state is read back first and the write skipped
+* if the pin is already in the requested mode, since each write makes the
+* kernel reprogram the pin controller. Returns -1 on failure, 0 on success.
 *******************************************************************************/
 int set_pinmux_mode(int pin, pinmux_mode_t mode){
-	int fd, ret;
-	char* path;
+	const char* path;
+	pinmux_file_t* f;
+	int ret;
+
+	path = pinmux_path(pin, mode);
+	if(path==NULL) return -1;
+	f = open_pinmux_file(path);
+	if(f==NULL) return -1;
+	ret = write_pinmux_file(f, mode);
+	// outside a batch someone else may change the pin before our next call
+	if(!pinmux_batch_running) close_pinmux_files();
+	return ret;
+}
+
+/*******************************************************************************
+* int set_pinmux_modes(int* pins, pinmux_mode_t* modes, int n)
+*
+* Sets n pins in one go, holding every state file open until the end and
+* skipping pins already in the right mode. All pins are attempted even if one
+* fails. Returns -1 if any failed, 0 on success.
+*******************************************************************************/
+int set_pinmux_modes(int* pins, pinmux_mode_t* modes, int n){
+	int i, ret = 0;
+
+	if(n<0 || n>PINMUX_MAX_PINS){
+		printf("ERROR: can only set up to %d pinmux modes at once\n", \
+														PINMUX_MAX_PINS);
+		return -1;
+	}
+	pinmux_batch_running = 1;
+	for(i=0;i<n;i++){
+		if(set_pinmux_mode(pins[i], modes[i])<0) ret = -1;
+	}
+	pinmux_batch_running = 0;
+	close_pinmux_files();
+	return ret;
+}
+
+/*******************************************************************************
+* int apply_pinmux_profile(pinmux_profile_t profile)
+*
+* Puts every user header pin in the modes of a common layout with one batched
+* call. The DSM pin stays in UART mode in all of them so the radio keeps
+* working. The SPI slave select pins follow the SPI header in each profile.
+*******************************************************************************/
+int apply_pinmux_profile(pinmux_profile_t profile){
+	int pins[PINMUX_MAX_PINS];
+	pinmux_mode_t modes[PINMUX_MAX_PINS];
+	pinmux_mode_t uart, spi, ss, gp;
+	int n = 0;
+
+	switch(profile){
+	case PINMUX_PROFILE_DEFAULT:
+		uart = PINMUX_UART;
+		spi = PINMUX_SPI;
+		ss = PINMUX_SPI;
+		gp = PINMUX_GPIO_PU;
+		break;
+	case PINMUX_PROFILE_UART_GPIO:
+		uart = PINMUX_UART;
+		spi = PINMUX_GPIO;
+		ss = PINMUX_GPIO;
+		gp = PINMUX_GPIO_PU;
+		break;
+	case PINMUX_PROFILE_SPI_GPIO:
+		uart = PINMUX_GPIO;
+		spi = PINMUX_SPI;
+		ss = PINMUX_SPI;
+		gp = PINMUX_GPIO_PU;
+		break;
+	case PINMUX_PROFILE_ALL_GPIO:
+		uart = PINMUX_GPIO;
+		spi = PINMUX_GPIO;
+		ss = PINMUX_GPIO;
+		gp = PINMUX_GPIO;
+		break;
+	default:
+		printf("ERROR: invalid pinmux profile\n");
+		return -1;
+	}
+
+	if(get_bb_model()==BB_BLUE){
+		add_pinmux_entry(pins, modes, &n, BLUE_SPI_PIN_6_SS1, ss);
+		add_pinmux_entry(pins, modes, &n, BLUE_SPI_PIN_6_SS2, ss);
+		add_pinmux_entry(pins, modes, &n, BLUE_GP0_PIN_3, gp);
+		add_pinmux_entry(pins, modes, &n, BLUE_GP0_PIN_4, gp);
+		add_pinmux_entry(pins, modes, &n, BLUE_GP0_PIN_5, gp);
+		add_pinmux_entry(pins, modes, &n, BLUE_GP0_PIN_6, gp);
+		add_pinmux_entry(pins, modes, &n, BLUE_GP1_PIN_3, gp);
+		add_pinmux_entry(pins, modes, &n, BLUE_GP1_PIN_4, gp);
+	}
+	else{
+		add_pinmux_entry(pins, modes, &n, CAPE_SPI_PIN_6_SS1, ss);
+		add_pinmux_entry(pins, modes, &n, CAPE_SPI_PIN_6_SS2, PINMUX_GPIO);
+	}
+	add_pinmux_entry(pins, modes, &n, DSM_PIN, PINMUX_UART);
+	add_pinmux_entry(pins, modes, &n, GPS_HEADER_PIN_3, uart);
+	add_pinmux_entry(pins, modes, &n, GPS_HEADER_PIN_4, uart);
+	add_pinmux_entry(pins, modes, &n, UART1_HEADER_PIN_3, uart);
+	add_pinmux_entry(pins, modes, &n, UART1_HEADER_PIN_4, uart);
+	add_pinmux_entry(pins, modes, &n, SPI_HEADER_PIN_3, spi);
+	add_pinmux_entry(pins, modes, &n, SPI_HEADER_PIN_4, spi);
+	add_pinmux_entry(pins, modes, &n, SPI_HEADER_PIN_5, spi);
+
+	return set_pinmux_modes(pins, modes, n);
+}
+
+/*******************************************************************************
+* const char* pinmux_path(int pin, pinmux_mode_t mode)
+*
+* returns the state file for pin, or NULL if the pin can't be put in that mode
+* on this board
+*******************************************************************************/
+const char* pinmux_path(int pin, pinmux_mode_t mode){
+	const char* path;
 
 	// flag set when parsing pin switch case
 	int blue_only = 0;
@@ -69,7 +213,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PD 	&& \
 			mode!=PINMUX_UART){
 			printf("ERROR: DSM pairing pin can only be put in GPIO or UART mode\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_11_PATH;
 		break;
@@ -83,7 +227,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_PWM	 	&& \
 			mode!=PINMUX_UART){
 			printf("ERROR: GPS_HEADER_PIN_3 can only be put in GPIO, UART, or PWM modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_22_PATH;
 		break;
@@ -95,7 +239,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_PWM	 	&& \
 			mode!=PINMUX_UART){
 			printf("ERROR: GPS_HEADER_PIN_4 can only be put in GPIO, UART, or PWM modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_21_PATH;
 		break;
@@ -109,7 +253,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_CAN 	 	&& \
 			mode!=PINMUX_UART){
 			printf("ERROR: UART1_HEADER_PIN_3 can only be put in GPIO, UART, CAN modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_26_PATH;
 		break;
@@ -121,7 +265,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_CAN 	 	&& \
 			mode!=PINMUX_UART){
 			printf("ERROR: UART1_HEADER_PIN_3 can only be put in GPIO, UART, CAN modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_24_PATH;
 		break;
@@ -134,7 +278,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PD 	&& \
 			mode!=PINMUX_SPI){
 			printf("ERROR: SPI_HEADER_PIN_3 can only be put in GPIO, or SPI modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_30_PATH;
 		break;
@@ -145,7 +289,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PD 	&& \
 			mode!=PINMUX_SPI){
 			printf("ERROR: SPI_HEADER_PIN_4 can only be put in GPIO, or SPI modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_29_PATH;
 		break;
@@ -156,7 +300,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PD 	&& \
 			mode!=PINMUX_SPI){
 			printf("ERROR: SPI_HEADER_PIN_5 can only be put in GPIO, or SPI modes\n");
-			return -1;
+			return NULL;
 		}
 		path = P9_31_PATH;
 		break;
@@ -175,7 +319,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			else{
 				printf("ERROR: SPI_HEADER_PIN_6_SS1 can only be put in GPIO or SPI modes\n");
 			}
-			return -1;
+			return NULL;
 		}
 		path = P9_28_PATH;
 		break;
@@ -193,7 +337,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			else{
 				printf("ERROR: SPI_HEADER_PIN_6_SS2 can only be put in GPIO modes\n");
 			}
-			return -1;
+			return NULL;
 		}
 		path = P9_23_PATH;
 		break;
@@ -207,7 +351,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PD 	&& \
 			mode!=PINMUX_SPI ){
 			printf("ERROR: BLUE_SPI_PIN_6_SS1 can only be put in GPIO, or SPI modes\n");
-			return -1;
+			return NULL;
 		}
 		path = H18_PATH;
 		blue_only = 1;
@@ -219,7 +363,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PD 	&& \
 			mode!=PINMUX_SPI ){
 			printf("ERROR: BLUE_SPI_PIN_6_SS2 can only be put in GPIO, or SPI modes\n");
-			return -1;
+			return NULL;
 		}
 		path = C18_PATH;
 		blue_only = 1;
@@ -230,7 +374,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PU 	&& \
 			mode!=PINMUX_GPIO_PD ){
 			printf("ERROR: BLUE_GP0_PIN_3 can only be put in GPIO modes\n");
-			return -1;
+			return NULL;
 		}
 		path = U16_PATH;
 		blue_only = 1;
@@ -243,7 +387,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PU 	&& \
 			mode!=PINMUX_GPIO_PD ){
 			printf("ERROR: BLUE_GP0_PIN_5 can only be put in GPIO modes\n");
-			return -1;
+			return NULL;
 		}
 		path = D13_PATH;
 		blue_only = 1;
@@ -256,7 +400,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PU 	&& \
 			mode!=PINMUX_GPIO_PD ){
 			printf("ERROR: BLUE_GP1_PIN_3 can only be put in GPIO modes\n");
-			return -1;
+			return NULL;
 		}
 		path = J15_PATH;
 		blue_only = 1;
@@ -267,7 +411,7 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 			mode!=PINMUX_GPIO_PU 	&& \
 			mode!=PINMUX_GPIO_PD ){
 			printf("ERROR: BLUE_GP1_PIN_4 can only be put in GPIO modes\n");
-			return -1;
+			return NULL;
 		}
 		path = H17_PATH;
 		blue_only = 1;
@@ -279,61 +423,138 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 	***************************************************************************/
 	default:
 		printf("ERROR: Pinmuxing on pin %d is not supported\n", pin);
-		return -1;
+		return NULL;
 	}
 
 
 	// check for board incompatibility
 	if(blue_only && get_bb_model()!=BB_BLUE){
 		printf("ERROR: Trying to set pinmux on pin that should only used on BB Blue\n");
-		return -1;
+		return NULL;
 	}
 
-	// open pin state fd
-	fd = open(path, O_WRONLY);
+	return path;
+}
+
+/*******************************************************************************
+* const char* pinmux_mode_string(pinmux_mode_t mode)
+*
+* name of mode as the pinmux helper driver reads and writes it
+*******************************************************************************/
+const char* pinmux_mode_string(pinmux_mode_t mode){
+	switch(mode){
+	case PINMUX_GPIO:		return "gpio";
+	case PINMUX_GPIO_PU:	return "gpio_pu";
+	case PINMUX_GPIO_PD:	return "gpio_pd";
+	case PINMUX_PWM:		return "pwm";
+	case PINMUX_SPI:		return "spi";
+	case PINMUX_UART:		return "uart";
+	case PINMUX_CAN:		return "can";
+	default:				return NULL;
+	}
+}
+
+/*******************************************************************************
+* pinmux_file_t* open_pinmux_file(const char* path)
+*
+* returns the cached entry for path, opening the state file if it isn't held
+* open already
+*******************************************************************************/
+pinmux_file_t* open_pinmux_file(const char* path){
+	pinmux_file_t* f;
+	int i, fd;
+
+	for(i=0;i<pinmux_num_files;i++){
+		if(pinmux_files[i].path==path) return &pinmux_files[i];
+	}
+	if(pinmux_num_files>=PINMUX_MAX_PINS){
+		printf("ERROR: too many pinmux files open\n");
+		return NULL;
+	}
+	// fall back to write only in case an old driver can't report the state
+	fd = open(path, O_RDWR);
+	if(fd == -1) fd = open(path, O_WRONLY);
 	if(fd == -1){
-		printf("can't open: ");
-		printf(path);
-		printf("\n");
-		return -1;
+		printf("can't open: %s\n", path);
+		return NULL;
 	}
+	f = &pinmux_files[pinmux_num_files];
+	f->path = path;
+	f->fd = fd;
+	f->mode = -1;
+	pinmux_num_files++;
+	return f;
+}
 
+/*******************************************************************************
+* int read_pinmux_file(pinmux_file_t* f)
+*
+* reads back the state the pin is currently in, returns the mode or -1 if it
+* couldn't be read or isn't one of ours
+*******************************************************************************/
+int read_pinmux_file(pinmux_file_t* f){
+	char buf[PINMUX_MAX_STATE_LEN];
+	const char* name;
+	int i, len;
+
+	len = pread(f->fd, buf, sizeof(buf)-1, 0);
+	if(len<=0) return -1;
+	buf[len] = 0;
+	if(buf[len-1]=='\n') buf[len-1] = 0;
+	for(i=PINMUX_GPIO;i<=PINMUX_CAN;i++){
+		name = pinmux_mode_string(i);
+		if(strcmp(buf, name)==0) return i;
+	}
+	return -1;
+}
 
-	switch(mode){
-	case PINMUX_GPIO:
-		ret = write(fd, "gpio", 4);
-		break;
-	case PINMUX_GPIO_PU:
-		ret = write(fd, "gpio_pu", 7);
-		break;
-	case PINMUX_GPIO_PD:
-		ret = write(fd, "gpio_pd", 7);
-		break;
-	case PINMUX_PWM:
-		ret = write(fd, "pwm", 3);
-		break;
-	case PINMUX_SPI:
-		ret = write(fd, "spi", 3);
-		break;
-	case PINMUX_UART:
-		ret = write(fd, "uart", 4);
-		break;
-	case PINMUX_CAN:
-		ret = write(fd, "can", 3);
-		break;
-	default:
+/*******************************************************************************
+* int write_pinmux_file(pinmux_file_t* f, pinmux_mode_t mode)
+*
+* writes mode unless the pin is known to be in it already
+*******************************************************************************/
+int write_pinmux_file(pinmux_file_t* f, pinmux_mode_t mode){
+	const char* name;
+
+	name = pinmux_mode_string(mode);
+	if(name==NULL){
 		printf("ERROR: unknown PINMUX mode\n");
-		close(fd);
 		return -1;
 	}
-
-	if(ret<0){
+	if(f->mode<0) f->mode = read_pinmux_file(f);
+	if(f->mode==(int)mode) return 0;
+	if(pwrite(f->fd, name, strlen(name), 0)<0){
 		printf("ERROR: failed to write to pinmux driver\n");
-		close(fd);
+		f->mode = -1;
 		return -1;
 	}
+	f->mode = mode;
+	return 0;
+}
+
+/*******************************************************************************
+* void close_pinmux_files()
+*
+* closes every held state file and forgets the cached modes
+*******************************************************************************/
+void close_pinmux_files(){
+	int i;
+	for(i=0;i<pinmux_num_files;i++) close(pinmux_files[i].fd);
+	pinmux_num_files = 0;
+}
 
-	close(fd);
+/*******************************************************************************
+* int add_pinmux_entry(int* pins, pinmux_mode_t* modes, int* n, int pin,
+*														pinmux_mode_t mode)
+*
+* appends one pin to the lists apply_pinmux_profile builds
+*******************************************************************************/
+int add_pinmux_entry(int* pins, pinmux_mode_t* modes, int* n, int pin, \
+														pinmux_mode_t mode){
+	if(*n>=PINMUX_MAX_PINS) return -1;
+	pins[*n] = pin;
+	modes[*n] = mode;
+	(*n)++;
 	return 0;
 }
 
@@ -345,37 +566,9 @@ int set_pinmux_mode(int pin, pinmux_mode_t mode){
 * puts everything back to standard and is used by initialize_cape
 *******************************************************************************/
 int set_default_pinmux(){
-	int ret = 0;
-
-	// bb blue available pinmux
-	if(get_bb_model()==BB_BLUE){
-		ret |= set_pinmux_mode(BLUE_SPI_PIN_6_SS1, PINMUX_SPI);
-		ret |= set_pinmux_mode(BLUE_SPI_PIN_6_SS2, PINMUX_SPI);
-		ret |= set_pinmux_mode(BLUE_GP0_PIN_3, PINMUX_GPIO_PU);
-		ret |= set_pinmux_mode(BLUE_GP0_PIN_4, PINMUX_GPIO_PU);
-		ret |= set_pinmux_mode(BLUE_GP0_PIN_5, PINMUX_GPIO_PU);
-		ret |= set_pinmux_mode(BLUE_GP0_PIN_6, PINMUX_GPIO_PU);
-		ret |= set_pinmux_mode(BLUE_GP1_PIN_3, PINMUX_GPIO_PU);
-		ret |= set_pinmux_mode(BLUE_GP1_PIN_4, PINMUX_GPIO_PU);
-
-	}
-
-	// bb black and everything else
-	else{
-		ret |= set_pinmux_mode(CAPE_SPI_PIN_6_SS1, PINMUX_SPI);
-		ret |= set_pinmux_mode(CAPE_SPI_PIN_6_SS2, PINMUX_GPIO);
-	}
-
-	// shared pins
-	ret |= set_pinmux_mode(DSM_PIN, PINMUX_UART);
-	ret |= set_pinmux_mode(GPS_HEADER_PIN_3, PINMUX_UART);
-	ret |= set_pinmux_mode(GPS_HEADER_PIN_4, PINMUX_UART);
-	ret |= set_pinmux_mode(UART1_HEADER_PIN_3, PINMUX_UART);
-	ret |= set_pinmux_mode(UART1_HEADER_PIN_4, PINMUX_UART);
-	ret |= set_pinmux_mode(SPI_HEADER_PIN_3, PINMUX_SPI);
-	ret |= set_pinmux_mode(SPI_HEADER_PIN_4, PINMUX_SPI);
-	ret |= set_pinmux_mode(SPI_HEADER_PIN_5, PINMUX_SPI);
+	int ret;
 
+	ret = apply_pinmux_profile(PINMUX_PROFILE_DEFAULT);
 
 	if(ret){
 		printf("WARNING: missing PINMUX driver\n");
@@ -0,0 +1,227 @@
+/*******************************************************************************
+* replay.c
+*
+* Feeds a log written by the telemetry logger back through the IMU, DSM,
+* encoder and ADC interfaces so estimators and controllers can be run without
+* the hardware. A single thread delivers records in the order they were
+* logged, running the IMU and DSM callbacks as they come, either paced to the
+* recorded timestamps or as fast as the callbacks allow.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "replay.h"
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+int replay_mode = 0;
+volatile int replay_running = 0;
+volatile int replay_done = 0;
+float replay_speed;
+log_reader_t replay_reader;
+pthread_t replay_thread;
+uint64_t replay_count;
+uint64_t replay_offset;		// added to log timestamps to land them now
+
+// newest encoder and adc values, the seq counter is odd while updating
+volatile uint32_t replay_io_lock;
+int replay_encoder[4];
+int replay_adc[8];
+int replay_have_encoder;
+int replay_have_adc;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* replay_handler(void* ptr);
+void replay_wait_until(uint64_t log_micros, uint64_t first_micros, \
+													uint64_t start_micros);
+
+/*******************************************************************************
+* int open_replay(const char* path)
+*
+* Puts the library in replay mode with the given log. initialize_imu_dmp and
+* initialize_dsm called after this skip the hardware and wait for replayed
+* records instead, and encoder and adc reads return logged values once the
+* log has supplied some.
+*******************************************************************************/
+int open_replay(const char* path){
+	if(replay_mode){
+		printf("ERROR: replay already open\n");
+		return -1;
+	}
+	if(open_log_reader(&replay_reader, path)<0) return -1;
+	replay_have_encoder = 0;
+	replay_have_adc = 0;
+	replay_count = 0;
+	replay_done = 0;
+	replay_mode = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int start_replay(float speed)
+*
+* Starts delivering records. speed 1 replays in real time, 10 ten times 
+* faster, and 0 as fast as possible.
+*******************************************************************************/
+int start_replay(float speed){
+	if(!replay_mode){
+		printf("ERROR: call open_replay first\n");
+		return -1;
+	}
+	if(replay_running){
+		printf("ERROR: replay already started\n");
+		return -1;
+	}
+	if(speed<0){
+		printf("ERROR: replay speed can't be negative\n");
+		return -1;
+	}
+	replay_speed = speed;
+	replay_running = 1;
+	// not the IMU's SCHED_FIFO, at speed 0 this never sleeps
+	if(create_rt_thread(&replay_thread, RT_SERVICE_APP, replay_handler, NULL)){
+		replay_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int wait_for_replay()
+*
+* Blocks until every record has been delivered or the replay was stopped.
+* Returns the number of records delivered.
+*******************************************************************************/
+int wait_for_replay(){
+	if(!replay_running) return (int)replay_count;
+	pthread_join(replay_thread, NULL);
+	replay_running = 0;
+	return (int)replay_count;
+}
+
+/*******************************************************************************
+* int close_replay()
+*
+* Stops delivering records and leaves replay mode.
+*******************************************************************************/
+int close_replay(){
+	if(!replay_mode) return 0;
+	if(replay_running){
+		replay_done = 1;
+		pthread_join(replay_thread, NULL);
+		replay_running = 0;
+	}
+	close_log_reader(&replay_reader);
+	replay_mode = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int is_replay_mode() / int is_replay_finished()
+*******************************************************************************/
+int is_replay_mode(){
+	return replay_mode;
+}
+
+int is_replay_finished(){
+	return replay_mode && replay_done;
+}
+
+/*******************************************************************************
+* int get_replay_encoder_pos(int pos[4])
+*******************************************************************************/
+int get_replay_encoder_pos(int pos[4]){
+	uint32_t lock;
+	if(!replay_mode || !replay_have_encoder) return -1;
+	do{
+		while((lock=replay_io_lock)&1);
+		__sync_synchronize();
+		memcpy(pos, replay_encoder, sizeof(replay_encoder));
+		__sync_synchronize();
+	}while(replay_io_lock!=lock);
+	return 0;
+}
+
+/*******************************************************************************
+* int get_replay_adc_raw(int ch)
+*******************************************************************************/
+int get_replay_adc_raw(int ch){
+	if(!replay_mode || !replay_have_adc) return -1;
+	// a single aligned int can't tear
+	return replay_adc[ch];
+}
+
+/*******************************************************************************
+* void* replay_handler(void* ptr)
+*
+* Reads the log in order and hands each record to whichever interface it
+* came from. All timestamps are shifted so the first record lands at the
+* moment replay started.
+*******************************************************************************/
+void* replay_handler(void* ptr){
+	log_record_header_t hdr;
+	uint8_t payload[LOG_MAX_PAYLOAD];
+	uint64_t first = 0, start = micros_since_boot();
+	uint64_t ts;
+	log_encoder_record_t* enc;
+	log_adc_record_t* adc;
+	int i, ret = 0;
+
+	while(!replay_done && get_state()!=EXITING){
+		ret = read_log_record(&replay_reader, &hdr, payload, sizeof(payload));
+		if(ret<=0) break;
+		if(first==0){
+			first = hdr.timestamp_micros;
+			replay_offset = start - first;
+		}
+		if(replay_speed>0) replay_wait_until(hdr.timestamp_micros, first, start);
+		ts = hdr.timestamp_micros + replay_offset;
+
+		switch(hdr.type){
+		case LOG_RECORD_IMU:
+			replay_imu_record((log_imu_record_t*)payload, ts);
+			break;
+		case LOG_RECORD_DSM:
+			replay_dsm_record((log_dsm_record_t*)payload, ts);
+			break;
+		case LOG_RECORD_ENCODER:
+			enc = (log_encoder_record_t*)payload;
+			replay_io_lock++;
+			__sync_synchronize();
+			for(i=0;i<4;i++) replay_encoder[i] = enc->pos[i];
+			__sync_synchronize();
+			replay_io_lock++;
+			replay_have_encoder = 1;
+			break;
+		case LOG_RECORD_ADC:
+			adc = (log_adc_record_t*)payload;
+			for(i=0;i<8;i++) replay_adc[i] = adc->raw[i];
+			replay_have_adc = 1;
+			break;
+		default:
+			// motor commands and user records are outputs, nothing to feed
+			break;
+		}
+		replay_count++;
+	}
+	if(ret<0) printf("WARNING: replay log ends with a truncated record\n");
+	replay_done = 1;
+	return NULL;
+}
+
+/*******************************************************************************
+* void replay_wait_until(uint64_t log_micros, uint64_t first_micros,
+*													uint64_t start_micros)
+*
+* Sleeps until the record logged at log_micros is due at the replay speed.
+*******************************************************************************/
+void replay_wait_until(uint64_t log_micros, uint64_t first_micros, \
+													uint64_t start_micros){
+	uint64_t due, now;
+	due = start_micros + (uint64_t)((log_micros-first_micros)/replay_speed);
+	now = micros_since_boot();
+	if(due>now) usleep(due-now);
+}
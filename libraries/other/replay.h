@@ -0,0 +1,15 @@
+/*******************************************************************************
+* replay.h
+*
+* Hooks between replay.c and the drivers it stands in for. Not part of the
+* public API, see the SENSOR REPLAY section of roboticscape.h instead.
+*******************************************************************************/
+
+// implemented by the IMU and DSM drivers, return -1 if the driver was not
+// initialized in replay mode and the record should be skipped
+int replay_imu_record(const log_imu_record_t* r, uint64_t timestamp_micros);
+int replay_dsm_record(const log_dsm_record_t* r, uint64_t timestamp_micros);
+
+// latest replayed encoder and adc values, -1 if the log had none yet
+int get_replay_encoder_pos(int pos[4]);
+int get_replay_adc_raw(int ch);
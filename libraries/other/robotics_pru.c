@@ -7,6 +7,8 @@
 #include "../roboticscape.h"
 #include "../roboticscape-defs.h"
 #include "robotics_pru.h"
+#include <limits.h>
+#include <dirent.h>
 
 
 #define PRU_UNBIND_PATH "/sys/bus/platform/drivers/pru-rproc/unbind"
@@ -21,8 +23,57 @@
 #define PRU_LEN			0x80000			// Length of PRU memory
 #define PRU_SHAREDMEM	0x10000			// Offset to shared memory
 #define CNT_OFFSET 		64
+#define ENC_PERIOD_OFFSET	68		// PRU cycles between the last two edges
+#define ENC_DIR_OFFSET		72		// direction of the last edge, 1 or -1
+#define PRU0_CTRL		0x22000		// Offset to PRU0 control registers
+#define PRU_CYCLE		0xC			// cycle counter within control registers
+#define PRU_CLOCK_HZ	200000000.0
+#define ENC_READ_TRIES	3
+// repeat mode layout, must match pru1-servo.asm
+#define PERIOD_OFFSET	80
+#define WIDTH_OFFSET	84
+#define COMMIT_OFFSET	116
+#define STAGE_OFFSET	120
+#define SERVO_MIN_RATE	50
+#define SERVO_MAX_RATE	4000
+// event counters, must match both PRU programs
+#define SERVO_EVENT_OFFSET	152
+#define ENC_EVENT_OFFSET	156
+#define ENC_ARM_OFFSET		160
+#define ENC_THRESH_OFFSET	164
+#define PRU_EVENT_SLEEP_US	50
+// each PRU bumps its word every pass of its main loop
+#define PRU0_HEARTBEAT_OFFSET	168
+#define PRU1_HEARTBEAT_OFFSET	172
+// DShot layout, must match pru1-servo.asm
+#define DSHOT_BIT_OFFSET		176
+#define DSHOT_T0H_OFFSET		180
+#define DSHOT_T1H_OFFSET		184
+#define DSHOT_ACTIVE_OFFSET		188
+#define DSHOT_COMMIT_OFFSET		192
+#define DSHOT_FRAME_OFFSET		196
+#define DSHOT_FRAME_BITS		16
+#define DSHOT_LEN				(DSHOT_FRAME_OFFSET + DSHOT_FRAME_BITS - \
+														DSHOT_BIT_OFFSET)
+#define REMOTEPROC_DIR		"/sys/class/remoteproc"
+#define PRU_START_TIMEOUT_MS	500
+#define PRU_START_POLL_US		1000
 
 static unsigned int *prusharedMem_32int_ptr;
+static volatile unsigned int *pru0_cycle_ptr;
+static int pru_init_attempted = 0;
+static char pru_state_path[2][PATH_MAX];
+// bit of each servo channel in DShot output masks, r30.t4 is bit 0
+static const int dshot_out_bit[SERVO_CHANNELS] = {4, 6, 5, 7, 2, 3, 0, 1};
+
+int lazy_init_pru();
+int pru_loaded(int core);
+int find_pru_state_path(int core);
+int wait_for_pru_state(int core, const char* state);
+int write_pru_sysfs(const char* path, const char* buf);
+int dshot_on();
+uint16_t dshot_frame(int value, int telemetry);
+int stage_dshot_frames(const int values[8], int telemetry);
 
 
 /*******************************************************************************
@@ -37,7 +88,9 @@ int initialize_pru(){
 	int	fd;
 	
 	// reset memory pointer to NULL so if init fails it doesn't point somewhere bad
+	pru_init_attempted = 1;
 	prusharedMem_32int_ptr = NULL;
+	pru0_cycle_ptr = NULL;
 
 	// open file descriptors for pru rproc driver
 	bind_fd = open(PRU_BIND_PATH, O_WRONLY);
@@ -47,14 +100,14 @@ int initialize_pru(){
 	}
 
 	// if pru0 is not loaded, load it
-	if(access(PRU0_UEVENT, F_OK)!=0){
+	if(!pru_loaded(0)){
 		if(write(bind_fd, PRU0_NAME, PRU_NAME_LEN)<0){
 			printf("ERROR: pru0 bind failed\n");
 			return -1;
 		}
 	}
 	// if pru1 is not loaded, load it
-	if(access(PRU1_UEVENT, F_OK)!=0){
+	if(!pru_loaded(1)){
 		if(write(bind_fd, PRU1_NAME, PRU_NAME_LEN)<0){
 			printf("ERROR: pru1 bind failed\n");
 			return -1;
@@ -81,69 +134,227 @@ int initialize_pru(){
 
 	// set global shared memory pointer
 	prusharedMem_32int_ptr = pru + PRU_SHAREDMEM/4;	// Points to start of shared memory
+	// PRU0 restarts its cycle counter on every encoder edge
+	pru0_cycle_ptr = pru + (PRU0_CTRL+PRU_CYCLE)/4;
 
 	// zero out the 8 servo channels and encoder channel
 	#ifdef DEBUG
 	printf("zeroing out PRU shared memory\n");
 	#endif
 	memset(prusharedMem_32int_ptr, 0, 9*4);
-	
+	// and the repeat mode period, widths, and stage so the PRU starts in
+	// single pulse mode
+	memset(prusharedMem_32int_ptr + PERIOD_OFFSET/4, 0, \
+							STAGE_OFFSET - PERIOD_OFFSET + SERVO_CHANNELS*4);
+	// and DShot off
+	memset(prusharedMem_32int_ptr + DSHOT_BIT_OFFSET/4, 0, DSHOT_LEN);
+
+	// a freshly bound core may still be loading its firmware
+	if(wait_for_pru_heartbeat(0, PRU_START_TIMEOUT_MS) || \
+					wait_for_pru_heartbeat(1, PRU_START_TIMEOUT_MS)){
+		printf("ERROR: PRU firmware not running\n");
+		return -1;
+	}
     return 0;
 }
 
 /*******************************************************************************
-* int restart
-* Enables the PRU and gets a pointer to the PRU shared memory which is used by 
-* the servo and encoder functions in this C file.
+* int restart_pru()
+* 
+* Reloads the firmware on both PRUs.
 *******************************************************************************/
 int restart_pru(){
-	int unbind_fd, bind_fd;
+	if(restart_pru_core(0)) return -1;
+	return restart_pru_core(1);
+}
 
-	// open file descriptors for pru rproc driver
-	unbind_fd = open(PRU_UNBIND_PATH, O_WRONLY);
-	if(unbind_fd == -1){
-		printf("open unbind fail\n");
-		return -1;
-	}
-	bind_fd = open(PRU_BIND_PATH, O_WRONLY);
-	if(bind_fd == -1){
-		printf("open bind fail\n");
+/*******************************************************************************
+* int restart_pru_core(int core)
+* 
+* Stops and starts one PRU so the other keeps running, for instance so the 
+* servo firmware can be reloaded without losing the encoder count. Kernels
+* with a remoteproc state file are told to stop and start, older ones have
+* the core unbound and bound again. Either way this waits for each step to
+* take effect, then for the firmware's heartbeat if shared memory is mapped.
+* Returns 0 once it is running again, -1 otherwise.
+*******************************************************************************/
+int restart_pru_core(int core){
+	const char* name;
+	int i;
+
+	if(core!=0 && core!=1){
+		printf("ERROR: PRU core must be 0 or 1\n");
 		return -1;
 	}
-
-
-	// if pru0 is loaded, unload it
-	if(access(PRU0_UEVENT, F_OK)==0){
-		//printf("unbinding pru0\n");
-		if(write(unbind_fd, PRU0_NAME, PRU_NAME_LEN)<0){
-			printf("ERROR: pru0 unbind failed\n");
+	name = core ? PRU1_NAME : PRU0_NAME;
+	if(find_pru_state_path(core)==0){
+		// writing stop to a core that isn't running fails, which is fine
+		write_pru_sysfs(pru_state_path[core], "stop");
+		if(wait_for_pru_state(core, "offline")){
+			printf("ERROR: pru%d did not stop\n", core);
+			return -1;
+		}
+		if(write_pru_sysfs(pru_state_path[core], "start")<0 || \
+									wait_for_pru_state(core, "running")){
+			printf("ERROR: pru%d did not start\n", core);
 			return -1;
 		}
 	}
-	// if pru1 is loaded, unload it
-	if(access(PRU1_UEVENT, F_OK)==0){
-		//printf("unbinding pru1\n");
-		if(write(unbind_fd, PRU1_NAME, PRU_NAME_LEN)<0){
-			printf("ERROR: pru1 unbind failed\n");
+	else{
+		if(pru_loaded(core)){
+			if(write_pru_sysfs(PRU_UNBIND_PATH, name)<0){
+				printf("ERROR: pru%d unbind failed\n", core);
+				return -1;
+			}
+			for(i=0; pru_loaded(core); i++){
+				if(i*PRU_START_POLL_US >= PRU_START_TIMEOUT_MS*1000){
+					printf("ERROR: pru%d did not unbind\n", core);
+					return -1;
+				}
+				usleep(PRU_START_POLL_US);
+			}
+		}
+		if(write_pru_sysfs(PRU_BIND_PATH, name)<0){
+			printf("ERROR: pru%d bind failed\n", core);
 			return -1;
 		}
+		for(i=0; !pru_loaded(core); i++){
+			if(i*PRU_START_POLL_US >= PRU_START_TIMEOUT_MS*1000){
+				printf("ERROR: pru%d did not bind\n", core);
+				return -1;
+			}
+			usleep(PRU_START_POLL_US);
+		}
 	}
-
-	// now bind both
-	if(write(bind_fd, PRU0_NAME, PRU_NAME_LEN)<0){
-		printf("ERROR: pru0 bind failed\n");
+	if(prusharedMem_32int_ptr==NULL) return 0;
+	if(wait_for_pru_heartbeat(core, PRU_START_TIMEOUT_MS)){
+		printf("ERROR: pru%d firmware not running\n", core);
 		return -1;
 	}
-	if(write(bind_fd, PRU1_NAME, PRU_NAME_LEN)<0){
-		printf("ERROR: pru1 bind failed\n");
+	return 0;
+}
+
+/*******************************************************************************
+* int wait_for_pru_heartbeat(int core, int timeout_ms)
+* 
+* Returns 0 as soon as the core's heartbeat word changes, -1 if it doesn't
+* within timeout_ms or shared memory isn't mapped.
+*******************************************************************************/
+int wait_for_pru_heartbeat(int core, int timeout_ms){
+	unsigned int first;
+	int i, offset;
+
+	if(prusharedMem_32int_ptr==NULL) return -1;
+	if(core!=0 && core!=1){
+		printf("ERROR: PRU core must be 0 or 1\n");
 		return -1;
 	}
-
-	close(unbind_fd);
-	close(bind_fd);
+	offset = core ? PRU1_HEARTBEAT_OFFSET : PRU0_HEARTBEAT_OFFSET;
+	first = prusharedMem_32int_ptr[offset/4];
+	for(i=0; prusharedMem_32int_ptr[offset/4]==first; i++){
+		if(i*PRU_START_POLL_US >= timeout_ms*1000) return -1;
+		usleep(PRU_START_POLL_US);
+	}
 	return 0;
 }
 
+/*******************************************************************************
+* int pru_loaded(int core)
+* 
+* the pru-rproc driver has the core when its uevent file exists
+*******************************************************************************/
+int pru_loaded(int core){
+	return access(core ? PRU1_UEVENT : PRU0_UEVENT, F_OK)==0;
+}
+
+/*******************************************************************************
+* int find_pru_state_path(int core)
+* 
+* Looks through the remoteproc class for the instance named after the core's
+* address and remembers the path of its state file. Returns -1 on kernels
+* without one.
+*******************************************************************************/
+int find_pru_state_path(int core){
+	DIR* dir;
+	struct dirent* ent;
+	char path[PATH_MAX], name[32];
+	const char* addr;
+	int fd, len;
+
+	if(pru_state_path[core][0]!='\0') return 0;
+	addr = core ? "4a338000" : "4a334000";
+	dir = opendir(REMOTEPROC_DIR);
+	if(dir==NULL) return -1;
+	while((ent=readdir(dir))!=NULL){
+		if(strncmp(ent->d_name, "remoteproc", 10)) continue;
+		snprintf(path, sizeof(path), REMOTEPROC_DIR "/%s/name", ent->d_name);
+		fd = open(path, O_RDONLY);
+		if(fd<0) continue;
+		len = read(fd, name, sizeof(name)-1);
+		close(fd);
+		if(len<=0) continue;
+		name[len] = '\0';
+		if(strstr(name, addr)==NULL) continue;
+		snprintf(path, sizeof(path), REMOTEPROC_DIR "/%s/state", ent->d_name);
+		if(access(path, W_OK)!=0) break;
+		strcpy(pru_state_path[core], path);
+		closedir(dir);
+		return 0;
+	}
+	closedir(dir);
+	return -1;
+}
+
+/*******************************************************************************
+* int wait_for_pru_state(int core, const char* state)
+* 
+* polls the remoteproc state file until it reads state, -1 on timeout
+*******************************************************************************/
+int wait_for_pru_state(int core, const char* state){
+	char buf[16];
+	int fd, len, i;
+
+	for(i=0; i*PRU_START_POLL_US < PRU_START_TIMEOUT_MS*1000; i++){
+		fd = open(pru_state_path[core], O_RDONLY);
+		if(fd<0) return -1;
+		len = read(fd, buf, sizeof(buf)-1);
+		close(fd);
+		if(len>0){
+			buf[len] = '\0';
+			if(strncmp(buf, state, strlen(state))==0) return 0;
+		}
+		usleep(PRU_START_POLL_US);
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int write_pru_sysfs(const char* path, const char* buf)
+*******************************************************************************/
+int write_pru_sysfs(const char* path, const char* buf){
+	int fd, ret;
+	fd = open(path, O_WRONLY);
+	if(fd<0) return -1;
+	ret = write(fd, buf, strlen(buf));
+	close(fd);
+	return ret<0 ? -1 : 0;
+}
+
+
+/*******************************************************************************
+* int lazy_init_pru()
+* 
+* Called by everything that uses the shared memory. Programs that didn't ask
+* initialize_cape_subsystems for CAPE_PRU get it set up on first use. Only one
+* attempt is made so a missing driver doesn't cost a bind on every call.
+* Returns 0 if the PRU is ready, -1 otherwise.
+*******************************************************************************/
+int lazy_init_pru(){
+	if(prusharedMem_32int_ptr != NULL) return 0;
+	if(pru_init_attempted) return -1;
+	if(initialize_pru()) return -1;
+	return 0;
+}
 
 /*******************************************************************************
 * int get_pru_encoder_pos();
@@ -151,41 +362,177 @@ int restart_pru(){
 * returns the encoder position or -1 if there was a problem.
 *******************************************************************************/
 int get_pru_encoder_pos(){
-	if(prusharedMem_32int_ptr == NULL) return -1;
+	if(lazy_init_pru()) return -1;
 	else return (int) prusharedMem_32int_ptr[CNT_OFFSET/4];
 }
 
+/*******************************************************************************
+* int get_pru_encoder_state(int* pos, float* velocity, uint64_t* age_ns)
+* 
+* Reads position, velocity in counts per second from the time between the last
+* two edges, and the time since the last edge. Once the time since the last 
+* edge grows past the last period it is used instead so the velocity decays 
+* toward 0 when the encoder stops. The PRU cycle counter restarts on each edge
+* so if it went backwards between reads an edge came in and we read again.
+*******************************************************************************/
+int get_pru_encoder_state(int* pos, float* velocity, uint64_t* age_ns){
+	int i, dir;
+	unsigned int before, after, period;
+	
+	if(lazy_init_pru()) return -1;
+	for(i=0;i<ENC_READ_TRIES;i++){
+		before = *pru0_cycle_ptr;
+		*pos = (int) prusharedMem_32int_ptr[CNT_OFFSET/4];
+		period = prusharedMem_32int_ptr[ENC_PERIOD_OFFSET/4];
+		dir = (int) prusharedMem_32int_ptr[ENC_DIR_OFFSET/4];
+		after = *pru0_cycle_ptr;
+		if(after >= before) break;
+	}
+	if(i==ENC_READ_TRIES) return -1;
+
+	*age_ns = (uint64_t)after*1000000000/PRU_CLOCK_HZ;
+	if(period==0 || dir==0){
+		*velocity = 0.0;
+		return 0;
+	}
+	if(after > period) period = after;
+	*velocity = dir*(PRU_CLOCK_HZ/period);
+	return 0;
+}
+
 /*******************************************************************************
 * int set_pru_encoder_pos(int val)
 * 
 * Set the encoder position, return 0 on success, -1 on failure.
 *******************************************************************************/
 int set_pru_encoder_pos(int val){
-	if(prusharedMem_32int_ptr == NULL) return -1;
+	if(lazy_init_pru()) return -1;
 	else prusharedMem_32int_ptr[CNT_OFFSET/4] = val;
 	return 0;
 }
 
 
+/*******************************************************************************
+* int set_pru_encoder_threshold(int count)
+* 
+* Arms the PRU to report PRU_EVENT_ENCODER_THRESHOLD the next time channel 4
+* reaches count. It fires once and must be armed again for the next one.
+*******************************************************************************/
+int set_pru_encoder_threshold(int count){
+	if(lazy_init_pru()) return -1;
+	prusharedMem_32int_ptr[ENC_ARM_OFFSET/4] = 0;
+	__sync_synchronize();
+	prusharedMem_32int_ptr[ENC_THRESH_OFFSET/4] = (unsigned int)count;
+	// the threshold must land before the PRU sees it armed
+	__sync_synchronize();
+	prusharedMem_32int_ptr[ENC_ARM_OFFSET/4] = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int disable_pru_encoder_threshold()
+*******************************************************************************/
+int disable_pru_encoder_threshold(){
+	if(lazy_init_pru()) return -1;
+	prusharedMem_32int_ptr[ENC_ARM_OFFSET/4] = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int64_t get_pru_event_seq(pru_event_t event)
+* 
+* The PRUs count events in shared memory, returns the current count or -1.
+*******************************************************************************/
+int64_t get_pru_event_seq(pru_event_t event){
+	if(lazy_init_pru()) return -1;
+	switch(event){
+	case PRU_EVENT_SERVO_DONE:
+		return prusharedMem_32int_ptr[SERVO_EVENT_OFFSET/4];
+	case PRU_EVENT_ENCODER_THRESHOLD:
+		return prusharedMem_32int_ptr[ENC_EVENT_OFFSET/4];
+	default:
+		printf("ERROR: invalid pru event\n");
+		return -1;
+	}
+}
+
+/*******************************************************************************
+* int64_t wait_for_pru_event(pru_event_t event, uint32_t seq, int timeout_ms)
+* 
+* Sleeps until the event count moves past seq and returns the new count, or 
+* -1 on timeout. A timeout of 0 or less waits forever. The PRUs are owned by
+* remoteproc which doesn't route their interrupts to userspace, so this wakes
+* every PRU_EVENT_SLEEP_US to look rather than spinning on the count.
+*******************************************************************************/
+int64_t wait_for_pru_event(pru_event_t event, uint32_t seq, int timeout_ms){
+	int64_t now;
+	uint64_t deadline = 0;
+
+	if(timeout_ms>0) deadline = micros_since_boot() + (uint64_t)timeout_ms*1000;
+	while(1){
+		now = get_pru_event_seq(event);
+		if(now<0) return -1;
+		if((uint32_t)now!=seq) return now;
+		if(timeout_ms>0 && micros_since_boot()>=deadline) return -1;
+		usleep(PRU_EVENT_SLEEP_US);
+	}
+}
 
 /*******************************************************************************
 * int send_servo_pulse_us(int ch, int us)
 * 
 * Sends a single pulse of duration us (microseconds) to a single channel (ch)
-* This must be called regularly (>40hz) to keep servo or ESC awake.
+* This must be called regularly (>40hz) to keep servo or ESC awake unless the
+* PRU is in repeat mode, in which case this sets the width sent every frame.
 * returns -2 on fatal error (if the PRU is not set up or channel out of bounds)
 * returns -1 if the pulse was not sent because a pulse is already going
 * returns 0 if all went well.
 *******************************************************************************/
 int send_servo_pulse_us(int ch, int us){
+	if(us<0 || us>INT_MAX/1000){
+		printf("ERROR: pulse width out of range\n");
+		return -2;
+	}
+	return send_servo_pulse_ns(ch, us*1000);
+}
+
+/*******************************************************************************
+* int send_servo_pulse_ns(int ch, int ns)
+* 
+* Like send_servo_pulse_us with the width in nanoseconds. The PRU times edges
+* with its 200MHz IEP counter so the width is rounded down to 5ns.
+*******************************************************************************/
+int send_servo_pulse_ns(int ch, int ns){
+	unsigned int counts;
+
 	// Sanity Checks
 	if(ch<1 || ch>SERVO_CHANNELS){
 		printf("ERROR: Servo Channel must be between 1&%d\n", SERVO_CHANNELS);
 		return -2;
-	} if(prusharedMem_32int_ptr == NULL){
+	} if(lazy_init_pru()){
 		printf("ERROR: PRU servo Controller not initialized\n");
 		return -2;
 	}
+	if(ns<0){
+		printf("ERROR: pulse width must be positive\n");
+		return -2;
+	}
+	if(dshot_on()){
+		printf("ERROR: servo pulses can't be sent while DShot is on\n");
+		return -2;
+	}
+	counts = ns/PRU_SERVO_NS_PER_COUNT;
+	
+	// in repeat mode just update the width the PRU sends every frame
+	if(prusharedMem_32int_ptr[PERIOD_OFFSET/4] != 0){
+		if(counts >= prusharedMem_32int_ptr[PERIOD_OFFSET/4]){
+			printf("ERROR: pulse width must be shorter than the frame\n");
+			return -2;
+		}
+		prusharedMem_32int_ptr[WIDTH_OFFSET/4 + ch-1] = counts;
+		trace_point(TRACE_ACTUATOR);
+		return 0;
+	}
 
 	// first check to make sure no pulse is currently being sent
 	if(prusharedMem_32int_ptr[ch-1] != 0){
@@ -193,34 +540,199 @@ int send_servo_pulse_us(int ch, int us){
 		return -1;
 	}
 
-	// PRU runs at 200Mhz. find #loops needed
-	unsigned int num_loops = ((us*200.0)/PRU_SERVO_LOOP_INSTRUCTIONS); 
 	// write to PRU shared memory
-	prusharedMem_32int_ptr[ch-1] = num_loops;
+	prusharedMem_32int_ptr[ch-1] = counts;
+	trace_point(TRACE_ACTUATOR);
+	return 0;
+}
+
+/*******************************************************************************
+* int set_servo_repeat_rate(int hz)
+* 
+* Puts the PRU in repeat mode where it sends the last width given to each 
+* channel once every frame at hz without further help from the ARM. Call 
+* with 0 to return to sending single pulses. Channels start out idle and begin
+* pulsing once given a width. Returns 0 on success, -1 on failure.
+*******************************************************************************/
+int set_servo_repeat_rate(int hz){
+	int i;
+	
+	if(lazy_init_pru()){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -1;
+	}
+	if(hz==0){
+		prusharedMem_32int_ptr[PERIOD_OFFSET/4] = 0;
+		return 0;
+	}
+	if(dshot_on()){
+		printf("ERROR: servo repeat mode can't be used while DShot is on\n");
+		return -1;
+	}
+	if(hz<SERVO_MIN_RATE || hz>SERVO_MAX_RATE){
+		printf("ERROR: servo repeat rate must be 0 or between %d & %d\n",\
+											SERVO_MIN_RATE, SERVO_MAX_RATE);
+		return -1;
+	}
+	// start with no pulses until the user sets widths
+	if(prusharedMem_32int_ptr[PERIOD_OFFSET/4] == 0){
+		for(i=0;i<SERVO_CHANNELS;i++){
+			prusharedMem_32int_ptr[WIDTH_OFFSET/4 + i] = 0;
+		}
+	}
+	// PRU counts 200Mhz IEP ticks per frame
+	prusharedMem_32int_ptr[PERIOD_OFFSET/4] = PRU_SERVO_COUNTS_PER_S/hz;
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_servo_repeat(int ch)
+* 
+* In repeat mode, stops pulses on one channel until a new width is sent. 
+* Pass 0 to stop every channel.
+*******************************************************************************/
+int stop_servo_repeat(int ch){
+	int i;
+	
+	if(ch<0 || ch>SERVO_CHANNELS){
+		printf("ERROR: Servo Channel must be between 0&%d\n", SERVO_CHANNELS);
+		return -1;
+	} if(lazy_init_pru()){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -1;
+	}
+	for(i=1;i<=SERVO_CHANNELS;i++){
+		if(ch==0 || ch==i) prusharedMem_32int_ptr[WIDTH_OFFSET/4 + i-1] = 0;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_servo_outputs()
+* 
+* Fail safe stop used by the control watchdog. Leaves repeat mode and drops
+* every width, staged set and waiting pulse straight in shared memory so it
+* works from any thread. A pulse already high finishes on time. A staged
+* DShot frame is dropped too, DShot ESCs stop once frames stop coming.
+*******************************************************************************/
+int stop_servo_outputs(){
+	if(prusharedMem_32int_ptr==NULL) return -1;
+	prusharedMem_32int_ptr[DSHOT_COMMIT_OFFSET/4] = 0;
+	prusharedMem_32int_ptr[PERIOD_OFFSET/4] = 0;
+	prusharedMem_32int_ptr[COMMIT_OFFSET/4] = 0;
+	memset(prusharedMem_32int_ptr + WIDTH_OFFSET/4, 0, SERVO_CHANNELS*4);
+	memset(prusharedMem_32int_ptr + STAGE_OFFSET/4, 0, SERVO_CHANNELS*4);
+	memset(prusharedMem_32int_ptr, 0, SERVO_CHANNELS*4);
+	return 0;
+}
+
+/*******************************************************************************
+* int send_servo_pulses_us(const int us[8])
+* 
+* Writes the widths for all channels to a staging area in PRU shared memory 
+* and then sets a single commit word. The PRU takes the whole set at once so 
+* every pulse starts in the same loop. A width of 0 leaves that channel idle.
+* In repeat mode the set is taken at the next frame, otherwise within 25us.
+* returns -2 on fatal error, -1 if the previous set or a pulse is still in
+* flight, and 0 if all went well.
+*******************************************************************************/
+int send_servo_pulses_us(const int us[8]){
+	int i;
+	int ns[SERVO_CHANNELS];
+
+	for(i=0;i<SERVO_CHANNELS;i++){
+		if(us[i]<0 || us[i]>INT_MAX/1000){
+			printf("ERROR: pulse width out of range\n");
+			return -2;
+		}
+		ns[i] = us[i]*1000;
+	}
+	return send_servo_pulses_ns(ns);
+}
+
+/*******************************************************************************
+* int send_servo_pulses_ns(const int ns[8])
+* 
+* send_servo_pulses_us with widths in nanoseconds, rounded down to 5ns.
+*******************************************************************************/
+int send_servo_pulses_ns(const int ns[8]){
+	int i;
+	unsigned int period;
+	unsigned int counts[SERVO_CHANNELS];
+
+	if(lazy_init_pru()){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -2;
+	}
+	if(dshot_on()){
+		printf("ERROR: servo pulses can't be sent while DShot is on\n");
+		return -2;
+	}
+	period = prusharedMem_32int_ptr[PERIOD_OFFSET/4];
+	for(i=0;i<SERVO_CHANNELS;i++){
+		if(ns[i]<0){
+			printf("ERROR: pulse width must be positive\n");
+			return -2;
+		}
+		counts[i] = ns[i]/PRU_SERVO_NS_PER_COUNT;
+		if(period!=0 && counts[i]>=period){
+			printf("ERROR: pulse width must be shorter than the frame\n");
+			return -2;
+		}
+	}
+	// the PRU clears the commit word once it has taken the last set
+	if(prusharedMem_32int_ptr[COMMIT_OFFSET/4] != 0){
+		printf("WARNING: Tried to commit new pulses before the last set\n");
+		return -1;
+	}
+	// in single pulse mode all channels must be idle to start together
+	if(period==0){
+		for(i=0;i<SERVO_CHANNELS;i++){
+			if(prusharedMem_32int_ptr[i] != 0){
+				printf("WARNING: Tried to start a new pulse amidst another\n");
+				return -1;
+			}
+		}
+	}
+	for(i=0;i<SERVO_CHANNELS;i++){
+		prusharedMem_32int_ptr[STAGE_OFFSET/4 + i] = counts[i];
+	}
+	// widths must land before the commit word does
+	__sync_synchronize();
+	prusharedMem_32int_ptr[COMMIT_OFFSET/4] = 1;
+	trace_point(TRACE_ACTUATOR);
 	return 0;
 }
 
 /*******************************************************************************
 * int send_servo_pulse_us_all(int us)
 * 
-* Sends a single pulse of duration us (microseconds) to all channels.
+* Sends a single pulse of duration us (microseconds) to all channels at once.
 * This must be called regularly (>40hz) to keep servos or ESCs awake.
 *******************************************************************************/
 int send_servo_pulse_us_all(int us){
-	int i, ret_ch;
-	int ret = 0;
-	for(i=1;i<=SERVO_CHANNELS; i++){
-		ret_ch = send_servo_pulse_us(i, us);
-		if(ret_ch == -2) return -2;
-		else if(ret_ch == -1) ret=-1;
+	if(us<0 || us>INT_MAX/1000){
+		printf("ERROR: pulse width out of range\n");
+		return -2;
 	}
-	return ret;
+	return send_servo_pulse_ns_all(us*1000);
+}
+
+/*******************************************************************************
+* int send_servo_pulse_ns_all(int ns)
+*******************************************************************************/
+int send_servo_pulse_ns_all(int ns){
+	int i;
+	int widths[SERVO_CHANNELS];
+	for(i=0;i<SERVO_CHANNELS; i++) widths[i] = ns;
+	return send_servo_pulses_ns(widths);
 }
 
 /*******************************************************************************
 * int send_servo_pulse_normalized(int ch, float input)
 * 
-*
+* The normalized functions below convert straight to nanoseconds so the
+* input isn't rounded to whole microseconds before reaching the PRU.
 *******************************************************************************/
 int send_servo_pulse_normalized(int ch, float input){
 	if(ch<1 || ch>SERVO_CHANNELS){
@@ -231,8 +743,8 @@ int send_servo_pulse_normalized(int ch, float input){
 		printf("ERROR: normalized input must be between -1 & 1\n");
 		return -1;
 	}
-	float micros = SERVO_MID_US + (input*(SERVO_NORMAL_RANGE/2));
-	return send_servo_pulse_us(ch, micros);
+	return send_servo_pulse_ns(ch, SERVO_MID_US*1000 + \
+						lrintf(input*(SERVO_NORMAL_RANGE/2)*1000.0f));
 }
 
 /*******************************************************************************
@@ -241,14 +753,12 @@ int send_servo_pulse_normalized(int ch, float input){
 * 
 *******************************************************************************/
 int send_servo_pulse_normalized_all(float input){
-	int i, ret_ch;
-	int ret = 0;
-	for(i=1;i<=SERVO_CHANNELS; i++){
-		ret_ch = send_servo_pulse_normalized(i, input);
-		if(ret_ch == -2) return -2;
-		else if(ret_ch == -1) ret=-1;
+	if(input<-1.5 || input>1.5){
+		printf("ERROR: normalized input must be between -1 & 1\n");
+		return -1;
 	}
-	return ret;
+	return send_servo_pulse_ns_all(SERVO_MID_US*1000 + \
+						lrintf(input*(SERVO_NORMAL_RANGE/2)*1000.0f));
 }
 
 /*******************************************************************************
@@ -266,8 +776,7 @@ int send_esc_pulse_normalized(int ch, float input){
 		printf("ERROR: normalized input must be between 0 & 1\n");
 		return -1;
 	}
-	float micros = 1000.0 + (input*1000.0);
-	return send_servo_pulse_us(ch, micros);
+	return send_servo_pulse_ns(ch, 1000000 + lrintf(input*1000000.0f));
 }
 
 /*******************************************************************************
@@ -276,14 +785,11 @@ int send_esc_pulse_normalized(int ch, float input){
 * 
 *******************************************************************************/
 int send_esc_pulse_normalized_all(float input){
-	int i, ret_ch;
-	int ret = 0;
-	for(i=1;i<=SERVO_CHANNELS; i++){
-		ret_ch = send_esc_pulse_normalized(i, input);
-		if(ret_ch == -2) return -2;
-		else if(ret_ch == -1) ret=-1;
+	if(input < -0.1 || input > 1.0){
+		printf("ERROR: normalized input must be between 0 & 1\n");
+		return -1;
 	}
-	return ret;
+	return send_servo_pulse_ns_all(1000000 + lrintf(input*1000000.0f));
 }
 
 
@@ -302,8 +808,7 @@ int send_oneshot_pulse_normalized(int ch, float input){
 		printf("ERROR: normalized input must be between 0 & 1\n");
 		return -1;
 	}
-	float micros = 125.0 + (input*125.0);
-	return send_servo_pulse_us(ch, micros);
+	return send_servo_pulse_ns(ch, 125000 + lrintf(input*125000.0f));
 }
 
 /*******************************************************************************
@@ -312,12 +817,202 @@ int send_oneshot_pulse_normalized(int ch, float input){
 * 
 *******************************************************************************/
 int send_oneshot_pulse_normalized_all(float input){
-	int i, ret_ch;
-	int ret = 0;
-	for(i=1;i<=SERVO_CHANNELS; i++){
-		ret_ch = send_oneshot_pulse_normalized(i, input);
-		if(ret_ch == -2) return -2;
-		else if(ret_ch == -1) ret=-1;
-	}
-	return ret;
-}
\ No newline at end of file
+	if(input < -0.1 || input > 1.0){
+		printf("ERROR: normalized input must be between 0 & 1\n");
+		return -1;
+	}
+	return send_servo_pulse_ns_all(125000 + lrintf(input*125000.0f));
+}
+
+/*******************************************************************************
+* int send_multishot_pulse_normalized(int ch, float input)
+* 
+* normalized input of 0-1 corresponds to output pulse from 5-25 us
+* input is allowed to go down to -0.1 so ESC can be armed below minimum throttle
+*******************************************************************************/
+int send_multishot_pulse_normalized(int ch, float input){
+	if(ch < 1 || ch > SERVO_CHANNELS){
+		printf("ERROR: Servo Channel must be between 1&%d\n", SERVO_CHANNELS);
+		return -1;
+	}
+	if(input < -0.1 || input > 1.0){
+		printf("ERROR: normalized input must be between 0 & 1\n");
+		return -1;
+	}
+	return send_servo_pulse_ns(ch, 5000 + lrintf(input*20000.0f));
+}
+
+/*******************************************************************************
+* int send_multishot_pulse_normalized_all(float input)
+* 
+* 
+*******************************************************************************/
+int send_multishot_pulse_normalized_all(float input){
+	if(input < -0.1 || input > 1.0){
+		printf("ERROR: normalized input must be between 0 & 1\n");
+		return -1;
+	}
+	return send_servo_pulse_ns_all(5000 + lrintf(input*20000.0f));
+}
+
+/*******************************************************************************
+* int set_dshot_rate(int rate)
+* 
+* Switches PRU1 from servo pulses to DShot150, 300 or 600 frames, or back to
+* servo pulses with 0. Servo widths and repeat mode are dropped either way.
+* Bits are 1000/rate us long with a 1 high for 3/4 and a 0 for 3/8 of that.
+*******************************************************************************/
+int set_dshot_rate(int rate){
+	unsigned int bit;
+	
+	if(rate!=0 && rate!=DSHOT150 && rate!=DSHOT300 && rate!=DSHOT600){
+		printf("ERROR: DShot rate must be 0, 150, 300 or 600\n");
+		return -1;
+	}
+	if(lazy_init_pru()){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -1;
+	}
+	stop_servo_outputs();
+	if(rate==0){
+		prusharedMem_32int_ptr[DSHOT_BIT_OFFSET/4] = 0;
+		return 0;
+	}
+	bit = PRU_SERVO_COUNTS_PER_S/(rate*1000);
+	prusharedMem_32int_ptr[DSHOT_T0H_OFFSET/4] = bit*3/8;
+	prusharedMem_32int_ptr[DSHOT_T1H_OFFSET/4] = bit*3/4;
+	// timing must land before the PRU sees DShot on
+	__sync_synchronize();
+	prusharedMem_32int_ptr[DSHOT_BIT_OFFSET/4] = bit;
+	return 0;
+}
+
+/*******************************************************************************
+* int send_dshot_values(const int values[8])
+* 
+* Stages one frame per channel with the 11 bit DShot value for it and hands
+* them all to the PRU with one commit, so every frame goes out together. A
+* value of -1 sends nothing on that channel. Returns -2 on fatal error, -1 if
+* the previous frames haven't been taken by the PRU yet, 0 on success.
+*******************************************************************************/
+int send_dshot_values(const int values[8]){
+	return stage_dshot_frames(values, 0);
+}
+
+/*******************************************************************************
+* int send_dshot_normalized(const float throttle[8])
+* 
+* Throttle from 0 to 1 maps onto DShot values 48-2047. Like the ESC pulse
+* functions input may go down to -0.1, anything below 0 sends the motor stop
+* value 0, and NAN leaves that channel idle.
+*******************************************************************************/
+int send_dshot_normalized(const float throttle[8]){
+	int i;
+	int values[SERVO_CHANNELS];
+	
+	for(i=0;i<SERVO_CHANNELS;i++){
+		if(isnan(throttle[i])) values[i] = -1;
+		else if(throttle[i]<-0.1f || throttle[i]>1.0f){
+			printf("ERROR: normalized input must be between 0 & 1\n");
+			return -2;
+		}
+		else if(throttle[i]<0.0f) values[i] = DSHOT_CMD_MOTOR_STOP;
+		else values[i] = DSHOT_MIN_THROTTLE + lrintf(throttle[i] * \
+							(DSHOT_MAX_THROTTLE-DSHOT_MIN_THROTTLE));
+	}
+	return stage_dshot_frames(values, 0);
+}
+
+/*******************************************************************************
+* int send_dshot_command(int ch, int cmd)
+* 
+* Sends a DShot command from 0 to 47 once on channel ch, or every channel if
+* ch is 0, with the telemetry bit set as ESCs expect for commands. Motors
+* must be stopped, and most ESCs only act on settings commands after several
+* repeats in a row.
+*******************************************************************************/
+int send_dshot_command(int ch, int cmd){
+	int i;
+	int values[SERVO_CHANNELS];
+	
+	if(ch<0 || ch>SERVO_CHANNELS){
+		printf("ERROR: Servo Channel must be between 0&%d\n", SERVO_CHANNELS);
+		return -2;
+	}
+	if(cmd<0 || cmd>DSHOT_CMD_MAX){
+		printf("ERROR: DShot command must be between 0 & %d\n", \
+														DSHOT_CMD_MAX);
+		return -2;
+	}
+	for(i=0;i<SERVO_CHANNELS;i++){
+		values[i] = (ch==0 || ch==i+1) ? cmd : -1;
+	}
+	return stage_dshot_frames(values, 1);
+}
+
+/*******************************************************************************
+* int dshot_on()
+*******************************************************************************/
+int dshot_on(){
+	return prusharedMem_32int_ptr[DSHOT_BIT_OFFSET/4]!=0;
+}
+
+/*******************************************************************************
+* uint16_t dshot_frame(int value, int telemetry)
+* 
+* 11 bit value, telemetry request bit, then the xor of the three nibbles
+* above as a checksum
+*******************************************************************************/
+uint16_t dshot_frame(int value, int telemetry){
+	uint16_t packet = (value<<1) | (telemetry ? 1 : 0);
+	return (packet<<4) | ((packet ^ (packet>>4) ^ (packet>>8)) & 0x0F);
+}
+
+/*******************************************************************************
+* int stage_dshot_frames(const int values[8], int telemetry)
+* 
+* The PRU clocks all channels out bit by bit together, so the frames are
+* turned around into one byte per bit holding the outputs sending a 1.
+*******************************************************************************/
+int stage_dshot_frames(const int values[8], int telemetry){
+	uint8_t ones[DSHOT_FRAME_BITS];
+	unsigned int active = 0;
+	uint16_t frame;
+	int i, k;
+	
+	if(lazy_init_pru()){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -2;
+	}
+	if(!dshot_on()){
+		printf("ERROR: call set_dshot_rate before sending DShot frames\n");
+		return -2;
+	}
+	memset(ones, 0, sizeof(ones));
+	for(i=0;i<SERVO_CHANNELS;i++){
+		if(values[i]==-1) continue;
+		if(values[i]<0 || values[i]>DSHOT_MAX_THROTTLE){
+			printf("ERROR: DShot value must be between 0 & %d\n", \
+														DSHOT_MAX_THROTTLE);
+			return -2;
+		}
+		active |= 1<<dshot_out_bit[i];
+		frame = dshot_frame(values[i], telemetry);
+		for(k=0;k<DSHOT_FRAME_BITS;k++){
+			if(frame & (0x8000>>k)) ones[k] |= 1<<dshot_out_bit[i];
+		}
+	}
+	if(active==0) return 0;
+	// the PRU clears the commit word once it has taken the last frame
+	if(prusharedMem_32int_ptr[DSHOT_COMMIT_OFFSET/4] != 0){
+		printf("WARNING: Tried to commit DShot frames before the last set\n");
+		return -1;
+	}
+	prusharedMem_32int_ptr[DSHOT_ACTIVE_OFFSET/4] = active;
+	memcpy(prusharedMem_32int_ptr + DSHOT_FRAME_OFFSET/4, ones, sizeof(ones));
+	// frames must land before the commit word does
+	__sync_synchronize();
+	prusharedMem_32int_ptr[DSHOT_COMMIT_OFFSET/4] = 1;
+	trace_point(TRACE_ACTUATOR);
+	return 0;
+}
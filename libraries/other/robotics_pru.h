@@ -16,6 +16,23 @@ int initialize_pru();
 *******************************************************************************/
 int restart_pru();
 
+/*******************************************************************************
+* int restart_pru_core(int core)
+* 
+* Reloads the firmware on PRU 0 or 1 only and waits until it is running
+* again, checking its heartbeat when shared memory is mapped. Returns 0 on
+* success, -1 on failure.
+*******************************************************************************/
+int restart_pru_core(int core);
+
+/*******************************************************************************
+* int wait_for_pru_heartbeat(int core, int timeout_ms)
+* 
+* Returns 0 once the firmware on the core shows it is running, -1 if it
+* doesn't within timeout_ms.
+*******************************************************************************/
+int wait_for_pru_heartbeat(int core, int timeout_ms);
+
 /*******************************************************************************
 * int get_pru_encoder_pos();
 * 
@@ -23,6 +40,14 @@ int restart_pru();
 *******************************************************************************/
 int get_pru_encoder_pos();
 
+/*******************************************************************************
+* int get_pru_encoder_state(int* pos, float* velocity, uint64_t* age_ns)
+* 
+* Reads position, velocity in counts/s and nanoseconds since the last edge
+* consistently. Return 0 on success, -1 on failure.
+*******************************************************************************/
+int get_pru_encoder_state(int* pos, float* velocity, uint64_t* age_ns);
+
 /*******************************************************************************
 * int set_pru_encoder_pos()
 * 
@@ -0,0 +1,356 @@
+/*******************************************************************************
+* rt_threads.c
+*
+* One place to decide the scheduling policy, priority and CPU of every thread
+* the library starts, plus memory locking so those threads don't take page
+* faults once running. Services call create_rt_thread instead of pthread_create
+* so the attributes are applied before the thread runs its first instruction.
+* Each service also gets an explicit stack size instead of the 8MB default,
+* which matters once memory is locked since mlockall makes every page of
+* every thread's stack resident. glibc keeps the stacks of finished threads
+* and hands them to new threads of the same size, so restarting a service
+* reuses its old stack rather than mapping a new one.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include <sched.h>
+
+#define RT_PREFAULT_MAX_KB	1024	// most stack a thread may prefault
+#define RT_PAGE_SIZE		4096
+#define RT_MIN_STACK_KB		32
+#define RT_MAX_STACK_KB		8192
+#define RT_STACK_MARGIN_KB	16		// never prefault closer to the end
+// library threads only run their own loops, callbacks get room for user code
+#ifdef RC_SMALL_MEMORY
+#define RT_DEFAULT_STACK_KB		64
+#define RT_CALLBACK_STACK_KB	256
+#else
+#define RT_DEFAULT_STACK_KB		128
+#define RT_CALLBACK_STACK_KB	512
+#endif
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+const char* rt_service_names[RT_SERVICE_COUNT] = { \
+	"imu", \
+	"reactor", \
+	"dsm", \
+	"barometer", \
+	"i2c", \
+	"uart", \
+	"logger", \
+	"imu_callback", \
+	"watchdog", \
+	"telemetry", \
+	"errors", \
+	"app" };
+
+// what each service actually got the last time one of its threads started
+typedef struct rt_record_t{
+	int threads;	// number started so far
+	int policy;
+	int priority;
+	int cpu;
+	int stack_kb;
+	int fallback;	// 1 if the requested policy was refused
+} rt_record_t;
+
+rt_config_t rt_config;
+int rt_config_set = 0;
+int rt_memory_locked = 0;
+rt_record_t rt_records[RT_SERVICE_COUNT];
+pthread_mutex_t rt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// handed from create_rt_thread to the new thread
+typedef struct rt_start_t{
+	void* (*func)(void*);
+	void* arg;
+	int prefault_kb;
+} rt_start_t;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* rt_thread_start(void* ptr);
+void prefault_stack(int kb);
+const char* rt_policy_name(int policy);
+
+/*******************************************************************************
+* rt_config_t get_default_rt_config()
+*
+* The control watchdog at the top FIFO priority, the IMU handler just below
+* it with its callback worker one below that, the reactor at half, and
+* everything else under the normal time-sharing scheduler. Memory is not
+* locked by default. Threads that run user callbacks, the IMU callback
+* worker, the reactor and application threads, get a larger stack.
+*******************************************************************************/
+rt_config_t get_default_rt_config(){
+	rt_config_t conf;
+	int i;
+
+	for(i=0;i<RT_SERVICE_COUNT;i++){
+		conf.service[i].policy = SCHED_OTHER;
+		conf.service[i].priority = 0;
+		conf.service[i].cpu = -1;
+		conf.service[i].stack_kb = RT_DEFAULT_STACK_KB;
+	}
+	conf.service[RT_SERVICE_IMU_CALLBACK].stack_kb = RT_CALLBACK_STACK_KB;
+	conf.service[RT_SERVICE_REACTOR].stack_kb = RT_CALLBACK_STACK_KB;
+	conf.service[RT_SERVICE_APP].stack_kb = RT_CALLBACK_STACK_KB;
+	conf.service[RT_SERVICE_IMU].stack_kb = RT_CALLBACK_STACK_KB;
+	conf.service[RT_SERVICE_WATCHDOG].stack_kb = RT_CALLBACK_STACK_KB;
+	conf.service[RT_SERVICE_IMU].policy = SCHED_FIFO;
+	conf.service[RT_SERVICE_IMU].priority = sched_get_priority_max(SCHED_FIFO)-1;
+	conf.service[RT_SERVICE_IMU_CALLBACK].policy = SCHED_FIFO;
+	conf.service[RT_SERVICE_IMU_CALLBACK].priority = \
+									sched_get_priority_max(SCHED_FIFO)-2;
+	conf.service[RT_SERVICE_REACTOR].policy = SCHED_FIFO;
+	conf.service[RT_SERVICE_REACTOR].priority = \
+									sched_get_priority_max(SCHED_FIFO)/2;
+	conf.service[RT_SERVICE_WATCHDOG].policy = SCHED_FIFO;
+	conf.service[RT_SERVICE_WATCHDOG].priority = \
+									sched_get_priority_max(SCHED_FIFO);
+	conf.lock_memory = 0;
+	conf.prefault_stack_kb = 64;
+	return conf;
+}
+
+/*******************************************************************************
+* int set_rt_config(rt_config_t conf)
+*
+* Validates and stores the configuration used for threads started from now on.
+* Call before initialize_cape for lock_memory to take effect there.
+*******************************************************************************/
+int set_rt_config(rt_config_t conf){
+	int i, min, max;
+
+	for(i=0;i<RT_SERVICE_COUNT;i++){
+		if(conf.service[i].policy!=SCHED_OTHER && \
+			conf.service[i].policy!=SCHED_FIFO && \
+			conf.service[i].policy!=SCHED_RR){
+			printf("ERROR: %s policy must be SCHED_OTHER, SCHED_FIFO or \
+SCHED_RR\n", rt_service_names[i]);
+			return -1;
+		}
+		min = sched_get_priority_min(conf.service[i].policy);
+		max = sched_get_priority_max(conf.service[i].policy);
+		if(conf.service[i].priority<min || conf.service[i].priority>max){
+			printf("ERROR: %s priority must be between %d & %d\n", \
+										rt_service_names[i], min, max);
+			return -1;
+		}
+		if(conf.service[i].cpu>=CPU_SETSIZE){
+			printf("ERROR: %s cpu out of range\n", rt_service_names[i]);
+			return -1;
+		}
+		if(conf.service[i].stack_kb!=0 && \
+				(conf.service[i].stack_kb<RT_MIN_STACK_KB || \
+				conf.service[i].stack_kb>RT_MAX_STACK_KB)){
+			printf("ERROR: %s stack_kb must be 0 or between %d & %d\n", \
+					rt_service_names[i], RT_MIN_STACK_KB, RT_MAX_STACK_KB);
+			return -1;
+		}
+	}
+	if(conf.prefault_stack_kb<0 || conf.prefault_stack_kb>RT_PREFAULT_MAX_KB){
+		printf("ERROR: prefault_stack_kb must be between 0 & %d\n", \
+														RT_PREFAULT_MAX_KB);
+		return -1;
+	}
+	pthread_mutex_lock(&rt_mutex);
+	rt_config = conf;
+	rt_config_set = 1;
+	pthread_mutex_unlock(&rt_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* rt_config_t get_rt_config()
+*******************************************************************************/
+rt_config_t get_rt_config(){
+	rt_config_t conf;
+	pthread_mutex_lock(&rt_mutex);
+	if(!rt_config_set){
+		rt_config = get_default_rt_config();
+		rt_config_set = 1;
+	}
+	conf = rt_config;
+	pthread_mutex_unlock(&rt_mutex);
+	return conf;
+}
+
+/*******************************************************************************
+* int lock_rt_memory()
+*
+* mlockall current and future pages then touch a stack's worth below us so
+* the main thread's stack is resident too. Called by initialize_cape when
+* lock_memory is set. Returns -1 if the lock was refused, usually not root.
+*******************************************************************************/
+int lock_rt_memory(){
+	rt_config_t conf = get_rt_config();
+	if(mlockall(MCL_CURRENT|MCL_FUTURE)<0){
+		printf("WARNING: mlockall failed: %s\n", strerror(errno));
+		return -1;
+	}
+	prefault_stack(conf.prefault_stack_kb);
+	rt_memory_locked = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int create_rt_thread(pthread_t* thread, rt_service_t service,
+*									void* (*func)(void*), void* arg)
+*
+* pthread_create with the service's policy, priority, CPU and stack size set
+* through the attributes so they apply from the start. A thread never
+* prefaults more than its stack holds. If the kernel refuses the policy,
+* usually because we aren't root, the thread is started with inherited
+* scheduling instead and the fallback is noted for print_rt_summary.
+*******************************************************************************/
+int create_rt_thread(pthread_t* thread, rt_service_t service, \
+										void* (*func)(void*), void* arg){
+	rt_config_t conf;
+	rt_thread_config_t tc;
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+	rt_start_t* start;
+	int ret, fallback = 0;
+
+	if(service<0 || service>=RT_SERVICE_COUNT){
+		printf("ERROR: invalid rt service\n");
+		return -1;
+	}
+	conf = get_rt_config();
+	tc = conf.service[service];
+
+	start = malloc(sizeof(rt_start_t));
+	if(start==NULL) return -1;
+	start->func = func;
+	start->arg = arg;
+	start->prefault_kb = conf.lock_memory ? conf.prefault_stack_kb : 0;
+	if(tc.stack_kb>0 && start->prefault_kb>tc.stack_kb-RT_STACK_MARGIN_KB){
+		start->prefault_kb = tc.stack_kb-RT_STACK_MARGIN_KB;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	if(tc.stack_kb>0 && \
+			pthread_attr_setstacksize(&attr, (size_t)tc.stack_kb*1024)){
+		printf("ERROR: invalid %s stack size\n", rt_service_names[service]);
+		pthread_attr_destroy(&attr);
+		free(start);
+		return -1;
+	}
+	if(tc.cpu>=0){
+		CPU_ZERO(&cpus);
+		CPU_SET(tc.cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, tc.policy);
+	param.sched_priority = tc.priority;
+	pthread_attr_setschedparam(&attr, &param);
+
+	ret = pthread_create(thread, &attr, rt_thread_start, start);
+	if(ret==EPERM || ret==EINVAL){
+		// not allowed that policy, run it anyway with what we inherit
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(thread, &attr, rt_thread_start, start);
+		fallback = 1;
+	}
+	pthread_attr_destroy(&attr);
+	if(ret){
+		printf("ERROR: failed to start %s thread\n", rt_service_names[service]);
+		free(start);
+		return -1;
+	}
+
+	// record what it really got
+	pthread_mutex_lock(&rt_mutex);
+	rt_records[service].threads++;
+	pthread_getschedparam(*thread, &rt_records[service].policy, &param);
+	rt_records[service].priority = param.sched_priority;
+	rt_records[service].cpu = tc.cpu;
+	rt_records[service].stack_kb = tc.stack_kb;
+	rt_records[service].fallback = fallback;
+	pthread_mutex_unlock(&rt_mutex);
+
+	#ifdef DEBUG
+	printf("started %s thread %s %d\n", rt_service_names[service], \
+			rt_policy_name(rt_records[service].policy), param.sched_priority);
+	#endif
+	return 0;
+}
+
+/*******************************************************************************
+* int print_rt_summary()
+*
+* Prints the requested and actual scheduling and the stack size of every
+* service that has started a thread, and whether memory is locked.
+*******************************************************************************/
+int print_rt_summary(){
+	rt_config_t conf = get_rt_config();
+	int i;
+
+	printf("service      threads  requested       actual          ");
+	printf("stack  cpu\n");
+	pthread_mutex_lock(&rt_mutex);
+	for(i=0;i<RT_SERVICE_COUNT;i++){
+		if(rt_records[i].threads==0) continue;
+		printf("%-12s %-8d %-11s%3d  %-11s%3d  ", rt_service_names[i], \
+			rt_records[i].threads, rt_policy_name(conf.service[i].policy), \
+			conf.service[i].priority, rt_policy_name(rt_records[i].policy), \
+			rt_records[i].priority);
+		if(rt_records[i].stack_kb>0) printf("%4dK  ", rt_records[i].stack_kb);
+		else printf("  def  ");
+		if(rt_records[i].cpu<0) printf("any");
+		else printf("%d", rt_records[i].cpu);
+		if(rt_records[i].fallback) printf("  (policy refused)");
+		printf("\n");
+	}
+	pthread_mutex_unlock(&rt_mutex);
+	printf("memory locked: %s\n", rt_memory_locked ? "yes" : "no");
+	return 0;
+}
+
+/*******************************************************************************
+* void* rt_thread_start(void* ptr)
+*
+* Every library thread starts here, prefaulting its stack if memory is locked
+* before running the service's own function.
+*******************************************************************************/
+void* rt_thread_start(void* ptr){
+	rt_start_t start = *(rt_start_t*)ptr;
+	free(ptr);
+	if(start.prefault_kb>0) prefault_stack(start.prefault_kb);
+	return start.func(start.arg);
+}
+
+/*******************************************************************************
+* void prefault_stack(int kb)
+*
+* Touch one byte per page of a kb sized local buffer so the stack pages are
+* mapped now rather than on first use in the loop.
+*******************************************************************************/
+void prefault_stack(int kb){
+	if(kb<=0) return;
+	volatile char buf[kb*1024];
+	int i;
+	for(i=0;i<kb*1024;i+=RT_PAGE_SIZE) buf[i] = 0;
+	(void)buf[0]; // volatile read keeps the buffer from being optimized out
+	return;
+}
+
+/*******************************************************************************
+* const char* rt_policy_name(int policy)
+*******************************************************************************/
+const char* rt_policy_name(int policy){
+	switch(policy){
+	case SCHED_FIFO:	return "SCHED_FIFO";
+	case SCHED_RR:		return "SCHED_RR";
+	case SCHED_OTHER:	return "SCHED_OTHER";
+	default:			return "unknown";
+	}
+}
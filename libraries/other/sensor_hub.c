@@ -0,0 +1,558 @@
+/*******************************************************************************
+* sensor_hub.c
+*
+* Lets one process own the IMU, DSM receiver and encoders while any number of
+* others consume the same samples. The owner publishes into rings in a POSIX
+* shared memory segment straight from the IMU and DSM publish paths, the same
+* places the logger hooks in. Each ring has a single writer and uses the same
+* per-slot sequence lock as the in-process IMU sample ring, so clients never
+* block the owner. A futex word per ring lets clients sleep until the next
+* sample, and the owner only makes the wake syscall when a client is waiting.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "../roboticscape-defs.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+
+#define HUB_SHM_NAME		"/roboticscape_hub"
+#define HUB_SHM_VERSION		1
+#define HUB_IMU_RING_LEN	256	// powers of two
+#define HUB_DSM_RING_LEN	16
+#define HUB_ENCODER_RING_LEN	64
+#define HUB_READ_TRIES		8
+
+/*******************************************************************************
+* shared memory layout
+*******************************************************************************/
+typedef struct hub_ring_t{
+	volatile uint64_t newest;	// seq of the newest complete slot
+	volatile uint32_t futex;	// bumped with every publish
+	volatile uint32_t waiters;	// clients sleeping on futex
+} hub_ring_t;
+
+typedef struct hub_slot_t{
+	volatile uint32_t lock;		// odd while the owner is writing
+	uint32_t reserved;
+	uint64_t seq;
+} hub_slot_t;
+
+typedef struct hub_imu_slot_t{
+	hub_slot_t h;
+	imu_sample_t sample;
+} hub_imu_slot_t;
+
+typedef struct hub_dsm_slot_t{
+	hub_slot_t h;
+	dsm_frame_t frame;
+} hub_dsm_slot_t;
+
+typedef struct hub_encoder_slot_t{
+	hub_slot_t h;
+	hub_encoder_sample_t sample;
+} hub_encoder_slot_t;
+
+typedef struct hub_shm_t{
+	uint32_t version;
+	volatile int32_t owner_pid;	// 0 when no owner is publishing
+	volatile int32_t sources;	// HUB_SOURCE_* the owner publishes
+	hub_ring_t imu, dsm, encoder;
+	hub_imu_slot_t imu_slots[HUB_IMU_RING_LEN];
+	hub_dsm_slot_t dsm_slots[HUB_DSM_RING_LEN];
+	hub_encoder_slot_t encoder_slots[HUB_ENCODER_RING_LEN];
+} hub_shm_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+hub_shm_t* hub_shm = NULL;
+int hub_shm_writer = 0;
+int hub_server_sources = 0;
+uint64_t hub_encoder_seq = 0;
+
+// client callback threads
+int (*hub_imu_func)(imu_sample_t* sample) = NULL;
+int (*hub_dsm_func)(dsm_frame_t* frame) = NULL;
+volatile int hub_threads_running = 0;
+pthread_t hub_imu_thread, hub_dsm_thread;
+int hub_imu_thread_started = 0;
+int hub_dsm_thread_started = 0;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+int map_hub_shm(int writer);
+void unmap_hub_shm();
+void hub_publish(hub_ring_t* r, void* slots, size_t slot_size, int len, \
+								const void* payload, size_t payload_size);
+int hub_read_slot(void* slots, size_t slot_size, int len, uint64_t seq, \
+									void* payload, size_t payload_size);
+int hub_read_latest(hub_ring_t* r, void* slots, size_t slot_size, int len, \
+									void* payload, size_t payload_size);
+int hub_wait(hub_ring_t* r, uint64_t seq, int timeout_ms);
+void* hub_imu_handler(void* ptr);
+void* hub_dsm_handler(void* ptr);
+
+/*******************************************************************************
+* int start_sensor_hub_server(int sources)
+*
+* Called by the process owning the hardware after initializing whichever of
+* the IMU (DMP or FIFO stream) and DSM it publishes. Encoders are sampled
+* together with each IMU sample and carry its timestamp, so HUB_SOURCE_ENCODERS
+* needs the IMU running too.
+*******************************************************************************/
+int start_sensor_hub_server(int sources){
+	if(sources & ~(HUB_SOURCE_IMU|HUB_SOURCE_DSM|HUB_SOURCE_ENCODERS)){
+		printf("ERROR: invalid sensor hub sources\n");
+		return -1;
+	}
+	if(hub_shm!=NULL && !hub_shm_writer) disconnect_sensor_hub();
+	if(hub_shm==NULL && map_hub_shm(1)<0) return -1;
+	if(hub_shm->owner_pid!=0 && hub_shm->owner_pid!=getpid() && \
+									kill(hub_shm->owner_pid, 0)==0){
+		printf("ERROR: sensor hub already owned by process %d\n", \
+												(int)hub_shm->owner_pid);
+		unmap_hub_shm();
+		return -1;
+	}
+	hub_shm->sources = sources;
+	hub_shm->owner_pid = getpid();
+	__sync_synchronize();
+	hub_server_sources = sources;
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_sensor_hub_server()
+*
+* Stops publishing. The segment stays so clients keep their mapping if the
+* owner restarts, and this process keeps its own mapping too in case the IMU
+* thread is still inside a publish.
+*******************************************************************************/
+int stop_sensor_hub_server(){
+	if(!hub_shm_writer) return 0;
+	hub_server_sources = 0;
+	__sync_synchronize();
+	hub_shm->sources = 0;
+	hub_shm->owner_pid = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int get_sensor_hub_sources()
+*
+* returns the sources this process publishes, checked by the publish paths
+*******************************************************************************/
+int get_sensor_hub_sources(){
+	return hub_server_sources;
+}
+
+/*******************************************************************************
+* void hub_publish_imu_sample(imu_sample_t* sample)
+*
+* Called from publish_imu_sample on the IMU thread.
+*******************************************************************************/
+void hub_publish_imu_sample(imu_sample_t* sample){
+	hub_encoder_sample_t enc;
+	imu_sample_t s;
+	if(hub_shm==NULL) return;
+	if(hub_server_sources & HUB_SOURCE_IMU){
+		// clients see the hub's sequence so it has no gaps across restarts
+		s = *sample;
+		s.seq = hub_shm->imu.newest + 1;
+		hub_publish(&hub_shm->imu, hub_shm->imu_slots, sizeof(hub_imu_slot_t),\
+			HUB_IMU_RING_LEN, &s, sizeof(imu_sample_t));
+	}
+	if(hub_server_sources & HUB_SOURCE_ENCODERS){
+		if(get_encoder_pos_all(enc.pos, NULL)<0) return;
+		enc.seq = ++hub_encoder_seq;
+		enc.timestamp_micros = sample->timestamp_micros;
+		hub_publish(&hub_shm->encoder, hub_shm->encoder_slots, \
+			sizeof(hub_encoder_slot_t), HUB_ENCODER_RING_LEN, &enc, \
+			sizeof(hub_encoder_sample_t));
+	}
+}
+
+/*******************************************************************************
+* void hub_publish_dsm_frame(dsm_frame_t* frame)
+*
+* Called from the dsm service when a frame completes.
+*******************************************************************************/
+void hub_publish_dsm_frame(dsm_frame_t* frame){
+	if(hub_shm==NULL || !(hub_server_sources & HUB_SOURCE_DSM)) return;
+	hub_publish(&hub_shm->dsm, hub_shm->dsm_slots, sizeof(hub_dsm_slot_t), \
+					HUB_DSM_RING_LEN, frame, sizeof(dsm_frame_t));
+}
+
+/*******************************************************************************
+* int connect_sensor_hub()
+*
+* Maps the owner's segment. Returns -1 if no owner has ever run.
+*******************************************************************************/
+int connect_sensor_hub(){
+	if(hub_shm!=NULL) return 0;
+	return map_hub_shm(0);
+}
+
+/*******************************************************************************
+* int disconnect_sensor_hub()
+*
+* Stops any client callback threads and unmaps the segment.
+*******************************************************************************/
+int disconnect_sensor_hub(){
+	if(hub_shm_writer) return stop_sensor_hub_server();
+	hub_threads_running = 0;
+	if(hub_imu_thread_started) pthread_join(hub_imu_thread, NULL);
+	if(hub_dsm_thread_started) pthread_join(hub_dsm_thread, NULL);
+	hub_imu_thread_started = 0;
+	hub_dsm_thread_started = 0;
+	unmap_hub_shm();
+	return 0;
+}
+
+/*******************************************************************************
+* int is_sensor_hub_running()
+*
+* returns 1 if an owner process is alive and publishing, otherwise 0
+*******************************************************************************/
+int is_sensor_hub_running(){
+	int32_t pid;
+	if(hub_shm==NULL && connect_sensor_hub()<0) return 0;
+	pid = hub_shm->owner_pid;
+	if(pid==0) return 0;
+	if(kill(pid, 0)<0 && errno==ESRCH) return 0;
+	return 1;
+}
+
+/*******************************************************************************
+* int hub_get_latest_imu_sample(imu_sample_t* sample)
+* int hub_get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max)
+*
+* Same semantics as get_latest_imu_sample and get_imu_samples_since but read
+* from the hub. seq is the hub's own sequence number, not the owner's.
+*******************************************************************************/
+int hub_get_latest_imu_sample(imu_sample_t* sample){
+	if(hub_shm==NULL && connect_sensor_hub()<0) return -1;
+	return hub_read_latest(&hub_shm->imu, hub_shm->imu_slots, \
+		sizeof(hub_imu_slot_t), HUB_IMU_RING_LEN, sample, sizeof(imu_sample_t));
+}
+
+int hub_get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max){
+	uint64_t newest, next;
+	int n = 0;
+
+	if(max<1){
+		printf("ERROR: in hub_get_imu_samples_since, max must be >=1\n");
+		return -1;
+	}
+	if(hub_shm==NULL && connect_sensor_hub()<0) return -1;
+	newest = hub_shm->imu.newest;
+	__sync_synchronize();
+	next = seq+1;
+	if(newest>=HUB_IMU_RING_LEN && next<=newest-HUB_IMU_RING_LEN){
+		next = newest-HUB_IMU_RING_LEN+1;
+	}
+	while(next<=newest && n<max){
+		if(hub_read_slot(hub_shm->imu_slots, sizeof(hub_imu_slot_t), \
+			HUB_IMU_RING_LEN, next, &buf[n], sizeof(imu_sample_t))==0) n++;
+		next++;
+	}
+	return n;
+}
+
+/*******************************************************************************
+* int hub_get_dsm_frame(dsm_frame_t* frame)
+* int hub_get_encoder_sample(hub_encoder_sample_t* sample)
+*
+* newest DSM frame or encoder sample, 0 on success or -1 if there is none yet
+*******************************************************************************/
+int hub_get_dsm_frame(dsm_frame_t* frame){
+	if(hub_shm==NULL && connect_sensor_hub()<0) return -1;
+	return hub_read_latest(&hub_shm->dsm, hub_shm->dsm_slots, \
+		sizeof(hub_dsm_slot_t), HUB_DSM_RING_LEN, frame, sizeof(dsm_frame_t));
+}
+
+int hub_get_encoder_sample(hub_encoder_sample_t* sample){
+	if(hub_shm==NULL && connect_sensor_hub()<0) return -1;
+	return hub_read_latest(&hub_shm->encoder, hub_shm->encoder_slots, \
+		sizeof(hub_encoder_slot_t), HUB_ENCODER_RING_LEN, sample, \
+		sizeof(hub_encoder_sample_t));
+}
+
+/*******************************************************************************
+* int64_t hub_wait_for_imu_sample(uint64_t seq, int timeout_ms)
+*
+* Sleeps until the hub holds an IMU sample newer than seq. Returns the newest
+* seq, or -1 on timeout. A timeout of 0 or less waits forever.
+*******************************************************************************/
+int64_t hub_wait_for_imu_sample(uint64_t seq, int timeout_ms){
+	if(hub_shm==NULL && connect_sensor_hub()<0) return -1;
+	if(hub_wait(&hub_shm->imu, seq, timeout_ms)<0) return -1;
+	return hub_shm->imu.newest;
+}
+
+/*******************************************************************************
+* int set_hub_imu_func(int (*func)(imu_sample_t* sample))
+* int set_hub_dsm_func(int (*func)(dsm_frame_t* frame))
+*
+* Client side equivalents of set_imu_interrupt_func and set_new_dsm_data_func.
+* A thread per source sleeps on the ring's futex and calls func for every new
+* sample, oldest first. Threads are stopped by disconnect_sensor_hub.
+*******************************************************************************/
+int set_hub_imu_func(int (*func)(imu_sample_t* sample)){
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to hub_imu_func\n");
+		return -1;
+	}
+	if(hub_shm==NULL && connect_sensor_hub()<0){
+		printf("ERROR: sensor hub not running\n");
+		return -1;
+	}
+	hub_imu_func = func;
+	if(hub_imu_thread_started) return 0;
+	hub_threads_running = 1;
+	if(create_rt_thread(&hub_imu_thread, RT_SERVICE_APP, hub_imu_handler, \
+																	NULL)){
+		printf("ERROR: failed to start sensor hub imu thread\n");
+		return -1;
+	}
+	hub_imu_thread_started = 1;
+	return 0;
+}
+
+int set_hub_dsm_func(int (*func)(dsm_frame_t* frame)){
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to hub_dsm_func\n");
+		return -1;
+	}
+	if(hub_shm==NULL && connect_sensor_hub()<0){
+		printf("ERROR: sensor hub not running\n");
+		return -1;
+	}
+	hub_dsm_func = func;
+	if(hub_dsm_thread_started) return 0;
+	hub_threads_running = 1;
+	if(create_rt_thread(&hub_dsm_thread, RT_SERVICE_APP, hub_dsm_handler, \
+																	NULL)){
+		printf("ERROR: failed to start sensor hub dsm thread\n");
+		return -1;
+	}
+	hub_dsm_thread_started = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* void* hub_imu_handler(void* ptr)
+* void* hub_dsm_handler(void* ptr)
+*
+* Client callback threads. They start from the newest sample and wake at
+* least every POLL_TIMEOUT to notice being stopped.
+*******************************************************************************/
+void* hub_imu_handler(void* ptr){
+	imu_sample_t buf[8];
+	uint64_t last = hub_shm->imu.newest;
+	int i, n;
+
+	while(hub_threads_running && get_state()!=EXITING){
+		if(hub_wait(&hub_shm->imu, last, POLL_TIMEOUT)<0) continue;
+		while((n = hub_get_imu_samples_since(last, buf, 8))>0){
+			for(i=0;i<n;i++) hub_imu_func(&buf[i]);
+			last = buf[n-1].seq;
+		}
+		// everything left was overwritten while we were busy
+		if(hub_shm->imu.newest>last+HUB_IMU_RING_LEN){
+			last = hub_shm->imu.newest;
+		}
+	}
+	return NULL;
+}
+
+void* hub_dsm_handler(void* ptr){
+	dsm_frame_t frame;
+	uint64_t last = hub_shm->dsm.newest;
+
+	while(hub_threads_running && get_state()!=EXITING){
+		if(hub_wait(&hub_shm->dsm, last, POLL_TIMEOUT)<0) continue;
+		last = hub_shm->dsm.newest;
+		if(hub_read_slot(hub_shm->dsm_slots, sizeof(hub_dsm_slot_t), \
+			HUB_DSM_RING_LEN, last, &frame, sizeof(dsm_frame_t))==0){
+			hub_dsm_func(&frame);
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* void hub_publish(hub_ring_t* r, void* slots, size_t slot_size, int len,
+*								const void* payload, size_t payload_size)
+*
+* Single writer ring publish, then wakes sleeping clients if there are any.
+*******************************************************************************/
+void hub_publish(hub_ring_t* r, void* slots, size_t slot_size, int len, \
+								const void* payload, size_t payload_size){
+	uint64_t seq = r->newest + 1;
+	hub_slot_t* slot = (hub_slot_t*)((char*)slots + (seq&(len-1))*slot_size);
+
+	slot->lock++;
+	__sync_synchronize();
+	slot->seq = seq;
+	memcpy((char*)slot + sizeof(hub_slot_t), payload, payload_size);
+	__sync_synchronize();
+	slot->lock++;
+
+	__sync_synchronize();
+	r->newest = seq;
+	__sync_fetch_and_add(&r->futex, 1);
+	if(r->waiters){
+		syscall(SYS_futex, &r->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/*******************************************************************************
+* int hub_read_slot(void* slots, size_t slot_size, int len, uint64_t seq,
+*									void* payload, size_t payload_size)
+*
+* Same contract as read_imu_sample_slot: 0 on success, 1 if overwritten, -1
+* if a consistent copy could not be made.
+*******************************************************************************/
+int hub_read_slot(void* slots, size_t slot_size, int len, uint64_t seq, \
+									void* payload, size_t payload_size){
+	hub_slot_t* slot = (hub_slot_t*)((char*)slots + (seq&(len-1))*slot_size);
+	uint32_t before, after;
+	uint64_t got;
+	int i;
+
+	for(i=0;i<HUB_READ_TRIES;i++){
+		before = slot->lock;
+		if(before&1) continue;
+		__sync_synchronize();
+		got = slot->seq;
+		memcpy(payload, (char*)slot + sizeof(hub_slot_t), payload_size);
+		__sync_synchronize();
+		after = slot->lock;
+		if(before!=after) continue;
+		if(got!=seq) return 1;
+		return 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int hub_read_latest(hub_ring_t* r, void* slots, size_t slot_size, int len,
+*									void* payload, size_t payload_size)
+*******************************************************************************/
+int hub_read_latest(hub_ring_t* r, void* slots, size_t slot_size, int len, \
+									void* payload, size_t payload_size){
+	uint64_t seq;
+	int i;
+	for(i=0;i<HUB_READ_TRIES;i++){
+		seq = r->newest;
+		if(seq==0) return -1;
+		__sync_synchronize();
+		if(hub_read_slot(slots, slot_size, len, seq, payload, payload_size)==0){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int hub_wait(hub_ring_t* r, uint64_t seq, int timeout_ms)
+*
+* Futex sleep until r holds something newer than seq. The futex value is read
+* before checking newest so a publish in between makes FUTEX_WAIT return
+* immediately instead of being missed.
+*******************************************************************************/
+int hub_wait(hub_ring_t* r, uint64_t seq, int timeout_ms){
+	struct timespec ts, *tsp = NULL;
+	uint32_t f;
+	uint64_t start = micros_since_boot();
+	uint64_t left_us;
+
+	while(1){
+		f = r->futex;
+		__sync_synchronize();
+		if(r->newest>seq) return 0;
+		if(timeout_ms>0){
+			left_us = (uint64_t)timeout_ms*1000;
+			if(micros_since_boot()-start >= left_us) return -1;
+			left_us -= micros_since_boot()-start;
+			ts.tv_sec = left_us/1000000;
+			ts.tv_nsec = (left_us%1000000)*1000;
+			tsp = &ts;
+		}
+		__sync_fetch_and_add(&r->waiters, 1);
+		syscall(SYS_futex, &r->futex, FUTEX_WAIT, f, tsp, NULL, 0);
+		__sync_fetch_and_sub(&r->waiters, 1);
+	}
+}
+
+/*******************************************************************************
+* int map_hub_shm(int writer)
+*
+* The owner creates and sizes the segment, clients map it read-write only so
+* they can count themselves as futex waiters, they never touch the rings.
+*******************************************************************************/
+int map_hub_shm(int writer){
+	struct stat st;
+	int fd, i;
+	void* ptr;
+
+	if(writer) fd = shm_open(HUB_SHM_NAME, O_RDWR|O_CREAT, 0666);
+	else fd = shm_open(HUB_SHM_NAME, O_RDWR, 0);
+	if(fd<0){
+		if(writer) printf("ERROR: can't create sensor hub shared memory\n");
+		return -1;
+	}
+	if(writer && ftruncate(fd, sizeof(hub_shm_t))<0){
+		printf("ERROR: can't size sensor hub shared memory\n");
+		close(fd);
+		return -1;
+	}
+	// the owner may have created it but not sized it yet, reading past the
+	// end of the segment would fault
+	if(!writer && (fstat(fd, &st)<0 || st.st_size<(off_t)sizeof(hub_shm_t))){
+		close(fd);
+		return -1;
+	}
+	ptr = mmap(NULL, sizeof(hub_shm_t), PROT_READ|PROT_WRITE, MAP_SHARED,fd,0);
+	close(fd);
+	if(ptr==MAP_FAILED){
+		printf("ERROR: can't map sensor hub shared memory\n");
+		return -1;
+	}
+	hub_shm = (hub_shm_t*)ptr;
+	if(writer){
+		// a previous owner may have died in the middle of a write
+		for(i=0;i<HUB_IMU_RING_LEN;i++) hub_shm->imu_slots[i].h.lock &= ~1u;
+		for(i=0;i<HUB_DSM_RING_LEN;i++) hub_shm->dsm_slots[i].h.lock &= ~1u;
+		for(i=0;i<HUB_ENCODER_RING_LEN;i++){
+			hub_shm->encoder_slots[i].h.lock &= ~1u;
+		}
+		hub_shm->version = HUB_SHM_VERSION;
+		hub_shm_writer = 1;
+		hub_encoder_seq = hub_shm->encoder.newest;
+		return 0;
+	}
+	if(hub_shm->version!=HUB_SHM_VERSION){
+		if(hub_shm->version!=0){
+			printf("ERROR: sensor hub shared memory version mismatch\n");
+		}
+		unmap_hub_shm();
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* void unmap_hub_shm()
+*******************************************************************************/
+void unmap_hub_shm(){
+	if(hub_shm==NULL) return;
+	munmap(hub_shm, sizeof(hub_shm_t));
+	hub_shm = NULL;
+	hub_shm_writer = 0;
+}
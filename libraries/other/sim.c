@@ -0,0 +1,417 @@
+/*******************************************************************************
+* sim.c
+*
+* Runs programs against a model of the robot instead of the cape. The user
+* supplies a plant step function which is handed the motor outputs and fills
+* in what the sensors would read. One thread steps it at the IMU's DMP sample
+* rate and delivers each step through the same paths replay.c uses, so the
+* IMU interrupt function, DSM callback, encoder and ADC reads behave as they
+* would on the robot.
+*
+* Time is simulated too. From start_sim until close_sim micros_since_boot
+* returns the simulated clock, which advances by exactly one sample period
+* per step, so a run is deterministic and can go as far ahead of real time as
+* the callbacks allow. Building the library with SIM=1 turns simulation mode
+* on permanently so a program linked against it never touches the hardware.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "../roboticscape-defs.h"
+#include "replay.h"
+#include "sim.h"
+
+#define SIM_DSM_PERIOD_NS	11000000	// DSMX frame spacing
+#define SIM_BATTERY_V		8.0			// 2S pack until the plant says so
+#define SIM_DC_JACK_V		0.0
+#define SIM_GRAVITY			9.807		// accel reading at rest, m/s^2
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+#ifdef RC_SIM
+int sim_mode = 1;			// this build only has the simulation backend
+#else
+int sim_mode = 0;
+#endif
+int sim_open = 0;
+volatile int sim_running = 0;
+volatile int sim_done = 0;
+sim_plant_t sim_plant;
+float sim_speed;
+uint64_t sim_max_steps;		// 0 to run until stopped
+uint64_t sim_steps;
+pthread_t sim_thread;
+
+// read by nanos_since_boot
+volatile int sim_clock_en = 0;
+volatile uint64_t sim_clock_ns = 0;
+int64_t sim_clock_offset_ns = 0;
+
+// outputs written by the motor functions from any thread. Each value is an
+// aligned int or float so it can't tear, the plant sees whichever is newest.
+float sim_duty[MOTOR_CHANNELS];
+int sim_brake[MOTOR_CHANNELS];
+int sim_motors_enabled;
+
+// sensor values the plant keeps up to date, the seq counter is odd while
+// they are copied out for readers. The mutex only orders the sim thread
+// against set_encoder_pos, readers never take it.
+sim_sensors_t sim_sensors;
+volatile uint32_t sim_io_lock;
+pthread_mutex_t sim_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+int sim_encoder[4];
+int sim_encoder_offset[4];
+float sim_encoder_vel[4];
+int sim_adc[8];
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* sim_handler(void* ptr);
+uint64_t sim_real_nanos();
+int sim_volt_to_raw(float v, float offset);
+void sim_publish_io(const int prev_encoder[4], float dt);
+void sim_deliver_imu(uint64_t timestamp_micros);
+void sim_deliver_dsm(uint32_t frame_count, uint64_t timestamp_micros);
+
+/*******************************************************************************
+* int open_sim(sim_plant_t plant)
+*
+* Puts the library in simulation mode with the given plant. Must be called
+* before initialize_cape, initialize_imu_dmp and initialize_dsm so those skip
+* the hardware.
+*******************************************************************************/
+int open_sim(sim_plant_t plant){
+	int i;
+	if(sim_open){
+		printf("ERROR: simulation already open\n");
+		return -1;
+	}
+	if(is_replay_mode()){
+		printf("ERROR: can't simulate while a replay is open\n");
+		return -1;
+	}
+	if(plant.step==NULL){
+		printf("ERROR: sim plant needs a step function\n");
+		return -1;
+	}
+	sim_plant = plant;
+	memset(&sim_sensors, 0, sizeof(sim_sensors));
+	sim_sensors.quat[QUAT_W] = 1.0;
+	sim_sensors.accel[2] = SIM_GRAVITY;
+	sim_sensors.temp = 25.0;
+	sim_sensors.adc_raw[LIPO_ADC_CH] = sim_volt_to_raw(SIM_BATTERY_V, \
+																LIPO_OFFSET);
+	sim_sensors.adc_raw[DC_JACK_ADC_CH] = sim_volt_to_raw(SIM_DC_JACK_V, \
+															DC_JACK_OFFSET);
+	for(i=0;i<MOTOR_CHANNELS;i++){
+		sim_duty[i] = 0.0;
+		sim_brake[i] = 0;
+	}
+	sim_motors_enabled = 0;
+	memset(sim_encoder_offset, 0, sizeof(sim_encoder_offset));
+	sim_publish_io(sim_sensors.encoder, 1.0);
+	sim_steps = 0;
+	sim_done = 0;
+	sim_open = 1;
+	sim_mode = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int start_sim(float speed, float duration_s)
+*
+* Starts stepping the plant at the sample rate initialize_imu_dmp was given.
+* speed 1 runs in real time, 10 ten times faster and 0 as fast as possible.
+* duration_s 0 runs until close_sim, the plant ending the run or EXITING.
+*******************************************************************************/
+int start_sim(float speed, float duration_s){
+	int rate;
+	if(!sim_open){
+		printf("ERROR: call open_sim first\n");
+		return -1;
+	}
+	if(sim_running){
+		printf("ERROR: simulation already started\n");
+		return -1;
+	}
+	if(speed<0 || duration_s<0){
+		printf("ERROR: sim speed and duration can't be negative\n");
+		return -1;
+	}
+	rate = get_replayed_imu_rate();
+	if(rate<=0){
+		printf("ERROR: initialize_imu_dmp first, the sim steps at its rate\n");
+		return -1;
+	}
+	sim_speed = speed;
+	sim_max_steps = (uint64_t)llroundf(duration_s*rate);
+	sim_clock_ns = sim_real_nanos() + sim_clock_offset_ns;
+	sim_clock_en = 1;
+	sim_running = 1;
+	// not the IMU's SCHED_FIFO, at speed 0 this never sleeps
+	if(create_rt_thread(&sim_thread, RT_SERVICE_APP, sim_handler, NULL)){
+		sim_running = 0;
+		sim_clock_en = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int wait_for_sim()
+*
+* Blocks until the run ends and returns the number of steps taken.
+*******************************************************************************/
+int wait_for_sim(){
+	if(!sim_running) return (int)sim_steps;
+	pthread_join(sim_thread, NULL);
+	sim_running = 0;
+	return (int)sim_steps;
+}
+
+/*******************************************************************************
+* int close_sim()
+*
+* Stops stepping and releases the clock, which carries on from the simulated
+* time. Outside a SIM=1 build this also leaves simulation mode.
+*******************************************************************************/
+int close_sim(){
+	if(!sim_open) return 0;
+	if(sim_running){
+		sim_done = 1;
+		pthread_join(sim_thread, NULL);
+		sim_running = 0;
+	}
+	if(sim_clock_en){
+		sim_clock_offset_ns = (int64_t)(sim_clock_ns - sim_real_nanos());
+		sim_clock_en = 0;
+	}
+	sim_open = 0;
+	#ifndef RC_SIM
+	sim_mode = 0;
+	#endif
+	return 0;
+}
+
+/*******************************************************************************
+* int is_sim_mode() / int is_sim_finished()
+*******************************************************************************/
+int is_sim_mode(){
+	return sim_mode;
+}
+
+int is_sim_finished(){
+	return sim_open && sim_done;
+}
+
+/*******************************************************************************
+* uint64_t get_sim_steps()
+*******************************************************************************/
+uint64_t get_sim_steps(){
+	return sim_steps;
+}
+
+/*******************************************************************************
+* void set_sim_motor(int motor, float duty, int brake)
+* void set_sim_motors_enabled(int enabled)
+*
+* Called by the motor functions in place of the gpio and pwm writes.
+*******************************************************************************/
+void set_sim_motor(int motor, float duty, int brake){
+	sim_duty[motor-1] = duty;
+	sim_brake[motor-1] = brake;
+}
+
+void set_sim_motors_enabled(int enabled){
+	sim_motors_enabled = enabled;
+}
+
+/*******************************************************************************
+* int get_sim_encoder_pos(int pos[4])
+* int get_sim_encoder_velocity(float vel[4])
+*******************************************************************************/
+int get_sim_encoder_pos(int pos[4]){
+	uint32_t lock;
+	if(!sim_mode) return -1;
+	do{
+		while((lock=sim_io_lock)&1);
+		__sync_synchronize();
+		memcpy(pos, sim_encoder, sizeof(sim_encoder));
+		__sync_synchronize();
+	}while(sim_io_lock!=lock);
+	return 0;
+}
+
+int get_sim_encoder_velocity(float vel[4]){
+	uint32_t lock;
+	if(!sim_mode) return -1;
+	do{
+		while((lock=sim_io_lock)&1);
+		__sync_synchronize();
+		memcpy(vel, sim_encoder_vel, sizeof(sim_encoder_vel));
+		__sync_synchronize();
+	}while(sim_io_lock!=lock);
+	return 0;
+}
+
+/*******************************************************************************
+* int set_sim_encoder_pos(int ch, int val)
+*
+* The plant's own count is left alone, reads are offset from it instead.
+*******************************************************************************/
+int set_sim_encoder_pos(int ch, int val){
+	if(!sim_mode) return -1;
+	pthread_mutex_lock(&sim_io_mutex);
+	sim_encoder_offset[ch-1] += val - sim_encoder[ch-1];
+	sim_io_lock++;
+	__sync_synchronize();
+	sim_encoder[ch-1] = val;
+	__sync_synchronize();
+	sim_io_lock++;
+	pthread_mutex_unlock(&sim_io_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int get_sim_adc_raw(int ch)
+*******************************************************************************/
+int get_sim_adc_raw(int ch){
+	if(!sim_mode) return -1;
+	// a single aligned int can't tear
+	return sim_adc[ch];
+}
+
+/*******************************************************************************
+* void* sim_handler(void* ptr)
+*
+* One step per IMU sample: the plant advances by a sample period with the
+* current outputs, then the clock does and the new sensor values go out.
+*******************************************************************************/
+void* sim_handler(void* ptr){
+	sim_outputs_t out;
+	uint64_t period_ns, start_ns, start_real, due, now, dsm_due;
+	uint32_t dsm_frames = 0;
+	int prev_encoder[4];
+	float dt;
+	int i, ret;
+
+	period_ns = 1000000000/get_replayed_imu_rate();
+	dt = period_ns/1000000000.0;
+	start_ns = sim_clock_ns;
+	start_real = sim_real_nanos();
+	dsm_due = start_ns + SIM_DSM_PERIOD_NS;
+
+	while(!sim_done && get_state()!=EXITING){
+		if(sim_max_steps && sim_steps>=sim_max_steps) break;
+		for(i=0;i<MOTOR_CHANNELS;i++){
+			out.duty[i] = sim_motors_enabled ? sim_duty[i] : 0.0;
+		}
+		out.brake = 0;
+		for(i=0;i<MOTOR_CHANNELS;i++) if(sim_brake[i]) out.brake |= 1<<i;
+		out.enabled = sim_motors_enabled;
+		memcpy(prev_encoder, sim_sensors.encoder, sizeof(prev_encoder));
+
+		ret = sim_plant.step(sim_plant.ctx, dt, &out, &sim_sensors);
+		if(ret<0) printf("ERROR: sim plant step failed\n");
+		if(ret!=0) break;
+
+		__sync_fetch_and_add(&sim_clock_ns, period_ns);
+		sim_publish_io(prev_encoder, dt);
+		sim_deliver_imu(sim_clock_ns/1000);
+		if(sim_sensors.dsm_channels>0 && sim_clock_ns>=dsm_due){
+			sim_deliver_dsm(++dsm_frames, sim_clock_ns/1000);
+			dsm_due += SIM_DSM_PERIOD_NS;
+		}
+		sim_steps++;
+
+		if(sim_speed>0){
+			due = start_real + \
+					(uint64_t)((double)(sim_clock_ns-start_ns)/sim_speed);
+			now = sim_real_nanos();
+			if(due>now) usleep((due-now)/1000);
+		}
+	}
+	sim_done = 1;
+	return NULL;
+}
+
+/*******************************************************************************
+* uint64_t sim_real_nanos()
+*
+* The real monotonic clock, nanos_since_boot is the simulated one while
+* the sim runs.
+*******************************************************************************/
+uint64_t sim_real_nanos(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000)+ts.tv_nsec;
+}
+
+/*******************************************************************************
+* int sim_volt_to_raw(float v, float offset)
+*
+* adc reading for a voltage seen through the cape's divider
+*******************************************************************************/
+int sim_volt_to_raw(float v, float offset){
+	int raw = lrintf((v-offset)/V_DIV_RATIO/1.8*4095.0);
+	if(raw<0) raw = 0;
+	if(raw>4095) raw = 4095;
+	return raw;
+}
+
+/*******************************************************************************
+* void sim_publish_io(const int prev_encoder[4], float dt)
+*
+* Copies the plant's encoder and adc values out for readers.
+*******************************************************************************/
+void sim_publish_io(const int prev_encoder[4], float dt){
+	int i;
+	pthread_mutex_lock(&sim_io_mutex);
+	sim_io_lock++;
+	__sync_synchronize();
+	for(i=0;i<4;i++){
+		sim_encoder[i] = sim_sensors.encoder[i] + sim_encoder_offset[i];
+		sim_encoder_vel[i] = (sim_sensors.encoder[i]-prev_encoder[i])/dt;
+	}
+	__sync_synchronize();
+	sim_io_lock++;
+	pthread_mutex_unlock(&sim_io_mutex);
+	for(i=0;i<8;i++) sim_adc[i] = sim_sensors.adc_raw[i];
+}
+
+/*******************************************************************************
+* void sim_deliver_imu(uint64_t timestamp_micros)
+*
+* The plant's attitude stands in for both the DMP and fused outputs.
+*******************************************************************************/
+void sim_deliver_imu(uint64_t timestamp_micros){
+	log_imu_record_t r;
+	memcpy(r.accel, sim_sensors.accel, sizeof(r.accel));
+	memcpy(r.gyro, sim_sensors.gyro, sizeof(r.gyro));
+	memcpy(r.mag, sim_sensors.mag, sizeof(r.mag));
+	r.temp = sim_sensors.temp;
+	memcpy(r.dmp_quat, sim_sensors.quat, sizeof(r.dmp_quat));
+	quaternionToTaitBryan(r.dmp_quat, r.dmp_TaitBryan);
+	memcpy(r.fused_quat, r.dmp_quat, sizeof(r.fused_quat));
+	memcpy(r.fused_TaitBryan, r.dmp_TaitBryan, sizeof(r.fused_TaitBryan));
+	r.compass_heading = r.dmp_TaitBryan[TB_YAW_Z];
+	r.compass_heading_raw = r.dmp_TaitBryan[TB_YAW_Z];
+	replay_imu_record(&r, timestamp_micros);
+}
+
+/*******************************************************************************
+* void sim_deliver_dsm(uint32_t frame_count, uint64_t timestamp_micros)
+*******************************************************************************/
+void sim_deliver_dsm(uint32_t frame_count, uint64_t timestamp_micros){
+	log_dsm_record_t r;
+	int i;
+	memset(&r, 0, sizeof(r));
+	r.frame_count = frame_count;
+	r.num_channels = sim_sensors.dsm_channels;
+	if(r.num_channels>DSM_MAX_CHANNELS) r.num_channels = DSM_MAX_CHANNELS;
+	r.resolution = 2048;
+	for(i=0;i<r.num_channels;i++) r.raw[i] = sim_sensors.dsm_us[i];
+	replay_dsm_record(&r, timestamp_micros);
+}
@@ -0,0 +1,26 @@
+/*******************************************************************************
+* sim.h
+*
+* Hooks between sim.c and the drivers it stands in for. Not part of the
+* public API, see the SIMULATION section of roboticscape.h instead.
+*******************************************************************************/
+
+// simulated clock read by nanos_since_boot, live between start_sim and
+// close_sim. The offset keeps the clock from going back once it's released.
+extern volatile int sim_clock_en;
+extern volatile uint64_t sim_clock_ns;
+extern int64_t sim_clock_offset_ns;
+
+// motor outputs, brake is 1 while the motor terminals are shorted
+void set_sim_motor(int motor, float duty, int brake);
+void set_sim_motors_enabled(int enabled);
+
+// latest simulated encoder and adc values
+int get_sim_encoder_pos(int pos[4]);
+int get_sim_encoder_velocity(float vel[4]);
+int set_sim_encoder_pos(int ch, int val);
+int get_sim_adc_raw(int ch);
+
+// implemented by the IMU driver, the DMP sample rate it was initialized
+// with in replay or simulation mode or -1
+int get_replayed_imu_rate();
@@ -0,0 +1,373 @@
+/*******************************************************************************
+* telemetry.c
+*
+* UDP telemetry publisher. Producers claim 128 byte slots in a preallocated
+* ring exactly like the logger, so a control thread only ever fills a record
+* in place and sets a flag. The sender thread wakes every TELEM_FLUSH_US and
+* turns everything committed into datagrams. A slot's header and payload are
+* contiguous, so a datagram is built as an iovec list of one datagram header
+* and pointers into the ring, and the kernel copies each record once, while
+* sendmmsg hands over a whole batch of datagrams in one system call. Slots go
+* back to producers only after sendmmsg returns.
+*
+* The socket is non-blocking: over a congested WiFi link telemetry is shed at
+* the socket rather than backing up into the ring and the control loop.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include <stddef.h>
+
+#ifdef RC_SMALL_MEMORY
+#define TELEM_DEFAULT_RING_KB	32
+#define TELEM_BATCH				8		// datagrams per sendmmsg
+#else
+#define TELEM_DEFAULT_RING_KB	128
+#define TELEM_BATCH				32
+#endif
+#define TELEM_FLUSH_US			10000	// sender wakes this often
+#define TELEM_MAX_IOV			(1 + (TELEMETRY_MAX_DATAGRAM - \
+			sizeof(telemetry_datagram_header_t))/sizeof(log_record_header_t))
+
+// same layout as a logger slot, hdr is directly followed by payload
+typedef struct telem_slot_t{
+	volatile uint64_t committed;	// claim index+1 once the record is whole
+	log_record_header_t hdr;
+	uint8_t payload[LOG_MAX_PAYLOAD];
+} telem_slot_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+telem_slot_t* telem_ring = NULL;
+uint64_t telem_ring_mask;
+volatile uint64_t telem_head;	// next slot a producer will claim
+volatile uint64_t telem_tail;	// next slot the sender will read
+volatile int telem_sources;
+volatile int telemetry_running = 0;
+volatile int telem_producers;	// threads between reserve and commit
+int telem_sock = -1;
+uint32_t telem_seq;
+telemetry_stats_t telem_stats;
+pthread_t telem_thread;
+pthread_mutex_t telem_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the datagram pool, filled in again for every batch
+struct mmsghdr telem_msgs[TELEM_BATCH];
+struct iovec telem_iov[TELEM_BATCH][TELEM_MAX_IOV];
+telemetry_datagram_header_t telem_headers[TELEM_BATCH];
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* telemetry_sender(void* ptr);
+int send_telemetry_batch();
+void wait_for_telem_producers();
+
+/*******************************************************************************
+* int start_telemetry(const char* address, int port, int ring_kb)
+*
+* Opens a UDP socket aimed at address:port, allocates the ring and starts
+* the sender thread. ring_kb of 0 uses the default.
+*******************************************************************************/
+int start_telemetry(const char* address, int port, int ring_kb){
+	struct sockaddr_in dest;
+	uint64_t slots;
+	int one = 1;
+
+	pthread_mutex_lock(&telem_mutex);
+	if(telemetry_running){
+		pthread_mutex_unlock(&telem_mutex);
+		printf("ERROR: telemetry already running\n");
+		return -1;
+	}
+	if(port<1 || port>65535){
+		pthread_mutex_unlock(&telem_mutex);
+		printf("ERROR: telemetry port must be between 1 & 65535\n");
+		return -1;
+	}
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(port);
+	if(inet_pton(AF_INET, address, &dest.sin_addr)!=1){
+		pthread_mutex_unlock(&telem_mutex);
+		printf("ERROR: invalid telemetry address %s\n", address);
+		return -1;
+	}
+	if(ring_kb<=0) ring_kb = TELEM_DEFAULT_RING_KB;
+	// round down to a power of 2 number of slots
+	slots = 1;
+	while(slots*2*sizeof(telem_slot_t) <= (uint64_t)ring_kb*1024) slots *= 2;
+
+	telem_sock = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if(telem_sock<0){
+		pthread_mutex_unlock(&telem_mutex);
+		printf("ERROR: can't open telemetry socket\n");
+		return -1;
+	}
+	setsockopt(telem_sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+	if(connect(telem_sock, (struct sockaddr*)&dest, sizeof(dest))<0){
+		printf("ERROR: can't reach telemetry address %s\n", address);
+		goto fail;
+	}
+	// stop_telemetry waited for producers to leave the old ring
+	free(telem_ring);
+	telem_ring = calloc(slots, sizeof(telem_slot_t));
+	if(telem_ring==NULL){
+		printf("ERROR: failed to allocate telemetry ring\n");
+		goto fail;
+	}
+	telem_ring_mask = slots-1;
+	telem_head = 0;
+	telem_tail = 0;
+	telem_seq = 0;
+	memset(&telem_stats, 0, sizeof(telem_stats));
+
+	telemetry_running = 1;
+	if(create_rt_thread(&telem_thread, RT_SERVICE_TELEMETRY, \
+										telemetry_sender, NULL)){
+		telemetry_running = 0;
+		wait_for_telem_producers();
+		goto fail;
+	}
+	pthread_mutex_unlock(&telem_mutex);
+	return 0;
+
+fail:
+	close(telem_sock);
+	telem_sock = -1;
+	free(telem_ring);
+	telem_ring = NULL;
+	pthread_mutex_unlock(&telem_mutex);
+	return -1;
+}
+
+/*******************************************************************************
+* int stop_telemetry()
+*
+* Stops new records, sends what is already committed and closes the socket.
+*******************************************************************************/
+int stop_telemetry(){
+	pthread_mutex_lock(&telem_mutex);
+	if(!telemetry_running){
+		pthread_mutex_unlock(&telem_mutex);
+		return 0;
+	}
+	telem_sources = 0;
+	telemetry_running = 0;
+	wait_for_telem_producers();
+	pthread_join(telem_thread, NULL);
+	close(telem_sock);
+	telem_sock = -1;
+	pthread_mutex_unlock(&telem_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* void wait_for_telem_producers()
+*
+* Once telemetry_running is clear no new producer gets in, this waits for
+* those already holding a slot to commit it so the ring can be freed.
+*******************************************************************************/
+void wait_for_telem_producers(){
+	__sync_synchronize();
+	while(telem_producers>0) usleep(100);
+	return;
+}
+
+/*******************************************************************************
+* int set_telemetry_sources(int sources) / int get_telemetry_sources()
+*******************************************************************************/
+int set_telemetry_sources(int sources){
+	telem_sources = sources;
+	return 0;
+}
+
+int get_telemetry_sources(){
+	if(!telemetry_running) return 0;
+	return telem_sources;
+}
+
+/*******************************************************************************
+* int get_telemetry_stats(telemetry_stats_t* stats)
+*******************************************************************************/
+int get_telemetry_stats(telemetry_stats_t* stats){
+	*stats = telem_stats;
+	return 0;
+}
+
+/*******************************************************************************
+* void* telemetry_reserve(uint16_t type, uint16_t length,
+*												uint64_t timestamp_micros)
+*
+* Claims the next slot without locking, see log_reserve. The caller counts
+* as a producer until telemetry_commit so stop_telemetry can wait for it.
+*******************************************************************************/
+void* telemetry_reserve(uint16_t type, uint16_t length, \
+												uint64_t timestamp_micros){
+	telem_slot_t* slot;
+	uint64_t h;
+
+	if(length>LOG_MAX_PAYLOAD) return NULL;
+	__sync_fetch_and_add(&telem_producers, 1);
+	if(!telemetry_running){
+		__sync_fetch_and_sub(&telem_producers, 1);
+		return NULL;
+	}
+	do{
+		h = telem_head;
+		if(h-telem_tail > telem_ring_mask){
+			__sync_fetch_and_add(&telem_stats.drops, 1);
+			__sync_fetch_and_sub(&telem_producers, 1);
+			return NULL;
+		}
+	}while(!__sync_bool_compare_and_swap(&telem_head, h, h+1));
+
+	slot = &telem_ring[h&telem_ring_mask];
+	slot->hdr.type = type;
+	slot->hdr.length = length;
+	slot->hdr.seq = (uint32_t)h;
+	if(timestamp_micros==0) timestamp_micros = micros_since_boot();
+	slot->hdr.timestamp_micros = timestamp_micros;
+	return slot->payload;
+}
+
+/*******************************************************************************
+* int telemetry_commit(void* payload)
+*******************************************************************************/
+int telemetry_commit(void* payload){
+	telem_slot_t* slot;
+	if(payload==NULL) return -1;
+	slot = (telem_slot_t*)((uint8_t*)payload - offsetof(telem_slot_t,payload));
+	__sync_synchronize();
+	slot->committed = (uint64_t)slot->hdr.seq + 1;
+	__sync_fetch_and_sub(&telem_producers, 1);
+	return 0;
+}
+
+/*******************************************************************************
+* int telemetry_write(uint16_t type, const void* data, uint16_t length,
+*												uint64_t timestamp_micros)
+*******************************************************************************/
+int telemetry_write(uint16_t type, const void* data, uint16_t length, \
+												uint64_t timestamp_micros){
+	void* p = telemetry_reserve(type, length, timestamp_micros);
+	if(p==NULL) return -1;
+	memcpy(p, data, length);
+	return telemetry_commit(p);
+}
+
+/*******************************************************************************
+* typed records for the library's own data
+*******************************************************************************/
+int telemetry_imu_data(const imu_data_t* data, uint64_t timestamp_micros){
+	log_imu_record_t* r;
+	r = telemetry_reserve(LOG_RECORD_IMU, sizeof(log_imu_record_t), \
+														timestamp_micros);
+	if(r==NULL) return -1;
+	pack_log_imu_record(r, data);
+	return telemetry_commit(r);
+}
+
+int telemetry_motor_duties(const float duty[4], int mask){
+	log_motor_record_t* r;
+	r = telemetry_reserve(LOG_RECORD_MOTOR, sizeof(log_motor_record_t), 0);
+	if(r==NULL) return -1;
+	pack_log_motor_record(r, duty, mask);
+	return telemetry_commit(r);
+}
+
+int telemetry_dsm_frame(const dsm_frame_t* frame){
+	log_dsm_record_t* r;
+	r = telemetry_reserve(LOG_RECORD_DSM, sizeof(log_dsm_record_t), \
+												frame->timestamp_micros);
+	if(r==NULL) return -1;
+	pack_log_dsm_record(r, frame);
+	return telemetry_commit(r);
+}
+
+int telemetry_battery_status(const battery_status_t* status){
+	log_battery_record_t* r;
+	r = telemetry_reserve(LOG_RECORD_BATTERY, sizeof(log_battery_record_t), \
+												status->timestamp_micros);
+	if(r==NULL) return -1;
+	pack_log_battery_record(r, status);
+	return telemetry_commit(r);
+}
+
+/*******************************************************************************
+* void* telemetry_sender(void* ptr)
+*
+* Sends a batch every TELEM_FLUSH_US, straight away again while batches come
+* out full. Also publishes each new battery status for LOG_SOURCE_BATTERY.
+*******************************************************************************/
+void* telemetry_sender(void* ptr){
+	battery_status_t bat;
+	uint64_t last_bat = 0;
+
+	while(telemetry_running){
+		usleep(TELEM_FLUSH_US);
+		if((telem_sources&LOG_SOURCE_BATTERY) && read_battery_status(&bat)==0 \
+									&& bat.timestamp_micros!=last_bat){
+			telemetry_battery_status(&bat);
+			last_bat = bat.timestamp_micros;
+		}
+		while(send_telemetry_batch()==TELEM_BATCH);
+	}
+	// give any producer still filling a slot a moment, then flush
+	usleep(TELEM_FLUSH_US);
+	while(send_telemetry_batch()==TELEM_BATCH);
+	return NULL;
+}
+
+/*******************************************************************************
+* int send_telemetry_batch()
+*
+* Packs committed records in claim order into up to TELEM_BATCH datagrams
+* and sends them in one sendmmsg. Stops at the first slot still being filled
+* so records always go out in order. Returns the number of datagrams built.
+*******************************************************************************/
+int send_telemetry_batch(){
+	telem_slot_t* slot;
+	uint64_t t = telem_tail;
+	int i, n, iov, bytes, rec, ret;
+
+	for(n=0;n<TELEM_BATCH;n++){
+		iov = 1;
+		bytes = sizeof(telemetry_datagram_header_t);
+		while(t!=telem_head && iov<(int)TELEM_MAX_IOV){
+			slot = &telem_ring[t&telem_ring_mask];
+			// seq and so committed only hold the low 32 bits of the index
+			if(slot->committed!=(uint64_t)(uint32_t)t+1) break;
+			__sync_synchronize();
+			rec = sizeof(log_record_header_t) + slot->hdr.length;
+			if(bytes+rec > TELEMETRY_MAX_DATAGRAM) break;
+			telem_iov[n][iov].iov_base = &slot->hdr;
+			telem_iov[n][iov].iov_len = rec;
+			bytes += rec;
+			iov++;
+			t++;
+		}
+		if(iov==1) break;
+		telem_headers[n].magic = TELEMETRY_MAGIC;
+		telem_headers[n].version = TELEMETRY_VERSION;
+		telem_headers[n].records = iov-1;
+		telem_headers[n].seq = telem_seq++;
+		telem_iov[n][0].iov_base = &telem_headers[n];
+		telem_iov[n][0].iov_len = sizeof(telemetry_datagram_header_t);
+		memset(&telem_msgs[n], 0, sizeof(struct mmsghdr));
+		telem_msgs[n].msg_hdr.msg_iov = telem_iov[n];
+		telem_msgs[n].msg_hdr.msg_iovlen = iov;
+	}
+	if(n==0) return 0;
+
+	ret = sendmmsg(telem_sock, telem_msgs, n, MSG_DONTWAIT);
+	if(ret<0) ret = 0;
+	telem_stats.datagrams += ret;
+	telem_stats.send_drops += n-ret;
+	for(i=0;i<ret;i++) telem_stats.records += telem_headers[i].records;
+	// the kernel has copied everything it took, release the slots
+	__sync_synchronize();
+	telem_tail = t;
+	return n;
+}
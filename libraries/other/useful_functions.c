@@ -7,6 +7,7 @@
 
 #include "../roboticscape.h"
 #include "../roboticscape-usefulincludes.h"
+#include "sim.h"
 
 /*******************************************************************************
 * @ int null_func()
@@ -18,14 +19,121 @@ int null_func(){
 	return 0;
 }
 
+/*******************************************************************************
+* Random numbers
+*
+* xoshiro128+ with its 128 bits of state kept per thread, so unlike rand()
+* there is no lock and threads never interfere with each other's sequences.
+* Only 32 bit shifts, rotates and adds are needed which suits the ARM. Each 
+* thread seeds itself on first use from the clock and its thread id unless 
+* seed_random was called in that thread first.
+*******************************************************************************/
+__thread uint32_t random_state[4];
+__thread int random_seeded = 0;
+__thread int random_have_spare = 0;
+__thread float random_spare;
+
+/*******************************************************************************
+* int seed_random(uint32_t seed)
+*
+* Seeds the calling thread's generator. The state is filled with splitmix32
+* so any seed, including 0, gives a good starting state.
+*******************************************************************************/
+int seed_random(uint32_t seed){
+	int i;
+	uint32_t z;
+	for(i=0;i<4;i++){
+		seed += 0x9e3779b9;
+		z = seed;
+		z = (z ^ (z>>16)) * 0x85ebca6b;
+		z = (z ^ (z>>13)) * 0xc2b2ae35;
+		random_state[i] = z ^ (z>>16);
+	}
+	random_seeded = 1;
+	random_have_spare = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* uint32_t get_random_uint32()
+*
+* Next 32 random bits from the calling thread's generator.
+*******************************************************************************/
+uint32_t get_random_uint32(){
+	uint32_t* s = random_state;
+	uint32_t result, t;
+	if(!random_seeded){
+		seed_random((uint32_t)nanos_since_boot() ^ (uint32_t)pthread_self());
+	}
+	result = s[0] + s[3];
+	t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 11) | (s[3] >> 21);
+	return result;
+}
+
 /*******************************************************************************
 * float get_random_float()
 *
 * returns a random floating point number between -1 and 1
 *******************************************************************************/
 float get_random_float(){
-	unsigned int a = (rand()&0x007fffff) | 0x40000000;
-    return (*((float*)&a) - 3.0f);
+	union{
+		uint32_t i;
+		float f;
+	} u;
+	// top 23 bits as the mantissa of a float in [2,4)
+	u.i = (get_random_uint32()>>9) | 0x40000000;
+	return u.f - 3.0f;
+}
+
+/*******************************************************************************
+* int fill_random_floats(float* buf, int n)
+*
+* n random floats between -1 and 1, same as calling get_random_float n times
+*******************************************************************************/
+int fill_random_floats(float* buf, int n){
+	int i;
+	for(i=0;i<n;i++) buf[i] = get_random_float();
+	return 0;
+}
+
+/*******************************************************************************
+* float get_random_gaussian()
+*
+* Standard normal sample by the Marsaglia polar method. Each accepted pair
+* gives two samples so the second is kept for the next call.
+*******************************************************************************/
+float get_random_gaussian(){
+	float u, v, r;
+	if(random_have_spare){
+		random_have_spare = 0;
+		return random_spare;
+	}
+	do{
+		u = get_random_float();
+		v = get_random_float();
+		r = u*u + v*v;
+	}while(r>=1.0f || r==0.0f);
+	r = sqrtf(-2.0f*logf(r)/r);
+	random_spare = v*r;
+	random_have_spare = 1;
+	return u*r;
+}
+
+/*******************************************************************************
+* int fill_random_gaussian(float* buf, int n, float mean, float std_dev)
+*
+* n normally distributed samples with the given mean and standard deviation
+*******************************************************************************/
+int fill_random_gaussian(float* buf, int n, float mean, float std_dev){
+	int i;
+	for(i=0;i<n;i++) buf[i] = mean + std_dev*get_random_gaussian();
+	return 0;
 }
 
 /*******************************************************************************
@@ -162,6 +270,42 @@ uint64_t micros_since_epoch(){
 	return timeval_to_micros(tv);
 }
 
+/*******************************************************************************
+* @ uint64_t nanos_since_epoch()
+* 
+* wall-clock time in nanoseconds. This can jump when the system time is set
+* so don't use it to measure time intervals.
+*******************************************************************************/
+uint64_t nanos_since_epoch(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000)+ts.tv_nsec;
+}
+
+/*******************************************************************************
+* @ uint64_t nanos_since_boot()
+* 
+* monotonic time in nanoseconds. clock_gettime is serviced by the vDSO so this
+* does not enter the kernel. Use this for measuring dt and timeouts. While a
+* simulation runs this is the simulated clock instead, see start_sim.
+*******************************************************************************/
+uint64_t nanos_since_boot(){
+	struct timespec ts;
+	// the sim thread moves it on, read it whole on a 32 bit core too
+	if(sim_clock_en) return __sync_fetch_and_add(&sim_clock_ns, 0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000)+ts.tv_nsec+sim_clock_offset_ns;
+}
+
+/*******************************************************************************
+* @ uint64_t micros_since_boot()
+* 
+* monotonic time in microseconds
+*******************************************************************************/
+uint64_t micros_since_boot(){
+	return nanos_since_boot()/1000;
+}
+
 
 /*******************************************************************************
 * @ int suppress_stdout(int (*func)(void))
@@ -261,6 +405,52 @@ int continue_or_quit(){
 	return ret;
 }
 
+/*******************************************************************************
+* @ int init_loop_timer(loop_timer_t* timer, float hz)
+*
+* sets up a loop timer with the first deadline one period from now.
+*******************************************************************************/
+int init_loop_timer(loop_timer_t* timer, float hz){
+	if(hz<=0){
+		printf("ERROR: loop timer frequency must be >0\n");
+		return -1;
+	}
+	timer->period_ns = (uint64_t)(1000000000.0/hz);
+	timer->next_ns = nanos_since_boot() + timer->period_ns;
+	timer->overruns = 0;
+	timer->initialized = 1;
+	return 0;
+}
 
-
-
+/*******************************************************************************
+* @ int loop_timer_wait(loop_timer_t* timer)
+*
+* sleeps until the next absolute deadline then advances it by one period. If
+* the deadline has already passed, the missed periods are skipped rather than
+* run back to back so the loop stays phase-aligned to its original schedule.
+*******************************************************************************/
+int loop_timer_wait(loop_timer_t* timer){
+	struct timespec deadline;
+	uint64_t now, missed;
+	
+	if(timer->initialized!=1){
+		printf("ERROR: loop timer not initialized\n");
+		return -1;
+	}
+	
+	now = nanos_since_boot();
+	if(now >= timer->next_ns){
+		missed = ((now - timer->next_ns)/timer->period_ns) + 1;
+		timer->overruns += missed;
+		timer->next_ns += missed*timer->period_ns;
+		return 1;
+	}
+	
+	deadline.tv_sec  = timer->next_ns/1000000000;
+	deadline.tv_nsec = timer->next_ns%1000000000;
+	// restart the sleep if interrupted by a signal
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)\
+																	==EINTR);
+	timer->next_ns += timer->period_ns;
+	return 0;
+}
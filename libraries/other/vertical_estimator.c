@@ -0,0 +1,194 @@
+/*******************************************************************************
+* vertical_estimator.c
+*
+* Altitude and climb rate from the barometer and the accelerometer. Each
+* on-board IMU sample is handed over by the driver as it is published, its
+* accel is rotated into the world frame with the sample's own quaternion and
+* vertical acceleration less gravity is integrated into altitude and climb
+* rate. Whenever the barometer service has a new reading the error between
+* its altitude and the estimate pulls altitude, climb rate and an accel bias
+* back in, a third order complementary filter with all three poles at
+* -1/time_constant. Short term the accel dominates and the barometer's noise
+* is filtered out, long term the barometer holds the altitude and the bias
+* state soaks up accel offset and any error in gravity.
+*
+* Everything runs in the IMU interrupt thread, there is no thread of its own.
+* The estimate is published through the single writer seqlock pattern of the
+* IMU sample ring for any thread to read.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "vertical_estimator.h"
+
+#define VERTICAL_GRAVITY	9.80665
+#define VERTICAL_MAX_DT		0.5		// s, longer gaps aren't integrated
+#define VERTICAL_READ_TRIES	8
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+vertical_estimator_config_t vert_conf;
+volatile int vert_running = 0;
+float vert_h, vert_v, vert_b;
+float vert_k1, vert_k2, vert_k3;
+uint64_t vert_imu_micros, vert_baro_micros, vert_baro_seq;
+volatile uint32_t vert_lock = 0;	// odd while the estimate is being written
+vertical_estimate_t vert_est;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+float vertical_world_accel(const imu_data_t* data);
+
+/*******************************************************************************
+* vertical_estimator_config_t get_default_vertical_estimator_config()
+*******************************************************************************/
+vertical_estimator_config_t get_default_vertical_estimator_config(){
+	vertical_estimator_config_t conf;
+	conf.time_constant = 2.0;
+	conf.use_fused_quat = 0;
+	return conf;
+}
+
+/*******************************************************************************
+* int start_vertical_estimator(vertical_estimator_config_t conf)
+*
+* Starts fusing from the next IMU sample. The estimate becomes ready at the
+* first barometer reading after that.
+*******************************************************************************/
+int start_vertical_estimator(vertical_estimator_config_t conf){
+	float tau = conf.time_constant;
+	if(tau<=0){
+		printf("ERROR: vertical estimator time constant must be positive\n");
+		return -1;
+	}
+	vert_running = 0;
+	__sync_synchronize();
+	vert_conf = conf;
+	vert_k1 = 3.0/tau;
+	vert_k2 = 3.0/(tau*tau);
+	vert_k3 = 1.0/(tau*tau*tau);
+	vert_baro_seq = 0;
+	vert_lock++;
+	__sync_synchronize();
+	memset(&vert_est, 0, sizeof(vertical_estimate_t));
+	__sync_synchronize();
+	vert_lock++;
+	__sync_synchronize();
+	vert_running = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_vertical_estimator()
+*
+* The last estimate stays readable.
+*******************************************************************************/
+int stop_vertical_estimator(){
+	vert_running = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int get_vertical_estimate(vertical_estimate_t* est)
+*
+* Consistent copy of the newest estimate from any thread.
+*******************************************************************************/
+int get_vertical_estimate(vertical_estimate_t* est){
+	uint32_t before, after;
+	int i;
+	for(i=0;i<VERTICAL_READ_TRIES;i++){
+		before = vert_lock;
+		if(before&1) continue;
+		__sync_synchronize();
+		*est = vert_est;
+		__sync_synchronize();
+		after = vert_lock;
+		if(before==after) return 0;
+	}
+	printf("ERROR: vertical estimate kept changing while being read\n");
+	return -1;
+}
+
+/*******************************************************************************
+* void vertical_estimator_imu_sample(const imu_data_t* data,
+*												uint64_t timestamp_micros)
+*
+* Called by the IMU driver for every on-board sample it publishes.
+*******************************************************************************/
+void vertical_estimator_imu_sample(const imu_data_t* data, \
+												uint64_t timestamp_micros){
+	bmp_sample_t baro;
+	float dt, dtb, a, e;
+	int new_baro, forward;
+
+	if(!vert_running) return;
+	new_baro = get_barometer_sample(&baro)==0 && baro.seq!=vert_baro_seq;
+	a = vertical_world_accel(data) - VERTICAL_GRAVITY;
+
+	vert_lock++;
+	__sync_synchronize();
+	if(!vert_est.ready){
+		// nothing to integrate from until the barometer gives a start
+		if(new_baro){
+			vert_h = baro.altitude_m;
+			vert_v = 0;
+			vert_b = 0;
+			vert_baro_micros = baro.timestamp_micros;
+			vert_imu_micros = timestamp_micros;
+			vert_est.ready = 1;
+		}
+	}
+	else{
+		forward = timestamp_micros>=vert_imu_micros;
+		dt = (timestamp_micros-vert_imu_micros)/1000000.0;
+		vert_imu_micros = timestamp_micros;
+		a -= vert_b;
+		if(forward && dt<=VERTICAL_MAX_DT){
+			vert_h += vert_v*dt + 0.5*a*dt*dt;
+			vert_v += a*dt;
+		}
+		if(new_baro){
+			dtb = (baro.timestamp_micros-vert_baro_micros)/1000000.0;
+			vert_baro_micros = baro.timestamp_micros;
+			if(dtb>VERTICAL_MAX_DT) dtb = VERTICAL_MAX_DT;
+			e = baro.altitude_m - vert_h;
+			vert_h += vert_k1*e*dtb;
+			vert_v += vert_k2*e*dtb;
+			vert_b -= vert_k3*e*dtb;
+		}
+		vert_est.imu_updates++;
+	}
+	if(new_baro){
+		vert_baro_seq = baro.seq;
+		vert_est.baro_updates++;
+		vert_est.baro_altitude_m = baro.altitude_m;
+	}
+	vert_est.altitude_m = vert_h;
+	vert_est.climb_rate = vert_v;
+	vert_est.accel_bias = vert_b;
+	vert_est.vertical_accel = a;
+	vert_est.timestamp_micros = timestamp_micros;
+	__sync_synchronize();
+	vert_lock++;
+}
+
+/*******************************************************************************
+* float vertical_world_accel(const imu_data_t* data)
+*
+* Upward component of the accel in the world frame. Samples without a
+* quaternion, in random or FIFO stream mode, are taken as level.
+*******************************************************************************/
+float vertical_world_accel(const imu_data_t* data){
+	float q[4], v[3], out[3];
+	const float* src = vert_conf.use_fused_quat ? data->fused_quat : \
+														data->dmp_quat;
+	memcpy(q, src, sizeof(q));
+	if(q[QUAT_W]==0 && q[QUAT_X]==0 && q[QUAT_Y]==0 && q[QUAT_Z]==0){
+		return data->accel[2];
+	}
+	memcpy(v, data->accel, sizeof(v));
+	quaternionRotateVector(q, v, out);
+	return out[2];
+}
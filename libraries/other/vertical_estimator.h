@@ -0,0 +1,10 @@
+/*******************************************************************************
+* vertical_estimator.h
+*
+* Hook between vertical_estimator.c and the IMU driver. Not part of the
+* public API, see the VERTICAL ESTIMATOR section of roboticscape.h instead.
+*******************************************************************************/
+
+// advances the estimate with each on-board IMU sample as it is published
+void vertical_estimator_imu_sample(const imu_data_t* data, \
+												uint64_t timestamp_micros);
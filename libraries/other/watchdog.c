@@ -0,0 +1,222 @@
+/*******************************************************************************
+* watchdog.c
+*
+* Deadline watchdog for the control loop. A thread at the top SCHED_FIFO
+* priority sleeps until the moment the next heartbeat is due. If it wakes and
+* none has arrived it cuts the outputs itself: the H-bridge standby pin is
+* pulled low and the motor PWM duty zeroed with the mmapped GPIO and PWMSS
+* registers, and the PRU is told to stop sending servo pulses through its
+* shared memory. None of that makes a system call so it all happens within
+* a few microseconds of the deadline, however stuck the rest of the program
+* is.
+*
+* The heartbeat time is 64 bits which the ARM can't store atomically, so it
+* is written in the same single writer seqlock style as the IMU sample ring.
+*******************************************************************************/
+
+#include "../roboticscape-usefulincludes.h"
+#include "../roboticscape.h"
+#include "../roboticscape-defs.h"
+#include "../mmap/mmap_gpio_adc.h"
+#include "../mmap/mmap_pwmss.h"
+
+#define WATCHDOG_MIN_TIMEOUT_US	100
+#define WATCHDOG_MAX_TIMEOUT_US	1000000
+#define WATCHDOG_READ_TRIES		8
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+pthread_t watchdog_thread;
+volatile int watchdog_running = 0;
+volatile int watchdog_tripped = 0;
+uint64_t watchdog_timeout_ns;
+volatile uint32_t watchdog_feed_lock;
+volatile uint64_t watchdog_last_feed_ns;
+uint64_t watchdog_trips;
+uint64_t watchdog_trip_late_ns;		// deadline to outputs off, last trip
+uint64_t watchdog_trip_action_ns;	// time spent cutting outputs, last trip
+void (*watchdog_func)(void) = NULL;
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* watchdog_handler(void* ptr);
+uint64_t read_watchdog_feed();
+void cut_watchdog_outputs();
+
+/*******************************************************************************
+* int start_control_watchdog(int timeout_us)
+*
+* Starts watching for feed_control_watchdog to be called at least every
+* timeout_us. The first deadline is timeout_us from now.
+*******************************************************************************/
+int start_control_watchdog(int timeout_us){
+	if(watchdog_running){
+		printf("ERROR: control watchdog already running\n");
+		return -1;
+	}
+	if(timeout_us<WATCHDOG_MIN_TIMEOUT_US || timeout_us>WATCHDOG_MAX_TIMEOUT_US){
+		printf("ERROR: watchdog timeout must be between %dus & %dus\n", \
+						WATCHDOG_MIN_TIMEOUT_US, WATCHDOG_MAX_TIMEOUT_US);
+		return -1;
+	}
+	// map the gpio and the motor PWM subsystems now so a trip doesn't have to
+	if(initialize_mmap_gpio()){
+		printf("ERROR: control watchdog failed to map gpio\n");
+		return -1;
+	}
+	if(map_pwmss(1) || map_pwmss(2)){
+		printf("ERROR: control watchdog failed to map PWMSS\n");
+		return -1;
+	}
+	watchdog_timeout_ns = (uint64_t)timeout_us*1000;
+	watchdog_tripped = 0;
+	feed_control_watchdog();
+	watchdog_running = 1;
+	if(create_rt_thread(&watchdog_thread, RT_SERVICE_WATCHDOG, \
+											watchdog_handler, NULL)<0){
+		watchdog_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int stop_control_watchdog()
+*
+* Stops watching without touching the outputs. Waits up to one timeout for
+* the thread to notice.
+*******************************************************************************/
+int stop_control_watchdog(){
+	if(!watchdog_running) return 0;
+	watchdog_running = 0;
+	pthread_join(watchdog_thread, NULL);
+	return 0;
+}
+
+/*******************************************************************************
+* int feed_control_watchdog()
+*
+* The heartbeat, call it from the one control loop being watched.
+*******************************************************************************/
+int feed_control_watchdog(){
+	watchdog_feed_lock++;
+	__sync_synchronize();
+	watchdog_last_feed_ns = nanos_since_boot();
+	__sync_synchronize();
+	watchdog_feed_lock++;
+	return 0;
+}
+
+/*******************************************************************************
+* int rearm_control_watchdog()
+*
+* Clears a trip and starts a fresh deadline. Outputs stay off until the
+* program turns them on again with enable_motors and the servo functions.
+*******************************************************************************/
+int rearm_control_watchdog(){
+	feed_control_watchdog();
+	__sync_synchronize();
+	watchdog_tripped = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int is_control_watchdog_tripped()
+*******************************************************************************/
+int is_control_watchdog_tripped(){
+	return watchdog_tripped;
+}
+
+/*******************************************************************************
+* int set_control_watchdog_func(void (*func)(void))
+*
+* Optional function called from the watchdog thread after the outputs are
+* off, for instance to set the state to EXITING. NULL removes it.
+*******************************************************************************/
+int set_control_watchdog_func(void (*func)(void)){
+	watchdog_func = func;
+	return 0;
+}
+
+/*******************************************************************************
+* int get_control_watchdog_stats(control_watchdog_stats_t* stats)
+*******************************************************************************/
+int get_control_watchdog_stats(control_watchdog_stats_t* stats){
+	memset(stats, 0, sizeof(control_watchdog_stats_t));
+	stats->running = watchdog_running;
+	stats->tripped = watchdog_tripped;
+	stats->trips = watchdog_trips;
+	stats->trip_late_us = watchdog_trip_late_ns/1000;
+	stats->trip_action_us = watchdog_trip_action_ns/1000;
+	return 0;
+}
+
+/*******************************************************************************
+* void* watchdog_handler(void* ptr)
+*
+* Sleeps until the last feed plus the timeout. A feed in the meantime moves
+* the deadline so it just goes back to sleep, otherwise it trips. Once
+* tripped it checks back every timeout for a rearm or a stop.
+*******************************************************************************/
+void* watchdog_handler(void* ptr){
+	struct timespec ts;
+	uint64_t deadline, now, t_cut;
+
+	while(watchdog_running){
+		if(watchdog_tripped) deadline = nanos_since_boot()+watchdog_timeout_ns;
+		else deadline = read_watchdog_feed() + watchdog_timeout_ns;
+		now = nanos_since_boot();
+		if(watchdog_tripped || now<deadline){
+			ts.tv_sec = deadline/1000000000;
+			ts.tv_nsec = deadline%1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			continue;
+		}
+		// missed, a feed could have landed between the read and now
+		if(read_watchdog_feed()+watchdog_timeout_ns > now) continue;
+		cut_watchdog_outputs();
+		t_cut = nanos_since_boot();
+		watchdog_tripped = 1;
+		watchdog_trips++;
+		watchdog_trip_late_ns = t_cut - deadline;
+		watchdog_trip_action_ns = t_cut - now;
+		if(watchdog_func!=NULL) watchdog_func();
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* uint64_t read_watchdog_feed()
+*
+* Consistent copy of the last heartbeat time. If the feeder somehow keeps
+* writing through every try, 0 is returned which trips the watchdog.
+*******************************************************************************/
+uint64_t read_watchdog_feed(){
+	uint32_t before, after;
+	uint64_t t;
+	int i;
+	for(i=0;i<WATCHDOG_READ_TRIES;i++){
+		before = watchdog_feed_lock;
+		if(before&1) continue;
+		__sync_synchronize();
+		t = watchdog_last_feed_ns;
+		__sync_synchronize();
+		after = watchdog_feed_lock;
+		if(before==after) return t;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* void cut_watchdog_outputs()
+*
+* Standby first since it stops the H-bridges outright, then the PWM duty and
+* servo pulses so nothing comes back on if standby is raised again.
+*******************************************************************************/
+void cut_watchdog_outputs(){
+	mmap_gpio_write(MOT_STBY, LOW);
+	set_motor_free_spin_all();
+	stop_servo_outputs();
+}
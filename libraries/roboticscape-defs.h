@@ -18,6 +18,8 @@
 #define DSM_CAL_FILE	"dsm.cal"
 #define GYRO_CAL_FILE 	"gyro.cal"
 #define MAG_CAL_FILE	"mag.cal"
+#define IMU_TEMP_CAL_FILE	"imu_temp.cal"
+#define CAL_STORE_FILE	"calibration.bin"
 
 // PID file location
 // file created to indicate running process
@@ -88,7 +90,8 @@
 // PRU Servo & encoder Control parameters
 #define SERVO_PRU_NUM 	 1
 #define ENCODER_PRU_NUM 	 0
-#define PRU_SERVO_LOOP_INSTRUCTIONS	48	// instructions per PRU servo timer loop 
+#define PRU_SERVO_NS_PER_COUNT	5	// servo widths are in 200MHz IEP counts
+#define PRU_SERVO_COUNTS_PER_S	200000000
 
 
 #endif //ROBOTICS_CAPE_DEFS
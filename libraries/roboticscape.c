@@ -12,46 +12,133 @@
 #include "mmap/mmap_gpio_adc.h"		// used for fast gpio functions
 #include "mmap/mmap_pwmss.h"		// used for fast pwm functions
 #include "other/robotics_pru.h"
+#include "other/replay.h"
+#include "other/sim.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 
 #define CAPE_NAME 	"RoboticsCape"
 #define MAX_BUF 	512
+#define BUTTON_DEBOUNCE_NS 1500000	// button must be stable this long
+#define ADC_READ_CHUNK	32	// samples popped from the adc buffers at a time
+#define REACTOR_MAX_FDS		32	// most fds the reactor can watch
+#define REACTOR_MAX_EVENTS	16	// events handled per epoll_wait
+#define LED_PATTERN_MAX_STEPS	16	// on/off segments in one led pattern
+#define REACTOR_EXIT_SLOT	UINT64_MAX	// epoll data of the exit eventfd
 
 /*******************************************************************************
 * Global Variables
 *******************************************************************************/
-enum state_t state = UNINITIALIZED;
+volatile enum state_t state = UNINITIALIZED;
+enum state_t announced_state = UNINITIALIZED; // last state waiters were told
+pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t state_cond;
+int state_cond_initialized = 0;
+int state_exit_fd = -1;
+int state_signal_fd = -1;	// written by the signal handler, never closed
+volatile int state_signal_running = 0;
+pthread_t state_signal_thread;
 int pause_btn_state, mode_btn_state;
-int mdir1a, mdir2b; // variable gpio pin assignments
+int cape_subsystems = 0; // CAPE_* set up so far, eagerly or on first use
+int sim_led_state[2]; // stands in for the led pins in simulation mode
 
 
 
+/*******************************************************************************
+* struct motor_pins_t
+*
+* Direction pins and PWM output of one motor channel. fwd is driven high for
+* positive duty. Motors 2 and 3 are wired with their pins swapped and two pins
+* moved on the Blue, so the table is filled in once for the board at init and
+* the motor functions just index it.
+*******************************************************************************/
+typedef struct motor_pins_t{
+	int fwd;
+	int rev;
+	int pwm_ss;
+	char pwm_ch;
+} motor_pins_t;
+
+motor_pins_t motor_pins[MOTOR_CHANNELS];
+
+/*******************************************************************************
+* struct reactor_entry_t
+*
+* One watched fd. gen changes every time the slot is reused so events still
+* queued for an fd that was removed are recognised and dropped.
+*******************************************************************************/
+typedef struct reactor_entry_t{
+	int fd;
+	int active;
+	int is_timer;	// timerfd created by reactor_add_timer, read before dispatch
+	int priority;
+	uint32_t gen;
+	void (*func)(int fd, uint32_t events, void* arg);
+	void* arg;
+} reactor_entry_t;
+
+reactor_entry_t reactor_entries[REACTOR_MAX_FDS];
+int reactor_epfd = -1;
+int reactor_running = 0;
+pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* button state owned by the reactor callbacks
+*******************************************************************************/
+int button_pin[2] = {PAUSE_BTN, MODE_BTN};
+int button_fd[2] = {-1, -1};
+int button_chardev[2];
+int button_timer[2] = {-1, -1};
+button_state_t button_reported[2];
+
+/*******************************************************************************
+* led pattern state, stepped by one reactor timer per led
+*******************************************************************************/
+typedef struct led_pattern_state_t{
+	int timer;			// reactor timerfd, -1 until the first pattern
+	int active;
+	float times[LED_PATTERN_MAX_STEPS];	// seconds, alternating on then off
+	int steps;
+	int step;			// segment currently showing
+	int repeats;		// passes left including this one, 0 for forever
+} led_pattern_state_t;
+
+led_pattern_state_t led_patterns[2] = {{.timer=-1}, {.timer=-1}};
+pthread_mutex_t led_pattern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*******************************************************************************
 * local function declarations
 *******************************************************************************/
 int is_cape_loaded();
+int lazy_init_buttons();
 int initialize_button_handlers();
+void close_button_handlers();
+void button_edge_func(int fd, uint32_t events, void* arg);
+void button_settled_func(int fd, uint32_t events, void* arg);
+uint64_t edge_time_ns(uint64_t kernel_ns);
 int (*pause_released_func)();
 int (*pause_pressed_func)();
 int (*mode_released_func)();
 int (*mode_pressed_func)();
 void shutdown_signal_handler(int signo);
+int start_state_signal_thread();
+void stop_state_signal_thread();
+void led_pattern_func(int fd, uint32_t events, void* arg);
+void close_led_patterns();
+void init_motor_pins();
 
 /*******************************************************************************
 * local thread function declarations
 *******************************************************************************/
-void* pause_pressed_handler(void* ptr);
-void* pause_released_handler(void* ptr);
-void* mode_pressed_handler(void* ptr);
-void* mode_released_handler(void* ptr);
+void* reactor_handler(void* ptr);
+void* state_signal_handler(void* ptr);
 
 /*******************************************************************************
 * local thread structs
 *******************************************************************************/
-pthread_t pause_pressed_thread;
-pthread_t pause_released_thread;
-pthread_t mode_pressed_thread;
-pthread_t mode_released_thread;
+pthread_t reactor_thread;
 
 
 /*******************************************************************************
@@ -60,110 +147,173 @@ pthread_t mode_released_thread;
 * should be the first thing your program calls
 *******************************************************************************/
 int initialize_cape(){
+	return initialize_cape_subsystems(CAPE_ALL);
+}
+
+/*******************************************************************************
+* int initialize_cape_subsystems(int mask)
+*
+* Same as initialize_cape but only sets up the CAPE_* subsystems in mask right
+* away. robot_startup_routine has already configured the drivers at boot, so
+* everything else is set up on first use: gpio, adc, eQEP and PWM are mapped 
+* by the first call that touches them, the PRU by the first servo or encoder 4
+* call and the buttons by the first set_*_func.
+*******************************************************************************/
+int initialize_cape_subsystems(int mask){
 	FILE *fd; 
 
 	// check if another project was using resources
-	// kill that process cleanly with sigint if so
+	// kill that process cleanly with sigint if so. Simulations share nothing
+	// so any number of them can run side by side.
 	#ifdef DEBUG
 		printf("checking for existing PID_FILE\n");
 	#endif
-	kill_robot();
+	if(!is_sim_mode()) kill_robot();
 	
-	// Start Signal Handler
+	// Start Signal Handler, the thread it wakes tells everyone else
 	#ifdef DEBUG
 	printf("Initializing exit signal handler\n");
 	#endif
+	if(start_state_signal_thread()<0){
+		printf("ERROR: failed to start signal thread\n");
+		return -1;
+	}
 	signal(SIGINT, shutdown_signal_handler);	
 	signal(SIGTERM, shutdown_signal_handler);	
 
 
-	// do any board-specific config
-	if(get_bb_model()==BB_BLUE){
-		mdir1a = MDIR1A_BLUE;
-		mdir2b = MDIR2B_BLUE;
+	// keep pages resident before starting any real-time threads
+	if(get_rt_config().lock_memory && !is_sim_mode()){
+		#ifdef DEBUG
+		printf("Locking memory\n");
+		#endif
+		if(lock_rt_memory()<0){
+			printf("WARNING: continuing without locked memory\n");
+		}
 	}
-	else{
-		mdir1a = MDIR1A;
-		mdir2b = MDIR2B;
+
+	// real-time paths queue their errors for a low priority thread to print
+	if(start_error_reporter()<0){
+		printf("WARNING: error reports will be printed directly\n");
 	}
 
-	// initialize pinmux
-	#ifdef DEBUG
-	printf("Initializing: PINMUX\n");
-	#endif
-	set_default_pinmux();
+	// do any board-specific config
+	if(!is_sim_mode()) init_motor_pins();
 
-	// initialize gpio pins
-	#ifdef DEBUG
-	printf("Initializing: GPIO\n");
-	#endif
-	if(configure_gpio_pins()<0){
-		printf("ERROR: failed to configure GPIO\n");
+	if(mask & ~CAPE_ALL){
+		printf("ERROR: invalid cape subsystem mask\n");
 		return -1;
 	}
 
-	// now use mmap for fast gpio
-	#ifdef DEBUG
-	printf("Initializing: MMAP GPIO\n");
-	#endif
-	if(initialize_mmap_gpio()){
-		printf("mmap_gpio_adc.c failed to initialize gpio\n");
-		return -1;
+	// the sim stands in for every subsystem and there's no pid file to write
+	if(is_sim_mode()){
+		set_state(PAUSED);
+		return 0;
+	}
+
+	// initialize pinmux
+	if(mask & CAPE_PINMUX){
+		#ifdef DEBUG
+		printf("Initializing: PINMUX\n");
+		#endif
+		set_default_pinmux();
+		cape_subsystems |= CAPE_PINMUX;
+	}
+
+	if(mask & CAPE_GPIO){
+		// initialize gpio pins
+		#ifdef DEBUG
+		printf("Initializing: GPIO\n");
+		#endif
+		if(configure_gpio_pins()<0){
+			printf("ERROR: failed to configure GPIO\n");
+			return -1;
+		}
+
+		// now use mmap for fast gpio
+		#ifdef DEBUG
+		printf("Initializing: MMAP GPIO\n");
+		#endif
+		if(initialize_mmap_gpio()){
+			printf("mmap_gpio_adc.c failed to initialize gpio\n");
+			return -1;
+		}
+		cape_subsystems |= CAPE_GPIO;
 	}
 	
 	// now adc
-	#ifdef DEBUG
-	printf("Initializing: ADC\n");
-	#endif
-	if(initialize_mmap_adc()){
-		printf("mmap_gpio_adc.c failed to initialize adc\n");
-		return -1;
+	if(mask & CAPE_ADC){
+		#ifdef DEBUG
+		printf("Initializing: ADC\n");
+		#endif
+		if(initialize_mmap_adc()){
+			printf("mmap_gpio_adc.c failed to initialize adc\n");
+			return -1;
+		}
+		cape_subsystems |= CAPE_ADC;
 	}
 
 	// now eqep
-	#ifdef DEBUG
-	printf("Initializing: eQEP\n");
-	#endif
-	if(init_eqep(0)){
-		printf("ERROR: failed to initialize eQEP0\n");
-		// return -1;
-	}
-	if(init_eqep(1)){
-		printf("ERROR: failed to initialize eQEP1\n");
-		// return -1;
-	}
-	if(init_eqep(2)){
-		printf("ERROR: failed to initialize eQEP2\n");
-		// return -1;
+	if(mask & CAPE_ENCODERS){
+		#ifdef DEBUG
+		printf("Initializing: eQEP\n");
+		#endif
+		if(init_eqep(0)){
+			printf("ERROR: failed to initialize eQEP0\n");
+			// return -1;
+		}
+		if(init_eqep(1)){
+			printf("ERROR: failed to initialize eQEP1\n");
+			// return -1;
+		}
+		if(init_eqep(2)){
+			printf("ERROR: failed to initialize eQEP2\n");
+			// return -1;
+		}
+		cape_subsystems |= CAPE_ENCODERS;
 	}
 	
 	// now pwm
-	#ifdef DEBUG
-	printf("Initializing: PWM\n");
-	#endif
-	if(simple_init_pwm(1,PWM_FREQ)){
-		printf("ERROR: failed to initialize hrpwm1\n");
-		return -1;
-	}
-	if(simple_init_pwm(2,PWM_FREQ)){
-		printf("ERROR: failed to initialize PWMSS 2\n");
-		return -1;
+	if(mask & CAPE_MOTORS){
+		#ifdef DEBUG
+		printf("Initializing: PWM\n");
+		#endif
+		if(simple_init_pwm(1,PWM_FREQ)){
+			printf("ERROR: failed to initialize hrpwm1\n");
+			return -1;
+		}
+		if(simple_init_pwm(2,PWM_FREQ)){
+			printf("ERROR: failed to initialize PWMSS 2\n");
+			return -1;
+		}
+		cape_subsystems |= CAPE_MOTORS;
 	}
 	
-	//set up function pointers for button press events
-	#ifdef DEBUG
-	printf("Initializing: Buttons\n");
-	#endif
-	if(initialize_button_handlers()<0){
-		printf("ERROR: failed to start button threads\n");
-		return -1;
+	if(mask & CAPE_BUTTONS){
+		// one thread serves the buttons and any other background fds
+		#ifdef DEBUG
+		printf("Initializing: Reactor\n");
+		#endif
+		if(start_reactor()<0){
+			printf("ERROR: failed to start reactor thread\n");
+			return -1;
+		}
+		
+		//set up function pointers for button press events
+		#ifdef DEBUG
+		printf("Initializing: Buttons\n");
+		#endif
+		if(lazy_init_buttons()<0) return -1;
 	}
 	
 	// start PRU
-	#ifdef DEBUG
-	printf("Initializing: PRU\n");
-	#endif
-	initialize_pru();
+	if(mask & CAPE_PRU){
+		#ifdef DEBUG
+		printf("Initializing: PRU\n");
+		#endif
+		initialize_pru();
+		cape_subsystems |= CAPE_PRU;
+	}
 
 	// create new pid file with process id
 	#ifdef DEBUG
@@ -185,7 +335,7 @@ int initialize_cape(){
  	#endif
 
 	// wait to let threads start up
-	usleep(10000);
+	if(mask & CAPE_BUTTONS) usleep(10000);
 	
 	// all done
 	set_state(PAUSED);
@@ -201,61 +351,54 @@ int initialize_cape(){
 int cleanup_cape(){
 	// just in case the user forgot, set state to exiting
 	set_state(EXITING);
+	stop_state_signal_thread();
 	
 	// announce we are starting cleanup process
 	printf("\nExiting Cleanly\n");
 	
-	//allow up to 3 seconds for thread cleanup
-	struct timespec thread_timeout;
-	clock_gettime(CLOCK_REALTIME, &thread_timeout);
-	thread_timeout.tv_sec += 3;
-	int thread_err = 0;
-	thread_err = pthread_timedjoin_np(pause_pressed_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: pause_pressed_thread exit timeout\n");
-	}
-	thread_err = 0;
-	thread_err = pthread_timedjoin_np(pause_released_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: pause_released_thread exit timeout\n");
-	}
-	thread_err = 0;
-	thread_err = pthread_timedjoin_np(mode_pressed_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: mode_pressed_thread exit timeout\n");
-	}
-	thread_err = 0;
-	thread_err = pthread_timedjoin_np(mode_released_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: mode_released_thread exit timeout\n");
-	}
-	
+	// the watchdog would otherwise trip as the control loop goes away
+	stop_control_watchdog();
+
+	// stops the reactor thread, then release the button lines
+	close_led_patterns();
+	stop_reactor();
+	close_button_handlers();
+	cape_subsystems &= ~CAPE_BUTTONS;
 	
+	// only touch the outputs of subsystems that were used, so a program that
+	// read one voltage doesn't map the gpio and pwm just to exit
 	#ifdef DEBUG
 	printf("turning off GPIOs & PWM\n");
 	#endif
-	set_led(GREEN,LOW);
-	set_led(RED,LOW);	
-	disable_motors();
-	manual_deselect_spi_slave(1);	
-	manual_deselect_spi_slave(2);	
-	disable_servo_power_rail();
+	if(cape_subsystems & CAPE_MOTORS) disable_motors();
+	if((cape_subsystems & CAPE_GPIO) || mmap_gpio_is_initialized()){
+		set_led(GREEN,LOW);
+		set_led(RED,LOW);	
+		manual_deselect_spi_slave(1);	
+		manual_deselect_spi_slave(2);	
+		disable_servo_power_rail();
+	}
 	
 	#ifdef DEBUG
 	printf("stopping dsm service\n");
 	#endif
 	stop_dsm_service();	
 	
+	// flush any telemetry still in the rings to disk and the network
+	stop_logger();
+	stop_telemetry();
+	stop_sensor_hub_server();
+	stop_metrics_export();
+	stop_error_reporter();
+	set_cpu_performance_follows_state(0);
+	disable_cpu_performance_mode();
+	
 	#ifdef DEBUG
 	printf("deleting PID file\n");
 	#endif
 	FILE* fd;
-	// clean up the pid_file if it still exists
-	fd = fopen(PID_FILE, "r");
+	// clean up the pid_file if it still exists, unless it's a real robot's
+	fd = is_sim_mode() ? NULL : fopen(PID_FILE, "r");
 	if (fd != NULL) {
 		// close and delete the old file
 		fclose(fd);
@@ -279,6 +422,77 @@ state_t get_state(){
 	return state;
 }
 
+/*******************************************************************************
+* void init_state_cond()
+*
+* The condition variable waits on CLOCK_MONOTONIC so a wall clock step from
+* ntp doesn't stretch or cut short a timeout. Call with state_mutex held.
+*******************************************************************************/
+void init_state_cond(){
+	pthread_condattr_t attr;
+	if(state_cond_initialized) return;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&state_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	state_cond_initialized = 1;
+}
+
+/*******************************************************************************
+* @ state_t wait_for_state_change(state_t from, int timeout_ms)
+*
+* Blocks until the state is something other than from, or timeout_ms passes.
+* A timeout of 0 waits forever. Returns the state at the time of return, so
+* from again means it timed out.
+*******************************************************************************/
+state_t wait_for_state_change(state_t from, int timeout_ms){
+	struct timespec ts;
+	state_t ret;
+
+	pthread_mutex_lock(&state_mutex);
+	init_state_cond();
+	if(timeout_ms>0){
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += timeout_ms/1000;
+		ts.tv_nsec += (long)(timeout_ms%1000)*1000000;
+		if(ts.tv_nsec>=1000000000){
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+	while(state==from){
+		if(timeout_ms>0){
+			if(pthread_cond_timedwait(&state_cond, &state_mutex, &ts)==\
+													ETIMEDOUT) break;
+		}
+		else pthread_cond_wait(&state_cond, &state_mutex);
+	}
+	ret = state;
+	pthread_mutex_unlock(&state_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* @ int get_exit_fd()
+*
+* An eventfd that becomes readable (POLLIN) once the state is EXITING and 
+* stays that way, for threads to add to the poll() or epoll set they already 
+* block in instead of waking up to check get_state(). Never read from it.
+* Returns -1 on failure.
+*******************************************************************************/
+int get_exit_fd(){
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&state_mutex);
+	if(state_exit_fd<0){
+		state_exit_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+		if(state_exit_fd<0) printf("ERROR: failed to create exit eventfd\n");
+		else if(state==EXITING) write(state_exit_fd, &one, 8);
+	}
+	pthread_mutex_unlock(&state_mutex);
+	return state_exit_fd;
+}
+
 
 /*******************************************************************************
 * @ int set_state(state_t new_state)
@@ -287,7 +501,24 @@ state_t get_state(){
 * use this for managing how your threads start and stop
 *******************************************************************************/
 int set_state(state_t new_state){
+	uint64_t val = 1;
+	state_t old;
+
+	pthread_mutex_lock(&state_mutex);
+	init_state_cond();
+	old = announced_state;
 	state = new_state;
+	announced_state = new_state;
+	if(new_state!=old){
+		pthread_cond_broadcast(&state_cond);
+		// the eventfd stays readable for as long as the state is EXITING
+		if(state_exit_fd>=0){
+			if(new_state==EXITING) write(state_exit_fd, &val, 8);
+			else if(old==EXITING) read(state_exit_fd, &val, 8);
+		}
+	}
+	pthread_mutex_unlock(&state_mutex);
+	if(new_state!=old) cpu_performance_state_changed(new_state);
 	return 0;
 }
 
@@ -330,6 +561,10 @@ int set_led(led_t led, int state){
 	if(state) val = HIGH;
 	else val = LOW;
 	
+	if(is_sim_mode() && (led==GREEN || led==RED)){
+		sim_led_state[led==RED] = val;
+		return 0;
+	}
 	switch(led){
 	case GREEN:
 		return mmap_gpio_write(GRN_LED, val);
@@ -352,6 +587,9 @@ int set_led(led_t led, int state){
 *******************************************************************************/
 int get_led_state(led_t led){
 	int ret= -1;
+	if(is_sim_mode() && (led==GREEN || led==RED)){
+		return sim_led_state[led==RED];
+	}
 	switch(led){
 	case GREEN:
 		gpio_get_value(GRN_LED, &ret);
@@ -392,209 +630,617 @@ int blink_led(led_t led, float hz, float period){
 }
 
 /*******************************************************************************
-*	int initialize_button_interrups()
+* int start_led_pattern(led_t led, const float* times, int steps, int repeats)
+*
+* Shows a pattern on an LED in the background and returns immediately. times
+* holds steps durations in seconds alternating on, off, on... starting with
+* on, and the pattern runs repeats times or forever if repeats is 0. Replaces
+* whatever pattern the LED was already showing. Stepped by a one-shot reactor
+* timer re-armed with each segment's duration, so the reactor thread only
+* wakes on the edges.
+*******************************************************************************/
+int start_led_pattern(led_t led, const float* times, int steps, int repeats){
+	led_pattern_state_t* p;
+	int i, timer;
+
+	if(led!=GREEN && led!=RED){
+		printf("LED must be GREEN or RED\n");
+		return -1;
+	}
+	if(times==NULL || steps<1 || steps>LED_PATTERN_MAX_STEPS || repeats<0){
+		printf("ERROR: led pattern needs 1 to %d steps and repeats>=0\n", \
+													LED_PATTERN_MAX_STEPS);
+		return -1;
+	}
+	for(i=0;i<steps;i++){
+		if(times[i]<=0.0f){
+			printf("ERROR: led pattern times must be positive\n");
+			return -1;
+		}
+	}
+	p = &led_patterns[led];
+	pthread_mutex_lock(&led_pattern_mutex);
+	if(p->timer<0){
+		timer = reactor_add_timer(0, REACTOR_PRIORITY_LOW, led_pattern_func, \
+													(void*)(intptr_t)led);
+		if(timer<0){
+			pthread_mutex_unlock(&led_pattern_mutex);
+			printf("ERROR: failed to create led pattern timer\n");
+			return -1;
+		}
+		p->timer = timer;
+	}
+	memcpy(p->times, times, steps*sizeof(float));
+	p->steps = steps;
+	p->step = 0;
+	p->repeats = repeats;
+	p->active = 1;
+	set_led(led, 1);
+	reactor_set_timer(p->timer, p->times[0], 0);
+	pthread_mutex_unlock(&led_pattern_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int start_led_blink(led_t led, float hz, float period)
+*
+* Non-blocking blink_led. A period of 0 blinks until stop_led_pattern.
+*******************************************************************************/
+int start_led_blink(led_t led, float hz, float period){
+	float times[2];
+	int blinks;
+	if(hz<=0.0f || period<0.0f){
+		printf("ERROR: led blink needs hz>0 and period>=0\n");
+		return -1;
+	}
+	times[0] = times[1] = 0.5f/hz;
+	blinks = (int)(period*hz);
+	if(period>0.0f && blinks<1) blinks = 1;
+	return start_led_pattern(led, times, 2, blinks);
+}
+
+/*******************************************************************************
+* int start_led_heartbeat(led_t led, float period)
+*
+* Two short flashes every period seconds until stop_led_pattern.
+*******************************************************************************/
+int start_led_heartbeat(led_t led, float period){
+	float times[4] = {0.07f, 0.12f, 0.07f, 0.0f};
+	if(period<=0.5f){
+		printf("ERROR: led heartbeat period must be more than 0.5s\n");
+		return -1;
+	}
+	times[3] = period - times[0] - times[1] - times[2];
+	return start_led_pattern(led, times, 4, 0);
+}
+
+/*******************************************************************************
+* int stop_led_pattern(led_t led)
+*
+* Ends the LED's pattern, if any, and turns it off.
+*******************************************************************************/
+int stop_led_pattern(led_t led){
+	led_pattern_state_t* p;
+	if(led!=GREEN && led!=RED){
+		printf("LED must be GREEN or RED\n");
+		return -1;
+	}
+	p = &led_patterns[led];
+	pthread_mutex_lock(&led_pattern_mutex);
+	if(p->active){
+		p->active = 0;
+		reactor_set_timer(p->timer, 0, 0);
+		set_led(led, 0);
+	}
+	pthread_mutex_unlock(&led_pattern_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int led_pattern_running(led_t led)
 *
-*	start 4 threads to handle 4 interrupt routines for pressing and
-*	releasing the two buttons.
+* returns 1 while a pattern is showing on the LED, 0 once it has finished.
+*******************************************************************************/
+int led_pattern_running(led_t led){
+	if(led!=GREEN && led!=RED) return 0;
+	return led_patterns[led].active;
+}
+
+/*******************************************************************************
+* void led_pattern_func(int fd, uint32_t events, void* arg)
+*
+* Reactor callback at the end of each segment. Moves to the next one and
+* re-arms the timer for its duration, or turns the LED off after the last pass.
+*******************************************************************************/
+void led_pattern_func(int fd, uint32_t events, void* arg){
+	led_t led = (led_t)(intptr_t)arg;
+	led_pattern_state_t* p = &led_patterns[led];
+
+	pthread_mutex_lock(&led_pattern_mutex);
+	if(!p->active){
+		pthread_mutex_unlock(&led_pattern_mutex);
+		return;
+	}
+	p->step++;
+	if(p->step>=p->steps){
+		p->step = 0;
+		if(p->repeats>0 && --p->repeats==0){
+			p->active = 0;
+			set_led(led, 0);
+			pthread_mutex_unlock(&led_pattern_mutex);
+			return;
+		}
+	}
+	// even steps are on, odd steps are off
+	set_led(led, !(p->step&1));
+	reactor_set_timer(p->timer, p->times[p->step], 0);
+	pthread_mutex_unlock(&led_pattern_mutex);
+	return;
+}
+
+/*******************************************************************************
+* void close_led_patterns()
+*
+* Stops both patterns and forgets their timers, which stop_reactor closes.
+*******************************************************************************/
+void close_led_patterns(){
+	int i;
+	pthread_mutex_lock(&led_pattern_mutex);
+	for(i=0;i<2;i++){
+		led_patterns[i].active = 0;
+		if(led_patterns[i].timer>=0) reactor_remove_fd(led_patterns[i].timer);
+		led_patterns[i].timer = -1;
+	}
+	pthread_mutex_unlock(&led_pattern_mutex);
+	return;
+}
+
+/*******************************************************************************
+*	int initialize_button_handlers()
+*
+*	Registers both buttons with the reactor. Edge events come from the gpio 
+*	character device with kernel timestamps when the line can be requested,
+*	otherwise from sysfs timestamped on wakeup. Each button also gets a 
+*	one-shot timerfd which every edge pushes back to BUTTON_DEBOUNCE_NS after
+*	that edge, so the state is only sampled once the contacts have settled.
 *******************************************************************************/
 int initialize_button_handlers(){
+	char buf[MAX_BUF];
+	int i;
 	
-	struct sched_param params;
-	pthread_attr_t attr;
-	params.sched_priority = sched_get_priority_max(SCHED_FIFO)/2;
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-   
 	set_pause_pressed_func(&null_func);
 	set_pause_released_func(&null_func);
 	set_mode_pressed_func(&null_func);
 	set_mode_released_func(&null_func);
+	button_reported[0] = get_pause_button();
+	button_reported[1] = get_mode_button();
 	
-	
-	pthread_create(&pause_pressed_thread, &attr,			 \
-				pause_pressed_handler, (void*) NULL);
-	pthread_create(&pause_released_thread, &attr,			 \
-				pause_released_handler, (void*) NULL);
-	pthread_create(&mode_pressed_thread, &attr,			 \
-					mode_pressed_handler, (void*) NULL);
-	pthread_create(&mode_released_thread, &attr,			 \
-					mode_released_handler, (void*) NULL);
-	
-	// apply medium priority to all threads
-	pthread_setschedparam(pause_pressed_thread, SCHED_FIFO, &params);
-	pthread_setschedparam(pause_released_thread, SCHED_FIFO, &params);
-	pthread_setschedparam(mode_pressed_thread, SCHED_FIFO, &params);
-	pthread_setschedparam(mode_released_thread, SCHED_FIFO, &params);
-	 
+	for(i=0;i<2;i++){
+		// a line exported through sysfs can't also be requested as a chardev
+		snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d", button_pin[i]);
+		if(access(buf, F_OK)==0) button_fd[i] = -1;
+		else button_fd[i] = gpio_line_event_open(button_pin[i], EDGE_BOTH);
+		button_chardev[i] = (button_fd[i] >= 0);
+		if(!button_chardev[i]){
+			// pin is exported through sysfs, use that instead
+			button_fd[i] = gpio_fd_open(button_pin[i]);
+			if(button_fd[i]<0) return -1;
+			// clear the initial interrupt
+			read(button_fd[i], buf, MAX_BUF);
+		}
+		button_timer[i] = reactor_add_timer(0, REACTOR_PRIORITY_NORMAL, \
+									button_settled_func, (void*)(intptr_t)i);
+		if(button_timer[i]<0) return -1;
+		if(reactor_add_fd(button_fd[i], button_chardev[i] ? POLLIN : POLLPRI,\
+						REACTOR_PRIORITY_NORMAL, button_edge_func, \
+						(void*)(intptr_t)i)<0) return -1;
+	}
 	return 0;
 }
 
 /*******************************************************************************
-*	void* pause_pressed_handler(void* ptr)
+*	int lazy_init_buttons()
+*
+*	Sets up the button handlers the first time they are needed. The flag is set
+*	first since initialize_button_handlers calls the set_*_func functions.
+*******************************************************************************/
+int lazy_init_buttons(){
+	if(cape_subsystems & CAPE_BUTTONS) return 0;
+	cape_subsystems |= CAPE_BUTTONS;
+	if(initialize_button_handlers()<0){
+		printf("ERROR: failed to set up button handlers\n");
+		close_button_handlers();
+		cape_subsystems &= ~CAPE_BUTTONS;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+*	int get_cape_subsystems()
+*
+*	returns the CAPE_* mask of subsystems set up so far
+*******************************************************************************/
+int get_cape_subsystems(){
+	return cape_subsystems;
+}
+
+/*******************************************************************************
+*	void close_button_handlers()
+*******************************************************************************/
+void close_button_handlers(){
+	int i;
+	for(i=0;i<2;i++){
+		if(button_timer[i]>=0) reactor_remove_fd(button_timer[i]);
+		button_timer[i] = -1;
+		if(button_fd[i]<0) continue;
+		reactor_remove_fd(button_fd[i]);
+		if(button_chardev[i]) close(button_fd[i]);
+		else gpio_fd_close(button_fd[i]);
+		button_fd[i] = -1;
+	}
+}
+
+/*******************************************************************************
+*	uint64_t edge_time_ns(uint64_t kernel_ns)
+*
+*	gpio line event timestamps are CLOCK_REALTIME on older kernels and 
+*	CLOCK_MONOTONIC on newer ones. Convert to CLOCK_MONOTONIC using whichever
+*	clock the timestamp is closer to.
+*******************************************************************************/
+uint64_t edge_time_ns(uint64_t kernel_ns){
+	struct timespec ts;
+	uint64_t mono, real, d_mono, d_real;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	real = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	d_mono = mono>kernel_ns ? mono-kernel_ns : kernel_ns-mono;
+	d_real = real>kernel_ns ? real-kernel_ns : kernel_ns-real;
+	if(d_mono <= d_real) return kernel_ns;
+	return kernel_ns - (real-mono);
+}
+
+/*******************************************************************************
+*	void button_edge_func(int fd, uint32_t events, void* arg)
 * 
-*	wait on falling edge of pause button
+*	Reactor callback for an edge on either button. Drains the queued edges,
+*	keeping the newest, and re-arms that button's debounce timer.
 *******************************************************************************/
-void* pause_pressed_handler(void* ptr){
-	struct pollfd fdset[1];
+void button_edge_func(int fd, uint32_t events, void* arg){
+	int i = (intptr_t)arg;
 	char buf[MAX_BUF];
-	int gpio_fd = gpio_fd_open(PAUSE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
-			// delay debouce
-			usleep(500); 
-			if(get_pause_button()==PRESSED){
-				usleep(500);
-				if(get_pause_button()==PRESSED){
-					usleep(500);
-					if(get_pause_button()==PRESSED){
-						pause_pressed_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
+	struct pollfd queued;
+	struct timespec ts;
+	uint64_t last_edge, event_ns, now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	last_edge = now;
+	if(button_chardev[i]){
+		while(gpio_line_event_read(fd, &event_ns)==0){
+			last_edge = edge_time_ns(event_ns);
+			// only read events that are already queued
+			queued.fd = fd;
+			queued.events = POLLIN;
+			if(poll(&queued, 1, 0)<=0) break;
 		}
 	}
-	gpio_fd_close(gpio_fd);
+	else{
+		lseek(fd, 0, SEEK_SET);
+		read(fd, buf, MAX_BUF);
+	}
+	// wake once the button has been quiet for the debounce period
+	if(last_edge+BUTTON_DEBOUNCE_NS > now){
+		reactor_set_timer(button_timer[i], \
+				(last_edge+BUTTON_DEBOUNCE_NS-now)/1000000000.0f, 0);
+	}
+	else reactor_set_timer(button_timer[i], 1e-6f, 0);
+	return;
+}
+
+/*******************************************************************************
+*	void button_settled_func(int fd, uint32_t events, void* arg)
+* 
+*	Reactor callback for the debounce timer. Calls the matching pressed or
+*	released function if the settled state differs from the last one reported.
+*******************************************************************************/
+void button_settled_func(int fd, uint32_t events, void* arg){
+	int i = (intptr_t)arg;
+	button_state_t now_state;
+	
+	now_state = (i==0) ? get_pause_button() : get_mode_button();
+	if(now_state == button_reported[i]) return;
+	button_reported[i] = now_state;
+	if(i==0){
+		if(now_state==PRESSED) pause_pressed_func();
+		else pause_released_func();
+	}
+	else{
+		if(now_state==PRESSED) mode_pressed_func();
+		else mode_released_func();
+	}
+	return;
+}
+
+/*******************************************************************************
+*	int start_reactor()
+*
+*	Creates the epoll set and starts the reactor thread with the
+*	RT_SERVICE_REACTOR thread config, SCHED_FIFO at half priority by default.
+*	Called by initialize_cape and by the first reactor_add_fd if needed.
+*	Does nothing if already running.
+*******************************************************************************/
+int start_reactor(){
+	struct epoll_event exit_ev;
+
+	pthread_mutex_lock(&reactor_mutex);
+	if(reactor_running){
+		pthread_mutex_unlock(&reactor_mutex);
+		return 0;
+	}
+	reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(reactor_epfd<0){
+		pthread_mutex_unlock(&reactor_mutex);
+		printf("ERROR: reactor epoll_create1 failed\n");
+		return -1;
+	}
+	// registered without a slot, just so epoll_wait returns on exit
+	exit_ev.events = EPOLLIN;
+	exit_ev.data.u64 = REACTOR_EXIT_SLOT;
+	if(get_exit_fd()>=0){
+		epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, get_exit_fd(), &exit_ev);
+	}
+	reactor_running = 1;
+	if(create_rt_thread(&reactor_thread, RT_SERVICE_REACTOR, \
+										reactor_handler, (void*) NULL)){
+		reactor_running = 0;
+		close(reactor_epfd);
+		reactor_epfd = -1;
+		pthread_mutex_unlock(&reactor_mutex);
+		printf("ERROR: failed to start reactor thread\n");
+		return -1;
+	}
+	pthread_mutex_unlock(&reactor_mutex);
 	return 0;
 }
 
 /*******************************************************************************
-* @ void* pause_released_handler(void* ptr) 
+*	int stop_reactor()
 *
-* wait on rising edge of pause button
+*	Stops the reactor thread, allowing up to 3 seconds for the callback in 
+*	progress to return. Registered fds are forgotten but not closed except for 
+*	timers made by reactor_add_timer.
 *******************************************************************************/
-void* pause_released_handler(void* ptr){
-	struct pollfd fdset[1];
-	char buf[MAX_BUF];
-	int gpio_fd = gpio_fd_open(PAUSE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
-			// delay debouce
-			usleep(500); 
-			if(get_pause_button()==RELEASED){
-				usleep(500);
-				if(get_pause_button()==RELEASED){
-					usleep(500);
-					if(get_pause_button()==RELEASED){
-						pause_released_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
-		}
+int stop_reactor(){
+	struct timespec thread_timeout;
+	int i, ret = 0;
+	
+	pthread_mutex_lock(&reactor_mutex);
+	if(!reactor_running){
+		pthread_mutex_unlock(&reactor_mutex);
+		return 0;
+	}
+	reactor_running = 0;
+	pthread_mutex_unlock(&reactor_mutex);
+	
+	clock_gettime(CLOCK_REALTIME, &thread_timeout);
+	thread_timeout.tv_sec += 3;
+	if(pthread_timedjoin_np(reactor_thread, NULL, &thread_timeout)==ETIMEDOUT){
+		printf("WARNING: reactor_thread exit timeout\n");
+		ret = -1;
+	}
+	
+	pthread_mutex_lock(&reactor_mutex);
+	for(i=0;i<REACTOR_MAX_FDS;i++){
+		if(!reactor_entries[i].active) continue;
+		if(reactor_entries[i].is_timer) close(reactor_entries[i].fd);
+		reactor_entries[i].active = 0;
+	}
+	close(reactor_epfd);
+	reactor_epfd = -1;
+	pthread_mutex_unlock(&reactor_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+*	int reactor_add_fd(int fd, uint32_t events, int priority, 
+*				void (*func)(int fd, uint32_t events, void* arg), void* arg)
+*
+*	Watches fd for the given poll events and calls func from the reactor 
+*	thread when they occur. Returns 0 on success, -1 on failure.
+*******************************************************************************/
+int reactor_add_fd(int fd, uint32_t events, int priority, \
+			void (*func)(int fd, uint32_t events, void* arg), void* arg){
+	struct epoll_event ev;
+	int i;
+	
+	if(fd<0 || func==NULL){
+		printf("ERROR: reactor_add_fd needs a valid fd and function\n");
+		return -1;
 	}
-	gpio_fd_close(gpio_fd);
+	if(start_reactor()<0) return -1;
+	
+	pthread_mutex_lock(&reactor_mutex);
+	for(i=0;i<REACTOR_MAX_FDS;i++){
+		if(!reactor_entries[i].active) break;
+	}
+	if(i==REACTOR_MAX_FDS){
+		pthread_mutex_unlock(&reactor_mutex);
+		printf("ERROR: reactor can only watch %d fds\n", REACTOR_MAX_FDS);
+		return -1;
+	}
+	reactor_entries[i].fd = fd;
+	reactor_entries[i].is_timer = 0;
+	reactor_entries[i].priority = priority;
+	reactor_entries[i].func = func;
+	reactor_entries[i].arg = arg;
+	reactor_entries[i].gen++;
+	ev.events = events;
+	ev.data.u64 = ((uint64_t)reactor_entries[i].gen<<32) | i;
+	if(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, fd, &ev)<0){
+		pthread_mutex_unlock(&reactor_mutex);
+		printf("ERROR: reactor epoll_ctl failed: %s\n", strerror(errno));
+		return -1;
+	}
+	reactor_entries[i].active = 1;
+	pthread_mutex_unlock(&reactor_mutex);
 	return 0;
 }
 
 /*******************************************************************************
-*	void* mode_pressed_handler(void* ptr) 
-*	wait on falling edge of mode button
+*	int reactor_remove_fd(int fd)
+*
+*	Stops watching fd. Timers made by reactor_add_timer are also closed. Safe 
+*	to call from inside a callback.
 *******************************************************************************/
-void* mode_pressed_handler(void* ptr){
-	struct pollfd fdset[1];
-	char buf[MAX_BUF];
-	int gpio_fd = gpio_fd_open(MODE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
-			// delay debouce
-			usleep(500); 
-			if(get_mode_button()==PRESSED){
-				usleep(500);
-				if(get_mode_button()==PRESSED){
-					usleep(500);
-					if(get_mode_button()==PRESSED){
-						mode_pressed_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
+int reactor_remove_fd(int fd){
+	int i;
+	
+	pthread_mutex_lock(&reactor_mutex);
+	for(i=0;i<REACTOR_MAX_FDS;i++){
+		if(reactor_entries[i].active && reactor_entries[i].fd==fd) break;
+	}
+	if(i==REACTOR_MAX_FDS){
+		pthread_mutex_unlock(&reactor_mutex);
+		return -1;
+	}
+	epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, fd, NULL);
+	reactor_entries[i].active = 0;
+	if(reactor_entries[i].is_timer) close(fd);
+	pthread_mutex_unlock(&reactor_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+*	int reactor_add_timer(float period_s, int priority, 
+*				void (*func)(int fd, uint32_t events, void* arg), void* arg)
+*
+*	Creates a timerfd served by the reactor and returns it, or -1 on error.
+*	A period of 0 leaves it disarmed for reactor_set_timer. The expiration 
+*	count is read before func is called.
+*******************************************************************************/
+int reactor_add_timer(float period_s, int priority, \
+			void (*func)(int fd, uint32_t events, void* arg), void* arg){
+	int tfd, i;
+	
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(tfd<0){
+		printf("ERROR: timerfd_create failed\n");
+		return -1;
+	}
+	if(reactor_add_fd(tfd, POLLIN, priority, func, arg)<0){
+		close(tfd);
+		return -1;
+	}
+	pthread_mutex_lock(&reactor_mutex);
+	for(i=0;i<REACTOR_MAX_FDS;i++){
+		if(reactor_entries[i].active && reactor_entries[i].fd==tfd){
+			reactor_entries[i].is_timer = 1;
 		}
 	}
-	gpio_fd_close(gpio_fd);
+	pthread_mutex_unlock(&reactor_mutex);
+	if(period_s>0 && reactor_set_timer(tfd, period_s, period_s)<0){
+		reactor_remove_fd(tfd);
+		return -1;
+	}
+	return tfd;
+}
+
+/*******************************************************************************
+*	int reactor_set_timer(int timer_fd, float delay_s, float period_s)
+*
+*	Arms a reactor timer to first fire after delay_s then every period_s, or 
+*	only once if period_s is 0. A delay of 0 disarms it.
+*******************************************************************************/
+int reactor_set_timer(int timer_fd, float delay_s, float period_s){
+	struct itimerspec its;
+	
+	if(delay_s<0 || period_s<0){
+		printf("ERROR: reactor timer times must be >=0\n");
+		return -1;
+	}
+	its.it_value.tv_sec = (time_t)delay_s;
+	its.it_value.tv_nsec = (long)((delay_s-its.it_value.tv_sec)*1e9f);
+	its.it_interval.tv_sec = (time_t)period_s;
+	its.it_interval.tv_nsec = (long)((period_s-its.it_interval.tv_sec)*1e9f);
+	// a tiny but nonzero delay must not round down to disarming the timer
+	if(delay_s>0 && its.it_value.tv_sec==0 && its.it_value.tv_nsec==0){
+		its.it_value.tv_nsec = 1;
+	}
+	if(timerfd_settime(timer_fd, 0, &its, NULL)<0){
+		printf("ERROR: timerfd_settime failed\n");
+		return -1;
+	}
 	return 0;
 }
 
 /*******************************************************************************
-*	void* mode_released_handler(void* ptr) 
-*	wait on rising edge of mode button
+*	void* reactor_handler(void* ptr)
+* 
+*	The reactor thread. Waits on every registered fd in one epoll_wait, then
+*	runs the callbacks for the events that are ready, highest priority first.
+*	The exit eventfd is in the set so it returns as soon as the state goes to
+*	EXITING, POLL_TIMEOUT is only the backstop for stop_reactor.
 *******************************************************************************/
-void* mode_released_handler(void* ptr){
-	struct pollfd fdset[1];
-	char buf[MAX_BUF];
-	int gpio_fd = gpio_fd_open(MODE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
-			// delay debouce
-			usleep(500); 
-			if(get_mode_button()==RELEASED){
-				usleep(500);
-				if(get_mode_button()==RELEASED){
-					usleep(500);
-					if(get_mode_button()==RELEASED){
-						mode_released_func(); 
-					}
-				}
+void* reactor_handler(void* ptr){
+	struct epoll_event events[REACTOR_MAX_EVENTS], tmp;
+	reactor_entry_t* e;
+	uint64_t expirations;
+	uint32_t slot, gen;
+	int i, j, n;
+	
+	while(reactor_running && get_state()!=EXITING){
+		n = epoll_wait(reactor_epfd, events, REACTOR_MAX_EVENTS, POLL_TIMEOUT);
+		if(n<=0) continue;
+		for(i=0;i<n;i++) if(events[i].data.u64==REACTOR_EXIT_SLOT) break;
+		if(i<n) continue;
+		
+		// insertion sort by priority, n is tiny
+		for(i=1;i<n;i++){
+			tmp = events[i];
+			slot = (uint32_t)tmp.data.u64;
+			for(j=i; j>0 && \
+				reactor_entries[(uint32_t)events[j-1].data.u64].priority < \
+				reactor_entries[slot].priority; j--){
+				events[j] = events[j-1];
 			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, MAX_BUF);
+			events[j] = tmp;
+		}
+		
+		for(i=0;i<n;i++){
+			slot = (uint32_t)events[i].data.u64;
+			gen = (uint32_t)(events[i].data.u64>>32);
+			e = &reactor_entries[slot];
+			// skip fds removed by an earlier callback in this batch
+			if(!e->active || e->gen!=gen) continue;
+			if(e->is_timer && read(e->fd, &expirations, 8)!=8) continue;
+			e->func(e->fd, events[i].events, e->arg);
 		}
 	}
-	gpio_fd_close(gpio_fd);
-	return 0;
+	return NULL;
 }
 
 /*******************************************************************************
 *	button function assignments
 *******************************************************************************/
 int set_pause_pressed_func(int (*func)(void)){
+	if(lazy_init_buttons()<0) return -1;
 	pause_pressed_func = func;
 	return 0;
 }
 int set_pause_released_func(int (*func)(void)){
+	if(lazy_init_buttons()<0) return -1;
 	pause_released_func = func;
 	return 0;
 }
 int set_mode_pressed_func(int (*func)(void)){
+	if(lazy_init_buttons()<0) return -1;
 	mode_pressed_func = func;
 	return 0;
 }
 int set_mode_released_func(int (*func)(void)){
+	if(lazy_init_buttons()<0) return -1;
 	mode_released_func = func;
 	return 0;
 }
@@ -630,7 +1276,12 @@ button_state_t get_mode_button(){
 * returns 0 on success
 *******************************************************************************/
 int enable_motors(){
+	cape_subsystems |= CAPE_MOTORS;
 	set_motor_free_spin_all();
+	if(is_sim_mode()){
+		set_sim_motors_enabled(1);
+		return 0;
+	}
 	return mmap_gpio_write(MOT_STBY, HIGH);
 }
 
@@ -642,9 +1293,32 @@ int enable_motors(){
 *******************************************************************************/
 int disable_motors(){
 	set_motor_free_spin_all();
+	if(is_sim_mode()){
+		set_sim_motors_enabled(0);
+		return 0;
+	}
 	return mmap_gpio_write(MOT_STBY, LOW);
 }
 
+/*******************************************************************************
+* void init_motor_pins()
+*
+* resolves the board specific direction pins into motor_pins
+*******************************************************************************/
+void init_motor_pins(){
+	const motor_pins_t pins[MOTOR_CHANNELS] = {
+		{MDIR1A, MDIR1B, 1, 'A'},
+		{MDIR2B, MDIR2A, 1, 'B'},
+		{MDIR3B, MDIR3A, 2, 'A'},
+		{MDIR4A, MDIR4B, 2, 'B'}
+	};
+	memcpy(motor_pins, pins, sizeof(pins));
+	if(get_bb_model()==BB_BLUE){
+		motor_pins[0].fwd = MDIR1A_BLUE;
+		motor_pins[1].fwd = MDIR2B_BLUE;
+	}
+}
+
 /*******************************************************************************
 * int set_motor(int motor, float duty)
 * 
@@ -652,7 +1326,14 @@ int disable_motors(){
 * motor is from 1 to 4, duty is from -1.0 to +1.0
 *******************************************************************************/
 int set_motor(int motor, float duty){
-	uint8_t a,b;
+	motor_pins_t* m;
+	cape_subsystems |= CAPE_MOTORS;
+
+	if(motor<1 || motor>MOTOR_CHANNELS){
+		printf("enter a motor value between 1 and 4\n");
+		return -1;
+	}
+	m = &motor_pins[motor-1];
 
 	//check that the duty cycle is within +-1
 	if (duty>1.0){
@@ -661,43 +1342,33 @@ int set_motor(int motor, float duty){
 	else if(duty<-1.0){
 		duty=-1.0;
 	}
+	if((get_logger_sources()|get_telemetry_sources())&LOG_SOURCE_MOTORS){
+		float duties[MOTOR_CHANNELS] = {0, 0, 0, 0};
+		duties[motor-1] = duty;
+		if(get_logger_sources()&LOG_SOURCE_MOTORS){
+			log_motor_duties(duties, 1<<(motor-1));
+		}
+		if(get_telemetry_sources()&LOG_SOURCE_MOTORS){
+			telemetry_motor_duties(duties, 1<<(motor-1));
+		}
+	}
+	if(is_sim_mode()){
+		set_sim_motor(motor, duty, 0);
+		trace_point(TRACE_ACTUATOR);
+		return 0;
+	}
 	//switch the direction pins to H-bridge
 	if (duty>=0){
-	 	a=HIGH;
-		b=LOW;
+		mmap_gpio_write(m->fwd, HIGH);
+		mmap_gpio_write(m->rev, LOW);
 	}
 	else{
-		a=LOW;
-		b=HIGH;
+		mmap_gpio_write(m->fwd, LOW);
+		mmap_gpio_write(m->rev, HIGH);
 		duty=-duty;
 	}
-	
-	// set gpio direction outputs & duty
-	switch(motor){
-		case 1:
-			mmap_gpio_write(mdir1a, a);
-			mmap_gpio_write(MDIR1B, b);
-			mmap_set_pwm_duty(1, 'A', duty);
-			break;
-		case 2:
-			mmap_gpio_write(MDIR2A, b);
-			mmap_gpio_write(mdir2b, a);
-			mmap_set_pwm_duty(1, 'B', duty);
-			break;
-		case 3:
-			mmap_gpio_write(MDIR3A, b);
-			mmap_gpio_write(MDIR3B, a);
-			mmap_set_pwm_duty(2, 'A', duty);
-			break;
-		case 4:
-			mmap_gpio_write(MDIR4A, a);
-			mmap_gpio_write(MDIR4B, b);
-			mmap_set_pwm_duty(2, 'B', duty);
-			break;
-		default:
-			printf("enter a motor value between 1 and 4\n");
-			return -1;
-	}
+	mmap_set_pwm_duty(m->pwm_ss, m->pwm_ch, duty);
+	trace_point(TRACE_ACTUATOR);
 	return 0;
 }
 
@@ -708,8 +1379,61 @@ int set_motor(int motor, float duty){
 *******************************************************************************/
 int set_motor_all(float duty){
 	int i;
-	for(i=1;i<=MOTOR_CHANNELS; i++){
-		set_motor(i, duty);
+	float duties[MOTOR_CHANNELS];
+	for(i=0;i<MOTOR_CHANNELS; i++) duties[i] = duty;
+	return set_motors(duties);
+}
+
+/*******************************************************************************
+* int set_motors(const float duty[4])
+* 
+* sets all motors at once. Direction pins for every motor are collected into
+* one set and one clear mask per gpio bank, and each PWM subsystem's compare
+* registers are written together, so the hardware is touched as few times
+* as possible.
+*******************************************************************************/
+int set_motors(const float duty[MOTOR_CHANNELS]){
+	uint32_t set[4] = {0,0,0,0};
+	uint32_t clear[4] = {0,0,0,0};
+	float mag[MOTOR_CHANNELS];
+	int i, hi, lo;
+	cape_subsystems |= CAPE_MOTORS;
+
+	for(i=0;i<MOTOR_CHANNELS;i++){
+		//check that the duty cycle is within +-1
+		mag[i] = duty[i];
+		if(mag[i]>1.0) mag[i] = 1.0;
+		else if(mag[i]<-1.0) mag[i] = -1.0;
+		// pick which direction pin goes high
+		if(mag[i]>=0){
+			hi = motor_pins[i].fwd;
+			lo = motor_pins[i].rev;
+		}
+		else{
+			hi = motor_pins[i].rev;
+			lo = motor_pins[i].fwd;
+		}
+		if(mag[i]<0) mag[i] = -mag[i];
+		set[hi/32] |= 1u<<(hi%32);
+		clear[lo/32] |= 1u<<(lo%32);
+	}
+
+	if(is_sim_mode()){
+		for(i=0;i<MOTOR_CHANNELS;i++){
+			set_sim_motor(i+1, duty[i]<0 ? -mag[i] : mag[i], 0);
+		}
+	}
+	else{
+		if(mmap_gpio_write_banks(set, clear)) return -1;
+		if(mmap_set_pwm_duty_ab(1, mag[0], mag[1])) return -1;
+		if(mmap_set_pwm_duty_ab(2, mag[2], mag[3])) return -1;
+	}
+	trace_point(TRACE_ACTUATOR);
+	if(get_logger_sources()&LOG_SOURCE_MOTORS){
+		log_motor_duties(duty, (1<<MOTOR_CHANNELS)-1);
+	}
+	if(get_telemetry_sources()&LOG_SOURCE_MOTORS){
+		telemetry_motor_duties(duty, (1<<MOTOR_CHANNELS)-1);
 	}
 	return 0;
 }
@@ -721,33 +1445,19 @@ int set_motor_all(float duty){
 * motor spin freely as if it wasn't connected to anything.
 *******************************************************************************/
 int set_motor_free_spin(int motor){
-	
-	// set gpio direction outputs & duty
-	switch(motor){
-		case 1:
-			mmap_gpio_write(mdir1a, 0);
-			mmap_gpio_write(MDIR1B, 0);
-			mmap_set_pwm_duty(1, 'A', 0.0);
-			break;
-		case 2:
-			mmap_gpio_write(MDIR2A, 0);
-			mmap_gpio_write(mdir2b, 0);
-			mmap_set_pwm_duty(1, 'B', 0.0);
-			break;
-		case 3:
-			mmap_gpio_write(MDIR3A, 0);
-			mmap_gpio_write(MDIR3B, 0);
-			mmap_set_pwm_duty(2, 'A', 0.0);
-			break;
-		case 4:
-			mmap_gpio_write(MDIR4A, 0);
-			mmap_gpio_write(MDIR4B, 0);
-			mmap_set_pwm_duty(2, 'B', 0.0);
-			break;
-		default:
-			printf("enter a motor value between 1 and 4\n");
-			return -1;
+	cape_subsystems |= CAPE_MOTORS;
+	if(motor<1 || motor>MOTOR_CHANNELS){
+		printf("enter a motor value between 1 and 4\n");
+		return -1;
 	}
+	if(is_sim_mode()){
+		set_sim_motor(motor, 0.0, 0);
+		return 0;
+	}
+	mmap_gpio_write(motor_pins[motor-1].fwd, 0);
+	mmap_gpio_write(motor_pins[motor-1].rev, 0);
+	mmap_set_pwm_duty(motor_pins[motor-1].pwm_ss, motor_pins[motor-1].pwm_ch, \
+																		0.0);
 	return 0;
 }
 
@@ -769,33 +1479,19 @@ int set_motor_free_spin_all(){
 * makes the motor fight against its own back EMF turning it into a brake.
 *******************************************************************************/
 int set_motor_brake(int motor){
-
-	// set gpio direction outputs & duty
-	switch(motor){
-		case 1:
-			mmap_gpio_write(mdir1a, 1);
-			mmap_gpio_write(MDIR1B, 1);
-			mmap_set_pwm_duty(1, 'A', 0.0);
-			break;
-		case 2:
-			mmap_gpio_write(MDIR2A, 1);
-			mmap_gpio_write(mdir2b, 1);
-			mmap_set_pwm_duty(1, 'B', 0.0);
-			break;
-		case 3:
-			mmap_gpio_write(MDIR3A, 1);
-			mmap_gpio_write(MDIR3B, 1);
-			mmap_set_pwm_duty(2, 'A', 0.0);
-			break;
-		case 4:
-			mmap_gpio_write(MDIR4A, 1);
-			mmap_gpio_write(MDIR4B, 1);
-			mmap_set_pwm_duty(2, 'B', 0.0);
-			break;
-		default:
-			printf("enter a motor value between 1 and 4\n");
-			return -1;
+	cape_subsystems |= CAPE_MOTORS;
+	if(motor<1 || motor>MOTOR_CHANNELS){
+		printf("enter a motor value between 1 and 4\n");
+		return -1;
+	}
+	if(is_sim_mode()){
+		set_sim_motor(motor, 0.0, 1);
+		return 0;
 	}
+	mmap_gpio_write(motor_pins[motor-1].fwd, 1);
+	mmap_gpio_write(motor_pins[motor-1].rev, 1);
+	mmap_set_pwm_duty(motor_pins[motor-1].pwm_ss, motor_pins[motor-1].pwm_ch, \
+																		0.0);
 	return 0;
 }
 
@@ -818,10 +1514,13 @@ int set_motor_brake_all(){
 * returns the encoder counter position
 *******************************************************************************/
 int get_encoder_pos(int ch){
+	int pos[4];
 	if(ch<1 || ch>4){
 		printf("Encoder Channel must be from 1 to 4\n");
 		return -1;
 	}
+	if(get_replay_encoder_pos(pos)==0) return pos[ch-1];
+	if(get_sim_encoder_pos(pos)==0) return pos[ch-1];
 	// 4th channel is counted by the PRU not eQEP
 	if(ch==4) return get_pru_encoder_pos();
 	
@@ -830,6 +1529,65 @@ int get_encoder_pos(int ch){
 }
 
 
+/*******************************************************************************
+* int get_encoder_pos_all(int pos[4], uint64_t* timestamp_micros)
+* 
+* samples all 4 counters back to back and optionally records when. 
+* timestamp_micros may be NULL.
+*******************************************************************************/
+int get_encoder_pos_all(int pos[4], uint64_t* timestamp_micros){
+	if(get_replay_encoder_pos(pos)==0 || get_sim_encoder_pos(pos)==0){
+		if(timestamp_micros != NULL) *timestamp_micros = micros_since_boot();
+		return 0;
+	}
+	// eQEP checks are all done before the first counter is read
+	if(read_eqep_all(pos)){
+		printf("ERROR: failed to read eQEP encoders\n");
+		return -1;
+	}
+	// 4th channel is counted by the PRU not eQEP
+	pos[3] = get_pru_encoder_pos();
+	if(timestamp_micros != NULL) *timestamp_micros = micros_since_boot();
+	return 0;
+}
+
+/*******************************************************************************
+* int get_encoder_state_all(encoder_state_t state[4])
+* 
+* reads position, velocity, and the time of the last edge for all 4 channels
+*******************************************************************************/
+int get_encoder_state_all(encoder_state_t state[4]){
+	int i, ret;
+	int pos[4];
+	float vel[4];
+	uint64_t age_ns, now;
+	
+	// simulated counters move every step, so the last edge is always now
+	if(get_sim_encoder_pos(pos)==0 && get_sim_encoder_velocity(vel)==0){
+		now = micros_since_boot();
+		for(i=0;i<4;i++){
+			state[i].pos = pos[i];
+			state[i].velocity = vel[i];
+			state[i].edge_micros = now;
+		}
+		return 0;
+	}
+	for(i=0;i<4;i++){
+		// 4th channel is counted by the PRU not eQEP
+		if(i==3) ret = get_pru_encoder_state(&state[i].pos, \
+								&state[i].velocity, &age_ns);
+		else ret = read_eqep_state(i, &state[i].pos, &state[i].velocity, \
+								&age_ns);
+		if(ret){
+			printf("ERROR: failed to read encoder channel %d\n", i+1);
+			return -1;
+		}
+		now = micros_since_boot();
+		state[i].edge_micros = now - age_ns/1000;
+	}
+	return 0;
+}
+
 /*******************************************************************************
 * int set_encoder_pos(int ch, int val)
 * 
@@ -840,6 +1598,7 @@ int set_encoder_pos(int ch, int val){
 		printf("Encoder Channel must be from 1 to 4\n");
 		return -1;
 	}
+	if(is_sim_mode()) return set_sim_encoder_pos(ch, val);
 	// 4th channel is counted by the PRU not eQEP
 	if(ch==4) return set_pru_encoder_pos(val);
 
@@ -883,6 +1642,10 @@ int get_adc_raw(int ch){
 		printf("analog pin must be in 0-6\n");
 		return -1;
 	}
+	if(is_replay_mode() && get_replay_adc_raw(ch)>=0){
+		return get_replay_adc_raw(ch);
+	}
+	if(is_sim_mode()) return get_sim_adc_raw(ch);
 	return mmap_adc_read_raw((uint8_t)ch);
 }
 
@@ -896,10 +1659,86 @@ float get_adc_volt(int ch){
 		printf("analog pin must be in 0-6\n");
 		return -1;
 	}
-	int raw_adc = mmap_adc_read_raw((uint8_t)ch);
+	int raw_adc = get_adc_raw(ch);
 	return raw_adc * 1.8 / 4095.0;
 }
 
+/*******************************************************************************
+* int get_adc_volt_all(float v[8])
+* 
+* reads all 8 adc channels in one scan and converts them to voltages
+*******************************************************************************/
+int get_adc_volt_all(float v[8]){
+	int i;
+	int raw[8];
+	if(is_sim_mode()){
+		for(i=0;i<8;i++) raw[i] = get_sim_adc_raw(i);
+	}
+	else if(mmap_adc_read_raw_all(raw)){
+		printf("ERROR: failed to read adc\n");
+		return -1;
+	}
+	for(i=0;i<8;i++) v[i] = raw[i] * 1.8 / 4095.0;
+	return 0;
+}
+
+/*******************************************************************************
+* int start_adc_continuous(int averaging, int open_delay, int sample_delay)
+* 
+* puts the ADC in continuous mode sampling all channels in hardware
+*******************************************************************************/
+int start_adc_continuous(int averaging, int open_delay, int sample_delay){
+	if(is_sim_mode()){
+		printf("ERROR: continuous adc sampling isn't simulated\n");
+		return -1;
+	}
+	return mmap_adc_start_continuous(averaging, open_delay, sample_delay);
+}
+
+/*******************************************************************************
+* int stop_adc_continuous()
+* 
+* returns the ADC to one-shot mode
+*******************************************************************************/
+int stop_adc_continuous(){
+	return mmap_adc_stop_continuous();
+}
+
+/*******************************************************************************
+* int drain_adc_fifo()
+* 
+* moves all samples in the hardware FIFO into the per-channel buffers
+*******************************************************************************/
+int drain_adc_fifo(){
+	int n = mmap_adc_drain();
+	if(n<0) printf("ERROR: ADC not in continuous mode\n");
+	return n;
+}
+
+/*******************************************************************************
+* int read_adc_buffer_volt(int ch, float* v, int max)
+* 
+* pops up to max of the oldest buffered samples for a channel as voltages
+*******************************************************************************/
+int read_adc_buffer_volt(int ch, float* v, int max){
+	int i, n;
+	uint16_t raw[ADC_READ_CHUNK];
+	int total = 0;
+
+	if(ch<0 || ch>6){
+		printf("analog pin must be in 0-6\n");
+		return -1;
+	}
+	do{
+		n = max-total;
+		if(n>ADC_READ_CHUNK) n = ADC_READ_CHUNK;
+		n = mmap_adc_pop(ch, raw, n);
+		for(i=0;i<n;i++) v[total+i] = raw[i] * 1.8 / 4095.0;
+		total += n;
+	}while(n==ADC_READ_CHUNK);
+	return total;
+}
+
 
 
 
@@ -932,13 +1771,74 @@ int disable_servo_power_rail(){
 * all threads should watch for get_state()==EXITING and shut down cleanly
 *******************************************************************************/
 void shutdown_signal_handler(int signo){
-	if (signo == SIGINT){
-		set_state(EXITING);
-		printf("\nreceived SIGINT Ctrl-C\n");
- 	}else if (signo == SIGTERM){
+	const char sigint_msg[] = "\nreceived SIGINT Ctrl-C\n";
+	const char sigterm_msg[] = "\nreceived SIGTERM\n";
+	uint64_t one = 1;
+	int saved_errno = errno;
+
+	// the signal may land while this thread holds state_mutex, so only do
+	// async-signal-safe things here and let state_signal_handler announce it
+	if(signo!=SIGINT && signo!=SIGTERM) return;
+	state = EXITING;
+	if(state_signal_fd>=0) write(state_signal_fd, &one, 8);
+	if(signo==SIGINT) write(STDOUT_FILENO, sigint_msg, sizeof(sigint_msg)-1);
+	else write(STDOUT_FILENO, sigterm_msg, sizeof(sigterm_msg)-1);
+	errno = saved_errno;
+}
+
+/*******************************************************************************
+* int start_state_signal_thread()
+*
+* Creates the eventfd the signal handler writes and the thread that waits on
+* it. Only ever started once, later calls just make sure it's running.
+*******************************************************************************/
+int start_state_signal_thread(){
+	if(state_signal_running) return 0;
+	if(state_signal_fd<0){
+		state_signal_fd = eventfd(0, EFD_CLOEXEC);
+		if(state_signal_fd<0) return -1;
+	}
+	state_signal_running = 1;
+	if(create_rt_thread(&state_signal_thread, RT_SERVICE_REACTOR, \
+										state_signal_handler, NULL)){
+		state_signal_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* void stop_state_signal_thread()
+*
+* The eventfd stays open so a late signal can't write to a reused fd.
+*******************************************************************************/
+void stop_state_signal_thread(){
+	uint64_t one = 1;
+	if(!state_signal_running) return;
+	state_signal_running = 0;
+	write(state_signal_fd, &one, 8);
+	pthread_join(state_signal_thread, NULL);
+}
+
+/*******************************************************************************
+* void* state_signal_handler(void* ptr)
+*
+* Runs set_state for the signal handler in normal thread context, waking the
+* state waiters and the exit fd. The handler already stored EXITING but
+* announced_state hasn't moved, so set_state still sees it as a change. It's
+* set again in case a set_state racing the handler overwrote it.
+*******************************************************************************/
+void* state_signal_handler(void* ptr){
+	uint64_t val;
+	while(1){
+		if(read(state_signal_fd, &val, 8)<0){
+			if(errno==EINTR) continue;
+			break;
+		}
+		if(!state_signal_running) break;
 		set_state(EXITING);
-		printf("\nreceived SIGTERM\n");
- 	}
+	}
+	return NULL;
 }
 
 
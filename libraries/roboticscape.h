@@ -13,6 +13,8 @@
 #define ROBOTICS_CAPE
 
 #include <stdint.h> // for uint8_t types etc
+#include <pthread.h> // for pthread_t in create_rt_thread
+#include <stdio.h> // for FILE in log_reader_t
 typedef struct timespec	timespec;
 typedef struct timeval timeval;
 
@@ -45,10 +47,33 @@ typedef struct timeval timeval;
 *  0 : No existing program is running
 *  1 : An existing program was running but it shut down cleanly.
 *
+* @ int initialize_cape_subsystems(int mask)
+* @ int get_cape_subsystems()
+*
+* initialize_cape sets up every subsystem. Programs that only need a few, such
+* as a script reading a voltage, can pass a mask of CAPE_* values instead and
+* skip the rest of the startup cost, including the reactor thread if
+* CAPE_BUTTONS is left out. Everything not in the mask is still set up the 
+* first time it is used, the buttons on the first set_*_func, since the 
+* drivers themselves are configured at boot by robot_startup_routine. 
+* get_cape_subsystems returns the mask of what has been set up so far, and 
+* cleanup_cape only resets the outputs of those.
+*
 * All example programs use these functions. See the bare_minimum example 
 * for a skeleton outline.
 *******************************************************************************/
+#define CAPE_PINMUX		(1<<0)	// default pinmux for every cape pin
+#define CAPE_GPIO		(1<<1)	// export and map gpio, LEDs, direction pins
+#define CAPE_ADC		(1<<2)
+#define CAPE_ENCODERS	(1<<3)	// eQEP channels 1-3
+#define CAPE_MOTORS		(1<<4)	// PWM subsystems at PWM_FREQ
+#define CAPE_BUTTONS	(1<<5)	// reactor thread and button handlers
+#define CAPE_PRU		(1<<6)	// servos and encoder channel 4
+#define CAPE_ALL		0x7F
+
 int initialize_cape(); 	// call at the beginning of main()
+int initialize_cape_subsystems(int mask);
+int get_cape_subsystems();
 int cleanup_cape();		// call at the end of main()
 int kill_robot();		// not usually necessary, use kill_robot example instead
 
@@ -67,6 +92,19 @@ int kill_robot();		// not usually necessary, use kill_robot example instead
 * cleanly when prompted by another thread. You may also call print_state()
 * to print the textual name of the state to the screen.
 *
+* @ state_t wait_for_state_change(state_t from, int timeout_ms)
+*
+* Sleeps until another thread sets a state other than from, rather than
+* polling get_state() in a usleep loop. Returns the current state, which is
+* still from if timeout_ms ran out first. A timeout of 0 waits forever.
+*
+* @ int get_exit_fd()
+*
+* Returns an eventfd that polls readable from the moment the state becomes
+* EXITING. Background threads put it in the poll() or epoll set they already
+* block in so they return immediately on shutdown instead of at their next
+* timeout. Only poll it, never read it.
+*
 * All example programs use these functions. See the bare_minimum example 
 * for a skeleton outline.
 *******************************************************************************/
@@ -80,6 +118,8 @@ typedef enum state_t {
 state_t get_state();
 int set_state(state_t new_state);
 int print_state();
+state_t wait_for_state_change(state_t from, int timeout_ms);
+int get_exit_fd();
 
 
 /*******************************************************************************
@@ -112,6 +152,25 @@ int print_state();
 * Flash an LED at a set frequency for a finite period of time.
 * This is a blocking call and only returns after flashing.
 *
+* @ int start_led_blink(led_t led, float hz, float period)
+* @ int start_led_heartbeat(led_t led, float period)
+* @ int start_led_pattern(led_t led, const float* times, int steps, 
+*															int repeats)
+* 
+* Non-blocking patterns stepped by a reactor timer, these return immediately.
+* start_led_blink is blink_led in the background, a period of 0 blinks
+* forever. The heartbeat is a double flash every period seconds. A custom
+* pattern is up to 16 durations in seconds alternating on and off starting
+* with on, run repeats times or forever if repeats is 0.
+* Starting a pattern replaces the one already on that LED.
+*
+* @ int stop_led_pattern(led_t led)
+* @ int led_pattern_running(led_t led)
+*
+* Ends a pattern and turns the LED off. led_pattern_running returns 0 once a
+* finite pattern has finished. Calls to set_led while a pattern is running are
+* overwritten at its next step.
+*
 * See the blink example for sample use case of all of these functions.
 *******************************************************************************/
 #define ON 	1
@@ -123,6 +182,11 @@ typedef enum led_t {
 int set_led(led_t led, int state);
 int get_led_state(led_t led);
 int blink_led(led_t led, float hz, float period);
+int start_led_blink(led_t led, float hz, float period);
+int start_led_heartbeat(led_t led, float period);
+int start_led_pattern(led_t led, const float* times, int steps, int repeats);
+int stop_led_pattern(led_t led);
+int led_pattern_running(led_t led);
 
 
 /*******************************************************************************
@@ -143,8 +207,10 @@ int blink_led(led_t led, float hz, float period);
 * @ int set_mode_pressed_func(int (*func)(void))
 * @ int set_mode_released_func(int (*func)(void))
 *
-* initialize_cape() sets up interrupt handlers that run in the background to
-* handle changes in button state in a way that uses minimal resources. The 
+* initialize_cape() registers edges of both buttons with the reactor thread
+* described below which calls these functions in a way that uses minimal 
+* resources. A button must hold its new state for 1.5ms before its function
+* is called, which filters out contact bounce without sleeping. The 
 * user can assign which function should be called when either button is pressed
 * or released. Functions can also be assigned under both conditions.
 * for example, a timer could be started when a button is pressed and stopped
@@ -172,6 +238,52 @@ button_state_t get_pause_button();
 button_state_t get_mode_button();
 
 
+/*******************************************************************************
+* REACTOR
+*
+* Background services share one thread instead of each blocking on their own.
+* It waits on every registered file descriptor in a single epoll_wait and runs
+* the callbacks whose fds are ready, highest priority first. This is the one 
+* place the library sets a real-time priority for background I/O. The buttons
+* and GPS run on it. The IMU interrupt keeps its own higher priority thread.
+* Callbacks run on the reactor thread so they must not block, anything slow 
+* delays every other service.
+*
+* @ int start_reactor()
+* @ int stop_reactor()
+* Started by initialize_cape, or by the first reactor_add_fd, and stopped by 
+* cleanup_cape. The user normally doesn't need to call these.
+*
+* @ int reactor_add_fd(int fd, uint32_t events, int priority, 
+*				void (*func)(int fd, uint32_t events, void* arg), void* arg)
+* Calls func(fd, revents, arg) whenever any of the poll events (POLLIN, 
+* POLLPRI...) occur on fd. Level triggered, so func should consume what woke it.
+*
+* @ int reactor_remove_fd(int fd)
+* Stops watching fd. Safe to call from a callback.
+*
+* @ int reactor_add_timer(float period_s, int priority, 
+*				void (*func)(int fd, uint32_t events, void* arg), void* arg)
+* @ int reactor_set_timer(int timer_fd, float delay_s, float period_s)
+* Creates a timer served by the reactor and returns its fd, or -1 on error.
+* period_s of 0 creates it disarmed. reactor_set_timer re-arms it to fire after
+* delay_s and then every period_s, once if period_s is 0, or disarms it if 
+* delay_s is 0. reactor_remove_fd deletes a timer.
+*******************************************************************************/
+#define REACTOR_PRIORITY_LOW		0
+#define REACTOR_PRIORITY_NORMAL		1
+#define REACTOR_PRIORITY_HIGH		2
+
+int start_reactor();
+int stop_reactor();
+int reactor_add_fd(int fd, uint32_t events, int priority, \
+			void (*func)(int fd, uint32_t events, void* arg), void* arg);
+int reactor_remove_fd(int fd);
+int reactor_add_timer(float period_s, int priority, \
+			void (*func)(int fd, uint32_t events, void* arg), void* arg);
+int reactor_set_timer(int timer_fd, float delay_s, float period_s);
+
+
 /******************************************************************************
 * DC MOTOR CONTROL
 *
@@ -193,6 +305,14 @@ button_state_t get_mode_button();
 * corresponding to full power reverse to full power forward.
 * set_motor_all() applies the same duty cycle to all 4 motor channels.
 *
+* @ int set_motors(const float duty[4])
+*
+* Sets all 4 motors at once from an array of duty cycles. All direction bits
+* and compare values are worked out first, then each GPIO bank and each PWM
+* compare register is written once. This keeps the window where a motor's 
+* direction and duty disagree as short as possible and is much faster than 
+* calling set_motor 4 times.
+*
 * @ int set_motor_free_spin(int motor)
 * @ int set motor_free_spin_all()
 *
@@ -211,6 +331,7 @@ int enable_motors();
 int disable_motors();
 int set_motor(int motor, float duty);
 int set_motor_all(float duty);
+int set_motors(const float duty[4]);
 int set_motor_free_spin(int motor);
 int set_motor_free_spin_all();
 int set_motor_brake(int motor);
@@ -238,10 +359,46 @@ int set_motor_brake_all();
 * reset to 0 when initialize_cape() is called. However, the user can reset
 * the counter to zero or any other signed 32 bit value with set_encoder_pos().
 *
+* @ int get_encoder_pos_all(int pos[4], uint64_t* timestamp_micros)
+*
+* Reading channels one at a time with get_encoder_pos samples each at a 
+* different instant which skews odometry. get_encoder_pos_all samples all 4
+* counters back to back and writes the micros_since_boot() time of the
+* sample to timestamp_micros unless it is NULL, the same clock as the IMU
+* sample timestamps.
+*
+* @ int get_encoder_state_all(encoder_state_t state[4])
+*
+* Differentiating positions in code is noisy at low speed where only a few
+* counts arrive per loop. Instead this measures the time between edges in 
+* hardware, with the eQEP capture unit over every 4 counts on channels 1-3 
+* and the PRU cycle counter between single counts on channel 4, and returns
+* velocity in counts per second along with position and the time of the last
+* edge for every channel in one call. If the encoder stops, velocity decays
+* toward 0 as the time since the last edge grows and reads 0 once the eQEP
+* capture timer overflows after 84ms or the direction reverses.
+*
+* @ int set_pru_encoder_threshold(int count)
+* @ int disable_pru_encoder_threshold()
+*
+* Has the PRU raise PRU_EVENT_ENCODER_THRESHOLD once when channel 4 next
+* reaches count, so homing routines can sleep in wait_for_pru_event until the
+* axis gets there instead of reading the position in a loop.
+*
 * See the test_encoders example for sample use case.
 ******************************************************************************/
+typedef struct encoder_state_t{
+	int pos;				// position in counts
+	float velocity;			// counts per second from time between edges
+	uint64_t edge_micros;	// micros_since_boot() of the last edge
+} encoder_state_t;
+
 int get_encoder_pos(int ch);
 int set_encoder_pos(int ch, int value);
+int get_encoder_pos_all(int pos[4], uint64_t* timestamp_micros);
+int get_encoder_state_all(encoder_state_t state[4]);
+int set_pru_encoder_threshold(int count);
+int disable_pru_encoder_threshold();
  
  
 /******************************************************************************
@@ -274,12 +431,81 @@ int set_encoder_pos(int ch, int value);
 * 12-bit ADC. get_adc_volt(int ch) additionally converts this raw value to 
 * a voltage. ch must be from 0 to 6.
 *
+* @ int get_adc_volt_all(float v[8])
+*
+* When several channels are needed each loop, get_adc_volt_all starts all 8
+* conversions at once and fills v with every channel's voltage from a single
+* scan. The conversions still run one after another so it takes about 8 times
+* as long as one call to get_adc_volt, but saves the per call setup and gives
+* channels sampled within one scan of each other. v[ch] matches ch for 
+* get_adc_volt, and v[7] is the internal AIN7 channel.
+*
+* @ int start_adc_continuous(int averaging, int open_delay, int sample_delay)
+* @ int stop_adc_continuous()
+* @ int drain_adc_fifo()
+* @ int read_adc_buffer_volt(int ch, float* v, int max)
+*
+* By default each reading starts a single conversion and waits for it. For
+* high rate sampling such as motor current sensing, start_adc_continuous puts
+* the ADC in continuous mode where the hardware cycles through all channels on
+* its own. averaging is the number of hardware samples averaged per result
+* (1,2,4,8, or 16), open_delay and sample_delay are in ADC clock cycles 
+* (max 262143 and 255) and together set the sample rate. drain_adc_fifo moves
+* whatever results are waiting in the 64-entry hardware FIFO into a 256 sample
+* buffer per channel without blocking and returns how many it moved. Call it
+* often enough that the FIFO never fills. read_adc_buffer_volt then pops up to
+* max of the oldest buffered samples for a channel as voltages and returns how
+* many it wrote to v. While in continuous mode get_adc_raw, get_adc_volt, and
+* the voltage functions above return the newest sample without waiting.
+*
 * See the test_adc example for sample use case.
 ******************************************************************************/
 float get_battery_voltage();
 float get_dc_jack_voltage();
 int   get_adc_raw(int ch);
 float get_adc_volt(int ch);
+int   get_adc_volt_all(float v[8]);
+int   start_adc_continuous(int averaging, int open_delay, int sample_delay);
+int   stop_adc_continuous();
+int   drain_adc_fifo();
+int   read_adc_buffer_volt(int ch, float* v, int max);
+
+
+/******************************************************************************
+* BATTERY STATUS
+*
+* The battery_monitor service publishes what it measures into a small shared
+* memory segment, so programs that want the battery state can read it without
+* running ADC conversions and filters of their own.
+*
+* @ int read_battery_status(battery_status_t* status)
+*
+* Copies the newest status without blocking. Returns 0 on success or -1 if
+* battery_monitor hasn't published anything since boot. The monitor samples
+* every second while the voltage is steady and faster on transients, so
+* compare timestamp_micros with micros_since_boot() and treat a status more
+* than a few seconds old as stale.
+*
+* @ int publish_battery_status(battery_status_t* status)
+* @ int close_battery_status()
+*
+* publish_battery_status is used by battery_monitor and timestamps the status
+* itself. close_battery_status unmaps the segment for either side.
+******************************************************************************/
+typedef struct battery_status_t{
+	uint64_t timestamp_micros;	// micros_since_boot() when published
+	float v_pack;				// filtered 2S pack voltage from the balance plug
+	float v_jack;				// filtered DC jack voltage
+	float cell_voltage;			// per cell voltage of whichever pack is in use
+	int num_cells;				// 0 when no battery was detected
+	int pack_connected;			// 1 if a 2S pack is on the balance connector
+	int charging;				// 1 while the 2S pack is charging
+	float sample_period;		// seconds between the monitor's samples
+} battery_status_t;
+
+int read_battery_status(battery_status_t* status);
+int publish_battery_status(battery_status_t* status);
+int close_battery_status();
 
 
 /******************************************************************************
@@ -350,18 +576,115 @@ float get_adc_volt(int ch);
 * 10hz to prevent timing out. The timing accuracy of this loop is not critical
 * and the user can choose to update at whatever frequency they wish.
 *
+* @ int send_servo_pulse_ns(int ch, int ns)
+* @ int send_servo_pulse_ns_all(int ns)
+* @ int send_servo_pulses_ns(const int ns[8])
+*
+* Same as the _us functions with the width in nanoseconds. The PRU places
+* every edge with its 200MHz IEP timer, so widths resolve to 5ns and edges
+* land within a fraction of a microsecond. The normalized functions use these
+* directly so they aren't rounded to whole microseconds either, which matters
+* for OneShot125 and Multishot where 1us is a large step in throttle.
+*
+* @ int send_multishot_pulse_normalized(int ch, float input)
+* @ int send_multishot_pulse_normalized_all(float input)
+*
+* Like the oneshot functions with 0-1 mapped to 5-25us for Multishot ESCs.
+*
+* @ int send_servo_pulses_us(const int us[8])
+*
+* Takes a separate width for each channel and hands the whole set to the PRU
+* with one commit so that all pulses start on the same PRU cycle. This is
+* what multirotor mixers should use. The _all functions go through it too. A
+* width of 0 leaves that channel idle. Returns -1 if the previous set has not
+* been taken by the PRU yet or a pulse is still in flight.
+*
+* @ int set_servo_repeat_rate(int hz)
+* @ int stop_servo_repeat(int ch)
+*
+* Instead of single pulses the PRU can repeat the latest width for every 
+* channel itself at a frame rate of 50-490hz for normal servos and ESCs or up
+* to 4khz for OneShot125. After set_servo_repeat_rate all of the send_* 
+* functions above only change the width being repeated, so they need only be
+* called when the setpoint changes. Every channel's pulse starts at the top of
+* the same frame. Channels stay idle until first given a width and 
+* stop_servo_repeat(ch) idles one again, or all of them when ch is 0. Call
+* set_servo_repeat_rate(0) to go back to single pulses.
+*
+* @ int stop_servo_outputs()
+*
+* Leaves repeat mode and clears every width and waiting pulse at once. The
+* control watchdog uses this, it is safe to call from any thread.
+*
+* @ int64_t get_pru_event_seq(pru_event_t event)
+* @ int64_t wait_for_pru_event(pru_event_t event, uint32_t seq, int timeout_ms)
+*
+* The PRUs count events for the ARM to wait on. PRU_EVENT_SERVO_DONE counts
+* each time the last pulse in flight ends with no new widths waiting, which
+* is once per frame in repeat mode. Read the count with get_pru_event_seq 
+* while the servos are idle, send pulses, then wait_for_pru_event sleeps 
+* until the count moves past it instead of retrying sends that return -1.
+* It returns the new count or -1 after timeout_ms, 0 waits forever.
+*
+* @ int set_dshot_rate(int rate)
+* @ int send_dshot_values(const int values[8])
+* @ int send_dshot_normalized(const float throttle[8])
+* @ int send_dshot_command(int ch, int cmd)
+*
+* DShot ESCs take throttle as a digital frame instead of a pulse width, so
+* they need no calibration and a frame is only 27us long at DShot600. After
+* set_dshot_rate(DSHOT150, DSHOT300 or DSHOT600) the servo channels send
+* DShot frames instead of pulses until set_dshot_rate(0), and the servo pulse
+* functions return errors meanwhile. send_dshot_normalized maps throttle 0-1
+* to DShot values 48-2047 for every channel and hands all frames to the PRU
+* with one commit like send_servo_pulses_us. Below 0 sends motor stop and NAN
+* leaves a channel idle. send_dshot_values takes the raw 11 bit values with -1
+* for idle. Frames are sent once each so call these at the control loop rate,
+* ESCs disarm after a short time without frames. PRU_EVENT_SERVO_DONE counts
+* frames sent. send_dshot_command sends one of the DShot commands 0-47 with
+* the telemetry bit set, with the motors stopped. Bidirectional DShot eRPM 
+* telemetry isn't supported, the cape's servo pins are outputs only.
+*
 * See the test_servos, sweep_servos, and calibrate_escs examples.
 ******************************************************************************/
+#define DSHOT150				150
+#define DSHOT300				300
+#define DSHOT600				600
+#define DSHOT_CMD_MOTOR_STOP	0
+#define DSHOT_CMD_MAX			47
+#define DSHOT_MIN_THROTTLE		48
+#define DSHOT_MAX_THROTTLE		2047
+
+typedef enum pru_event_t{
+	PRU_EVENT_SERVO_DONE,
+	PRU_EVENT_ENCODER_THRESHOLD
+} pru_event_t;
+
 int enable_servo_power_rail();
 int disable_servo_power_rail();
 int send_servo_pulse_us(int ch, int us);
 int send_servo_pulse_us_all(int us);
+int send_servo_pulses_us(const int us[8]);
+int send_servo_pulse_ns(int ch, int ns);
+int send_servo_pulse_ns_all(int ns);
+int send_servo_pulses_ns(const int ns[8]);
 int send_servo_pulse_normalized(int ch, float input);
 int send_servo_pulse_normalized_all(float input);
 int send_esc_pulse_normalized(int ch, float input);
 int send_esc_pulse_normalized_all(float input);
 int send_oneshot_pulse_normalized(int ch, float input);
 int send_oneshot_pulse_normalized_all(float input);
+int send_multishot_pulse_normalized(int ch, float input);
+int send_multishot_pulse_normalized_all(float input);
+int set_servo_repeat_rate(int hz);
+int stop_servo_repeat(int ch);
+int stop_servo_outputs();
+int set_dshot_rate(int rate);
+int send_dshot_values(const int values[8]);
+int send_dshot_normalized(const float throttle[8]);
+int send_dshot_command(int ch, int cmd);
+int64_t get_pru_event_seq(pru_event_t event);
+int64_t wait_for_pru_event(pru_event_t event, uint32_t seq, int timeout_ms);
 
 
 /******************************************************************************
@@ -402,6 +725,14 @@ int send_oneshot_pulse_normalized_all(float input);
 * MUST run the clalibrate_dsm example to ensure the normalized values returned
 * by this function are correct.
 *
+* @ int get_dsm_frame(dsm_frame_t* frame)
+*
+* Fills in every channel's raw and normalized value along with a frame counter
+* and the micros_since_boot() timestamp when the frame was received. Unlike 
+* reading channels one at a time, all values are guaranteed to come from the
+* same frame. Returns 0 on success or -1 if no frame has arrived yet. A
+* frame_count that has not changed since the last call means no new data.
+*
 * @ int ms_since_last_dsm_packet()
 * 
 * returns the number of milliseconds since the last dsm packet was received.
@@ -421,20 +752,77 @@ int send_oneshot_pulse_normalized_all(float input);
 *
 * Starts a calibration routine. 
 *
+* @ int set_dsm_passthrough(int servo_ch, int dsm_ch, float gain,
+*															int failsafe_us)
+* @ int set_dsm_passthrough_limits(int servo_ch, int min_us, int max_us)
+* @ int enable_dsm_passthrough(int timeout_ms)
+* @ int disable_dsm_passthrough()
+* @ int is_dsm_passthrough_failsafe()
+*
+* Library level passthrough for manual control that doesn't depend on the
+* user's program keeping up. The DSM thread writes each forwarded channel
+* straight to the servo outputs as soon as a frame is complete, before any
+* callback runs. The width sent is 1500us + gain*(raw-1500us) clamped to the
+* limits, which default to 600-2400us. If no frame arrives for timeout_ms
+* each forwarded channel gets its failsafe_us, or is stopped if that is 0,
+* until frames return. Use set_servo_repeat_rate so the PRU keeps pulsing
+* between frames. Channels not forwarded stay free for the user.
+*
+* @ int get_dsm_link_stats(dsm_link_stats_t* stats)
+* @ int reset_dsm_link_stats()
+*
+* Counters for link quality. Packets arrive every 11 or 22ms according to
+* the system byte, so a longer gap is counted as lost packets. fades totals
+* the receiver's own count of missed frames. With more than 7 channels a
+* frame is split over two packets and the new data callback only runs once
+* both halves of the same frame are in. A half whose partner never arrived
+* is thrown away and counted in dropped_partial_frames rather than combined
+* with the next frame.
+*
 * see test_dsm, calibrate_dsm, and dsm_passthroguh examples for use cases.
 ******************************************************************************/
+#define DSM_MAX_CHANNELS 9
+
+typedef struct dsm_frame_t{
+	uint64_t frame_count;		// increments by one with each complete frame
+	uint64_t timestamp_micros;	// micros_since_boot() when frame completed
+	int num_channels;			// channels the transmitter is sending
+	int resolution;				// 1024 or 2048
+	int raw[DSM_MAX_CHANNELS];	// pulse widths in microseconds
+	float normalized[DSM_MAX_CHANNELS]; // -1 to 1 from calibration
+} dsm_frame_t;
+
+typedef struct dsm_link_stats_t{
+	uint64_t packets;				// good packets received
+	uint64_t frames;				// complete channel sets dispatched
+	uint64_t lost_packets;			// inferred from arrival gaps
+	uint64_t dropped_partial_frames;// half frames thrown away
+	uint64_t resyncs;				// misaligned packets
+	uint64_t fades;					// frames the receiver reports missing
+	uint64_t packet_period_us;		// 11000 or 22000, 0 before any packet
+	int system;						// protocol byte of the last packet
+} dsm_link_stats_t;
+
 int   initialize_dsm();
 int   is_new_dsm_data();
 int   is_dsm_active();
 int   set_new_dsm_data_func(int (*func)(void));
 int   get_dsm_ch_raw(int channel);
 float get_dsm_ch_normalized(int channel);
+int   get_dsm_frame(dsm_frame_t* frame);
 int   ms_since_last_dsm_packet();
 int   get_dsm_frame_resolution();
 int   get_num_dsm_channels();
 int   stop_dsm_service();
 int   bind_dsm();
 int   calibrate_dsm_routine();
+int   set_dsm_passthrough(int servo_ch, int dsm_ch, float gain, int failsafe_us);
+int   set_dsm_passthrough_limits(int servo_ch, int min_us, int max_us);
+int   enable_dsm_passthrough(int timeout_ms);
+int   disable_dsm_passthrough();
+int   is_dsm_passthrough_failsafe();
+int   get_dsm_link_stats(dsm_link_stats_t* stats);
+int   reset_dsm_link_stats();
 
 
 /******************************************************************************
@@ -476,6 +864,20 @@ int   calibrate_dsm_routine();
 * best to get the default config with get_default_imu_config() function and
 * modify from there.
 *
+* Bringing up the DMP is dominated by the 100ms reset delay and loading 3KB 
+* of firmware. Setting dmp_warm_start checks whether the firmware is still 
+* loaded from a previous process and if so skips both, still rewriting all 
+* configuration. dmp_verify_firmware can be turned off to skip reading back
+* each chunk of a full load.
+*
+* @ enum imu_interrupt_backend_t
+*
+* Selects how the DMP interrupt thread waits for the IMU interrupt pin. The
+* default IMU_INTERRUPT_SYSFS polls the sysfs gpio value file. 
+* IMU_INTERRUPT_CHARDEV uses the gpio character device which needs only one
+* syscall per interrupt and timestamps the edge in the kernel, giving lower and
+* more consistent latency. It falls back to sysfs if unavailable.
+*
 * @ struct imu_data_t 
 *
 * This is the container for holding the sensor data from the IMU.
@@ -504,7 +906,143 @@ int   calibrate_dsm_routine();
 * configuration struct. Since the magnetometer requires additional setup and
 * is slower to read, it is disabled by default.
 *
+* @ int get_latest_imu_sample(imu_sample_t* sample)
+* @ int get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max)
+*
+* In DMP mode the interrupt thread writes into the user's imu_data_t while 
+* other threads may be reading it. Every successful read is also published to
+* a small history ring of timestamped imu_sample_t copies. These two functions
+* return a consistent copy of the newest sample, or every sample after the
+* given sequence number, without ever blocking the interrupt thread. Use these
+* when a thread other than the imu interrupt function consumes IMU data.
+*
+* @ int read_imu_all(imu_data_t* data)
+*
+* Reads the accelerometer, thermometer, gyroscope, and magnetometer (if
+* enabled) in a single i2c burst. In random mode the magnetometer is read by
+* the MPU9250's own i2c master so all 9 axes sit in one contiguous register
+* block. Prefer this over the individual read functions in fast loops.
+*
+* @ int initialize_imu_fifo_stream(imu_data_t *data, imu_config_t conf)
+* @ int set_imu_fifo_batch_func(int (*func)(imu_sample_t* samples, int n))
+* @ uint64_t get_imu_fifo_overflows()
+*
+* Raw FIFO streaming mode without the DMP. The MPU9250 writes every accel, 
+* temp, gyro, and magnetometer (if enabled) sample into its hardware FIFO at 
+* fifo_sample_rate (4-1000hz) and a background thread empties it in bursts 
+* fifo_drain_rate times a second. Each batch is passed oldest first to the 
+* function set with set_imu_fifo_batch_func with estimated per-sample 
+* timestamps, published to get_imu_samples_since, and the newest sample is 
+* copied into data. The FIFO holds 512 bytes so the drain rate must keep each
+* burst under half of that. 1khz is the most a 400khz i2c bus can carry.
+*
+* @ uint64_t get_dmp_dropped_packets()
+* @ uint64_t get_dmp_fifo_resets()
+*
+* If the handler is late and several DMP packets have queued in the FIFO, 
+* all of them are read in one pass and fused in order instead of resetting
+* the FIFO. Every packet is published to get_imu_samples_since with its own
+* timestamp from the sample clock model described below. The user
+* function runs once for the newest packet and the older ones are counted by
+* get_dmp_dropped_packets, unless dmp_deliver_backlog is set in the config in
+* which case it runs once per packet. The FIFO is only reset on overflow or
+* bytes that can't be parsed, counted by get_dmp_fifo_resets.
+*
+* Each DMP packet is the 16 byte quaternion followed by 6 bytes of raw accel
+* and 6 of raw gyro. Clearing dmp_send_accel or dmp_send_gyro in the config
+* leaves those out of the FIFO and their fields in imu_data_t untouched, so
+* a program that only uses the DMP attitude reads 16 bytes per sample
+* instead of 28. The magnetometer blocks are separate and unaffected. Gyro
+* bias tracking needs both.
+*
+* @ float get_imu_sample_period_us()
+* @ uint64_t get_imu_clock_resyncs()
+*
+* The MPU's own oscillator sets its sample rate and is only accurate to a
+* few percent. Both handlers count samples against the interrupt time (DMP)
+* or the FIFO count read time (stream) and track the true period with an 
+* alpha-beta filter, so each sample's timestamp is its estimated acquisition
+* time with the wake-up jitter smoothed out, even deep in a backlog. 
+* get_imu_sample_period_us returns the measured period. When samples are 
+* lost the model starts over, counted by get_imu_clock_resyncs.
+*
+* @ uint64_t get_imu_callback_overruns()
+* @ uint64_t get_imu_callback_missed_deadlines()
+*
+* Set callback_worker in the config to run the user function in a separate
+* thread started with the RT_SERVICE_IMU_CALLBACK thread config. The
+* interrupt thread then only reads, fuses and publishes, and the user's data
+* struct is filled in by the worker right before each call. If a new sample
+* is ready while the callback is still running the worker skips ahead to the
+* newest and the skipped one counts as an overrun. Callbacks returning more
+* than one sample period after their interrupt count as missed deadlines.
+* The timing histogram's callback channel then only covers the hand off.
+*
+* @ int get_imu_timing_stats(imu_timing_stats_t* stats)
+* @ int reset_imu_timing_stats()
+* @ int print_imu_timing_stats()
+*
+* The DMP and FIFO stream handlers time every pass into power-of-two
+* microsecond histograms: the interrupt period, wake latency from the edge to
+* the handler running, the i2c read, data_fusion, the user callback, and the
+* total from edge to callback return. Passes whose total exceeds the sample 
+* period (the drain period in stream mode) are counted as overruns. Wake 
+* latency needs IMU_INTERRUPT_CHARDEV, sysfs stamps the edge after waking.
+* get_imu_timing_stats copies everything for logging without blocking the
+* handler and reset_imu_timing_stats zeroes it on the next pass.
+*
+* @ int get_gyro_bias(float bias[3])
+* @ uint64_t get_gyro_bias_updates()
+* @ int save_gyro_bias()
+*
+* Set track_gyro_bias in the config to have the DMP or FIFO stream handler
+* estimate gyro bias whenever the robot sits still, judged by the gyro and
+* accelerometer barely varying over half a second, instead of relying on
+* calibrate_gyro_routine alone. Each still window moves the MPU's gyro offset
+* registers a quarter of the way toward removing the remaining rate, so DMP
+* angles are corrected too and thermal drift is followed. get_gyro_bias 
+* reports the bias in deg/s being removed. The offsets are written back to 
+* the calibration file every 10 minutes while they change, by save_gyro_bias,
+* and by power_off_imu.
+*
+* @ int calibrate_imu_temp_routine(int max_minutes)
+*
+* Gyro and accel biases drift as the MPU warms up. Run this from cold with
+* the board still, as the calibrate_imu_temp example does, and it records the
+* average readings in 1C steps until the temperature settles or max_minutes
+* pass (0 for no limit). With temp_compensation set in the config the DMP and
+* FIFO stream handlers then interpolate the change from 25C for the current 
+* temperature. Gyro corrections go into the offset registers on top of the 
+* gyro calibration, and accel corrections are subtracted from each sample.
+* Temperature is read once a second in DMP mode.
+*
+* @ imu_handle_t* create_imu_handle(int bus, int address, int interrupt_pin)
+* @ imu_handle_t* create_imu_handle_spi(int slave, int interrupt_pin)
+* @ int destroy_imu_handle(imu_handle_t* imu)
+* @ int select_imu(imu_handle_t* imu)
+* @ imu_handle_t* get_selected_imu()
+*
+* Every IMU function above acts on the IMU selected by the calling thread,
+* which is the one on the cape unless select_imu says otherwise. To run
+* another MPU9250, describe it with create_imu_handle giving its i2c bus,
+* address (0x68 or 0x69) and interrupt gpio pin or -1 if it has none, then
+* select it and call initialize_imu, initialize_imu_dmp or
+* initialize_imu_fifo_stream as usual. Interrupt and batch functions run on
+* that IMU's own threads with it already selected. select_imu(NULL) goes
+* back to the on-board IMU. The calibration files belong to the on-board
+* IMU, others start with zero offsets and can't run the calibration
+* routines. Only one IMU per i2c bus can enable the magnetometer since each
+* AK8963 answers at the same address while it is being set up.
+*
+* An MPU9250 wired to SPI1 is described with create_imu_handle_spi giving
+* its slave select, 1 or 2, instead. Registers are written at 1MHz and the
+* sensor and FIFO registers read at 20MHz, so FIFO batches come in larger
+* chunks and the i2c bus stays free for other devices. The magnetometer is
+* reached through the MPU's own i2c master so the limit above doesn't apply.
+*
 ******************************************************************************/
+typedef struct imu_handle_t imu_handle_t;
+
 typedef enum accel_fsr_t {
   A_FSR_2G,
   A_FSR_4G,
@@ -550,6 +1088,11 @@ typedef enum imu_orientation_t {
 	ORIENTATION_X_BACK 	  = 161
 } imu_orientation_t;
 
+typedef enum imu_interrupt_backend_t {
+	IMU_INTERRUPT_SYSFS,	// poll() on /sys/class/gpio value file
+	IMU_INTERRUPT_CHARDEV	// gpio character device events, kernel timestamp
+} imu_interrupt_backend_t;
+
 typedef struct imu_config_t {
 	// full scale ranges for sensors
 	accel_fsr_t accel_fsr; // AFS_2G, AFS_4G, AFS_8G, AFS_16G
@@ -568,7 +1111,21 @@ typedef struct imu_config_t {
 	// higher mix_factor means less weight the compass has on fused_TaitBryan
 	float compass_time_constant; 	// time constant for filtering fused yaw
 	int dmp_interrupt_priority; // scheduler priority for handler
+	imu_interrupt_backend_t interrupt_backend; // how the handler wakes up
 	int show_warnings;	// set to 1 to enable showing of i2c_bus warnings
+	int fast_math;		// 1 for approximate trig in DMP angles, ~2e-6 rad
+	int dmp_verify_firmware; // 0 skips reading back the DMP firmware load
+	int dmp_warm_start;	// 1 reuses DMP firmware left loaded by a past process
+	int dmp_deliver_backlog; // 1 calls the user function for every caught up packet
+	int dmp_send_accel;	// 0 leaves raw accel out of the DMP packet
+	int dmp_send_gyro;	// 0 leaves raw gyro out of the DMP packet
+	int callback_worker;	// 1 runs the user function in its own thread
+	int track_gyro_bias;	// 1 keeps estimating gyro bias whenever still
+	int temp_compensation;	// 1 applies the calibrate_imu_temp table
+	
+	// raw FIFO streaming settings, only used with initialize_imu_fifo_stream
+	int fifo_sample_rate;	// hz, 4-1000
+	int fifo_drain_rate;	// hz the FIFO is emptied at
 
 } imu_config_t;
 
@@ -599,12 +1156,44 @@ typedef struct imu_data_t {
 	float compass_heading;	// heading filtered with gyro and accel data
 	float compass_heading_raw;	// heading in radians based purely on magnetometer
 } imu_data_t;
+
+typedef struct imu_sample_t {
+	uint64_t seq;				// increments by one with each sample
+	uint64_t timestamp_micros;	// micros_since_boot() of the sample
+	imu_data_t data;
+} imu_sample_t;
+
+#define IMU_TIMING_BINS 16 // bin k counts 2^k to 2^(k+1) us, last is open
+typedef enum imu_timing_channel_t {
+	IMU_TIMING_PERIOD,		// time between interrupts or drains
+	IMU_TIMING_WAKE,		// interrupt edge to handler running
+	IMU_TIMING_READ,		// i2c read of the FIFO
+	IMU_TIMING_FUSION,		// data_fusion, only with the magnetometer
+	IMU_TIMING_CALLBACK,	// user interrupt or batch function
+	IMU_TIMING_TOTAL,		// edge to callback return
+	IMU_TIMING_CHANNELS
+} imu_timing_channel_t;
+
+typedef struct imu_timing_hist_t {
+	uint64_t count;
+	uint64_t sum_us;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t bins[IMU_TIMING_BINS];
+} imu_timing_hist_t;
+
+typedef struct imu_timing_stats_t {
+	imu_timing_hist_t channel[IMU_TIMING_CHANNELS];
+	uint32_t budget_us;	// sample period each pass should fit in
+	uint64_t overruns;	// passes whose total exceeded budget_us
+} imu_timing_stats_t;
  
 // General functions
 imu_config_t get_default_imu_config();
 int set_imu_config_to_defaults(imu_config_t *conf);
 int calibrate_gyro_routine();
 int calibrate_mag_routine();
+int calibrate_imu_temp_routine(int max_minutes);
 int power_off_imu();
 
 // one-shot sampling mode functions
@@ -613,6 +1202,7 @@ int read_accel_data(imu_data_t *data);
 int read_gyro_data(imu_data_t *data);
 int read_mag_data(imu_data_t *data);
 int read_imu_temp(imu_data_t* data);
+int read_imu_all(imu_data_t* data);
 
 // interrupt-driven sampling mode functions
 int initialize_imu_dmp(imu_data_t *data, imu_config_t conf);
@@ -620,6 +1210,910 @@ int set_imu_interrupt_func(int (*func)(void));
 int stop_imu_interrupt_func();
 int was_last_read_successful();
 uint64_t micros_since_last_interrupt();
+int get_latest_imu_sample(imu_sample_t* sample);
+int get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max);
+
+// raw FIFO streaming mode functions
+int initialize_imu_fifo_stream(imu_data_t *data, imu_config_t conf);
+int set_imu_fifo_batch_func(int (*func)(imu_sample_t* samples, int n));
+uint64_t get_imu_fifo_overflows();
+
+// DMP catch-up counters
+uint64_t get_dmp_dropped_packets();
+uint64_t get_dmp_fifo_resets();
+
+// sample clock model
+float get_imu_sample_period_us();
+uint64_t get_imu_clock_resyncs();
+
+// online gyro bias tracking
+int get_gyro_bias(float bias[3]);
+uint64_t get_gyro_bias_updates();
+int save_gyro_bias();
+
+// callback worker counters
+uint64_t get_imu_callback_overruns();
+uint64_t get_imu_callback_missed_deadlines();
+
+// handler timing instrumentation
+int get_imu_timing_stats(imu_timing_stats_t* stats);
+int reset_imu_timing_stats();
+int print_imu_timing_stats();
+
+// multiple IMUs
+imu_handle_t* create_imu_handle(int bus, int address, int interrupt_pin);
+imu_handle_t* create_imu_handle_spi(int slave, int interrupt_pin);
+int destroy_imu_handle(imu_handle_t* imu);
+int select_imu(imu_handle_t* imu);
+imu_handle_t* get_selected_imu();
+
+/*******************************************************************************
+* IMU TASKS
+*
+* A cyclic executive clocked by the IMU, for control programs that would
+* otherwise run slower loops in their own threads sleeping at their own
+* rates and locking the state they share with the IMU callback.
+*
+* @ int add_imu_task(const char* name, int divisor, int (*func)(void),
+*														uint32_t budget_us)
+*
+* Registers func to run once every divisor IMU samples, so with a 200hz DMP 
+* divisors of 1, 4, 20 and 200 give 200, 50, 10 and 1hz loops. Tasks run in 
+* the order they were added. Tasks with the same divisor are put on 
+* different samples where possible. budget_us is how long a run may take 
+* before it counts as an overrun, 0 for no limit. Returns the task id, or -1.
+* Add every task before the IMU starts.
+*
+* @ int run_imu_tasks()
+*
+* The executive itself. Pass it to set_imu_interrupt_func and every task runs
+* in the IMU interrupt thread, or in the callback worker if callback_worker
+* is set in the IMU config, always at the same phase to the sample.
+*
+* @ int get_imu_task_stats(int id, imu_task_stats_t* stats)
+* @ int reset_imu_task_stats()
+* @ int print_imu_task_stats()
+*
+* Run count, execution time, overruns of the budget and negative returns per
+* task, readable from any thread without blocking the executive.
+*******************************************************************************/
+#define IMU_MAX_TASKS		16
+#define IMU_TASK_NAME_LEN	16
+
+typedef struct imu_task_stats_t{
+	uint64_t runs;
+	uint64_t sum_us;
+	uint32_t last_us;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t overruns;	// runs longer than budget_us
+	uint64_t errors;	// runs that returned < 0
+} imu_task_stats_t;
+
+int add_imu_task(const char* name, int divisor, int (*func)(void), \
+														uint32_t budget_us);
+int run_imu_tasks();
+int get_imu_task_stats(int id, imu_task_stats_t* stats);
+int reset_imu_task_stats();
+int print_imu_task_stats();
+
+/*******************************************************************************
+* IMU VOTING
+*
+* Fuses two or three MPU9250s into one stream and votes out a faulty one,
+* built on the multiple IMU handles above.
+*
+* @ imu_vote_config_t get_default_imu_vote_config()
+* @ int start_imu_vote(imu_handle_t** imus, int n, imu_vote_config_t conf,
+*															imu_data_t* data)
+* @ int stop_imu_vote()
+* @ int set_imu_vote_func(int (*func)(void))
+*
+* Start every IMU in DMP mode at the same sample rate, then pass their
+* handles to start_imu_vote, NULL standing for the on-board IMU. It takes
+* over their interrupt functions. Each sample is interpolated to a common
+* time and accel, gyro and magnetometer are voted per axis, median of three
+* or mean of two, into data. The function set with set_imu_vote_func is then
+* called, in whichever IMU thread completed the vote. DMP angles and raw
+* readings are copied from the IMU closest to the vote. An IMU further than
+* gyro_tolerance or accel_tolerance from the vote, or missing, for
+* fault_samples votes in a row is excluded until it agrees again for
+* recover_samples. With two IMUs left a disagreement can't be pinned on
+* either, so the first one listed is used alone and the vote counts as
+* degraded.
+*
+* @ int get_latest_imu_vote_sample(imu_sample_t* sample)
+* @ int get_imu_vote_status(imu_vote_status_t* status)
+* @ int print_imu_vote_status()
+*
+* Newest vote for other threads, and each IMU's health, fault count and
+* last error against the vote.
+*******************************************************************************/
+#define IMU_VOTE_MAX 3
+
+typedef struct imu_vote_config_t{
+	float gyro_tolerance;	// deg/s from the vote counted as disagreeing
+	float accel_tolerance;	// m/s^2 from the vote counted as disagreeing
+	int fault_samples;		// bad votes in a row before an IMU is excluded
+	int recover_samples;	// good votes in a row before it is let back in
+	uint64_t max_skew_us;	// time apart beyond which samples aren't voted
+} imu_vote_config_t;
+
+typedef struct imu_vote_status_t{
+	int n;							// IMUs being voted
+	int healthy[IMU_VOTE_MAX];		// 0 while excluded
+	int reference;					// IMU the DMP angles last came from
+	uint64_t faults[IMU_VOTE_MAX];	// times each was excluded
+	uint64_t missed[IMU_VOTE_MAX];	// votes held without its sample
+	float gyro_error[IMU_VOTE_MAX];	// last distance from the vote, deg/s
+	float accel_error[IMU_VOTE_MAX];// last distance from the vote, m/s^2
+	uint64_t votes;
+	uint64_t degraded;				// votes of two IMUs that disagreed
+} imu_vote_status_t;
+
+imu_vote_config_t get_default_imu_vote_config();
+int start_imu_vote(imu_handle_t** imus, int n, imu_vote_config_t conf, \
+															imu_data_t* data);
+int stop_imu_vote();
+int set_imu_vote_func(int (*func)(void));
+int get_latest_imu_vote_sample(imu_sample_t* sample);
+int get_imu_vote_status(imu_vote_status_t* status);
+int print_imu_vote_status();
+
+/*******************************************************************************
+* LATENCY TRACE
+*
+* Measures each control loop from the IMU interrupt edge to the actuator
+* write it causes, the number to tune a control stack on.
+*
+* @ int start_latency_trace(int loops)
+* @ int stop_latency_trace()
+*
+* While running, every on-board IMU interrupt opens a loop in a ring
+* holding the last loops of them (0 for 4096) and the first time each point
+* below is reached after the edge is recorded in nanoseconds. In FIFO
+* stream mode each drain is a loop, timed from the drain's wake up. Wake
+* is only meaningful with IMU_INTERRUPT_CHARDEV, sysfs stamps the edge after
+* waking. The actuator point is the first set_motor, set_motors or servo,
+* ESC or oneshot pulse of the loop, from whatever thread makes it.
+*
+* @ int trace_point(trace_point_t p)
+*
+* Marks a point in the current loop, for actuators the library doesn't
+* drive, such as TRACE_ACTUATOR before an i2c or uart write to a motor
+* controller. Costs a single load while tracing is off.
+*
+* @ int get_latency_trace(uint64_t seq, latency_trace_loop_t* buf, int max)
+*
+* Copies finished loops after seq, oldest first, and returns how many. Pass
+* 0 first, then the seq of the last loop received to stream them out.
+*
+* @ int get_latency_trace_summary(latency_trace_summary_t* sum)
+* @ int print_latency_trace_summary()
+*
+* Median, 90th, 99th and 99.9th percentile and worst time after the edge for
+* each point over the loops in the ring. The trace_latency example prints
+* this for a running DMP loop.
+*******************************************************************************/
+#define TRACE_NOT_REACHED	UINT32_MAX
+
+typedef enum trace_point_t{
+	TRACE_EDGE,				// IMU interrupt edge, time zero of the loop
+	TRACE_WAKE,				// handler running
+	TRACE_READ_DONE,		// FIFO read over i2c finished
+	TRACE_FUSION_DONE,		// packets parsed and fused, data struct filled
+	TRACE_CALLBACK_START,	// user's interrupt function called
+	TRACE_CALLBACK_END,		// and returned
+	TRACE_ACTUATOR,			// first motor or PRU pulse write
+	TRACE_POINTS
+} trace_point_t;
+
+typedef struct latency_trace_loop_t{
+	uint64_t seq;
+	uint64_t edge_ns;			// nanos_since_boot() of the edge
+	uint32_t ns[TRACE_POINTS];	// after the edge or TRACE_NOT_REACHED
+} latency_trace_loop_t;
+
+typedef struct latency_trace_summary_t{
+	uint64_t loops;					// loops in the ring
+	uint64_t count[TRACE_POINTS];	// loops that reached each point
+	uint32_t p50_ns[TRACE_POINTS];
+	uint32_t p90_ns[TRACE_POINTS];
+	uint32_t p99_ns[TRACE_POINTS];
+	uint32_t p999_ns[TRACE_POINTS];
+	uint32_t max_ns[TRACE_POINTS];
+} latency_trace_summary_t;
+
+int start_latency_trace(int loops);
+int stop_latency_trace();
+int trace_point(trace_point_t p);
+int get_latency_trace(uint64_t seq, latency_trace_loop_t* buf, int max);
+int get_latency_trace_summary(latency_trace_summary_t* sum);
+int print_latency_trace_summary();
+
+/*******************************************************************************
+* ODOMETRY
+*
+* Dead reckoning for a differential drive robot from two encoder channels,
+* optionally steering by the IMU's yaw rate instead of the wheel difference.
+*
+* @ odometry_config_t get_default_odometry_config()
+* @ int start_odometry(odometry_config_t conf)
+* @ int stop_odometry()
+*
+* Channels are 1-4 as for get_encoder_pos. Polarities flip a wheel whose
+* count falls going forward, or the gyro if positive z doesn't turn left.
+* Distances come out in the units of wheel_diameter and track_width. 
+* Starting puts the robot at the origin heading along x.
+*
+* @ int update_odometry()
+*
+* Takes one snapshot of every encoder with get_encoder_pos_all, and with
+* use_imu_yaw the gyro z interpolated between the IMU samples either side of
+* the snapshot's timestamp, and integrates the motion since the last update. Call it at a steady rate from one thread, such as
+* an IMU task. A gap over a second between updates is not integrated and
+* is counted in gaps.
+*
+* @ int feed_odometry(const int pos[4], uint64_t timestamp_micros,
+*															float yaw_rate)
+*
+* Same from a snapshot taken elsewhere, such as a log being replayed.
+* yaw_rate is in rad/s and only used with use_imu_yaw.
+*
+* @ int get_odometry_pose(odometry_pose_t* pose)
+* @ int set_odometry_pose(float x, float y, float heading)
+* @ int print_odometry_pose()
+*
+* The pose can be read from any thread without blocking the updates. A set
+* pose takes effect at the next update.
+*******************************************************************************/
+typedef struct odometry_config_t{
+	int left_ch;			// encoder channel of the left wheel
+	int right_ch;
+	int left_polarity;		// 1 or -1
+	int right_polarity;
+	float counts_per_rev;	// encoder counts per wheel revolution
+	float wheel_diameter;
+	float track_width;		// between the wheels' contact points
+	int use_imu_yaw;		// heading from gyro z rather than the wheels
+	int gyro_polarity;		// 1 or -1
+} odometry_config_t;
+
+typedef struct odometry_pose_t{
+	float x;
+	float y;
+	float heading;				// radians from x toward y, -PI to PI
+	float velocity;				// forward, per second
+	float yaw_rate;				// rad/s
+	float distance;				// travelled either way since start
+	uint64_t timestamp_micros;	// of the last snapshot
+	uint64_t updates;
+	uint64_t gaps;				// updates too late to integrate
+} odometry_pose_t;
+
+odometry_config_t get_default_odometry_config();
+int start_odometry(odometry_config_t conf);
+int stop_odometry();
+int update_odometry();
+int feed_odometry(const int pos[4], uint64_t timestamp_micros, \
+															float yaw_rate);
+int get_odometry_pose(odometry_pose_t* pose);
+int set_odometry_pose(float x, float y, float heading);
+int print_odometry_pose();
+
+/*******************************************************************************
+* METRICS
+*
+* Process wide counters and gauges for watching a fleet of robots from a
+* monitoring agent without stopping or attaching to the control process.
+*
+* @ int register_metric(const char* name, metric_type_t type)
+* @ void metric_add(int id, int64_t n)
+* @ void metric_set(int id, int64_t value)
+* @ int64_t get_metric(int id)
+*
+* The library counts its own errors in the METRIC_* ids below, summed over
+* every IMU and bus. register_metric adds one of the program's own and
+* returns its id, or the existing id if the name is taken with the same type.
+* metric_add bumps a counter, metric_set sets a gauge. Both are a single
+* atomic operation, safe from any thread including the IMU interrupt, and
+* do nothing for an id that doesn't exist. Register before starting loops.
+*
+* @ int start_metrics_export()
+* @ int stop_metrics_export()
+*
+* Moves the table into the shared memory file
+* /dev/shm/roboticscape_metrics.<pid>, world readable, for agents to poll.
+* cleanup_cape removes it.
+*
+* @ int read_process_metrics(int pid, metric_value_t* buf, int max)
+*
+* For the agent side. Reads everything process pid exports into buf without
+* any effect on that process. Returns how many or -1 if it exports nothing.
+*
+* @ int print_metrics()
+*******************************************************************************/
+#define METRICS_MAX			128
+#define METRIC_NAME_LEN		32
+
+typedef enum metric_type_t{
+	METRIC_COUNTER,
+	METRIC_GAUGE
+} metric_type_t;
+
+// ids of the metrics the library keeps itself
+typedef enum builtin_metric_t{
+	METRIC_I2C_ERRORS,				// failed i2c reads and writes
+	METRIC_IMU_READ_FAILURES,		// was_last_read_successful() false
+	METRIC_DMP_FIFO_RESETS,			// as get_dmp_fifo_resets()
+	METRIC_DMP_DROPPED_PACKETS,		// as get_dmp_dropped_packets()
+	METRIC_IMU_CALLBACK_OVERRUNS,	// as get_imu_callback_overruns()
+	METRIC_IMU_DEADLINE_MISSES,		// as get_imu_callback_missed_deadlines()
+	METRIC_IMU_BUDGET_OVERRUNS,		// IMU handler over its timing budget
+	METRIC_IMU_TASK_OVERRUNS,		// IMU tasks over their budget
+	METRIC_IMU_TASK_ERRORS,			// IMU tasks returning < 0
+	METRIC_DSM_LOST_PACKETS,		// DSM packets missed between arrivals
+	METRIC_LOGGER_DROPS,			// as get_logger_drops()
+	METRIC_BUILTIN_COUNT
+} builtin_metric_t;
+
+typedef struct metric_value_t{
+	char name[METRIC_NAME_LEN];
+	metric_type_t type;
+	int64_t value;
+} metric_value_t;
+
+int register_metric(const char* name, metric_type_t type);
+void metric_add(int id, int64_t n);
+void metric_set(int id, int64_t value);
+int64_t get_metric(int id);
+int start_metrics_export();
+int stop_metrics_export();
+int read_process_metrics(int pid, metric_value_t* buf, int max);
+int print_metrics();
+
+/*******************************************************************************
+* ERROR REPORTING
+*
+* printf from a SCHED_FIFO thread can stall it for milliseconds when stdout
+* is a serial console or ssh session. The library's real-time paths report
+* through this channel instead and user code in the IMU callback and other
+* control loops can too.
+*
+* @ void report_error(const char* fmt, ...)
+*
+* printf style. The message is formatted into a preallocated ring without
+* locking and printed later by a low priority thread with the 
+* RT_SERVICE_ERRORS thread config, which initialize_cape starts and 
+* cleanup_cape stops after printing what is left. Each call site, told apart
+* by its format string, gets one report a second through and the repeats in
+* between are counted and noted on its next report. Without the thread
+* reports are printed immediately, still rate limited.
+*
+* @ int set_error_report_func(int (*func)(const error_report_t* r))
+*
+* Has the reporter thread pass each report to func instead of printing it,
+* to send them to the logger or telemetry for example. NULL to print again.
+*
+* @ uint64_t get_error_report_drops()
+*
+* Reports lost because the ring was full.
+*
+* @ int start_error_reporter()
+* @ int stop_error_reporter()
+*******************************************************************************/
+#define ERROR_REPORT_LEN	100
+
+typedef struct error_report_t{
+	uint64_t timestamp_micros;	// micros_since_boot() of the report
+	uint32_t suppressed;		// repeats held back since the last one
+	char text[ERROR_REPORT_LEN];
+} error_report_t;
+
+void report_error(const char* fmt, ...) \
+									__attribute__((format(printf, 1, 2)));
+int set_error_report_func(int (*func)(const error_report_t* r));
+uint64_t get_error_report_drops();
+int start_error_reporter();
+int stop_error_reporter();
+
+/*******************************************************************************
+* TELEMETRY LOGGER
+*
+* Fixed-schema binary records written from real-time threads into a
+* preallocated lock-free ring and drained by a low-priority writer thread to a
+* file that is synced every second. Logging never blocks the caller: if the
+* ring is full the record is dropped and counted. Decode logs with the
+* decode_log example or read them back with the log reader functions.
+*
+* @ int start_logger(const char* path, int ring_kb)
+* @ int stop_logger()
+*
+* start_logger truncates path, allocates ring_kb of 128 byte slots (0 for
+* 256kB) and starts the writer with the RT_SERVICE_LOGGER thread config.
+* stop_logger writes out everything committed and closes the file.
+*
+* @ int set_logger_sources(int sources)
+* @ int get_logger_sources()
+*
+* A mask of LOG_SOURCE_IMU, LOG_SOURCE_MOTORS and LOG_SOURCE_DSM makes the
+* library log every IMU sample, motor command and DSM frame itself. 
+* LOG_SOURCE_BATTERY logs each new status published by battery_monitor.
+*
+* @ void* log_reserve(uint16_t type, uint16_t length, uint64_t timestamp_micros)
+* @ int log_commit(void* payload)
+*
+* Zero-copy record writes. log_reserve returns space for length bytes, up to
+* LOG_MAX_PAYLOAD, to fill in place then hand to log_commit. Returns NULL if
+* the logger isn't running or the ring is full. A timestamp of 0 means now.
+* Use types from LOG_RECORD_USER up for your own records.
+*
+* @ int log_write(uint16_t type, const void* data, uint16_t length,
+*												uint64_t timestamp_micros)
+* @ int log_imu_data(const imu_data_t* data, uint64_t timestamp_micros)
+* @ int log_motor_duties(const float duty[4], int mask)
+* @ int log_dsm_frame(const dsm_frame_t* frame)
+* @ int log_encoders(const int pos[4], uint64_t timestamp_micros)
+* @ int log_adc_raw(const int raw[8], uint64_t timestamp_micros)
+* @ int log_battery_status(const battery_status_t* status)
+*
+* Copying writers for an existing buffer and for the library's own record
+* types. mask says which of the 4 motors the duties apply to.
+*
+* @ int pack_log_imu_record(log_imu_record_t* r, const imu_data_t* data)
+* @ int pack_log_motor_record(log_motor_record_t* r, const float duty[4],
+*																int mask)
+* @ int pack_log_dsm_record(log_dsm_record_t* r, const dsm_frame_t* frame)
+* @ int pack_log_battery_record(log_battery_record_t* r,
+*											const battery_status_t* status)
+*
+* Fill a record in place, for instance in space from log_reserve or
+* telemetry_reserve.
+*
+* @ uint64_t get_logger_drops()
+* @ uint64_t get_logger_records()
+*
+* Records dropped because the ring was full and records written to the file.
+*
+* @ int open_log_reader(log_reader_t* reader, const char* path)
+* @ int read_log_record(log_reader_t* reader, log_record_header_t* hdr,
+*												void* payload, int max_bytes)
+* @ int close_log_reader(log_reader_t* reader)
+*
+* Reads a log back in order. read_log_record returns 1 for each record with
+* its length in hdr, 0 at the end of the file, or -1 on a truncated or 
+* oversized record.
+*******************************************************************************/
+#define LOG_MAX_PAYLOAD		104
+
+#define LOG_SOURCE_IMU		(1<<0)
+#define LOG_SOURCE_MOTORS	(1<<1)
+#define LOG_SOURCE_DSM		(1<<2)
+#define LOG_SOURCE_BATTERY	(1<<3)
+
+typedef enum log_record_type_t{
+	LOG_RECORD_IMU = 1,
+	LOG_RECORD_MOTOR,
+	LOG_RECORD_DSM,
+	LOG_RECORD_ENCODER,
+	LOG_RECORD_ADC,
+	LOG_RECORD_BATTERY,
+	LOG_RECORD_USER = 64
+} log_record_type_t;
+
+typedef struct log_record_header_t{
+	uint16_t type;				// log_record_type_t or a user type
+	uint16_t length;			// payload bytes following this header
+	uint32_t seq;				// increments with every record reserved
+	uint64_t timestamp_micros;	// micros_since_boot()
+} log_record_header_t;
+
+typedef struct log_imu_record_t{
+	float accel[3];
+	float gyro[3];
+	float mag[3];
+	float temp;
+	float dmp_quat[4];
+	float dmp_TaitBryan[3];
+	float fused_quat[4];
+	float fused_TaitBryan[3];
+	float compass_heading;
+	float compass_heading_raw;
+} log_imu_record_t;
+
+typedef struct log_motor_record_t{
+	float duty[4];
+	int32_t mask;				// bit n set if motor n+1 was commanded
+} log_motor_record_t;
+
+typedef struct log_dsm_record_t{
+	uint32_t frame_count;
+	int16_t num_channels;
+	int16_t resolution;
+	int16_t raw[DSM_MAX_CHANNELS];
+	int16_t reserved;
+	float normalized[DSM_MAX_CHANNELS];
+} log_dsm_record_t;
+
+typedef struct log_encoder_record_t{
+	int32_t pos[4];
+} log_encoder_record_t;
+
+typedef struct log_adc_record_t{
+	int32_t raw[8];
+} log_adc_record_t;
+
+typedef struct log_battery_record_t{
+	float v_pack;
+	float v_jack;
+	float cell_voltage;
+	int32_t num_cells;
+	int32_t pack_connected;
+	int32_t charging;
+} log_battery_record_t;
+
+typedef struct log_reader_t{
+	FILE* fp;
+	uint32_t version;
+	uint64_t start_micros;		// when the log was started
+	uint64_t records;			// records read so far
+} log_reader_t;
+
+int start_logger(const char* path, int ring_kb);
+int stop_logger();
+int set_logger_sources(int sources);
+int get_logger_sources();
+void* log_reserve(uint16_t type, uint16_t length, uint64_t timestamp_micros);
+int log_commit(void* payload);
+int log_write(uint16_t type, const void* data, uint16_t length, \
+												uint64_t timestamp_micros);
+int log_imu_data(const imu_data_t* data, uint64_t timestamp_micros);
+int log_motor_duties(const float duty[4], int mask);
+int log_dsm_frame(const dsm_frame_t* frame);
+int log_encoders(const int pos[4], uint64_t timestamp_micros);
+int log_adc_raw(const int raw[8], uint64_t timestamp_micros);
+int log_battery_status(const battery_status_t* status);
+int pack_log_imu_record(log_imu_record_t* r, const imu_data_t* data);
+int pack_log_motor_record(log_motor_record_t* r, const float duty[4], \
+																	int mask);
+int pack_log_dsm_record(log_dsm_record_t* r, const dsm_frame_t* frame);
+int pack_log_battery_record(log_battery_record_t* r, \
+											const battery_status_t* status);
+uint64_t get_logger_drops();
+uint64_t get_logger_records();
+int open_log_reader(log_reader_t* reader, const char* path);
+int read_log_record(log_reader_t* reader, log_record_header_t* hdr, \
+												void* payload, int max_bytes);
+int close_log_reader(log_reader_t* reader);
+
+/*******************************************************************************
+* UDP TELEMETRY
+*
+* Streams the same binary records as the logger to a ground station over
+* UDP. Producers fill records in place in a preallocated lock-free ring and 
+* never block. A low priority sender thread gathers committed records into 
+* datagrams of at most TELEMETRY_MAX_DATAGRAM bytes, pointing straight at 
+* the ring slots rather than copying them, and sends a whole batch of 
+* datagrams with one sendmmsg call. Records that don't fit in the ring or
+* the socket buffer are dropped and counted.
+*
+* Each datagram is a telemetry_datagram_header_t followed by records laid
+* out exactly as in a log file, a log_record_header_t then its payload.
+*
+* @ int start_telemetry(const char* address, int port, int ring_kb)
+* @ int stop_telemetry()
+*
+* Sends to an IPv4 address, which may be a broadcast address, and starts the
+* sender with the RT_SERVICE_TELEMETRY thread config. ring_kb of 0 uses 
+* 128kB of 128 byte slots.
+*
+* @ int set_telemetry_sources(int sources)
+* @ int get_telemetry_sources()
+*
+* The same LOG_SOURCE_* mask as set_logger_sources, the two are independent.
+*
+* @ void* telemetry_reserve(uint16_t type, uint16_t length,
+*												uint64_t timestamp_micros)
+* @ int telemetry_commit(void* payload)
+* @ int telemetry_write(uint16_t type, const void* data, uint16_t length,
+*												uint64_t timestamp_micros)
+* @ int telemetry_imu_data(const imu_data_t* data, uint64_t timestamp_micros)
+* @ int telemetry_motor_duties(const float duty[4], int mask)
+* @ int telemetry_dsm_frame(const dsm_frame_t* frame)
+* @ int telemetry_battery_status(const battery_status_t* status)
+*
+* Work exactly like their log_ counterparts. Every slot reserved must be
+* committed, stop_telemetry waits for outstanding ones before freeing the ring.
+*
+* @ int get_telemetry_stats(telemetry_stats_t* stats)
+*******************************************************************************/
+#define TELEMETRY_MAX_DATAGRAM	1472	// fits a 1500 byte MTU unfragmented
+#define TELEMETRY_MAGIC			0x4d544352	// "RCTM" little endian
+#define TELEMETRY_VERSION		1
+
+typedef struct telemetry_datagram_header_t{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t records;			// records following in this datagram
+	uint32_t seq;				// increments with every datagram sent
+} telemetry_datagram_header_t;
+
+typedef struct telemetry_stats_t{
+	uint64_t records;			// records sent
+	uint64_t datagrams;			// datagrams sent
+	uint64_t drops;				// records dropped with the ring full
+	uint64_t send_drops;		// datagrams the socket didn't take
+} telemetry_stats_t;
+
+int start_telemetry(const char* address, int port, int ring_kb);
+int stop_telemetry();
+int set_telemetry_sources(int sources);
+int get_telemetry_sources();
+void* telemetry_reserve(uint16_t type, uint16_t length, \
+												uint64_t timestamp_micros);
+int telemetry_commit(void* payload);
+int telemetry_write(uint16_t type, const void* data, uint16_t length, \
+												uint64_t timestamp_micros);
+int telemetry_imu_data(const imu_data_t* data, uint64_t timestamp_micros);
+int telemetry_motor_duties(const float duty[4], int mask);
+int telemetry_dsm_frame(const dsm_frame_t* frame);
+int telemetry_battery_status(const battery_status_t* status);
+int get_telemetry_stats(telemetry_stats_t* stats);
+
+/*******************************************************************************
+* SENSOR REPLAY
+*
+* Runs estimators and controllers against a log from the telemetry logger 
+* instead of the hardware, including on a PC. Logged IMU samples and DSM
+* frames are delivered in order through the normal imu_data_t, 
+* imu_interrupt_func, dsm frame and new dsm data callback paths, and
+* get_encoder_pos and get_adc_raw return the newest logged values. 
+*
+* @ int open_replay(const char* path)
+*
+* Enters replay mode. Call before initialize_imu_dmp and initialize_dsm which
+* then skip the hardware entirely. initialize_cape is not needed.
+*
+* @ int start_replay(float speed)
+* @ int wait_for_replay()
+*
+* Starts delivering records from a RT_SERVICE_APP thread, SCHED_OTHER by
+* default so a fast replay can't starve the rest of the system. speed 1 is
+* real time, 100 is 100 times faster and 0 is as fast as the callbacks
+* return. Timestamps are shifted so the first record lands when replay
+* starts, keeping their spacing at any speed. wait_for_replay blocks until
+* the end of the log and returns the number of records delivered.
+*
+* @ int close_replay()
+* @ int is_replay_mode()
+* @ int is_replay_finished()
+*
+* close_replay stops delivery and leaves replay mode. Call power_off_imu and
+* stop_dsm_service first as usual.
+*******************************************************************************/
+int open_replay(const char* path);
+int start_replay(float speed);
+int wait_for_replay();
+int close_replay();
+int is_replay_mode();
+int is_replay_finished();
+
+/*******************************************************************************
+* SIMULATION
+*
+* Runs programs against a model of the robot instead of the cape, on the
+* BeagleBone or a PC. The plant's step function is given the motor outputs
+* and advances the model by dt seconds, updating whatever sensor values it
+* models. Values it leaves alone keep their last value, starting from a level
+* robot at rest with an 8V battery. Its return is 0 to carry on, 1 to end the
+* run or -1 on error.
+*
+* Each step goes out through the same paths as a real sample: imu_data_t is
+* filled in and the imu_interrupt_func runs, DSM frames arrive every 11ms
+* once dsm_channels is set, get_encoder_pos and get_adc_raw return the
+* plant's values and set_motor and friends feed the next step. The attitude
+* in quat stands for both dmp_quat and fused_quat, give it in the frame the
+* DMP would report after the orientation in imu_config_t.
+*
+* @ int open_sim(sim_plant_t plant)
+*
+* Enters simulation mode. Call before initialize_cape, initialize_imu_dmp and
+* initialize_dsm which then skip the hardware. initialize_cape in this mode
+* doesn't stop other robotics cape programs or write the pid file either, so
+* any number of simulations can run at once.
+*
+* @ int start_sim(float speed, float duration_s)
+* @ int wait_for_sim()
+*
+* Starts stepping the plant from a RT_SERVICE_APP thread, SCHED_OTHER by
+* default so parallel runs as fast as possible share the cpus with
+* everything else. One step runs per sample at the rate initialize_imu_dmp
+* was given, so call that first. micros_since_boot returns the simulated clock until close_sim, 
+* advancing exactly one sample period per step, and the IMU callback runs in
+* the sim thread even with callback_worker set, so the same plant and
+* controller always produce the same run. speed 1 is real time, 100 is 100
+* times faster and 0 is as fast as the callbacks return. duration_s 0 runs
+* until close_sim, the plant ends it or the state is EXITING. wait_for_sim
+* blocks until the run ends and returns the number of steps taken.
+*
+* @ int close_sim()
+* @ int is_sim_mode()
+* @ int is_sim_finished()
+* @ uint64_t get_sim_steps()
+*
+* close_sim stops stepping and leaves simulation mode. Call power_off_imu and
+* cleanup_cape first as usual. Building the library with "make SIM=1"
+* puts it in simulation mode for good instead, so programs linked against
+* that build can't reach the hardware even before open_sim. Servos, the PRU,
+* continuous ADC sampling and the other buses are not simulated.
+*******************************************************************************/
+typedef struct sim_outputs_t{
+	float duty[4];				// -1 to 1 as given to set_motor
+	int brake;					// bit n set while motor n+1 brakes
+	int enabled;				// 0 until enable_motors, duty is 0 then
+} sim_outputs_t;
+
+typedef struct sim_sensors_t{
+	float accel[3];		// m/s^2 as in imu_data_t
+	float gyro[3];		// degrees/s
+	float mag[3];		// uT
+	float temp;			// degrees Celsius
+	float quat[4];		// attitude, normalized
+	int encoder[4];		// counts
+	int adc_raw[8];		// 12 bit readings, see get_adc_raw
+	int dsm_channels;	// 0 for no radio
+	int dsm_us[DSM_MAX_CHANNELS];	// pulse widths in microseconds
+} sim_sensors_t;
+
+typedef struct sim_plant_t{
+	int (*step)(void* ctx, float dt, const sim_outputs_t* out, \
+														sim_sensors_t* in);
+	void* ctx;			// passed to step as is
+} sim_plant_t;
+
+int open_sim(sim_plant_t plant);
+int start_sim(float speed, float duration_s);
+int wait_for_sim();
+int close_sim();
+int is_sim_mode();
+int is_sim_finished();
+uint64_t get_sim_steps();
+
+/*******************************************************************************
+* SENSOR HUB
+*
+* Only one process can own the IMU, DSM receiver and PRU at a time. The hub
+* lets that process publish every IMU sample, DSM frame and encoder reading
+* into shared memory so any number of other processes, such as a logger or
+* telemetry server, consume the same stream without touching the hardware.
+* The sensor_hub program in roboticscape_service is such an owner. Clients
+* never block the owner, and they sleep on a futex between samples.
+*
+* @ int start_sensor_hub_server(int sources)
+* @ int stop_sensor_hub_server()
+* @ int get_sensor_hub_sources()
+*
+* Used by the owner once the hardware is initialized. sources is a mask of
+* HUB_SOURCE_IMU, HUB_SOURCE_DSM and HUB_SOURCE_ENCODERS. Encoders are read
+* with each IMU sample and share its timestamp so they need the IMU running.
+* Fails if another live process already owns the hub. cleanup_cape stops it.
+*
+* @ int connect_sensor_hub()
+* @ int disconnect_sensor_hub()
+* @ int is_sensor_hub_running()
+*
+* Client side. The functions below connect on first use so calling
+* connect_sensor_hub is optional, it returns -1 if no owner ever started.
+* disconnect_sensor_hub also stops the callback threads.
+*
+* @ int hub_get_latest_imu_sample(imu_sample_t* sample)
+* @ int hub_get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max)
+* @ int hub_get_dsm_frame(dsm_frame_t* frame)
+* @ int hub_get_encoder_sample(hub_encoder_sample_t* sample)
+*
+* Same semantics as get_latest_imu_sample, get_imu_samples_since and
+* get_dsm_frame. Sequence numbers are the hub's own and the IMU ring holds
+* the last 256 samples.
+*
+* @ int64_t hub_wait_for_imu_sample(uint64_t seq, int timeout_ms)
+*
+* Sleeps until a sample newer than seq exists and returns the newest seq, or
+* -1 after timeout_ms. 0 waits forever.
+*
+* @ int set_hub_imu_func(int (*func)(imu_sample_t* sample))
+* @ int set_hub_dsm_func(int (*func)(dsm_frame_t* frame))
+*
+* The client versions of set_imu_interrupt_func and set_new_dsm_data_func.
+* func runs in a thread of the client process for every new sample.
+*******************************************************************************/
+#define HUB_SOURCE_IMU		(1<<0)
+#define HUB_SOURCE_DSM		(1<<1)
+#define HUB_SOURCE_ENCODERS	(1<<2)
+
+typedef struct hub_encoder_sample_t{
+	uint64_t seq;				// increments by one with each sample
+	uint64_t timestamp_micros;	// timestamp of the IMU sample read with it
+	int pos[4];					// encoder channels 1-4
+} hub_encoder_sample_t;
+
+int start_sensor_hub_server(int sources);
+int stop_sensor_hub_server();
+int get_sensor_hub_sources();
+void hub_publish_imu_sample(imu_sample_t* sample);
+void hub_publish_dsm_frame(dsm_frame_t* frame);
+int connect_sensor_hub();
+int disconnect_sensor_hub();
+int is_sensor_hub_running();
+int hub_get_latest_imu_sample(imu_sample_t* sample);
+int hub_get_imu_samples_since(uint64_t seq, imu_sample_t* buf, int max);
+int hub_get_dsm_frame(dsm_frame_t* frame);
+int hub_get_encoder_sample(hub_encoder_sample_t* sample);
+int64_t hub_wait_for_imu_sample(uint64_t seq, int timeout_ms);
+int set_hub_imu_func(int (*func)(imu_sample_t* sample));
+int set_hub_dsm_func(int (*func)(dsm_frame_t* frame));
+
+/*******************************************************************************
+* Attitude Estimation
+*
+* When not using the DMP, or when a higher update rate than the DMP's 200hz is
+* needed, orientation can be estimated on the BeagleBone from raw gyro, accel,
+* and optionally magnetometer readings at whatever rate they are sampled.
+*
+* @ attitude_estimator_t create_attitude_estimator(estimator_type_t type)
+*
+* ESTIMATOR_MADGWICK is a gradient descent filter with one gain, beta, in 
+* rad/s. ESTIMATOR_MAHONY is a complementary filter with PI gains kp and ki.
+* The defaults below suit an IMU sampled at a few hundred hz or faster and may
+* be changed in the struct at any time. For ESTIMATOR_CUSTOM fill in 
+* est.update with your own function, est.user is free for its use.
+*
+* @ int march_attitude_estimator(attitude_estimator_t* est, float gyro[3], 
+*							float accel[3], float mag[3], float dt)
+*
+* Advances the estimate by dt seconds. gyro is in rad/s, accel and mag may be
+* in any units. Pass NULL for mag to estimate from gyro and accel only in
+* which case yaw will drift. The result is in est.q which rotates body frame
+* vectors into a Z-up world frame.
+*
+* @ int march_estimator_imu_data(attitude_estimator_t* est, imu_data_t* data, 
+*												int use_mag, float dt)
+*
+* Convenience wrapper taking the latest readings from an imu_data_t, such as
+* after read_imu_all, and writing the result to data->fused_quat and 
+* data->fused_TaitBryan.
+*
+* @ int reset_attitude_estimator(attitude_estimator_t* est)
+*******************************************************************************/
+#define ESTIMATOR_DEFAULT_BETA	0.1f
+#define ESTIMATOR_DEFAULT_KP	1.0f
+#define ESTIMATOR_DEFAULT_KI	0.0f
+
+typedef enum estimator_type_t {
+	ESTIMATOR_MADGWICK,
+	ESTIMATOR_MAHONY,
+	ESTIMATOR_CUSTOM
+} estimator_type_t;
+
+typedef struct attitude_estimator_t{
+	estimator_type_t type;
+	float q[4];				// current estimate, body to world
+	float beta;				// Madgwick gain
+	float kp;				// Mahony proportional gain
+	float ki;				// Mahony integral gain
+	float integral[3];		// Mahony integral of error, rad/s
+	uint64_t steps;			// updates since reset
+	int (*update)(struct attitude_estimator_t* est, float gyro[3], \
+								float accel[3], float mag[3], float dt);
+	void* user;				// for use by custom update functions
+	int initialized;
+} attitude_estimator_t;
+
+attitude_estimator_t create_attitude_estimator(estimator_type_t type);
+int reset_attitude_estimator(attitude_estimator_t* est);
+int march_attitude_estimator(attitude_estimator_t* est, float gyro[3], \
+								float accel[3], float mag[3], float dt);
+int march_estimator_imu_data(attitude_estimator_t* est, imu_data_t* data, \
+												int use_mag, float dt);
 
 /*******************************************************************************
 * BMP280 Barometer
@@ -669,12 +2163,24 @@ uint64_t micros_since_last_interrupt();
 * meters based on the pressure received by the last call to the read_barometer()
 * function. Assuming current pressure at sea level is the default 101325 Pa.
 * Use set_sea_level_pressure_pa() if you know the current sea level pressure
-* and desire more accuracy. 
+* and desire more accuracy. Altitude is computed with an expansion about a 
+* recent reference pressure so powf only runs when altitude changes by tens of
+* meters, making reads at the full 182hz cheap.
 * 
 * @ int set_sea_level_pressure_pa(float pa)
 * If you know the current sea level pressure for your region and weather, you 
 * can use this to correct the altititude reading. This is not necessary if you
 * only care about differential altitude from a starting point.
+*
+* @ int start_barometer_service(int rate_hz)
+* @ int stop_barometer_service()
+* @ int get_barometer_sample(bmp_sample_t* sample)
+* Instead of calling read_barometer() from a control loop, a background 
+* thread can read the barometer at up to 182hz after initialize_barometer().
+* While the IMU is running in DMP mode each read is timed to fall just after
+* an IMU read so the two don't contend for the shared I2C bus.
+* get_barometer_sample() returns a consistent copy of the newest timestamped
+* reading from any thread without blocking.
 *******************************************************************************/
 typedef enum bmp_oversample_t{
 	BMP_OVERSAMPLE_1  =	(0x01<<2), // update rate 182 HZ
@@ -700,14 +2206,130 @@ float bmp_get_pressure_pa();
 float bmp_get_altitude_m();
 int set_sea_level_pressure_pa(float pa);
 
+typedef struct bmp_sample_t{
+	uint64_t seq;				// increments by one with each sample
+	uint64_t timestamp_micros;	// micros_since_boot() of the read
+	float temp_c;
+	float pressure_pa;
+	float altitude_m;
+} bmp_sample_t;
+
+int start_barometer_service(int rate_hz);
+int stop_barometer_service();
+int get_barometer_sample(bmp_sample_t* sample);
+
+/*******************************************************************************
+* VERTICAL ESTIMATOR
+*
+* Altitude and climb rate from the barometer fused with the accelerometer,
+* for altitude hold. The barometer alone is noisy and has no velocity, the
+* accel alone drifts within seconds.
+*
+* @ int start_vertical_estimator(vertical_estimator_config_t conf)
+* @ int stop_vertical_estimator()
+*
+* Runs inside the IMU driver on every on-board sample, rotating its accel
+* into the world frame with dmp_quat, or fused_quat with use_fused_quat, and
+* correcting from each new reading of the barometer service. Start the
+* barometer service and the IMU, in DMP mode with dmp_send_accel, first.
+* time_constant in seconds is how long the accel is trusted over the
+* barometer. Shorter follows the barometer more closely with more of its
+* noise, longer smooths more but takes a while to settle the accel bias.
+*
+* @ int get_vertical_estimate(vertical_estimate_t* est)
+*
+* Newest estimate from any thread without blocking the IMU. Nothing is
+* estimated until the first barometer reading after starting, ready is set
+* from then on. Altitude is the barometer's, relative to sea level pressure.
+*******************************************************************************/
+typedef struct vertical_estimator_config_t{
+	float time_constant;	// s, default 2
+	int use_fused_quat;		// rotate by fused_quat rather than dmp_quat
+} vertical_estimator_config_t;
+
+typedef struct vertical_estimate_t{
+	int ready;					// a barometer reading has arrived
+	float altitude_m;
+	float climb_rate;			// m/s, positive up
+	float vertical_accel;		// m/s^2 less gravity and bias
+	float accel_bias;			// m/s^2 estimated in the vertical accel
+	float baro_altitude_m;		// last barometer reading
+	uint64_t timestamp_micros;	// micros_since_boot() of the IMU sample
+	uint64_t imu_updates;
+	uint64_t baro_updates;
+} vertical_estimate_t;
+
+vertical_estimator_config_t get_default_vertical_estimator_config();
+int start_vertical_estimator(vertical_estimator_config_t conf);
+int stop_vertical_estimator();
+int get_vertical_estimate(vertical_estimate_t* est);
+
 
 /*******************************************************************************
 * GPS
 *
-* work in progress
+* @ int initialize_gps(int baud)
+*
+* Registers the GPS port on the GPS header with the reactor thread so NMEA 
+* sentences are parsed incrementally as bytes arrive without any heap 
+* allocation.
+*
+* @ int set_gps_sentence_mask(int mask)
+*
+* Chooses which sentences update the fix by OR-ing GPS_SENTENCE_GGA, 
+* GPS_SENTENCE_RMC, and GPS_SENTENCE_VTG. All three are decoded by default.
+*
+* @ int get_gps_fix(gps_fix_t* fix)
+*
+* Returns a consistent copy of the latest fix, safe to call from any thread.
+* seq increments with every decoded sentence and timestamp_micros is the 
+* micros_since_boot() time that sentence started arriving. Returns -1 if 
+* nothing has been decoded yet.
+*
+* @ int is_gps_active()
+*
+* Returns 1 if the GPS has sent anything in the last second.
+*
+* @ int configure_gps_ubx(int rate_hz)
+*
+* For u-blox receivers. Switches the port to binary UBX output with the
+* NAV-PVT and NAV-DOP messages at rate_hz (1-25) without changing baud. They
+* then fill the same gps_fix_t, hdop coming from NAV-DOP, adding fix_type,
+* NED velocity, and accuracy estimates.
+* The listener decodes NMEA and UBX at the same time so this can be called 
+* any time after initialize_gps. Returns 0 when the receiver acknowledges.
 *
 *******************************************************************************/
+#define GPS_SENTENCE_GGA	0x01
+#define GPS_SENTENCE_RMC	0x02
+#define GPS_SENTENCE_VTG	0x04
+
+typedef struct gps_fix_t{
+	uint64_t seq;				// increments with each decoded sentence
+	uint64_t timestamp_micros;	// micros_since_boot() the sentence began
+	int valid;					// 1 when RMC reports an active fix
+	int fix_quality;			// GGA 0:none 1:GPS 2:DGPS 4:RTK ...
+	int satellites;				// number used in fix
+	double lat;					// decimal degrees, negative south
+	double lon;					// decimal degrees, negative west
+	float altitude_m;			// above mean sea level
+	float hdop;					// horizontal dilution of precision
+	float speed_ms;				// ground speed
+	float course_deg;			// true course over ground
+	double utc_time;			// hhmmss.sss
+	int utc_date;				// ddmmyy
+	// only filled in by UBX NAV-PVT
+	int fix_type;				// 0:none 2:2D 3:3D 4:GNSS+dead reckoning
+	float vel_ned[3];			// north east down velocity m/s
+	float h_acc_m;				// horizontal accuracy estimate
+	float v_acc_m;				// vertical accuracy estimate
+} gps_fix_t;
+
 int initialize_gps(int baud);
+int set_gps_sentence_mask(int mask);
+int get_gps_fix(gps_fix_t* fix);
+int is_gps_active();
+int configure_gps_ubx(int rate_hz);
 int stop_gps_service();
 
 
@@ -726,17 +2348,32 @@ int stop_gps_service();
 * without initializing. i2c_init only needs to be called once per bus.
 * 
 * @ int set_device_address(int bus, uint8_t devAddr)
-* Use this to change to another device address after initialization.
+* Use this to change to another device address after initialization. This is
+* free, the address ioctl is only issued when a write actually needs it.
 * 
 * @ int i2c_close(int bus) 
 * Closes the bus and device file descriptors.
 *
 * @int i2c_claim_bus(int bus)
+* @int i2c_claim_bus_priority(int bus, int priority)
 * @int i2c_release_bus(int bus)
 * @int i2c_get_in_use_state(int bus)
-* Claim and release bus are purely for the convenience of the user and are not 
-* necessary. They simply set a flag indicating that the bus is in use to help 
-* manage multiple device access in multithreaded applications.
+* Each bus has an arbiter so transfers from different threads never
+* interleave. Claiming blocks until the bus is free and no thread of higher
+* priority is waiting, then holds it for the calling thread until released.
+* Claims nest, and every read/write function below claims the bus for its own
+* duration, so holding a claim across several calls makes them one atomic 
+* transaction. i2c_claim_bus uses I2C_PRIORITY_NORMAL. The IMU claims
+* I2C_PRIORITY_IMU right after its interrupt so it waits at most for the one
+* transaction already in flight. i2c_get_in_use_state returns 1 only if
+* another thread holds the bus.
+*
+* @ int i2c_submit_job(int bus, i2c_job_t* job)
+* Queues a single register read or write for the bus owner thread, which is 
+* started on first use and runs jobs in priority order, first-come 
+* first-served within a priority. Blocks until the job has run and returns 0
+* on success or -1 on failure. The job carries its own device address and the
+* bus address is restored afterwards.
 *
 * @ int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data)
 * @ int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t *data)
@@ -755,20 +2392,65 @@ int stop_gps_service();
 * These write values write a value to a particular register on the previously
 * selected device.
 *
+* @ int i2c_write_regs(int bus, const i2c_reg_write_t* regs, int n)
+* Writes a list of up to 64 single register values to the current device in
+* order. Consecutive register addresses are merged into one auto-incremented
+* write and the whole list normally goes out in one ioctl. Only use this
+* where the device needs no delay between the writes. Returns 0 on success,
+* -1 on failure.
+*
 * @ int i2c_send_bytes(int bus, uint8_t length, uint8_t* data)
 * @ int i2c_send_byte(int bus, uint8_t data)
 * Instead of automatically sending a device address before the data which is 
 * what happens in the above read and write functions, the i2c_send functions 
 * send only the data given by the data argument. This is useful for more
 * complicated IO such as uploading firmware to a device.
+*
+* @ int i2c_transfer_batch(int bus, i2c_read_req_t* reqs, int n)
+* Performs up to 21 register reads in a single ioctl call. Each request 
+* carries its own device address so several devices on the same bus can be 
+* read in one go. Returns 0 on success, -1 on failure. This does not change
+* the device address set with i2c_set_device_address.
 *******************************************************************************/
+#define I2C_PRIORITY_LOW	0
+#define I2C_PRIORITY_NORMAL	1
+#define I2C_PRIORITY_HIGH	2
+#define I2C_PRIORITY_IMU	3
+#define I2C_PRIORITY_LEVELS	4
+
+typedef struct i2c_job_t{
+	uint8_t devAddr;	// 7-bit address of device
+	uint8_t regAddr;	// first register to read or write
+	uint8_t length;		// number of bytes
+	uint8_t* data;		// user buffer at least length bytes long
+	int write;			// 1 to write data to the device, 0 to read
+	int priority;		// I2C_PRIORITY_LOW to I2C_PRIORITY_IMU
+	int result;			// filled in when done, 0 or -1
+	volatile int done;	// used internally
+	struct i2c_job_t* next;	// used internally
+} i2c_job_t;
+
+typedef struct i2c_reg_write_t{
+	uint8_t regAddr;	// register to write
+	uint8_t data;		// value to write to it
+} i2c_reg_write_t;
+
+typedef struct i2c_read_req_t{
+	uint8_t devAddr;	// 7-bit address of device to read from
+	uint8_t regAddr;	// first register to read
+	uint8_t length;		// number of bytes to read
+	uint8_t* data;		// user buffer at least length bytes long
+} i2c_read_req_t;
+
 int i2c_init(int bus, uint8_t devAddr);
 int i2c_close(int bus);
 int i2c_set_device_address(int bus, uint8_t devAddr);
  
 int i2c_claim_bus(int bus);
+int i2c_claim_bus_priority(int bus, int priority);
 int i2c_release_bus(int bus);
 int i2c_get_in_use_state(int bus);
+int i2c_submit_job(int bus, i2c_job_t* job);
 
 int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data);
 int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,  uint8_t *data);
@@ -781,9 +2463,11 @@ int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t* data);
 int i2c_write_word(int bus, uint8_t regAddr, uint16_t data);
 int i2c_write_words(int bus, uint8_t regAddr, uint8_t length, uint16_t* data);
 int i2c_write_bit(int bus, uint8_t regAddr, uint8_t bitNum, uint8_t data);
+int i2c_write_regs(int bus, const i2c_reg_write_t* regs, int n);
 
 int i2c_send_bytes(int bus, uint8_t length, uint8_t* data);
 int i2c_send_byte(int bus, uint8_t data);
+int i2c_transfer_batch(int bus, i2c_read_req_t* reqs, int n);
 
 
 
@@ -798,6 +2482,18 @@ int i2c_send_byte(int bus, uint8_t data);
 * with select/deselect_spi_slave() functions. On the Robotics Cape, slave 1
 * can be used in either mode, but slave 2 must be selected manually. On the
 * BB Blue either slave can be used in manual or automatic modes. 
+*
+* @ int spi_transfer_list(spi_xfer_t* list, int n, int slave)
+* Submits up to 32 transfers to one slave in a single ioctl. Either data 
+* pointer of an entry may be NULL for write-only or read-only transfers. 
+* Transfers within the list keep the slave selected unless cs_change is set,
+* in which case it is deselected before the next transfer starts. It is
+* ignored on the last transfer, the slave is always deselected at the end of
+* the list. Use this to batch a burst of register reads, e.g. alternating
+* 1-byte address writes with cs_change=0 and reads with cs_change=1. speed_hz
+* overrides the clock given to initialize_spi for that one transfer, leave it
+* 0 otherwise, so devices with faster data registers can be read quickly.
+* Returns the total number of bytes transferred or -1 on error.
 *******************************************************************************/
 typedef enum ss_mode_t{
 	SS_MODE_AUTO,
@@ -821,19 +2517,92 @@ char spi_read_reg_byte(char reg_addr, int slave);
 int spi_read_reg_bytes(char reg_addr, char* data, int bytes, int slave);
 int spi_transfer(char* tx_data, int tx_bytes, char* rx_data, int slave);
 
+typedef struct spi_xfer_t{
+	const char* tx_data;	// bytes to send, NULL to clock out zeros
+	char* rx_data;			// buffer for the response, NULL to discard it
+	int bytes;				// length of this transfer
+	int cs_change;			// 1 to deselect the slave after this transfer
+	int speed_hz;			// 0 for the speed given to initialize_spi
+} spi_xfer_t;
+
+int spi_transfer_list(spi_xfer_t* list, int n, int slave);
+
 
 /*******************************************************************************
 * UART
+*
+* @ int initialize_uart(int bus, int speed, float timeout)
+* @ int initialize_uart_config(int bus, uart_config_t conf)
+* @ uart_config_t get_default_uart_config()
+*
+* initialize_uart opens a bus at 8N1. initialize_uart_config also takes the
+* parity, stop bits and the latency options. Any baudrate from 50 to 3686400
+* is accepted, rates without a termios constant such as 100000 for SBUS are
+* set through termios2. low_latency sets ASYNC_LOW_LATENCY on the driver and
+* rx_trigger, if not 0, the number of bytes the hardware FIFO collects before
+* interrupting. Both trade a few more interrupts for less time between a byte
+* arriving and read() returning it, and are only warned about if the kernel
+* doesn't support them.
+*
+* @ int set_uart_read_min(int bus, int bytes)
+*
+* Makes poll() and read() on the bus's fd wait for a whole fixed-size packet
+* rather than waking on every byte. See simple_uart.c for details.
+*
+* @ int uart_start_rx_thread(int bus, int ring_size)
+* @ int uart_stop_rx_thread(int bus)
+* Starts or stops a background thread that reads everything arriving on the
+* bus in large chunks into a ring buffer of ring_size bytes (a power of 2, or
+* 0 for 4096). While it runs, uart_read_bytes, uart_read_line and 
+* uart_bytes_available are served from the ring. close_uart stops it.
+*
+* @ int uart_set_rx_callback(int bus, void (*func)(int bus, int bytes))
+* func is called from the rx thread whenever new data arrives with the number
+* of bytes now waiting. Keep it short, the next read waits for it to return.
+*
+* @ int uart_rx_available(int bus)
+* @ int uart_rx_peek(int bus, char* buf, int max_bytes)
+* @ int uart_rx_consume(int bus, int bytes)
+* @ int uart_rx_read(int bus, char* buf, int max_bytes)
+* Non-blocking access to the ring. peek copies without removing so a parser 
+* can wait for a whole packet, consume then drops the bytes it used. Only one
+* thread should consume from a bus. Each returns a byte count or -1 if the rx
+* thread is not running.
 *******************************************************************************/
+typedef enum uart_parity_t{
+	UART_PARITY_NONE,
+	UART_PARITY_EVEN,
+	UART_PARITY_ODD
+} uart_parity_t;
+
+typedef struct uart_config_t{
+	int baudrate;
+	float timeout_s;		// >=0.1
+	uart_parity_t parity;
+	int stop_bits;			// 1 or 2
+	int low_latency;		// set ASYNC_LOW_LATENCY
+	int rx_trigger;			// rx FIFO interrupt level in bytes, 0 for default
+} uart_config_t;
+
+uart_config_t get_default_uart_config();
 int initialize_uart(int bus, int speed, float timeout);
+int initialize_uart_config(int bus, uart_config_t conf);
 int close_uart(int bus);
 int get_uart_fd(int bus);
 int flush_uart(int bus);
+int set_uart_read_min(int bus, int bytes);
 int uart_send_bytes(int bus, int bytes, char* data);
 int uart_send_byte(int bus, char data);
 int uart_read_bytes(int bus, int bytes, char* buf);
 int uart_read_line(int bus, int max_bytes, char* buf);
 int uart_bytes_available(int bus);
+int uart_start_rx_thread(int bus, int ring_size);
+int uart_stop_rx_thread(int bus);
+int uart_set_rx_callback(int bus, void (*func)(int bus, int bytes));
+int uart_rx_available(int bus);
+int uart_rx_peek(int bus, char* buf, int max_bytes);
+int uart_rx_consume(int bus, int bytes);
+int uart_rx_read(int bus, char* buf, int max_bytes);
 
 /*******************************************************************************
 * CPU Frequency Control
@@ -854,6 +2623,28 @@ int uart_bytes_available(int bus);
 *
 * Prints the current frequency to the screen. For example "300MHZ".
 * Returns 0 on success or -1 on failure.
+*
+* @ int enable_cpu_performance_mode(int max_latency_us)
+*
+* For deterministic loop timing. Holds the cpu at full speed with the
+* performance governor so there is no frequency ramp after each IMU interrupt,
+* and uses /dev/cpu_dma_latency to keep the cpu out of idle states slower than
+* max_latency_us to wake from. 0 allows only the instant WFI idle. The governor
+* in use beforehand is saved.
+*
+* @ int disable_cpu_performance_mode()
+*
+* Releases the idle latency limit and restores the saved governor.
+*
+* @ int is_cpu_performance_mode()
+*
+* Returns 1 while performance mode is on, otherwise 0.
+*
+* @ int set_cpu_performance_follows_state(int enable)
+*
+* Ties performance mode to the program state: set_state(RUNNING) enables it
+* and PAUSED returns to power saving. EXITING leaves it for cleanup_cape,
+* which always restores the governor. Off by default.
 *******************************************************************************/
 typedef enum cpu_frequency_t{
 	FREQ_ONDEMAND,
@@ -866,6 +2657,138 @@ typedef enum cpu_frequency_t{
 int set_cpu_frequency(cpu_frequency_t freq);
 cpu_frequency_t get_cpu_frequency();
 int print_cpu_frequency();
+int enable_cpu_performance_mode(int max_latency_us);
+int disable_cpu_performance_mode();
+int is_cpu_performance_mode();
+int set_cpu_performance_follows_state(int enable);
+int cpu_performance_state_changed(state_t new_state);
+
+/*******************************************************************************
+* REAL-TIME THREADS
+*
+* Every thread the library starts takes its scheduling policy, priority and
+* CPU from one configuration so a control program can decide what runs under
+* SCHED_FIFO and where. Without root the policies are refused and threads run
+* under the normal scheduler, which print_rt_summary reports.
+*
+* @ rt_config_t get_default_rt_config()
+*
+* Control watchdog at SCHED_FIFO max, IMU interrupt thread at max-1, its 
+* callback worker at max-2, the reactor at SCHED_FIFO max/2, everything else
+* SCHED_OTHER on any cpu. Memory is not locked. Stacks are 128K, or 512K for
+* threads that run user code: the IMU interrupt thread, which calls the
+* interrupt function directly, its callback worker, the control watchdog,
+* which calls the trip function, the reactor and RT_SERVICE_APP. Library
+* builds with SMALL_MEMORY=1 halve those.
+*
+* @ int set_rt_config(rt_config_t conf)
+* @ rt_config_t get_rt_config()
+*
+* Applies to threads started afterwards, so call set_rt_config before
+* initialize_cape and before starting any service. The IMU's
+* dmp_interrupt_priority still sets that thread's priority. cpu -1 means any.
+* stack_kb 0 gives the system default, usually 8MB, which once memory is
+* locked is all resident. Returns -1 if a policy, priority, cpu or stack size
+* is out of range.
+*
+* @ int lock_rt_memory()
+*
+* Locks current and future pages in RAM and prefaults prefault_stack_kb of
+* stack. initialize_cape calls this when lock_memory is set and each library
+* thread then prefaults its own stack. Returns -1 if not permitted.
+*
+* @ int create_rt_thread(pthread_t* thread, rt_service_t service,
+*									void* (*func)(void*), void* arg)
+*
+* pthread_create with the service's configuration applied through the thread
+* attributes. Used by the library itself but available for user threads,
+* which can run under RT_SERVICE_APP.
+*
+* @ int print_rt_summary()
+*
+* Prints requested and actual policy & priority of each service's threads.
+*******************************************************************************/
+typedef enum rt_service_t{
+	RT_SERVICE_IMU,
+	RT_SERVICE_REACTOR,
+	RT_SERVICE_DSM,
+	RT_SERVICE_BAROMETER,
+	RT_SERVICE_I2C,
+	RT_SERVICE_UART,
+	RT_SERVICE_LOGGER,
+	RT_SERVICE_IMU_CALLBACK,
+	RT_SERVICE_WATCHDOG,
+	RT_SERVICE_TELEMETRY,
+	RT_SERVICE_ERRORS,
+	RT_SERVICE_APP,		// application threads and sensor hub callbacks
+	RT_SERVICE_COUNT
+} rt_service_t;
+
+typedef struct rt_thread_config_t{
+	int policy;		// SCHED_OTHER, SCHED_FIFO or SCHED_RR
+	int priority;	// 0 for SCHED_OTHER, 1-99 otherwise
+	int cpu;		// cpu to pin the thread to, -1 for any
+	int stack_kb;	// stack per thread, 0 for the system default
+} rt_thread_config_t;
+
+typedef struct rt_config_t{
+	rt_thread_config_t service[RT_SERVICE_COUNT];
+	int lock_memory;		// mlockall in initialize_cape
+	int prefault_stack_kb;	// stack touched per thread when locked
+} rt_config_t;
+
+rt_config_t get_default_rt_config();
+int set_rt_config(rt_config_t conf);
+rt_config_t get_rt_config();
+int lock_rt_memory();
+int create_rt_thread(pthread_t* thread, rt_service_t service, \
+										void* (*func)(void*), void* arg);
+int print_rt_summary();
+
+/*******************************************************************************
+* CONTROL WATCHDOG
+*
+* Stops the motors and servos if the control loop stops running, without 
+* relying on the loop, the rest of the program, or another process.
+*
+* @ int start_control_watchdog(int timeout_us)
+* @ int feed_control_watchdog()
+* @ int stop_control_watchdog()
+*
+* After starting, the control loop must call feed_control_watchdog at least
+* every timeout_us (100us to 1s). A thread at the top real-time priority 
+* wakes at each deadline and if no feed arrived pulls the motor standby pin
+* low, zeroes the motor PWM duty and stops the PRU servo pulses, all through
+* mmapped registers and shared memory in a few microseconds. Feed from one
+* thread only.
+*
+* @ int is_control_watchdog_tripped()
+* @ int rearm_control_watchdog()
+*
+* A trip latches until rearm_control_watchdog. Outputs stay off until the
+* program enables them again itself.
+*
+* @ int set_control_watchdog_func(void (*func)(void))
+* @ int get_control_watchdog_stats(control_watchdog_stats_t* stats)
+*
+* func is called from the watchdog thread after the outputs are cut. The
+* stats give how late after the deadline the last trip cut the outputs.
+*******************************************************************************/
+typedef struct control_watchdog_stats_t{
+	int running;
+	int tripped;
+	uint64_t trips;
+	uint64_t trip_late_us;		// deadline to outputs off, last trip
+	uint64_t trip_action_us;	// time spent cutting outputs, last trip
+} control_watchdog_stats_t;
+
+int start_control_watchdog(int timeout_us);
+int feed_control_watchdog();
+int stop_control_watchdog();
+int is_control_watchdog_tripped();
+int rearm_control_watchdog();
+int set_control_watchdog_func(void (*func)(void));
+int get_control_watchdog_stats(control_watchdog_stats_t* stats);
 
 /*******************************************************************************
 * Useful Functions
@@ -884,6 +2807,20 @@ int print_cpu_frequency();
 * the rand() function from stdlib.h only returns and integer. This is an
 * optimized routine using bitwise operation instead of floating point division.
 *
+* @ int seed_random(uint32_t seed)
+* @ uint32_t get_random_uint32()
+* @ int fill_random_floats(float* buf, int n)
+* @ float get_random_gaussian()
+* @ int fill_random_gaussian(float* buf, int n, float mean, float std_dev)
+*
+* The random functions use a xoshiro128+ generator whose state is separate
+* for every thread, so they take no lock and can be called from any number of
+* threads at once, unlike rand(). Each thread seeds itself from the clock the
+* first time it asks for a number. Call seed_random in a thread to get the 
+* same sequence every run there, for instance for Monte Carlo tests. 
+* get_random_gaussian returns standard normal samples and the fill functions
+* write n values at once.
+*
 * @ saturate_float(float* val, float min, float max)
 *
 * Modifies val to be bounded between between min and max. Returns 1 if 
@@ -922,6 +2859,25 @@ int print_cpu_frequency();
 * handy function for getting current time in microseconds
 * so you don't have to deal with timespec structs
 *
+* @ uint64_t nanos_since_epoch()
+* @ uint64_t nanos_since_boot()
+* @ uint64_t micros_since_boot()
+*
+* The _since_boot functions use CLOCK_MONOTONIC which is never stepped or 
+* slewed backwards by NTP, so use them to measure elapsed time and loop dt.
+* The _since_epoch functions are wall-clock time, use them for logging only.
+*
+* @ int init_loop_timer(loop_timer_t* timer, float hz)
+* @ int loop_timer_wait(loop_timer_t* timer)
+*
+* Runs a loop at a fixed rate using absolute deadlines. Instead of sleeping for
+* a fixed period after the body, which drifts by the time the body takes, 
+* loop_timer_wait sleeps until the next multiple of the period on the monotonic
+* clock. Call init_loop_timer once before the loop and loop_timer_wait once per
+* iteration. loop_timer_wait returns 0 normally or 1 if the deadline had 
+* already passed, in which case missed periods are skipped and counted in 
+* timer->overruns.
+*
 * @ int suppress_stdout(int (*func)(void))
 *
 * Executes a functiton func with all outputs to stdout suppressed. func must
@@ -946,8 +2902,20 @@ int print_cpu_frequency();
 * This is a useful function for checking if the user wishes to continue with a 
 * process or quit.
 *******************************************************************************/
+typedef struct loop_timer_t{
+	uint64_t period_ns;		// loop period
+	uint64_t next_ns;		// next deadline on the monotonic clock
+	uint64_t overruns;		// number of periods missed
+	int initialized;
+} loop_timer_t;
+
 int null_func();
 float get_random_float();
+int seed_random(uint32_t seed);
+uint32_t get_random_uint32();
+int fill_random_floats(float* buf, int n);
+float get_random_gaussian();
+int fill_random_gaussian(float* buf, int n, float mean, float std_dev);
 int saturate_float(float* val, float min, float max);
 char *byte_to_binary(unsigned char x);
 timespec timespec_diff(timespec A, timespec B);
@@ -955,14 +2923,37 @@ void timespec_add(timespec* start, float seconds);
 uint64_t timespec_to_micros(timespec ts);
 uint64_t timeval_to_micros(timeval tv);
 uint64_t micros_since_epoch();
+uint64_t nanos_since_epoch();
+uint64_t nanos_since_boot();
+uint64_t micros_since_boot();
 int suppress_stdout(int (*func)(void));
 int suppress_stderr(int (*func)(void));
 int continue_or_quit();
+int init_loop_timer(loop_timer_t* timer, float hz);
+int loop_timer_wait(loop_timer_t* timer);
 
 /*******************************************************************************
 * Vector and Quaternion Math
 *
 * These are useful for dealing with IMU orientation data and general vector math
+*
+* @ void quaternionRotateVector(float q[4], float v[3], float out[3])
+*
+* Rotates vector v by unit quaternion q. This is equivalent to tilt_compensate
+* on a quaternion with zero real part but considerably cheaper.
+*
+* @ void normalizeQuaternionFast(float q[4])
+*
+* Normalizes a quaternion which has only drifted slightly from unit length
+* without a square root or division. Falls back to normalizeQuaternion if the
+* length is off by more than 0.1%.
+*
+* @ float fastAtan2f(float y, float x)
+* @ void quaternionToTaitBryanFast(float q[4], float v[3])
+*
+* Polynomial approximations of atan2f and quaternionToTaitBryan with maximum
+* error under 2e-6 radians. Set fast_math in imu_config_t to have the DMP 
+* routines use these.
 *******************************************************************************/
 // defines for index location within TaitBryan and quaternion arrays
 #define TB_PITCH_X	0
@@ -982,25 +2973,227 @@ void quaternionConjugate(float in[4], float out[4]);
 void quaternionMultiply(float a[4], float b[4], float out[4]);
 float vector3vector_dot_product(float a[3], float b[3]);
 void vector3CrossProduct(float a[3], float b[3], float d[3]);
+void quaternionRotateVector(float q[4], float v[3], float out[3]);
+void normalizeQuaternionFast(float q[4]);
+float fastAtan2f(float y, float x);
+void quaternionToTaitBryanFast(float q[4], float v[3]);
+
+/*******************************************************************************
+* Fixed Size 3D Math
+*
+* mat3_t, mat4_t, and vec3_t are plain structs which live on the stack or
+* inside other structs and are passed and returned by value. Unlike matrix_t
+* and vector_t they never allocate memory and every operation is written out
+* element by element, so they are the right choice for attitude math inside 
+* the IMU interrupt function and feedback controllers. Entries are row-major
+* and contiguous so create_matrix_view(&M.d[0][0],3,3) works when the general
+* linear algebra functions below are needed.
+*
+* @ mat3_t mat3_identity()
+* @ mat3_t mat3_multiply(mat3_t A, mat3_t B)
+* @ mat3_t mat3_transpose(mat3_t A)
+* @ vec3_t mat3_times_vec3(mat3_t A, vec3_t v)
+* @ float mat3_determinant(mat3_t A)
+* @ int mat3_invert(mat3_t A, mat3_t* out)
+*
+* mat3_invert returns -1 and leaves out untouched if A is singular.
+*
+* @ mat3_t quaternion_to_mat3(float q[4])
+*
+* Returns the rotation matrix for a unit quaternion in the same WXYZ order as
+* the DMP quaternions. Multiplying a body-frame vector by this matrix rotates
+* it into the world frame.
+*
+* @ mat4_t mat4_identity()
+* @ mat4_t mat4_multiply(mat4_t A, mat4_t B)
+* @ mat4_t mat4_transpose(mat4_t A)
+* @ float mat4_determinant(mat4_t A)
+* @ int mat4_invert(mat4_t A, mat4_t* out)
+*
+* @ int mat3_invert_batch(const mat3_t* A, mat3_t* out, int count)
+* @ int mat4_invert_batch(const mat4_t* A, mat4_t* out, int count)
+*
+* Invert arrays of matrices, such as one model per wheel or axis, in one 
+* call. Singular matrices are not reported one by one, instead their output 
+* is zeroed and the number of them is returned. out may be the same as A.
+*
+* @ vec3_t create_vec3(float x, float y, float z)
+* @ vec3_t vec3_add(vec3_t a, vec3_t b)
+* @ vec3_t vec3_subtract(vec3_t a, vec3_t b)
+* @ vec3_t vec3_scale(vec3_t a, float s)
+* @ float vec3_dot(vec3_t a, vec3_t b)
+* @ vec3_t vec3_cross(vec3_t a, vec3_t b)
+* @ float vec3_norm(vec3_t a)
+*******************************************************************************/
+typedef struct mat3_t{
+	float d[3][3];
+} mat3_t;
+
+typedef struct mat4_t{
+	float d[4][4];
+} mat4_t;
+
+typedef struct vec3_t{
+	float d[3];
+} vec3_t;
+
+mat3_t mat3_identity();
+mat3_t mat3_multiply(mat3_t A, mat3_t B);
+mat3_t mat3_transpose(mat3_t A);
+vec3_t mat3_times_vec3(mat3_t A, vec3_t v);
+float mat3_determinant(mat3_t A);
+int mat3_invert(mat3_t A, mat3_t* out);
+mat3_t quaternion_to_mat3(float q[4]);
+mat4_t mat4_identity();
+mat4_t mat4_multiply(mat4_t A, mat4_t B);
+mat4_t mat4_transpose(mat4_t A);
+float mat4_determinant(mat4_t A);
+int mat4_invert(mat4_t A, mat4_t* out);
+int mat3_invert_batch(const mat3_t* A, mat3_t* out, int count);
+int mat4_invert_batch(const mat4_t* A, mat4_t* out, int count);
+vec3_t create_vec3(float x, float y, float z);
+vec3_t vec3_add(vec3_t a, vec3_t b);
+vec3_t vec3_subtract(vec3_t a, vec3_t b);
+vec3_t vec3_scale(vec3_t a, float s);
+float vec3_dot(vec3_t a, vec3_t b);
+vec3_t vec3_cross(vec3_t a, vec3_t b);
+float vec3_norm(vec3_t a);
 
 /*******************************************************************************
 * Linear Algebra
 *
-*
+* Most functions here allocate and return a new matrix_t or vector_t which the
+* user must later free with destroy_matrix or destroy_vector. For use inside
+* real-time loops each common operation also has an _into variant which writes
+* into storage the user has already allocated, and the decompositions take
+* their scratch memory from a la_workspace_t allocated once at startup.
+*
+* @ la_workspace_t create_la_workspace(int bytes)
+* @ int destroy_la_workspace(la_workspace_t* ws)
+* @ int reset_la_workspace(la_workspace_t* ws)
+*
+* A workspace is a single block of memory that matrices and vectors can be
+* taken from with workspace_matrix and workspace_vector. These must not be 
+* passed to destroy_matrix/vector, instead reset the whole workspace when done.
+* The _into decompositions return any scratch they took before returning.
+*
+* @ int multiply_matrices_into(matrix_t A, matrix_t B, matrix_t* out)
+* @ int add_matrices_into(matrix_t A, matrix_t B, matrix_t* out)
+* @ int matrix_times_col_vec_into(matrix_t A, vector_t v, vector_t* out)
+* @ int invert_matrix_into(matrix_t A, matrix_t* out, la_workspace_t* ws)
+* @ int lin_system_solve_into(matrix_t A, vector_t b, vector_t* x, 
+*														la_workspace_t* ws)
+*
+* These and the other _into functions perform the same operation as their
+* allocating counterparts but return 0 on success or -1 on failure and leave
+* the result in the last matrix or vector argument which must already have the
+* right dimensions. Multiplication and transpose outputs may not alias inputs.
+*
+* @ int LU_decomposition_inplace(matrix_t* A, int* perm, int* sign)
+* @ int invert_matrices_batch(const float* A, float* out, int n, int count)
+* @ int matrix_determinants_batch(const float* A, float* det, int n, 
+*																int count)
+*
+* matrix_determinant, invert_matrix and invert_matrix_into use the closed
+* forms of the fixed size functions for matrices up to 4x4 and allocate 
+* nothing for them, except that the inverses fall back to LU as larger
+* matrices do when the determinant is below 1e-12 in magnitude. Above that they use LU_decomposition_inplace, partial 
+* pivoting LU which overwrites A with both factors so PA = LU, perm[i] 
+* being the original row now in row i and sign the determinant of P. The
+* batch functions handle count 1x1 to 4x4 matrices packed one after another
+* row-major, as an array of mat3_t is. invert_matrices_batch zeroes the
+* output of and counts any singular matrix rather than stopping.
+*
+* @ int poly_conv_into(vector_t v1, vector_t v2, vector_t* out)
+* @ int poly_power_into(vector_t v, int N, vector_t* out)
+* @ int poly_butter_into(int N, float wc, vector_t* out)
+*
+* Polynomial products built up in the output itself, so filter coefficients
+* can be designed from stack arrays wrapped in create_vector_view. out must
+* have length v1.len+v2.len-1, (v.len-1)*N+1 and N+1 respectively. 
+* poly_conv_into may write over v1 but poly_power_into's out must not be v.
+*
+* @ matrix_t create_matrix_view(float* data, int rows, int cols)
+* @ matrix_t create_submatrix_view(matrix_t A, int row, int col, int rows,
+*																	int cols)
+* @ matrix_t matrix_row_view(matrix_t A, int row, int rows)
+* @ vector_t matrix_row_as_vector(matrix_t A, int row)
+* @ vector_t create_vector_view(float* data, int len)
+*
+* Matrix entries are stored in a single contiguous row-major block with 
+* data[i] pointing at the start of each row. Views reuse existing memory 
+* instead of copying it, such as a user's float array or a block of a larger 
+* matrix. Writing through a view writes the original. destroy_matrix and 
+* destroy_vector may be called on views and only free what the view allocated.
+*
+* @ int init_ellipsoid_fit(ellipsoid_fit_t* fit, int full, float forget)
+* @ int ellipsoid_fit_add_point(ellipsoid_fit_t* fit, float x, float y, float z)
+* @ int solve_ellipsoid_fit(ellipsoid_fit_t* fit, float center[3],
+*											float lengths[3], mat3_t* shape)
+*
+* Least squares ellipsoid fitting without storing the points. Each point
+* updates the normal equations in place so memory stays fixed however long 
+* the calibration runs, and solve_ellipsoid_fit may be called at any time 
+* while points keep coming. Set full to also fit rotated ellipsoids, such as 
+* from soft iron, in which case shape holds the full surface matrix. A forget 
+* factor below 1 lets old points fade out for continuous re-estimation of a 
+* hard iron offset. fit_ellipsoid is now a wrapper around these.
+*
+* @ int cholesky_decomposition(matrix_t* A)
+* @ int lower_triangular_solve(matrix_t L, vector_t b, vector_t* x)
+* @ int lower_transpose_solve(matrix_t L, vector_t b, vector_t* x)
+* @ int cholesky_solve(matrix_t L, vector_t b, vector_t* x)
+* @ int spd_solve(matrix_t A, vector_t b, vector_t* x, la_workspace_t* ws)
+* @ int spd_solve_matrix(matrix_t A, matrix_t B, matrix_t* X, la_workspace_t* ws)
+*
+* Solvers for symmetric positive definite matrices such as covariances.
+* cholesky_decomposition overwrites A with its lower triangular factor L in
+* place and fails if A is not positive definite. cholesky_solve reuses that
+* factor for any number of right hand sides through the two triangular solves.
+* spd_solve and spd_solve_matrix factor a copy of A from the workspace and
+* allocate nothing, so a Kalman gain can be found with spd_solve_matrix 
+* instead of invert_matrix at about half the cost of LUP.
 *******************************************************************************/
+// values for the view field of matrix_t and vector_t
+#define NOT_A_VIEW			0 // owns its entries
+#define VIEW_OWNS_ROW_PTRS	1 // entries borrowed, row pointers allocated
+#define VIEW_BORROWED		2 // owns nothing, destroy does not free
+
 typedef struct matrix_t{
 	int rows;
 	int cols;
-	float** data;
+	float** data;	// row pointers into one contiguous row-major block
+	int view;
 	int initialized;
 } matrix_t;
 
 typedef struct vector_t{
 	int len;
 	float* data;
+	int view;
 	int initialized;
 } vector_t;
 
+typedef struct la_workspace_t{
+	char* mem;
+	int size;		// bytes allocated
+	int used;		// bytes currently handed out
+	int initialized;
+} la_workspace_t;
+
+#define ELLIPSOID_ALIGNED_TERMS	6	// x^2 y^2 z^2 x y z
+#define ELLIPSOID_FULL_TERMS	9	// plus xy xz yz
+
+typedef struct ellipsoid_fit_t{
+	int full;		// 1 to fit the cross terms too
+	int terms;		// 6 or 9 unknowns
+	float forget;	// weight of old points per new one, 1 for none
+	uint64_t points;// number of points added
+	double ata[ELLIPSOID_FULL_TERMS][ELLIPSOID_FULL_TERMS]; // upper triangle
+	double atb[ELLIPSOID_FULL_TERMS];
+	int initialized;
+} ellipsoid_fit_t;
+
 // Basic Matrix creation, modification, and access
 matrix_t create_matrix(int rows, int cols);
 void destroy_matrix(matrix_t* A);
@@ -1013,6 +3206,9 @@ matrix_t create_diagonal_matrix(vector_t v);
 matrix_t create_matrix_of_ones(int dim);
 int set_matrix_entry(matrix_t* A, int row, int col, float val);
 float get_matrix_entry(matrix_t A, int row, int col);
+matrix_t create_matrix_view(float* data, int rows, int cols);
+matrix_t create_submatrix_view(matrix_t A, int row, int col, int rows, int cols);
+matrix_t matrix_row_view(matrix_t A, int row, int rows);
 void print_matrix(matrix_t A);
 void print_matrix_sci_notation(matrix_t A);
 
@@ -1026,6 +3222,8 @@ vector_t create_vector_of_ones(int len);
 vector_t create_vector_from_array(int len, float* array);
 int set_vector_entry(vector_t* v, int pos, float val);
 float get_vector_entry(vector_t v, int pos);
+vector_t matrix_row_as_vector(matrix_t A, int row);
+vector_t create_vector_view(float* data, int len);
 void print_vector(vector_t v);
 void print_vector_sci_notation(vector_t v);
 
@@ -1061,8 +3259,109 @@ matrix_t householder_matrix(vector_t v);
 vector_t lin_system_solve(matrix_t A, vector_t b);
 vector_t lin_system_solve_qr(matrix_t A, vector_t b);
 int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths);
+int init_ellipsoid_fit(ellipsoid_fit_t* fit, int full, float forget);
+int ellipsoid_fit_add_point(ellipsoid_fit_t* fit, float x, float y, float z);
+int solve_ellipsoid_fit(ellipsoid_fit_t* fit, float center[3], \
+											float lengths[3], mat3_t* shape);
+
+// workspaces and zero-allocation variants
+la_workspace_t create_la_workspace(int bytes);
+int destroy_la_workspace(la_workspace_t* ws);
+int reset_la_workspace(la_workspace_t* ws);
+matrix_t workspace_matrix(la_workspace_t* ws, int rows, int cols);
+vector_t workspace_vector(la_workspace_t* ws, int len);
+int copy_matrix_into(matrix_t A, matrix_t* out);
+int copy_vector_into(vector_t v, vector_t* out);
+int multiply_matrices_into(matrix_t A, matrix_t B, matrix_t* out);
+int add_matrices_into(matrix_t A, matrix_t B, matrix_t* out);
+int add_matrices_inplace(matrix_t* A, matrix_t B);
+int matrix_times_col_vec_into(matrix_t A, vector_t v, vector_t* out);
+int transpose_matrix_into(matrix_t A, matrix_t* out);
+int LUP_decomposition_into(matrix_t A, matrix_t* L, matrix_t* U, matrix_t* P,\
+														la_workspace_t* ws);
+int QR_decomposition_into(matrix_t A, matrix_t* Q, matrix_t* R, \
+														la_workspace_t* ws);
+int invert_matrix_into(matrix_t A, matrix_t* out, la_workspace_t* ws);
+int lin_system_solve_into(matrix_t A, vector_t b, vector_t* x, \
+														la_workspace_t* ws);
+int LU_decomposition_inplace(matrix_t* A, int* perm, int* sign);
+int invert_matrices_batch(const float* A, float* out, int n, int count);
+int matrix_determinants_batch(const float* A, float* det, int n, int count);
+int poly_conv_into(vector_t v1, vector_t v2, vector_t* out);
+int poly_power_into(vector_t v, int N, vector_t* out);
+int poly_butter_into(int N, float wc, vector_t* out);
+
+// symmetric positive definite solvers
+int cholesky_decomposition(matrix_t* A);
+int lower_triangular_solve(matrix_t L, vector_t b, vector_t* x);
+int lower_transpose_solve(matrix_t L, vector_t b, vector_t* x);
+int cholesky_solve(matrix_t L, vector_t b, vector_t* x);
+int spd_solve(matrix_t A, vector_t b, vector_t* x, la_workspace_t* ws);
+int spd_solve_matrix(matrix_t A, matrix_t B, matrix_t* X, la_workspace_t* ws);
 
 
+/*******************************************************************************
+* Kalman Filter
+*
+* Discrete time linear Kalman filter, also usable as an EKF, which allocates
+* everything it needs in create_kalman_filter so that predict and update 
+* never touch the heap and can run at the IMU sample rate.
+*
+* @ kalman_filter_t create_kalman_filter(int nx, int nu, int nz)
+* @ int destroy_kalman_filter(kalman_filter_t* kf)
+*
+* nx states, nu inputs (may be 0) and nz measurements. Fill in the model
+* matrices F, B, H, Q and R and the initial x and P directly in the struct,
+* they start as F=P=R=I with everything else zero.
+*
+* @ int kalman_predict(kalman_filter_t* kf, vector_t u)
+* @ int kalman_predict_covariance(kalman_filter_t* kf)
+*
+* x = F*x + B*u and P = F*P*F' + Q. An EKF propagates x itself, updates F to
+* the Jacobian, and calls kalman_predict_covariance for the P half alone.
+*
+* @ int kalman_update(kalman_filter_t* kf, vector_t z)
+* @ int kalman_update_innovation(kalman_filter_t* kf, vector_t y)
+*
+* Measurement update for z = H*x + noise of covariance R. The gain is solved
+* for with a Cholesky factorization of the innovation covariance, no inverse
+* is formed. An EKF passes its own innovation z - h(x) to
+* kalman_update_innovation with the Jacobian of h in H.
+*
+* @ int kalman_update_sequential(kalman_filter_t* kf, vector_t z)
+*
+* Same result as kalman_update when R is diagonal but done as nz scalar
+* updates which need no factorization at all, the cheapest choice when the 
+* measurement noises are independent. Returns the number of measurements 
+* skipped for a non-positive innovation variance.
+*******************************************************************************/
+typedef struct kalman_filter_t{
+	int nx;			// number of states
+	int nu;			// number of inputs
+	int nz;			// number of measurements
+	matrix_t F;		// nx x nx state transition
+	matrix_t B;		// nx x nu input matrix, empty if nu is 0
+	matrix_t H;		// nz x nx measurement matrix
+	matrix_t Q;		// nx x nx process noise covariance
+	matrix_t R;		// nz x nz measurement noise covariance
+	vector_t x;		// state estimate
+	matrix_t P;		// state covariance
+	uint64_t steps;	// number of predictions so far
+	// preallocated scratch, taken from ws
+	la_workspace_t ws;
+	matrix_t FP, HP, Kt, S;
+	vector_t y, tmp, ph;
+	int initialized;
+} kalman_filter_t;
+
+kalman_filter_t create_kalman_filter(int nx, int nu, int nz);
+int destroy_kalman_filter(kalman_filter_t* kf);
+int kalman_predict(kalman_filter_t* kf, vector_t u);
+int kalman_predict_covariance(kalman_filter_t* kf);
+int kalman_update(kalman_filter_t* kf, vector_t z);
+int kalman_update_innovation(kalman_filter_t* kf, vector_t y);
+int kalman_update_sequential(kalman_filter_t* kf, vector_t z);
+
 /*******************************************************************************
 * Ring Buffer
 *
@@ -1087,6 +3386,30 @@ int fit_ellipsoid(matrix_t points, vector_t* center, vector_t* lengths);
 * returns the float which is 'position' steps behind the last value placed in
 * the buffer. If 'position' is given as 0 then the most recent value is
 * returned. 'Position' obviously can't be larger than buffer_size minus 1
+*
+* @ int insert_ring_buf_values(ring_buf_t* buf, const float* vals, int n)
+*
+* Inserts n values in order with a single check. vals[n-1] becomes newest.
+*
+* @ pow2_ring_buf_t create_pow2_ring_buf(int min_size)
+*
+* A faster ring buffer for high rate data. The size is rounded up to a power
+* of two and every value is stored twice so that the newest values can be 
+* read as one contiguous array with pow2_ring_buf_window, for example to pass
+* straight to create_vector_view without copying. The insert and get 
+* functions do no checking so only use them on a successfully created buffer.
+*
+* @ void insert_pow2_ring_buf_value(pow2_ring_buf_t* buf, float val)
+* @ void insert_pow2_ring_buf_values(pow2_ring_buf_t* buf, const float* vals, 
+*																		int n)
+* @ float get_pow2_ring_buf_value(pow2_ring_buf_t* buf, int position)
+* @ const float* pow2_ring_buf_window(pow2_ring_buf_t* buf, int n)
+*
+* pow2_ring_buf_window returns a pointer to the newest n values with the 
+* oldest first. It is only valid until the next insert.
+*
+* @ int reset_pow2_ring_buf(pow2_ring_buf_t* buf)
+* @ int destroy_pow2_ring_buf(pow2_ring_buf_t* buf)
 *******************************************************************************/
 
 typedef struct ring_buf_t{
@@ -1102,6 +3425,81 @@ int reset_ring_buf(ring_buf_t* buf);
 int destroy_ring_buf(ring_buf_t* buf);
 int insert_new_ring_buf_value(ring_buf_t* buf, float val);
 float get_ring_buf_value(ring_buf_t* buf, int position);
+int insert_ring_buf_values(ring_buf_t* buf, const float* vals, int n);
+
+typedef struct pow2_ring_buf_t{
+	float* data;			// 2*size values, data[i] == data[i+size]
+	int size;				// power of two
+	unsigned int mask;		// size-1
+	unsigned int index;		// position of newest value
+	int initialized;
+} pow2_ring_buf_t;
+
+pow2_ring_buf_t create_pow2_ring_buf(int min_size);
+int reset_pow2_ring_buf(pow2_ring_buf_t* buf);
+int destroy_pow2_ring_buf(pow2_ring_buf_t* buf);
+void insert_pow2_ring_buf_value(pow2_ring_buf_t* buf, float val);
+void insert_pow2_ring_buf_values(pow2_ring_buf_t* buf, const float* vals, int n);
+float get_pow2_ring_buf_value(pow2_ring_buf_t* buf, int position);
+const float* pow2_ring_buf_window(pow2_ring_buf_t* buf, int n);
+
+
+/*******************************************************************************
+* Running Statistics
+*
+* Accumulators for the mean and standard deviation of a stream of samples
+* which update in constant time per sample instead of storing every sample
+* and calling standard_deviation. running_stats_t covers every sample since 
+* the last reset and also tracks the min and max. windowed_stats_t covers only
+* the most recent 'window' samples. Variances are population variances like
+* standard_deviation uses.
+*
+* @ running_stats_t create_running_stats()
+* @ int reset_running_stats(running_stats_t* stats)
+* @ int update_running_stats(running_stats_t* stats, float x)
+* @ float running_stats_mean(running_stats_t* stats)
+* @ float running_stats_variance(running_stats_t* stats)
+* @ float running_stats_stddev(running_stats_t* stats)
+*
+* @ windowed_stats_t create_windowed_stats(int window)
+* @ int destroy_windowed_stats(windowed_stats_t* stats)
+* @ int reset_windowed_stats(windowed_stats_t* stats)
+* @ int update_windowed_stats(windowed_stats_t* stats, float x)
+* @ float windowed_stats_mean(windowed_stats_t* stats)
+* @ float windowed_stats_variance(windowed_stats_t* stats)
+* @ float windowed_stats_stddev(windowed_stats_t* stats)
+*******************************************************************************/
+typedef struct running_stats_t{
+	uint64_t n;			// samples since reset
+	double mean;
+	double m2;			// sum of squared differences from the mean
+	float min;
+	float max;
+	int initialized;
+} running_stats_t;
+
+typedef struct windowed_stats_t{
+	ring_buf_t buf;		// the samples currently in the window
+	int window;
+	int count;			// samples in the window, up to 'window'
+	double mean;
+	double m2;
+	int initialized;
+} windowed_stats_t;
+
+running_stats_t create_running_stats();
+int reset_running_stats(running_stats_t* stats);
+int update_running_stats(running_stats_t* stats, float x);
+float running_stats_mean(running_stats_t* stats);
+float running_stats_variance(running_stats_t* stats);
+float running_stats_stddev(running_stats_t* stats);
+windowed_stats_t create_windowed_stats(int window);
+int destroy_windowed_stats(windowed_stats_t* stats);
+int reset_windowed_stats(windowed_stats_t* stats);
+int update_windowed_stats(windowed_stats_t* stats, float x);
+float windowed_stats_mean(windowed_stats_t* stats);
+float windowed_stats_variance(windowed_stats_t* stats);
+float windowed_stats_stddev(windowed_stats_t* stats);
 
 
 /*******************************************************************************
@@ -1132,6 +3530,14 @@ float get_ring_buf_value(ring_buf_t* buf, int position);
 * min and max values given to enable_saturation. The enable_saturation entry
 * in the filter struct will also be set to 1 if saturation occurred. 
 *
+* @ int march_filter_block(d_filter_t* filter, const float* in, float* out, 
+*																		int n)
+*
+* Same as calling march_filter n times on the n values of in, placing each 
+* output in out, but with much less per sample overhead. Useful for running
+* filters over logged data or buffers of oversampled ADC readings. State 
+* carries over between calls and in and out may be the same array.
+*
 * @ int reset_filter(d_filter_t* filter)
 *
 * resets all inputs and outputs to 0
@@ -1193,6 +3599,32 @@ float get_ring_buf_value(ring_buf_t* buf, int position);
 * @ int print_filter_details(d_filter_t* filter)
 *
 * Prints the order, numerator, and denominator coefficients for debugging.
+*
+* @ int refresh_filter_coefficients(d_filter_t* filter)
+*
+* march_filter works from a normalized copy of the transfer function made
+* when the filter is created. If you change filter.numerator or 
+* filter.denominator by hand afterwards, call this to apply the change. 
+* Filters from create_empty_filter are refreshed automatically on their first
+* step. Changing filter.gain does not need a refresh.
+*
+* @ int C2DTustin_into(vector_t num, vector_t den, float dt, float w,
+*														d_filter_t* filter)
+* @ int retune_filter(d_filter_t* filter, const float* num, const float* den)
+* @ int retune_first_order_lowpass(d_filter_t* filter, float dt, 
+*														float time_constant)
+* @ int retune_first_order_highpass(d_filter_t* filter, float dt, 
+*														float time_constant)
+* @ int retune_butterworth_lowpass(d_filter_t* filter, float dt, float wc)
+* @ int retune_butterworth_highpass(d_filter_t* filter, float dt, float wc)
+*
+* Change the transfer function of an existing filter of the same order, such
+* as moving a cutoff from a DSM knob while the loop runs. The coefficients
+* are designed on the stack and written over the old ones, nothing is 
+* allocated, and the ring buffers and saturation are untouched. The state is
+* rebuilt from the input and output history so there is no step in the 
+* output. The retune_butterworth functions support orders up to 32,
+* C2DTustin_into allocates a workspace for orders above that.
 *******************************************************************************/
 
 typedef struct d_filter_t{
@@ -1202,6 +3634,12 @@ typedef struct d_filter_t{
 	float gain; 			// gain usually 1
 	vector_t numerator;		// numerator coefficients 
 	vector_t denominator;	// denominator coefficients 
+	// normalized coefficients and DF2T state in one contiguous allocation
+	float* df2t_num;		// numerator/denominator[0]
+	float* df2t_den;		// denominator/denominator[0]
+	float* df2t_state;		// order entries
+	int coefs_ready;		// set by refresh_filter_coefficients()
+	float (*march_fn)(struct d_filter_t*, float); // step for this order
 	// saturation settings
 	int saturation_en;		// set to 1 by enable_saturation()
 	float saturation_min;
@@ -1225,6 +3663,7 @@ d_filter_t create_filter(int order, float dt, float* num, float* den);
 int destroy_filter(d_filter_t* filter);
 d_filter_t create_empty_filter(int order);
 float march_filter(d_filter_t* filter, float new_input);
+int march_filter_block(d_filter_t* filter, const float* in, float* out, int n);
 int reset_filter(d_filter_t* filter);
 int enable_saturation(d_filter_t* filter, float min, float max);
 int did_filter_saturate(d_filter_t* filter);
@@ -1236,17 +3675,381 @@ float newest_filter_input(d_filter_t* filter);
 int prefill_filter_inputs(d_filter_t* filter, float in);
 int prefill_filter_outputs(d_filter_t* filter, float out);
 int print_filter_details(d_filter_t* filter);
+int refresh_filter_coefficients(d_filter_t* filter);
 d_filter_t multiply_filters(d_filter_t f1, d_filter_t f2);
 d_filter_t C2DTustin(vector_t num, vector_t den, float dt, float w);
+int C2DTustin_into(vector_t num, vector_t den, float dt, float w, \
+														d_filter_t* filter);
 d_filter_t create_first_order_lowpass(float dt, float time_constant);
 d_filter_t create_first_order_highpass(float dt, float time_constant);
 d_filter_t create_butterworth_lowpass(int order, float dt, float wc);
 d_filter_t create_butterworth_highpass(int order, float dt, float wc);
+int retune_filter(d_filter_t* filter, const float* num, const float* den);
+int retune_first_order_lowpass(d_filter_t* filter, float dt, \
+														float time_constant);
+int retune_first_order_highpass(d_filter_t* filter, float dt, \
+														float time_constant);
+int retune_butterworth_lowpass(d_filter_t* filter, float dt, float wc);
+int retune_butterworth_highpass(d_filter_t* filter, float dt, float wc);
 d_filter_t create_moving_average(int samples);
 d_filter_t create_integrator(float dt);
 d_filter_t create_double_integrator(float dt);
 d_filter_t create_pid(float kp, float ki, float kd, float Tf, float dt);
 
+/*******************************************************************************
+* PID Controllers
+*
+* A dedicated PID type for loops that saturate, such as motor duty cycles.
+* Unlike create_pid the three terms are separate state, so the integrator can
+* be kept from winding up while the output sits at its limit and setpoint
+* changes can be kept out of the derivative. Each step is a handful of
+* multiply-adds with no call through march_filter.
+*
+* @ pid_controller_t create_pid_controller(float kp, float ki, float kd,
+*														float Tf, float dt)
+*
+* Same gains and derivative rolloff Tf as create_pid, Tf may be 0 for a plain
+* difference. No limits or anti-windup until set below.
+*
+* @ int set_pid_output_limits(pid_controller_t* pid, float min, float max)
+* @ int set_pid_antiwindup(pid_controller_t* pid, pid_antiwindup_t mode,
+*																	float kt)
+*
+* PID_ANTIWINDUP_CLAMP stops integrating while saturated in the direction of
+* the error. PID_ANTIWINDUP_BACK_CALC feeds the amount clipped off back into 
+* the integrator with gain kt (1/s), 0 keeps the default of 1/sqrt(Ti*Td).
+*
+* @ int set_pid_setpoint_weights(pid_controller_t* pid, float b, float c)
+*
+* Weights on the setpoint in the P and D terms, both default to 1. c=0 
+* removes the derivative kick on setpoint steps.
+*
+* @ float march_pid_controller(pid_controller_t* pid, float setpoint,
+*														float measurement)
+*
+* One step, returns the limited output. pid.saturation_flag is set if it was
+* limited.
+*
+* @ int reset_pid_controller(pid_controller_t* pid)
+*******************************************************************************/
+typedef enum pid_antiwindup_t{
+	PID_ANTIWINDUP_NONE,
+	PID_ANTIWINDUP_CLAMP,		// conditional integration
+	PID_ANTIWINDUP_BACK_CALC	// back-calculation with gain kt
+} pid_antiwindup_t;
+
+typedef struct pid_controller_t{
+	// gains and settings
+	float kp, ki, kd;
+	float Tf;				// derivative rolloff time constant
+	float dt;				// timestep in seconds
+	float b;				// setpoint weight in the P term
+	float c;				// setpoint weight in the D term
+	float out_min;
+	float out_max;
+	pid_antiwindup_t antiwindup;
+	float kt;				// back-calculation gain
+	float ad, bd;			// precomputed derivative filter coefficients
+	// state
+	float integrator;		// I term in output units
+	float derivative;		// filtered D term
+	float last_ed;			// last derivative error
+	float output;			// last limited output
+	int saturation_flag;	// 1 if the last output was limited
+	uint64_t steps;
+	int initialized;
+} pid_controller_t;
+
+pid_controller_t create_pid_controller(float kp, float ki, float kd, \
+														float Tf, float dt);
+int set_pid_output_limits(pid_controller_t* pid, float min, float max);
+int set_pid_antiwindup(pid_controller_t* pid, pid_antiwindup_t mode, float kt);
+int set_pid_setpoint_weights(pid_controller_t* pid, float b, float c);
+int reset_pid_controller(pid_controller_t* pid);
+float march_pid_controller(pid_controller_t* pid, float setpoint, \
+														float measurement);
+
+/*******************************************************************************
+* Motor Mixers
+*
+* Turns thrust, roll, pitch and yaw commands into rotor or wheel outputs from
+* a fixed coefficient table, with no allocation per tick. If the commands
+* don't all fit in the output range, roll and pitch are kept first, then
+* thrust, and yaw last. Ground layouts keep steering over throttle.
+*
+* Rotors are numbered clockwise seen from above, starting front right on X
+* layouts and at the front on + layouts. Rotor 1 spins anticlockwise and the
+* directions alternate. Positive roll is right side down, positive pitch nose
+* up and positive yaw clockwise from above. Ground layouts use only thrust
+* (forward) and yaw (turn right). MIXER_DIFF_DRIVE outputs are left, right
+* and MIXER_SKID_STEER left front, left rear, right front, right rear.
+*
+* @ mixer_t create_mixer(mixer_layout_t layout)
+*
+* Roll and pitch coefficients are scaled so the furthest rotor moves by the
+* whole command. m.mix may be edited afterwards for other geometries, keeping
+* the thrust column at 1. Rotor outputs range 0 to 1 and wheels -1 to 1.
+*
+* @ int set_mixer_output_limits(mixer_t* m, float min, float max)
+*
+* For example a minimum above 0 to keep rotors spinning in flight.
+*
+* @ int mix_controls(mixer_t* m, float thrust, float roll, float pitch,
+*																float yaw)
+*
+* Fills m.out and sets m.saturated if anything had to be given up.
+*
+* @ int send_mixer_esc_pulses(mixer_t* m, int first_ch)
+* @ int send_mixer_dshot(mixer_t* m, int first_ch)
+* @ int set_mixer_motors(mixer_t* m, int first_motor)
+*
+* Hand m.out to the ESCs on servo channels from first_ch in one batch with
+* send_servo_pulses_us or send_dshot_normalized, or to the H-bridges from
+* first_motor.
+*******************************************************************************/
+#define MIXER_MAX_OUTPUTS	8
+
+typedef enum mixer_layout_t{
+	MIXER_QUAD_X,
+	MIXER_QUAD_PLUS,
+	MIXER_HEX_X,
+	MIXER_HEX_PLUS,
+	MIXER_OCTO_X,
+	MIXER_OCTO_PLUS,
+	MIXER_DIFF_DRIVE,
+	MIXER_SKID_STEER
+} mixer_layout_t;
+
+typedef struct mixer_t{
+	mixer_layout_t layout;
+	int outputs;							// rotors or wheels in use
+	float mix[MIXER_MAX_OUTPUTS][4];		// thrust, roll, pitch, yaw
+	float min, max;							// output limits
+	float out[MIXER_MAX_OUTPUTS];			// last mixed outputs
+	int saturated;							// 1 if the last mix was limited
+	int initialized;
+} mixer_t;
+
+mixer_t create_mixer(mixer_layout_t layout);
+int set_mixer_output_limits(mixer_t* m, float min, float max);
+int mix_controls(mixer_t* m, float thrust, float roll, float pitch, float yaw);
+int send_mixer_esc_pulses(mixer_t* m, int first_ch);
+int send_mixer_dshot(mixer_t* m, int first_ch);
+int set_mixer_motors(mixer_t* m, int first_motor);
+
+/*******************************************************************************
+* State Space Systems
+*
+* Discrete multi-input multi-output systems x[k+1] = A*x[k] + B*u[k], 
+* y[k] = C*x[k] + D*u[k] for controllers and observers that don't fit a
+* single transfer function. The four matrices are stored together as
+* [A B; C D] and stepping is one matrix times vector product with no
+* allocation, so a full LQR and observer runs in a single call.
+*
+* @ ss_system_t create_ss_system(int nx, int nu, int ny, float dt)
+*
+* Allocates a discrete system of nx states, nu inputs and ny outputs with
+* everything zeroed. Fill in sys.A, sys.B, sys.C and sys.D directly.
+*
+* @ ss_system_t create_ss_from_continuous(matrix_t A, matrix_t B, matrix_t C,
+*						matrix_t D, float dt, ss_discretization_t method)
+*
+* Discretizes a continuous system. SS_ZOH is exact for inputs held constant
+* between steps and uses the matrix exponential. SS_TUSTIN is the bilinear
+* transform, the MIMO version of C2DTustin.
+*
+* @ int march_ss_system(ss_system_t* sys, float* u, float* y)
+*
+* Writes the ny outputs for input u and the current state into y, then
+* advances the state.
+*
+* @ int reset_ss_system(ss_system_t* sys)
+* @ int set_ss_state(ss_system_t* sys, float* x)
+* @ int destroy_ss_system(ss_system_t* sys)
+*
+* @ matrix_t matrix_exponential(matrix_t A)
+*
+* e^A by scaling and squaring, returns a new matrix.
+*******************************************************************************/
+typedef enum ss_discretization_t{
+	SS_ZOH,
+	SS_TUSTIN
+} ss_discretization_t;
+
+typedef struct ss_system_t{
+	int nx;			// number of states
+	int nu;			// number of inputs
+	int ny;			// number of outputs
+	float dt;		// timestep in seconds
+	matrix_t M;		// (nx+ny) x (nx+nu) block [A B; C D]
+	matrix_t A, B, C, D;	// views into M
+	vector_t xu;	// [x; u] input to each step
+	vector_t out;	// [x next; y] from each step
+	float* x;		// the state, first nx entries of xu
+	int initialized;
+} ss_system_t;
+
+ss_system_t create_ss_system(int nx, int nu, int ny, float dt);
+ss_system_t create_ss_from_continuous(matrix_t A, matrix_t B, matrix_t C, \
+						matrix_t D, float dt, ss_discretization_t method);
+int destroy_ss_system(ss_system_t* sys);
+int march_ss_system(ss_system_t* sys, float* u, float* y);
+int reset_ss_system(ss_system_t* sys);
+int set_ss_state(ss_system_t* sys, float* x);
+matrix_t matrix_exponential(matrix_t A);
+
+/*******************************************************************************
+* Filter Banks
+*
+* A filter_bank_t applies the same transfer function independently to several
+* channels, for example the same low pass on all 3 gyro axes. This is much 
+* cheaper than one d_filter_t per channel since all channels share one copy
+* of the coefficients and are stepped together.
+*
+* @ filter_bank_t create_filter_bank(d_filter_t* filter, int channels)
+*
+* Makes a bank of 'channels' copies of a filter created with any of the 
+* functions above, including its gain, saturation and soft start settings.
+* The bank keeps its own copy so the original may be destroyed afterwards.
+*
+* @ int march_filter_bank(filter_bank_t* bank, float* in, float* out)
+*
+* Marches all channels forward one step. in and out are arrays of length
+* channels and may be the same array. bank.saturation_flag is set to 1 if any
+* channel saturated this step.
+*
+* @ int reset_filter_bank(filter_bank_t* bank)
+* @ int destroy_filter_bank(filter_bank_t* bank)
+*******************************************************************************/
+typedef struct filter_bank_t{
+	d_filter_t filter;		// shared coefficients and limit settings
+	int channels;
+	float* state;			// order rows of 'channels' DF2T states
+	float* scaled_in;		// scratch row for gain*input
+	int saturation_flag;	// 1 if any channel saturated on the last step
+	int initialized;
+} filter_bank_t;
+
+filter_bank_t create_filter_bank(d_filter_t* filter, int channels);
+int destroy_filter_bank(filter_bank_t* bank);
+int reset_filter_bank(filter_bank_t* bank);
+int march_filter_bank(filter_bank_t* bank, float* in, float* out);
+
+/*******************************************************************************
+* Biquad Filters
+*
+* High order filters built as one transfer function lose accuracy in single
+* precision and can go unstable above about 4th order. A biquad_filter_t is
+* instead a cascade of second order sections, each discretized separately,
+* which is stable at any order and costs 5 multiply-adds per section.
+*
+* @ biquad_filter_t create_butterworth_lowpass_biquad(int order, float dt, 
+*																	float wc)
+* @ biquad_filter_t create_butterworth_highpass_biquad(int order, float dt, 
+*																	float wc)
+*
+* Same response as create_butterworth_lowpass and highpass with Tustin 
+* prewarping at the cutoff wc in rad/s. Odd orders end with a first order 
+* section.
+*
+* @ float march_biquad_filter(biquad_filter_t* filter, float new_input)
+* @ int reset_biquad_filter(biquad_filter_t* filter)
+* @ int destroy_biquad_filter(biquad_filter_t* filter)
+*******************************************************************************/
+typedef struct biquad_filter_t{
+	int order;				// total order of the cascade
+	int sections;			// number of second order sections
+	float dt;				// timestep in seconds
+	float gain; 			// gain usually 1
+	float* coefs;			// b0 b1 b2 a1 a2 for each section, a0 is 1
+	float* state;			// 2 DF2T states per section, after coefs
+	float newest_input;
+	float newest_output;
+	uint64_t step;			// steps since last reset
+	int initialized;
+} biquad_filter_t;
+
+biquad_filter_t create_butterworth_lowpass_biquad(int order, float dt, float wc);
+biquad_filter_t create_butterworth_highpass_biquad(int order, float dt, float wc);
+float march_biquad_filter(biquad_filter_t* filter, float new_input);
+int reset_biquad_filter(biquad_filter_t* filter);
+int destroy_biquad_filter(biquad_filter_t* filter);
+
+/*******************************************************************************
+* Fixed Point Filters
+*
+* Integer biquad cascades for filtering encoder or ADC data at high rates or
+* on processors without floating point such as the PRUs. A q_filter_t is
+* made by quantizing a filter designed with the float constructors. Q15 
+* filters have 16 bit coefficients and samples with a saturating 32 bit 
+* accumulator. Q31 filters have 32 bit coefficients and samples and a 64 bit
+* accumulator, use these when the cutoff is small relative to the sample 
+* rate as Q15 poles are then too coarse. Q15 numerators and denominators are
+* scaled separately so the tiny numerator of a low cutoff lowpass keeps its
+* full 16 bits rather than rounding to a count or two. Samples are plain
+* integers in whatever units the data comes in, limited to the int16_t range
+* for Q15, and the output saturates rather than wrapping.
+*
+* @ q_filter_t create_q_filter(d_filter_t f, q_format_t format)
+* @ q_filter_t create_q_filter_from_biquad(biquad_filter_t f, 
+*														q_format_t format)
+* @ q_filter_t create_q_butterworth_lowpass(int order, float dt, float wc,
+*														q_format_t format)
+* @ q_filter_t create_q_butterworth_highpass(int order, float dt, float wc,
+*														q_format_t format)
+*
+* create_q_filter takes first and second order filters such as those from
+* create_first_order_lowpass. Higher orders must come from a biquad cascade.
+* The source filter is only read and still needs destroying.
+*
+* @ int32_t march_q_filter(q_filter_t* filter, int32_t new_input)
+* @ int march_q_filter_block(q_filter_t* filter, const int32_t* in, 
+*														int32_t* out, int n)
+* @ int reset_q_filter(q_filter_t* filter)
+* @ int destroy_q_filter(q_filter_t* filter)
+*
+* q_biquad_t is a fixed layout of 32 bit words and the step uses only 
+* integer multiply, add and shift, so sections can be copied as they are to
+* a PRU running the same code.
+*******************************************************************************/
+typedef enum q_format_t{
+	Q_FORMAT_Q15,
+	Q_FORMAT_Q31
+} q_format_t;
+
+typedef struct q_biquad_t{
+	int32_t b0, b1, b2;		// numerator scaled by 2^b_frac
+	int32_t a1, a2;			// denominator scaled by 2^a_frac, a0 is 1
+	int32_t b_frac;			// fractional bits of the numerator
+	int32_t a_frac;			// fractional bits of the denominator
+	int32_t x1, x2;			// last two inputs
+	int32_t y1, y2;			// last two outputs
+} q_biquad_t;
+
+typedef struct q_filter_t{
+	q_format_t format;
+	int order;				// total order of the cascade
+	int sections;			// number of q_biquad_t
+	float dt;				// timestep in seconds
+	q_biquad_t* section;
+	int32_t newest_input;
+	int32_t newest_output;
+	uint64_t step;			// steps since last reset
+	int initialized;
+} q_filter_t;
+
+q_filter_t create_q_filter(d_filter_t f, q_format_t format);
+q_filter_t create_q_filter_from_biquad(biquad_filter_t f, q_format_t format);
+q_filter_t create_q_butterworth_lowpass(int order, float dt, float wc, \
+														q_format_t format);
+q_filter_t create_q_butterworth_highpass(int order, float dt, float wc, \
+														q_format_t format);
+int32_t march_q_filter(q_filter_t* filter, int32_t new_input);
+int march_q_filter_block(q_filter_t* filter, const int32_t* in, int32_t* out,\
+																		int n);
+int reset_q_filter(q_filter_t* filter);
+int destroy_q_filter(q_filter_t* filter);
+
 
 /*******************************************************************************
 * Board identification
@@ -1284,6 +4087,19 @@ void print_bb_model();
 * enum pinmux_mode_t gives options for pinmuxing. Not every mode if available on
 * each pin. refer to the pin table for which to use. 
 *
+* set_pinmux_mode() reads the pin's current state back first and skips the
+* write if it is already in that mode.
+*
+* set_pinmux_modes() sets several pins in one go, holding their state files
+* open for the duration. All pins are attempted even if one fails.
+*
+* apply_pinmux_profile() puts all user header pins in one of the layouts of
+* pinmux_profile_t with a single batched call. The DSM pin stays UART in all.
+*	PINMUX_PROFILE_DEFAULT:		UART on GPS and UART1 headers, SPI header SPI
+*	PINMUX_PROFILE_UART_GPIO:	UART on GPS and UART1 headers, SPI header GPIO
+*	PINMUX_PROFILE_SPI_GPIO:	SPI header SPI, GPS and UART1 headers GPIO
+*	PINMUX_PROFILE_ALL_GPIO:	every user header pin GPIO
+*
 * set_default_pinmux() puts everything back to standard and is used by 
 * initialize_cape
 *******************************************************************************/
@@ -1321,7 +4137,16 @@ typedef enum pinmux_mode_t{
 	PINMUX_CAN
 } pinmux_mode_t;
 
+typedef enum pinmux_profile_t{
+	PINMUX_PROFILE_DEFAULT,
+	PINMUX_PROFILE_UART_GPIO,
+	PINMUX_PROFILE_SPI_GPIO,
+	PINMUX_PROFILE_ALL_GPIO
+} pinmux_profile_t;
+
 int set_pinmux_mode(int pin, pinmux_mode_t mode);
+int set_pinmux_modes(int* pins, pinmux_mode_t* modes, int n);
+int apply_pinmux_profile(pinmux_profile_t profile);
 int set_default_pinmux();
 
 
@@ -1352,20 +4177,57 @@ int gpio_get_value(unsigned int gpio, int *value);
 int gpio_set_edge(unsigned int gpio, gpio_pin_edge_t edge);
 int gpio_fd_open(unsigned int gpio);
 int gpio_fd_close(int fd);
+// gpio character device edge events with kernel timestamps
+int gpio_line_event_open(unsigned int gpio, gpio_pin_edge_t edge);
+int gpio_line_event_read(int fd, uint64_t* timestamp_ns);
 int mmap_gpio_write(int pin, int state);
 int mmap_gpio_read(int pin);
+int mmap_gpio_write_banks(const uint32_t set[4], const uint32_t clear[4]);
+int mmap_gpio_write_mask(int bank, uint32_t set_mask, uint32_t clear_mask);
+uint32_t mmap_gpio_read_bank(int bank);
+
+// A pin resolved once by mmap_gpio_pin_init to its bank's registers so each
+// access after that is a single load or store with no checks. 
+typedef struct mmap_gpio_pin_t{
+	volatile uint32_t* set;
+	volatile uint32_t* clear;
+	volatile uint32_t* datain;
+	uint32_t bit;
+} mmap_gpio_pin_t;
+int mmap_gpio_pin_init(mmap_gpio_pin_t* pin, int gpio);
+static inline void mmap_gpio_pin_write(const mmap_gpio_pin_t* pin, int state){
+	if(state) *pin->set = pin->bit;
+	else *pin->clear = pin->bit;
+}
+static inline int mmap_gpio_pin_read(const mmap_gpio_pin_t* pin){
+	return (*pin->datain & pin->bit) != 0;
+}
 
 
 
 
 /*******************************************************************************
 * PWM
+*
+* mmap_set_pwm_duty and mmap_set_pwm_duty_ab use the ePWM shadow registers so
+* new duty cycles latch at the start of the next period instead of mid-pulse.
+* mmap_set_pwm_duty_ab sets both channels of a subsystem in the same period.
+*
+* The simple_ functions go through the ti-pwm sysfs driver for kernels or
+* setups without /dev/mem access. The duty_cycle files stay open from
+* simple_init_pwm to simple_uninit_pwm so an update costs one pwrite, and
+* none if the width didn't change. simple_set_pwm_duty_ab and
+* simple_set_pwm_duty_ns_ab update both channels of a subsystem with one
+* call, but as two writes that can land a period apart.
 *******************************************************************************/
 int simple_init_pwm(int ss, int frequency);
 int simple_uninit_pwm(int ss);
 int simple_set_pwm_duty(int ss, char ch, float duty);
 int simple_set_pwm_duty_ns(int ss, char ch, int duty_ns);
+int simple_set_pwm_duty_ab(int ss, float duty_a, float duty_b);
+int simple_set_pwm_duty_ns_ab(int ss, int duty_a_ns, int duty_b_ns);
 int mmap_set_pwm_duty(int subsystem, char ch, float duty);
+int mmap_set_pwm_duty_ab(int subsystem, float duty_a, float duty_b);
 
 
 
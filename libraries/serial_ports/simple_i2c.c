@@ -30,8 +30,12 @@ USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <linux/i2c.h>     // for struct i2c_msg
 #include <linux/i2c-dev.h> //for IOCTL defs
 
 // debian wheezy enumerates the busses backwards on the BBB
@@ -42,6 +46,8 @@ USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define I2C1_FILE "/dev/i2c-1"
 #define I2C2_FILE "/dev/i2c-2"
 #define MAX_I2C_LENGTH   128
+#define MAX_I2C_BATCH    (I2C_RDWR_IOCTL_MAX_MSGS/2)
+#define MAX_I2C_REG_WRITES 64
 
 /******************************************************************
 * struct i2c_t 
@@ -51,15 +57,38 @@ USE OR OTHER DEALINGS IN THE SOFTWARE.
 ******************************************************************/
 typedef struct i2c_t {
   /* data */
-  uint8_t devAddr;
+  uint8_t devAddr;	// address the next transfer goes to
+  int fd_addr;		// address last bound to the file with I2C_SLAVE, or -1
   int bus;
   int file;
   int initialized;
-  int in_use;
+  int in_use;		// claim depth of the owning thread, 0 when free
+  int rdwr_unsupported; // set if adapter rejects I2C_RDWR transfers
+  pthread_t owner;	// thread currently holding the bus
+  int waiting[I2C_PRIORITY_LEVELS]; // threads blocked in claim per priority
+  i2c_job_t* queue;	// pending jobs, highest priority first
+  pthread_t sched_thread;
+  int sched_running;
+  int sched_stop;
 } i2c_t;
 
 i2c_t i2c[3]; 
 
+// one lock and condition per bus protect the arbiter state above
+pthread_mutex_t i2c_lock[3] = {PTHREAD_MUTEX_INITIALIZER,\
+				PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+pthread_cond_t i2c_cond[3] = {PTHREAD_COND_INITIALIZER,\
+				PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/******************************************************************
+* local function declarations
+******************************************************************/
+int i2c_rdwr_read(int bus, uint8_t regAddr, uint8_t length, uint8_t* data);
+int bind_device_address(int bus);
+int higher_priority_waiting(int bus, int priority);
+int run_i2c_job(int bus, i2c_job_t* job);
+void* i2c_scheduler(void* ptr);
+
 
 /******************************************************************
 * i2c_init
@@ -70,14 +99,15 @@ int i2c_init(int bus, uint8_t devAddr){
 		return -1;
 	}
 	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	i2c_claim_bus(bus);
 	
 	// start filling in the i2c state struct
 	i2c[bus].file = 0;
+	i2c[bus].fd_addr = -1;
 	i2c[bus].devAddr = devAddr;
 	i2c[bus].bus     = bus;
 	i2c[bus].initialized = 1;
+	i2c[bus].rdwr_unsupported = 0;
 	switch(bus){
 	case 1:
 		i2c[bus].file = open(I2C1_FILE, O_RDWR);
@@ -87,10 +117,12 @@ int i2c_init(int bus, uint8_t devAddr){
 		break;
 	default:
 		printf("i2c bus must be 1 or 2\n");
+		i2c_release_bus(bus);
 		return -1;
 	}
 	if(i2c[bus].file==-1){
 		printf("failed to open /dev/i2c\n");
+		i2c_release_bus(bus);
 		return -1;
 	}
 	#ifdef DEBUG
@@ -98,11 +130,12 @@ int i2c_init(int bus, uint8_t devAddr){
 	#endif
 	if(ioctl(i2c[bus].file, I2C_SLAVE, devAddr) < 0){
 		printf("ioctl slave address change failed\n");
+		i2c_release_bus(bus);
 		return -1;
 	}
 	i2c[bus].devAddr = devAddr;
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c[bus].fd_addr = devAddr;
+	i2c_release_bus(bus);
 	
 	#ifdef DEBUG
 	printf("successfully initialized i2c_%d\n", bus);
@@ -112,25 +145,38 @@ int i2c_init(int bus, uint8_t devAddr){
 
 /******************************************************************
 * i2c_set_device_address
+* 
+* only records the address. Register reads carry the address in 
+* each I2C_RDWR message so switching between devices costs nothing,
+* the I2C_SLAVE ioctl is issued lazily by bind_device_address before
+* a plain write() or read() and only if that fd is bound elsewhere.
 ******************************************************************/
 int i2c_set_device_address(int bus, uint8_t devAddr){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	// if the device address is already correct, just return
-	if(i2c[bus].devAddr == devAddr){
-		return 0;
-	}
-	// if not, change it with ioctl
+	i2c[bus].devAddr = devAddr;
+	return 0;
+}
+
+/******************************************************************
+* bind_device_address
+* 
+* make sure the file descriptor is bound to the current device
+* address before a write() or read() syscall.
+******************************************************************/
+int bind_device_address(int bus){
+	if(i2c[bus].fd_addr == i2c[bus].devAddr) return 0;
 	#ifdef DEBUG
 	printf("calling ioctl slave address change\n");
 	#endif
-	if(ioctl(i2c[bus].file, I2C_SLAVE, devAddr) < 0){
+	if(ioctl(i2c[bus].file, I2C_SLAVE, i2c[bus].devAddr) < 0){
 		printf("ioctl slave address change failed\n");
+		i2c[bus].fd_addr = -1;
 		return -1;
 	}
-	i2c[bus].devAddr = devAddr;
+	i2c[bus].fd_addr = i2c[bus].devAddr;
 	return 0;
 }
 
@@ -142,45 +188,280 @@ int i2c_close(int bus){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
+	// stop the scheduler first, any jobs still queued fail with -1
+	pthread_mutex_lock(&i2c_lock[bus]);
+	if(i2c[bus].sched_running){
+		i2c[bus].sched_stop = 1;
+		pthread_cond_broadcast(&i2c_cond[bus]);
+		pthread_mutex_unlock(&i2c_lock[bus]);
+		pthread_join(i2c[bus].sched_thread, NULL);
+		pthread_mutex_lock(&i2c_lock[bus]);
+		i2c[bus].sched_running = 0;
+		i2c[bus].sched_stop = 0;
+	}
+	pthread_mutex_unlock(&i2c_lock[bus]);
+	
 	i2c[bus].devAddr = 0;
+	i2c[bus].fd_addr = -1;
 	if(close(i2c[bus].file) < 0) return -1;
 	i2c[bus].initialized = 0;
 	return 0;
 }
 
 /******************************************************************
-* i2c_claim_bus(int bus)
+* higher_priority_waiting(int bus, int priority)
+* 
+* returns 1 if a thread of greater priority than the one given is
+* blocked waiting for the bus. Call with i2c_lock held.
 ******************************************************************/
-int i2c_claim_bus(int bus){
+int higher_priority_waiting(int bus, int priority){
+	int i;
+	for(i=priority+1;i<I2C_PRIORITY_LEVELS;i++){
+		if(i2c[bus].waiting[i]) return 1;
+	}
+	return 0;
+}
+
+/******************************************************************
+* i2c_claim_bus_priority(int bus, int priority)
+* 
+* blocks until the bus is free and no thread of higher priority is
+* waiting for it. Claims nest so a thread already holding the bus
+* may call any of the transfer functions below.
+******************************************************************/
+int i2c_claim_bus_priority(int bus, int priority){
+	pthread_t self;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	i2c[bus].in_use=1;
+	if(priority<0 || priority>=I2C_PRIORITY_LEVELS){
+		printf("i2c priority must be between 0 and %d\n",\
+											I2C_PRIORITY_LEVELS-1);
+		return -1;
+	}
+	self = pthread_self();
+	pthread_mutex_lock(&i2c_lock[bus]);
+	if(i2c[bus].in_use && pthread_equal(i2c[bus].owner, self)){
+		i2c[bus].in_use++;
+		pthread_mutex_unlock(&i2c_lock[bus]);
+		return 0;
+	}
+	i2c[bus].waiting[priority]++;
+	while(i2c[bus].in_use || higher_priority_waiting(bus, priority)){
+		pthread_cond_wait(&i2c_cond[bus], &i2c_lock[bus]);
+	}
+	i2c[bus].waiting[priority]--;
+	i2c[bus].owner = self;
+	i2c[bus].in_use = 1;
+	pthread_mutex_unlock(&i2c_lock[bus]);
 	return 0;
 }
 
+/******************************************************************
+* i2c_claim_bus(int bus)
+******************************************************************/
+int i2c_claim_bus(int bus){
+	return i2c_claim_bus_priority(bus, I2C_PRIORITY_NORMAL);
+}
+
 /******************************************************************
 * i2c_release_bus(int bus)
+* 
+* releasing a bus this thread does not hold is harmless and ignored
 ******************************************************************/
 int i2c_release_bus(int bus){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	i2c[bus].in_use=0;
+	pthread_mutex_lock(&i2c_lock[bus]);
+	if(i2c[bus].in_use && pthread_equal(i2c[bus].owner, pthread_self())){
+		i2c[bus].in_use--;
+		if(i2c[bus].in_use==0) pthread_cond_broadcast(&i2c_cond[bus]);
+	}
+	pthread_mutex_unlock(&i2c_lock[bus]);
 	return 0;
 }
 
 /******************************************************************
 * i2c_get_in_use_state(int bus)
+* 
+* returns 1 only if another thread holds the bus
 ******************************************************************/
 int i2c_get_in_use_state(int bus){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	return i2c[bus].in_use;
+	if(i2c[bus].in_use==0) return 0;
+	if(pthread_equal(i2c[bus].owner, pthread_self())) return 0;
+	return 1;
+}
+
+/******************************************************************
+* run_i2c_job(int bus, i2c_job_t* job)
+* 
+* executes one job with the bus held, leaving the device address as
+* it was found for code that doesn't set it before every transfer.
+******************************************************************/
+int run_i2c_job(int bus, i2c_job_t* job){
+	int ret;
+	uint8_t old_addr;
+	
+	i2c_claim_bus_priority(bus, job->priority);
+	old_addr = i2c[bus].devAddr;
+	if(i2c_set_device_address(bus, job->devAddr)<0) ret = -1;
+	else if(job->write){
+		ret = i2c_write_bytes(bus, job->regAddr, job->length, job->data);
+	}
+	else{
+		ret = i2c_read_bytes(bus, job->regAddr, job->length, job->data);
+		ret = (ret==job->length) ? 0 : -1;
+	}
+	if(old_addr!=0) i2c_set_device_address(bus, old_addr);
+	i2c_release_bus(bus);
+	return ret;
+}
+
+/******************************************************************
+* i2c_scheduler(void* ptr)
+* 
+* owner thread for one bus. Takes the highest priority job off the
+* queue and runs it, so jobs from different drivers never interleave
+* and urgent claimants such as the IMU still get in between jobs.
+******************************************************************/
+void* i2c_scheduler(void* ptr){
+	int bus = (int)(intptr_t)ptr;
+	i2c_job_t* job;
+	
+	pthread_mutex_lock(&i2c_lock[bus]);
+	while(1){
+		while(i2c[bus].queue==NULL && !i2c[bus].sched_stop){
+			pthread_cond_wait(&i2c_cond[bus], &i2c_lock[bus]);
+		}
+		if(i2c[bus].sched_stop) break;
+		job = i2c[bus].queue;
+		i2c[bus].queue = job->next;
+		pthread_mutex_unlock(&i2c_lock[bus]);
+		
+		job->result = run_i2c_job(bus, job);
+		
+		pthread_mutex_lock(&i2c_lock[bus]);
+		job->done = 1;
+		pthread_cond_broadcast(&i2c_cond[bus]);
+	}
+	// fail anything left so the submitters can return
+	while(i2c[bus].queue!=NULL){
+		job = i2c[bus].queue;
+		i2c[bus].queue = job->next;
+		job->result = -1;
+		job->done = 1;
+	}
+	pthread_cond_broadcast(&i2c_cond[bus]);
+	pthread_mutex_unlock(&i2c_lock[bus]);
+	return NULL;
+}
+
+/******************************************************************
+* i2c_submit_job(int bus, i2c_job_t* job)
+* 
+* queues a job for the bus owner thread, starting it on first use,
+* and blocks until the job has run.
+******************************************************************/
+int i2c_submit_job(int bus, i2c_job_t* job){
+	i2c_job_t** p;
+	
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(job==NULL || job->data==NULL || job->length>MAX_I2C_LENGTH){
+		printf("ERROR: invalid i2c job\n");
+		return -1;
+	}
+	if(job->priority<0 || job->priority>=I2C_PRIORITY_LEVELS){
+		printf("i2c priority must be between 0 and %d\n",\
+											I2C_PRIORITY_LEVELS-1);
+		return -1;
+	}
+	if(!i2c[bus].initialized){
+		printf("ERROR: i2c bus %d not initialized\n", bus);
+		return -1;
+	}
+	// a thread already holding the bus would deadlock the owner thread
+	// so run the job right here instead
+	if(i2c_get_in_use_state(bus)==0 && i2c[bus].in_use){
+		job->result = run_i2c_job(bus, job);
+		job->done = 1;
+		return job->result;
+	}
+	
+	pthread_mutex_lock(&i2c_lock[bus]);
+	if(!i2c[bus].sched_running){
+		if(create_rt_thread(&i2c[bus].sched_thread, RT_SERVICE_I2C, i2c_scheduler,\
+												(void*)(intptr_t)bus)){
+			pthread_mutex_unlock(&i2c_lock[bus]);
+			printf("ERROR: failed to start i2c scheduler thread\n");
+			return -1;
+		}
+		i2c[bus].sched_running = 1;
+	}
+	// insert behind every job of equal or greater priority
+	job->done = 0;
+	job->next = NULL;
+	p = &i2c[bus].queue;
+	while(*p!=NULL && (*p)->priority>=job->priority) p = &(*p)->next;
+	job->next = *p;
+	*p = job;
+	pthread_cond_broadcast(&i2c_cond[bus]);
+	while(!job->done) pthread_cond_wait(&i2c_cond[bus], &i2c_lock[bus]);
+	pthread_mutex_unlock(&i2c_lock[bus]);
+	return job->result;
+}
+
+/******************************************************************
+* i2c_rdwr_read
+* 
+* write the register address then read the response with a 
+* repeated start in a single I2C_RDWR ioctl. If the adapter does
+* not support combined transfers, fall back to write() + read()
+* and remember not to try again. Returns number of bytes read.
+******************************************************************/
+int i2c_rdwr_read(int bus, uint8_t regAddr, uint8_t length, uint8_t* data){
+	int ret;
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+	
+	if(!i2c[bus].rdwr_unsupported){
+		msgs[0].addr  = i2c[bus].devAddr;
+		msgs[0].flags = 0;
+		msgs[0].len   = 1;
+		msgs[0].buf   = &regAddr;
+		msgs[1].addr  = i2c[bus].devAddr;
+		msgs[1].flags = I2C_M_RD;
+		msgs[1].len   = length;
+		msgs[1].buf   = data;
+		xfer.msgs  = msgs;
+		xfer.nmsgs = 2;
+		ret = ioctl(i2c[bus].file, I2C_RDWR, &xfer);
+		if(ret==2) return length;
+		if(errno!=EOPNOTSUPP && errno!=ENOSYS && errno!=EINVAL) return -1;
+		#ifdef DEBUG
+		printf("I2C_RDWR not supported, using write+read\n");
+		#endif
+		i2c[bus].rdwr_unsupported = 1;
+	}
+	
+	// write register to device 
+	if(bind_device_address(bus)<0) return -1;
+	ret = write(i2c[bus].file, &regAddr, 1);
+	if(ret!=1){ 
+		printf("write to i2c bus failed\n");
+		return -1;
+	}
+	// then read the response
+	return read(i2c[bus].file, data, length);
 }
 
 /******************************************************************
@@ -202,27 +483,18 @@ int i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,\
     }
 
 	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	i2c_claim_bus(bus);
 	
 	#ifdef DEBUG
 	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
 	printf("reading %d bytes from 0x%x\n", length, regAddr);
 	#endif
 	
-	// write register to device 
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(ret!=1){ 
-		printf("write to i2c bus failed\n");
-		return -1;
-	}
-	
-	// then read the response
-	//usleep(300);
-	ret = read(i2c[bus].file, data, length);
+	// write register and read response in one transaction
+	ret = i2c_rdwr_read(bus, regAddr, length, data);
+	if(ret!=length) metric_add(METRIC_I2C_ERRORS, 1);
 
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_release_bus(bus);
     return ret;
 }
 
@@ -239,7 +511,7 @@ int i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data) {
 int i2c_read_words(int bus, uint8_t regAddr, uint8_t length,\
 												uint16_t *data) {
     int ret,i;
-	char buf[MAX_I2C_LENGTH];
+	uint8_t buf[MAX_I2C_LENGTH];
 	
     // Boundary checks
 	if(bus!=1 && bus!=2){
@@ -255,36 +527,29 @@ int i2c_read_words(int bus, uint8_t regAddr, uint8_t length,\
     }
 	
 	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	i2c_claim_bus(bus);
 	
 	#ifdef DEBUG
 	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
 	printf("reading %d words from 0x%x\n", length, regAddr);
 	#endif
 
-	// write first 
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(ret!=1){
-		printf("write to i2c bus failed\n");
-		return -1;
-	}
-
-	// then read the response
-	ret = read(i2c[bus].file, buf, length*2);
+	// write register and read response in one transaction
+	ret = i2c_rdwr_read(bus, regAddr, length*2, buf);
 	if(ret!=(length*2)){
 		printf("i2c device returned %d bytes\n",ret);
-		printf("expected %d bytes instead\n",length);
+		printf("expected %d bytes instead\n",length*2);
+		metric_add(METRIC_I2C_ERRORS, 1);
+		i2c_release_bus(bus);
 		return -1;
 	}
 	
 	// form words from bytes and put into user's data array
 	for(i=0;i<length;i++){
-		data[i] = (((uint16_t)buf[0])<<8 | buf[1]); 
+		data[i] = (((uint16_t)buf[2*i])<<8 | buf[(2*i)+1]); 
 	}
 	
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_release_bus(bus);
 	
     return 0;
 }
@@ -307,6 +572,165 @@ int i2c_read_bit(int bus, uint8_t regAddr, uint8_t bitNum,\
     return count;
 }
 
+/******************************************************************
+* i2c_transfer_batch
+*
+* submit up to MAX_I2C_BATCH register reads, possibly to different
+* device addresses, in a single I2C_RDWR ioctl. Each read is a
+* register write followed by a repeated-start read so the whole
+* batch costs one syscall.
+******************************************************************/
+int i2c_transfer_batch(int bus, i2c_read_req_t* reqs, int n){
+	int i, ret;
+	struct i2c_msg msgs[2*MAX_I2C_BATCH];
+	struct i2c_rdwr_ioctl_data xfer;
+	
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(n<1 || n>MAX_I2C_BATCH){
+		printf("i2c_transfer_batch n must be between 1 and %d\n",\
+														MAX_I2C_BATCH);
+		return -1;
+	}
+	
+	// adapter can't do combined transfers, do them one at a time
+	if(i2c[bus].rdwr_unsupported){
+		i2c_claim_bus(bus);
+		uint8_t old_addr = i2c[bus].devAddr;
+		ret = 0;
+		for(i=0;i<n && ret==0;i++){
+			if(i2c_set_device_address(bus, reqs[i].devAddr)<0) ret = -1;
+			else if(i2c_read_bytes(bus, reqs[i].regAddr, reqs[i].length,\
+									reqs[i].data)!=reqs[i].length) ret = -1;
+		}
+		i2c_set_device_address(bus, old_addr);
+		i2c_release_bus(bus);
+		return ret;
+	}
+	
+	// two messages per request, register write then read
+	for(i=0;i<n;i++){
+		if(reqs[i].length > MAX_I2C_LENGTH){
+			printf("i2c_transfer_batch length must be <= MAX_I2C_LENGTH\n");
+			return -1;
+		}
+		msgs[2*i].addr  = reqs[i].devAddr;
+		msgs[2*i].flags = 0;
+		msgs[2*i].len   = 1;
+		msgs[2*i].buf   = &reqs[i].regAddr;
+		msgs[(2*i)+1].addr  = reqs[i].devAddr;
+		msgs[(2*i)+1].flags = I2C_M_RD;
+		msgs[(2*i)+1].len   = reqs[i].length;
+		msgs[(2*i)+1].buf   = reqs[i].data;
+	}
+	xfer.msgs  = msgs;
+	xfer.nmsgs = 2*n;
+	
+	// claim the bus during this operation
+	i2c_claim_bus(bus);
+	
+	#ifdef DEBUG
+	printf("i2c submitting batch of %d reads\n", n);
+	#endif
+	
+	ret = ioctl(i2c[bus].file, I2C_RDWR, &xfer);
+	
+	i2c_release_bus(bus);
+	if(ret!=2*n){
+		printf("i2c_transfer_batch failed\n");
+		metric_add(METRIC_I2C_ERRORS, 1);
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************
+* i2c_write_regs
+*
+* write a list of single register values to the current device.
+* Runs of consecutive register addresses are merged into one
+* auto-incremented write and all the runs go out together in as few
+* I2C_RDWR ioctls as possible. The order of the list is preserved.
+******************************************************************/
+int i2c_write_regs(int bus, const i2c_reg_write_t* regs, int n){
+	int i, j, groups, ret;
+	uint8_t buf[2*MAX_I2C_REG_WRITES];
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct i2c_rdwr_ioctl_data xfer;
+	uint8_t* p;
+	
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(n<1 || n>MAX_I2C_REG_WRITES){
+		printf("i2c_write_regs n must be between 1 and %d\n",\
+													MAX_I2C_REG_WRITES);
+		return -1;
+	}
+	
+	// claim the bus during this operation
+	i2c_claim_bus(bus);
+	
+	p = buf;
+	i = 0;
+	ret = 0;
+	while(i<n && ret==0){
+		// pack up to one ioctl worth of runs
+		groups = 0;
+		while(i<n && groups<I2C_RDWR_IOCTL_MAX_MSGS){
+			msgs[groups].addr  = i2c[bus].devAddr;
+			msgs[groups].flags = 0;
+			msgs[groups].buf   = p;
+			*p++ = regs[i].regAddr;
+			*p++ = regs[i].data;
+			j = i+1;
+			while(j<n && regs[j].regAddr==(uint8_t)(regs[j-1].regAddr+1)){
+				*p++ = regs[j].data;
+				j++;
+			}
+			msgs[groups].len = p - msgs[groups].buf;
+			groups++;
+			i = j;
+		}
+		
+		#ifdef DEBUG
+		printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+		printf("writing %d register runs\n", groups);
+		#endif
+		
+		if(!i2c[bus].rdwr_unsupported){
+			xfer.msgs  = msgs;
+			xfer.nmsgs = groups;
+			if(ioctl(i2c[bus].file, I2C_RDWR, &xfer)==groups) continue;
+			if(errno!=EOPNOTSUPP && errno!=ENOSYS && errno!=EINVAL){
+				ret = -1;
+				break;
+			}
+			i2c[bus].rdwr_unsupported = 1;
+		}
+		// one write() per run instead
+		if(bind_device_address(bus)<0){
+			ret = -1;
+			break;
+		}
+		for(j=0;j<groups;j++){
+			if(write(i2c[bus].file, msgs[j].buf, msgs[j].len)!=msgs[j].len){
+				ret = -1;
+				break;
+			}
+		}
+	}
+	i2c_release_bus(bus);
+	if(ret<0){
+		printf("i2c_write_regs failed\n");
+		metric_add(METRIC_I2C_ERRORS, 1);
+	}
+	return ret;
+}
+
 /******************************************************************
 * i2c_write_bytes
 ******************************************************************/
@@ -321,8 +745,7 @@ int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
 	}
 	
 	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	i2c_claim_bus(bus);
 	
 	// assemble array to send, starting with the register address
 	writeData[0] = regAddr; 
@@ -341,14 +764,19 @@ int i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
 	#endif 
 	
 	// send the bytes
+	if(bind_device_address(bus)<0){
+		i2c_release_bus(bus);
+		return -1;
+	}
 	ret = write(i2c[bus].file, writeData, length+1);
     // write should have returned the correct # bytes written
 	if( ret!=(length+1)){
 		printf("i2c_write failed\n");
+		metric_add(METRIC_I2C_ERRORS, 1);
+		i2c_release_bus(bus);
 		return -1;
 	}
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_release_bus(bus);
 	return 0;
 }
 
@@ -368,9 +796,8 @@ int i2c_write_words(int bus, uint8_t regAddr, uint8_t length,\
 	int i,ret;
 	uint8_t writeData[(length*2)+1];
    
-   // claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+   	// claim the bus during this operation
+	i2c_claim_bus(bus);
 	
    // assemble bytes to send
    writeData[0] = regAddr;
@@ -389,14 +816,19 @@ int i2c_write_words(int bus, uint8_t regAddr, uint8_t length,\
     printf("\n");
 #endif 
 
+	if(bind_device_address(bus)<0){
+		i2c_release_bus(bus);
+		return -1;
+	}
     ret = write(i2c[bus].file, writeData, (length*2)+1);
 	if(ret!=(length*2)+1){
 		printf("i2c write failed\n");
+		metric_add(METRIC_I2C_ERRORS, 1);
+		i2c_release_bus(bus);
 		return -1;
 	}
 
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_release_bus(bus);
 	
    return 0;
 }
@@ -434,8 +866,7 @@ int i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
 	}
 	
 	// claim the bus during this operation
-	int old_in_use= i2c[bus].in_use;
-	i2c[bus].in_use = 1;
+	i2c_claim_bus(bus);
 	
 #ifdef DEBUG
 	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
@@ -443,10 +874,15 @@ int i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
 #endif
 
 	// send the bytes
+	if(bind_device_address(bus)<0){
+		i2c_release_bus(bus);
+		return -1;
+	}
 	ret = write(i2c[bus].file, data, length);
     // write should have returned the correct # bytes written
 	if(ret!=length){
 		printf("i2c_send failed\n");
+		i2c_release_bus(bus);
 		return -1;
 	}
 
@@ -459,8 +895,7 @@ int i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
     printf("\n");
 #endif 
 	
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	i2c_release_bus(bus);
 	
 	return 0;
 }
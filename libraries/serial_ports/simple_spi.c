@@ -22,14 +22,15 @@
 #define SPI_MIN_SPEED 		1000		// 1khz
 #define SPI_BITS_PER_WORD 	8
 #define SPI_BUF_SIZE		2		
+#define SPI_MAX_XFERS		32	// most transfers in one spi_transfer_list
 
 int fd[2]; // file descriptor for SPI1_PATH device cs0, cs1
 int initialized[2]; // set to 1 after successful initialization 
 int gpio_ss[2];		// holds gpio pins for slave select lines
 
-struct spi_ioc_transfer xfer[2]; // ioctl transfer structs for tx & rx
-char tx_buf[SPI_BUF_SIZE];
-char rx_buf[SPI_BUF_SIZE];
+// per-slave ioctl transfer template holding the speed and word size so
+// each call only fills in buffers and lengths
+struct spi_ioc_transfer xfer_template[2];
 
 /*******************************************************************************
 * @ int initialize_spi(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave)
@@ -113,15 +114,12 @@ int initialize_spi(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave){
 		 return -1;
 	}
 
-	// store settings
-    xfer[0].cs_change = 1;
-    xfer[0].delay_usecs = 0;
-    xfer[0].speed_hz = speed_hz;
-    xfer[0].bits_per_word = SPI_BITS_PER_WORD;
-    xfer[1].cs_change = 1;
-    xfer[1].delay_usecs = 0;
-    xfer[1].speed_hz = speed_hz;
-    xfer[1].bits_per_word = SPI_BITS_PER_WORD;
+	// store settings for this slave
+	memset(&xfer_template[slave-1], 0, sizeof(struct spi_ioc_transfer));
+	xfer_template[slave-1].cs_change = 1;
+	xfer_template[slave-1].delay_usecs = 0;
+	xfer_template[slave-1].speed_hz = speed_hz;
+	xfer_template[slave-1].bits_per_word = SPI_BITS_PER_WORD;
 	
 
     // set up slave select pins
@@ -271,14 +269,14 @@ int spi_send_bytes(char* data, int bytes, int slave){
 	}
 
 	int ret;
+	struct spi_ioc_transfer xfer = xfer_template[slave-1];
 
 	// fill in ioctl xfer struct. speed and bits were already set in initialize
-	xfer[0].rx_buf = 0;
-	xfer[0].tx_buf = (unsigned long) data;
-	xfer[0].len = bytes;
+	xfer.tx_buf = (unsigned long) data;
+	xfer.len = bytes;
 	
 	// send
-	ret = ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer);
+	ret = ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), &xfer);
 	if(ret<0){
 		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
@@ -307,14 +305,14 @@ int spi_read_bytes(char* data, int bytes, int slave){
 	}
 
 	int ret;
+	struct spi_ioc_transfer xfer = xfer_template[slave-1];
 
 	// fill in ioctl xfer struct. speed and bits were already set in initialize
-	xfer[0].rx_buf = (unsigned long) data;;
-	xfer[0].tx_buf = 0;
-	xfer[0].len = bytes;
+	xfer.rx_buf = (unsigned long) data;
+	xfer.len = bytes;
 	
 	// receive
-	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer);
+	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), &xfer);
 	if(ret<0){
 		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
@@ -344,13 +342,14 @@ int spi_transfer(char* tx_data, int tx_bytes, char* rx_data, int slave){
 	}
 	
 	int ret;
+	struct spi_ioc_transfer xfer = xfer_template[slave-1];
 
 	// fill in send struct 
-	xfer[0].tx_buf = (unsigned long) tx_data; 
-	xfer[0].rx_buf = (unsigned long) rx_data;
-	xfer[0].len = tx_bytes;
+	xfer.tx_buf = (unsigned long) tx_data; 
+	xfer.rx_buf = (unsigned long) rx_data;
+	xfer.len = tx_bytes;
 
-	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer);
+	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), &xfer);
 	if(ret<0){
 		printf("SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
@@ -378,17 +377,19 @@ int spi_write_reg_byte(char reg_addr, char data, int slave){
 		return -1;
 	} 
 	
-	//wipe TX buffer and fill in register address and data
-	memset(tx_buf, 0, sizeof tx_buf);
+	char tx_buf[SPI_BUF_SIZE];
+	struct spi_ioc_transfer xfer = xfer_template[slave-1];
+	
+	// fill in register address and data
 	tx_buf[0] = reg_addr | 0x80; /// set MSBit = 1 to indicate it's a write
 	tx_buf[1] = data;
   
 	// fill in ioctl zfer struct. speed and bits were already set in initialize
-	xfer[0].tx_buf = (unsigned long) tx_buf;
-	xfer[0].len = 2;
+	xfer.tx_buf = (unsigned long) tx_buf;
+	xfer.len = 2;
 	
 	// send
-	if(ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer)<0){
+	if(ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), &xfer)<0){
 		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
 	}
@@ -413,17 +414,17 @@ char spi_read_reg_byte(char reg_addr, int slave){
 		return -1;
 	} 
 	
-	// wipe buffers
-	memset(tx_buf, 0, sizeof tx_buf);
-	memset(rx_buf, 0, sizeof rx_buf);
+	char tx_buf[SPI_BUF_SIZE] = {0};
+	char rx_buf[SPI_BUF_SIZE] = {0};
+	struct spi_ioc_transfer xfer = xfer_template[slave-1];
 	
 	// fill in xfer struct 
 	tx_buf[0] = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
-	xfer[0].tx_buf = (unsigned long) tx_buf; 
-	xfer[0].rx_buf = (unsigned long) rx_buf;
-	xfer[0].len = 1;
+	xfer.tx_buf = (unsigned long) tx_buf; 
+	xfer.rx_buf = (unsigned long) rx_buf;
+	xfer.len = 1;
 
-	if(ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer)<0){
+	if(ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), &xfer)<0){
 		printf("SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
 	}
@@ -452,18 +453,18 @@ int spi_read_reg_bytes(char reg_addr, char* data, int bytes, int slave){
 	}
 
 	int ret;
+	char tx_buf = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
+	struct spi_ioc_transfer xfer[2];
 
-	// wipe buffers
-	memset(tx_buf, 0, sizeof tx_buf);
 	memset(data, 0, bytes);
 	
-	// fill in send struct 
-	tx_buf[0] = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
-	xfer[0].tx_buf = (unsigned long) tx_buf; 
-	xfer[0].rx_buf = 0;
+	// fill in send struct, keeping the slave selected for the response
+	xfer[0] = xfer_template[slave-1];
+	xfer[0].tx_buf = (unsigned long) &tx_buf; 
 	xfer[0].len = 1;
+	xfer[0].cs_change = 0;
 	// fill in receive struct
-	xfer[1].tx_buf = 0;
+	xfer[1] = xfer_template[slave-1];
 	xfer[1].rx_buf = (unsigned long) data;
 	xfer[1].len = bytes;
 
@@ -476,4 +477,59 @@ int spi_read_reg_bytes(char reg_addr, char* data, int bytes, int slave){
 	return 0;
 }
 
-
+/*******************************************************************************
+* int spi_transfer_list(spi_xfer_t* list, int n, int slave)
+*
+* Submits up to SPI_MAX_XFERS transfers as one SPI message so a whole burst of
+* register reads costs a single ioctl. Each entry starts from the slave's
+* template so only buffers, length, cs_change and any speed_hz override are
+* filled in here.
+* Returns the total number of bytes clocked or -1 on error.
+*******************************************************************************/
+int spi_transfer_list(spi_xfer_t* list, int n, int slave){
+	int i, ret;
+	struct spi_ioc_transfer xfer[SPI_MAX_XFERS];
+	
+	// sanity checks
+	if(slave!=1 && slave!=2){
+		printf("ERROR: SPI slave must be 1 or 2\n");
+		return -1;
+	}
+	if(initialized[slave-1]==0){
+		printf("ERROR: SPI slave %d not yet initialized\n", slave);
+		return -1;
+	}
+	if(n<1 || n>SPI_MAX_XFERS){
+		printf("ERROR: spi_transfer_list n must be between 1 and %d\n",\
+															SPI_MAX_XFERS);
+		return -1;
+	}
+	
+	for(i=0;i<n;i++){
+		if(list[i].bytes<1){
+			printf("ERROR: spi_transfer_list, bytes must be >=1\n");
+			return -1;
+		}
+		if(list[i].speed_hz>SPI_MAX_SPEED){
+			printf("ERROR: spi_transfer_list speed_hz must be <= %d\n", \
+																SPI_MAX_SPEED);
+			return -1;
+		}
+		xfer[i] = xfer_template[slave-1];
+		xfer[i].tx_buf = (unsigned long) list[i].tx_data;
+		xfer[i].rx_buf = (unsigned long) list[i].rx_data;
+		xfer[i].len = list[i].bytes;
+		xfer[i].cs_change = list[i].cs_change;
+		if(list[i].speed_hz>0) xfer[i].speed_hz = list[i].speed_hz;
+	}
+	// on the last transfer spidev reads cs_change as "leave the slave
+	// selected after the message", which would hang it off the bus
+	xfer[n-1].cs_change = 0;
+	
+	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(n), xfer);
+	if(ret<0){
+		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
+		return -1;
+	}
+	return ret;
+}
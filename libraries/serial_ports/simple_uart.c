@@ -8,12 +8,64 @@
 
 #include "../roboticscape.h"
 #include "../roboticscape-usefulincludes.h"
+#include <linux/serial.h>	// ASYNC_LOW_LATENCY
 
 #define MIN_BUS 0
 #define MAX_BUS 5
 
 // Most bytes to read at once. This is the size of the Sitara UART FIFO buffer.
 #define MAX_READ_LEN 128
+#ifdef RC_SMALL_MEMORY
+#define UART_RX_DEFAULT_SIZE	1024
+#else
+#define UART_RX_DEFAULT_SIZE	4096
+#endif
+#define UART_RX_MAX_SIZE		(1<<20)
+#define UART_RX_POLL_MS			100	// how often the rx thread checks for exit
+#define UART_BOTHER				0010000	// cflag speed bits for a custom rate
+
+/*******************************************************************************
+* struct uart_termios2_t
+*
+* The kernel's termios2, which carries the baud rate as a plain number. It 
+* can't be included alongside glibc's termios.h so it is repeated here with
+* the ioctls that take it.
+*******************************************************************************/
+typedef struct uart_termios2_t{
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+} uart_termios2_t;
+
+#define UART_TCGETS2	_IOR('T', 0x2A, uart_termios2_t)
+#define UART_TCSETS2	_IOW('T', 0x2B, uart_termios2_t)
+
+/*******************************************************************************
+* struct uart_rx_t
+*
+* Receive ring for one bus. The rx thread is the only writer of head and the
+* user the only writer of tail so no lock is needed to move data. The mutex 
+* and condition only exist so blocking reads can sleep until data arrives.
+*******************************************************************************/
+typedef struct uart_rx_t{
+	char* buf;
+	unsigned int size;			// power of 2
+	volatile unsigned int head;	// total bytes written by the rx thread
+	volatile unsigned int tail;	// total bytes consumed by the user
+	volatile unsigned int overruns; // times the ring was full
+	pthread_t thread;
+	int running;
+	volatile int stop;
+	volatile int waiters;		// blocking readers asleep on cond
+	void (*callback)(int bus, int bytes);
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} uart_rx_t;
 
 /*******************************************************************************
 * Local Global Variables
@@ -29,21 +81,64 @@ char *paths[6] = { \
 
 int fd[6]; // file descriptors for all ports
 float bus_timeout_s[6]; // user-requested timeout in seconds for each bus
+uart_rx_t rx[6];
+
+/*******************************************************************************
+* local function declarations
+*******************************************************************************/
+void* uart_rx_handler(void* ptr);
+int set_uart_custom_baud(int bus, int baudrate);
+int set_uart_low_latency(int bus);
+int set_uart_rx_trigger(int bus, int bytes);
+int uart_rx_wait(int bus, int bytes, struct timespec* deadline);
+int uart_read_bytes_ring(int bus, int bytes, char* buf);
+int uart_read_line_ring(int bus, int max_bytes, char* buf);
 
 /*******************************************************************************
-* int initialize_uart(int bus, int baudrate)
+* uart_config_t get_default_uart_config()
+*
+* 115200 8N1 with a 0.5 second timeout and the driver's own latency settings
+*******************************************************************************/
+uart_config_t get_default_uart_config(){
+	uart_config_t conf;
+	conf.baudrate = 115200;
+	conf.timeout_s = 0.5;
+	conf.parity = UART_PARITY_NONE;
+	conf.stop_bits = 1;
+	conf.low_latency = 0;
+	conf.rx_trigger = 0;
+	return conf;
+}
+
+/*******************************************************************************
+* int initialize_uart(int bus, int baudrate, float timeout_s)
+* 
+* 8N1 with otherwise default settings, see initialize_uart_config
+*******************************************************************************/ 
+int initialize_uart(int bus, int baudrate, float timeout_s){
+	uart_config_t conf = get_default_uart_config();
+	conf.baudrate = baudrate;
+	conf.timeout_s = timeout_s;
+	return initialize_uart_config(bus, conf);
+}
+
+/*******************************************************************************
+* int initialize_uart_config(int bus, uart_config_t conf)
 * 
 * bus needs to be between MIN_BUS and MAX_BUS which here is 0 & 5.
-* baudrate must be one of the standard speeds in the UART spec. 115200 and 
-* 57600 are most common.
+* Standard baudrates go through termios as before, anything else is set as a
+* plain number with termios2 and BOTHER so the driver picks the nearest 
+* divisor it can make, for instance 100000 for SBUS.
 * timeout is in seconds and must be >=0.1
 *
 * returns -1 for failure or 0 for success
 *******************************************************************************/ 
-int initialize_uart(int bus, int baudrate, float timeout_s){
+int initialize_uart_config(int bus, uart_config_t conf){
 
 	struct termios config;
 	speed_t speed; //baudrate
+	int custom = 0;
+	float timeout_s = conf.timeout_s;
 	
 	// sanity checks
 	if(bus<MIN_BUS || bus>MAX_BUS){
@@ -54,8 +149,41 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 		printf("ERROR: timeout must be >=0.1 seconds\n");
 		return -1;
 	}
+	if(conf.stop_bits!=1 && conf.stop_bits!=2){
+		printf("ERROR: uart stop_bits must be 1 or 2\n");
+		return -1;
+	}
+	if(conf.rx_trigger<0 || conf.rx_trigger>MAX_READ_LEN/2){
+		printf("ERROR: uart rx_trigger must be between 0 & %d\n", \
+															MAX_READ_LEN/2);
+		return -1;
+	}
 	
-	switch(baudrate){
+	switch(conf.baudrate){
+	case (3000000): 
+		speed=B3000000;
+		break;
+	case (2000000): 
+		speed=B2000000;
+		break;
+	case (1500000): 
+		speed=B1500000;
+		break;
+	case (1000000): 
+		speed=B1000000;
+		break;
+	case (921600): 
+		speed=B921600;
+		break;
+	case (576000): 
+		speed=B576000;
+		break;
+	case (500000): 
+		speed=B500000;
+		break;
+	case (460800): 
+		speed=B460800;
+		break;
 	case (230400): 
 		speed=B230400;
 		break;
@@ -111,8 +239,13 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 		speed=B50;
 		break;
 	default:
-		printf("ERROR: invalid speed. Please use a standard baudrate\n");
-		return -1;
+		if(conf.baudrate<50 || conf.baudrate>3686400){
+			printf("ERROR: uart baudrate must be between 50 & 3686400\n");
+			return -1;
+		}
+		// set a placeholder through termios, the real rate goes in after
+		speed = B38400;
+		custom = 1;
 	}
 	
 	// close the bus in case it was already open
@@ -147,6 +280,9 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 	config.c_cflag |= CS8;		// set size to 8 bit characters
 	config.c_cflag |= CREAD;    // enable reading
     config.c_cflag |= CLOCAL;	// ignore modem status lines
+	if(conf.stop_bits==2) config.c_cflag |= CSTOPB;
+	if(conf.parity==UART_PARITY_EVEN) config.c_cflag |= PARENB;
+	else if(conf.parity==UART_PARITY_ODD) config.c_cflag |= PARENB|PARODD;
 	
 	// convert float timeout in seconds to int timeout in tenths of a second
 	int tenths = (timeout_s*10);
@@ -177,6 +313,14 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 		return -1;
 	}
 	tcflush(fd[bus],TCIOFLUSH);
+	if(custom && set_uart_custom_baud(bus, conf.baudrate)<0){
+		close(fd[bus]);
+		return -1;
+	}
+
+	// both only cut latency so carry on without them if the driver says no
+	if(conf.low_latency) set_uart_low_latency(bus);
+	if(conf.rx_trigger) set_uart_rx_trigger(bus, conf.rx_trigger);
 
 	// turn off the FNDELAY flag
 	fcntl(fd[bus], F_SETFL, 0);
@@ -188,6 +332,82 @@ int initialize_uart(int bus, int baudrate, float timeout_s){
 	return 0;
 }
 
+/*******************************************************************************
+* int set_uart_custom_baud(int bus, int baudrate)
+*
+* Replaces the speed bits with BOTHER and the rate itself through termios2.
+* The driver rounds to its nearest divisor, more than 2% off is an error 
+* since the far end will start to see framing errors around there.
+*******************************************************************************/
+int set_uart_custom_baud(int bus, int baudrate){
+	uart_termios2_t t2;
+	if(ioctl(fd[bus], UART_TCGETS2, &t2)<0){
+		printf("ERROR: uart%d can't get termios2\n", bus);
+		return -1;
+	}
+	t2.c_cflag &= ~CBAUD;
+	t2.c_cflag |= UART_BOTHER;
+	t2.c_ispeed = baudrate;
+	t2.c_ospeed = baudrate;
+	if(ioctl(fd[bus], UART_TCSETS2, &t2)<0 || \
+		ioctl(fd[bus], UART_TCGETS2, &t2)<0){
+		printf("ERROR: uart%d can't set baudrate %d\n", bus, baudrate);
+		return -1;
+	}
+	if(fabsf((float)t2.c_ospeed-baudrate) > baudrate*0.02f){
+		printf("ERROR: uart%d can only get %d baud, asked for %d\n", bus, \
+												(int)t2.c_ospeed, baudrate);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int set_uart_low_latency(int bus)
+*
+* Sets ASYNC_LOW_LATENCY so received bytes are pushed to the tty layer from
+* the interrupt rather than batched for a later work item.
+*******************************************************************************/
+int set_uart_low_latency(int bus){
+	struct serial_struct ser;
+	if(ioctl(fd[bus], TIOCGSERIAL, &ser)<0){
+		printf("WARNING: uart%d doesn't support low latency mode\n", bus);
+		return -1;
+	}
+	ser.flags |= ASYNC_LOW_LATENCY;
+	if(ioctl(fd[bus], TIOCSSERIAL, &ser)<0){
+		printf("WARNING: failed to set uart%d low latency mode\n", bus);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int set_uart_rx_trigger(int bus, int bytes)
+*
+* Sets how many bytes collect in the hardware rx FIFO before it interrupts.
+* The 8250 driver rounds up to the nearest level the UART supports. 
+* Otherwise a short burst that doesn't reach the default level only arrives 
+* after the line has been idle for 4 character times.
+*******************************************************************************/
+int set_uart_rx_trigger(int bus, int bytes){
+	char path[64];
+	FILE* f;
+	int ret;
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/rx_trig_bytes", \
+													paths[bus]+strlen("/dev/"));
+	f = fopen(path, "w");
+	if(f==NULL){
+		printf("WARNING: uart%d rx trigger level can't be set\n", bus);
+		return -1;
+	}
+	ret = fprintf(f, "%d", bytes);
+	if(fclose(f)!=0 || ret<0){
+		printf("WARNING: failed to set uart%d rx trigger level\n", bus);
+		return -1;
+	}
+	return 0;
+}
 
 /*******************************************************************************
 *	int close_uart(int bus)
@@ -207,6 +427,7 @@ int close_uart(int bus){
 	if(initialized[bus]==0){
 		return 0;
 	}
+	uart_stop_rx_thread(bus);
 	tcflush(fd[bus],TCIOFLUSH);
 	close(fd[bus]);
 	initialized[bus]=0;
@@ -239,6 +460,43 @@ int get_uart_fd(int bus){
 	return fd[bus];
 }
 
+/*******************************************************************************
+* int set_uart_read_min(int bus, int bytes)
+*
+* Sets VMIN to bytes and VTIME to 0 so a read(), select(), or poll() on the 
+* fd returned by get_uart_fd only wakes once that many bytes are buffered. 
+* Useful for fixed size packets where one wakeup per packet is wanted. Note 
+* uart_read_bytes also waits on select() so reads shorter than this will only
+* return on timeout.
+*******************************************************************************/
+int set_uart_read_min(int bus, int bytes){
+	struct termios config;
+	// sanity checks
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(bytes<1 || bytes>MAX_READ_LEN){
+		printf("ERROR: uart read min must be between 1 & %d\n", MAX_READ_LEN);
+		return -1;
+	}
+	if(tcgetattr(fd[bus],&config)!=0){
+		printf("ERROR: cannot get uart%d attributes\n", bus);
+		return -1;
+	}
+	config.c_cc[VMIN] = bytes;
+	config.c_cc[VTIME] = 0;
+	if(tcsetattr(fd[bus], TCSANOW, &config) < 0) { 
+		printf("ERROR: cannot set uart%d attributes\n", bus);
+		return -1;
+	}
+	return 0;
+}
+
 /*******************************************************************************
 * int flush_uart(int bus)
 *
@@ -329,6 +587,8 @@ int uart_read_bytes(int bus, int bytes, char* buf){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	// the rx thread owns the fd, serve the read from its ring
+	if(rx[bus].running) return uart_read_bytes_ring(bus, bytes, buf);
 	
 	// // a single call to 'read' just isn't reliable, don't do it
 	// if(bytes<=MAX_READ_LEN){
@@ -420,6 +680,18 @@ int uart_read_line(int bus, int max_bytes, char* buf){
 	struct timeval timeout;
 	int bytes_read=0; // number of bytes read so far
 
+	// sanity checks
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	// the rx thread owns the fd, serve the read from its ring
+	if(rx[bus].running) return uart_read_line_ring(bus, max_bytes, buf);
+
 	// set up the timeout OUTSIDE of the read loop. We will likely be calling
 	// select() multiple times and that will decrease the timeout struct each
 	// time ensuring the TOTAL timeout requested by the user is honoured instead
@@ -483,10 +755,328 @@ int uart_bytes_available(int bus){
 		return -1;
 	}
 
+	// with the rx thread running the data is waiting in the ring instead
+	if(rx[bus].running) return uart_rx_available(bus);
+
 	if(ioctl(fd[bus], FIONREAD, &out)<0){
 		printf("ERROR: can't use ioctl on UART bus %d\n", bus);
 		return -1;
 	}
 
 	return out;
-}
\ No newline at end of file
+}
+
+/*******************************************************************************
+* int uart_start_rx_thread(int bus, int ring_size)
+*
+* Starts a thread that reads everything arriving on the bus in large chunks 
+* into a ring of ring_size bytes, which must be a power of 2. 0 selects the 
+* default of 4096. VMIN and VTIME are zeroed so the thread wakes as soon as
+* anything arrives and read() never blocks.
+*******************************************************************************/
+int uart_start_rx_thread(int bus, int ring_size){
+	struct termios config;
+	// sanity checks
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(rx[bus].running){
+		printf("ERROR: uart%d rx thread already running\n", bus);
+		return -1;
+	}
+	if(ring_size==0) ring_size = UART_RX_DEFAULT_SIZE;
+	if(ring_size<MAX_READ_LEN || ring_size>UART_RX_MAX_SIZE || \
+										(ring_size&(ring_size-1))!=0){
+		printf("ERROR: uart ring_size must be a power of 2 between %d & %d\n",\
+											MAX_READ_LEN, UART_RX_MAX_SIZE);
+		return -1;
+	}
+	
+	if(tcgetattr(fd[bus],&config)!=0){
+		printf("ERROR: cannot get uart%d attributes\n", bus);
+		return -1;
+	}
+	config.c_cc[VMIN] = 0;
+	config.c_cc[VTIME] = 0;
+	if(tcsetattr(fd[bus], TCSANOW, &config) < 0) { 
+		printf("ERROR: cannot set uart%d attributes\n", bus);
+		return -1;
+	}
+	
+	rx[bus].buf = malloc(ring_size);
+	if(rx[bus].buf==NULL){
+		printf("ERROR: failed to allocate uart%d ring\n", bus);
+		return -1;
+	}
+	rx[bus].size = ring_size;
+	rx[bus].head = 0;
+	rx[bus].tail = 0;
+	rx[bus].overruns = 0;
+	rx[bus].stop = 0;
+	rx[bus].waiters = 0;
+	pthread_mutex_init(&rx[bus].lock, NULL);
+	pthread_cond_init(&rx[bus].cond, NULL);
+	rx[bus].running = 1;
+	if(create_rt_thread(&rx[bus].thread, RT_SERVICE_UART, uart_rx_handler, \
+												(void*)(intptr_t)bus)){
+		printf("ERROR: failed to start uart%d rx thread\n", bus);
+		rx[bus].running = 0;
+		free(rx[bus].buf);
+		rx[bus].buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int uart_stop_rx_thread(int bus)
+*
+* Stops the rx thread and frees the ring. Anything unread is discarded. 
+* Returns 0 if the thread wasn't running.
+*******************************************************************************/
+int uart_stop_rx_thread(int bus){
+	// sanity checks
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(!rx[bus].running) return 0;
+	rx[bus].stop = 1;
+	pthread_join(rx[bus].thread, NULL);
+	rx[bus].running = 0;
+	pthread_mutex_destroy(&rx[bus].lock);
+	pthread_cond_destroy(&rx[bus].cond);
+	free(rx[bus].buf);
+	rx[bus].buf = NULL;
+	return 0;
+}
+
+/*******************************************************************************
+* int uart_set_rx_callback(int bus, void (*func)(int bus, int bytes))
+*
+* Sets a function for the rx thread to call each time new data lands in the
+* ring, with the number of bytes now available. Pass NULL to remove it.
+*******************************************************************************/
+int uart_set_rx_callback(int bus, void (*func)(int bus, int bytes)){
+	// sanity checks
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	rx[bus].callback = func;
+	return 0;
+}
+
+/*******************************************************************************
+* void* uart_rx_handler(void* ptr)
+*
+* Body of the rx thread. Reads straight into the free space of the ring, at
+* most up to the wrap point per read(), then publishes the new head.
+*******************************************************************************/
+void* uart_rx_handler(void* ptr){
+	int bus = (int)(intptr_t)ptr;
+	uart_rx_t* r = &rx[bus];
+	struct pollfd fdset[2];
+	unsigned int used, space, offset;
+	int ret;
+	
+	fdset[0].fd = fd[bus];
+	fdset[0].events = POLLIN;
+	fdset[1].fd = get_exit_fd();
+	fdset[1].events = POLLIN;
+	while(!r->stop && get_state()!=EXITING){
+		used = r->head - r->tail;
+		space = r->size - used;
+		if(space==0){
+			// user isn't keeping up, leave data in the kernel for a moment
+			r->overruns++;
+			usleep(1000);
+			continue;
+		}
+		ret = poll(fdset, 2, UART_RX_POLL_MS);
+		if(ret<0 && errno!=EINTR){
+			printf("uart%d poll() error: %s\n", bus, strerror(errno));
+			break;
+		}
+		if(ret<=0 || !(fdset[0].revents&POLLIN)) continue;
+		
+		offset = r->head & (r->size-1);
+		if(space > r->size-offset) space = r->size-offset;
+		ret = read(fd[bus], r->buf+offset, space);
+		if(ret<=0) continue;
+		
+		// make the bytes visible before the head that covers them
+		__sync_synchronize();
+		r->head += ret;
+		__sync_synchronize();
+		if(r->waiters){
+			pthread_mutex_lock(&r->lock);
+			pthread_cond_broadcast(&r->cond);
+			pthread_mutex_unlock(&r->lock);
+		}
+		if(r->callback!=NULL) r->callback(bus, r->head - r->tail);
+	}
+	// wake any blocked reader so it can notice
+	pthread_mutex_lock(&r->lock);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+/*******************************************************************************
+* int uart_rx_available(int bus)
+*
+* Returns the number of bytes waiting in the ring, or -1 if the rx thread
+* isn't running.
+*******************************************************************************/
+int uart_rx_available(int bus){
+	if(bus<MIN_BUS || bus>MAX_BUS || !rx[bus].running) return -1;
+	return rx[bus].head - rx[bus].tail;
+}
+
+/*******************************************************************************
+* int uart_rx_peek(int bus, char* buf, int max_bytes)
+*
+* Copies up to max_bytes from the ring without consuming them. Never blocks.
+* Returns the number of bytes copied.
+*******************************************************************************/
+int uart_rx_peek(int bus, char* buf, int max_bytes){
+	unsigned int n, offset, first;
+	uart_rx_t* r;
+	
+	if(bus<MIN_BUS || bus>MAX_BUS || !rx[bus].running){
+		printf("ERROR: uart%d rx thread not running\n", bus);
+		return -1;
+	}
+	if(max_bytes<0){
+		printf("ERROR: max_bytes must be >=0\n");
+		return -1;
+	}
+	r = &rx[bus];
+	n = r->head - r->tail;
+	// don't read the data before the head that covers it
+	__sync_synchronize();
+	if(n>(unsigned int)max_bytes) n = max_bytes;
+	offset = r->tail & (r->size-1);
+	first = r->size - offset;
+	if(first>n) first = n;
+	memcpy(buf, r->buf+offset, first);
+	memcpy(buf+first, r->buf, n-first);
+	return n;
+}
+
+/*******************************************************************************
+* int uart_rx_consume(int bus, int bytes)
+*
+* Discards bytes from the front of the ring, normally after uart_rx_peek.
+* Returns the number of bytes actually discarded.
+*******************************************************************************/
+int uart_rx_consume(int bus, int bytes){
+	unsigned int n;
+	
+	if(bus<MIN_BUS || bus>MAX_BUS || !rx[bus].running){
+		printf("ERROR: uart%d rx thread not running\n", bus);
+		return -1;
+	}
+	if(bytes<0){
+		printf("ERROR: bytes to consume must be >=0\n");
+		return -1;
+	}
+	n = rx[bus].head - rx[bus].tail;
+	if(n>(unsigned int)bytes) n = bytes;
+	// finish reading the data before handing the space back
+	__sync_synchronize();
+	rx[bus].tail += n;
+	return n;
+}
+
+/*******************************************************************************
+* int uart_rx_read(int bus, char* buf, int max_bytes)
+*
+* Non-blocking peek and consume in one. Returns the number of bytes read.
+*******************************************************************************/
+int uart_rx_read(int bus, char* buf, int max_bytes){
+	int n = uart_rx_peek(bus, buf, max_bytes);
+	if(n<=0) return n;
+	return uart_rx_consume(bus, n);
+}
+
+/*******************************************************************************
+* int uart_rx_wait(int bus, int bytes, struct timespec* deadline)
+*
+* Sleeps until at least bytes are in the ring, the CLOCK_REALTIME deadline 
+* passes, or the program is exiting. Returns the number available.
+*******************************************************************************/
+int uart_rx_wait(int bus, int bytes, struct timespec* deadline){
+	uart_rx_t* r = &rx[bus];
+	int ret = 0;
+	
+	if((int)(r->head - r->tail) >= bytes) return r->head - r->tail;
+	pthread_mutex_lock(&r->lock);
+	r->waiters++;
+	// the rx thread checks waiters after moving head, so either it sees us
+	// or we see its data below
+	__sync_synchronize();
+	while((int)(r->head - r->tail) < bytes && ret==0 && !r->stop && \
+												get_state()!=EXITING){
+		ret = pthread_cond_timedwait(&r->cond, &r->lock, deadline);
+	}
+	r->waiters--;
+	pthread_mutex_unlock(&r->lock);
+	return r->head - r->tail;
+}
+
+/*******************************************************************************
+* int uart_read_bytes_ring(int bus, int bytes, char* buf)
+*
+* uart_read_bytes when the rx thread is running. Same timeout behaviour.
+*******************************************************************************/
+int uart_read_bytes_ring(int bus, int bytes, char* buf){
+	struct timespec deadline;
+	int bytes_read = 0;
+	
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	timespec_add(&deadline, bus_timeout_s[bus]);
+	while(bytes_read<bytes){
+		if(uart_rx_wait(bus, 1, &deadline)<1) break;
+		bytes_read += uart_rx_read(bus, buf+bytes_read, bytes-bytes_read);
+	}
+	return bytes_read;
+}
+
+/*******************************************************************************
+* int uart_read_line_ring(int bus, int max_bytes, char* buf)
+*
+* uart_read_line when the rx thread is running. Scans the ring for the newline
+* instead of reading one byte per syscall.
+*******************************************************************************/
+int uart_read_line_ring(int bus, int max_bytes, char* buf){
+	struct timespec deadline;
+	uart_rx_t* r = &rx[bus];
+	unsigned int i, n;
+	int bytes_read = 0;
+	char c;
+	
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	timespec_add(&deadline, bus_timeout_s[bus]);
+	while(bytes_read<max_bytes){
+		n = uart_rx_wait(bus, 1, &deadline);
+		if(n<1) break;
+		__sync_synchronize();
+		for(i=0; i<n && bytes_read<max_bytes; i++){
+			c = r->buf[(r->tail+i) & (r->size-1)];
+			if(c=='\n'){
+				uart_rx_consume(bus, i+1);
+				return bytes_read;
+			}
+			buf[bytes_read++] = c;
+		}
+		uart_rx_consume(bus, i);
+	}
+	return bytes_read;
+}
@@ -47,9 +47,56 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h> // for gpio character device line events
 
 #define SYSFS_GPIO_DIR "/sys/class/gpio"
+#define GPIO_CHIP_DEV "/dev/gpiochip"
+#define GPIO_LINES_PER_CHIP 32
 #define MAX_BUF 64
+#define MAX_CACHED_GPIO 128	// all 4 gpio banks of the AM335x
+
+// value files are opened once per pin and kept open for set/get. Stored as 
+// fd+1 so the zero initialized array means none are open yet.
+static int value_fd_cache[MAX_CACHED_GPIO];
+
+/****************************************************************
+ * get_value_fd
+ *
+ * returns the cached value file descriptor for a pin, opening it
+ * the first time. Pins beyond the cache get a new fd each time 
+ * which the caller must close, signalled by *cached being 0.
+ ****************************************************************/
+static int get_value_fd(unsigned int gpio, int* cached){
+	int fd;
+	char buf[MAX_BUF];
+
+	if(gpio<MAX_CACHED_GPIO && value_fd_cache[gpio]){
+		*cached = 1;
+		return value_fd_cache[gpio]-1;
+	}
+	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", gpio);
+	fd = open(buf, O_RDWR);
+	// input pins on some kernels only allow read access
+	if(fd<0) fd = open(buf, O_RDONLY);
+	if(fd<0) return fd;
+	*cached = (gpio<MAX_CACHED_GPIO);
+	if(*cached) value_fd_cache[gpio] = fd+1;
+	return fd;
+}
+
+/****************************************************************
+ * drop_value_fd
+ *
+ * closes a cached value fd, used when the pin is unexported or a
+ * cached fd stopped working
+ ****************************************************************/
+static void drop_value_fd(unsigned int gpio){
+	if(gpio<MAX_CACHED_GPIO && value_fd_cache[gpio]){
+		close(value_fd_cache[gpio]-1);
+		value_fd_cache[gpio] = 0;
+	}
+}
 
 /****************************************************************
  * gpio_export
@@ -78,6 +125,7 @@ int gpio_unexport(unsigned int gpio){
 	int fd, len;
 	char buf[MAX_BUF];
 
+	drop_value_fd(gpio);
 	fd = open(SYSFS_GPIO_DIR "/unexport", O_WRONLY);
 	if (fd < 0) {
 		perror("gpio/export");
@@ -115,54 +163,55 @@ int gpio_set_dir(int gpio, gpio_pin_direction_t out_flag){
 
 /****************************************************************
  * gpio_set_value
+ *
+ * the value file stays open between calls so each set is a single
+ * pwrite. If the cached fd fails, for example because the pin was
+ * unexported and exported again, it is reopened once.
  ****************************************************************/
 int gpio_set_value(unsigned int gpio, int value){
-	int fd;
-	char buf[MAX_BUF];
-
-	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", gpio);
-
-	fd = open(buf, O_WRONLY);
-	if (fd < 0) {
-		perror("gpio/set-value");
-		return fd;
+	int fd, cached, tries, ret;
+
+	for(tries=0;tries<2;tries++){
+		fd = get_value_fd(gpio, &cached);
+		if (fd < 0) {
+			perror("gpio/set-value");
+			return fd;
+		}
+		ret = pwrite(fd, value ? "1" : "0", 1, 0);
+		if(!cached) close(fd);
+		if(ret==1) return 0;
+		drop_value_fd(gpio);
 	}
-
-	if(value)
-		write(fd, "1", 2);
-	else
-		write(fd, "0", 2);
-
-	close(fd);
-	return 0;
+	perror("gpio/set-value");
+	return -1;
 }
 
 /****************************************************************
  * gpio_get_value
+ *
+ * reads through the cached value fd, sysfs needs the read to start
+ * at offset 0 each time which pread does without an lseek
  ****************************************************************/
 int gpio_get_value(unsigned int gpio, int *value){
-	int fd;
-	char buf[MAX_BUF];
+	int fd, cached, tries, ret;
 	char ch;
 
-	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", gpio);
-
-	fd = open(buf, O_RDONLY);
-	if (fd < 0) {
-		perror("gpio/get-value");
-		return fd;
+	for(tries=0;tries<2;tries++){
+		fd = get_value_fd(gpio, &cached);
+		if (fd < 0) {
+			perror("gpio/get-value");
+			return fd;
+		}
+		ret = pread(fd, &ch, 1, 0);
+		if(!cached) close(fd);
+		if(ret==1){
+			*value = (ch != '0');
+			return 0;
+		}
+		drop_value_fd(gpio);
 	}
-
-	read(fd, &ch, 1);
-
-	if (ch != '0') {
-		*value = 1;
-	} else {
-		*value = 0;
-	}
-
-	close(fd);
-	return 0;
+	perror("gpio/get-value");
+	return -1;
 }
 
 
@@ -240,4 +289,69 @@ int gpio_fd_close(int fd){
 	return close(fd);
 }
 
+/****************************************************************
+ * gpio_line_event_open
+ *
+ * requests edge events on a gpio through the character device
+ * interface instead of sysfs. Each bank of 32 gpios on the AM335x
+ * is its own gpiochip. The pin must not be exported through sysfs
+ * at the same time. Returns a file descriptor which becomes
+ * readable (POLLIN) on each edge.
+ ****************************************************************/
+int gpio_line_event_open(unsigned int gpio, gpio_pin_edge_t edge){
+	int chip_fd, ret;
+	char buf[MAX_BUF];
+	struct gpioevent_request req;
 
+	snprintf(buf, sizeof(buf), GPIO_CHIP_DEV "%d", gpio/GPIO_LINES_PER_CHIP);
+	chip_fd = open(buf, O_RDONLY);
+	if (chip_fd < 0) {
+		perror("gpio/line_event_open");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.lineoffset = gpio%GPIO_LINES_PER_CHIP;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	switch(edge){
+	case EDGE_RISING:
+		req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+		break;
+	case EDGE_FALLING:
+		req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+		break;
+	case EDGE_BOTH:
+		req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+		break;
+	default:
+		printf("ERROR: gpio_line_event_open needs an edge\n");
+		close(chip_fd);
+		return -1;
+	}
+	strncpy(req.consumer_label, "roboticscape", sizeof(req.consumer_label)-1);
+
+	ret = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+	// the line keeps its own fd, the chip fd is no longer needed
+	close(chip_fd);
+	if (ret < 0) {
+		perror("gpio/line_event_open");
+		return -1;
+	}
+	return req.fd;
+}
+
+/****************************************************************
+ * gpio_line_event_read
+ *
+ * reads one pending event from a line event fd and returns the
+ * kernel timestamp of the edge in nanoseconds. Older kernels use
+ * CLOCK_REALTIME for this, 5.7 and newer use CLOCK_MONOTONIC.
+ ****************************************************************/
+int gpio_line_event_read(int fd, uint64_t* timestamp_ns){
+	struct gpioevent_data event;
+	if (read(fd, &event, sizeof(event)) != sizeof(event)) {
+		return -1;
+	}
+	*timestamp_ns = event.timestamp;
+	return 0;
+}
@@ -11,11 +11,16 @@
 #define DEFAULT_FREQ 20000 // 40khz pwm freq
 
 // variables
-int duty_fd[6]; 	// pointers to duty cycle file descriptor
+int duty_fd[6] = {-1,-1,-1,-1,-1,-1}; // held open from init to uninit
+int last_duty_ns[6]; // last width written, repeats of it are skipped
 int period_ns[3]; 	//one period (frequency) per subsystem
 char simple_pwm_initialized[3] = {0,0,0};
 int ver; // pwm driver version, 0 or 1. automatically detected
 
+// local function declarations
+int write_duty_ns(int ch, int duty_ns);
+int format_ns(char* buf, int ns);
+
 /*******************************************************************************
 * int simple_init_pwm(int ss, int frequency)
 *
@@ -97,6 +102,8 @@ int simple_init_pwm(int ss, int frequency){
 	write(enableB_fd, "0", 1);
 	write(polarityB_fd, "0", 1);
 	write(duty_fd[(2*ss)+1], "0", 1);
+	last_duty_ns[(2*ss)] = 0;
+	last_duty_ns[(2*ss)+1] = 0;
 	
 	// set the period to match the A channel
 	len = snprintf(buf, sizeof(buf), "%d", period_ns[ss]);
@@ -149,6 +156,12 @@ int simple_uninit_pwm(int ss){
 		return -1;
 	}
 
+	// the duty files go away with the channels
+	if(duty_fd[(2*ss)]>=0) close(duty_fd[(2*ss)]);
+	if(duty_fd[(2*ss)+1]>=0) close(duty_fd[(2*ss)+1]);
+	duty_fd[(2*ss)] = -1;
+	duty_fd[(2*ss)+1] = -1;
+
 	// write 0 and 1 to the file to unexport both channels
 	write(fd, "0", 1);
 	write(fd, "1", 1);
@@ -183,8 +196,6 @@ int simple_set_pwm_duty(int ss, char ch, float duty){
 * like simple_set_pwm_duty() but takes a width in nanoseconds.
 *******************************************************************************/
 int simple_set_pwm_duty_ns(int ss, char ch, int duty_ns){
-	int len;
-	char buf[MAXBUF];
 	// start with sanity checks
 	if(ss<0 || ss>2){
 		printf("PWM subsystem must be between 0 and 2\n");
@@ -202,20 +213,101 @@ int simple_set_pwm_duty_ns(int ss, char ch, int duty_ns){
 	}
 	
 	// set the duty
-	len = snprintf(buf, sizeof(buf), "%d", duty_ns);
 	switch(ch){
 	case 'A':
-		write(duty_fd[(2*ss)], buf, len);
-		break;
+		return write_duty_ns((2*ss), duty_ns);
 	case 'B':
-		write(duty_fd[(2*ss)+1], buf, len);
-		break;
+		return write_duty_ns((2*ss)+1, duty_ns);
 	default:
 		printf("pwm channel must be 'A' or 'B'\n");
 		return -1;
 	}
-	
+}
+
+/*******************************************************************************
+* int simple_set_pwm_duty_ab(int ss, float duty_a, float duty_b)
+*
+* sets both channels of a subsystem, checking arguments once. Unlike
+* mmap_set_pwm_duty_ab the two files are still written separately so the
+* channels may change a period apart.
+*******************************************************************************/
+int simple_set_pwm_duty_ab(int ss, float duty_a, float duty_b){
+	if(duty_a>1.0 || duty_a<0.0 || duty_b>1.0 || duty_b<0.0){
+		printf("duty must be between 0.0 & 1.0\n");
+		return -1;
+	}
+	if(ss<0 || ss>2){
+		printf("PWM subsystem must be between 0 and 2\n");
+		return -1;
+	}
+	if(simple_pwm_initialized[ss]==0){
+		printf("initializing PWMSS%d with default PWM frequency\n", ss);
+		simple_init_pwm(ss, DEFAULT_FREQ);
+	}
+	return simple_set_pwm_duty_ns_ab(ss, duty_a*period_ns[ss], \
+												duty_b*period_ns[ss]);
+}
+
+/*******************************************************************************
+* int simple_set_pwm_duty_ns_ab(int ss, int duty_a_ns, int duty_b_ns)
+*******************************************************************************/
+int simple_set_pwm_duty_ns_ab(int ss, int duty_a_ns, int duty_b_ns){
+	int ret;
+	if(ss<0 || ss>2){
+		printf("PWM subsystem must be between 0 and 2\n");
+		return -1;
+	}
+	if(simple_pwm_initialized[ss]==0){
+		printf("initializing PWMSS%d with default PWM frequency\n", ss);
+		simple_init_pwm(ss, DEFAULT_FREQ);
+	}
+	if(duty_a_ns>period_ns[ss] || duty_a_ns<0 || \
+		duty_b_ns>period_ns[ss] || duty_b_ns<0){
+		printf("duty must be between 0 & period_ns\n");
+		return -1;
+	}
+	ret = write_duty_ns((2*ss), duty_a_ns);
+	ret |= write_duty_ns((2*ss)+1, duty_b_ns);
+	return ret;
+}
+
+/*******************************************************************************
+* int write_duty_ns(int ch, int duty_ns)
+*
+* One pwrite to the already open duty file of channel ch (0-5), nothing at all
+* if the width hasn't changed.
+*******************************************************************************/
+int write_duty_ns(int ch, int duty_ns){
+	char buf[MAXBUF];
+	int len;
+	if(duty_fd[ch]<0){
+		printf("ERROR: pwm duty file not open\n");
+		return -1;
+	}
+	if(duty_ns==last_duty_ns[ch]) return 0;
+	len = format_ns(buf, duty_ns);
+	if(pwrite(duty_fd[ch], buf, len, 0)!=len){
+		printf("ERROR: failed to write pwm duty cycle\n");
+		return -1;
+	}
+	last_duty_ns[ch] = duty_ns;
 	return 0;
-	
+}
+
+/*******************************************************************************
+* int format_ns(char* buf, int ns)
+*
+* decimal digits of a non-negative ns without going through snprintf, returns
+* the length. buf is not null terminated.
+*******************************************************************************/
+int format_ns(char* buf, int ns){
+	char tmp[12];
+	int i = 0, len = 0;
+	do{
+		tmp[i++] = '0' + ns%10;
+		ns /= 10;
+	}while(ns>0);
+	while(i>0) buf[len++] = tmp[--i];
+	return len;
 }
 
@@ -45,6 +45,15 @@
 	.asg	0x020,	OTHER_RAM
 	.asg    0x100,	SHARED_RAM       ; This is so prudebug can find it.
 	.asg    64,     CNT_OFFSET
+	.asg    68,     PERIOD_OFFSET	; cycles between the last two edges
+	.asg    72,     DIR_OFFSET		; direction of the last edge, 1 or -1
+	.asg    156,    EVENT_OFFSET	; counts the times the threshold was hit
+	.asg    160,    ARM_OFFSET		; nonzero while the threshold is armed
+	.asg    164,    THRESH_OFFSET	; count to report
+	.asg    168,    HEARTBEAT_OFFSET	; bumped every pass to show we're running
+	.asg    0x0,    CTRL			; PRU0 control register offset
+	.asg    0xC,    CYCLE			; PRU0 cycle counter offset
+	.asg    3,      CTR_EN			; CTRL bit enabling the cycle counter
 
 ; Encoder counting definitions
 ; these pin definitions are specific to SD-101D Robotics Cape
@@ -56,17 +65,54 @@
 	.asg	14,			A
 	.asg	15,			B
 
+; Edge timing uses the PRU cycle counter, which only counts up and stops when 
+; full, so it is restarted from 0 on every edge. At any time it then holds the
+; cycles since the last edge, which the ARM reads directly. The counter is 
+; reset before the shared memory is written so the ARM can detect an edge 
+; landing between its reads by the counter going backwards.
+; r3 CTRL value, r4 control register address, r5 period, r6 direction, r7 zero
+stamp		.macro
+	LBBO	&r3, r4, CTRL, 4
+	CLR		r3, r3, CTR_EN	; stop the cycle counter so it can be written
+	SBBO	&r3, r4, CTRL, 4
+	LBBO	&r5, r4, CYCLE, 4	; cycles since last edge
+	SBBO	&r7, r4, CYCLE, 4	; restart from 0
+	SET		r3, r3, CTR_EN
+	SBBO	&r3, r4, CTRL, 4
+	SBCO	&r5, CONST_PRUSHAREDRAM, PERIOD_OFFSET, 4
+	SBCO	&r6, CONST_PRUSHAREDRAM, DIR_OFFSET, 4
+	.endm
+
+; After every count, if the ARM armed a threshold and the count has reached
+; it, disarm and bump the event counter the ARM waits on. Counts move by one
+; so equality is enough. r2 holds the new count, r8 & r9 are scratch.
+threshold	.macro
+	LBCO	&r8, CONST_PRUSHAREDRAM, ARM_OFFSET, 8	; r8 armed, r9 threshold
+	QBEQ	CHECKPINS, r8, 0
+	QBNE	CHECKPINS, r9, r2
+	SBCO	&r7, CONST_PRUSHAREDRAM, ARM_OFFSET, 4	; r7 is always 0
+	LBCO	&r8, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	ADD		r8, r8, 1
+	SBCO	&r8, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	.endm
+
 increment	.macro 
+	LDI		r6, 1
+	stamp
 	LBCO	&r2, CONST_PRUSHAREDRAM, CNT_OFFSET, 4	; load existing counter from shared memory
 	ADD 	r2, r2, 1		; increment
 	SBCO	&r2, CONST_PRUSHAREDRAM, CNT_OFFSET, 4	; write to shared memory
+	threshold
 	QBA CHECKPINS				; jump back to main CHECKPINS
 	.endm
 
 decrement	.macro
+	LDI32	r6, 0xFFFFFFFF	; -1
+	stamp
 	LBCO	&r2, CONST_PRUSHAREDRAM, CNT_OFFSET, 4	; load existing counter from shared memory
 	SUB 	r2, r2, 1		; subtract 1
 	SBCO	&r2, CONST_PRUSHAREDRAM, CNT_OFFSET, 4	; write to shared memory
+	threshold
 	QBA CHECKPINS				;/ jump back to main CHECKPINS
 	.endm
 
@@ -85,9 +131,26 @@ start:
 	MOV 	OLD, r31				
 	zero	&r2, 4
 	SBCO	&r2, CONST_PRUSHAREDRAM, CNT_OFFSET, 4	; write 0 to shared memory
+	SBCO	&r2, CONST_PRUSHAREDRAM, PERIOD_OFFSET, 4	; no period measured yet
+	SBCO	&r2, CONST_PRUSHAREDRAM, DIR_OFFSET, 4
+	SBCO	&r2, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	SBCO	&r2, CONST_PRUSHAREDRAM, ARM_OFFSET, 4	; no threshold armed
+	zero	&r10, 4					; heartbeat
+	
+; start the cycle counter from 0
+	zero	&r7, 4
+	LDI32	r4, PRU0_CTRL
+	LBBO	&r3, r4, CTRL, 4
+	CLR		r3, r3, CTR_EN
+	SBBO	&r3, r4, CTRL, 4
+	SBBO	&r7, r4, CYCLE, 4
+	SET		r3, r3, CTR_EN
+	SBBO	&r3, r4, CTRL, 4
 	
 ; CHECKPINS here forever looking for pin changes
 CHECKPINS:
+	ADD		r10, r10, 1
+	SBCO	&r10, CONST_PRUSHAREDRAM, HEARTBEAT_OFFSET, 4
 	XOR EXOR, OLD, r31
 	QBBS A_CHANGED, EXOR, A	; Branch if CHA has toggled
 	QBBS B_CHANGED, EXOR, B ; Branch if CHB has toggled
@@ -20,6 +20,27 @@ $E?:
 	.endm
 	
 
+; One channel, run once per pass of the loop with the IEP count of this pass
+; in r19. A high channel falls once the count passes its falling time, kept
+; in the channel's own register. An idle channel takes a pending width from
+; its shared memory word, rises and schedules its fall. Differences of 32 bit
+; counts stay correct across the counter wrapping.
+CHANNEL	.macro	chbit, fall, n, offset
+	QBBC	$I?, r22, n
+	SUB		r20, r19, fall
+	QBBS	$E?, r20, 31				; falling edge not reached yet
+	CLR		r30, chbit
+	CLR		r22, r22, n
+	QBA		$E?
+$I?:	LBCO	&r20, CONST_PRUSHAREDRAM, offset, 4
+	QBEQ	$E?, r20, 0
+	SBCO	&r9, CONST_PRUSHAREDRAM, offset, 4	; tell ARM it's taken
+	ADD		fall, r19, r20
+	SET		r30, chbit
+	SET		r22, r22, n
+$E?:
+	.endm
+
 	.clink
 	.global start
 start:
@@ -53,6 +74,30 @@ start:
 	.asg	0x020,	OTHER_RAM
 	.asg    0x100,	SHARED_RAM       ; This is so prudebug can find it.
 
+; repeat mode shared memory layout, must match robotics_pru.c
+	.asg	80,		PERIOD_OFFSET	; loops per frame, 0 for single pulses
+	.asg	84,		WIDTH_OFFSET	; 8 words, loops per pulse to repeat
+	.asg	116,	COMMIT_OFFSET	; nonzero when the staged widths are ready
+	.asg	120,	STAGE_OFFSET	; 8 words, widths to start together
+	.asg	152,	EVENT_OFFSET	; counts the times the last pulse ended
+	.asg	172,	HEARTBEAT_OFFSET	; bumped every pass to show we're running
+
+; DShot shared memory layout, must match robotics_pru.c. Output masks have
+; bit n for r30.t(n+4) so a channel's bit is the same in every mask.
+	.asg	176,	DSHOT_BIT_OFFSET	; IEP counts per bit, 0 for servos
+	.asg	180,	DSHOT_T0H_OFFSET	; high time of a 0 bit
+	.asg	184,	DSHOT_T1H_OFFSET	; high time of a 1 bit
+	.asg	188,	DSHOT_ACTIVE_OFFSET	; outputs the frame goes out on
+	.asg	192,	DSHOT_COMMIT_OFFSET	; nonzero when a frame is staged
+	.asg	196,	DSHOT_FRAME_OFFSET	; 16 bytes, outputs sending a 1
+	.asg	4,		DSHOT_GAP_SHIFT		; idle 1<<this bits after a frame
+
+; all widths and the period are in IEP counts of 5ns
+	.asg	C26,	CONST_IEP
+	.asg	0x00,	IEP_GLB_CFG		; global config, DEFAULT_INC and CNT_ENABLE
+	.asg	0x0C,	IEP_COUNT		; free running 32 bit counter
+	.asg	0x11,	IEP_CFG_RUN		; increment by 1, counter enabled
+
 	LBCO	&r0, CONST_SYSCFG, 4, 4		; Enable OCP master port
 	CLR 	r0, r0, 4					; Clear SYSCFG[STANDBY_INIT] to enable OCP master port
 	SBCO	&r0, CONST_SYSCFG, 4, 4
@@ -62,101 +107,150 @@ start:
 	LDI32   r1, PRU1_CTRL + CTPPR0		; Note we use beginning of shared ram unlike example which
 	SBBO    &r0, r1, 0, 4				;  page 25
 	
+; Start the IEP timer counting once per 200MHz clock so every edge can be
+; placed to 5ns instead of to one pass of a fixed length loop. PRU0 doesn't
+; use the IEP so it is ours to configure.
+	LDI		r20, IEP_CFG_RUN
+	SBCO	&r20, CONST_IEP, IEP_GLB_CFG, 4
+
 	LDI		r9, 0x0				; erase r9 to use to use later
-	
-	LDI 	r0, 0x0				; clear internal counters
-	LDI 	r1, 0x0	
-	LDI 	r2, 0x0
-	LDI 	r3, 0x0
-	LDI 	r4, 0x0
-	LDI 	r5, 0x0
-	LDI 	r6, 0x0
-	LDI32 	r7, 0x0
+	LDI		r22, 0x0			; bit n set while channel n+1 is high
+	LDI		r23, 0x0			; r22 as of the last pass
+	LDI		r24, 0x0			; heartbeat
+	SBCO	&r9, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
 	LDI 	r30, 0x0				; turn off GPIO outputs
+	LBCO	&r18, CONST_IEP, IEP_COUNT, 4	; start of the current frame
 	
 
-; Beginning of loop, should always take 48 instructions to complete
-CH1:			
-	QBEQ	CLR1, r0, 0						; If timer is 0, jump to clear channel
-	SET		r30, CH1BIT						; If non-zero turn on the corresponding channel
-	SUB		r0, r0, 1						; Subtract one from timer
-	CLR		r9, r9.t1						; waste a cycle for timing
-	SBCO	&r9, CONST_PRUSHAREDRAM, 0, 4	; write 0 to shared memory
-CH2:			
-	QBEQ	CLR2, r1, 0
-	SET		r30, CH2BIT
-	SUB		r1, r1, 1
-	CLR		r9, r9.t1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 4, 4
-CH3:			
-	QBEQ	CLR3, r2, 0
-	SET		r30, CH3BIT
-	SUB		r2, r2, 1
-	CLR		r9, r9.t1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 8, 4
-CH4:			
-	QBEQ	CLR4, r3, 0
-	SET		r30, CH4BIT
-	SUB		r3, r3, 1
-	CLR		r9, r9.t1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 12, 4
-CH5:			
-	QBEQ	CLR5, r4, 0
-	SET		r30, CH5BIT
-	SUB		r4, r4, 1
-	CLR		r9, r9.t1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 16, 4
-CH6:			
-	QBEQ	CLR6, r5, 0
-	SET		r30, CH6BIT
-	SUB		r5, r5, 1
-	CLR		r9, r9.t1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 20, 4
-CH7:			
-	QBEQ	CLR7, r6, 0
-	SET		r30, CH7BIT
-	SUB		r6, r6, 1
-	CLR		r9, r9.t1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 24, 4
-CH8:			
-	QBEQ	CLR8, r7, 0
-	SET		r30, CH8BIT
-	SUB		r7, r7, 1
-	SBCO	&r9, CONST_PRUSHAREDRAM, 28, 4
-
-	QBA		CH1								; return to beginning of loop
-	; no need to waste a cycle for timing here because of the QBA above
-	
-		
-CLR1:
-	CLR		r30, CH1BIT						; turn off the corresponding channel
-	LBCO	&r0, CONST_PRUSHAREDRAM, 0, 4	; Load new timer register
-	QBA		CH2
-CLR2:
-	CLR		r30, CH2BIT
-	LBCO	&r1, CONST_PRUSHAREDRAM, 4, 4
-	QBA		CH3
-CLR3:
-	CLR		r30, CH3BIT
-	LBCO	&r2, CONST_PRUSHAREDRAM, 8, 4
-	QBA		CH4
-CLR4:
-	CLR		r30, CH4BIT
-	LBCO	&r3, CONST_PRUSHAREDRAM, 12, 4
-	QBA		CH5
-CLR5:
-	CLR		r30, CH5BIT
-	LBCO	&r4, CONST_PRUSHAREDRAM, 16, 4
-	QBA		CH6
-CLR6:
-	CLR		r30, CH6BIT
-	LBCO	&r5, CONST_PRUSHAREDRAM, 20, 4
-	QBA		CH7
-CLR7:
-	CLR		r30, CH7BIT
-	LBCO	&r6, CONST_PRUSHAREDRAM, 24, 4
-	QBA		CH8
-CLR8:
-	CLR		r30, CH8BIT
-	LBCO	&r7, CONST_PRUSHAREDRAM, 28, 4
-	QBA		CH1								; return to beginning of loop
+; Each pass reads the IEP count once, so edges land within one pass of the
+; count they were scheduled for. A pass takes well under a microsecond.
+LOOP:
+	ADD		r24, r24, 1
+	SBCO	&r24, CONST_PRUSHAREDRAM, HEARTBEAT_OFFSET, 4
+	LBCO	&r19, CONST_IEP, IEP_COUNT, 4
+	LBCO	&r21, CONST_PRUSHAREDRAM, DSHOT_BIT_OFFSET, 4
+	QBEQ	SERVO, r21, 0
+	QBEQ	DSHOT, r22, 0					; once servo pulses are done
+SERVO:
+	LBCO	&r21, CONST_PRUSHAREDRAM, PERIOD_OFFSET, 4
+	QBEQ	SINGLE, r21, 0
+	SUB		r20, r19, r18					; counts into this frame
+	QBLT	CHANNELS, r21, r20				; frame not over yet
+
+; once per frame, take any committed set of widths from the stage and queue
+; the repeat widths as the next pulse on all channels. Idle channels take
+; their word in this same pass, so they all start together.
+FRAME:
+	ADD		r18, r18, r21
+	LBCO	&r20, CONST_PRUSHAREDRAM, COMMIT_OFFSET, 4
+	QBEQ	REPEAT, r20, 0
+	LBCO	&r10, CONST_PRUSHAREDRAM, STAGE_OFFSET, 32	; r10-r17
+	SBCO	&r10, CONST_PRUSHAREDRAM, WIDTH_OFFSET, 32
+	SBCO	&r9, CONST_PRUSHAREDRAM, COMMIT_OFFSET, 4	; tell ARM it's taken
+REPEAT:
+	LBCO	&r10, CONST_PRUSHAREDRAM, WIDTH_OFFSET, 32	; r10-r17
+	SBCO	&r10, CONST_PRUSHAREDRAM, 0, 32
+	QBA		CHANNELS
+
+; single pulse mode, a committed set starts as soon as it is seen. The frame
+; start follows the count so the first frame after switching to repeat mode
+; is a whole period after the switch.
+SINGLE:
+	MOV		r18, r19
+	LBCO	&r20, CONST_PRUSHAREDRAM, COMMIT_OFFSET, 4
+	QBEQ	CHANNELS, r20, 0
+	LBCO	&r10, CONST_PRUSHAREDRAM, STAGE_OFFSET, 32
+	SBCO	&r10, CONST_PRUSHAREDRAM, 0, 32
+	SBCO	&r9, CONST_PRUSHAREDRAM, COMMIT_OFFSET, 4
+
+CHANNELS:
+	CHANNEL	CH1BIT, r0, 0, 0
+	CHANNEL	CH2BIT, r1, 1, 4
+	CHANNEL	CH3BIT, r2, 2, 8
+	CHANNEL	CH4BIT, r3, 3, 12
+	CHANNEL	CH5BIT, r4, 4, 16
+	CHANNEL	CH6BIT, r5, 5, 20
+	CHANNEL	CH7BIT, r6, 6, 24
+	CHANNEL	CH8BIT, r7, 7, 28
+
+; count an event for the ARM when the last pulse in flight falls and no new
+; ones are waiting to be taken, so it can sleep until the PRU is idle instead
+; of retrying. In repeat mode that is once per frame.
+	QBNE	BUSY, r22, 0
+	QBEQ	LOOP, r23, 0					; was already idle
+	LBCO	&r10, CONST_PRUSHAREDRAM, 0, 32	; r10-r17 are free here
+	OR		r10, r10, r11
+	OR		r10, r10, r12
+	OR		r10, r10, r13
+	OR		r10, r10, r14
+	OR		r10, r10, r15
+	OR		r10, r10, r16
+	OR		r10, r10, r17
+	QBNE	LOOP, r10, 0					; taken next pass, check again after
+	LBCO	&r20, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	ADD		r20, r20, 1
+	SBCO	&r20, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	LDI		r23, 0x0
+	QBA		LOOP
+BUSY:
+	MOV		r23, r22
+	QBA		LOOP
+
+; DShot, a staged frame of 16 bits MSB first goes out on all active outputs
+; at once. Every bit rises on all of them, outputs sending a 0 fall at T0H
+; and the rest at T1H, placed from the IEP count like the servo edges. The
+; frame is copied into r0-r3, free while no servo pulse is high, and taken
+; before it starts so the ARM can stage the next one meanwhile.
+DSHOT:
+	LBCO	&r20, CONST_PRUSHAREDRAM, DSHOT_COMMIT_OFFSET, 4
+	QBEQ	LOOP, r20, 0
+	LBCO	&r25, CONST_PRUSHAREDRAM, DSHOT_BIT_OFFSET, 16	; r25-r28
+	LBCO	&r0, CONST_PRUSHAREDRAM, DSHOT_FRAME_OFFSET, 16	; r0-r3
+	SBCO	&r9, CONST_PRUSHAREDRAM, DSHOT_COMMIT_OFFSET, 4	; tell ARM it's taken
+	LSL		r28, r28, 4						; active outputs as r30 bits
+	NOT		r13, r28						; mask to drop them all
+	LDI		r8, 0							; bits sent
+	MOV		r29, r19						; start of this bit
+DSHOT_BIT:
+	AND		r10, r0, 0xFF
+	LSL		r10, r10, 4						; outputs sending a 1
+	XOR		r11, r10, r28
+	NOT		r11, r11						; mask to drop those sending a 0
+	LSR		r0, r0, 8
+DSHOT_RISE:
+	LBCO	&r20, CONST_IEP, IEP_COUNT, 4
+	SUB		r20, r20, r29
+	QBBS	DSHOT_RISE, r20, 31				; bit not started yet
+	OR		r30, r30, r28
+DSHOT_T0:
+	LBCO	&r20, CONST_IEP, IEP_COUNT, 4
+	SUB		r20, r20, r29
+	QBLT	DSHOT_T0, r26, r20
+	AND		r30, r30, r11
+DSHOT_T1:
+	LBCO	&r20, CONST_IEP, IEP_COUNT, 4
+	SUB		r20, r20, r29
+	QBLT	DSHOT_T1, r27, r20
+	AND		r30, r30, r13
+	ADD		r29, r29, r25
+	ADD		r8, r8, 1
+	AND		r20, r8, 3
+	QBNE	DSHOT_BIT, r20, 0				; 4 bits per register
+	QBEQ	DSHOT_END, r8, 16
+	MOV		r0, r1
+	MOV		r1, r2
+	MOV		r2, r3
+	QBA		DSHOT_BIT
+
+; ESCs find the start of a frame from the line staying low in between
+DSHOT_END:
+	LSL		r20, r25, DSHOT_GAP_SHIFT
+	ADD		r29, r29, r20
+DSHOT_GAP:
+	LBCO	&r20, CONST_IEP, IEP_COUNT, 4
+	SUB		r20, r20, r29
+	QBBS	DSHOT_GAP, r20, 31
+	LBCO	&r20, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	ADD		r20, r20, 1
+	SBCO	&r20, CONST_PRUSHAREDRAM, EVENT_OFFSET, 4
+	QBA		LOOP
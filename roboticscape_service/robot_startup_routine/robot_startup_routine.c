@@ -3,8 +3,8 @@
 *
 * James Strawson 2016
 * Hardware drivers and the bone capemanager initialize in a rather unpredictable
-* schedule. This program checks everything necessary for the cape library to run
-* in order.
+* schedule. This program waits for everything necessary for the cape library to
+* run, checking all the drivers at the same time.
 *******************************************************************************/
 
 #include "../../libraries/roboticscape-usefulincludes.h"
@@ -13,16 +13,48 @@
 #include "../../libraries/simple_gpio/gpio_setup.h"
 #include "../../libraries/other/robotics_pru.h"
 
+#include <sys/inotify.h>
+#include <stdarg.h>
+
 #define TIMEOUT_S 5
 #define START_LOG "/var/log/roboticscape/startup_log.txt"
+#define RECHECK_MS 20	// first wait between checks if no event arrives
+#define RECHECK_MAX_MS 500	// the wait doubles up to this
+
+/*******************************************************************************
+* One driver to wait for. Every stage runs in its own thread so the slowest
+* driver sets the startup time instead of the sum of all of them. Stages that
+* aren't required only log a timeout.
+*******************************************************************************/
+typedef struct startup_stage_t{
+	const char* name;
+	int (*check)();		// returns 0 once the driver is ready
+	const char* watch;	// sysfs directory whose changes trigger a recheck
+	int required;
+	int result;
+	pthread_t thread;
+} startup_stage_t;
 
-int is_cape_loaded();
-int check_timeout();
-int setup_gpio();
 int setup_pwm();
 int check_eqep();
+int check_pru();
+int check_pinmux();
+void* stage_handler(void* ptr);
+int wait_for_change(int fd, int timeout_ms);
+void log_line(const char* fmt, ...);
+
+startup_stage_t stages[] = {
+	{"GPIO",		configure_gpio_pins,	"/sys/class/gpio",			1},
+	{"eQEP",		check_eqep,				"/sys/devices/platform/ocp",1},
+	{"PWM",			setup_pwm,				"/sys/class/pwm",			1},
+	{"PRU rproc",	check_pru,				"/sys/class/remoteproc",	0},
+	{"pinmux driver",check_pinmux,			"/sys/devices/platform/ocp",0}
+};
+#define NUM_STAGES (int)(sizeof(stages)/sizeof(stages[0]))
 
 uint64_t start_us;
+FILE* log_file;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*******************************************************************************
@@ -30,110 +62,135 @@ uint64_t start_us;
 *
 *******************************************************************************/
 int main(){
-	char buf[128];
-	float time;
+	int i, ret = 0;
 
 	// log start time 
-	start_us = micros_since_epoch();
-	system("echo start > " START_LOG);
+	start_us = micros_since_boot();
+	log_file = fopen(START_LOG, "w");
+	log_line("start");
 
 	// stop a possibly running process and
 	// delete old pid file if it's left over from an improper shudown
 	kill_robot();
 
-	// export gpio pins
-	while(configure_gpio_pins()!=0){
-		if(check_timeout()){
-			system("echo 'timeout reached while waiting for gpio driver' >> " START_LOG);
-			printf("timeout reached while waiting for gpio driver\n");
-		 	return -1;
+	// wait for every driver at once
+	for(i=0;i<NUM_STAGES;i++){
+		if(pthread_create(&stages[i].thread, NULL, stage_handler, &stages[i])){
+			// fall back to checking this one from here
+			stage_handler(&stages[i]);
+			stages[i].thread = 0;
 		}
-		usleep(500000);
 	}
-	time = (micros_since_epoch()-start_us)/1000000;
-	sprintf(buf, "echo 'time (s): %4.1f GPIO loaded' >> %s",time,START_LOG);
-	system(buf);
-
-
-	// wait for eQEP to load
-	while(check_eqep()!=0){
-		if(check_timeout()){
-			system("echo 'timeout reached while waiting for eQEP driver' >> " START_LOG);
-			printf("timeout reached while waiting for eQEP driver\n");
-		 	return -1;
-		}
-		usleep(500000);
+	for(i=0;i<NUM_STAGES;i++){
+		if(stages[i].thread) pthread_join(stages[i].thread, NULL);
+		if(stages[i].result<0 && stages[i].required) ret = -1;
 	}
-	time = (micros_since_epoch()-start_us)/1000000;
-	sprintf(buf, "echo 'time (s): %4.1f eQEP loaded' >> %s",time,START_LOG);
-	system(buf);
-
-
-	// set up pwm at desired frequnecy
-	while(setup_pwm()!=0){
-		if(check_timeout()){
-			system("echo 'timeout reached while waiting for pwm driver' >> " START_LOG);
-			printf("timeout reached while waiting for pwm driver\n");
-		 	return -1;
-		}
-		usleep(500000);
+	if(ret<0){
+		if(log_file!=NULL) fclose(log_file);
+		return -1;
 	}
-	time = (micros_since_epoch()-start_us)/1000000;
-	sprintf(buf, "echo 'time (s): %4.1f PWM loaded' >> %s",time,START_LOG);
-	system(buf);
+
+	printf("startup routine complete\n");
+	log_line("startup routine complete");
+	if(log_file!=NULL) fclose(log_file);
+	return 0;
+}
 
 
-	//wait for pru
-	while(restart_pru()!=0){
-		if(check_timeout()){
-			system("echo 'timeout reached while waiting for remoteproc pru' >> " START_LOG);
-			printf("timeout reached while waiting for remoteproc pru\n");
-		 	return 0;
+/*******************************************************************************
+* void* stage_handler(void* ptr)
+*
+* Checks one driver until it is ready or TIMEOUT_S passes. Between checks it
+* sleeps on inotify events in the stage's sysfs directory, so a driver that
+* appears is noticed right away. sysfs doesn't report every change through
+* inotify, so it also rechecks after RECHECK_MS, backing off to RECHECK_MAX_MS
+* so drivers that print on every failed attempt don't flood the journal.
+*******************************************************************************/
+void* stage_handler(void* ptr){
+	startup_stage_t* st = (startup_stage_t*)ptr;
+	int fd, wait_ms = RECHECK_MS;
+
+	fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if(fd>=0 && inotify_add_watch(fd, st->watch, \
+					IN_CREATE|IN_ATTRIB|IN_MODIFY|IN_MOVED_TO)<0){
+		// directory doesn't exist yet, rely on the periodic recheck
+		close(fd);
+		fd = -1;
+	}
+	while(st->check()!=0){
+		if(micros_since_boot()-start_us > TIMEOUT_S*1000000ULL){
+			log_line("timeout reached while waiting for %s", st->name);
+			printf("timeout reached while waiting for %s\n", st->name);
+			st->result = -1;
+			if(fd>=0) close(fd);
+			return NULL;
+		}
+		if(wait_for_change(fd, wait_ms)==0 && wait_ms<RECHECK_MAX_MS){
+			wait_ms *= 2;
+			if(wait_ms>RECHECK_MAX_MS) wait_ms = RECHECK_MAX_MS;
 		}
-		usleep(500000);
 	}
-	time = (micros_since_epoch()-start_us)/1000000;
-	sprintf(buf, "echo 'time (s): %4.1f PRU rproc loaded' >> %s",time,START_LOG);
-	system(buf);
+	log_line("time (s): %4.2f %s loaded", \
+				(micros_since_boot()-start_us)/1000000.0, st->name);
+	st->result = 0;
+	if(fd>=0) close(fd);
+	return NULL;
+}
 
 
-	//wait for pinmux
-	while(set_default_pinmux()!=0){
-		if(check_timeout()){
-			system("echo 'timeout reached while waiting for pinmux' >> " START_LOG);
-			printf("timeout reached while waiting for pinmux\n");
-		 	return 0;
-		}
-		usleep(500000);
-	}
-	time = (micros_since_epoch()-start_us)/1000000;
-	sprintf(buf, "echo 'time (s): %4.1f pinmux driver loaded' >> %s",time,START_LOG);
-	system(buf);
+/*******************************************************************************
+* int wait_for_change(int fd, int timeout_ms)
+*
+* Waits for an inotify event on fd, which may be -1 to just sleep, and drains
+* whatever events arrived. Returns 1 on an event, 0 on timeout.
+*******************************************************************************/
+int wait_for_change(int fd, int timeout_ms){
+	struct pollfd pfd;
+	char buf[1024];
 
-	printf("startup routine complete\n");
-	system("echo 'startup routine complete' >> " START_LOG);
-	return 0;
+	if(fd<0){
+		usleep(timeout_ms*1000);
+		return 0;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, timeout_ms)<=0) return 0;
+	while(read(fd, buf, sizeof(buf))>0);
+	return 1;
 }
 
 
+/*******************************************************************************
+* void log_line(const char* fmt, ...)
+*
+* appends a line to START_LOG, from any stage thread
+*******************************************************************************/
+void log_line(const char* fmt, ...){
+	va_list args;
+	if(log_file==NULL) return;
+	pthread_mutex_lock(&log_mutex);
+	va_start(args, fmt);
+	vfprintf(log_file, fmt, args);
+	va_end(args);
+	fputc('\n', log_file);
+	fflush(log_file);
+	pthread_mutex_unlock(&log_mutex);
+}
+
 
 /*******************************************************************************
-* int check_timeout()
+* int check_pru()
+* int check_pinmux()
 *
-* looks and the current time to decide if the timeout has been reached.
-* returns 1 if timeout has been reached.
+* wrappers so every stage check returns 0 once ready
 *******************************************************************************/
-int check_timeout(){
-	uint64_t new_us = micros_since_epoch();
-	int seconds = (new_us-start_us)/1000000;
-	if(seconds>TIMEOUT_S){
-		printf("TIMEOUT REACHED\n");
-		system("echo 'TIMEOUT_REACHED' >> " START_LOG);
-		return 1;
-	}
-	return 0;
+int check_pru(){
+	return restart_pru()!=0 ? -1 : 0;
 }
 
+int check_pinmux(){
+	return set_default_pinmux()!=0 ? -1 : 0;
+}
 
 
 /*******************************************************************************
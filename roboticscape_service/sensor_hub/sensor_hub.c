@@ -0,0 +1,86 @@
+/*******************************************************************************
+* sensor_hub.c
+*
+* Owns the IMU, DSM receiver and encoders and publishes every sample through
+* the library's sensor hub so several programs can use them at once. Run it
+* as the startup program or by hand, then have the other programs use the
+* hub_ client functions instead of initializing the hardware themselves.
+*******************************************************************************/
+
+#include "../../libraries/roboticscape-usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+imu_data_t data;
+
+void print_usage(){
+	printf("\n Options\n");
+	printf("-s {rate}	Set IMU sample rate in HZ (default 100)\n");
+	printf("		Sample rate must be a divisor of 200\n");
+	printf("-m		Enable Magnetometer\n");
+	printf("-i		Don't publish the IMU or encoders\n");
+	printf("-d		Don't publish DSM frames\n");
+	printf("-e		Don't publish encoders\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+int main(int argc, char *argv[]){
+	int c, sources;
+	imu_config_t conf = get_default_imu_config();
+
+	sources = HUB_SOURCE_IMU | HUB_SOURCE_DSM | HUB_SOURCE_ENCODERS;
+	opterr = 0;
+	while ((c = getopt(argc, argv, "s:midech")) != -1){
+		switch (c){
+		case 's':
+			conf.dmp_sample_rate = atoi(optarg);
+			break;
+		case 'm':
+			conf.enable_magnetometer = 1;
+			break;
+		case 'i':
+			sources &= ~(HUB_SOURCE_IMU | HUB_SOURCE_ENCODERS);
+			break;
+		case 'd':
+			sources &= ~HUB_SOURCE_DSM;
+			break;
+		case 'e':
+			sources &= ~HUB_SOURCE_ENCODERS;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return -1;
+		}
+	}
+
+	if(initialize_cape()<0){
+		printf("ERROR: failed to initialize cape\n");
+		return -1;
+	}
+	if((sources & HUB_SOURCE_IMU) && initialize_imu_dmp(&data, conf)){
+		printf("ERROR: can't talk to IMU\n");
+		cleanup_cape();
+		return -1;
+	}
+	if((sources & HUB_SOURCE_DSM) && initialize_dsm()){
+		printf("WARNING: dsm not initialized, continuing without it\n");
+		sources &= ~HUB_SOURCE_DSM;
+	}
+	if(start_sensor_hub_server(sources)<0){
+		power_off_imu();
+		cleanup_cape();
+		return -1;
+	}
+
+	// every sample is published from the imu and dsm threads
+	set_state(RUNNING);
+	while(get_state()!=EXITING) usleep(200000);
+
+	stop_sensor_hub_server();
+	if(sources & HUB_SOURCE_IMU) power_off_imu();
+	cleanup_cape();
+	return 0;
+}